@@ -0,0 +1,154 @@
+#include "models.hpp"
+
+#include "KPM.hpp"
+#include "kpm/calc_moments.hpp"
+
+using namespace cpb;
+
+namespace {
+
+using Reorder = kpm::MatrixConfig::Reorder;
+using Format = kpm::MatrixConfig::Format;
+
+constexpr auto num_moments = 258; // `(n - 2) % 4 == 0` as required by the interleaved loop
+
+/// The KPM-ready Hamiltonian of a `bench::make_model()` targeting the site closest to the center
+template<class scalar_t>
+struct OptimizedModel {
+    Model model;
+    SparseMatrixX<scalar_t> const& h;
+    kpm::Scale<num::get_real_t<scalar_t>> scale;
+    int index;
+    kpm::OptimizedHamiltonian<scalar_t> oh;
+
+    OptimizedModel(int size, kpm::MatrixConfig config)
+        : model(bench::make_model<scalar_t>(size)),
+          h(ham::get_reference<scalar_t>(model.hamiltonian())),
+          scale(kpm::Bounds<scalar_t>(&h, kpm::Config{}.lanczos_precision).scaling_factors()),
+          index(model.system()->find_nearest({0, 0, 0})),
+          oh(&h, config) {
+        oh.optimize_for({index, index}, scale);
+    }
+};
+
+template<class scalar_t, class Matrix>
+void run_spmv(benchmark::State& state, Matrix const& matrix) {
+    auto const x = VectorX<scalar_t>::Random(matrix.rows()).eval();
+    auto y = VectorX<scalar_t>::Random(matrix.rows()).eval();
+    while (state.KeepRunning()) {
+        compute::kpm_spmv(0, matrix.rows(), matrix, x, y);
+        benchmark::DoNotOptimize(y.data());
+    }
+    state.SetItemsProcessed(state.iterations() * matrix.nonZeros());
+}
+
+template<class scalar_t>
+void kpm_spmv_csr(benchmark::State& state) {
+    OptimizedModel<scalar_t> const m(state.range(0), {Reorder::OFF, Format::CSR});
+#ifdef CPB_USE_MKL
+    state.SetLabel("mkl");
+#endif
+    run_spmv<scalar_t>(state, m.oh.csr());
+}
+
+template<class scalar_t>
+void kpm_spmv_ell(benchmark::State& state) {
+    OptimizedModel<scalar_t> const m(state.range(0), {Reorder::OFF, Format::ELL});
+    run_spmv<scalar_t>(state, m.oh.ell());
+}
+
+template<class scalar_t>
+void kpm_spmv_sell(benchmark::State& state) {
+    OptimizedModel<scalar_t> const m(state.range(0), {Reorder::ON, Format::SELL});
+    run_spmv<scalar_t>(state, m.oh.sell());
+}
+
+/// Diagonal moments of a single site: `items_per_second` are the mul + add operations
+template<class scalar_t>
+void calc_moments_basic(benchmark::State& state) {
+    OptimizedModel<scalar_t> const m(state.range(0), {Reorder::OFF, Format::CSR});
+    while (state.KeepRunning()) {
+        auto moments = kpm::ExvalDiagonalMoments<scalar_t>(num_moments, m.oh.idx().row);
+        kpm::calc_moments::diagonal::basic(moments, m.oh.csr());
+        benchmark::DoNotOptimize(moments.get().data());
+    }
+    state.SetItemsProcessed(state.iterations() * m.oh.operations(num_moments));
+}
+
+template<class scalar_t>
+void calc_moments_opt_size(benchmark::State& state) {
+    OptimizedModel<scalar_t> const m(state.range(0), {Reorder::ON, Format::ELL});
+    while (state.KeepRunning()) {
+        auto moments = kpm::ExvalDiagonalMoments<scalar_t>(num_moments, m.oh.idx().row);
+        kpm::calc_moments::diagonal::opt_size(moments, m.oh.ell(), m.oh.sizes());
+        benchmark::DoNotOptimize(moments.get().data());
+    }
+    state.SetItemsProcessed(state.iterations() * m.oh.operations(num_moments));
+}
+
+template<class scalar_t>
+void calc_moments_interleaved(benchmark::State& state) {
+    OptimizedModel<scalar_t> const m(state.range(0), {Reorder::ON, Format::ELL});
+    while (state.KeepRunning()) {
+        auto moments = kpm::ExvalDiagonalMoments<scalar_t>(num_moments, m.oh.idx().row);
+        kpm::calc_moments::diagonal::opt_size_and_interleaved(moments, m.oh.ell(),
+                                                              m.oh.sizes());
+        benchmark::DoNotOptimize(moments.get().data());
+    }
+    state.SetItemsProcessed(state.iterations() * m.oh.operations(num_moments));
+}
+
+/// Four KPM iterations per pass over the matrix, see `calc_moments_interleaved`
+template<class scalar_t>
+void calc_moments_wavefront(benchmark::State& state) {
+    OptimizedModel<scalar_t> const m(state.range(0), {Reorder::ON, Format::ELL});
+    while (state.KeepRunning()) {
+        auto moments = kpm::ExvalDiagonalMoments<scalar_t>(num_moments, m.oh.idx().row);
+        kpm::calc_moments::diagonal::opt_size_and_interleaved(moments, m.oh.ell(),
+                                                              m.oh.sizes(), /*depth*/4);
+        benchmark::DoNotOptimize(moments.get().data());
+    }
+    state.SetItemsProcessed(state.iterations() * m.oh.operations(num_moments));
+}
+
+/// A new reordering and format conversion every time: the cache is bypassed
+template<class scalar_t>
+void optimize_for(benchmark::State& state, kpm::MatrixConfig config) {
+    OptimizedModel<scalar_t> const m(state.range(0), config);
+    while (state.KeepRunning()) {
+        auto oh = kpm::OptimizedHamiltonian<scalar_t>(&m.h, config);
+        oh.optimize_for({m.index, m.index}, m.scale);
+        benchmark::DoNotOptimize(oh.sizes().get_data().data());
+    }
+    state.SetItemsProcessed(state.iterations() * m.h.nonZeros());
+}
+
+template<class scalar_t>
+void optimize_for_csr(benchmark::State& state) {
+    optimize_for<scalar_t>(state, {Reorder::ON, Format::CSR});
+}
+
+template<class scalar_t>
+void optimize_for_ell(benchmark::State& state) {
+    optimize_for<scalar_t>(state, {Reorder::ON, Format::ELL});
+}
+
+template<class scalar_t>
+void optimize_for_sell(benchmark::State& state) {
+    optimize_for<scalar_t>(state, {Reorder::ON, Format::SELL});
+}
+
+} // anonymous namespace
+
+CPB_BENCHMARK_SCALARS(kpm_spmv_csr);
+CPB_BENCHMARK_SCALARS(kpm_spmv_ell);
+CPB_BENCHMARK_SCALARS(kpm_spmv_sell);
+
+CPB_BENCHMARK_SCALARS(calc_moments_basic);
+CPB_BENCHMARK_SCALARS(calc_moments_opt_size);
+CPB_BENCHMARK_SCALARS(calc_moments_interleaved);
+CPB_BENCHMARK_SCALARS(calc_moments_wavefront);
+
+CPB_BENCHMARK_SCALARS(optimize_for_csr);
+CPB_BENCHMARK_SCALARS(optimize_for_ell);
+CPB_BENCHMARK_SCALARS(optimize_for_sell);
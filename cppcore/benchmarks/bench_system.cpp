@@ -0,0 +1,62 @@
+#include "models.hpp"
+
+#include "system/Foundation.hpp"
+
+using namespace cpb;
+
+namespace {
+
+/// Size (nm) x number of threads
+void foundation_args(benchmark::internal::Benchmark* b) {
+    for (auto size : {10, 30, 100}) {
+        for (auto num_threads : {1, 4}) {
+            b->Args({size, num_threads});
+        }
+    }
+    b->Unit(benchmark::kMicrosecond)->UseRealTime();
+}
+
+void foundation(benchmark::State& state) {
+    auto const lattice = graphene::monolayer();
+    auto const size = static_cast<float>(state.range(0));
+    auto const rectangle = shape::rectangle(size, size);
+    auto num_sites = 0;
+    while (state.KeepRunning()) {
+        Foundation const foundation(lattice, rectangle, state.range(1));
+        num_sites = foundation.get_num_sites();
+        benchmark::DoNotOptimize(foundation.get_positions().x.data());
+    }
+    state.SetItemsProcessed(state.iterations() * num_sites);
+}
+
+void foundation_tiled(benchmark::State& state) {
+    auto const lattice = graphene::monolayer();
+    auto const size = static_cast<float>(state.range(0));
+    auto const rectangle = shape::rectangle(size, size);
+    auto num_sites = 0;
+    while (state.KeepRunning()) {
+        Foundation const foundation(lattice, rectangle, state.range(1), /*tile_size*/16);
+        num_sites = foundation.get_num_sites();
+        benchmark::DoNotOptimize(foundation.get_positions().x.data());
+    }
+    state.SetItemsProcessed(state.iterations() * num_sites);
+}
+
+/// The complete model build: foundation, system and Hamiltonian matrix
+template<class scalar_t>
+void build_hamiltonian(benchmark::State& state) {
+    auto num_sites = 0;
+    while (state.KeepRunning()) {
+        auto const model = bench::make_model<scalar_t>(state.range(0));
+        auto const& h = ham::get_reference<scalar_t>(model.hamiltonian());
+        num_sites = static_cast<int>(h.rows());
+        benchmark::DoNotOptimize(h.valuePtr());
+    }
+    state.SetItemsProcessed(state.iterations() * num_sites);
+}
+
+} // anonymous namespace
+
+BENCHMARK(foundation)->Apply(foundation_args);
+BENCHMARK(foundation_tiled)->Apply(foundation_args);
+CPB_BENCHMARK_SCALARS(build_hamiltonian);
@@ -0,0 +1,39 @@
+#pragma once
+#include "fixtures.hpp"
+
+#include "numeric/traits.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <type_traits>
+
+namespace bench {
+
+/// Graphene rectangles of `size x size` nm: roughly 4k, 35k and 380k sites
+inline void lattice_sizes(benchmark::internal::Benchmark* b) {
+    b->Arg(10)->Arg(30)->Arg(100)->Unit(benchmark::kMicrosecond);
+}
+
+/// A deterministic model with a Hamiltonian of the given scalar type
+template<class scalar_t>
+cpb::Model make_model(int size) {
+    auto model = cpb::Model(graphene::monolayer(),
+                            shape::rectangle(static_cast<float>(size), static_cast<float>(size)),
+                            field::constant_potential(1));
+    if (std::is_same<cpb::num::get_real_t<scalar_t>, double>::value) {
+        model.add(field::force_double_precision());
+    }
+    if (cpb::num::is_complex<scalar_t>()) {
+        model.add(field::force_complex_numbers());
+    }
+    return model;
+}
+
+} // namespace bench
+
+/// Register a benchmark for all 4 scalar types over `bench::lattice_sizes()`
+#define CPB_BENCHMARK_SCALARS(fn)                                                    \
+    BENCHMARK_TEMPLATE(fn, float)->Apply(bench::lattice_sizes);                      \
+    BENCHMARK_TEMPLATE(fn, std::complex<float>)->Apply(bench::lattice_sizes);        \
+    BENCHMARK_TEMPLATE(fn, double)->Apply(bench::lattice_sizes);                     \
+    BENCHMARK_TEMPLATE(fn, std::complex<double>)->Apply(bench::lattice_sizes)
@@ -4,6 +4,13 @@
 #include "cuda/thrust.hpp"
 #include <thrust/device_vector.h>
 #include <thrust/inner_product.h>
+#include <thrust/transform_reduce.h>
+
+#include <algorithm>
+#include <cassert>
+#include <list>
+#include <stdexcept>
+#include <string>
 
 namespace cpb { namespace cuda {
 
@@ -45,6 +52,25 @@ struct Mulc {
     }
 };
 
+/**
+ Return the real or imaginary part of a real or complex number
+ */
+struct RealPart {
+    template<class real_t> __host__ __device__
+    real_t operator()(real_t a) const { return a; }
+
+    template<class real_t> __host__ __device__
+    real_t operator()(thr::complex<real_t> a) const { return a.real(); }
+};
+
+struct ImagPart {
+    template<class real_t> __host__ __device__
+    real_t operator()(real_t) const { return real_t{0}; }
+
+    template<class real_t> __host__ __device__
+    real_t operator()(thr::complex<real_t> a) const { return a.imag(); }
+};
+
 /**
  Complex dot product of two vectors
  */
@@ -56,95 +82,359 @@ thr_scalar_t dotc(int start, int end, thr::device_vector<thr_scalar_t> const& x,
 }
 
 /**
- ELLPACK matrix stored in GPU memory
+ Throw if a Cuda runtime call failed
+ */
+inline void check(cudaError_t status) {
+    if (status != cudaSuccess) {
+        throw std::runtime_error(std::string("CUDA error: ") + cudaGetErrorString(status));
+    }
+}
+
+/**
+ Uninitialized GPU memory
+
+ Unlike thrust vectors, it's never initialized by a kernel on the default stream which
+ could race with an asynchronous copy on a different stream.
+ */
+class DeviceBuffer {
+public:
+    explicit DeviceBuffer(std::size_t bytes) { check(cudaMalloc(&ptr, bytes)); }
+    ~DeviceBuffer() { cudaFree(ptr); }
+
+    DeviceBuffer(DeviceBuffer const&) = delete;
+    DeviceBuffer& operator=(DeviceBuffer const&) = delete;
+
+    void* get() const { return ptr; }
+
+private:
+    void* ptr = nullptr;
+};
+
+/**
+ Page-locked host memory: required for copies which don't block the host
+ */
+class PinnedBuffer {
+public:
+    explicit PinnedBuffer(std::size_t bytes) : bytes(bytes) {
+        check(cudaMallocHost(&ptr, bytes));
+    }
+    ~PinnedBuffer() { cudaFreeHost(ptr); }
+
+    PinnedBuffer(PinnedBuffer const&) = delete;
+    PinnedBuffer& operator=(PinnedBuffer const&) = delete;
+
+    char* get() const { return static_cast<char*>(ptr); }
+    std::size_t size() const { return bytes; }
+
+private:
+    void* ptr = nullptr;
+    std::size_t bytes;
+};
+
+/**
+ Cuda event, recorded when an upload is complete
+ */
+class Event {
+public:
+    Event() { check(cudaEventCreateWithFlags(&event, cudaEventDisableTiming)); }
+    ~Event() { cudaEventDestroy(event); }
+
+    Event(Event const&) = delete;
+    Event& operator=(Event const&) = delete;
+
+    cudaEvent_t get() const { return event; }
+
+private:
+    cudaEvent_t event;
+};
+
+/**
+ ELLPACK matrix resident in GPU memory, the data is scalar type agnostic
+ */
+struct DeviceEll {
+    static constexpr auto align_bytes = 256;
+
+    std::uint64_t id;
+    int rows, nnz_per_row, pitch;
+    DeviceBuffer data;
+    DeviceBuffer indices;
+    Event ready; ///< the upload is complete
+
+    DeviceEll(std::uint64_t id, int rows, int nnz_per_row, int pitch, std::size_t scalar_size)
+        : id(id), rows(rows), nnz_per_row(nnz_per_row), pitch(pitch),
+          data(std::size_t{1} * pitch * nnz_per_row * scalar_size),
+          indices(std::size_t{1} * pitch * nnz_per_row * sizeof(int)) {}
+};
+
+struct DeviceCache::Impl {
+    int device;
+    int capacity;
+    cudaStream_t stream; ///< uploads only, compute stays on the default stream
+    std::unique_ptr<PinnedBuffer> staging;
+    std::unique_ptr<Event> staging_free; ///< the last upload from `staging` is complete
+    std::list<std::unique_ptr<DeviceEll>> entries; ///< most recently used first
+
+    explicit Impl(int capacity) : capacity(capacity) {
+        check(cudaGetDevice(&device));
+        check(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+        staging_free.reset(new Event());
+    }
+
+    ~Impl() {
+        // The memory, events and stream must be released on the GPU which owns them
+        auto current = 0;
+        cudaGetDevice(&current);
+        cudaSetDevice(device);
+
+        cudaStreamSynchronize(stream);
+        cudaStreamDestroy(stream);
+        entries.clear();
+        staging.reset();
+        staging_free.reset();
+        cudaSetDevice(current);
+    }
+
+    /// Return the cached matrix or start uploading a new one
+    template<class scalar_t>
+    DeviceEll const& get(std::uint64_t id, num::EllConstRef<scalar_t> const& ell) {
+        auto const it = std::find_if(entries.begin(), entries.end(),
+                                     [&](std::unique_ptr<DeviceEll> const& e) {
+                                         return e->id == id;
+                                     });
+        if (it != entries.end()) {
+            entries.splice(entries.begin(), entries, it);
+            return *entries.front();
+        }
+
+        while (static_cast<int>(entries.size()) >= capacity) {
+            entries.pop_back(); // `cudaFree` waits for any kernels which are still using it
+        }
+
+        using thr_scalar_t = num::get_thrust_t<scalar_t>;
+        auto const pitch = num::aligned_size<thr_scalar_t, DeviceEll::align_bytes>(ell.rows);
+        entries.emplace_front(new DeviceEll(id, ell.rows, ell.nnz_per_row, pitch,
+                                            sizeof(scalar_t)));
+        auto& entry = *entries.front();
+
+        // Lay out the data with the GPU pitch in the staging buffer
+        auto const data_bytes = std::size_t{1} * pitch * ell.nnz_per_row * sizeof(scalar_t);
+        auto const indices_bytes = std::size_t{1} * pitch * ell.nnz_per_row * sizeof(int);
+        check(cudaEventSynchronize(staging_free->get())); // the previous upload is done
+        if (!staging || staging->size() < data_bytes + indices_bytes) {
+            staging.reset(new PinnedBuffer(data_bytes + indices_bytes));
+        }
+
+        auto const staged_data = reinterpret_cast<scalar_t*>(staging->get());
+        auto const staged_indices = reinterpret_cast<int*>(staging->get() + data_bytes);
+        for (auto n = 0; n < ell.nnz_per_row; ++n) {
+            std::copy_n(ell.data() + n * ell.pitch, ell.rows, staged_data + n * pitch);
+            std::copy_n(ell.indices + n * ell.pitch, ell.rows, staged_indices + n * pitch);
+        }
+
+        check(cudaMemcpyAsync(entry.data.get(), staged_data, data_bytes,
+                              cudaMemcpyHostToDevice, stream));
+        check(cudaMemcpyAsync(entry.indices.get(), staged_indices, indices_bytes,
+                              cudaMemcpyHostToDevice, stream));
+        check(cudaEventRecord(entry.ready.get(), stream));
+        check(cudaEventRecord(staging_free->get(), stream));
+        return entry;
+    }
+};
+
+int num_devices() {
+    auto count = 0;
+    check(cudaGetDeviceCount(&count));
+    return count;
+}
+
+int get_device() {
+    auto device = 0;
+    check(cudaGetDevice(&device));
+    return device;
+}
+
+void set_device(int device) {
+    check(cudaSetDevice(device));
+}
+
+DeviceCache::DeviceCache(int capacity) : impl(new Impl(capacity)) {}
+
+DeviceCache::~DeviceCache() = default;
+
+int DeviceCache::size() const { return static_cast<int>(impl->entries.size()); }
+
+/**
+ Typed view of an ELLPACK matrix in GPU memory
  */
 template<class scalar_t, class index_t = int,
          class thr_scalar_t = num::get_thrust_t<scalar_t>>
 class EllMatrix {
-    static constexpr auto align_bytes = 256;
-
-    index_t _rows, _cols, _nnz_per_row, _pitch;
-    thr::device_vector<thr_scalar_t> _data;
-    thr::device_vector<index_t> _indices;
+    DeviceEll const& ell;
 
 public:
     using Scalar = scalar_t;
     using ThrustScalar = thr_scalar_t;
     using Index = index_t;
-    
-    EllMatrix(num::EllConstRef<scalar_t> ref)
-        : _rows(ref.rows), _cols(ref.cols), _nnz_per_row(ref.nnz_per_row),
-          _pitch(num::aligned_size<thr_scalar_t, align_bytes>(ref.rows)) {        
-        _data.resize(nnz());
-        _indices.resize(nnz());        
-        auto const ref_data = static_cast<thr_scalar_t const*>(ref.void_data);
-        for (auto n = 0; n < ref.nnz_per_row; ++n) {
-            thr::copy(ref_data + n * ref.pitch, ref_data + (n + 1) * ref.pitch,
-                      _data.begin() + n * _pitch);
-            thr::copy(ref.indices + n * ref.pitch, ref.indices + (n + 1) * ref.pitch,
-                      _indices.begin() + n * _pitch);
-        }
+
+    /// The compute kernels on the default stream will wait for the upload to complete
+    explicit EllMatrix(DeviceEll const& ell) : ell(ell) {
+        check(cudaStreamWaitEvent(0, ell.ready.get(), 0));
     }
-    
-    index_t rows() const { return _rows; }
-    index_t cols() const { return _cols; }
-    index_t nnz_per_row() const { return _nnz_per_row; }
-    index_t pitch() const { return _pitch; }
-    index_t nnz() const { return _pitch * _nnz_per_row; }
-    
-    thr_scalar_t const* data() const { return thr::raw_pointer_cast(_data.data()); }
-    index_t const* indices() const { return thr::raw_pointer_cast(_indices.data()); }
+
+    index_t rows() const { return ell.rows; }
+    index_t nnz_per_row() const { return ell.nnz_per_row; }
+    index_t pitch() const { return ell.pitch; }
+
+    thr_scalar_t const* data() const { return static_cast<thr_scalar_t const*>(ell.data.get()); }
+    index_t const* indices() const { return static_cast<index_t const*>(ell.indices.get()); }
 };
 
 /**
- Return the KPM r0 vector with all zeros except for the source index
+ Combine real and imaginary parts into a real or complex host scalar
  */
-template<class Matrix, class thr_scalar_t = typename Matrix::ThrustScalar>
-thr::device_vector<thr_scalar_t> make_r0(Matrix const& h2, int i) {
-    auto r0 = thr::device_vector<thr_scalar_t>(h2.rows(), thr_scalar_t{0});
-    r0[i] = thr_scalar_t{1};
-    return r0;
-}
+template<class scalar_t>
+struct FromParts {
+    template<class real_t>
+    static scalar_t get(real_t real, real_t /*imag*/) { return real; }
+};
+
+template<class real_t>
+struct FromParts<std::complex<real_t>> {
+    static std::complex<real_t> get(real_t real, real_t imag) { return {real, imag}; }
+};
 
 /**
- Return the KPM r1 vector which is equal to the Hamiltonian matrix column at the source index
+ Copy a host vector to GPU memory
  */
 template<class scalar_t, class thr_scalar_t = num::get_thrust_t<scalar_t>>
-thr::device_vector<thr_scalar_t> make_r1(num::EllConstRef<scalar_t> const& h2, int i) {
-    auto r1 = thr::host_vector<thr_scalar_t>(h2.rows, thr_scalar_t{0});
-    for (auto n = 0; n < h2.nnz_per_row; ++n) {
-        auto const col = h2.indices[i + n * h2.pitch];
-        auto const value = h2.data()[i + n * h2.pitch];
-        r1[col] = num::conjugate(value) * scalar_t{0.5};
+thr::device_vector<thr_scalar_t> to_device(scalar_t const* data, int size) {
+    auto const begin = reinterpret_cast<thr_scalar_t const*>(data);
+    return thr::device_vector<thr_scalar_t>(begin, begin + size);
+}
+
+/**
+ Copy a GPU vector back to host memory
+ */
+template<class scalar_t, class thr_scalar_t>
+void to_host(thr::device_vector<thr_scalar_t> const& v, scalar_t* data) {
+    thr::copy(v.begin(), v.end(), reinterpret_cast<thr_scalar_t*>(data));
+}
+
+/**
+ Sum the `value` of each thread in the block, the result is returned to all threads
+
+ The `block_size` must be a power of 2.
+ */
+template<int block_size, class real_t>
+__device__ real_t block_sum(real_t value, real_t* shared) {
+    auto const tid = static_cast<int>(threadIdx.x);
+    shared[tid] = value;
+    __syncthreads();
+
+    for (auto stride = block_size / 2; stride > 0; stride /= 2) {
+        if (tid < stride) {
+            shared[tid] += shared[tid + stride];
+        }
+        __syncthreads();
     }
-    return r1;
+
+    auto const sum = shared[0];
+    __syncthreads(); // before `shared` is reused
+    return sum;
 }
 
 /**
  GPU function component of the KPM compute kernel for ELLPACK matrix
 
- Equivalent to: y = matrix * x - y
+ Equivalent to: y = matrix * x - y for a block of `num_vectors` row-major vectors.
+ The x-dimension of the grid goes over the rows and the y-dimension over the vectors.
+
+ If `partial` isn't null, the dot products `|x|^2` and `dot(y, x)` are accumulated at the
+ same time, while the vector elements are still in registers. Each thread block writes
+ 3 partial sums per vector: `|x|^2` and the real and imaginary parts of `dot(y, x)`.
  */
-template<class index_t, class thr_scalar_t>
+template<int block_size, class index_t, class thr_scalar_t, class real_t>
 __global__ void kpm_kernel_device(index_t num_rows, index_t nnz_per_row, index_t pitch,
-                                  thr_scalar_t const* data, index_t const* indices,
-                                  thr_scalar_t const* x, thr_scalar_t* y) {
-    auto const thread_id = blockDim.x * blockIdx.x + threadIdx.x;
-    auto const grid_size = gridDim.x * blockDim.x;
+                                  int num_vectors, thr_scalar_t const* data,
+                                  index_t const* indices, thr_scalar_t const* x,
+                                  thr_scalar_t const* x_rows, thr_scalar_t* y,
+                                  real_t* partial) {
+    auto const vector = static_cast<int>(blockIdx.y);
+    auto const thread_id = static_cast<index_t>(blockDim.x * blockIdx.x + threadIdx.x);
+    auto const grid_size = static_cast<index_t>(gridDim.x * blockDim.x);
 
-    for(auto row = thread_id; row < num_rows; row += grid_size) {
-        auto sum = -y[row];
+    auto m2 = real_t{0}, m3_real = real_t{0}, m3_imag = real_t{0};
+    for (auto row = thread_id; row < num_rows; row += grid_size) {
+        auto const i = row * num_vectors + vector;
+        auto sum = -y[i];
 
         auto idx = row;
-        for(auto n = 0; n < nnz_per_row; ++n) {
+        for (auto n = 0; n < nnz_per_row; ++n) {
             auto const col = indices[idx];
             auto const value = data[idx];
-            sum += value * x[col];
-            
+            sum += value * x[col * num_vectors + vector];
+
             idx += pitch;
         }
-        
-        y[row] = sum;
+
+        y[i] = sum;
+
+        if (partial) {
+            auto const xi = x_rows[i];
+            auto const product = Mulc()(sum, xi);
+            m2 += Square()(xi);
+            m3_real += RealPart()(product);
+            m3_imag += ImagPart()(product);
+        }
+    }
+
+    if (partial) {
+        __shared__ real_t shared[block_size];
+        m2 = block_sum<block_size>(m2, shared);
+        m3_real = block_sum<block_size>(m3_real, shared);
+        m3_imag = block_sum<block_size>(m3_imag, shared);
+
+        if (threadIdx.x == 0) {
+            auto const p = 3 * (vector * gridDim.x + blockIdx.x);
+            partial[p] = m2;
+            partial[p + 1] = m3_real;
+            partial[p + 2] = m3_imag;
+        }
+    }
+}
+
+/**
+ Sum the partial results of the `num_blocks` thread blocks of `kpm_kernel_device`
+
+ Launched with one thread block per vector.
+ */
+template<int block_size, class real_t>
+__global__ void reduce_partial_device(int num_blocks, real_t const* partial, real_t* result) {
+    __shared__ real_t shared[block_size];
+    auto const vector = static_cast<int>(blockIdx.x);
+
+    for (auto k = 0; k < 3; ++k) {
+        auto sum = real_t{0};
+        for (auto b = static_cast<int>(threadIdx.x); b < num_blocks; b += block_size) {
+            sum += partial[3 * (vector * num_blocks + b) + k];
+        }
+
+        sum = block_sum<block_size>(sum, shared);
+        if (threadIdx.x == 0) {
+            result[3 * vector + k] = sum;
+        }
+    }
+}
+
+/**
+ Copy the `cols` elements of `x` to `result`
+ */
+template<class thr_scalar_t>
+__global__ void gather_device(int num_cols, int const* cols, thr_scalar_t const* x,
+                              thr_scalar_t* result) {
+    auto const i = static_cast<int>(blockDim.x * blockIdx.x + threadIdx.x);
+    if (i < num_cols) {
+        result[i] = x[cols[i]];
     }
 }
 
@@ -155,87 +445,158 @@ constexpr int required_num_blocks(int size, int block_size) noexcept {
     return (size + (block_size - 1)) / block_size;
 }
 
-/**
- KPM compute kernel for ELLPACK matrix
+constexpr auto block_size = 256;
+/// The threads loop over the remaining rows of larger systems. This also limits
+/// the number of partial dot products which need to be reduced per iteration.
+constexpr auto max_num_blocks = 1024;
 
- Equivalent to: y = matrix * x - y
+/**
+ Launch `kpm_kernel_device` and return the number of thread blocks per vector
  */
-template<class scalar_t, class thr_scalar_t> CPB_ALWAYS_INLINE
-void kpm_kernel(int start, int end, EllMatrix<scalar_t> const& ell,
-                thr::device_vector<thr_scalar_t> const& x,
-                thr::device_vector<thr_scalar_t>& y) {
+template<class scalar_t, class thr_scalar_t, class real_t>
+int launch_kpm_kernel(int start, int end, EllMatrix<scalar_t> const& ell, int num_vectors,
+                      thr::device_vector<thr_scalar_t> const& x,
+                      thr::device_vector<thr_scalar_t>& y, real_t* partial) {
     auto const size = end - start;
     if (size <= 0) {
-        return;
+        return 0;
     }
 
-    static constexpr auto block_size = 256;
-    auto const num_blocks = required_num_blocks(size, block_size);
-    
-    kpm_kernel_device<<<num_blocks, block_size>>>(
-        size, ell.nnz_per_row(), ell.pitch(), 
+    auto const num_blocks = std::min(required_num_blocks(size, block_size), max_num_blocks);
+    auto const grid = dim3(num_blocks, num_vectors);
+
+    kpm_kernel_device<block_size><<<grid, block_size>>>(
+        size, ell.nnz_per_row(), ell.pitch(), num_vectors,
         ell.data() + start,
         ell.indices() + start,
         thr::raw_pointer_cast(x.data()),
-        thr::raw_pointer_cast(y.data()) + start
+        thr::raw_pointer_cast(x.data()) + start * num_vectors,
+        thr::raw_pointer_cast(y.data()) + start * num_vectors,
+        partial
     );
+    return num_blocks;
+}
+
+/**
+ KPM compute kernel for ELLPACK matrix
+
+ Equivalent to: y = matrix * x - y
+ */
+template<class scalar_t, class thr_scalar_t> CPB_ALWAYS_INLINE
+void kpm_kernel(int start, int end, EllMatrix<scalar_t> const& ell, int num_vectors,
+                thr::device_vector<thr_scalar_t> const& x,
+                thr::device_vector<thr_scalar_t>& y) {
+    using real_t = num::get_real_t<thr_scalar_t>;
+    launch_kpm_kernel(start, end, ell, num_vectors, x, y, static_cast<real_t*>(nullptr));
+}
+
+/**
+ KPM compute kernel for ELLPACK matrix with the diagonal dot products
+
+ Equivalent to: y = matrix * x - y, and `result` = [|x|^2, dot(y, x)] for each vector
+ (the real and imaginary parts of the second one are stored separately). The `partial`
+ buffer needs room for `3 * max_num_blocks * num_vectors` values.
+ */
+template<class scalar_t, class thr_scalar_t, class real_t> CPB_ALWAYS_INLINE
+void kpm_kernel_diagonal(int start, int end, EllMatrix<scalar_t> const& ell, int num_vectors,
+                         thr::device_vector<thr_scalar_t> const& x,
+                         thr::device_vector<thr_scalar_t>& y,
+                         thr::device_vector<real_t>& partial, real_t* result) {
+    auto const partial_data = thr::raw_pointer_cast(partial.data());
+    auto const num_blocks = launch_kpm_kernel(start, end, ell, num_vectors, x, y, partial_data);
+    if (num_blocks > 0) {
+        reduce_partial_device<block_size><<<num_vectors, block_size>>>(
+            num_blocks, partial_data, result
+        );
+    }
 }
 
 template<class scalar_t>
-thr::host_vector<scalar_t> 
-I<scalar_t>::calc_diag_moments0(num::EllConstRef<scalar_t> ellref, int i, int num_moments) {
-    auto const h2 = EllMatrix<scalar_t>(ellref);    
-    auto r0 = make_r0(h2, i);
-    auto r1 = make_r1(ellref, i);
+void I<scalar_t>::upload(DeviceCache& cache, std::uint64_t id, num::EllConstRef<scalar_t> ell) {
+    cache.impl->get(id, ell);
+}
 
-    using thr_scalar_t = num::get_thrust_t<scalar_t>;
-    auto const m0 = static_cast<thr_scalar_t>(r0[i]) * real_t{0.5};
-    auto const m1 = static_cast<thr_scalar_t>(r1[i]);
-
-    auto moments = thr::host_vector<scalar_t>(num_moments);
-    moments[0] = m0;
-    moments[1] = m1;
-    
-    auto const size = h2.rows();
-    assert(num_moments % 2 == 0);
-    for (auto n = 2; n <= num_moments / 2; ++n) {
-        cuda::kpm_kernel(0, size, h2, r1, r0);
-        r1.swap(r0);
-        
-        moments[2 * (n - 1)] = real_t{2} * (squared_norm(0, size, r0) - m0);       
-        moments[2 * (n - 1) + 1] = real_t{2} * dotc(0, size, r0, r1) - m1;
+template<class scalar_t>
+thr::host_vector<scalar_t>
+I<scalar_t>::diagonal(DeviceCache& cache, std::uint64_t id, num::EllConstRef<scalar_t> ellref,
+                      std::vector<int> const& sizes, scalar_t* r0_data, scalar_t* r1_data,
+                      int num_vectors, bool fused) {
+    assert(fused || num_vectors == 1);
+    auto const h2 = EllMatrix<scalar_t>(cache.impl->get(id, ellref));
+    auto r0 = to_device(r0_data, h2.rows() * num_vectors);
+    auto r1 = to_device(r1_data, h2.rows() * num_vectors);
+
+    auto const num_iterations = static_cast<int>(sizes.size());
+    auto const results_size = 3 * num_vectors * num_iterations;
+    auto results = thr::host_vector<real_t>(results_size, real_t{0});
+
+    if (fused) {
+        auto partial = thr::device_vector<real_t>(3 * max_num_blocks * num_vectors);
+        auto device_results = thr::device_vector<real_t>(results_size, real_t{0});
+        auto const results_data = thr::raw_pointer_cast(device_results.data());
+
+        // Nothing here waits for the GPU: the kernels of all iterations are queued at once
+        for (auto k = 0; k < num_iterations; ++k) {
+            kpm_kernel_diagonal(0, sizes[k], h2, num_vectors, r1, r0, partial,
+                                results_data + 3 * num_vectors * k);
+            r1.swap(r0);
+        }
+        results = device_results;
+    } else {
+        for (auto k = 0; k < num_iterations; ++k) {
+            auto const size = sizes[k];
+            kpm_kernel(0, size, h2, 1, r1, r0);
+            r1.swap(r0);
+
+            auto const m3 = dotc(0, size, r1, r0);
+            results[3 * k] = squared_norm(0, size, r0);
+            results[3 * k + 1] = RealPart()(m3);
+            results[3 * k + 2] = ImagPart()(m3);
+        }
+    }
+
+    to_host(r0, r0_data);
+    to_host(r1, r1_data);
+
+    auto moments = thr::host_vector<scalar_t>(2 * num_vectors * num_iterations);
+    for (auto i = 0; i < num_vectors * num_iterations; ++i) {
+        moments[2 * i] = FromParts<scalar_t>::get(results[3 * i], real_t{0});
+        moments[2 * i + 1] = FromParts<scalar_t>::get(results[3 * i + 1], results[3 * i + 2]);
     }
-    
     return moments;
 }
 
 template<class scalar_t>
-thr::host_vector<scalar_t> 
-I<scalar_t>::calc_diag_moments1(num::EllConstRef<scalar_t> ellref, int i, int num_moments,
-                                kpm::OptimizedSizes const& sizes) {
-    auto const h2 = EllMatrix<scalar_t>(ellref);    
-    auto r0 = make_r0(h2, i);
-    auto r1 = make_r1(ellref, i);
+thr::host_vector<scalar_t>
+I<scalar_t>::off_diagonal(DeviceCache& cache, std::uint64_t id,
+                          num::EllConstRef<scalar_t> ellref, std::vector<int> const& sizes,
+                          scalar_t* r0_data, scalar_t* r1_data, int const* cols_data,
+                          int num_cols) {
+    auto const h2 = EllMatrix<scalar_t>(cache.impl->get(id, ellref));
+    auto r0 = to_device(r0_data, h2.rows());
+    auto r1 = to_device(r1_data, h2.rows());
+    auto const cols = thr::device_vector<int>(cols_data, cols_data + num_cols);
 
     using thr_scalar_t = num::get_thrust_t<scalar_t>;
-    auto const m0 = static_cast<thr_scalar_t>(r0[i]) * real_t{0.5};
-    auto const m1 = static_cast<thr_scalar_t>(r1[i]);
-
-    auto moments = thr::host_vector<scalar_t>(num_moments);
-    moments[0] = m0;
-    moments[1] = m1;
+    auto const num_iterations = static_cast<int>(sizes.size());
+    auto values = thr::device_vector<thr_scalar_t>(num_cols * num_iterations);
 
-    assert(num_moments % 2 == 0);
-    for (auto n = 2; n <= num_moments / 2; ++n) {
-        auto const opt_size = sizes.optimal(n, num_moments);
-        cuda::kpm_kernel(0, opt_size, h2, r1, r0);
+    for (auto k = 0; k < num_iterations; ++k) {
+        kpm_kernel(0, sizes[k], h2, 1, r1, r0);
         r1.swap(r0);
-        
-        moments[2 * (n - 1)] = real_t{2} * (squared_norm(0, opt_size, r0) - m0);       
-        moments[2 * (n - 1) + 1] = real_t{2} * dotc(0, opt_size, r0, r1) - m1;
+
+        gather_device<<<required_num_blocks(num_cols, block_size), block_size>>>(
+            num_cols, thr::raw_pointer_cast(cols.data()), thr::raw_pointer_cast(r1.data()),
+            thr::raw_pointer_cast(values.data()) + k * num_cols
+        );
     }
 
-    return moments;
+    to_host(r0, r0_data);
+    to_host(r1, r1_data);
+
+    auto result = thr::host_vector<scalar_t>(values.size());
+    to_host(values, result.data());
+    return result;
 }
 
 CPB_INSTANTIATE_TEMPLATE_CLASS(I)
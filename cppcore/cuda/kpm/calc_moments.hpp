@@ -1,12 +1,49 @@
 #pragma once
-#include "kpm/OptimizedSizes.hpp"
-
 #include "detail/macros.hpp"
 #include "numeric/sparseref.hpp"
 #include "cuda/thrust.hpp"
 
+#include <cstdint>
+#include <memory>
+#include <vector>
+
 namespace cpb { namespace cuda {
 
+template<class scalar_t> class I;
+
+/// Number of GPUs visible to this process (see the `CUDA_VISIBLE_DEVICES` variable)
+int num_devices();
+/// The GPU currently selected by the calling host thread
+int get_device();
+/// Select the GPU used by the calling host thread
+void set_device(int device);
+
+/**
+ ELLPACK matrices kept in GPU memory between KPM calculations
+
+ The matrices are identified by `OptimizedHamiltonian::id()` and the least recently used
+ one is evicted when the `capacity` is exceeded. An upload doesn't block the host: the data
+ is staged in pinned memory and copied on a separate stream while the host continues, e.g.
+ preparing the initial KPM vectors. The compute kernels wait for it on the GPU side only.
+ A cache belongs to the GPU which was selected when it was created.
+ */
+class DeviceCache {
+public:
+    explicit DeviceCache(int capacity = 4);
+    ~DeviceCache();
+
+    DeviceCache(DeviceCache const&) = delete;
+    DeviceCache& operator=(DeviceCache const&) = delete;
+
+    /// Number of matrices currently resident in GPU memory
+    int size() const;
+
+private:
+    template<class scalar_t> friend class I;
+    struct Impl;
+    std::unique_ptr<Impl> impl;
+};
+
 /**
  The Cuda functions must be defined only in nvcc-compiled translation units,
  but the declarations need to be visible to non-Cuda code as well. Since these
@@ -14,28 +51,49 @@ namespace cpb { namespace cuda {
  unit for all relevant scalar types. To help with this, they are all wrapped in
  a template class `I`. This way, a single explicit instantiation of `I` will
  take care of everything. It's a bit weird but it works nicely.
+
+ The initial vectors are prepared on the host by the usual `Moments` classes and
+ the results are collected there as well, so only the main KPM loop runs on the GPU.
+ `sizes` holds the number of matrix rows to compute in each iteration of the loop:
+ the full system or the optimal sizes of a reordered matrix. All the iterations are
+ queued without waiting for the GPU and the results are copied back just once at the end.
+ The matrix is taken from the `cache` and only uploaded if it's not already there.
 */
 template<class scalar_t>
 class I {
     using real_t = num::get_real_t<scalar_t>;
     using complex_t = num::get_complex_t<scalar_t>;
-    
+
 public:
+    /// Start uploading the matrix with the given `id` to the `cache`, if it's not there yet
+    static void upload(DeviceCache& cache, std::uint64_t id, num::EllConstRef<scalar_t> ell);
+
     /**
-     Diagonal KPM moments -- reference implementation, no optimizations
+     Diagonal KPM moments for a block of `num_vectors` independent vectors
 
-     Calculates moments for a single matrix element (i, i) on the main diagonal.
-     It's 1.5x to 2x times faster than the general version.
+     The row-major `r0` and `r1` (`ell.rows` x `num_vectors`) are the initial vectors and
+     they are overwritten with the final ones, e.g. to resume the calculation later.
+     For each iteration and vector, returns the pair `|r0|^2, dot(r1, r0)` which is
+     needed by `Moments::collect()`, laid out as `[iteration][vector][pair]`.
+
+     If `fused`, the dot products are accumulated by the matrix-vector multiplication
+     kernel itself and reduced on the GPU. Otherwise, they are computed by separate
+     reductions which need to read the vectors again (reference implementation).
      */
     static thr::host_vector<scalar_t>
-        calc_diag_moments0(num::EllConstRef<scalar_t> ell, int i, int num_moments);
+        diagonal(DeviceCache& cache, std::uint64_t id, num::EllConstRef<scalar_t> ell,
+                 std::vector<int> const& sizes, scalar_t* r0, scalar_t* r1,
+                 int num_vectors, bool fused);
 
     /**
-     Diagonal KPM moments -- with reordering optimization (optimal system size for each iteration)
+     Off-diagonal KPM moments: the elements of the `r1` vector at the `cols` indices
+
+     Returns the gathered values of each iteration, laid out as `[iteration][col]`.
      */
     static thr::host_vector<scalar_t>
-        calc_diag_moments1(num::EllConstRef<scalar_t> ell, int i, int num_moments,
-                           kpm::OptimizedSizes const& sizes);
+        off_diagonal(DeviceCache& cache, std::uint64_t id, num::EllConstRef<scalar_t> ell,
+                     std::vector<int> const& sizes, scalar_t* r0, scalar_t* r1,
+                     int const* cols, int num_cols);
 };
 
 CPB_EXTERN_TEMPLATE_CLASS(I)
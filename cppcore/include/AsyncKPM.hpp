@@ -0,0 +1,144 @@
+#pragma once
+#include "KPM.hpp"
+#include "utils/TaskPool.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <stdexcept>
+
+namespace cpb {
+
+/// Thrown by `AsyncResult::get()` if the calculation was cancelled before it finished
+class CancelledError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+/**
+ Future result of an `AsyncKPM` calculation
+
+ It may be copied and waited on from any thread. `cancel()` is cooperative: a queued
+ calculation never starts and a running one stops at the next checkpoint, which is right
+ after the Hamiltonian is built. A calculation which was already past the checkpoint
+ still completes normally.
+ */
+template<class T>
+class AsyncResult {
+public:
+    AsyncResult(std::shared_future<T> future, std::shared_ptr<std::atomic<bool>> cancelled)
+        : future(std::move(future)), cancelled(std::move(cancelled)) {}
+
+    /// Wait for the result. Rethrows the calculation's exception or `CancelledError`.
+    T const& get() const { return future.get(); }
+    /// Wait at most `seconds` and return true if the result (or an error) is ready
+    bool wait_for(double seconds) const {
+        auto const timeout = std::chrono::duration<double>(seconds);
+        return future.wait_for(timeout) == std::future_status::ready;
+    }
+    bool is_ready() const { return wait_for(0); }
+
+    /// Request cancellation: see the class description
+    void cancel() { *cancelled = true; }
+    bool is_cancelled() const { return *cancelled; }
+
+private:
+    std::shared_future<T> future;
+    std::shared_ptr<std::atomic<bool>> cancelled;
+};
+
+/**
+ Asynchronous KPM calculations for many independent requests
+
+ Each request runs on a worker of a `TaskPool` with its own copy of the model and its own
+ `KPM` strategy, so the Hamiltonian build, the matrix optimization and the moments of
+ different requests overlap. A model which was already built shares its Hamiltonian with
+ the copies. The pool can be shared by several `AsyncKPM` objects, e.g. with different
+ strategy configurations. Use the `make_async_kpm<Strategy>()` helper to create it.
+
+ The results are returned as `AsyncResult` futures which support cancellation.
+ The model modifiers must be thread-safe, i.e. not call back into Python.
+ */
+class AsyncKPM {
+public:
+    using MakeStrategy = std::function<std::unique_ptr<kpm::Strategy>(Hamiltonian const&)>;
+
+    AsyncKPM(std::shared_ptr<TaskPool> pool, MakeStrategy make_strategy)
+        : pool(std::move(pool)), make_strategy(std::move(make_strategy)) {}
+
+    std::shared_ptr<TaskPool> const& get_pool() const { return pool; }
+    MakeStrategy const& get_make_strategy() const { return make_strategy; }
+
+    /// See `KPM::calc_greens`
+    AsyncResult<ArrayXcd> calc_greens(Model const& model, int row, int col,
+                                      ArrayXd const& energy, double broadening) const;
+    /// See `KPM::calc_ldos`
+    AsyncResult<ArrayXd> calc_ldos(Model const& model, ArrayXd const& energy,
+                                   double broadening, Cartesian position,
+                                   std::string const& sublattice = "") const;
+    /// See `KPM::calc_ldos_vector`
+    AsyncResult<ArrayXXd> calc_ldos_vector(Model const& model, std::vector<int> const& indices,
+                                           ArrayXd const& energy, double broadening) const;
+    /// See `KPM::calc_dos`
+    AsyncResult<ArrayXd> calc_dos(Model const& model, ArrayXd const& energy,
+                                  double broadening, int num_random = 16) const;
+
+private:
+    /// Throws `CancelledError` if the request was cancelled
+    class Checkpoint {
+    public:
+        explicit Checkpoint(std::shared_ptr<std::atomic<bool>> cancelled)
+            : cancelled(std::move(cancelled)) {}
+
+        void operator()() const {
+            if (*cancelled) { throw CancelledError("The KPM calculation was cancelled."); }
+        }
+
+    private:
+        std::shared_ptr<std::atomic<bool>> cancelled;
+    };
+
+    /// Queue `compute(kpm)` on the pool. The KPM is created on the worker thread
+    /// and the Hamiltonian is built there, with checkpoints before and after.
+    template<class T, class Fn>
+    AsyncResult<T> submit(Model const& model, Fn compute) const {
+        auto cancelled = std::make_shared<std::atomic<bool>>(false);
+        auto const checkpoint = Checkpoint(cancelled);
+        auto const make = make_strategy;
+        auto task = std::make_shared<std::packaged_task<T()>>([=]() {
+            checkpoint();
+            KPM kpm(model, make);
+            kpm.get_model().hamiltonian();
+            checkpoint();
+            return compute(kpm);
+        });
+
+        auto result = AsyncResult<T>(task->get_future().share(), std::move(cancelled));
+        pool->submit([task]() { (*task)(); });
+        return result;
+    }
+
+private:
+    std::shared_ptr<TaskPool> pool;
+    MakeStrategy make_strategy;
+};
+
+/**
+ Helper function for creating an AsyncKPM object with a new pool of `num_workers` threads
+
+ For example::
+
+     auto async_kpm = make_async_kpm(4);
+     auto ldos = async_kpm.calc_ldos(model, energy, 0.1, {0, 0, 0});
+     // ... do other work
+     auto const& result = ldos.get();
+ */
+template<template<class> class Strategy = kpm::DefaultStrategy,
+         class Config = typename Strategy<float>::Config>
+AsyncKPM make_async_kpm(int num_workers, Config const& config = {}) {
+    return {std::make_shared<TaskPool>(num_workers),
+            detail::MakeStrategy<kpm::Strategy, Strategy>(config)};
+}
+
+} // namespace cpb
@@ -0,0 +1,105 @@
+#pragma once
+#include "KPM.hpp"
+
+#include <utility>
+
+namespace cpb {
+
+/**
+ KPM averages over many realizations of onsite disorder of a single model
+
+ All the realizations share the system and the hoppings, so everything which depends only
+ on the structure is done once: the Hamiltonian is built a single time (with every
+ diagonal element stored), the energy bounds of the clean model are widened once by the
+ disorder range, and each worker thread reorders and converts its matrix only for the
+ first realization. After that, a realization just writes new onsite energies into the
+ optimized matrix, see `kpm::Strategy::change_onsite()`.
+
+ The raw moments are averaged over the realizations. Since all of them have the same
+ scaling factors, this is the same as averaging the reconstructed DOS or LDOS.
+ */
+class DisorderEnsemble {
+public:
+    /// Disorder of realization `n`: one energy per Hamiltonian row, added to the onsite
+    /// energies of the model. It's called concurrently by the worker threads, so it must be
+    /// thread-safe. Results are reproducible if it's deterministic in `n`, e.g. seeded by it.
+    using Realization = std::function<ArrayXd(int n)>;
+    using MakeStrategy = std::function<std::unique_ptr<kpm::Strategy>(Hamiltonian const&,
+                                                                       kpm::Config const&)>;
+
+    /// The disorder values of every realization must be within [`min_disorder`,
+    /// `max_disorder`]. If the `config` has an energy range, it must already cover all
+    /// the realizations. The realizations are split between `num_threads` workers.
+    DisorderEnsemble(Model const& model, Realization realization, double min_disorder,
+                     double max_disorder, MakeStrategy const& make_strategy,
+                     kpm::Config const& config = {}, int num_threads = 1);
+
+    /// The energy range of all the realizations which is used for the KPM scaling
+    std::pair<double, double> energy_range() const {
+        return {config.min_energy, config.max_energy};
+    }
+
+    /// Raw diagonal moments at the `indices` averaged over the first `num_realizations`
+    std::vector<kpm::RawMoments> ldos_moments(std::vector<int> const& indices,
+                                              int num_moments, int num_realizations) const;
+    /// Raw stochastic trace moments with `num_random` vectors per realization, averaged over
+    /// the first `num_realizations`. Each realization gets different random vectors.
+    kpm::RawMoments dos_moments(int num_moments, int num_realizations,
+                                int num_random = 1) const;
+
+    /// Average LDOS at the `indices`: one column per index
+    ArrayXXd calc_ldos(std::vector<int> const& indices, ArrayXd const& energy,
+                       double broadening, int num_realizations) const;
+    /// Average total DOS, see `dos_moments()`
+    ArrayXd calc_dos(ArrayXd const& energy, double broadening, int num_realizations,
+                     int num_random = 1) const;
+
+    /// Time of the last calculation
+    Chrono const& get_timer() const { return calculation_timer; }
+
+private:
+    using Compute = std::function<std::vector<kpm::RawMoments>(kpm::Strategy&, int n)>;
+
+    /// Run `compute` for each realization on the worker threads and average the results
+    std::vector<kpm::RawMoments> average(int num_realizations, Compute const& compute) const;
+    /// Number of moments which resolve the `broadening` within the `energy_range()`
+    int required_num_moments(double broadening) const;
+    /// Reconstruct the function with the `config` kernel from all of the `moments`
+    ArrayXd reconstruct(kpm::RawMoments const& moments, ArrayXd const& energy) const;
+
+private:
+    Hamiltonian hamiltonian; ///< the clean model with every diagonal element stored
+    ArrayXd onsite; ///< diagonal of the clean `hamiltonian`
+    Realization realization;
+    double min_disorder;
+    double max_disorder;
+    kpm::Config config; ///< with the energy range of the whole ensemble
+    std::unique_ptr<ThreadPool> pool;
+    std::vector<std::unique_ptr<kpm::Strategy>> strategies; ///< one for each thread
+    mutable Chrono calculation_timer;
+};
+
+/**
+ Helper function for creating a DisorderEnsemble with the given KPM strategy
+
+ For example::
+
+     auto ensemble = make_disorder_ensemble(model, [](int n) {
+         auto rng = std::mt19937(n);
+         ...
+         return disorder;
+     }, -0.5, 0.5, {}, 4);
+     auto dos = ensemble.calc_dos(energy, 0.05, 500);
+ */
+template<template<class> class Strategy = kpm::DefaultStrategy>
+DisorderEnsemble make_disorder_ensemble(Model const& model,
+                                        DisorderEnsemble::Realization realization,
+                                        double min_disorder, double max_disorder,
+                                        kpm::Config const& config = {}, int num_threads = 1) {
+    return {model, std::move(realization), min_disorder, max_disorder,
+            [](Hamiltonian const& h, kpm::Config const& c) {
+                return detail::MakeStrategy<kpm::Strategy, Strategy>(c)(h);
+            }, config, num_threads};
+}
+
+} // namespace cpb
@@ -1,5 +1,6 @@
 #pragma once
 #include "kpm/Strategy.hpp"
+#include "hamiltonian/PointSymmetry.hpp"
 
 namespace cpb {
 
@@ -8,6 +9,10 @@ namespace cpb {
 
  Internally it uses a kpm::Strategy with the scalar of the given Hamiltonian.
  Don't create it directly -- use the `make_kpm<Strategy>()` helper function.
+
+ The strategy is only created when it's first needed, which is also when the model's
+ system and Hamiltonian are built. E.g. the Deferred jobs of `parallel_for` do this
+ on the worker threads instead of the single producer thread.
  */
 class KPM {
     using MakeStrategy = std::function<std::unique_ptr<kpm::Strategy>(Hamiltonian const&)>;
@@ -19,22 +24,127 @@ public:
     Model const& get_model() const { return model; }
     std::shared_ptr<System const> system() const { return model.system(); }
 
+    /// Use the rotation and mirror symmetries of a finite system to compute the LDOS of
+    /// only one site per orbit in `calc_ldos_vector` and `calc_spatial_ldos`. The results
+    /// of the other sites are copied. See `ham::find_point_symmetry()`.
+    void set_symmetry(bool enabled) { use_symmetry = enabled; }
+    bool get_symmetry() const { return use_symmetry; }
+    /// The symmetries of the current model: found on first use and cached
+    PointSymmetry const& point_symmetry() const;
+
+    /// Damp the KPM vectors by a factor `0 < d <= 1` for each site in every iteration:
+    /// an absorbing boundary which imitates an open system without any lead self-energies.
+    /// Used by `calc_ldos`, `calc_greens*` of a single row and `calc_moments`, the other
+    /// calculations ignore it. An empty array disables it. Kept by `set_model` if the number
+    /// of sites stays the same.
+    void set_damping(ArrayXf const& damping);
+    ArrayXf const& get_damping() const { return damping; }
+    /// Damp the sites outside of the `interior` shape: the damping factor drops from 1 to
+    /// `1 - strength` over the first `width` layers of neighbors (hoppings) away from it
+    void set_absorbing_boundary(Shape const& interior, int width, float strength = 0.1f);
+    /// Damp the sites near the leads of the model: the damping factor rises from
+    /// `1 - strength` at the lead interface to 1 after `width` layers of neighbors
+    void set_lead_absorbing_boundary(int width, float strength = 0.1f);
+
     ArrayXcd calc_greens(int row, int col, ArrayXd const& energy, double broadening) const;
     std::vector<ArrayXcd> calc_greens_vector(int row, std::vector<int> const& cols,
                                              ArrayXd const& energy, double broadening) const;
 
+    /// The block of Green's functions between all the `rows` and `cols`, e.g. two contacts,
+    /// from a single fused calculation: element (rows[i], cols[j]) is `i * cols.size() + j`
+    std::vector<ArrayXcd> calc_greens_block(std::vector<int> const& rows,
+                                            std::vector<int> const& cols,
+                                            ArrayXd const& energy, double broadening) const;
+
+    /// Same as `calc_greens_vector` but the results are written to the `sink` one by one
+    void calc_greens_stream(int row, std::vector<int> const& cols, ArrayXd const& energy,
+                            double broadening, kpm::Sink& sink) const;
+
     ArrayXd calc_ldos(ArrayXd const& energy, double broadening,
                       Cartesian position, std::string const& sublattice = "") const;
+    /// Total DOS estimated using stochastic trace evaluation with `num_random` vectors
+    ArrayXd calc_dos(ArrayXd const& energy, double broadening, int num_random = 16) const;
+    /// DOS projected on each sublattice, from the same random vectors as `calc_dos`:
+    /// column `i` is the sublattice with ID `i` and the columns add up to the total DOS
+    ArrayXXd calc_sublattice_dos(ArrayXd const& energy, double broadening,
+                                 int num_random = 16) const;
+    /// DOS projected on each of the `regions`, one column each: a site which is located
+    /// within several of them only counts for the first one
+    ArrayXXd calc_region_dos(ArrayXd const& energy, double broadening,
+                             std::vector<Shape> const& regions, int num_random = 16) const;
+    /// Local current `Im(H_ij * G_ji(E))` of every bond `(i, j)` with both sites within `shape`
+    /// from a single KPM run: one column per non-zero of `System::hoppings` in CSR order, zero
+    /// for the bonds outside of the shape. With `num_random == 0`, the result is exact but
+    /// the cost grows with the number of sites in the shape (as `calc_ldos_vector`).
+    ArrayXXd calc_bond_currents(ArrayXd const& energy, double broadening, Shape const& shape,
+                                int num_random = 16) const;
+    /// Electron density (occupation) of every Hamiltonian index at the `chemical_potential`
+    /// and `temperature` (Kelvin) from a Chebyshev expansion of the Fermi operator: the cost is
+    /// linear in the system size. Estimated with `num_random` vectors or, if
+    /// `probing_distance > 0`, with probing vectors, see `kpm::Strategy::density()`.
+    ArrayXd calc_density(double chemical_potential, double broadening, double temperature = 0,
+                         int num_random = 16, int probing_distance = 0) const;
+    /// Spectral function `A(k, E)` of the plane waves with the given wave vectors, optionally
+    /// projected on a single `sublattice`: one column per k-point
+    ArrayXXd calc_spectral_function(std::vector<Cartesian> const& k_points,
+                                    ArrayXd const& energy, double broadening,
+                                    std::string const& sublattice = "") const;
+    /// LDOS for many Hamiltonian `indices` computed together: one column per index
+    ArrayXXd calc_ldos_vector(std::vector<int> const& indices, ArrayXd const& energy,
+                              double broadening) const;
+    /// Same as `calc_ldos_vector` but the results are written to the `sink` block by block
+    void calc_ldos_stream(std::vector<int> const& indices, ArrayXd const& energy,
+                          double broadening, kpm::Sink& sink) const;
+    /// LDOS map of all the sites located within `shape`: one column per site, in ascending
+    /// index order (see `spatial_indices`). All of them share a single reordered matrix.
+    ArrayXXd calc_spatial_ldos(ArrayXd const& energy, double broadening,
+                               Shape const& shape) const;
+    /// Indices of the system sites which are located within `shape`
+    std::vector<int> spatial_indices(Shape const& shape) const;
+    /// Raw KPM moments of the Green's matrix elements (row, cols): the expensive part of
+    /// the calculation which can be saved and reconstructed later, see `kpm::RawMoments`
+    std::vector<kpm::RawMoments> calc_moments(int row, std::vector<int> const& cols,
+                                              int num_moments) const;
+    /// Raw diagonal moments at `index` which can be extended to more moments later
+    kpm::RawMoments calc_resumable_moments(int index, int num_moments) const;
+    /// Continue the calculation of resumable `previous` moments at `index` up to
+    /// `num_moments`. Throws if `previous` was computed for a different index.
+    kpm::RawMoments extend_moments(int index, kpm::RawMoments const& previous,
+                                   int num_moments) const;
+    /// Kubo-Bastin conductivity tensor element sigma_lr for the velocity directions `l`
+    /// and `r` (unit vectors) at each chemical potential. In units of e^2/h times the system
+    /// volume (area in 2D), so it must be divided by the volume. `temperature` in Kelvin.
+    ArrayXcd calc_conductivity(Cartesian direction_l, Cartesian direction_r,
+                               ArrayXd const& chemical_potential, double broadening,
+                               double temperature = 0, int num_random = 1,
+                               int num_points = 1000) const;
+    /// Time evolution of the `state` by `exp(-i*H*t)` using the Chebyshev propagator:
+    /// the state after each of `num_steps` steps of `time_step` (in femtoseconds)
+    ArrayXXcd calc_time_evolution(VectorXcd const& state, double time_step,
+                                  int num_steps = 1) const;
 
     /// Get some information about what happened during the last calculation
     std::string report(bool shortform) const;
     kpm::Stats const& get_stats() const;
 
+private:
+    /// Create the strategy (and build the Hamiltonian) on first use
+    kpm::Strategy& get_strategy() const;
+    /// LDOS of the `indices` computed only for their orbit representatives if enabled
+    ArrayXXd ldos_vector(std::vector<int> const& indices, ArrayXd const& energy,
+                         double broadening) const;
+    /// Shared by `calc_sublattice_dos` and `calc_region_dos`
+    ArrayXXd projected_dos(ArrayXi const& labels, int num_labels, ArrayXd const& energy,
+                           double broadening, int num_random, char const* name) const;
+
 private:
     Model model;
     MakeStrategy make_strategy;
-    std::unique_ptr<kpm::Strategy> strategy;
+    mutable std::unique_ptr<kpm::Strategy> strategy;
     mutable Chrono calculation_timer; ///< last calculation time
+    bool use_symmetry = false;
+    mutable std::shared_ptr<PointSymmetry const> symmetry; ///< reset with the model
+    ArrayXf damping; ///< see `set_damping()`
 };
 
 /**
@@ -43,7 +43,7 @@ struct SubIdRef {
  Helper class for passing hopping information to modifier functions
  */
 struct HopIdRef {
-    ArrayX<hop_id> const& ids;
+    Eigen::Map<ArrayX<hop_id> const> ids; ///< maps directly into the system's hopping matrix
     std::unordered_map<std::string, hop_id> const& name_map;
 };
 
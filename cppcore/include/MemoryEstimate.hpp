@@ -0,0 +1,44 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+namespace cpb {
+
+class Model;
+
+/**
+ Memory needed to build a model, estimated before anything is allocated
+
+ The foundation covers the bounding box of the shape (see `detail::find_bounds`) or only
+ the tiles which intersect the shape. The number of sites follows from the fraction of
+ a coarse sample of the box which is within the shape, and the Hamiltonian has one row
+ per site with the lattice's average number of hoppings plus the diagonal. Hopping
+ generators, leads and dangling site removal are not taken into account.
+ */
+struct MemoryEstimate {
+    std::size_t box_sites = 0; ///< all the sites of the bounding box
+    std::size_t foundation_sites = 0; ///< sites stored by the foundation, fewer with tiling
+    std::size_t num_sites = 0; ///< sites within the shape: the Hamiltonian rows
+    std::size_t hamiltonian_nnz = 0; ///< including the diagonal, if there are onsite energies
+    int max_nnz_per_row = 0; ///< the ELLPACK width of the Hamiltonian
+    int scalar_bytes = 0; ///< size of a single Hamiltonian value
+
+    std::size_t foundation_bytes = 0;
+    std::size_t system_bytes = 0;
+    std::size_t hamiltonian_bytes = 0;
+
+    /// The foundation exists together with the system being built from it,
+    /// and then the system together with the Hamiltonian
+    std::size_t peak_bytes() const {
+        return system_bytes + (foundation_bytes > hamiltonian_bytes ? foundation_bytes
+                                                                    : hamiltonian_bytes);
+    }
+
+    std::string report() const;
+};
+
+/// Estimate the memory of `model` as if it were built with the given foundation
+/// `tile_size` and `compact_positions`, see `Model::estimate_memory()`
+MemoryEstimate estimate_memory(Model const& model, int tile_size, bool compact_positions);
+
+} // namespace cpb
@@ -1,23 +1,46 @@
 #pragma once
+#include "MemoryEstimate.hpp"
 #include "system/System.hpp"
 #include "system/Shape.hpp"
 #include "system/Symmetry.hpp"
 #include "system/SystemModifiers.hpp"
 #include "system/Generators.hpp"
+#include "system/Cache.hpp"
 #include "leads/Leads.hpp"
 #include "hamiltonian/Hamiltonian.hpp"
 #include "hamiltonian/HamiltonianModifiers.hpp"
+#include "numeric/bulkboundary.hpp"
+#include "numeric/symmetric.hpp"
 
 #include "utils/Chrono.hpp"
 #include "detail/sugar.hpp"
 
+#include <functional>
+#include <mutex>
 #include <string>
 #include <vector>
 
 namespace cpb {
 
+/**
+ Builds the system and Hamiltonian from the lattice, shape, symmetry and modifier parameters
+
+ A copy shares the already built system, leads and Hamiltonian with the original (they are
+ immutable or copied before any change, e.g. the onsite update). A structural parameter
+ (shape, symmetry, lead, site state or position modifier, hopping generator) only clears
+ the system of the model it's added to. Variants which only differ in Hamiltonian
+ modifiers or the wave vector never build the system again, see `derive()`.
+
+ The results are built at most once and the const member functions are thread-safe: one
+ model can be shared by several threads, e.g. KPM strategies or solvers, instead of one copy
+ per thread. The first thread to request a result builds it while the others wait for it,
+ then they all read the same data. Changing the parameters is not thread-safe.
+ */
 class Model {
 public:
+    /// Identifies the modifier and shape functions, see `set_cache()`
+    using CacheTag = std::function<std::string()>;
+
     Model(Lattice const& lattice) : lattice(lattice) {}
 
     /// The arguments can any type accepted by `Model::add()`
@@ -26,6 +49,14 @@ public:
         detail::eval_ordered({(add(std::forward<Args>(args)), 0)...});
     }
 
+    /// A copy for variants of this model with different Hamiltonian parameters: the system
+    /// is built first (if it wasn't already), so that all the variants share it
+    Model derive() const {
+        std::lock_guard<std::recursive_mutex> const lock(build_mutex);
+        system();
+        return *this;
+    }
+
 public: // add parameters
     void add(Primitive primitive);
     void add(Shape const& shape);
@@ -40,7 +71,51 @@ public: // add parameters
 
     void add(HoppingGenerator const& g);
 
+    /// After the first change, the wave vector independent parts of the Hamiltonian are kept:
+    /// the following Hamiltonians only need to have their boundary hoppings recomputed
     void set_wave_vector(Cartesian const& k);
+    /// Number of threads used to build the system and to apply thread-safe hopping modifiers
+    /// (the result does not depend on it)
+    void set_num_threads(int n) { num_threads = n; hamiltonian_modifiers.num_threads = n; }
+    /// Apply the onsite modifiers to chunks of `n` sites, see `HamiltonianModifiers`
+    void set_onsite_chunk_size(int n) {
+        hamiltonian_modifiers.onsite_chunk_size = n;
+        clear_hamiltonian();
+    }
+    /// Build the foundation in tiles of `n` unit cells and only keep the ones which intersect
+    /// the shape. Ignored (no tiling) for models with leads since they extend beyond the shape.
+    void set_tile_size(int n) { tile_size = n; clear_structure(); }
+    /// Renumber the sites of the system for better memory locality, see `SiteOrder`
+    void set_site_order(SiteOrder order) { site_order = order; clear_structure(); }
+    /// Store the site positions as unit cell and sublattice indices, see `CompactPositions`.
+    /// Ignored for models with position modifiers.
+    void set_compact_positions(bool enabled) { compact_positions = enabled; clear_structure(); }
+    /// Keep the sites and hoppings of the built system when the position modifiers change,
+    /// e.g. for strain sweeps: only the positions are recomputed and the Hamiltonian is built
+    /// again with the same structure. This keeps a copy of the unmodified positions, and the
+    /// position modifiers see the sites of the system (in its order) instead of the foundation.
+    /// Ignored for models with hopping generators, leads or `SiteOrder::Morton`: their
+    /// hoppings or site order depend on the positions.
+    void set_keep_topology(bool enabled) { keep_topology = enabled; clear_structure(); }
+    /// Keep the built system and Hamiltonian in a binary file in `directory`, see `cache::save`.
+    /// The filename is a hash of the lattice, shape, symmetry and modifier parameters, but the
+    /// modifier and shape functions themselves are opaque: `tag` must identify them, e.g. by
+    /// their names and arguments. Models with such functions and an empty `tag` are not
+    /// cached. An empty `directory` disables the cache.
+    void set_cache(std::string const& directory, std::string const& tag = "");
+    /// Same, but the `tag` is computed each time the model is built, so that it also sees
+    /// the parameters which are added (or modified) after this call
+    void set_cache(std::string const& directory, CacheTag const& tag);
+    /// Share the built system and Hamiltonian with the other models of the process which
+    /// have the same parameters, see `cache::MemoryCache`. The key is the same hash as the
+    /// cache filename and it needs a `tag` in the same way, but it's kept separately.
+    void set_memory_cache(bool enabled, std::string const& tag = "");
+    void set_memory_cache(bool enabled, CacheTag const& tag);
+    /// Check the `estimate_memory()` against a budget of `bytes` before building the system.
+    /// If it doesn't fit, tiling and compact positions are switched on as far as the model
+    /// allows them. If it still doesn't fit, `system()` throws right away instead of running
+    /// out of memory halfway through the build. 0 (the default) disables the check.
+    void set_memory_budget(std::size_t bytes) { memory_budget = bytes; }
 
 public:
     /// Uses double precision values in the Hamiltonian matrix?
@@ -53,6 +128,18 @@ public: // get parameters
     Primitive const& get_primitive() const { return primitive; }
     Shape const& get_shape() const { return shape; }
     TranslationalSymmetry const& get_symmetry() const { return symmetry; }
+    int get_num_threads() const { return num_threads; }
+    int get_tile_size() const { return tile_size; }
+    SiteOrder get_site_order() const { return site_order; }
+    bool get_compact_positions() const { return compact_positions; }
+    bool get_keep_topology() const { return keep_topology; }
+    std::size_t get_memory_budget() const { return memory_budget; }
+    bool get_memory_cache() const { return memory_cache; }
+    /// Full path of the cache file for the current parameters, empty if there is no cache
+    std::string cache_filename() const;
+    /// Why the last cache file could not be saved, empty if it was (or if there is no cache).
+    /// Failing to save doesn't lose the results: the model keeps them.
+    std::string const& get_cache_error() const { return cache_error; }
 
     std::vector<SiteStateModifier> state_modifiers() const { return system_modifiers.state; }
     std::vector<PositionModifier> position_modifiers() const { return system_modifiers.position; }
@@ -62,6 +149,23 @@ public: // get parameters
 public: // get results
     std::shared_ptr<System const> const& system() const;
     Hamiltonian const& hamiltonian() const;
+    /// The wave vector independent parts of the Hamiltonian, kept for subsequent calls
+    PeriodicHamiltonian const& periodic_hamiltonian() const;
+    /// Hermitian storage alternative to `hamiltonian()`: only the upper triangle is built,
+    /// which takes half the memory. Throws if the model has translational symmetry. Explicitly
+    /// instantiated for the four scalar types of the Hamiltonian.
+    template<class scalar_t>
+    num::SymmetricMatrix<scalar_t> make_symmetric() const;
+    /// Periodic alternative to `hamiltonian()`: a real bulk matrix plus the complex boundary
+    /// hoppings with the phase of the current wave vector. Throws if the model doesn't have
+    /// translational symmetry, or if it has complex hoppings or modifiers. Explicitly
+    /// instantiated for the two complex scalar types.
+    template<class scalar_t>
+    num::BulkBoundaryMatrix<scalar_t> make_bulk_boundary() const;
+    /// Rows [start, end) of `hamiltonian()` with the global column indices, built without the
+    /// full matrix and not kept by the model: each rank of a distributed run builds only its
+    /// own block, see `dist::DistributedMatrix`. The system is still built in full.
+    Hamiltonian hamiltonian_rows(int start, int end) const;
     /// Return all leads
     Leads const& leads() const;
     /// Return lead at index
@@ -72,37 +176,117 @@ public: // get information
     std::string report();
     double system_build_seconds() const { return system_build_time.elapsed_seconds(); }
     double hamiltonian_build_seconds() const { return hamiltonian_build_time.elapsed_seconds(); }
+    /// Memory needed to build the system and Hamiltonian with the current parameters,
+    /// estimated without building anything, see `MemoryEstimate`
+    MemoryEstimate estimate_memory() const;
 
 public:
     void clear_system_modifiers() { system_modifiers.clear(); }
+    /// Remove the onsite modifiers: as with `add(OnsiteModifier)`, an existing Hamiltonian
+    /// only gets its diagonal updated instead of being rebuilt from scratch
+    void clear_onsite_modifiers();
+    /// Remove the position modifiers: with `set_keep_topology()`, an existing system only
+    /// gets its positions updated instead of being rebuilt from scratch
+    void clear_position_modifiers();
     void clear_hamiltonian_modifiers() { hamiltonian_modifiers.clear(); }
     void clear_all_modifiers() { clear_system_modifiers(); clear_hamiltonian_modifiers(); }
 
+    /// Remove the given sites from the built system and Hamiltonian without building them
+    /// again: the sparse matrices are spliced in one pass over their non-zeros and the
+    /// modifiers are not applied again. With `min_neighbors > 0`, the neighbors which are
+    /// left with fewer than that are removed as well, see `detail::removal_index()`.
+    /// Returns the new index of each previous site, -1 for the removed ones.
+    ///
+    /// The removal is not a model parameter: a structural change builds the system again
+    /// without it. The cache is disabled. Throws for models with leads.
+    ArrayXi remove_sites(std::vector<int> const& indices, int min_neighbors = 0);
+
 private:
+    /// The foundation with the shape, symmetry and site state and position modifiers applied
+    Foundation make_foundation(int foundation_tile_size, bool with_positions = true) const;
     std::shared_ptr<System> make_system() const;
+    /// The positions may change without rebuilding the sites and hoppings, see `keep_topology`
+    bool is_topology_fixed() const;
+    /// Recompute `System::positions` from `System::lattice_positions` (or `compact`) and the
+    /// current position modifiers
+    void apply_position_modifiers(System& system) const;
+    /// A copy of the existing system with new positions, the sites and hoppings are the same
+    std::shared_ptr<System> update_positions() const;
+    /// Switch on the lower memory build modes until the estimate fits the `memory_budget`,
+    /// throws if it can't
+    void fit_memory_budget(int& foundation_tile_size, bool& is_compact) const;
     Hamiltonian make_hamiltonian() const;
+    PeriodicHamiltonian make_periodic_hamiltonian() const;
+    /// Update only the onsite energies of the existing Hamiltonian, empty result on failure
+    Hamiltonian update_onsite() const;
+    /// Are there any modifier or shape functions which can't be identified by their parameters
+    bool has_opaque_functions() const;
+    /// Can the results be found by their parameters and `tag`: not with leads or removed
+    /// sites, and opaque functions need a non-empty `tag`
+    bool is_cacheable(std::string const& tag) const;
+    /// Hash of all the parameters and the `tag`: the key of the cache file and entry
+    cache::Hasher parameter_hash(std::string const& tag) const;
+    /// Fill in the missing system and/or Hamiltonian from the memory cache or the cache file
+    bool load_cache() const;
+    void save_cache() const;
 
     /// Clear any existing structural data, implies clearing Hamiltonian
     void clear_structure();
     /// Clear Hamiltonian, but leave structural data untouched
     void clear_hamiltonian();
+    /// Mark the positions as outdated after the position modifiers changed: the sites and
+    /// hoppings are kept if the topology is fixed, otherwise the structure is cleared
+    void clear_positions();
+    /// Mark the onsite energy as outdated after the onsite modifiers changed from the state
+    /// given by `was_double` and `was_complex`: the hoppings are kept if the scalar type
+    /// of the Hamiltonian stays the same
+    void clear_onsite(bool was_double, bool was_complex);
 
 private:
+    /// Each copy of the model gets its own (unlocked) mutex. It's recursive because building
+    /// the Hamiltonian or the leads requests the system.
+    struct BuildMutex : std::recursive_mutex {
+        BuildMutex() = default;
+        BuildMutex(BuildMutex const&) : std::recursive_mutex() {}
+        BuildMutex& operator=(BuildMutex const&) { return *this; }
+    };
+
     Lattice lattice;
     Primitive primitive;
     Shape shape;
     TranslationalSymmetry symmetry;
     Cartesian wave_vector = {0, 0, 0};
+    int num_threads = 1;
+    int tile_size = 0; ///< 0 means no tiling: the foundation is the entire bounding box
+    SiteOrder site_order = SiteOrder::Foundation;
+    bool compact_positions = false;
+    bool keep_topology = false;
+    std::string cache_directory; ///< empty means no cache
+    CacheTag cache_tag; ///< identifies the modifier and shape functions, called at build time
+    bool memory_cache = false; ///< share the results with the other models, see `MemoryCache`
+    CacheTag memory_cache_tag; ///< same as `cache_tag`, but for the memory cache
+    mutable std::uint64_t missed_key = 0; ///< last memory cache miss, until the results are saved
+    mutable std::string cache_error; ///< see `get_cache_error()`
+    std::size_t memory_budget = 0; ///< bytes, 0 means no limit
 
     SystemModifiers system_modifiers;
     HamiltonianModifiers hamiltonian_modifiers;
     HoppingGenerators hopping_generators;
 
     mutable std::shared_ptr<System const> _system;
+    mutable bool are_positions_outdated = false; ///< only the positions of `_system` are invalid
+    /// Boundaries of the last system: reused when only the position modifiers change
+    mutable System::BoundaryCache boundary_cache;
     mutable Hamiltonian _hamiltonian;
+    mutable bool is_onsite_outdated = false; ///< only the diagonal of `_hamiltonian` is invalid
+    /// Wave vector independent parts of the Hamiltonian, only built on request or if `is_k_sweep`
+    mutable PeriodicHamiltonian _periodic_hamiltonian;
+    bool is_k_sweep = false; ///< the wave vector was changed after building a Hamiltonian
     mutable Leads _leads;
+    bool has_removed_sites = false; ///< by `remove_sites()` since the system was built
     mutable Chrono system_build_time;
     mutable Chrono hamiltonian_build_time;
+    mutable BuildMutex build_mutex; ///< guards the lazy build of all the results above
 };
 
 } // namespace cpb
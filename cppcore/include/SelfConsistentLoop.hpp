@@ -0,0 +1,168 @@
+#pragma once
+#include "KPM.hpp"
+
+#include <deque>
+#include <utility>
+
+namespace cpb { namespace scf {
+
+/// How the next input potential is found from the previous ones and their residuals
+enum class Mixing {
+    Linear,   ///< a fraction `mixing_parameter` of the residual is added to the input
+    Anderson, ///< Anderson (Pulay) extrapolation: least squares over the residual history
+    Broyden   ///< Broyden's (good) quasi-Newton update of the inverse Jacobian
+};
+
+/**
+ Self-consistency configuration struct with defaults
+ */
+struct Config {
+    Mixing mixing = Mixing::Anderson;
+    /// Fraction of the residual which is mixed in: the step of the linear mixing and
+    /// the initial inverse Jacobian `-alpha * I` of the Anderson and Broyden mixing
+    double mixing_parameter = 0.3;
+    int history = 5; ///< number of previous iterations kept by the Anderson and Broyden mixing
+    double tolerance = 1e-5; ///< converged when `max|V_out - V_in|` drops below this
+    int max_iterations = 100;
+};
+
+/**
+ Finds the next input potential of a fixed-point iteration `V_in -> V_out`
+
+ The residual of an iteration is `F = V_out - V_in`. The Anderson and Broyden mixing keep
+ the last `history` input potentials and residuals in order to extrapolate to `F = 0`.
+ */
+class Mixer {
+public:
+    explicit Mixer(Config const& config) : config(config) {}
+
+    /// The next input potential after `input` gave the `residual`
+    ArrayXd next(ArrayXd const& input, ArrayXd const& residual);
+    /// Forget the history, e.g. when the fixed-point function changes
+    void reset();
+
+private:
+    ArrayXd anderson(ArrayXd const& input, ArrayXd const& residual) const;
+    ArrayXd broyden(ArrayXd const& input, ArrayXd const& residual);
+    /// Apply the approximate inverse Jacobian of the Broyden mixing (or its transpose)
+    ArrayXd inverse_jacobian(ArrayXd const& x, bool transpose = false) const;
+
+private:
+    Config config;
+    ArrayXd last_input;
+    ArrayXd last_residual;
+    std::deque<ArrayXd> input_steps; ///< differences between consecutive input potentials
+    std::deque<ArrayXd> residual_steps; ///< differences between consecutive residuals
+    std::deque<std::pair<ArrayXd, ArrayXd>> updates; ///< rank-1 Broyden updates `u * v^T`
+};
+
+} // namespace scf
+
+/**
+ Self-consistent onsite potential: `V = potential(density(H_0 + V))`
+
+ E.g. a Hartree or Poisson loop alternates between the electron density of the current
+ potential and the potential of that density. Everything stays in C++: the Hamiltonian is
+ built once (with every diagonal element stored) and each iteration only writes the new
+ onsite energies into the optimized KPM matrix, see `kpm::Strategy::change_onsite()`.
+ The model and its modifiers are not involved after construction.
+
+ The energy bounds of the clean Hamiltonian are also found once. The potential moves the
+ eigenvalues by at most its min and max values (Weyl's inequality), so the KPM scaling
+ covers the potential range with a margin of 10% of the clean bandwidth. Only a potential
+ which leaves this range requires a new strategy with a wider scaling.
+ */
+class SelfConsistentLoop {
+public:
+    /// Computes the density (one value per Hamiltonian row) of the current Hamiltonian
+    using Density = std::function<ArrayXd(kpm::Strategy&)>;
+    /// Computes the onsite potential (one value per Hamiltonian row) of a density
+    using Potential = std::function<ArrayXd(ArrayXd const& density)>;
+    using MakeStrategy = std::function<std::unique_ptr<kpm::Strategy>(Hamiltonian const&,
+                                                                       kpm::Config const&)>;
+
+    /// If the `kpm_config` has an energy range, it's taken as the range of the clean model
+    SelfConsistentLoop(Model const& model, Density density, Potential potential,
+                       MakeStrategy make_strategy, kpm::Config const& kpm_config = {},
+                       scf::Config const& config = {});
+
+    /// Iterate from the `initial` potential (zero if empty) until the residual is below the
+    /// tolerance or the maximum number of iterations is reached. Returns true if converged.
+    bool run(ArrayXd const& initial = {});
+
+    /// The input potential of the last iteration
+    ArrayXd const& get_potential() const { return potential_in; }
+    /// The density of the last input potential
+    ArrayXd const& get_density() const { return density_out; }
+    /// `max|V_out - V_in|` of each iteration of the last `run()`
+    std::vector<double> const& get_residuals() const { return residuals; }
+    int num_iterations() const { return static_cast<int>(residuals.size()); }
+    bool converged() const {
+        return !residuals.empty() && residuals.back() < config.tolerance;
+    }
+    /// The energy range of the current KPM scaling
+    std::pair<double, double> energy_range() const {
+        return {kpm_config.min_energy, kpm_config.max_energy};
+    }
+
+    /// Time of the last run
+    Chrono const& get_timer() const { return calculation_timer; }
+
+private:
+    /// Make sure the KPM scaling covers the `potential`: a new strategy if it doesn't
+    void cover(ArrayXd const& potential);
+
+private:
+    Hamiltonian hamiltonian; ///< the clean model with every diagonal element stored
+    ArrayXd onsite; ///< diagonal of the clean `hamiltonian`
+    Density density;
+    Potential potential;
+    MakeStrategy make_strategy;
+    kpm::Config kpm_config; ///< with the energy range of the current `strategy`
+    scf::Config config;
+    std::pair<double, double> clean_range; ///< energy bounds of the clean `hamiltonian`
+    std::pair<double, double> covered; ///< potential range covered by the KPM scaling
+    std::unique_ptr<kpm::Strategy> strategy;
+
+    ArrayXd potential_in;
+    ArrayXd density_out;
+    std::vector<double> residuals;
+    Chrono calculation_timer;
+};
+
+namespace scf {
+
+/// Density kernel: the KPM electron density, see `kpm::Strategy::density()`
+SelfConsistentLoop::Density fermi_density(double chemical_potential, double broadening,
+                                          double temperature = 0, int num_random = 16,
+                                          int probing_distance = 0);
+
+/// Linear response potential `V = coupling * (n - background)`, e.g. a Hubbard-like
+/// diagonal `coupling` or the discretized Coulomb interaction of a Hartree loop
+SelfConsistentLoop::Potential linear_potential(SparseMatrixXd coupling, ArrayXd background);
+
+} // namespace scf
+
+/**
+ Helper function for creating a SelfConsistentLoop with the given KPM strategy
+
+ For example::
+
+     auto loop = make_self_consistent_loop(model, scf::fermi_density(0.1, 0.02, 300),
+                                           scf::linear_potential(coupling, background));
+     loop.run();
+     auto const& potential = loop.get_potential();
+ */
+template<template<class> class Strategy = kpm::DefaultStrategy>
+SelfConsistentLoop make_self_consistent_loop(Model const& model,
+                                             SelfConsistentLoop::Density density,
+                                             SelfConsistentLoop::Potential potential,
+                                             kpm::Config const& kpm_config = {},
+                                             scf::Config const& config = {}) {
+    return {model, std::move(density), std::move(potential),
+            [](Hamiltonian const& h, kpm::Config const& c) {
+                return detail::MakeStrategy<kpm::Strategy, Strategy>(c)(h);
+            }, kpm_config, config};
+}
+
+} // namespace cpb
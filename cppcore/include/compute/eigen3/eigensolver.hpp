@@ -0,0 +1,50 @@
+#pragma once
+#include "numeric/dense.hpp"
+
+#include <Eigen/Eigenvalues>
+#include <algorithm>
+
+namespace cpb { namespace compute {
+
+/**
+ Eigenvalues (ascending) and, if `compute_vectors`, eigenvectors of a dense Hermitian matrix
+
+ Only the lower triangle of `matrix` is used and its contents may be destroyed. If `min < max`,
+ only the eigenpairs within [min, max] are returned: the Eigen solver computes all of them
+ and then drops the ones outside. Returns false if the solver didn't converge.
+ */
+template<class scalar_t, class real_t = num::get_real_t<scalar_t>>
+bool hermitian_eigensolve(MatrixX<scalar_t>& matrix, real_t min, real_t max,
+                          bool compute_vectors, ArrayX<real_t>& values,
+                          MatrixX<scalar_t>& vectors) {
+    auto const solver = Eigen::SelfAdjointEigenSolver<MatrixX<scalar_t>>(
+        matrix, compute_vectors ? Eigen::ComputeEigenvectors : Eigen::EigenvaluesOnly
+    );
+    if (solver.info() != Eigen::Success) {
+        return false;
+    }
+
+    auto const& all = solver.eigenvalues();
+    auto first = 0;
+    auto count = static_cast<int>(all.size());
+    if (min < max) {
+        auto const begin = all.data();
+        auto const end = all.data() + all.size();
+        first = static_cast<int>(std::lower_bound(begin, end, min) - begin);
+        count = static_cast<int>(std::upper_bound(begin, end, max) - begin) - first;
+    }
+
+    values = all.segment(first, count).array();
+    if (compute_vectors) {
+        vectors = solver.eigenvectors().middleCols(first, count);
+    } else {
+        vectors.resize(0, 0);
+    }
+    return true;
+}
+
+/// LAPACK threads of the calling thread, e.g. 1 for the workers of a `ThreadPool`:
+/// the Eigen solver is always single-threaded
+inline void set_local_lapack_threads(int) {}
+
+}} // namespace cpb::compute
@@ -0,0 +1,7 @@
+#pragma once
+
+#ifdef CPB_USE_MKL
+# include "mkl/eigensolver.hpp"
+#else
+# include "eigen3/eigensolver.hpp"
+#endif
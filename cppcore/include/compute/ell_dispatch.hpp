@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <complex>
+#include <string>
+#include <vector>
+
+namespace cpb { namespace compute { namespace ell_dispatch {
+
+/**
+ Runtime CPU dispatch for the ELLPACK `kpm_spmv()` column kernels
+
+ The library is compiled for a single instruction set (see `support/simd.hpp`) which is
+ the build machine's with `PB_NATIVE_SIMD` or a conservative baseline for portable builds.
+ The ELL column loop is the hottest part of KPM, so it also has explicit versions which
+ are compiled with function target attributes and selected on first use based on the CPU:
+
+   * "avx2": 256-bit gathers and FMA (x86-64 with GCC or clang)
+   * "avx512": 512-bit gathers, complex products with lane shuffles and `fmaddsub`
+   * "neon": the aarch64 baseline, gathers are assembled from lane loads
+   * "sve": vector-length agnostic gathers and complex `FCMLA`, only compiled if the
+            compiler already targets SVE (e.g. `PB_NATIVE_SIMD` on an SVE machine)
+
+ "generic" means no dispatch: the inline `support/simd.hpp` (or scalar) code is used.
+ Only the uncompressed 32-bit ELL indices are dispatched, see `kpm_spmv()`. The diagonal
+ moments of the common ELL widths use the row-wise kernel of `kpm_spmv_diagonal()` instead.
+ */
+
+/// `y[row] += data[row] * x[indices[row]]` for all rows in [start, end)
+template<class scalar_t>
+using ColumnKernel = void (*)(int start, int end, scalar_t const* data, int const* indices,
+                              scalar_t const* x, scalar_t* y);
+
+namespace detail {
+    /// The kernels of a single instruction set, `nullptr` entries fall back to inline code
+    struct KernelTable {
+        char const* isa;
+        ColumnKernel<float> f32;
+        ColumnKernel<std::complex<float>> cf32;
+        ColumnKernel<double> f64;
+        ColumnKernel<std::complex<double>> cf64;
+    };
+
+    extern std::atomic<KernelTable const*> active; ///< `nullptr` until the first use
+    KernelTable const* select_best();
+
+    inline KernelTable const& table() {
+        auto const t = active.load(std::memory_order_acquire);
+        return t ? *t : *select_best();
+    }
+
+    inline ColumnKernel<float> get(KernelTable const& t, float*) { return t.f32; }
+    inline ColumnKernel<std::complex<float>> get(KernelTable const& t, std::complex<float>*) {
+        return t.cf32;
+    }
+    inline ColumnKernel<double> get(KernelTable const& t, double*) { return t.f64; }
+    inline ColumnKernel<std::complex<double>> get(KernelTable const& t, std::complex<double>*) {
+        return t.cf64;
+    }
+} // namespace detail
+
+/// The dispatched kernel for `scalar_t` or `nullptr` if the inline code should be used
+template<class scalar_t>
+ColumnKernel<scalar_t> column_kernel() {
+    return detail::get(detail::table(), static_cast<scalar_t*>(nullptr));
+}
+
+/// Name of the selected instruction set, e.g. "avx512" or "generic"
+std::string active_isa();
+/// All the instruction sets which are compiled in and supported by this CPU, best last
+std::vector<std::string> available_isas();
+/// Force one of the `available_isas()` (mainly for testing and benchmarks)
+void set_isa(std::string const& name);
+
+}}} // namespace cpb::compute::ell_dispatch
@@ -0,0 +1,67 @@
+#pragma once
+#include "numeric/dense.hpp"
+
+#include <complex>
+#include <cmath>
+#include <utility>
+
+namespace cpb { namespace compute {
+
+/// Return the smallest power of 2 which is `>= n`
+inline int next_power_of_two(int n) {
+    auto p = 1;
+    while (p < n) {
+        p *= 2;
+    }
+    return p;
+}
+
+/**
+ In-place forward discrete Fourier transform: `data[k] = sum(data[n] * exp(-2pi*i*n*k/N))`
+
+ Iterative radix-2 Cooley-Tukey, the size of `data` must be a power of two. The twiddle
+ factors are computed in double precision even for a single precision transform.
+ */
+template<class real_t>
+void fft(ArrayX<std::complex<real_t>>& data) {
+    using complex_t = std::complex<real_t>;
+    auto const size = static_cast<int>(data.size());
+    assert(size == next_power_of_two(size));
+    if (size < 2) {
+        return;
+    }
+
+    // Bit-reversal permutation
+    for (auto i = 1, j = 0; i < size; ++i) {
+        auto bit = size >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            std::swap(data[i], data[j]);
+        }
+    }
+
+    // Twiddle factors of the last (largest) stage, the smaller stages use a stride
+    auto twiddles = ArrayX<complex_t>(size / 2);
+    for (auto j = 0; j < size / 2; ++j) {
+        auto const angle = -6.283185307179586 * j / size;
+        twiddles[j] = complex_t(static_cast<real_t>(std::cos(angle)),
+                                static_cast<real_t>(std::sin(angle)));
+    }
+
+    for (auto half = 1; half < size; half *= 2) {
+        auto const stride = size / (2 * half);
+        for (auto start = 0; start < size; start += 2 * half) {
+            for (auto j = 0; j < half; ++j) {
+                auto const u = data[start + j];
+                auto const v = data[start + j + half] * twiddles[j * stride];
+                data[start + j] = u + v;
+                data[start + j + half] = u - v;
+            }
+        }
+    }
+}
+
+}} // namespace cpb::compute
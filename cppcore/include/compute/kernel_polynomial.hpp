@@ -1,10 +1,17 @@
 #pragma once
 #include "numeric/dense.hpp"
 #include "numeric/sparse.hpp"
+#include "numeric/bsrmatrix.hpp"
+#include "numeric/bulkboundary.hpp"
 #include "numeric/ellmatrix.hpp"
+#include "numeric/permuted.hpp"
+#include "numeric/sellmatrix.hpp"
+#include "numeric/splitvector.hpp"
+#include "numeric/symmetric.hpp"
 #include "numeric/traits.hpp"
 
 #include "compute/detail.hpp"
+#include "compute/ell_dispatch.hpp"
 #include "detail/macros.hpp"
 #include "support/simd.hpp"
 
@@ -18,25 +25,134 @@ namespace cpb { namespace compute {
  KPM-specialized sparse matrix-vector multiplication (CSR, off-diagonal)
 
  Equivalent to: y = matrix * x - y
+
+ Without MKL, the SIMD version sorts each row into one of three buckets on the fly:
+ long rows (e.g. the hubs made by a `HoppingGenerator`) are reduced along the row,
+ groups of consecutive short rows with the same length (the regular lattice bulk) get one
+ row per SIMD lane and everything else uses the scalar loop.
  */
 #ifndef CPB_USE_MKL
 
-template<class scalar_t> CPB_ALWAYS_INLINE
-void kpm_spmv(int start, int end, SparseMatrixX<scalar_t> const& matrix,
+namespace detail {
+    /// `y[row] = sum(data * x[indices]) - y[row]` for a single CSR row
+    template<class scalar_t, class index_t> CPB_ALWAYS_INLINE
+    void csr_row_spmv(int row, scalar_t const* data, index_t const* indices,
+                      index_t const* indptr, scalar_t const* x, scalar_t* y) {
+        auto r = scalar_t{0};
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            r += mul(data[n], x[indices[n]]);
+        }
+        y[row] = r - y[row];
+    }
+} // namespace detail
+
+#if SIMDPP_USE_NULL // generic version
+
+template<class scalar_t, class index_t> CPB_ALWAYS_INLINE
+void kpm_spmv(int start, int end, SparseMatrixX<scalar_t, index_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    for (auto row = start; row < end; ++row) {
+        detail::csr_row_spmv(row, matrix.valuePtr(), matrix.innerIndexPtr(),
+                             matrix.outerIndexPtr(), x.data(), y.data());
+    }
+}
+
+#else // vectorized using SIMD intrinsics
+
+namespace detail {
+    /// Rows with at least this many registers worth of nonzeros are reduced along the row
+    constexpr auto csr_long_row_registers = 4;
+
+    /// Long row: segmented reduction of contiguous nonzeros, then a horizontal sum
+    template<class scalar_t, class index_t> CPB_ALWAYS_INLINE
+    void csr_long_row_spmv(int row, scalar_t const* data, index_t const* indices,
+                           index_t const* indptr, scalar_t const* x, scalar_t* y) {
+        using simd_register_t = simd::select_vector_t<scalar_t>;
+        constexpr auto step = static_cast<index_t>(simd::detail::traits<scalar_t>::size);
+
+        auto sum = simd::make_float<simd_register_t>(0);
+        auto n = indptr[row];
+        auto const last = indptr[row + 1];
+        for (; n + step <= last; n += step) {
+            auto const a = simd::load_u<simd_register_t>(data + n);
+            auto const b = simd::gather<simd_register_t>(x, indices + n);
+            sum = simd::madd_rc<scalar_t>(a, b, sum);
+        }
+
+        auto r = simd::reduce_add_rc<scalar_t>(sum);
+        for (; n < last; ++n) {
+            r += mul(data[n], x[indices[n]]);
+        }
+        y[row] = r - y[row];
+    }
+
+    /// Are the `step` rows starting at `row` all `length` long?
+    template<int step, class index_t> CPB_ALWAYS_INLINE
+    bool csr_is_uniform(int row, index_t length, index_t const* indptr) {
+        for (auto i = 1; i < step; ++i) {
+            if (indptr[row + i + 1] - indptr[row + i] != length) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// Short rows of the same `length`: one row per SIMD lane, the k-th nonzeros of all
+    /// the rows are gathered into a single register
+    template<class scalar_t, class index_t> CPB_ALWAYS_INLINE
+    void csr_uniform_rows_spmv(int row, index_t length, scalar_t const* data,
+                               index_t const* indices, index_t const* indptr,
+                               scalar_t const* x, scalar_t* y) {
+        using simd_register_t = simd::select_vector_t<scalar_t>;
+        constexpr auto step = simd::detail::traits<scalar_t>::size;
+
+        index_t data_idx[step];
+        index_t columns[step];
+        auto sum = simd::make_float<simd_register_t>(0);
+        for (auto k = index_t{0}; k < length; ++k) {
+            for (auto i = 0; i < static_cast<int>(step); ++i) {
+                data_idx[i] = indptr[row + i] + k;
+                columns[i] = indices[data_idx[i]];
+            }
+            auto const a = simd::gather<simd_register_t>(data, data_idx);
+            auto const b = simd::gather<simd_register_t>(x, columns);
+            sum = simd::madd_rc<scalar_t>(a, b, sum);
+        }
+
+        auto const c = simd::load_u<simd_register_t>(y + row);
+        simd::store_u(y + row, simd_register_t{sum - c});
+    }
+} // namespace detail
+
+template<class scalar_t, class index_t> CPB_ALWAYS_INLINE
+void kpm_spmv(int start, int end, SparseMatrixX<scalar_t, index_t> const& matrix,
               VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    constexpr auto step = static_cast<int>(simd::detail::traits<scalar_t>::size);
+    constexpr auto long_row = detail::csr_long_row_registers * step;
     auto const data = matrix.valuePtr();
     auto const indices = matrix.innerIndexPtr();
     auto const indptr = matrix.outerIndexPtr();
 
-    for (auto row = start; row < end; ++row) {
-        auto r = scalar_t{0};
-        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
-            r += detail::mul(data[n], x[indices[n]]);
+    auto row = start;
+    while (row < end) {
+        auto const length = indptr[row + 1] - indptr[row];
+        if (length >= long_row) {
+            detail::csr_long_row_spmv(row, data, indices, indptr, x.data(), y.data());
+            row += 1;
+        } else if (step > 1 && length > 0 && row + step <= end
+                   && detail::csr_is_uniform<step>(row, length, indptr)) {
+            detail::csr_uniform_rows_spmv(row, length, data, indices, indptr,
+                                          x.data(), y.data());
+            row += step;
+        } else {
+            detail::csr_row_spmv(row, data, indices, indptr, x.data(), y.data());
+            row += 1;
         }
-        y[row] = r - y[row];
     }
 }
 
+#endif // SIMDPP_USE_NULL
+
 #else // CPB_USE_MKL
 
 template<class scalar_t> CPB_ALWAYS_INLINE
@@ -74,6 +190,29 @@ void kpm_spmv(int start, int end, SparseMatrixX<scalar_t> const& matrix,
 
 #endif // CPB_USE_MKL
 
+namespace detail {
+    /// Accumulate `m2 += x^2` and `m3 += dot(x, y)` for rows [start, end)
+    template<class scalar_t> CPB_ALWAYS_INLINE
+    void accumulate_diagonal(int start, int end, VectorX<scalar_t> const& x,
+                             VectorX<scalar_t> const& y, scalar_t& m2, scalar_t& m3) {
+        auto const size = end - start;
+        m2 += x.segment(start, size).squaredNorm();
+        m3 += y.segment(start, size).dot(x.segment(start, size));
+    }
+
+    /// Same as above, but with a higher precision accumulator type `acc_t` (mixed precision)
+    template<class scalar_t, class acc_t> CPB_ALWAYS_INLINE
+    void accumulate_diagonal(int start, int end, VectorX<scalar_t> const& x,
+                             VectorX<scalar_t> const& y, acc_t& m2, acc_t& m3) {
+        for (auto row = start; row < end; ++row) {
+            auto const a = static_cast<acc_t>(x[row]);
+            auto const b = static_cast<acc_t>(y[row]);
+            m2 += square(a);
+            m3 += mul(num::conjugate(b), a);
+        }
+    }
+} // namespace detail
+
 /**
  KPM-specialized sparse matrix-vector multiplication (CSR, diagonal)
 
@@ -81,35 +220,153 @@ void kpm_spmv(int start, int end, SparseMatrixX<scalar_t> const& matrix,
    y = matrix * x - y
    m2 = x^2
    m3 = dot(x, y)
+
+ The accumulator type `acc_t` may have a higher precision than `scalar_t`.
  */
-template<class scalar_t> CPB_ALWAYS_INLINE
-void kpm_spmv_diagonal(int start, int end, SparseMatrixX<scalar_t> const& matrix,
+template<class scalar_t, class index_t, class acc_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(int start, int end, SparseMatrixX<scalar_t, index_t> const& matrix,
                        VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
-                       scalar_t& m2, scalar_t& m3) {
+                       acc_t& m2, acc_t& m3) {
     kpm_spmv(start, end, matrix, x, y);
-    auto const size = end - start;
-    m2 += x.segment(start, size).squaredNorm();
-    m3 += y.segment(start, size).dot(x.segment(start, size));
+    detail::accumulate_diagonal(start, end, x, y, m2, m3);
 }
 
+namespace detail {
+    /// The runtime-dispatched column kernel, only for uncompressed 32-bit indices
+    template<class scalar_t, class index_t>
+    ell_dispatch::ColumnKernel<scalar_t> ell_column_kernel(
+        num::EllMatrix<scalar_t, index_t> const& matrix
+    ) {
+        return (std::is_same<index_t, int>::value && !matrix.is_compressed())
+               ? ell_dispatch::column_kernel<scalar_t>() : nullptr;
+    }
+
+    /// Call `kernel.template run<width>()` if there is a compile-time specialization for
+    /// the ELLPACK `width`: these cover `Lattice::max_hoppings()` of the common lattices
+    /// (e.g. 3 for graphene) plus one for the onsite energy. False for any other width.
+    template<class Kernel> CPB_ALWAYS_INLINE
+    bool with_fixed_width(int width, Kernel& kernel) {
+        switch (width) {
+            case 2: kernel.template run<2>(); return true;
+            case 3: kernel.template run<3>(); return true;
+            case 4: kernel.template run<4>(); return true;
+            case 5: kernel.template run<5>(); return true;
+            case 6: kernel.template run<6>(); return true;
+            case 7: kernel.template run<7>(); return true;
+            case 8: kernel.template run<8>(); return true;
+            case 9: kernel.template run<9>(); return true;
+            case 10: kernel.template run<10>(); return true;
+            case 11: kernel.template run<11>(); return true;
+            case 12: kernel.template run<12>(); return true;
+            default: return false;
+        }
+    }
+} // namespace detail
+
+namespace detail {
+    /// One column of an indexed ELLPACK matrix, see `EllMatrix::index_values()`
+    template<class scalar_t, class Index>
+    struct IndexedColumn {
+        scalar_t const* table;
+        std::uint8_t const* ids;
+        Index const* indices;
+        int block; ///< rows per block of compressed offsets or 0 for full column indices
+
+        CPB_ALWAYS_INLINE int column(int row) const {
+            return (block ? row - row % block : 0) + static_cast<int>(indices[row]);
+        }
+    };
+
+    /// `y += table[ids] * x[indices]` for a single column. The table is tiny and it stays in
+    /// the L1 cache, so only a byte per element is loaded from memory instead of a value.
+    template<class scalar_t, class Index> CPB_ALWAYS_INLINE
+    void indexed_column_spmv(int start, int end, IndexedColumn<scalar_t, Index> const& a,
+                             scalar_t const* x, scalar_t* y) {
+        auto loop = simd::split_loop(y, start, end);
+#if SIMDPP_USE_NULL
+        loop.vec_end = loop.peel_end;
+#else
+        if (a.block && (loop.peel_end % loop.step != 0 || a.block % loop.step != 0)) {
+            loop.vec_end = loop.peel_end; // same as `kpm_spmv()` for compressed offsets
+        }
+#endif
+
+        for (auto row = loop.start; row < loop.peel_end; ++row) {
+            y[row] += mul(a.table[a.ids[row]], x[a.column(row)]);
+        }
+#if !SIMDPP_USE_NULL
+        using simd_register_t = simd::select_vector_t<scalar_t>;
+        for (auto row = loop.peel_end; row < loop.vec_end; row += loop.step) {
+            auto const origin = a.block ? row - row % a.block : 0;
+            auto const v = simd::gather<simd_register_t>(a.table, a.ids + row);
+            auto const b = simd::gather<simd_register_t>(x + origin, a.indices + row);
+            auto const c = simd::load<simd_register_t>(y + row);
+            simd::store(y + row, simd::madd_rc<scalar_t>(v, b, c));
+        }
+#endif // !SIMDPP_USE_NULL
+        for (auto row = loop.vec_end; row < loop.end; ++row) {
+            y[row] += mul(a.table[a.ids[row]], x[a.column(row)]);
+        }
+    }
+    /// `y = matrix * x - y` with the values gathered from the table of an indexed ELLPACK
+    /// matrix, e.g. one which doesn't keep its `data`, see `EllMatrix::drop_data()`
+    template<class scalar_t, class index_t> CPB_ALWAYS_INLINE
+    void indexed_spmv(int start, int end, num::EllMatrix<scalar_t, index_t> const& matrix,
+                      VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+        assert(matrix.is_indexed());
+        auto const size = end - start;
+        y.segment(start, size) = -y.segment(start, size);
+
+        auto const table = matrix.value_table.data();
+        auto const block = static_cast<int>(matrix.offset_block);
+        for (auto n = 0; n < matrix.nnz_per_row; ++n) {
+            auto const ids = &matrix.value_ids(0, n);
+            if (matrix.is_compressed()) {
+                using Column = IndexedColumn<scalar_t, typename num::EllMatrix<
+                    scalar_t, index_t>::offset_t>;
+                indexed_column_spmv(start, end, Column{table, ids, &matrix.offsets(0, n), block},
+                                    x.data(), y.data());
+            } else {
+                using Column = IndexedColumn<scalar_t, index_t>;
+                indexed_column_spmv(start, end, Column{table, ids, &matrix.indices(0, n), 0},
+                                    x.data(), y.data());
+            }
+        }
+    }
+} // namespace detail
+
 /**
  KPM-specialized sparse matrix-vector multiplication (ELLPACK, off-diagonal)
 
  Equivalent to: y = matrix * x - y
+
+ The columns are computed by the runtime-selected kernel of `compute/ell_dispatch.hpp`
+ if one is available for this CPU, otherwise by the inline code below.
  */
 #if SIMDPP_USE_NULL // generic version
 
-template<class scalar_t> CPB_ALWAYS_INLINE
-void kpm_spmv(int start, int end, num::EllMatrix<scalar_t> const& matrix,
+template<class scalar_t, class index_t> CPB_ALWAYS_INLINE
+void kpm_spmv(int start, int end, num::EllMatrix<scalar_t, index_t> const& matrix,
               VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    if (!matrix.has_data()) {
+        detail::indexed_spmv(start, end, matrix, x, y);
+        return;
+    }
     for (auto row = start; row < end; ++row) {
         y[row] = -y[row];
     }
 
+    auto const column_kernel = detail::ell_column_kernel(matrix);
     for (auto n = 0; n < matrix.nnz_per_row; ++n) {
+        if (column_kernel) {
+            column_kernel(start, end, &matrix.data(0, n),
+                          reinterpret_cast<int const*>(&matrix.indices(0, n)),
+                          x.data(), y.data());
+            continue;
+        }
         for (auto row = start; row < end; ++row) {
             auto const a = matrix.data(row, n);
-            auto const b = x[matrix.indices(row, n)];
+            auto const b = x[matrix.column(row, n)];
             y[row] += detail::mul(a, b);
         }
     }
@@ -117,12 +374,50 @@ void kpm_spmv(int start, int end, num::EllMatrix<scalar_t> const& matrix,
 
 #else // vectorized using SIMD intrinsics
 
+namespace detail {
+    /// `y += data * x[indices]` for a single ELLPACK column. With `block != 0`, the indices
+    /// are compressed offsets relative to the first row of each block of `block` rows.
+    template<class scalar_t, class Index, int step> CPB_ALWAYS_INLINE
+    void ell_column_spmv(simd::split_loop_t<step> const& loop, scalar_t const* data,
+                         Index const* indices, int block, scalar_t const* x, scalar_t* y) {
+        using simd_register_t = simd::select_vector_t<scalar_t>;
+
+        for (auto row = loop.start; row < loop.peel_end; ++row) {
+            auto const origin = block ? row - row % block : 0;
+            y[row] += mul(data[row], x[origin + indices[row]]);
+        }
+        for (auto row = loop.peel_end; row < loop.vec_end; row += loop.step) {
+            // All the lanes share the same origin, see `kpm_spmv()` below
+            auto const origin = block ? row - row % block : 0;
+            auto const a = simd::load<simd_register_t>(data + row);
+            auto const b = simd::gather<simd_register_t>(x + origin, indices + row);
+            auto const c = simd::load<simd_register_t>(y + row);
+            simd::store(y + row, simd::madd_rc<scalar_t>(a, b, c));
+        }
+        for (auto row = loop.vec_end; row < loop.end; ++row) {
+            auto const origin = block ? row - row % block : 0;
+            y[row] += mul(data[row], x[origin + indices[row]]);
+        }
+    }
+} // namespace detail
+
 template<class scalar_t, int skip_last_n = 0,
-         int step = simd::detail::traits<scalar_t>::size> CPB_ALWAYS_INLINE
-simd::split_loop_t<step> kpm_spmv(int start, int end, num::EllMatrix<scalar_t> const& matrix,
+         int step = simd::detail::traits<scalar_t>::size, class index_t> CPB_ALWAYS_INLINE
+simd::split_loop_t<step> kpm_spmv(int start, int end,
+                                  num::EllMatrix<scalar_t, index_t> const& matrix,
                                   VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
     using simd_register_t = simd::select_vector_t<scalar_t>;
-    auto const loop = simd::split_loop(y.data(), start, end);
+    auto loop = simd::split_loop(y.data(), start, end);
+    if (!matrix.has_data()) {
+        assert(skip_last_n == 0); // see `kpm_spmv_diagonal()`
+        detail::indexed_spmv(start, end, matrix, x, y);
+        return loop;
+    }
+    auto const block = static_cast<int>(matrix.offset_block);
+    if (matrix.is_compressed() && (loop.peel_end % step != 0 || block % step != 0)) {
+        // The compressed offsets of a register's lanes must share a block: use scalar code
+        loop.vec_end = loop.peel_end;
+    }
 
     for (auto row = loop.start; row < loop.peel_end; ++row) {
         y[row] = -y[row];
@@ -135,21 +430,19 @@ simd::split_loop_t<step> kpm_spmv(int start, int end, num::EllMatrix<scalar_t> c
         y[row] = -y[row];
     }
 
+    auto const column_kernel = detail::ell_column_kernel(matrix);
     for (auto n = 0; n < matrix.nnz_per_row - skip_last_n; ++n) {
         auto const data = &matrix.data(0, n);
-        auto const indices = &matrix.indices(0, n);
-
-        for (auto row = loop.start; row < loop.peel_end; ++row) {
-            y[row] += detail::mul(data[row], x[indices[row]]);
-        }
-        for (auto row = loop.peel_end; row < loop.vec_end; row += loop.step) {
-            auto const a = simd::load<simd_register_t>(data + row);
-            auto const b = simd::gather<simd_register_t>(x.data(), indices + row);
-            auto const c = simd::load<simd_register_t>(y.data() + row);
-            simd::store(y.data() + row, simd::madd_rc<scalar_t>(a, b, c));
-        }
-        for (auto row = loop.vec_end; row < loop.end; ++row) {
-            y[row] += detail::mul(data[row], x[indices[row]]);
+        if (column_kernel) {
+            column_kernel(loop.start, loop.end, data,
+                          reinterpret_cast<int const*>(&matrix.indices(0, n)),
+                          x.data(), y.data());
+        } else if (matrix.is_compressed()) {
+            detail::ell_column_spmv(loop, data, &matrix.offsets(0, n), block,
+                                    x.data(), y.data());
+        } else {
+            detail::ell_column_spmv(loop, data, &matrix.indices(0, n), 0,
+                                    x.data(), y.data());
         }
     }
 
@@ -168,22 +461,176 @@ simd::split_loop_t<step> kpm_spmv(int start, int end, num::EllMatrix<scalar_t> c
  */
 #if SIMDPP_USE_NULL // generic version
 
-template<class scalar_t> CPB_ALWAYS_INLINE
-void kpm_spmv_diagonal(int start, int end, num::EllMatrix<scalar_t> const& matrix,
+namespace detail {
+    /// Row-wise ELLPACK diagonal product for a compile-time number of nonzeros per row.
+    /// The columns of a row are summed in a register, so `y` is read and written only once
+    /// instead of once per column, and the m2 and m3 sums are fused into the same loop.
+    template<class scalar_t, class index_t, class acc_t>
+    struct EllFixedDiagonal {
+        int start, end;
+        num::EllMatrix<scalar_t, index_t> const& matrix;
+        VectorX<scalar_t> const& x;
+        VectorX<scalar_t>& y;
+        acc_t& m2;
+        acc_t& m3;
+
+        template<int width> CPB_ALWAYS_INLINE
+        void run() {
+            scalar_t const* data[width];
+            index_t const* indices[width];
+            for (auto n = 0; n < width; ++n) {
+                data[n] = &matrix.data(0, n);
+                indices[n] = &matrix.indices(0, n);
+            }
+
+            for (auto row = start; row < end; ++row) {
+                auto r2 = -y[row];
+                for (auto n = 0; n < width; ++n) { // constant trip count: fully unrolled
+                    r2 += mul(data[n][row], x[indices[n][row]]);
+                }
+                y[row] = r2;
+
+                auto const a = static_cast<acc_t>(x[row]); // see `accumulate_diagonal()`
+                auto const b = static_cast<acc_t>(r2);
+                m2 += square(a);
+                m3 += mul(num::conjugate(b), a);
+            }
+        }
+    };
+} // namespace detail
+
+template<class scalar_t, class index_t, class acc_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(int start, int end, num::EllMatrix<scalar_t, index_t> const& matrix,
                        VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
-                       scalar_t& m2, scalar_t& m3) {
+                       acc_t& m2, acc_t& m3) {
+    if (!matrix.has_data()) {
+        detail::indexed_spmv(start, end, matrix, x, y);
+        detail::accumulate_diagonal(start, end, x, y, m2, m3);
+        return;
+    }
+    if (!matrix.is_compressed()) {
+        auto kernel = detail::EllFixedDiagonal<scalar_t, index_t, acc_t>{start, end, matrix,
+                                                                          x, y, m2, m3};
+        if (detail::with_fixed_width(matrix.nnz_per_row, kernel)) {
+            return;
+        }
+    }
+
     kpm_spmv(start, end, matrix, x, y);
-    auto const size = end - start;
-    m2 += x.segment(start, size).squaredNorm();
-    m3 += y.segment(start, size).dot(x.segment(start, size));
+    detail::accumulate_diagonal(start, end, x, y, m2, m3);
 }
 
 #else // vectorized using SIMD intrinsics
 
-template<class scalar_t> CPB_ALWAYS_INLINE
-void kpm_spmv_diagonal(int start, int end, num::EllMatrix<scalar_t> const& matrix,
+namespace detail {
+    /// Row-wise ELLPACK diagonal product for a compile-time number of nonzeros per row.
+    /// All the columns of a row register are summed before `y` is stored, so `y` is read
+    /// and written only once instead of once per column, and the m2 and m3 sums are fused
+    /// into the same loop. The fixed trip count lets the compiler keep the column pointers
+    /// in registers.
+    template<class scalar_t, class index_t, class acc_t>
+    struct EllFixedDiagonal {
+        int start, end;
+        num::EllMatrix<scalar_t, index_t> const& matrix;
+        VectorX<scalar_t> const& x;
+        VectorX<scalar_t>& y;
+        acc_t& m2;
+        acc_t& m3;
+
+        template<int width> CPB_ALWAYS_INLINE
+        scalar_t row_sum(scalar_t const* const* data, index_t const* const* indices,
+                         int row) const {
+            auto r2 = -y[row];
+            for (auto n = 0; n < width; ++n) {
+                r2 += mul(data[n][row], x[indices[n][row]]);
+            }
+            return r2;
+        }
+
+        template<int width> CPB_ALWAYS_INLINE
+        void run() {
+            using simd_register_t = simd::select_vector_t<scalar_t>;
+            scalar_t const* data[width];
+            index_t const* indices[width];
+            for (auto n = 0; n < width; ++n) {
+                data[n] = &matrix.data(0, n);
+                indices[n] = &matrix.indices(0, n);
+            }
+
+            auto const loop = simd::split_loop(y.data(), start, end);
+            auto m2_vec = simd::make_float<simd_register_t>(0);
+            auto m3_vec = simd::make_float<simd_register_t>(0);
+            constexpr auto flush_interval = std::is_same<scalar_t, acc_t>::value ? 0 : 64;
+            auto flush_counter = 0;
+
+            for (auto row = loop.start; row < loop.peel_end; ++row) {
+                auto const r1 = x[row];
+                auto const r2 = row_sum<width>(data, indices, row);
+                m2 += square(r1);
+                m3 += mul(num::conjugate(r2), r1);
+                y[row] = r2;
+            }
+            for (auto row = loop.peel_end; row < loop.vec_end; row += loop.step) {
+                simd_register_t r2 = simd::neg(simd::load<simd_register_t>(y.data() + row));
+                for (auto n = 0; n < width; ++n) { // constant trip count: fully unrolled
+                    auto const a = simd::load<simd_register_t>(data[n] + row);
+                    auto const b = simd::gather<simd_register_t>(x.data(), indices[n] + row);
+                    r2 = simd::madd_rc<scalar_t>(a, b, r2);
+                }
+
+                auto const r1 = simd::load<simd_register_t>(x.data() + row);
+                m2_vec = m2_vec + r1 * r1;
+                m3_vec = simd::conjugate_madd_rc<scalar_t>(r2, r1, m3_vec);
+                simd::store(y.data() + row, r2);
+
+                if (flush_interval && ++flush_counter == flush_interval) {
+                    m2 += simd::reduce_add(m2_vec);
+                    m3 += simd::reduce_add_rc<scalar_t>(m3_vec);
+                    m2_vec = simd::make_float<simd_register_t>(0);
+                    m3_vec = simd::make_float<simd_register_t>(0);
+                    flush_counter = 0;
+                }
+            }
+            for (auto row = loop.vec_end; row < loop.end; ++row) {
+                auto const r1 = x[row];
+                auto const r2 = row_sum<width>(data, indices, row);
+                m2 += square(r1);
+                m3 += mul(num::conjugate(r2), r1);
+                y[row] = r2;
+            }
+
+            m2 += simd::reduce_add(m2_vec);
+            m3 += simd::reduce_add_rc<scalar_t>(m3_vec);
+        }
+    };
+} // namespace detail
+
+template<class scalar_t, class index_t, class acc_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(int start, int end, num::EllMatrix<scalar_t, index_t> const& matrix,
                        VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
-                       scalar_t& m2, scalar_t& m3) {
+                       acc_t& m2, acc_t& m3) {
+    if (!matrix.has_data()) {
+        detail::indexed_spmv(start, end, matrix, x, y);
+        detail::accumulate_diagonal(start, end, x, y, m2, m3);
+        return;
+    }
+    if (!matrix.is_compressed()) {
+        // Even with a dispatched column kernel: the row-wise kernel reads and writes `y`
+        // once instead of once per column, which saves more than the wider gathers
+        auto kernel = detail::EllFixedDiagonal<scalar_t, index_t, acc_t>{start, end, matrix,
+                                                                          x, y, m2, m3};
+        if (detail::with_fixed_width(matrix.nnz_per_row, kernel)) {
+            return;
+        }
+    }
+
+    if (matrix.is_compressed()) {
+        // The fused last iteration below is only done for full column indices
+        kpm_spmv(start, end, matrix, x, y);
+        detail::accumulate_diagonal(start, end, x, y, m2, m3);
+        return;
+    }
+
     // Call the regular compute function, but skip the last loop iteration.
     auto const loop = kpm_spmv<scalar_t, 1>(start, end, matrix, x, y);
 
@@ -200,6 +647,11 @@ void kpm_spmv_diagonal(int start, int end, num::EllMatrix<scalar_t> const& matri
     auto m2_vec = simd::make_float<simd_register_t>(0);
     auto m3_vec = simd::make_float<simd_register_t>(0);
 
+    // With a higher precision accumulator (mixed precision), the SIMD registers only
+    // hold short partial sums which are regularly flushed into `m2` and `m3`
+    constexpr auto flush_interval = std::is_same<scalar_t, acc_t>::value ? 0 : 64;
+    auto flush_counter = 0;
+
     for (auto row = loop.start; row < loop.peel_end; ++row) {
         auto const r1 = x[row];
         auto const r2 = y[row] + detail::mul(data[row], x[indices[row]]);
@@ -218,6 +670,14 @@ void kpm_spmv_diagonal(int start, int end, num::EllMatrix<scalar_t> const& matri
         m3_vec = simd::conjugate_madd_rc<scalar_t>(r2, r1, m3_vec);
 
         simd::store(y.data() + row, r2);
+
+        if (flush_interval && ++flush_counter == flush_interval) {
+            m2 += simd::reduce_add(m2_vec);
+            m3 += simd::reduce_add_rc<scalar_t>(m3_vec);
+            m2_vec = simd::make_float<simd_register_t>(0);
+            m3_vec = simd::make_float<simd_register_t>(0);
+            flush_counter = 0;
+        }
     }
     for (auto row = loop.vec_end; row < loop.end; ++row) {
         auto const r1 = x[row];
@@ -232,4 +692,844 @@ void kpm_spmv_diagonal(int start, int end, num::EllMatrix<scalar_t> const& matri
 }
 
 #endif // SIMDPP_USE_NULL
+
+namespace detail {
+    /// One column of a split-complex ELLPACK matrix, see `EllMatrix::split()`
+    template<class real_t, class Index>
+    struct SplitColumn {
+        real_t const* re;
+        real_t const* im;
+        Index const* indices;
+        int block; ///< rows per block of compressed offsets or 0 for full column indices
+
+        CPB_ALWAYS_INLINE int column(int row) const {
+            return (block ? row - row % block : 0) + static_cast<int>(indices[row]);
+        }
+    };
+
+    template<class real_t, class Index> CPB_ALWAYS_INLINE
+    void split_row_spmv(int row, SplitColumn<real_t, Index> const& a,
+                        num::SplitVector<real_t> const& x, num::SplitVector<real_t>& y) {
+        auto const col = a.column(row);
+        y.real[row] += a.re[row] * x.real[col] - a.im[row] * x.imag[col];
+        y.imag[row] += a.re[row] * x.imag[col] + a.im[row] * x.real[col];
+    }
+
+    /// `y += a * x[indices]` for a single split-complex column: no lane shuffles are needed
+    template<class real_t, class Index> CPB_ALWAYS_INLINE
+    void split_column_spmv(int start, int end, SplitColumn<real_t, Index> const& a,
+                           num::SplitVector<real_t> const& x, num::SplitVector<real_t>& y) {
+        // The planes of the matrix and the vectors share the same alignment
+        auto loop = simd::split_loop(y.real.data(), start, end);
+#if SIMDPP_USE_NULL
+        loop.vec_end = loop.peel_end;
+#else
+        if (a.block && (loop.peel_end % loop.step != 0 || a.block % loop.step != 0)) {
+            loop.vec_end = loop.peel_end; // same as `kpm_spmv()` for compressed offsets
+        }
+#endif
+
+        for (auto row = loop.start; row < loop.peel_end; ++row) {
+            split_row_spmv(row, a, x, y);
+        }
+#if !SIMDPP_USE_NULL
+        using simd_register_t = simd::select_vector_t<real_t>;
+        for (auto row = loop.peel_end; row < loop.vec_end; row += loop.step) {
+            auto const origin = a.block ? row - row % a.block : 0;
+            auto const a_re = simd::load<simd_register_t>(a.re + row);
+            auto const a_im = simd::load<simd_register_t>(a.im + row);
+            auto const x_re = simd::gather<simd_register_t>(x.real.data() + origin,
+                                                            a.indices + row);
+            auto const x_im = simd::gather<simd_register_t>(x.imag.data() + origin,
+                                                            a.indices + row);
+            auto y_re = simd::load<simd_register_t>(y.real.data() + row);
+            auto y_im = simd::load<simd_register_t>(y.imag.data() + row);
+            y_re = y_re + a_re * x_re - a_im * x_im;
+            y_im = y_im + a_re * x_im + a_im * x_re;
+            simd::store(y.real.data() + row, y_re);
+            simd::store(y.imag.data() + row, y_im);
+        }
+#endif // !SIMDPP_USE_NULL
+        for (auto row = loop.vec_end; row < loop.end; ++row) {
+            split_row_spmv(row, a, x, y);
+        }
+    }
+
+    template<class real_t> CPB_ALWAYS_INLINE
+    void accumulate_diagonal(int start, int end, num::SplitVector<real_t> const& x,
+                             num::SplitVector<real_t> const& y,
+                             std::complex<real_t>& m2, std::complex<real_t>& m3) {
+        auto const size = end - start;
+        auto const x_re = x.real.segment(start, size);
+        auto const x_im = x.imag.segment(start, size);
+        auto const y_re = y.real.segment(start, size);
+        auto const y_im = y.imag.segment(start, size);
+        m2 += x_re.squaredNorm() + x_im.squaredNorm();
+        m3 += std::complex<real_t>{y_re.dot(x_re) + y_im.dot(x_im),
+                                   y_re.dot(x_im) - y_im.dot(x_re)};
+    }
+
+    /// Same as above, but with a higher precision accumulator type `acc_t` (mixed precision)
+    template<class real_t, class acc_t> CPB_ALWAYS_INLINE
+    void accumulate_diagonal(int start, int end, num::SplitVector<real_t> const& x,
+                             num::SplitVector<real_t> const& y, acc_t& m2, acc_t& m3) {
+        for (auto row = start; row < end; ++row) {
+            auto const a = acc_t{x.real[row], x.imag[row]};
+            auto const b = acc_t{y.real[row], y.imag[row]};
+            m2 += square(a);
+            m3 += mul(num::conjugate(b), a);
+        }
+    }
+} // namespace detail
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (split-complex ELLPACK, diagonal)
+
+ Same as the interleaved version above, but the matrix values (see `EllMatrix::split()`)
+ and the vectors are stored as separate real and imaginary planes.
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class real_t, class index_t, class acc_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(int start, int end,
+                       num::EllMatrix<std::complex<real_t>, index_t> const& matrix,
+                       num::SplitVector<real_t> const& x, num::SplitVector<real_t>& y,
+                       acc_t& m2, acc_t& m3) {
+    assert(matrix.is_split());
+    auto const size = end - start;
+    y.real.segment(start, size) = -y.real.segment(start, size);
+    y.imag.segment(start, size) = -y.imag.segment(start, size);
+
+    auto const block = static_cast<int>(matrix.offset_block);
+    for (auto n = 0; n < matrix.nnz_per_row; ++n) {
+        auto const re = &matrix.data_real(0, n);
+        auto const im = &matrix.data_imag(0, n);
+        if (matrix.is_compressed()) {
+            using Column = detail::SplitColumn<real_t, typename num::EllMatrix<
+                std::complex<real_t>, index_t>::offset_t>;
+            detail::split_column_spmv(start, end, Column{re, im, &matrix.offsets(0, n), block},
+                                      x, y);
+        } else {
+            using Column = detail::SplitColumn<real_t, index_t>;
+            detail::split_column_spmv(start, end, Column{re, im, &matrix.indices(0, n), 0},
+                                      x, y);
+        }
+    }
+
+    detail::accumulate_diagonal(start, end, x, y, m2, m3);
+}
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (ELLPACK row block, diagonal)
+
+ Rows [start, end) must be inside of the `block`, see `kpm::MatrixStream`. The vectors
+ have the size of the full matrix. Plain loops: the out-of-core matrix is limited by I/O.
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t, class index_t, class acc_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(int start, int end, num::EllRowBlock<scalar_t, index_t> const& block,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       acc_t& m2, acc_t& m3) {
+    assert(start >= block.first_row && end <= block.last_row);
+    auto const size = end - start;
+    y.segment(start, size) = -y.segment(start, size);
+
+    auto const offset = start - block.first_row;
+    auto const y_data = y.data() + start;
+    for (auto n = 0; n < block.nnz_per_row(); ++n) {
+        auto const data = &block.data(offset, n);
+        auto const indices = &block.indices(offset, n);
+        for (auto i = 0; i < size; ++i) {
+            y_data[i] += detail::mul(data[i], x[indices[i]]);
+        }
+    }
+
+    detail::accumulate_diagonal(start, end, x, y, m2, m3);
+}
+
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (indexed ELLPACK, diagonal)
+
+ Same as the regular ELLPACK version, but the values are gathered from the table of
+ distinct values using the 8-bit `value_ids`, see `EllMatrix::index_values()`.
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t, class index_t, class acc_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(int start, int end, num::IndexedEllRef<scalar_t, index_t> const& ref,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       acc_t& m2, acc_t& m3) {
+    detail::indexed_spmv(start, end, ref.matrix, x, y);
+    detail::accumulate_diagonal(start, end, x, y, m2, m3);
+}
+
+namespace detail {
+    /// One column of a reduced precision ELLPACK matrix, see `EllMatrix::reduce_precision()`
+    template<class scalar_t, class Index>
+    struct ReducedColumn {
+        static constexpr auto parts = num::is_complex<scalar_t>() ? 2 : 1;
+
+        num::bfloat16_t const* values; ///< `parts` values for each row
+        Index const* indices;
+        int block; ///< rows per block of compressed offsets or 0 for full column indices
+
+        CPB_ALWAYS_INLINE int column(int row) const {
+            return (block ? row - row % block : 0) + static_cast<int>(indices[row]);
+        }
+
+        CPB_ALWAYS_INLINE scalar_t value(int row) const {
+            return num::bfloat16_value<scalar_t>(values + row * parts);
+        }
+    };
+
+    /// `y += values * x[indices]` for a single column. The bfloat16 values are converted
+    /// to `scalar_t` in registers: the vectors and the arithmetic keep the full precision.
+    template<class scalar_t, class Index> CPB_ALWAYS_INLINE
+    void reduced_column_spmv(int start, int end, ReducedColumn<scalar_t, Index> const& a,
+                             scalar_t const* x, scalar_t* y) {
+        auto loop = simd::split_loop(y, start, end);
+#if SIMDPP_USE_NULL
+        loop.vec_end = loop.peel_end;
+#else
+        if (a.block && (loop.peel_end % loop.step != 0 || a.block % loop.step != 0)) {
+            loop.vec_end = loop.peel_end; // same as `kpm_spmv()` for compressed offsets
+        }
+#endif
+
+        for (auto row = loop.start; row < loop.peel_end; ++row) {
+            y[row] += mul(a.value(row), x[a.column(row)]);
+        }
+#if !SIMDPP_USE_NULL
+        using simd_register_t = simd::select_vector_t<scalar_t>;
+        for (auto row = loop.peel_end; row < loop.vec_end; row += loop.step) {
+            auto const origin = a.block ? row - row % a.block : 0;
+            auto const v = simd::load_bfloat16<simd_register_t>(a.values + row * a.parts);
+            auto const b = simd::gather<simd_register_t>(x + origin, a.indices + row);
+            auto const c = simd::load<simd_register_t>(y + row);
+            simd::store(y + row, simd::madd_rc<scalar_t>(v, b, c));
+        }
+#endif // !SIMDPP_USE_NULL
+        for (auto row = loop.vec_end; row < loop.end; ++row) {
+            y[row] += mul(a.value(row), x[a.column(row)]);
+        }
+    }
+} // namespace detail
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (reduced precision ELLPACK, diagonal)
+
+ Same as the regular ELLPACK version, but the matrix values are read from the bfloat16
+ copy, see `EllMatrix::reduce_precision()`. The result differs from the full precision
+ one by the rounding of the matrix values (relative 2^-9).
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t, class index_t, class acc_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(int start, int end, num::ReducedEllRef<scalar_t, index_t> const& ref,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       acc_t& m2, acc_t& m3) {
+    auto const& matrix = ref.matrix;
+    assert(matrix.is_reduced());
+    auto const size = end - start;
+    y.segment(start, size) = -y.segment(start, size);
+
+    auto const block = static_cast<int>(matrix.offset_block);
+    for (auto n = 0; n < matrix.nnz_per_row; ++n) {
+        auto const values = &matrix.reduced(0, n);
+        if (matrix.is_compressed()) {
+            using Column = detail::ReducedColumn<scalar_t, typename num::EllMatrix<
+                scalar_t, index_t>::offset_t>;
+            detail::reduced_column_spmv(start, end, Column{values, &matrix.offsets(0, n), block},
+                                        x.data(), y.data());
+        } else {
+            using Column = detail::ReducedColumn<scalar_t, index_t>;
+            detail::reduced_column_spmv(start, end, Column{values, &matrix.indices(0, n), 0},
+                                        x.data(), y.data());
+        }
+    }
+
+    detail::accumulate_diagonal(start, end, x, y, m2, m3);
+}
+
+namespace detail {
+    /// Rows [first, last) of a single SELL chunk: `x` points to the origin of the column
+    /// `indices`, i.e. to the first row of the chunk if the indices are compressed offsets
+    template<class scalar_t, class Index> CPB_ALWAYS_INLINE
+    void sell_chunk_spmv(int first, int last, int chunk_start, int chunk_size, int width,
+                         scalar_t const* data, Index const* indices,
+                         scalar_t const* x, scalar_t* y) {
+#if !SIMDPP_USE_NULL
+        using simd_register_t = simd::select_vector_t<scalar_t>;
+        constexpr auto step = static_cast<int>(simd::detail::traits<scalar_t>::size);
+
+        if (chunk_size == step && first == chunk_start && last == chunk_start + step) {
+            // A full chunk fits exactly into a single register which is kept for all `n`
+            auto r = simd::neg(simd::load<simd_register_t>(y + first));
+            for (auto n = 0; n < width; ++n) {
+                auto const a = simd::load<simd_register_t>(data + n * step);
+                auto const b = simd::gather<simd_register_t>(x, indices + n * step);
+                r = simd::madd_rc<scalar_t>(a, b, r);
+            }
+            simd::store(y + first, r);
+            return;
+        }
+#endif // !SIMDPP_USE_NULL
+
+        for (auto row = first; row < last; ++row) {
+            auto r = -y[row];
+            for (auto n = 0; n < width; ++n) {
+                auto const k = n * chunk_size + (row - chunk_start);
+                r += mul(data[k], x[indices[k]]);
+            }
+            y[row] = r;
+        }
+    }
+} // namespace detail
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (SELL-C-sigma, off-diagonal)
+
+ Equivalent to: y = matrix * x - y
+
+ The [start, end) range doesn't need to be aligned to the chunks: partial chunks
+ at the edges are computed with scalar code. Compressed 16-bit column offsets are
+ resolved by gathering relative to the first row of each chunk.
+ */
+template<class scalar_t, class index_t> CPB_ALWAYS_INLINE
+void kpm_spmv(int start, int end, num::SellMatrix<scalar_t, index_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    if (end <= start) {
+        return;
+    }
+
+    auto const chunk_size = static_cast<int>(matrix.chunk_size);
+    for (auto chunk = start / chunk_size; chunk <= (end - 1) / chunk_size; ++chunk) {
+        auto const chunk_start = chunk * chunk_size;
+        auto const first = std::max(start, chunk_start);
+        auto const last = std::min(end, chunk_start + chunk_size);
+        auto const width = static_cast<int>(matrix.chunk_width[chunk]);
+        auto const data = matrix.data.data() + matrix.chunk_ptr[chunk];
+
+        if (matrix.is_compressed()) {
+            auto const offsets = matrix.offsets.data() + matrix.chunk_ptr[chunk];
+            detail::sell_chunk_spmv(first, last, chunk_start, chunk_size, width, data,
+                                    offsets, x.data() + chunk_start, y.data());
+        } else {
+            auto const indices = matrix.indices.data() + matrix.chunk_ptr[chunk];
+            detail::sell_chunk_spmv(first, last, chunk_start, chunk_size, width, data,
+                                    indices, x.data(), y.data());
+        }
+    }
+}
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (SELL-C-sigma, diagonal)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t, class index_t, class acc_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(int start, int end, num::SellMatrix<scalar_t, index_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       acc_t& m2, acc_t& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    detail::accumulate_diagonal(start, end, x, y, m2, m3);
+}
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (upper triangle, off-diagonal)
+
+ Equivalent to: y = matrix * x - y
+
+ The transposed scatter of each element writes to other rows, so this always covers the
+ whole matrix: `start` and `end` must be the full range.
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(int start, int end, num::SymmetricMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    assert(start == 0 && end == matrix.rows());
+    auto const data = matrix.upper.valuePtr();
+    auto const indices = matrix.upper.innerIndexPtr();
+    auto const indptr = matrix.upper.outerIndexPtr();
+
+    for (auto row = start; row < end; ++row) {
+        y[row] = -y[row];
+    }
+    for (auto row = start; row < end; ++row) {
+        auto const x_row = x[row];
+        auto r = detail::mul(data[indptr[row]], x_row); // diagonal
+        for (auto n = indptr[row] + 1; n < indptr[row + 1]; ++n) {
+            auto const col = indices[n];
+            r += detail::mul(data[n], x[col]);
+            y[col] += detail::mul(num::conjugate(data[n]), x_row);
+        }
+        y[row] += r;
+    }
+}
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (upper triangle, diagonal)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t, class acc_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(int start, int end, num::SymmetricMatrix<scalar_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       acc_t& m2, acc_t& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    detail::accumulate_diagonal(start, end, x, y, m2, m3);
+}
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (real bulk + complex boundary)
+
+ Equivalent to: y = matrix * x - y
+
+ The bulk is real CSR times the complex vector. The few boundary rows within the range are
+ found with a binary search and their complex elements are added on top.
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(int start, int end, num::BulkBoundaryMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    auto const data = matrix.bulk.valuePtr();
+    auto const indices = matrix.bulk.innerIndexPtr();
+    auto const indptr = matrix.bulk.outerIndexPtr();
+
+    for (auto row = start; row < end; ++row) {
+        auto r = scalar_t{0};
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            r += detail::mul(data[n], x[indices[n]]);
+        }
+        y[row] = r - y[row];
+    }
+
+    auto const b_data = matrix.boundary.valuePtr();
+    auto const b_indices = matrix.boundary.innerIndexPtr();
+    auto const b_indptr = matrix.boundary.outerIndexPtr();
+    auto const num_boundary_rows = static_cast<int>(matrix.boundary_rows.size());
+    for (auto k = matrix.first_boundary_row(start); k < num_boundary_rows; ++k) {
+        auto const row = matrix.boundary_rows[k];
+        if (row >= end) { break; }
+
+        auto r = scalar_t{0};
+        for (auto n = b_indptr[k]; n < b_indptr[k + 1]; ++n) {
+            r += detail::mul(b_data[n], x[b_indices[n]]);
+        }
+        y[row] += r;
+    }
+}
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (real bulk + complex boundary, diagonal)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t, class acc_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(int start, int end, num::BulkBoundaryMatrix<scalar_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       acc_t& m2, acc_t& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    detail::accumulate_diagonal(start, end, x, y, m2, m3);
+}
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (permuted CSR, off-diagonal)
+
+ Equivalent to: y = matrix * x - y
+
+ The vectors are in the permuted order: each row is read from its original row of the
+ shared matrix and the columns are mapped back to permuted indices, see `num::PermutedMatrix`.
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(int start, int end, num::PermutedMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    auto const data = matrix.matrix->valuePtr();
+    auto const indices = matrix.matrix->innerIndexPtr();
+    auto const indptr = matrix.matrix->outerIndexPtr();
+    auto const order = matrix.order.data();
+    auto const position = matrix.position.data();
+
+    for (auto row = start; row < end; ++row) {
+        auto const original = order[row];
+        auto r = scalar_t{0};
+        for (auto n = indptr[original]; n < indptr[original + 1]; ++n) {
+            r += detail::mul(data[n], x[position[indices[n]]]);
+        }
+        y[row] = r - y[row];
+    }
+}
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (permuted CSR, diagonal)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t, class acc_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(int start, int end, num::PermutedMatrix<scalar_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       acc_t& m2, acc_t& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    detail::accumulate_diagonal(start, end, x, y, m2, m3);
+}
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (BSR, off-diagonal)
+
+ Equivalent to: y = matrix * x - y
+
+ Each row reads one column index per block followed by `block_size` contiguous values
+ and vector elements, see `num::BsrMatrix`.
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmv(int start, int end, num::BsrMatrix<scalar_t> const& matrix,
+              VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    auto const data = matrix.data.data();
+    auto const block_cols = matrix.block_cols.data();
+    auto const block_ptr = matrix.block_ptr.data();
+    auto const block_size = matrix.block_size;
+
+    for (auto row = start; row < end; ++row) {
+        auto const i = row / block_size;
+        auto const r = row - i * block_size;
+        auto sum = scalar_t{0};
+        for (auto k = block_ptr[i]; k < block_ptr[i + 1]; ++k) {
+            auto const values = data + (k * block_size + r) * block_size;
+            auto const x_block = x.data() + block_cols[k] * block_size;
+            for (auto c = 0; c < block_size; ++c) {
+                sum += detail::mul(values[c], x_block[c]);
+            }
+        }
+        y[row] = sum - y[row];
+    }
+}
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (BSR, diagonal)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2
+   m3 = dot(x, y)
+ */
+template<class scalar_t, class acc_t> CPB_ALWAYS_INLINE
+void kpm_spmv_diagonal(int start, int end, num::BsrMatrix<scalar_t> const& matrix,
+                       VectorX<scalar_t> const& x, VectorX<scalar_t>& y,
+                       acc_t& m2, acc_t& m3) {
+    kpm_spmv(start, end, matrix, x, y);
+    detail::accumulate_diagonal(start, end, x, y, m2, m3);
+}
+
+/**
+ KPM-specialized sparse matrix-vector multiplication (any format, damped)
+
+ Equivalent to: y = damping * (matrix * x - y)  <- elementwise, one `damping` factor per row
+
+ The rows are multiplied in chunks and each chunk is scaled right after, while it's still
+ in cache, instead of a second pass over the whole vector.
+ */
+template<class Matrix, class scalar_t = typename Matrix::Scalar,
+         class real_t = num::get_real_t<scalar_t>> CPB_ALWAYS_INLINE
+void kpm_spmv_damped(int start, int end, Matrix const& matrix, VectorX<scalar_t> const& x,
+                     VectorX<scalar_t>& y, ArrayX<real_t> const& damping) {
+    constexpr auto chunk_size = 256;
+    for (auto first = start; first < end; first += chunk_size) {
+        auto const size = std::min(chunk_size, end - first);
+        kpm_spmv(first, first + size, matrix, x, y);
+        y.segment(first, size).array() *= damping.segment(first, size)
+                                                  .template cast<scalar_t>();
+    }
+}
+
+/**
+ KPM-specialized sparse matrix-matrix multiplication (CSR, block of vectors)
+
+ Equivalent to: y = matrix * x - y
+
+ Each row of `x` and `y` holds one entry of every vector in the block (row-major storage).
+ This way each matrix element is loaded only once per iteration for the entire block and
+ the innermost loop over the block is contiguous in memory (easy to auto-vectorize).
+ */
+template<class scalar_t, class index_t> CPB_ALWAYS_INLINE
+void kpm_spmm(int start, int end, SparseMatrixX<scalar_t, index_t> const& matrix,
+              RowMajorMatrixX<scalar_t> const& x, RowMajorMatrixX<scalar_t>& y) {
+    auto const data = matrix.valuePtr();
+    auto const indices = matrix.innerIndexPtr();
+    auto const indptr = matrix.outerIndexPtr();
+    auto const block_size = static_cast<int>(x.cols());
+
+    for (auto row = start; row < end; ++row) {
+        auto const y_row = y.data() + row * block_size;
+        for (auto b = 0; b < block_size; ++b) {
+            y_row[b] = -y_row[b];
+        }
+
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            auto const a = data[n];
+            auto const x_row = x.data() + indices[n] * block_size;
+            for (auto b = 0; b < block_size; ++b) {
+                y_row[b] += detail::mul(a, x_row[b]);
+            }
+        }
+    }
+}
+
+/**
+ KPM-specialized sparse matrix-matrix multiplication (ELLPACK, block of vectors)
+
+ Equivalent to: y = matrix * x - y
+ */
+template<class scalar_t, class index_t> CPB_ALWAYS_INLINE
+void kpm_spmm(int start, int end, num::EllMatrix<scalar_t, index_t> const& matrix,
+              RowMajorMatrixX<scalar_t> const& x, RowMajorMatrixX<scalar_t>& y) {
+    auto const block_size = static_cast<int>(x.cols());
+
+    for (auto row = start; row < end; ++row) {
+        auto const y_row = y.data() + row * block_size;
+        for (auto b = 0; b < block_size; ++b) {
+            y_row[b] = -y_row[b];
+        }
+
+        for (auto n = 0; n < matrix.nnz_per_row; ++n) {
+            auto const a = matrix.value(row, n);
+            auto const x_row = x.data() + matrix.column(row, n) * block_size;
+            for (auto b = 0; b < block_size; ++b) {
+                y_row[b] += detail::mul(a, x_row[b]);
+            }
+        }
+    }
+}
+
+/**
+ KPM-specialized sparse matrix-matrix multiplication (SELL-C-sigma, block of vectors)
+
+ Equivalent to: y = matrix * x - y
+ */
+template<class scalar_t, class index_t> CPB_ALWAYS_INLINE
+void kpm_spmm(int start, int end, num::SellMatrix<scalar_t, index_t> const& matrix,
+              RowMajorMatrixX<scalar_t> const& x, RowMajorMatrixX<scalar_t>& y) {
+    auto const block_size = static_cast<int>(x.cols());
+
+    for (auto row = start; row < end; ++row) {
+        auto const y_row = y.data() + row * block_size;
+        for (auto b = 0; b < block_size; ++b) {
+            y_row[b] = -y_row[b];
+        }
+
+        matrix.for_each_in_row(row, [&](index_t col, scalar_t a) {
+            auto const x_row = x.data() + col * block_size;
+            for (auto b = 0; b < block_size; ++b) {
+                y_row[b] += detail::mul(a, x_row[b]);
+            }
+        });
+    }
+}
+
+/**
+ KPM-specialized sparse matrix-matrix multiplication (upper triangle, block of vectors)
+
+ Equivalent to: y = matrix * x - y, always for the whole matrix, see `kpm_spmv()` above
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmm(int start, int end, num::SymmetricMatrix<scalar_t> const& matrix,
+              RowMajorMatrixX<scalar_t> const& x, RowMajorMatrixX<scalar_t>& y) {
+    assert(start == 0 && end == matrix.rows());
+    auto const data = matrix.upper.valuePtr();
+    auto const indices = matrix.upper.innerIndexPtr();
+    auto const indptr = matrix.upper.outerIndexPtr();
+    auto const block_size = static_cast<int>(x.cols());
+
+    for (auto row = start; row < end; ++row) {
+        auto const y_row = y.data() + row * block_size;
+        for (auto b = 0; b < block_size; ++b) {
+            y_row[b] = -y_row[b];
+        }
+    }
+
+    for (auto row = start; row < end; ++row) {
+        auto const x_row = x.data() + row * block_size;
+        auto const y_row = y.data() + row * block_size;
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            auto const col = indices[n];
+            auto const a = data[n];
+            auto const x_col = x.data() + col * block_size;
+            for (auto b = 0; b < block_size; ++b) {
+                y_row[b] += detail::mul(a, x_col[b]);
+            }
+            if (col == row) { continue; } // diagonal
+
+            auto const a_conj = num::conjugate(a);
+            auto const y_col = y.data() + col * block_size;
+            for (auto b = 0; b < block_size; ++b) {
+                y_col[b] += detail::mul(a_conj, x_row[b]);
+            }
+        }
+    }
+}
+
+/**
+ KPM-specialized sparse matrix-matrix multiplication (real bulk + complex boundary, block)
+
+ Equivalent to: y = matrix * x - y
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmm(int start, int end, num::BulkBoundaryMatrix<scalar_t> const& matrix,
+              RowMajorMatrixX<scalar_t> const& x, RowMajorMatrixX<scalar_t>& y) {
+    auto const data = matrix.bulk.valuePtr();
+    auto const indices = matrix.bulk.innerIndexPtr();
+    auto const indptr = matrix.bulk.outerIndexPtr();
+    auto const block_size = static_cast<int>(x.cols());
+
+    for (auto row = start; row < end; ++row) {
+        auto const y_row = y.data() + row * block_size;
+        for (auto b = 0; b < block_size; ++b) {
+            y_row[b] = -y_row[b];
+        }
+
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            auto const a = data[n];
+            auto const x_row = x.data() + indices[n] * block_size;
+            for (auto b = 0; b < block_size; ++b) {
+                y_row[b] += detail::mul(a, x_row[b]);
+            }
+        }
+    }
+
+    auto const b_data = matrix.boundary.valuePtr();
+    auto const b_indices = matrix.boundary.innerIndexPtr();
+    auto const b_indptr = matrix.boundary.outerIndexPtr();
+    auto const num_boundary_rows = static_cast<int>(matrix.boundary_rows.size());
+    for (auto k = matrix.first_boundary_row(start); k < num_boundary_rows; ++k) {
+        auto const row = matrix.boundary_rows[k];
+        if (row >= end) { break; }
+
+        auto const y_row = y.data() + row * block_size;
+        for (auto n = b_indptr[k]; n < b_indptr[k + 1]; ++n) {
+            auto const a = b_data[n];
+            auto const x_row = x.data() + b_indices[n] * block_size;
+            for (auto b = 0; b < block_size; ++b) {
+                y_row[b] += detail::mul(a, x_row[b]);
+            }
+        }
+    }
+}
+
+/**
+ KPM-specialized sparse matrix-matrix multiplication (permuted CSR, block of vectors)
+
+ Equivalent to: y = matrix * x - y
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmm(int start, int end, num::PermutedMatrix<scalar_t> const& matrix,
+              RowMajorMatrixX<scalar_t> const& x, RowMajorMatrixX<scalar_t>& y) {
+    auto const data = matrix.matrix->valuePtr();
+    auto const indices = matrix.matrix->innerIndexPtr();
+    auto const indptr = matrix.matrix->outerIndexPtr();
+    auto const order = matrix.order.data();
+    auto const position = matrix.position.data();
+    auto const block_size = static_cast<int>(x.cols());
+
+    for (auto row = start; row < end; ++row) {
+        auto const y_row = y.data() + row * block_size;
+        for (auto b = 0; b < block_size; ++b) {
+            y_row[b] = -y_row[b];
+        }
+
+        auto const original = order[row];
+        for (auto n = indptr[original]; n < indptr[original + 1]; ++n) {
+            auto const a = data[n];
+            auto const x_row = x.data() + position[indices[n]] * block_size;
+            for (auto b = 0; b < block_size; ++b) {
+                y_row[b] += detail::mul(a, x_row[b]);
+            }
+        }
+    }
+}
+
+/**
+ KPM-specialized sparse matrix-matrix multiplication (BSR, block of vectors)
+
+ Equivalent to: y = matrix * x - y
+ */
+template<class scalar_t> CPB_ALWAYS_INLINE
+void kpm_spmm(int start, int end, num::BsrMatrix<scalar_t> const& matrix,
+              RowMajorMatrixX<scalar_t> const& x, RowMajorMatrixX<scalar_t>& y) {
+    auto const data = matrix.data.data();
+    auto const block_cols = matrix.block_cols.data();
+    auto const block_ptr = matrix.block_ptr.data();
+    auto const matrix_block = matrix.block_size;
+    auto const block_size = static_cast<int>(x.cols());
+
+    for (auto row = start; row < end; ++row) {
+        auto const y_row = y.data() + row * block_size;
+        for (auto b = 0; b < block_size; ++b) {
+            y_row[b] = -y_row[b];
+        }
+
+        auto const i = row / matrix_block;
+        auto const r = row - i * matrix_block;
+        for (auto k = block_ptr[i]; k < block_ptr[i + 1]; ++k) {
+            auto const values = data + (k * matrix_block + r) * matrix_block;
+            auto const first_col = block_cols[k] * matrix_block;
+            for (auto c = 0; c < matrix_block; ++c) {
+                auto const a = values[c];
+                auto const x_row = x.data() + (first_col + c) * block_size;
+                for (auto b = 0; b < block_size; ++b) {
+                    y_row[b] += detail::mul(a, x_row[b]);
+                }
+            }
+        }
+    }
+}
+
+/**
+ KPM-specialized sparse matrix-matrix multiplication (any format, diagonal, block of vectors)
+
+ Equivalent to:
+   y = matrix * x - y
+   m2 = x^2        <- for each column of the block
+   m3 = dot(x, y)  <- for each column of the block
+ */
+template<class Matrix, class scalar_t = typename Matrix::Scalar> CPB_ALWAYS_INLINE
+void kpm_spmm_diagonal(int start, int end, Matrix const& matrix,
+                       RowMajorMatrixX<scalar_t> const& x, RowMajorMatrixX<scalar_t>& y,
+                       ArrayX<scalar_t>& m2, ArrayX<scalar_t>& m3) {
+    kpm_spmm(start, end, matrix, x, y);
+
+    // The rows are still hot in cache after the multiplication above
+    auto const block_size = static_cast<int>(x.cols());
+    for (auto row = start; row < end; ++row) {
+        auto const x_row = x.data() + row * block_size;
+        auto const y_row = y.data() + row * block_size;
+        for (auto b = 0; b < block_size; ++b) {
+            m2[b] += detail::square(x_row[b]);
+            m3[b] += detail::mul(num::conjugate(y_row[b]), x_row[b]);
+        }
+    }
+}
+
 }} // namespace cpb::compute
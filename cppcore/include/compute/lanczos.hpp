@@ -10,8 +10,35 @@
 #include "numeric/random.hpp"
 #include "compute/linear_algebra.hpp"
 
+#include <Eigen/Eigenvalues>
+
 namespace cpb { namespace compute {
 
+namespace detail {
+    /// Return the normalized sum of the min and max eigenvalue Ritz vectors given the Lanczos
+    /// `basis` vectors and the diagonals of the tridiagonal matrix
+    template<class scalar_t, class real_t>
+    VectorX<scalar_t> minmax_ritz_vector(std::vector<VectorX<scalar_t>> const& basis,
+                                         std::vector<real_t> const& alpha,
+                                         std::vector<real_t> const& beta) {
+        auto const size = static_cast<int>(alpha.size());
+        auto const diagonal = eigen_cast<ArrayX>(alpha);
+        auto const subdiagonal = ArrayX<real_t>{eigen_cast<ArrayX>(beta).head(size - 1)};
+
+        auto solver = Eigen::SelfAdjointEigenSolver<MatrixX<real_t>>();
+        solver.computeFromTridiagonal(diagonal.matrix(), subdiagonal.matrix(),
+                                      Eigen::ComputeEigenvectors);
+        auto const& s = solver.eigenvectors();
+
+        auto ritz = VectorX<scalar_t>{VectorX<scalar_t>::Zero(basis.front().size())};
+        for (auto j = 0; j < size; ++j) {
+            ritz += scalar_t{s(j, 0) + s(j, size - 1)} * basis[j];
+        }
+        ritz.normalize();
+        return ritz;
+    }
+} // namespace detail
+
 template<class real_t>
 struct LanczosBounds {
     real_t min; ///< the lowest eigenvalue
@@ -19,19 +46,41 @@ struct LanczosBounds {
     int loops;  ///< number of iterations needed to converge
 };
 
-/// Use the Lanczos algorithm to find the min and max eigenvalues at given precision (%)
-template<class scalar_t, class real_t = num::get_real_t<scalar_t>>
-LanczosBounds<real_t> minmax_eigenvalues(SparseMatrixX<scalar_t> const& matrix,
-                                         double precision_percent) {
+/// The Lanczos basis is kept for `ritz_vector` only if it fits within this many bytes
+constexpr auto max_lanczos_basis_bytes = std::size_t{256} * 1024 * 1024;
+
+/**
+ Use the Lanczos algorithm to find the min and max eigenvalues at given precision (%)
+
+ The procedure starts from the normalized `start` vector. If `ritz_vector` is given, it
+ receives the sum of the Ritz vectors of the min and max eigenvalues: it's a very good
+ `start` for a slightly different matrix. This requires keeping the Lanczos basis, so the
+ result is left empty if the basis wouldn't fit within `max_lanczos_basis_bytes`.
+
+ The `matrix` may be any type supported by `compute::matrix_vector_mul`, e.g. a CSR
+ `SparseMatrixX` or a `num::SymmetricMatrix`.
+ */
+template<class Matrix, class scalar_t = typename Matrix::Scalar,
+         class real_t = num::get_real_t<scalar_t>>
+LanczosBounds<real_t> minmax_eigenvalues(Matrix const& matrix,
+                                         double precision_percent, VectorX<scalar_t> start,
+                                         VectorX<scalar_t>* ritz_vector = nullptr) {
     auto const precision = static_cast<real_t>(precision_percent / 100);
     auto const matrix_size = static_cast<int>(matrix.rows());
 
     auto left = VectorX<scalar_t>{VectorX<scalar_t>::Zero(matrix_size)};
     auto right_previous = VectorX<scalar_t>{VectorX<scalar_t>::Zero(matrix_size)};
 
-    auto right = num::make_random<VectorX<scalar_t>>(matrix_size);
+    auto right = std::move(start);
     right.normalize();
 
+    auto basis = std::vector<VectorX<scalar_t>>();
+    auto const vector_bytes = sizeof(scalar_t) * static_cast<std::size_t>(matrix_size);
+    auto keep_basis = ritz_vector != nullptr;
+    if (ritz_vector) {
+        ritz_vector->resize(0);
+    }
+
     // Alpha and beta are the diagonals of the tridiagonal matrix.
     // The final size is not known ahead of time, but it will be small.
     auto alpha = std::vector<real_t>();
@@ -48,6 +97,11 @@ LanczosBounds<real_t> minmax_eigenvalues(SparseMatrixX<scalar_t> const& matrix,
     // This may iterate up to matrix_size, but since only the extreme eigenvalues are required it
     // will converge very quickly. Exceeding `loop_limit` would suggest something is wrong.
     for (int i = 0; i < loop_limit; ++i) {
+        if (keep_basis) {
+            keep_basis = (basis.size() + 1) * vector_bytes <= max_lanczos_basis_bytes;
+            if (keep_basis) { basis.push_back(right); } else { basis.clear(); }
+        }
+
         // PART 1: Calculate tridiagonal matrix elements a and b
         // =====================================================
         // left = h_matrix * right
@@ -63,7 +117,9 @@ LanczosBounds<real_t> minmax_eigenvalues(SparseMatrixX<scalar_t> const& matrix,
         auto const b = left.norm();
 
         right_previous.swap(right);
-        right = (1/b) * left;
+        if (b != 0) { // otherwise, the Krylov subspace is invariant and the result is exact
+            right = (1/b) * left;
+        }
 
         alpha.push_back(a);
         beta.push_back(b);
@@ -77,7 +133,10 @@ LanczosBounds<real_t> minmax_eigenvalues(SparseMatrixX<scalar_t> const& matrix,
         auto const is_converged_min = abs((previous_min - min) / min) < precision;
         auto const is_converged_max = abs((previous_max - max) / max) < precision;
 
-        if (is_converged_min && is_converged_max) {
+        if ((is_converged_min && is_converged_max) || b == 0) {
+            if (keep_basis) {
+                *ritz_vector = detail::minmax_ritz_vector(basis, alpha, beta);
+            }
             return {min, max, i};
         }
 
@@ -88,4 +147,13 @@ LanczosBounds<real_t> minmax_eigenvalues(SparseMatrixX<scalar_t> const& matrix,
     throw std::runtime_error{"Lanczos algorithm did not converge for the min/max eigenvalues."};
 }
 
+/// Same as above, starting from a random vector
+template<class Matrix, class scalar_t = typename Matrix::Scalar,
+         class real_t = num::get_real_t<scalar_t>>
+LanczosBounds<real_t> minmax_eigenvalues(Matrix const& matrix, double precision_percent) {
+    auto const matrix_size = static_cast<int>(matrix.rows());
+    return minmax_eigenvalues(matrix, precision_percent,
+                              num::make_random<VectorX<scalar_t>>(matrix_size));
+}
+
 }} // namespace cpb::compute
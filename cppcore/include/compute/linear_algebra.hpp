@@ -5,3 +5,33 @@
 #else
 # include "eigen3/linear_algebra.hpp"
 #endif
+
+#include "numeric/bulkboundary.hpp"
+#include "numeric/symmetric.hpp"
+
+namespace cpb { namespace compute {
+
+/// Upper triangle storage: every element is also applied to the transposed position
+template<class scalar_t>
+inline void matrix_vector_mul(num::SymmetricMatrix<scalar_t> const& matrix,
+                              VectorX<scalar_t> const& x_vector, VectorX<scalar_t>& y_vector) {
+    y_vector.setZero(matrix.rows());
+    matrix.for_each([&](int row, int col, scalar_t value) {
+        y_vector[row] += value * x_vector[col];
+        if (col != row) {
+            y_vector[col] += num::conjugate(value) * x_vector[row];
+        }
+    });
+}
+
+/// Real bulk plus complex boundary: the two parts may overlap, so the elements are summed
+template<class scalar_t>
+inline void matrix_vector_mul(num::BulkBoundaryMatrix<scalar_t> const& matrix,
+                              VectorX<scalar_t> const& x_vector, VectorX<scalar_t>& y_vector) {
+    y_vector.setZero(matrix.rows());
+    matrix.for_each([&](int row, int col, scalar_t value) {
+        y_vector[row] += value * x_vector[col];
+    });
+}
+
+}} // namespace cpb::compute
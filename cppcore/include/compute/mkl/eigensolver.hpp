@@ -0,0 +1,66 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "compute/mkl/wrapper.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace cpb { namespace compute {
+
+/**
+ Eigenvalues (ascending) and, if `compute_vectors`, eigenvectors of a dense Hermitian matrix
+
+ Only the lower triangle of `matrix` is used and its contents are destroyed. If `min < max`,
+ only the eigenpairs within [min, max] are computed by the MRRR algorithm (`heevr`), which
+ is much cheaper than the full decomposition for a narrow window. Returns false if LAPACK
+ reports an error.
+ */
+template<class scalar_t, class real_t = num::get_real_t<scalar_t>>
+bool hermitian_eigensolve(MatrixX<scalar_t>& matrix, real_t min, real_t max,
+                          bool compute_vectors, ArrayX<real_t>& values,
+                          MatrixX<scalar_t>& vectors) {
+    auto const size = static_cast<lapack_int>(matrix.rows());
+    auto const ld = std::max(size, lapack_int{1});
+    auto const in_window = min < max;
+    // The LAPACK window is (vl, vu]: move `min` down so that it's included
+    auto const vl = in_window ? std::nextafter(min, std::numeric_limits<real_t>::lowest())
+                              : real_t{0};
+
+    values.resize(size);
+    if (compute_vectors) {
+        vectors.resize(size, size);
+    } else {
+        vectors.resize(1, 1);
+    }
+    auto support = std::vector<lapack_int>(2 * static_cast<std::size_t>(ld));
+    auto found = lapack_int{0};
+
+    using T = mkl::type<scalar_t>;
+    auto const error_id = mkl::heevr<scalar_t>::call(
+        LAPACK_COL_MAJOR, compute_vectors ? 'V' : 'N', in_window ? 'V' : 'A', 'L', size,
+        reinterpret_cast<T*>(matrix.data()), ld, vl, max, 0, 0, real_t{0}, &found,
+        values.data(), reinterpret_cast<T*>(vectors.data()), compute_vectors ? ld : 1,
+        support.data()
+    );
+    if (error_id != 0) {
+        return false;
+    }
+
+    values.conservativeResize(found);
+    if (compute_vectors) {
+        vectors.conservativeResize(size, found);
+    } else {
+        vectors.resize(0, 0);
+    }
+    return true;
+}
+
+/// LAPACK threads of the calling thread, e.g. 1 for the workers of a `ThreadPool`
+/// which already run many solvers concurrently
+inline void set_local_lapack_threads(int num_threads) {
+    mkl_set_num_threads_local(num_threads);
+}
+
+}} // namespace cpb::compute
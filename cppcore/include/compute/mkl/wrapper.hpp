@@ -33,6 +33,13 @@ template<class scalar_t> struct stev;
 template<> struct stev<float> { static constexpr auto call = LAPACKE_sstev; };
 template<> struct stev<double> { static constexpr auto call = LAPACKE_dstev; };
 
+/// Selected eigenvalues and eigenvectors of a dense Hermitian (real symmetric) matrix
+template<class scalar_t> struct heevr;
+template<> struct heevr<float> { static constexpr auto call = LAPACKE_ssyevr; };
+template<> struct heevr<double> { static constexpr auto call = LAPACKE_dsyevr; };
+template<> struct heevr<std::complex<float>> { static constexpr auto call = LAPACKE_cheevr; };
+template<> struct heevr<std::complex<double>> { static constexpr auto call = LAPACKE_zheevr; };
+
 /// CSR matrix vector multiplication
 template<class scalar_t> struct csrmv;
 template<> struct csrmv<float> { static constexpr auto call = mkl_scsrmv; };
@@ -0,0 +1,65 @@
+#pragma once
+#include <memory>
+#include <vector>
+
+namespace cpb { namespace dist {
+
+/**
+ Communication between the processes (ranks) of a distributed-memory calculation
+
+ Only the few collective operations needed by the distributed KPM are exposed. They must be
+ called by all the ranks in the same order. The MPI implementation is available when the
+ library is compiled with `PB_MPI`, but any other transport may implement this interface.
+ */
+class Communicator {
+public:
+    virtual ~Communicator() = default;
+
+    /// Index of this process in [0, size)
+    virtual int rank() const = 0;
+    /// Total number of processes
+    virtual int size() const = 0;
+
+    /// Return `value` from every rank, ordered by rank
+    virtual std::vector<int> allgather(int value) = 0;
+    /// Element-wise sum of `data` over all ranks, the result is written back on every rank
+    virtual void allreduce_sum(double* data, int size) = 0;
+    /// Send `send_bytes[r]` bytes starting at `send + send_displs[r]` to each rank `r` and
+    /// receive `recv_bytes[r]` bytes from each rank `r` at `recv + recv_displs[r]`
+    virtual void alltoallv(void const* send, int const* send_bytes, int const* send_displs,
+                           void* recv, int const* recv_bytes, int const* recv_displs) = 0;
+
+    /// Typed version of `alltoallv()`: the counts and displacements are numbers of elements
+    template<class T>
+    void alltoallv(T const* send, std::vector<int> const& send_counts,
+                   std::vector<int> const& send_displs, T* recv,
+                   std::vector<int> const& recv_counts, std::vector<int> const& recv_displs) {
+        auto const to_bytes = [](std::vector<int> const& v) {
+            auto bytes = v;
+            for (auto& b : bytes) { b *= static_cast<int>(sizeof(T)); }
+            return bytes;
+        };
+        alltoallv(static_cast<void const*>(send), to_bytes(send_counts).data(),
+                  to_bytes(send_displs).data(), static_cast<void*>(recv),
+                  to_bytes(recv_counts).data(), to_bytes(recv_displs).data());
+    }
+};
+
+/// A single process: all the operations are local copies
+class SerialCommunicator : public Communicator {
+public:
+    int rank() const override { return 0; }
+    int size() const override { return 1; }
+    std::vector<int> allgather(int value) override { return {value}; }
+    void allreduce_sum(double*, int) override {}
+    void alltoallv(void const* send, int const* send_bytes, int const* send_displs,
+                   void* recv, int const* recv_bytes, int const* recv_displs) override;
+};
+
+#ifdef CPB_USE_MPI
+/// Communicator over `MPI_COMM_WORLD`. MPI must be initialized by the caller
+/// (e.g. `MPI_Init` or `mpi4py`) before this is created and finalized after it's gone.
+std::unique_ptr<Communicator> make_mpi_communicator();
+#endif
+
+}} // namespace cpb::dist
@@ -0,0 +1,191 @@
+#pragma once
+#include "distributed/Communicator.hpp"
+#include "kpm/Bounds.hpp"
+#include "numeric/dense.hpp"
+#include "numeric/sparse.hpp"
+#include "compute/detail.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace cpb { namespace dist {
+
+/// Rows [start, end) owned by `rank`: contiguous blocks of nearly equal size in rank order
+inline std::pair<int, int> partition(int num_rows, int rank, int size) {
+    auto const start = std::int64_t{num_rows} * rank / size;
+    auto const end = std::int64_t{num_rows} * (rank + 1) / size;
+    return {static_cast<int>(start), static_cast<int>(end)};
+}
+
+/// Rows [start, end) of a CSR matrix with the original (global) column indices. This is for an
+/// existing full matrix: `Model::hamiltonian_rows()` builds a rank's rows without it.
+template<class scalar_t>
+SparseMatrixX<scalar_t> slice_rows(SparseMatrixX<scalar_t> const& matrix, int start, int end) {
+    SparseMatrixX<scalar_t> result = matrix.middleRows(start, end - start);
+    result.makeCompressed();
+    return result;
+}
+
+/**
+ Scaled Hamiltonian `h2 = (H - b) * 2 / a` partitioned by rows across the ranks
+
+ Each rank owns a contiguous block of rows and the ranks are ordered by their rows. The local
+ matrix refers to the owned vector elements first, followed by the "halo": the elements owned
+ by other ranks which are needed by the local rows, i.e. the hoppings across the partition
+ boundary. The KPM vectors have `vector_size()` elements with the same layout. A halo
+ exchange refreshes the halo elements before each matrix-vector multiplication.
+
+ With a spatial partition (the sites are ordered by position), the halo is only the surface
+ of the local block and each rank only exchanges data with its neighbors.
+
+ Each rank gets its rows from `Model::hamiltonian_rows()`, so no rank holds the full matrix,
+ only the full `System`. Only the diagonal moments are distributed (LDOS and stochastic DOS,
+ see `dist::diagonal_moments()`): conductivity is not, and neither is the Python `KPM`.
+ */
+template<class scalar_t>
+class DistributedMatrix {
+    using real_t = num::get_real_t<scalar_t>;
+
+public:
+    using Scalar = scalar_t;
+
+    /// `local_rows` holds the rows [row_start, row_start + local_rows.rows()) of the
+    /// unscaled Hamiltonian with global column indices. Collective: all ranks must call it.
+    DistributedMatrix(SparseMatrixX<scalar_t> const& local_rows, int row_start,
+                      kpm::Scale<real_t> scale, Communicator& comm)
+        : comm(&comm), row_start(row_start), num_local(static_cast<int>(local_rows.rows())) {
+        auto const num_ranks = comm.size();
+        auto const starts = comm.allgather(row_start);
+        auto const counts = comm.allgather(num_local);
+        for (auto r = 0; r < num_ranks - 1; ++r) {
+            if (starts[r] + counts[r] != starts[r + 1]) {
+                throw std::runtime_error("DistributedMatrix: each rank must own a contiguous "
+                                         "block of rows and the blocks must be in rank order");
+            }
+        }
+        // The last rank with `start <= col` is the owner, even if some ranks have no rows
+        auto const owner = [&](int col) {
+            auto const it = std::upper_bound(starts.begin(), starts.end(), col);
+            return static_cast<int>(it - starts.begin()) - 1;
+        };
+        auto const is_local = [&](int col) {
+            return col >= row_start && col < row_start + num_local;
+        };
+
+        // Sorted non-local columns, which also groups them by owner
+        auto halo = std::vector<int>();
+        for (auto row = 0; row < local_rows.outerSize(); ++row) {
+            for (auto it = typename SparseMatrixX<scalar_t>::InnerIterator(local_rows, row);
+                 it; ++it) {
+                if (!is_local(it.col())) { halo.push_back(it.col()); }
+            }
+        }
+        std::sort(halo.begin(), halo.end());
+        halo.erase(std::unique(halo.begin(), halo.end()), halo.end());
+        num_halo = static_cast<int>(halo.size());
+
+        recv_counts.assign(num_ranks, 0);
+        for (auto col : halo) { ++recv_counts[owner(col)]; }
+        recv_displs = exclusive_scan(recv_counts);
+
+        // Each owner learns which of its rows the other ranks need
+        auto const ones = std::vector<int>(num_ranks, 1);
+        auto one_displs = std::vector<int>(num_ranks);
+        for (auto r = 0; r < num_ranks; ++r) { one_displs[r] = r; }
+        send_counts.assign(num_ranks, 0);
+        comm.alltoallv(recv_counts.data(), ones, one_displs,
+                       send_counts.data(), ones, one_displs);
+        send_displs = exclusive_scan(send_counts);
+
+        auto const num_send = send_displs.back() + send_counts.back();
+        send_rows.resize(num_send);
+        comm.alltoallv(halo.data(), recv_counts, recv_displs,
+                       send_rows.data(), send_counts, send_displs);
+        for (auto& row : send_rows) { row -= row_start; }
+        send_buffer.resize(num_send);
+
+        // Local matrix with the columns mapped to [owned, halo]
+        auto const inverted_a = real_t{2 / scale.a};
+        auto triplets = std::vector<Eigen::Triplet<scalar_t>>();
+        triplets.reserve(static_cast<std::size_t>(local_rows.nonZeros() + num_local));
+        for (auto row = 0; row < local_rows.outerSize(); ++row) {
+            for (auto it = typename SparseMatrixX<scalar_t>::InnerIterator(local_rows, row);
+                 it; ++it) {
+                auto const col = is_local(it.col()) ? it.col() - row_start : num_local
+                    + static_cast<int>(std::lower_bound(halo.begin(), halo.end(), it.col())
+                                       - halo.begin());
+                triplets.emplace_back(row, col, it.value() * inverted_a);
+            }
+            if (scale.b != 0) {
+                triplets.emplace_back(row, row, scalar_t{-scale.b * inverted_a});
+            }
+        }
+        matrix.resize(num_local, num_local + num_halo);
+        matrix.setFromTriplets(triplets.begin(), triplets.end());
+        matrix.makeCompressed();
+    }
+
+    Communicator& communicator() const { return *comm; }
+    /// Number of owned rows
+    int rows() const { return num_local; }
+    /// Global index of the first owned row
+    int first_row() const { return row_start; }
+    /// Owned elements followed by the halo
+    int vector_size() const { return num_local + num_halo; }
+    /// Local rows with the columns mapped to the local vector layout
+    SparseMatrixX<scalar_t> const& local() const { return matrix; }
+
+    /// Fill the halo part of `x` with the elements owned by other ranks. Collective.
+    void halo_exchange(VectorX<scalar_t>& x) const {
+        assert(x.size() == vector_size());
+        for (auto i = 0; i < static_cast<int>(send_rows.size()); ++i) {
+            send_buffer[i] = x[send_rows[i]];
+        }
+        comm->alltoallv(send_buffer.data(), send_counts, send_displs,
+                        x.data() + num_local, recv_counts, recv_displs);
+    }
+
+    /// Equivalent to `y = h2 * x - y` for the owned rows, see `compute::kpm_spmv()`.
+    /// The halo of `x` is exchanged first, so this is also collective.
+    void kpm_spmv(VectorX<scalar_t>& x, VectorX<scalar_t>& y) const {
+        halo_exchange(x);
+        auto const data = matrix.valuePtr();
+        auto const indices = matrix.innerIndexPtr();
+        auto const indptr = matrix.outerIndexPtr();
+        for (auto row = 0; row < num_local; ++row) {
+            auto r = scalar_t{0};
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                r += compute::detail::mul(data[n], x[indices[n]]);
+            }
+            y[row] = r - y[row];
+        }
+    }
+
+private:
+    static std::vector<int> exclusive_scan(std::vector<int> const& counts) {
+        auto displs = std::vector<int>(counts.size(), 0);
+        for (auto i = std::size_t{1}; i < counts.size(); ++i) {
+            displs[i] = displs[i - 1] + counts[i - 1];
+        }
+        return displs;
+    }
+
+private:
+    Communicator* comm;
+    int row_start;
+    int num_local;
+    int num_halo = 0;
+    SparseMatrixX<scalar_t> matrix;
+
+    std::vector<int> send_rows; ///< local indices of the owned elements needed by others
+    std::vector<int> send_counts;
+    std::vector<int> send_displs;
+    std::vector<int> recv_counts; ///< halo elements received from each rank
+    std::vector<int> recv_displs;
+    mutable std::vector<scalar_t> send_buffer;
+};
+
+}} // namespace cpb::dist
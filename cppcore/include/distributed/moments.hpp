@@ -0,0 +1,98 @@
+#pragma once
+#include "distributed/DistributedMatrix.hpp"
+#include "kpm/Moments.hpp"
+#include "numeric/random.hpp"
+#include "numeric/traits.hpp"
+
+#include <utility>
+
+namespace cpb { namespace dist {
+
+namespace detail {
+    /// Global sums of `|r0|^2` and `dot(r1, r0)` with a single reduction
+    template<class acc_t>
+    std::pair<acc_t, acc_t> reduce_pair(Communicator& comm, acc_t a, acc_t b) {
+        double buffer[4] = {std::real(a), std::imag(a), std::real(b), std::imag(b)};
+        comm.allreduce_sum(buffer, 4);
+        return {num::complex_cast<acc_t>({buffer[0], buffer[1]}),
+                num::complex_cast<acc_t>({buffer[2], buffer[3]})};
+    }
+} // namespace detail
+
+/**
+ KPM moments `mu_n = <r0|T_n(h2)|r0>` of a vector which is distributed across the ranks
+
+ `local_r0` holds the owned elements of the initial vector. The main loop is the same as
+ `kpm::calc_moments::diagonal::basic()`, but each matrix-vector multiplication exchanges the
+ halo first and the partial `|r0|^2` and `dot(r1, r0)` sums are reduced over all the ranks
+ before they are collected. Every rank gets the same result. Collective.
+ */
+template<class acc_t, class scalar_t>
+ArrayX<acc_t> diagonal_moments(DistributedMatrix<scalar_t> const& h2,
+                               VectorX<scalar_t> const& local_r0, int num_moments) {
+    auto& comm = h2.communicator();
+    auto const n = h2.rows();
+    assert(local_r0.size() == n);
+
+    VectorX<scalar_t> r0 = VectorX<scalar_t>::Zero(h2.vector_size());
+    VectorX<scalar_t> r1 = VectorX<scalar_t>::Zero(h2.vector_size());
+    r0.head(n) = local_r0;
+    h2.kpm_spmv(r0, r1); // r1 = h2 * r0
+    r1.head(n) *= scalar_t{0.5};
+
+    // The first 2 moments are given to `resume()` which makes the target index irrelevant
+    auto moments = kpm::ExvalDiagonalMoments<scalar_t, acc_t>(num_moments, 0);
+    auto const initial = detail::reduce_pair(
+        comm, kpm::exval::squared_norm<acc_t>(r0.head(n)) * acc_t{0.5},
+        kpm::exval::dot<acc_t>(r1.head(n), r0.head(n))
+    );
+    auto first_moments = ArrayX<acc_t>(2);
+    first_moments << initial.first, initial.second;
+    moments.resume(first_moments);
+
+    for (auto i = 2; i <= num_moments / 2; ++i) {
+        h2.kpm_spmv(r1, r0);
+        r1.swap(r0);
+        auto const m = detail::reduce_pair(
+            comm, kpm::exval::squared_norm<acc_t>(r0.head(n)),
+            kpm::exval::dot<acc_t>(r1.head(n), r0.head(n))
+        );
+        moments.collect(i, m.first, m.second);
+    }
+    return moments.get();
+}
+
+/// Moments of the diagonal element `h2[index, index]` of the global matrix
+template<class acc_t = void, class scalar_t>
+ArrayX<std14::conditional_t<std::is_void<acc_t>::value, scalar_t, acc_t>>
+exval_moments(DistributedMatrix<scalar_t> const& h2, int index, int num_moments) {
+    using result_t = std14::conditional_t<std::is_void<acc_t>::value, scalar_t, acc_t>;
+    VectorX<scalar_t> r0 = VectorX<scalar_t>::Zero(h2.rows());
+    auto const local_index = index - h2.first_row();
+    if (local_index >= 0 && local_index < h2.rows()) {
+        r0[local_index] = scalar_t{1};
+    }
+    return diagonal_moments<result_t>(h2, r0, num_moments);
+}
+
+/**
+ Stochastic trace moments: the average of `<r|T_n(h2)|r>` over `num_random` random-phase
+ vectors, same as `kpm::StochasticTraceMoments`. Each rank generates its own part of the
+ vectors by global index, so the result doesn't depend on the number of ranks.
+ */
+template<class acc_t = void, class scalar_t>
+ArrayX<std14::conditional_t<std::is_void<acc_t>::value, scalar_t, acc_t>>
+trace_moments(DistributedMatrix<scalar_t> const& h2, int num_moments, int num_random,
+              std::uint64_t seed = std::mt19937::default_seed) {
+    using result_t = std14::conditional_t<std::is_void<acc_t>::value, scalar_t, acc_t>;
+    ArrayX<result_t> result = ArrayX<result_t>::Zero(num_moments);
+    auto r0 = VectorX<scalar_t>(h2.rows());
+    for (auto j = 0; j < num_random; ++j) {
+        num::random_phase_fill(r0, seed, static_cast<std::uint64_t>(j),
+                               static_cast<std::uint64_t>(h2.first_row()));
+        result += diagonal_moments<result_t>(h2, r0, num_moments);
+    }
+    return result / static_cast<num::get_real_t<result_t>>(num_random);
+}
+
+}} // namespace cpb::dist
@@ -0,0 +1,65 @@
+#pragma once
+#include "hamiltonian/HamiltonianModifiers.hpp"
+
+#include <cstdint>
+
+namespace cpb { namespace builtin {
+
+/**
+ Compiled versions of commonly used modifiers
+
+ Unlike modifiers defined in Python, these don't call back into the interpreter: the arrays
+ are processed directly with Eigen expressions and the GIL is never needed. The hopping
+ modifiers are thread-safe, so they can be applied in parallel, see `Model::set_num_threads`.
+ They have a `fingerprint` made from their arguments, so models with them can be cached
+ without a tag, see `Model::set_cache`.
+ */
+
+/// Constant magnetic field in the z-direction [T], applied as a Peierls phase
+/// with the vector potential A = (-B*y, 0, 0)
+HoppingModifier constant_magnetic_field(float magnitude);
+
+/// Uniform electric field [V/nm]: the onsite energy [eV] of an electron at `r` is
+/// shifted by `field.dot(r)`
+OnsiteModifier linear_electric_field(Cartesian field);
+
+/// Bond length dependent hopping: t = t0 * exp(-beta * (l / bond_length - 1))
+/// where `l` is the distance between the two sites
+HoppingModifier strained_hopping(float beta, float bond_length);
+
+/// Add random onsite energy disorder: uniformly distributed in [-width/2, width/2].
+/// The value of each site is a function of the `seed`, its position and its sublattice,
+/// so it doesn't depend on the site order, the chunk size or the number of threads.
+OnsiteModifier onsite_disorder(float width, std::uint32_t seed = 0);
+
+/**
+ C ABI of native modifier functions, e.g. numba `cfunc`s or symbols of a shared library
+
+ `energy` holds `n` values, as interleaved (real, imag) pairs for complex modifiers. It's
+ converted to double precision and back, regardless of the scalar type of the Hamiltonian.
+ A real modifier only sees the real part of a complex Hamiltonian (e.g. one which another
+ modifier made complex): the imaginary part is kept as is. The position and id arrays have
+ the same length `n`. The functions are called without the GIL and concurrently for
+ different chunks of sites or hoppings, so they must be thread-safe. The `fingerprint`
+ of the modifier is made from the function address: it's unique within this process as
+ long as the function is kept alive.
+ */
+using NativeOnsiteFunction = void (*)(double* energy, float const* x, float const* y,
+                                      float const* z, std::int8_t const* sub_id,
+                                      std::int64_t n);
+using NativeHoppingFunction = void (*)(double* energy, float const* x1, float const* y1,
+                                       float const* z1, float const* x2, float const* y2,
+                                       float const* z2, std::int8_t const* hop_id,
+                                       std::int64_t n);
+
+/// Onsite energy modifier which calls the native `function`, see `NativeOnsiteFunction`.
+/// Throws if `function` is null.
+OnsiteModifier native_onsite(NativeOnsiteFunction function, bool is_complex = false,
+                             bool is_double = false);
+
+/// Hopping energy modifier which calls the native `function`, see `NativeHoppingFunction`.
+/// Throws if `function` is null.
+HoppingModifier native_hopping(NativeHoppingFunction function, bool is_complex = false,
+                               bool is_double = false);
+
+}} // namespace cpb::builtin
@@ -3,19 +3,29 @@
 
 #include "numeric/dense.hpp"
 #include "numeric/sparse.hpp"
+#include "numeric/bulkboundary.hpp"
+#include "numeric/symmetric.hpp"
 #include "numeric/traits.hpp"
 #include "numeric/constant.hpp"
 
 #include "support/variant.hpp"
 
+#include <algorithm>
+#include <tuple>
+#include <vector>
+
 namespace cpb {
 
-template<class scalar_t>
-using SparseMatrixRC = std::shared_ptr<SparseMatrixX<scalar_t> const>;
+template<class scalar_t, class index_t = int>
+using SparseMatrixRC = std::shared_ptr<SparseMatrixX<scalar_t, index_t> const>;
 
 /**
  Stores a tight-binding Hamiltonian as a sparse matrix variant
  with real or complex scalar type and single or double precision.
+
+ The variant always has 32-bit indices (up to 2^31 non-zeros). A matrix with a different
+ index type is built directly by `ham::make_csr()` and optimized for KPM by an
+ `kpm::OptimizedHamiltonian` with the same `index_t`.
  */
 class Hamiltonian {
     using Variant = var::variant<SparseMatrixRC<float>, SparseMatrixRC<std::complex<float>>,
@@ -42,55 +52,438 @@ public:
 
 namespace detail {
 
+/**
+ The wave vector independent parts of a Hamiltonian with periodic boundaries
+
+ `matrix` already has the sparsity pattern of the complete Hamiltonian, but its values only
+ include the onsite energies and the main hoppings. The boundary hoppings are kept separately
+ together with their positions in `matrix.valuePtr()`, i.e. precomputed CSR offsets.
+ */
+template<class scalar_t>
+struct PeriodicParts {
+    struct Boundary {
+        Cartesian shift;
+        ArrayX<scalar_t> hoppings; ///< value of each boundary hopping (i, j)
+        ArrayXi ij_offsets; ///< position of element (i, j) in the CSR data
+        ArrayXi ji_offsets; ///< position of the conjugate element (j, i)
+    };
+
+    SparseMatrixX<scalar_t> matrix;
+    std::vector<Boundary> boundaries;
+};
+
+} // namespace detail
+
+/**
+ Stores the wave vector independent `PeriodicParts` of a Hamiltonian as a variant with
+ real or complex scalar type and single or double precision. A Hamiltonian for a new wave
+ vector can be assembled without rebuilding the sparse matrix: it's a copy of the main part
+ plus the phase-dependent boundary elements written in place. Intended for k-point sweeps.
+ */
+class PeriodicHamiltonian {
+    template<class scalar_t>
+    using PartsRC = std::shared_ptr<detail::PeriodicParts<scalar_t> const>;
+    using Variant = var::variant<PartsRC<float>, PartsRC<std::complex<float>>,
+                                 PartsRC<double>, PartsRC<std::complex<double>>>;
+    Variant variant_parts;
+
+public:
+    PeriodicHamiltonian() = default;
+    template<class scalar_t>
+    PeriodicHamiltonian(std::shared_ptr<detail::PeriodicParts<scalar_t>> p)
+        : variant_parts(PartsRC<scalar_t>(std::move(p))) {}
+
+    Variant const& get_variant() const { return variant_parts; }
+
+    explicit operator bool() const;
+    void reset();
+
+    /// Return the Hamiltonian at the given wave vector
+    Hamiltonian at(Cartesian k_vector) const;
+};
+
+namespace detail {
+
+/**
+ Direct two-pass CSR assembly
+
+ The first pass gives an upper bound of the number of non-zeros in each row, e.g. from the
+ structure of the triangular `System::hoppings`, see `hamiltonian_capacity()`. The final
+ arrays are allocated once and the elements are written straight into their rows, in any
+ order, without the search of `coeffRef()` or the reallocations of `insert()`. `finish()`
+ sorts each row by column, sums duplicate elements (in insertion order) and squeezes out
+ the unused slots, e.g. the ones of hoppings which were set to zero by a modifier.
+ The row and column counts are `int`, but the positions in the arrays are `index_t`.
+ */
+template<class scalar_t, class index_t = int>
+class CsrBuilder {
+public:
+    CsrBuilder(SparseMatrixX<scalar_t, index_t>& matrix, ArrayXi const& row_capacity)
+        : CsrBuilder(matrix, row_capacity, 0, static_cast<int>(row_capacity.size())) {}
+
+    /// Only the rows [row_start, row_start + row_capacity.size()) of a matrix with `cols`
+    /// columns: `insert()` skips the elements of all the other rows
+    CsrBuilder(SparseMatrixX<scalar_t, index_t>& matrix, ArrayXi const& row_capacity,
+               int row_start, int cols)
+        : matrix(matrix), row_start(row_start),
+          row_end(static_cast<std::size_t>(row_capacity.size())) {
+        auto const num_rows = static_cast<int>(row_capacity.size());
+        matrix.resize(num_rows, cols);
+
+        auto const indptr = matrix.outerIndexPtr();
+        indptr[0] = 0;
+        for (auto row = 0; row < num_rows; ++row) {
+            indptr[row + 1] = indptr[row] + row_capacity[row];
+            row_end[row] = indptr[row];
+        }
+        matrix.resizeNonZeros(indptr[num_rows]);
+    }
+
+    void insert(int row, int col, scalar_t value) {
+        row -= row_start;
+        if (static_cast<std::size_t>(row) >= row_end.size()) { return; }
+        auto const n = row_end[row]++;
+        assert(n < matrix.outerIndexPtr()[row + 1]);
+        matrix.innerIndexPtr()[n] = col;
+        matrix.valuePtr()[n] = value;
+    }
+
+    /// Sort and merge the rows in parallel, then compact the arrays in place
+    void finish(int num_threads = 1) {
+        auto const num_rows = static_cast<int>(row_end.size());
+        auto const indptr = matrix.outerIndexPtr();
+        auto const indices = matrix.innerIndexPtr();
+        auto const data = matrix.valuePtr();
+
+        ThreadPool pool(num_threads);
+        pool.parallel_for(0, num_rows, [&](int, int start, int end) {
+            for (auto row = start; row < end; ++row) {
+                row_end[row] = sort_row(indices, data, indptr[row], row_end[row]);
+            }
+        });
+
+        auto nnz = index_t{0};
+        for (auto row = 0; row < num_rows; ++row) {
+            auto const row_start = indptr[row];
+            indptr[row] = nnz;
+            for (auto n = row_start; n < row_end[row]; ++n, ++nnz) {
+                indices[nnz] = indices[n];
+                data[nnz] = data[n];
+            }
+        }
+        indptr[num_rows] = nnz;
+        matrix.resizeNonZeros(nnz);
+        matrix.data().squeeze();
+    }
+
+private:
+    /// Insertion sort of a (short) row, stable, so that duplicates are summed in the order
+    /// they were inserted. Returns the new end of the row after merging the duplicates.
+    static index_t sort_row(index_t* indices, scalar_t* data, index_t start, index_t end) {
+        for (auto n = start + 1; n < end; ++n) {
+            auto const col = indices[n];
+            auto const value = data[n];
+            auto m = n;
+            for (; m > start && indices[m - 1] > col; --m) {
+                indices[m] = indices[m - 1];
+                data[m] = data[m - 1];
+            }
+            indices[m] = col;
+            data[m] = value;
+        }
+
+        auto last = start;
+        for (auto n = start + 1; n < end; ++n) {
+            if (indices[n] == indices[last]) {
+                data[last] += data[n];
+            } else {
+                ++last;
+                indices[last] = indices[n];
+                data[last] = data[n];
+            }
+        }
+        return (end > start) ? last + 1 : start;
+    }
+
+private:
+    SparseMatrixX<scalar_t, index_t>& matrix;
+    int row_start; ///< global index of the first row
+    std::vector<index_t> row_end; ///< current end of each row in the CSR arrays
+};
+
+inline bool has_onsite_energy(System const& system, HamiltonianModifiers const& modifiers) {
+    return system.lattice.has_onsite_energy() || !modifiers.onsite.empty();
+}
+
+/// Upper bound of the number of non-zeros in each row of the Hamiltonian
+inline ArrayXi hamiltonian_capacity(System const& system, bool has_onsite_energy,
+                                    bool with_boundaries) {
+    ArrayXi capacity = nonzeros_per_row(system.hoppings, has_onsite_energy);
+    if (with_boundaries) {
+        for (auto const& boundary : system.boundaries) {
+            capacity += nonzeros_per_row(boundary.hoppings);
+        }
+    }
+    return capacity;
+}
+
+/// Onsite energies and the main hoppings: both (i, j) and the conjugate (j, i)
+template<class scalar_t, class index_t>
+void insert_main(CsrBuilder<scalar_t, index_t>& builder, System const& system,
+                 HamiltonianModifiers const& modifiers) {
+    modifiers.apply_to_onsite<scalar_t>(system, [&](int i, scalar_t onsite) {
+        builder.insert(i, i, onsite);
+    });
+
+    modifiers.apply_to_hoppings<scalar_t>(system, [&](int i, int j, scalar_t hopping) {
+        builder.insert(i, j, hopping);
+        builder.insert(j, i, num::conjugate(hopping));
+    });
+}
+
+/// Periodic boundary hoppings with the phase of the given wave vector, they are added to
+/// any main hopping or onsite energy at the same position
+template<class scalar_t, class index_t>
+void insert_periodic(CsrBuilder<scalar_t, index_t>& builder, System const& system,
+                     HamiltonianModifiers const& modifiers, Cartesian k_vector) {
+    for (auto n = size_t{0}, size = system.boundaries.size(); n < size; ++n) {
+        using constant::i1;
+        auto const& d = system.boundaries[n].shift;
+        auto const phase = num::complex_cast<scalar_t>(exp(i1 * k_vector.dot(d)));
+
+        modifiers.apply_to_hoppings<scalar_t>(system, n, [&](int i, int j, scalar_t hopping) {
+            builder.insert(i, j, hopping * phase);
+            builder.insert(j, i, num::conjugate(hopping * phase));
+        });
+    }
+}
+
+/// Build the compressed matrix of the main part of the Hamiltonian (no boundaries)
 template<class scalar_t>
 void build_main(SparseMatrixX<scalar_t>& matrix, System const& system,
                 HamiltonianModifiers const& modifiers) {
-    auto const num_sites = system.num_sites();
-    matrix.resize(num_sites, num_sites);
+    auto builder = CsrBuilder<scalar_t>(
+        matrix, hamiltonian_capacity(system, has_onsite_energy(system, modifiers), false)
+    );
+    insert_main(builder, system, modifiers);
+    builder.finish(modifiers.num_threads);
+}
 
-    auto const has_onsite_energy = system.lattice.has_onsite_energy() || !modifiers.onsite.empty();
-    if (system.has_unbalanced_hoppings) {
-        matrix.reserve(nonzeros_per_row(system.hoppings, has_onsite_energy));
-    } else {
-        auto const num_per_row = system.lattice.max_hoppings() + has_onsite_energy;
-        matrix.reserve(ArrayXi::Constant(num_sites, num_per_row));
+/// Only the upper triangle of the main Hamiltonian (no boundaries), see `num::SymmetricMatrix`
+template<class scalar_t>
+num::SymmetricMatrix<scalar_t> build_symmetric(System const& system,
+                                               HamiltonianModifiers const& modifiers) {
+    // Each triangular hopping goes to the row of its smaller index. The diagonal slot is
+    // always there, plus one for the onsite energy and two for a hopping to the same site.
+    auto const num_sites = system.num_sites();
+    auto const has_onsite = has_onsite_energy(system, modifiers);
+    ArrayXi capacity = ArrayXi::Constant(num_sites, has_onsite ? 2 : 1);
+    auto const indptr = system.hoppings.outerIndexPtr();
+    auto const indices = system.hoppings.innerIndexPtr();
+    for (auto row = 0; row < num_sites; ++row) {
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            capacity[std::min(row, indices[n])] += (indices[n] == row) ? 2 : 1;
+        }
     }
 
+    auto result = num::SymmetricMatrix<scalar_t>();
+    auto builder = CsrBuilder<scalar_t>(result.upper, capacity);
+    for (auto i = 0; i < num_sites; ++i) {
+        builder.insert(i, i, scalar_t{0});
+    }
     modifiers.apply_to_onsite<scalar_t>(system, [&](int i, scalar_t onsite) {
-        matrix.insert(i, i) = onsite;
+        builder.insert(i, i, onsite);
     });
-
     modifiers.apply_to_hoppings<scalar_t>(system, [&](int i, int j, scalar_t hopping) {
-        matrix.insert(i, j) = hopping;
-        matrix.insert(j, i) = num::conjugate(hopping);
+        if (i == j) {
+            builder.insert(i, i, hopping);
+            builder.insert(i, i, num::conjugate(hopping));
+        } else if (i < j) {
+            builder.insert(i, j, hopping);
+        } else {
+            builder.insert(j, i, num::conjugate(hopping));
+        }
     });
+    builder.finish(modifiers.num_threads);
+    return result;
 }
 
+/// The main Hamiltonian with real values and the phase-carrying periodic boundary hoppings
+/// at the given wave vector, see `num::BulkBoundaryMatrix`. The lattice and the modifiers
+/// must be real, the only complex values are the Bloch phases.
+template<class scalar_t, class real_t = num::get_real_t<scalar_t>>
+num::BulkBoundaryMatrix<scalar_t> build_bulk_boundary(System const& system,
+                                                      HamiltonianModifiers const& modifiers,
+                                                      Cartesian k_vector) {
+    // One more slot in each row for the explicit diagonal, see `BulkBoundaryMatrix::scaled()`
+    auto bulk = SparseMatrixX<real_t>();
+    ArrayXi bulk_capacity = hamiltonian_capacity(system, has_onsite_energy(system, modifiers),
+                                                 false) + 1;
+    auto bulk_builder = CsrBuilder<real_t>(bulk, bulk_capacity);
+    for (auto i = 0; i < system.num_sites(); ++i) {
+        bulk_builder.insert(i, i, real_t{0});
+    }
+    insert_main(bulk_builder, system, modifiers);
+    bulk_builder.finish(modifiers.num_threads);
+
+    auto boundary = SparseMatrixX<scalar_t>();
+    ArrayXi boundary_capacity = ArrayXi::Zero(system.num_sites());
+    for (auto const& b : system.boundaries) {
+        boundary_capacity += nonzeros_per_row(b.hoppings);
+    }
+    auto boundary_builder = CsrBuilder<scalar_t>(boundary, boundary_capacity);
+    insert_periodic(boundary_builder, system, modifiers, k_vector);
+    boundary_builder.finish(modifiers.num_threads);
+
+    return {std::move(bulk), boundary};
+}
+
+/**
+ Replace the onsite energies (diagonal) of an existing matrix in place, the hoppings are
+ not touched. Returns false, without modifying the matrix, if the sparsity pattern doesn't
+ have the diagonal slots required for the new non-zero onsite energies.
+ */
 template<class scalar_t>
-void build_periodic(SparseMatrixX<scalar_t>& matrix, System const& system,
-                    HamiltonianModifiers const& modifiers, Cartesian k_vector) {
+bool update_onsite(SparseMatrixX<scalar_t>& matrix, System const& system,
+                   HamiltonianModifiers const& modifiers, Cartesian k_vector) {
+    assert(matrix.isCompressed());
+    auto const num_sites = system.num_sites();
+    auto diagonal = ArrayX<scalar_t>::Zero(num_sites).eval();
+    modifiers.apply_to_onsite<scalar_t>(system, [&](int i, scalar_t onsite) {
+        diagonal[i] = onsite;
+    });
+
+    // Periodic hoppings may connect a site to its own image, see `insert_periodic()`
     for (auto n = size_t{0}, size = system.boundaries.size(); n < size; ++n) {
         using constant::i1;
         auto const& d = system.boundaries[n].shift;
         auto const phase = num::complex_cast<scalar_t>(exp(i1 * k_vector.dot(d)));
 
         modifiers.apply_to_hoppings<scalar_t>(system, n, [&](int i, int j, scalar_t hopping) {
-            matrix.coeffRef(i, j) += hopping * phase;
-            matrix.coeffRef(j, i) += num::conjugate(hopping * phase);
+            if (i == j) {
+                diagonal[i] += hopping * phase + num::conjugate(hopping * phase);
+            }
         });
     }
+
+    auto const indptr = matrix.outerIndexPtr();
+    auto const indices = matrix.innerIndexPtr();
+    auto slots = ArrayXi(num_sites);
+    for (auto i = 0; i < num_sites; ++i) {
+        auto const row_end = indices + indptr[i + 1];
+        auto const it = std::lower_bound(indices + indptr[i], row_end, i);
+        slots[i] = (it != row_end && *it == i) ? static_cast<int>(it - indices) : -1;
+        if (slots[i] < 0 && diagonal[i] != scalar_t{0}) {
+            return false;
+        }
+    }
+
+    auto const data = matrix.valuePtr();
+    for (auto i = 0; i < num_sites; ++i) {
+        if (slots[i] >= 0) {
+            data[slots[i]] = diagonal[i];
+        }
+    }
+    return true;
 }
 
-/// Check that all the values in the matrix are finite
+/// Check that all the values are finite
 template<class scalar_t>
-void throw_if_invalid(SparseMatrixX<scalar_t> const& m) {
-    auto const data = Eigen::Map<ArrayX<scalar_t> const>(m.valuePtr(), m.nonZeros());
+void throw_if_invalid(scalar_t const* values, Eigen::Index size) {
+    auto const data = Eigen::Map<ArrayX<scalar_t> const>(values, size);
     if (!data.allFinite()) {
         throw std::runtime_error("The Hamiltonian contains invalid values: NaN or INF.\n"
                                  "Check the lattice and/or modifier functions.");
     }
 }
 
+/// Check that all the values in the matrix are finite
+template<class scalar_t, class index_t>
+void throw_if_invalid(SparseMatrixX<scalar_t, index_t> const& m) {
+    throw_if_invalid(m.valuePtr(), m.nonZeros());
+}
+
+/// Position of element (row, col) in the data of the compressed matrix `m`, which must exist
+template<class scalar_t>
+int find_offset(SparseMatrixX<scalar_t> const& m, int row, int col) {
+    auto const indices = m.innerIndexPtr();
+    auto const it = std::lower_bound(indices + m.outerIndexPtr()[row],
+                                     indices + m.outerIndexPtr()[row + 1], col);
+    assert(it != indices + m.outerIndexPtr()[row + 1] && *it == col);
+    return static_cast<int>(it - indices);
+}
+
+/// Build the complete Hamiltonian at the given wave vector, see `ham::make()`
+template<class scalar_t, class index_t>
+void build_full(SparseMatrixX<scalar_t, index_t>& matrix, System const& system,
+                HamiltonianModifiers const& modifiers, Cartesian k_vector) {
+    auto builder = CsrBuilder<scalar_t, index_t>(
+        matrix, hamiltonian_capacity(system, has_onsite_energy(system, modifiers), true)
+    );
+    insert_main(builder, system, modifiers);
+    insert_periodic(builder, system, modifiers, k_vector);
+    builder.finish(modifiers.num_threads);
+    throw_if_invalid(matrix);
+}
+
+/// Build the main part of the Hamiltonian and make room for all the periodic boundary hoppings
+template<class scalar_t>
+void build_periodic_parts(PeriodicParts<scalar_t>& parts, System const& system,
+                          HamiltonianModifiers const& modifiers) {
+    auto& matrix = parts.matrix;
+    auto builder = CsrBuilder<scalar_t>(
+        matrix, hamiltonian_capacity(system, has_onsite_energy(system, modifiers), true)
+    );
+    insert_main(builder, system, modifiers);
+
+    using Triplets = std::vector<std::tuple<int, int, scalar_t>>;
+    auto triplets = std::vector<Triplets>(system.boundaries.size());
+    for (auto n = size_t{0}, size = system.boundaries.size(); n < size; ++n) {
+        modifiers.apply_to_hoppings<scalar_t>(system, n, [&](int i, int j, scalar_t hopping) {
+            triplets[n].emplace_back(i, j, hopping);
+            // Explicit zeros: the values are only known once the wave vector is given
+            builder.insert(i, j, scalar_t{0});
+            builder.insert(j, i, scalar_t{0});
+        });
+    }
+    builder.finish(modifiers.num_threads);
+
+    parts.boundaries.resize(system.boundaries.size());
+    for (auto n = size_t{0}, size = system.boundaries.size(); n < size; ++n) {
+        auto& b = parts.boundaries[n];
+        auto const num_hoppings = static_cast<int>(triplets[n].size());
+        b.shift = system.boundaries[n].shift;
+        b.hoppings.resize(num_hoppings);
+        b.ij_offsets.resize(num_hoppings);
+        b.ji_offsets.resize(num_hoppings);
+
+        for (auto h = 0; h < num_hoppings; ++h) {
+            auto const& t = triplets[n][h];
+            b.hoppings[h] = std::get<2>(t);
+            b.ij_offsets[h] = find_offset(matrix, std::get<0>(t), std::get<1>(t));
+            b.ji_offsets[h] = find_offset(matrix, std::get<1>(t), std::get<0>(t));
+        }
+    }
+}
+
+/// Assemble the Hamiltonian at the given wave vector: same values as `insert_periodic()`
+template<class scalar_t>
+void assemble_periodic(SparseMatrixX<scalar_t>& matrix, PeriodicParts<scalar_t> const& parts,
+                       Cartesian k_vector) {
+    matrix = parts.matrix;
+    auto const data = matrix.valuePtr();
+    for (auto const& b : parts.boundaries) {
+        using constant::i1;
+        auto const phase = num::complex_cast<scalar_t>(exp(i1 * k_vector.dot(b.shift)));
+
+        for (auto h = 0, size = static_cast<int>(b.hoppings.size()); h < size; ++h) {
+            auto const value = b.hoppings[h] * phase;
+            data[b.ij_offsets[h]] += value;
+            data[b.ji_offsets[h]] += num::conjugate(value);
+        }
+    }
+}
+
 } // namespace detail
 
 namespace ham {
@@ -110,18 +503,105 @@ inline bool is(Hamiltonian const& h) {
     return h.get_variant().template is<SparseMatrixRC<scalar_t>>();
 }
 
+/// The matrix of `make()` with any `index_t`, e.g. `std::int64_t` for more than 2^31 non-zeros
+template<class scalar_t, class index_t = int>
+SparseMatrixX<scalar_t, index_t> make_csr(System const& system,
+                                          HamiltonianModifiers const& modifiers,
+                                          Cartesian k_vector) {
+    auto matrix = SparseMatrixX<scalar_t, index_t>();
+    detail::build_full(matrix, system, modifiers, k_vector);
+    return matrix;
+}
+
 template<class scalar_t>
 Hamiltonian make(System const& system, HamiltonianModifiers const& modifiers, Cartesian k_vector) {
     auto matrix = std::make_shared<SparseMatrixX<scalar_t>>();
+    detail::build_full(*matrix, system, modifiers, k_vector);
+    return matrix;
+}
 
-    detail::build_main(*matrix, system, modifiers);
-    detail::build_periodic(*matrix, system, modifiers, k_vector);
+/// Rows [start, end) of the Hamiltonian built by `make()`, with the global column indices.
+/// The modifiers are applied to the whole system, but only the rows in the block are stored:
+/// a distributed run builds each rank's block without the full matrix, see `dist::`.
+template<class scalar_t>
+Hamiltonian make_rows(System const& system, HamiltonianModifiers const& modifiers,
+                      Cartesian k_vector, int start, int end) {
+    auto matrix = std::make_shared<SparseMatrixX<scalar_t>>();
 
-    matrix->makeCompressed();
+    ArrayXi const capacity = detail::hamiltonian_capacity(
+        system, detail::has_onsite_energy(system, modifiers), true
+    ).segment(start, end - start);
+    auto builder = detail::CsrBuilder<scalar_t>(*matrix, capacity, start, system.num_sites());
+    detail::insert_main(builder, system, modifiers);
+    detail::insert_periodic(builder, system, modifiers, k_vector);
+    builder.finish(modifiers.num_threads);
     detail::throw_if_invalid(*matrix);
 
     return matrix;
 }
 
+/// Build the wave vector independent parts of the Hamiltonian, see `PeriodicHamiltonian`
+template<class scalar_t>
+PeriodicHamiltonian make_periodic(System const& system, HamiltonianModifiers const& modifiers) {
+    auto parts = std::make_shared<detail::PeriodicParts<scalar_t>>();
+    detail::build_periodic_parts(*parts, system, modifiers);
+
+    detail::throw_if_invalid(parts->matrix);
+    for (auto const& b : parts->boundaries) {
+        detail::throw_if_invalid(b.hoppings.data(), static_cast<int>(b.hoppings.size()));
+    }
+
+    return parts;
+}
+
+/// Return a copy of `h` with new onsite energies: the hoppings are reused as they are.
+/// The result is empty if the sparsity pattern of `h` can't fit the new onsite energies.
+template<class scalar_t>
+Hamiltonian update_onsite(Hamiltonian const& h, System const& system,
+                          HamiltonianModifiers const& modifiers, Cartesian k_vector) {
+    auto matrix = std::make_shared<SparseMatrixX<scalar_t>>(get_reference<scalar_t>(h));
+    if (!detail::update_onsite(*matrix, system, modifiers, k_vector)) {
+        return {};
+    }
+
+    detail::throw_if_invalid(*matrix);
+    return matrix;
+}
+
+/// Copy a square external CSR matrix into a new Hamiltonian, see `sparse::from_csr()`.
+/// This is an entry point for matrices which don't come from a `Model`.
+template<class scalar_t>
+Hamiltonian from_csr(num::CsrConstRef<scalar_t> const& ref) {
+    if (ref.rows != ref.cols) {
+        throw std::logic_error("The Hamiltonian matrix must be square");
+    }
+    auto matrix = std::make_shared<SparseMatrixX<scalar_t>>(sparse::from_csr(ref));
+    detail::throw_if_invalid(*matrix);
+    return matrix;
+}
+
+/// Do `a` and `b` have the same scalar type, structure and hoppings? I.e. they may only
+/// differ in the values of the diagonal elements (onsite energy)
+bool differs_only_in_onsite(Hamiltonian const& a, Hamiltonian const& b);
+
+/// Return the velocity operator `v = i/hbar [H, r]` along `direction` without the `i/hbar`
+/// factor: `v_ij = h_ij * (r_j - r_i) . direction`, with the same scalar type and structure
+/// as `h`. The periodic boundary hoppings use the distance to the shifted image of site `j`.
+/// An element which combines a regular and a boundary hopping (tiny periodic systems) can't
+/// be split and it takes the boundary distance.
+Hamiltonian velocity(Hamiltonian const& h, System const& system, Cartesian direction);
+
+/// Return a copy of `h` without the rows and columns of the sites with `new_index < 0`,
+/// see `detail::removal_index()`. The other values are copied as they are: no modifiers
+/// are applied again.
+Hamiltonian remove_sites(Hamiltonian const& h, ArrayXi const& new_index);
+
+/// Return a copy of `h` which stores every diagonal element, zeros included,
+/// so that `kpm::Strategy::change_onsite()` can write all of them
+Hamiltonian with_diagonal(Hamiltonian const& h);
+
+/// The real part of the main diagonal (onsite energy) of `h`
+ArrayXd real_diagonal(Hamiltonian const& h);
+
 } // namespace ham
 } // namespace cpb
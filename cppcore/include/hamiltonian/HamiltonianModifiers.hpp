@@ -3,10 +3,12 @@
 
 #include "numeric/dense.hpp"
 #include "numeric/sparse.hpp"
+#include "utils/ThreadPool.hpp"
 
 #include <vector>
 #include <algorithm>
 #include <memory>
+#include <string>
 
 namespace cpb {
 
@@ -20,9 +22,15 @@ public:
     Function apply; ///< to be user-implemented
     bool is_complex = false; ///< the modeled effect requires complex values
     bool is_double = false; ///< the modeled effect requires double precision
+    bool is_thread_safe = false; ///< `apply` may be called concurrently (not for Python functions)
+    /// Identifies a compiled `apply` function and its arguments, see `Model::parameter_hash()`.
+    /// Empty if `apply` is opaque, e.g. a Python function.
+    std::string fingerprint;
 
-    OnsiteModifier(Function const& apply, bool is_complex = false, bool is_double = false)
-        : apply(apply), is_complex(is_complex), is_double(is_double) {}
+    OnsiteModifier(Function const& apply, bool is_complex = false, bool is_double = false,
+                   bool is_thread_safe = false)
+        : apply(apply), is_complex(is_complex), is_double(is_double),
+          is_thread_safe(is_thread_safe) {}
 
     explicit operator bool() const { return static_cast<bool>(apply); }
 };
@@ -37,9 +45,15 @@ public:
     Function apply; ///< to be user-implemented
     bool is_complex = false; ///< the modeled effect requires complex values
     bool is_double = false; ///< the modeled effect requires double precision
+    bool is_thread_safe = false; ///< `apply` may be called concurrently (not for Python functions)
+    /// Identifies a compiled `apply` function and its arguments, see `Model::parameter_hash()`.
+    /// Empty if `apply` is opaque, e.g. a Python function.
+    std::string fingerprint;
 
-    HoppingModifier(Function const& apply, bool is_complex = false, bool is_double = false)
-        : apply(apply), is_complex(is_complex), is_double(is_double) {}
+    HoppingModifier(Function const& apply, bool is_complex = false, bool is_double = false,
+                    bool is_thread_safe = false)
+        : apply(apply), is_complex(is_complex), is_double(is_double),
+          is_thread_safe(is_thread_safe) {}
 
     explicit operator bool() const { return static_cast<bool>(apply); }
 };
@@ -50,6 +64,12 @@ public:
 struct HamiltonianModifiers {
     std::vector<OnsiteModifier> onsite;
     std::vector<HoppingModifier> hopping;
+    int num_threads = 1; ///< used only if all the hopping (or onsite) modifiers are thread-safe
+    /// Number of sites per onsite modifier call, 0 means all of them in a single call.
+    /// This bounds the memory of the buffers and of the modifiers' temporaries, but the
+    /// modifiers which depend on the whole system (e.g. random disorder) see each chunk
+    /// as a separate system. Thread-safe modifiers evaluate the chunks in parallel.
+    int onsite_chunk_size = 0;
 
     /// Do any of the modifiers require complex numbers?
     bool any_complex() const;
@@ -57,6 +77,11 @@ struct HamiltonianModifiers {
     /// Do any of the modifiers require double precision?
     bool any_double() const;
 
+    /// Can the hopping modifiers be applied to multiple chunks concurrently?
+    bool all_thread_safe() const;
+    /// Can the onsite modifiers be applied to multiple chunks concurrently?
+    bool all_onsite_thread_safe() const;
+
     /// Remove all modifiers
     void clear();
 
@@ -69,61 +94,152 @@ struct HamiltonianModifiers {
     ///     lambda(int i, int j, scalar_t hopping)
     template<class scalar_t, class Fn>
     void apply_to_hoppings(System const& system, Fn fn) const {
-        apply_to_hoppings_impl<scalar_t>(system, system.positions, system.lattice, fn);
+        apply_to_hoppings_impl<scalar_t>(system, system, fn);
     };
 
     template<class scalar_t, class Fn>
     void apply_to_hoppings(System const& system, size_t boundary_index, Fn fn) const {
-        apply_to_hoppings_impl<scalar_t>(system.boundaries[boundary_index],
-                                         system.positions, system.lattice, fn);
+        apply_to_hoppings_impl<scalar_t>(system.boundaries[boundary_index], system, fn);
     };
 
 private:
+    /// The site positions and the lattice are taken from `sites`
     template<class scalar_t, class SystemOrBoundary, class Fn>
-    void apply_to_hoppings_impl(SystemOrBoundary const& system, CartesianArray const& positions,
-                                Lattice const& lattice, Fn lambda) const;
+    void apply_to_hoppings_impl(SystemOrBoundary const& system, System const& sites,
+                                Fn lambda) const;
 };
 
 namespace detail {
     inline Cartesian shifted(Cartesian pos, System const&) { return pos; }
     inline Cartesian shifted(Cartesian pos, System::Boundary const& b) { return pos - b.shift; }
+
+    /// Number of hoppings per modifier call: sized so that a chunk of buffers (`bytes_per_hopping`
+    /// each) fits into the L3 cache or into the L2 cache of each thread if `is_parallel`
+    int hopping_chunk_size(int bytes_per_hopping, int max_hoppings, bool is_parallel);
+
+    /// Call `modify(buffer, c)` for chunks `c` in [0, num_chunks) and then `consume(buffer, c)`.
+    /// With `num_threads > 1`, each thread modifies one chunk per round, but the results are
+    /// always consumed in order so that the consumer sees the same sequence as in the serial
+    /// case. There is one reusable `Buffer` per thread.
+    template<class Buffer, class Modify, class Consume>
+    void process_chunks(int num_chunks, int num_threads, Modify modify, Consume consume) {
+        if (num_threads <= 1) {
+            auto buffer = Buffer();
+            for (auto c = 0; c < num_chunks; ++c) {
+                modify(buffer, c);
+                consume(buffer, c);
+            }
+        } else {
+            ThreadPool pool(num_threads);
+            auto buffers = std::vector<Buffer>(pool.size());
+            for (auto first = 0; first < num_chunks; first += pool.size()) {
+                pool.run([&](int thread_id) {
+                    if (first + thread_id < num_chunks) {
+                        modify(buffers[thread_id], first + thread_id);
+                    }
+                });
+                for (auto n = 0; n < pool.size() && first + n < num_chunks; ++n) {
+                    consume(buffers[n], first + n);
+                }
+            }
+        }
+    }
+
+    /// Reusable buffers for applying onsite modifiers to a chunk of sites
+    template<class scalar_t>
+    struct OnsiteBuffer {
+        ArrayX<scalar_t> potential;
+        CartesianArray positions;
+        ArrayX<sub_id> sublattices;
+    };
+
+    /// Reusable buffers for applying hopping modifiers to a chunk of hoppings
+    template<class scalar_t>
+    struct HoppingBuffer {
+        ArrayX<scalar_t> hoppings;
+        CartesianArray pos1;
+        CartesianArray pos2;
+
+        /// No reallocation unless the size changes, i.e. at most once for the last chunk
+        void resize(int size) {
+            hoppings.resize(size);
+            pos1.resize(size);
+            pos2.resize(size);
+        }
+    };
 }
 
 template<class scalar_t, class Fn>
 void HamiltonianModifiers::apply_to_onsite(System const& system, Fn lambda) const {
+    auto const has_lattice_onsite = system.lattice.has_onsite_energy();
+    if (!has_lattice_onsite && onsite.empty()) {
+        return;
+    }
+
     auto const num_sites = system.num_sites();
-    auto potential = ArrayX<scalar_t>{};
+    auto const chunk_size = (onsite_chunk_size > 0) ? std::min(onsite_chunk_size, num_sites)
+                                                    : num_sites;
+    auto const num_chunks = (num_sites + chunk_size - 1) / chunk_size;
+    auto const is_parallel = num_threads > 1 && num_chunks > 1 && !onsite.empty()
+                             && all_onsite_thread_safe();
 
-    if (system.lattice.has_onsite_energy()) {
-        potential.resize(num_sites);
-        transform(system.sublattices, potential, [&](sub_id id) {
-            using real_t = num::get_real_t<scalar_t>;
-            return static_cast<real_t>(system.lattice.onsite_energy(id));
-        });
-    }
+    auto modify = [&](detail::OnsiteBuffer<scalar_t>& buffer, int c) {
+        auto const start = c * chunk_size;
+        auto const size = std::min(chunk_size, num_sites - start);
+        auto const is_whole = (size == num_sites); // no copies, the system arrays are used
+
+        if (!is_whole) {
+            buffer.sublattices = system.sublattices.segment(start, size);
+        }
+        auto const& sublattices = is_whole ? system.sublattices : buffer.sublattices;
 
-    if (!onsite.empty()) {
-        if (potential.size() == 0)
-            potential.setZero(num_sites);
+        buffer.potential.resize(size);
+        if (has_lattice_onsite) {
+            transform(sublattices, buffer.potential, [&](sub_id id) {
+                using real_t = num::get_real_t<scalar_t>;
+                return static_cast<real_t>(system.lattice.onsite_energy(id));
+            });
+        } else {
+            buffer.potential.setZero();
+        }
+        if (onsite.empty()) {
+            return;
+        }
 
+        auto const& positions = [&]() -> CartesianArray const& {
+            if (is_whole) {
+                return system.expanded_positions(buffer.positions);
+            }
+            buffer.positions.resize(size);
+            for (auto i = 0; i < size; ++i) {
+                buffer.positions[i] = system.position(start + i);
+            }
+            return buffer.positions;
+        }();
         for (auto const& modifier : onsite) {
-            modifier.apply(arrayref(potential), system.positions,
-                           {system.sublattices, system.lattice.get_sites().id});
+            modifier.apply(arrayref(buffer.potential), positions,
+                           {sublattices, system.lattice.get_sites().id});
         }
-    }
+    };
 
-    if (potential.size() > 0) {
-        for (int i = 0; i < num_sites; ++i) {
-            if (potential[i] != scalar_t{0})
-                lambda(i, potential[i]);
+    auto consume = [&](detail::OnsiteBuffer<scalar_t> const& buffer, int c) {
+        auto const start = c * chunk_size;
+        for (auto i = 0, size = static_cast<int>(buffer.potential.size()); i < size; ++i) {
+            if (buffer.potential[i] != scalar_t{0}) {
+                lambda(start + i, buffer.potential[i]);
+            }
         }
-    }
+    };
+
+    detail::process_chunks<detail::OnsiteBuffer<scalar_t>>(
+        num_chunks, is_parallel ? num_threads : 1, modify, consume
+    );
 }
 
 template<class scalar_t, class SystemOrBoundary, class Fn>
 void HamiltonianModifiers::apply_to_hoppings_impl(SystemOrBoundary const& system,
-                                                  CartesianArray const& positions,
-                                                  Lattice const& lattice, Fn lambda) const {
+                                                  System const& sites, Fn lambda) const {
+    auto const& lattice = sites.lattice;
     auto hopping_csr_matrix = sparse::make_loop(system.hoppings);
 
     if (hopping.empty()) {
@@ -135,54 +251,62 @@ void HamiltonianModifiers::apply_to_hoppings_impl(SystemOrBoundary const& system
         /*
          Applying modifiers to each hopping individually would be slow.
          Passing all the values in one call would require a lot of memory.
-         The loop below buffers hoppings to balance performance and memory usage.
+         The hoppings are processed in cache-sized chunks to balance the two.
         */
-        // TODO: experiment with buffer_size -> currently: hoppings + pos1 + pos2 is about 3MB
-        auto const buffer_size = [&]{
-            constexpr auto max_buffer_size = 100000;
-            auto const max_hoppings = system.hoppings.nonZeros();
-            return std::min(max_hoppings, max_buffer_size);
-        }();
+        auto const num_hoppings = static_cast<int>(system.hoppings.nonZeros());
+        auto const is_parallel = num_threads > 1 && all_thread_safe();
+        auto const chunk_size = detail::hopping_chunk_size(
+            static_cast<int>(sizeof(scalar_t) + 2 * sizeof(Cartesian)), num_hoppings, is_parallel
+        );
+        auto const num_chunks = (num_hoppings + chunk_size - 1) / chunk_size;
 
-        auto hoppings = ArrayX<scalar_t>{buffer_size};
-        auto pos1 = CartesianArray{buffer_size};
-        auto pos2 = CartesianArray{buffer_size};
-
-        // TODO: Hopping IDs can be mapped directly from the matrix, thus removing the need for
-        //       this temporary buffer. However `apply()` needs to accept an array map.
-        auto hop_ids = ArrayX<hop_id>{buffer_size};
-
-        hopping_csr_matrix.buffered_for_each(
-            buffer_size,
-            // fill buffer
-            [&](int row, int col, hop_id id, int n) {
-                hoppings[n] = num::complex_cast<scalar_t>(lattice.hopping_energy(id));
-                pos1[n] = positions[row];
-                pos2[n] = detail::shifted(positions[col], system);
-                hop_ids[n] = id;
-            },
-            // process buffer
-            [&](int start_row, int start_idx, int size) {
-                if (size < buffer_size) {
-                    hoppings.conservativeResize(size);
-                    pos1.conservativeResize(size);
-                    pos2.conservativeResize(size);
-                    hop_ids.conservativeResize(size);
-                }
+        auto const indptr = system.hoppings.outerIndexPtr();
+        auto const rows = static_cast<int>(system.hoppings.outerSize());
+        auto const hop_ids = system.hoppings.valuePtr();
+        auto const& name_map = lattice.get_hoppings().id;
 
-                for (auto const& modifier : hopping) {
-                    modifier.apply(arrayref(hoppings), pos1, pos2,
-                                   {hop_ids, lattice.get_hoppings().id});
+        // Position of chunk `c` in the matrix: its first data index and that element's row
+        auto const chunk_start = [&](int c) { return c * chunk_size; };
+        auto const chunk_row = [&](int c) {
+            auto const it = std::upper_bound(indptr, indptr + rows + 1, chunk_start(c));
+            return static_cast<int>(it - indptr) - 1;
+        };
+        auto const chunk_length = [&](int c) {
+            return std::min(chunk_size, num_hoppings - chunk_start(c));
+        };
+
+        auto modify = [&](detail::HoppingBuffer<scalar_t>& buffer, int c) {
+            auto const size = chunk_length(c);
+            buffer.resize(size);
+            hopping_csr_matrix.slice_for_each(
+                chunk_row(c), chunk_start(c), size,
+                [&](int row, int col, hop_id id, int n) {
+                    buffer.hoppings[n] = num::complex_cast<scalar_t>(lattice.hopping_energy(id));
+                    buffer.pos1[n] = sites.position(row);
+                    buffer.pos2[n] = detail::shifted(sites.position(col), system);
                 }
+            );
 
-                hopping_csr_matrix.slice_for_each(
-                    start_row, start_idx, size,
-                    [&](int row, int col, hop_id, int n) {
-                        if (hoppings[n] != scalar_t{0})
-                            lambda(row, col, hoppings[n]);
-                    }
-                );
+            // The hopping IDs don't need a buffer: they are mapped straight from the matrix
+            auto const ids = Eigen::Map<ArrayX<hop_id> const>(hop_ids + chunk_start(c), size);
+            for (auto const& modifier : hopping) {
+                modifier.apply(arrayref(buffer.hoppings), buffer.pos1, buffer.pos2,
+                               {ids, name_map});
             }
+        };
+
+        auto consume = [&](detail::HoppingBuffer<scalar_t> const& buffer, int c) {
+            hopping_csr_matrix.slice_for_each(
+                chunk_row(c), chunk_start(c), chunk_length(c),
+                [&](int row, int col, hop_id, int n) {
+                    if (buffer.hoppings[n] != scalar_t{0})
+                        lambda(row, col, buffer.hoppings[n]);
+                }
+            );
+        };
+
+        detail::process_chunks<detail::HoppingBuffer<scalar_t>>(
+            num_chunks, is_parallel ? num_threads : 1, modify, consume
         );
     }
 }
@@ -0,0 +1,40 @@
+#pragma once
+#include "hamiltonian/Hamiltonian.hpp"
+#include "system/System.hpp"
+
+#include <vector>
+
+namespace cpb {
+
+/**
+ Rotation and mirror symmetries of a finite system together with its Hamiltonian
+
+ Each symmetry is a permutation of the sites which leaves the Hamiltonian unchanged:
+ `H(p[i], p[j]) == H(i, j)`. All the sites of an orbit, i.e. the sites which are mapped
+ onto each other, have identical local properties like the LDOS. Only one representative
+ per orbit needs to be computed, which cuts the work by up to the order of the group.
+ */
+struct PointSymmetry {
+    std::vector<ArrayXi> permutations; ///< site `i` is mapped to `permutations[k][i]`
+    ArrayXi representatives; ///< the lowest index in the orbit of each site
+
+    /// Number of symmetry operations, including the identity
+    int group_order() const { return static_cast<int>(permutations.size()) + 1; }
+    bool empty() const { return permutations.empty(); }
+    /// Ascending indices of the representative sites of all the orbits
+    std::vector<int> orbit_representatives() const;
+};
+
+namespace ham {
+
+/// Find the symmetries of `system` and Hamiltonian `h` among the rotations about the z axis
+/// by multiples of 60 and 90 degrees and the mirror lines at multiples of 15 degrees, all
+/// through the centroid of the sites. The positions must match within `tolerance` (nm) and
+/// the Hamiltonian elements within a relative `1e-4`. The sublattices may be exchanged as
+/// long as the Hamiltonian is unchanged. Systems with periodic boundaries and Hamiltonians
+/// with more than one orbital per site have no symmetries here.
+PointSymmetry find_point_symmetry(System const& system, Hamiltonian const& h,
+                                  float tolerance = 1e-3f);
+
+} // namespace ham
+} // namespace cpb
@@ -27,13 +27,33 @@ struct Scale {
     }
 
     explicit operator bool() { return a != 0; }
+
+    friend bool operator==(Scale const& l, Scale const& r) { return l.a == r.a && l.b == r.b; }
+    friend bool operator!=(Scale const& l, Scale const& r) { return !(l == r); }
 };
 
+/**
+ How to determine the energy bounds automatically
+
+ Lanczos: from a random vector every time (reference implementation)
+ WarmLanczos: start from the extremal Ritz vectors of the previous Hamiltonian, see
+              `Bounds::warm_start()`, this converges in a few loops for a small change
+ Gershgorin: no iterations, the union of Gershgorin discs always contains the spectrum
+             but it's wider than the real bounds so more moments are needed
+ */
+enum class BoundsMethod { Lanczos, WarmLanczos, Gershgorin };
+
 /**
  Min and max eigenvalues of the Hamiltonian
 
  The bounds can be determined automatically using the Lanczos procedure,
  or set manually by the user. Also computes the KPM scaling factors a and b.
+
+ With `use_cache`, the Lanczos results are shared between all `Bounds` in the process
+ by a hash of the matrix. This avoids running the same procedure again and again, e.g. for
+ each job of a `parallel_for` sweep which doesn't change the Hamiltonian. Hashing reads the
+ whole matrix on every call and the cache keeps a copy of each matrix to verify a hit, so
+ it only pays off if the Lanczos procedure would run again for the same matrix.
 */
 template<class scalar_t>
 class Bounds {
@@ -43,15 +63,26 @@ class Bounds {
     real_t max; ///< the highest eigenvalue
     Scale<real_t> factors;
 
-    SparseMatrixX<scalar_t> const* matrix;
-    real_t precision_percent;
+    SparseMatrixX<scalar_t> const* matrix = nullptr;
+    real_t precision_percent = 0;
+    BoundsMethod method = BoundsMethod::Lanczos;
+    bool use_cache = false;
+    VectorX<scalar_t> ritz_vector; ///< start of the next `WarmLanczos` procedure
 
     int lanczos_loops = 0;  ///< number of iterations needed to converge the Lanczos procedure
+    bool is_shifted = false; ///< the Lanczos result was updated by `shift_diagonal()`
+    bool is_cached = false; ///< the Lanczos result was found in the cache
     Chrono timer;
 
+    /// Max relative widening of the spectrum accepted by `shift_diagonal()`: a wider
+    /// spectrum requires more KPM moments, at some point that costs more than Lanczos
+    static constexpr auto max_widening = 0.05f;
+
 public:
-    Bounds(SparseMatrixX<scalar_t> const* matrix, real_t precision_percent)
-        : matrix(matrix), precision_percent(precision_percent) {}
+    Bounds(SparseMatrixX<scalar_t> const* matrix, real_t precision_percent,
+           BoundsMethod method = BoundsMethod::Lanczos, bool use_cache = false)
+        : matrix(matrix), precision_percent(precision_percent), method(method),
+          use_cache(use_cache) {}
     /// Set the energy bounds manually, therefore skipping the Lanczos computation
     Bounds(real_t min_energy, real_t max_energy)
         : min(min_energy), max(max_energy), factors(min_energy, max_energy) {}
@@ -64,6 +95,25 @@ public:
         return factors;
     }
 
+    /// The lowest and highest eigenvalue, computed on first use like the scaling factors
+    real_t min_energy() { scaling_factors(); return min; }
+    real_t max_energy() { scaling_factors(); return max; }
+
+    /// The matrix was replaced by `new_matrix` which only differs from `previous` in the
+    /// diagonal elements. Try to update the bounds without the Lanczos procedure: returns
+    /// false if that's not possible and the bounds need to be recomputed from scratch.
+    bool shift_diagonal(SparseMatrixX<scalar_t> const& previous,
+                        SparseMatrixX<scalar_t> const* new_matrix);
+
+    /// Take over the Ritz vector of the `previous` bounds (for a matrix of the same size)
+    /// as the starting point of the `WarmLanczos` method
+    void warm_start(Bounds&& previous) {
+        if (method == BoundsMethod::WarmLanczos && matrix
+            && previous.ritz_vector.size() == matrix->rows()) {
+            ritz_vector = std::move(previous.ritz_vector);
+        }
+    }
+
     /// Apply the scaling factors to a vector
     ArrayX<real_t> scaled(ArrayX<real_t> const& v) {
         auto const scale = scaling_factors();
@@ -73,8 +123,10 @@ public:
     std::string report(bool shortform = false) const;
 
 private:
-    /// Compute the scaling factors using the Lanczos procedure
+    /// Compute the scaling factors using the Lanczos procedure (or the chosen `method`)
     void compute_factors();
+    /// The Lanczos procedure itself, the result is shared via the cache if enabled
+    void compute_lanczos();
 };
 
 CPB_EXTERN_TEMPLATE_CLASS(Bounds)
@@ -22,8 +22,19 @@ struct Kernel {
         auto const N = static_cast<int>(moments.size());
         moments *= damping_coefficients(N).template cast<real_t>();
     }
+
+    /// Apply the kernel damping to a block of moments (one column per index)
+    template<class scalar_t>
+    void apply(ArrayXX<scalar_t>& moments) const {
+        using real_t = num::get_real_t<scalar_t>;
+        auto const N = static_cast<int>(moments.rows());
+        moments.colwise() *= damping_coefficients(N).template cast<real_t>();
+    }
 };
 
+/// Round up `n` to a number of moments which is acceptable for all KPM algorithms
+int round_num_moments(int n);
+
 /**
  The Jackson kernel
 
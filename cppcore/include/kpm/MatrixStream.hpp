@@ -0,0 +1,86 @@
+#pragma once
+#include "kpm/OptimizedSizes.hpp"
+#include "numeric/ellmatrix.hpp"
+#include "numeric/sparse.hpp"
+#include "detail/macros.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cpb { namespace kpm {
+
+/**
+ Out-of-core ELLPACK matrix: the rows are kept in a file and only a few blocks are in memory
+
+ The file is split into the row blocks of `OptimizedSizes`, which are exactly the units of
+ work of the interleaved KPM passes (see `calc_moments::diagonal::opt_size_and_interleaved`).
+ A pass of depth `d` sweeps the blocks in order and needs a sliding window of `d` blocks,
+ so each block which is read from the file is reused for `d` KPM iterations. The next
+ block is read in the background while the current window is being computed.
+
+ The file is written by the constructor, one ELLPACK block at a time straight from the CSR
+ rows, so the full ELLPACK matrix is never in memory. It's removed by the destructor. The
+ reads go through the regular file API, so the OS page cache may keep (part of) the file
+ in memory as long as there is free RAM.
+ */
+template<class scalar_t>
+class MatrixStream {
+public:
+    using Block = num::EllRowBlock<scalar_t>;
+
+    /// Write the rows of `matrix` into `filename` as ELLPACK blocks given by `sizes`
+    MatrixStream(std::string filename, SparseMatrixX<scalar_t> const& matrix,
+                 OptimizedSizes const& sizes);
+    ~MatrixStream();
+
+    MatrixStream(MatrixStream const&) = delete;
+    MatrixStream& operator=(MatrixStream const&) = delete;
+
+    int rows() const { return num_rows; }
+    int num_blocks() const { return static_cast<int>(block_rows.size()) - 1; }
+
+    /// Make blocks [first, last] resident and release all the others, except for the
+    /// next block `last + 1` which starts reading in the background
+    void window(int first, int last);
+    /// A block within the current `window()`
+    Block const& operator[](int k) const;
+
+    /// Total number of bytes read from the file so far
+    std::size_t bytes_read() const { return read_bytes; }
+    /// Number of bytes of the largest block: the memory use is about `window + 1` of them
+    std::size_t max_block_bytes() const;
+
+private:
+    struct Slot {
+        int index = -1; ///< block index or -1 if the slot is free
+        Block block;
+    };
+
+    Slot* find(int k) const;
+    Slot* free_slot();
+    void read(int k, Block& block);
+    void finish_prefetch();
+
+private:
+    std::string filename;
+    int num_rows;
+    int nnz_per_row;
+    std::vector<int> block_rows; ///< first row of each block, followed by the end of the last
+    std::vector<std::int64_t> block_offsets; ///< position of each block in the file
+    std::ifstream file;
+
+    std::vector<std::unique_ptr<Slot>> slots;
+    std::future<void> prefetch; ///< background read of `prefetch_slot`, if valid
+    Slot* prefetch_slot = nullptr;
+    int prefetch_index = -1;
+    std::atomic<std::size_t> read_bytes{0}; ///< also updated by the background reads
+};
+
+CPB_EXTERN_TEMPLATE_CLASS(MatrixStream)
+
+}} // namespace cpb::kpm
@@ -1,13 +1,29 @@
 #pragma once
 #include "kpm/OptimizedHamiltonian.hpp"
 
+#include "compute/kernel_polynomial.hpp"
+#include "compute/fft.hpp"
+
 #include "numeric/dense.hpp"
 #include "numeric/constant.hpp"
+#include "numeric/random.hpp"
+
+#include "utils/Arena.hpp"
 
 #include "detail/macros.hpp"
 
 namespace cpb { namespace kpm {
 
+/**
+ Method for reconstructing the final function from the KPM moments
+
+ Direct: evaluate the Chebyshev series at each energy (reference implementation)
+ Clenshaw: same result, but using the Clenshaw recurrence instead of `cos(n * acos(E))`
+ DCT: evaluate the series on a dense Chebyshev grid with a single FFT and interpolate
+      to the requested energies, the fastest option for many moments and energies
+ */
+enum class Reconstruction { Direct, Clenshaw, DCT };
+
 namespace detail {
     /// Reconstruct a real function for `scaled_energy` based on the KPM `moments`
     ///    f(E) = 2/pi * 1/sqrt(1 - E^2) * sum( moments * cos(ns * acos(E)) )
@@ -39,6 +55,328 @@ namespace detail {
         });
         return g;
     }
+
+    /// Clenshaw recurrence for the Chebyshev series with `size` coefficients `c` at `x`.
+    /// Returns `{b0, b1}`: the 1st kind series is `b0 - x*b1` and the 2nd kind is `b0`.
+    template<class scalar_t, class real_t>
+    std::pair<scalar_t, scalar_t> clenshaw(scalar_t const* c, int size, real_t x) {
+        auto b1 = scalar_t{0};
+        auto b2 = scalar_t{0};
+        for (auto n = size - 1; n >= 0; --n) {
+            auto const b0 = c[n] + real_t{2} * x * b1 - b2;
+            b2 = b1;
+            b1 = b0;
+        }
+        return {b1, b2};
+    }
+
+    /// Same as `reconstruct_function` but using the Clenshaw recurrence
+    template<class real_t>
+    ArrayX<real_t> reconstruct_function_clenshaw(ArrayX<real_t> const& scaled_energy,
+                                                 ArrayX<real_t> const& moments) {
+        auto const size = static_cast<int>(moments.size());
+        auto f = ArrayX<real_t>(scaled_energy.size());
+        transform(scaled_energy, f, [&](real_t E) {
+            using constant::pi;
+            auto const b = clenshaw(moments.data(), size, E);
+            return real_t{2/pi} / sqrt(1 - E*E) * (b.first - E * b.second);
+        });
+        return f;
+    }
+
+    /// Same as `reconstruct_greens` but using the Clenshaw recurrence:
+    ///     sum( moments * exp(-i*n*theta) ) = sum( moments * T_n ) - i*sin(theta) * sum( moments[n+1] * U_n )
+    template<class scalar_t, class real_t, class complex_t = num::get_complex_t<scalar_t>>
+    ArrayX<complex_t> reconstruct_greens_clenshaw(ArrayX<real_t> const& scaled_energy,
+                                                  ArrayX<scalar_t> const& moments) {
+        auto const size = static_cast<int>(moments.size());
+        auto g = ArrayX<complex_t>(scaled_energy.size());
+        transform(scaled_energy, g, [&](real_t E) {
+            using constant::i1;
+            auto const sin_theta = sqrt(1 - E*E);
+            auto const t = clenshaw(moments.data(), size, E);
+            auto const u = clenshaw(moments.data() + 1, size - 1, E);
+            auto const series = complex_t{t.first - E * t.second}
+                                - complex_t{i1} * sin_theta * complex_t{u.first};
+            return -real_t{2} * complex_t{i1} / sin_theta * series;
+        });
+        return g;
+    }
+
+    /// The Chebyshev grid has this many points per moment (the accuracy of interpolation)
+    constexpr auto chebyshev_grid_oversampling = 32;
+
+    /// Return `s_k = sum( moments * exp(-i*n*theta_k) )` where `theta_k = 2pi * (k + 1/2) / M`
+    /// for all `k` in [0, M). The grid covers the full circle and it's computed with one FFT.
+    template<class scalar_t, class real_t = num::get_real_t<scalar_t>,
+             class complex_t = num::get_complex_t<scalar_t>>
+    ArrayX<complex_t> chebyshev_grid_series(ArrayX<scalar_t> const& moments) {
+        auto const num_moments = static_cast<int>(moments.size());
+        auto const grid_size = compute::next_power_of_two(
+            chebyshev_grid_oversampling * num_moments
+        );
+
+        // The half-step grid offset is a phase shift of each moment
+        auto s = Arena<ArrayX<complex_t>>::local().take(grid_size);
+        s.setZero();
+        for (auto n = 0; n < num_moments; ++n) {
+            auto const phase = -3.141592653589793 * n / grid_size;
+            s[n] = complex_t{moments[n]} * complex_t(static_cast<real_t>(std::cos(phase)),
+                                                     static_cast<real_t>(std::sin(phase)));
+        }
+        compute::fft(s);
+        return s;
+    }
+
+    /// Cubic (Catmull-Rom) interpolation of the periodic `grid` series at angle `theta`
+    template<class complex_t, class real_t>
+    complex_t interpolate_chebyshev_grid(ArrayX<complex_t> const& grid, real_t theta) {
+        using constant::pi;
+        auto const size = static_cast<int>(grid.size());
+        auto const t = theta * size / (2 * real_t{pi}) - real_t{0.5};
+        auto const k = static_cast<int>(std::floor(t));
+        auto const x = t - k;
+        auto const at = [&](int j) { return grid[((j % size) + size) % size]; };
+
+        auto const p0 = at(k - 1), p1 = at(k), p2 = at(k + 1), p3 = at(k + 2);
+        return real_t{0.5} * (real_t{2} * p1 + (p2 - p0) * x
+                              + (real_t{2} * p0 - real_t{5} * p1 + real_t{4} * p2 - p3) * x * x
+                              + (real_t{3} * (p1 - p2) + p3 - p0) * x * x * x);
+    }
+
+    /// Same as `reconstruct_function` but using a DCT on a dense Chebyshev grid
+    template<class real_t>
+    ArrayX<real_t> reconstruct_function_dct(ArrayX<real_t> const& scaled_energy,
+                                            ArrayX<real_t> const& moments) {
+        auto grid = chebyshev_grid_series(moments);
+        auto f = ArrayX<real_t>(scaled_energy.size());
+        transform(scaled_energy, f, [&](real_t E) {
+            using constant::pi;
+            auto const s = interpolate_chebyshev_grid(grid, acos(E));
+            return real_t{2/pi} / sqrt(1 - E*E) * s.real();
+        });
+        Arena<decltype(grid)>::local().give(std::move(grid));
+        return f;
+    }
+
+    /// Same as `reconstruct_greens` but using an FFT on a dense Chebyshev grid
+    template<class scalar_t, class real_t, class complex_t = num::get_complex_t<scalar_t>>
+    ArrayX<complex_t> reconstruct_greens_dct(ArrayX<real_t> const& scaled_energy,
+                                             ArrayX<scalar_t> const& moments) {
+        auto grid = chebyshev_grid_series(moments);
+        auto g = ArrayX<complex_t>(scaled_energy.size());
+        transform(scaled_energy, g, [&](real_t E) {
+            using constant::i1;
+            auto const norm = -real_t{2} * complex_t{i1} / sqrt(1 - E*E);
+            return norm * interpolate_chebyshev_grid(grid, acos(E));
+        });
+        Arena<decltype(grid)>::local().give(std::move(grid));
+        return g;
+    }
+
+    /// Reconstruct a real function using the given `method`
+    template<class real_t>
+    ArrayX<real_t> reconstruct_function(ArrayX<real_t> const& scaled_energy,
+                                        ArrayX<real_t> const& moments, Reconstruction method) {
+        switch (method) {
+            case Reconstruction::Clenshaw:
+                return reconstruct_function_clenshaw(scaled_energy, moments);
+            case Reconstruction::DCT:
+                return reconstruct_function_dct(scaled_energy, moments);
+            default:
+                return reconstruct_function(scaled_energy, moments);
+        }
+    }
+
+    /// Reconstruct Green's function using the given `method`
+    template<class scalar_t, class real_t, class complex_t = num::get_complex_t<scalar_t>>
+    ArrayX<complex_t> reconstruct_greens(ArrayX<real_t> const& scaled_energy,
+                                         ArrayX<scalar_t> const& moments, Reconstruction method) {
+        switch (method) {
+            case Reconstruction::Clenshaw:
+                return reconstruct_greens_clenshaw(scaled_energy, moments);
+            case Reconstruction::DCT:
+                return reconstruct_greens_dct(scaled_energy, moments);
+            default:
+                return reconstruct_greens(scaled_energy, moments);
+        }
+    }
+
+    /**
+     Precomputed Chebyshev basis for reconstructing many results on the same energy grid
+
+     Row `k` holds the terms of the `reconstruct_function` (or `reconstruct_greens`) series at
+     `scaled_energy[k]` including the normalization, so all the columns of a moments matrix
+     are reconstructed by a single matrix product (GEMM). Same as `Reconstruction::Direct`.
+     The basis needs `energies * num_moments` elements and it's only built on first use.
+     */
+    template<class real_t>
+    class ReconstructionPlan {
+        using complex_t = std::complex<real_t>;
+
+    public:
+        /// Keep the basis if it's for the same energy grid and number of moments
+        void prepare(ArrayX<real_t> const& scaled_energy, int num_moments) {
+            auto const is_same = num_moments == this->num_moments
+                                 && scaled_energy.size() == energy.size()
+                                 && (scaled_energy == energy).all();
+            if (!is_same) {
+                energy = scaled_energy;
+                this->num_moments = num_moments;
+                function_basis.resize(0, 0);
+                greens_basis.resize(0, 0);
+            }
+        }
+
+        /// Real functions: one column of the result for each column of `moments`
+        MatrixX<real_t> functions(MatrixX<real_t> const& moments) {
+            assert(moments.rows() == num_moments);
+            if (function_basis.size() == 0) {
+                using constant::pi;
+                function_basis.resize(energy.size(), num_moments);
+                for (auto k = 0; k < energy.size(); ++k) {
+                    auto const E = energy[k];
+                    auto const norm = real_t{2/pi} / std::sqrt(1 - E*E);
+                    auto const theta = std::acos(E);
+                    for (auto n = 0; n < num_moments; ++n) {
+                        function_basis(k, n) = norm * std::cos(static_cast<real_t>(n) * theta);
+                    }
+                }
+            }
+            return function_basis * moments;
+        }
+
+        /// Green's functions: one column of the result for each column of `moments`
+        template<class scalar_t>
+        MatrixX<complex_t> greens(MatrixX<scalar_t> const& moments) {
+            assert(moments.rows() == num_moments);
+            if (greens_basis.size() == 0) {
+                using constant::i1;
+                greens_basis.resize(energy.size(), num_moments);
+                for (auto k = 0; k < energy.size(); ++k) {
+                    auto const E = energy[k];
+                    auto const norm = -real_t{2} * complex_t{i1} / std::sqrt(1 - E*E);
+                    auto const theta = std::acos(E);
+                    for (auto n = 0; n < num_moments; ++n) {
+                        greens_basis(k, n) = norm * std::polar(real_t{1}, -n * theta);
+                    }
+                }
+            }
+            return greens_basis * moments.template cast<complex_t>();
+        }
+
+    private:
+        ArrayX<real_t> energy;
+        int num_moments = 0;
+        MatrixX<real_t> function_basis;
+        MatrixX<complex_t> greens_basis;
+    };
+
+    /**
+     Kubo-Bastin conductivity from the kernel-damped 2D moments `mu_nm`, see `DenseMatrixMoments`
+
+         sigma(mu) = 8 / a^2 * int dE f(E, mu) / (1 - E^2)^2 * sum_nm Gamma_nm(E) * mu_nm
+         Gamma_nm(E) = (E - i*n*sqrt(1 - E^2)) * exp(i*n*acos(E)) * T_m(E)
+                     + (E + i*m*sqrt(1 - E^2)) * exp(-i*m*acos(E)) * T_n(E)
+
+     The result is in units of e^2/h times the volume (area in 2D) of the system, `a` is the
+     energy scaling factor and `f` is the Fermi-Dirac distribution. The `scaled_mu` and
+     `scaled_kt` are the chemical potentials and temperature (k*T) in the scaled energy units.
+     The energy integral uses the midpoint rule on `num_points` which avoids the edges +/-1.
+     Both sums are evaluated for all the energy points at once as dense matrix products.
+     */
+    template<class scalar_t>
+    ArrayXcd kubo_bastin(MatrixX<scalar_t> const& moments, ArrayXd const& scaled_mu,
+                         double scaled_kt, double a, int num_points) {
+        using complex_d = std::complex<double>;
+        auto const num_moments = static_cast<int>(moments.rows());
+        auto const step = 2.0 / num_points;
+
+        auto energy = ArrayXd(num_points);
+        auto T = MatrixX<complex_d>(num_moments, num_points);
+        auto A = MatrixX<complex_d>(num_moments, num_points);
+        auto B = MatrixX<complex_d>(num_moments, num_points);
+        for (auto k = 0; k < num_points; ++k) {
+            auto const E = -1 + (k + 0.5) * step;
+            auto const theta = std::acos(E);
+            auto const s = std::sqrt(1 - E * E);
+            energy[k] = E;
+            for (auto n = 0; n < num_moments; ++n) {
+                auto const phase = std::polar(1.0, n * theta);
+                T(n, k) = phase.real();
+                A(n, k) = complex_d{E, -n * s} * phase;
+                B(n, k) = complex_d{E, n * s} * std::conj(phase);
+            }
+        }
+
+        // sum_nm Gamma_nm * mu_nm = sum_n A_n * (mu * T)_n + sum_m B_m * (mu^T * T)_m
+        MatrixX<complex_d> const mu = moments.template cast<complex_d>();
+        MatrixX<complex_d> const mu_t = mu * T;
+        MatrixX<complex_d> const mu_tt = mu.transpose() * T;
+        ArrayXcd gamma = (A.array() * mu_t.array()).colwise().sum().transpose()
+                         + (B.array() * mu_tt.array()).colwise().sum().transpose();
+        gamma /= (1.0 - energy.square()).square().template cast<complex_d>();
+
+        auto sigma = ArrayXcd(scaled_mu.size());
+        for (auto i = 0; i < scaled_mu.size(); ++i) {
+            auto sum = complex_d{0};
+            for (auto k = 0; k < num_points; ++k) {
+                auto const f = (scaled_kt > 0)
+                               ? 1 / (1 + std::exp((energy[k] - scaled_mu[i]) / scaled_kt))
+                               : (energy[k] < scaled_mu[i] ? 1.0 : 0.0);
+                sum += f * gamma[k];
+            }
+            sigma[i] = sum * step * 8.0 / (a * a);
+        }
+        return sigma;
+    }
+
+    /**
+     Chebyshev coefficients of the Fermi-Dirac distribution on the scaled spectrum, so that
+     `f(H) = sum_n c_n * T_n(H)`. The `scaled_mu` and `scaled_kt` (k*T) are in the scaled
+     energy units. The zero temperature step has a closed form:
+
+         c_0 = 1 - acos(mu) / pi,  c_n = -2 * sin(n * acos(mu)) / (n * pi)
+
+     It's also used for temperatures well below the resolution of `num_moments`. Otherwise,
+     the coefficients come from Chebyshev-Gauss quadrature with points spaced finer than k*T.
+     */
+    inline ArrayXd fermi_coefficients(int num_moments, double scaled_mu, double scaled_kt) {
+        auto const pi = static_cast<double>(constant::pi);
+        auto c = ArrayXd(num_moments);
+        if (scaled_kt * num_moments < 0.1) {
+            auto const theta = std::acos(std::max(-1.0, std::min(1.0, scaled_mu)));
+            c[0] = 1 - theta / pi;
+            for (auto n = 1; n < num_moments; ++n) {
+                c[n] = -2 * std::sin(n * theta) / (n * pi);
+            }
+            return c;
+        }
+
+        auto const num_points = std::max(4 * num_moments,
+                                         static_cast<int>(std::ceil(4 * pi / scaled_kt)));
+        c.setZero();
+        for (auto k = 0; k < num_points; ++k) {
+            auto const theta = pi * (k + 0.5) / num_points;
+            auto const E = std::cos(theta);
+            auto const x = (E - scaled_mu) / scaled_kt;
+            auto const f = x > 0 ? std::exp(-x) / (1 + std::exp(-x)) : 1 / (1 + std::exp(x));
+
+            // cos(n * theta) = T_n(E) from the Chebyshev recurrence
+            auto t0 = 1.0;
+            auto t1 = E;
+            c[0] += f;
+            for (auto n = 1; n < num_moments; ++n) {
+                c[n] += f * t1;
+                auto const t2 = 2 * E * t1 - t0;
+                t0 = t1;
+                t1 = t2;
+            }
+        }
+        c *= 2.0 / num_points;
+        c[0] *= 0.5;
+        return c;
+    }
 } // namespace detail
 
 /**
@@ -46,47 +384,159 @@ namespace detail {
  */
 namespace exval {
 
-/// Return the KPM r0 vector with all zeros except for the source index
+/// Return the KPM r0 vector with all zeros except for the source index.
+/// The KPM vectors are drawn from the thread's `Arena`, see `calc_moments`.
 template<class Matrix, class scalar_t = typename Matrix::Scalar>
 VectorX<scalar_t> make_r0(Matrix const& h2, int i) {
-    auto r0 = VectorX<scalar_t>::Zero(h2.rows()).eval();
+    auto r0 = Arena<VectorX<scalar_t>>::local().take(h2.rows());
+    r0.setZero();
     r0[i] = 1;
     return r0;
 }
 
 /// Return the KPM r1 vector which is equal to the Hamiltonian matrix column at the source index
-template<class scalar_t>
-VectorX<scalar_t> make_r1(SparseMatrixX<scalar_t> const& h2, int i) {
+template<class scalar_t, class index_t>
+VectorX<scalar_t> make_r1(SparseMatrixX<scalar_t, index_t> const& h2, int i) {
     // -> r1 = h * r0; <- optimized thanks to `r0[i] = 1`
     // Note: h2.col(i) == h2.row(i).conjugate(), but the second is row-major friendly
     // multiply by 0.5 because H2 was pre-multiplied by 2
-    return h2.row(i).conjugate() * scalar_t{0.5};
+    auto r1 = Arena<VectorX<scalar_t>>::local().take(h2.rows());
+    r1 = h2.row(i).conjugate() * scalar_t{0.5};
+    return r1;
 }
 
-template<class scalar_t>
-VectorX<scalar_t> make_r1(num::EllMatrix<scalar_t> const& h2, int i) {
-    auto r1 = VectorX<scalar_t>::Zero(h2.rows()).eval();
+template<class scalar_t, class index_t>
+VectorX<scalar_t> make_r1(num::EllMatrix<scalar_t, index_t> const& h2, int i) {
+    auto r1 = Arena<VectorX<scalar_t>>::local().take(h2.rows());
+    r1.setZero();
     for (auto n = 0; n < h2.nnz_per_row; ++n) {
-        auto const col = h2.indices(i, n);
-        auto const value = h2.data(i, n);
+        auto const col = h2.column(i, n);
+        auto const value = h2.value(i, n);
         r1[col] = num::conjugate(value) * scalar_t{0.5};
     }
     return r1;
 }
 
+/// The `block` must contain row `i`, see `MatrixStream`
+template<class scalar_t>
+VectorX<scalar_t> make_r1(num::EllRowBlock<scalar_t> const& h2, int i) {
+    assert(h2.contains(i));
+    auto r1 = Arena<VectorX<scalar_t>>::local().take(h2.rows());
+    r1.setZero();
+    auto const row = i - h2.first_row;
+    for (auto n = 0; n < h2.nnz_per_row(); ++n) {
+        r1[h2.indices(row, n)] = num::conjugate(h2.data(row, n)) * scalar_t{0.5};
+    }
+    return r1;
+}
+
+template<class scalar_t, class index_t>
+VectorX<scalar_t> make_r1(num::SellMatrix<scalar_t, index_t> const& h2, int i) {
+    auto r1 = Arena<VectorX<scalar_t>>::local().take(h2.rows());
+    r1.setZero();
+    // `+=` because the padding elements may repeat the column index of a real element
+    h2.for_each_in_row(i, [&](index_t col, scalar_t value) {
+        r1[col] += num::conjugate(value) * scalar_t{0.5};
+    });
+    return r1;
+}
+
+template<class scalar_t>
+VectorX<scalar_t> make_r1(num::PermutedMatrix<scalar_t> const& h2, int i) {
+    auto r1 = Arena<VectorX<scalar_t>>::local().take(h2.rows());
+    r1.setZero();
+    h2.for_each_in_row(i, [&](int col, scalar_t value) {
+        r1[col] = num::conjugate(value) * scalar_t{0.5};
+    });
+    return r1;
+}
+
+template<class scalar_t>
+VectorX<scalar_t> make_r1(num::BsrMatrix<scalar_t> const& h2, int i) {
+    auto r1 = Arena<VectorX<scalar_t>>::local().take(h2.rows());
+    r1.setZero();
+    h2.for_each_in_row(i, [&](int col, scalar_t value) {
+        r1[col] = num::conjugate(value) * scalar_t{0.5};
+    });
+    return r1;
+}
+
+template<class scalar_t>
+VectorX<scalar_t> make_r1(num::SymmetricMatrix<scalar_t> const& h2, int i) {
+    auto r1 = Arena<VectorX<scalar_t>>::local().take(h2.rows());
+    r1.setZero();
+    // Column `i` is split between row `i` (transposed) and the other rows' column `i`
+    h2.for_each([&](int row, int col, scalar_t value) {
+        if (col == i) {
+            r1[row] += value * scalar_t{0.5};
+        } else if (row == i) {
+            r1[col] += num::conjugate(value) * scalar_t{0.5};
+        }
+    });
+    return r1;
+}
+
+template<class scalar_t>
+VectorX<scalar_t> make_r1(num::BulkBoundaryMatrix<scalar_t> const& h2, int i) {
+    auto r1 = Arena<VectorX<scalar_t>>::local().take(h2.rows());
+    r1.setZero();
+    // Hermitian: column `i` is the conjugate of row `i`, which may have a boundary part
+    auto const indptr = h2.bulk.outerIndexPtr();
+    auto const indices = h2.bulk.innerIndexPtr();
+    auto const data = h2.bulk.valuePtr();
+    for (auto n = indptr[i]; n < indptr[i + 1]; ++n) {
+        r1[indices[n]] = scalar_t{data[n] / 2};
+    }
+
+    auto const k = h2.first_boundary_row(i);
+    if (k < h2.boundary_rows.size() && h2.boundary_rows[k] == i) {
+        auto const b_indptr = h2.boundary.outerIndexPtr();
+        for (auto n = b_indptr[k]; n < b_indptr[k + 1]; ++n) {
+            auto const value = h2.boundary.valuePtr()[n];
+            r1[h2.boundary.innerIndexPtr()[n]] += num::conjugate(value) * scalar_t{0.5};
+        }
+    }
+    return r1;
+}
+
+/// Return `|v|^2` computed with the precision of the accumulator type `acc_t`
+template<class acc_t, class Vector>
+std14::enable_if_t<std::is_same<acc_t, typename Vector::Scalar>::value, acc_t>
+squared_norm(Vector const& v) { return v.squaredNorm(); }
+
+template<class acc_t, class Vector>
+std14::enable_if_t<!std::is_same<acc_t, typename Vector::Scalar>::value, acc_t>
+squared_norm(Vector const& v) { return v.template cast<acc_t>().squaredNorm(); }
+
+/// Return `dot(a, b)` computed with the precision of the accumulator type `acc_t`
+template<class acc_t, class Vector>
+std14::enable_if_t<std::is_same<acc_t, typename Vector::Scalar>::value, acc_t>
+dot(Vector const& a, Vector const& b) { return a.dot(b); }
+
+template<class acc_t, class Vector>
+std14::enable_if_t<!std::is_same<acc_t, typename Vector::Scalar>::value, acc_t>
+dot(Vector const& a, Vector const& b) {
+    return a.template cast<acc_t>().dot(b.template cast<acc_t>());
+}
+
 } // namespace exval
 
 /**
  Sets the initial conditions for the diagonal expectation
  value routine and collects the computed KPM moments.
+
+ The moments are accumulated with the precision of `acc_t`. For mixed precision,
+ it can be higher than the `scalar_t` of the matrix and vectors.
  */
-template<class scalar_t>
+template<class scalar_t, class acc_t = scalar_t>
 class ExvalDiagonalMoments {
 public:
+    using accumulator_t = acc_t;
+
     ExvalDiagonalMoments(int num_moments, int index) : moments(num_moments), index(index) {}
 
     int size() const { return static_cast<int>(moments.size()); }
-    ArrayX<scalar_t>& get() { return moments; }
+    ArrayX<acc_t>& get() { return moments; }
 
     /// Initial vector
     template<class Matrix>
@@ -102,30 +552,474 @@ public:
 
     /// Collect the first 2 moments which are computer outside the main KPM loop
     void collect_initial(VectorX<scalar_t> const& r0, VectorX<scalar_t> const& r1) {
-        m0 = moments[0] = r0[index] * scalar_t{0.5};
-        m1 = moments[1] = r1[index];
+        m0 = moments[0] = static_cast<acc_t>(r0[index]) * acc_t{0.5};
+        m1 = moments[1] = static_cast<acc_t>(r1[index]);
+    }
+
+    /// Start with the moments of a previous calculation instead of `collect_initial`
+    void resume(ArrayX<acc_t> const& previous) {
+        assert(previous.size() >= 2 && previous.size() <= size());
+        moments.head(previous.size()) = previous;
+        m0 = previous[0];
+        m1 = previous[1];
     }
 
     /// Collect moments `n` and `n + 1` from the result vectors. Expects `n >= 2`.
     template<class Vector>
     CPB_ALWAYS_INLINE void collect(int n, Vector const& r0, Vector const& r1) {
-        collect(n, r0.squaredNorm(), r1.dot(r0));
+        collect(n, exval::squared_norm<acc_t>(r0), exval::dot<acc_t>(r1, r0));
     }
 
-    CPB_ALWAYS_INLINE void collect(int n, scalar_t a, scalar_t b) {
+    CPB_ALWAYS_INLINE void collect(int n, acc_t a, acc_t b) {
         assert(n >= 2 && n <= size() / 2);
-        moments[2 * (n - 1)] = scalar_t{2} * (a - m0);
-        moments[2 * (n - 1) + 1] = scalar_t{2} * b - m1;
+        moments[2 * (n - 1)] = acc_t{2} * (a - m0);
+        moments[2 * (n - 1) + 1] = acc_t{2} * b - m1;
     }
 
     template<class V1, class V2> void pre_process(V1 const&, V2 const&) {}
     template<class V1, class V2> void post_process(V1 const&, V2 const&) {}
 
 private:
-    ArrayX<scalar_t> moments;
+    ArrayX<acc_t> moments;
     int index;
-    scalar_t m0;
-    scalar_t m1;
+    acc_t m0;
+    acc_t m1;
+};
+
+/**
+ Like `ExvalDiagonalMoments` but for a block of diagonal elements which are computed together
+
+ The KPM vectors of all indices are stored side by side in a single row-major matrix
+ (one column per index) so that the whole block is advanced with a single pass over
+ the Hamiltonian matrix. The moments are also stored with one column per index.
+ */
+template<class scalar_t>
+class ExvalDiagonalBlockMoments {
+    using Block = RowMajorMatrixX<scalar_t>;
+
+public:
+    ExvalDiagonalBlockMoments(int num_moments, ArrayXi const& indices)
+        : moments(num_moments, indices.size()), indices(indices),
+          m0(indices.size()), m1(indices.size()) {}
+
+    int size() const { return static_cast<int>(moments.rows()); }
+    int block_size() const { return static_cast<int>(indices.size()); }
+    ArrayXX<scalar_t>& get() { return moments; }
+
+    /// Initial vectors
+    template<class Matrix>
+    Block r0(Matrix const& h2) const {
+        auto r0 = Arena<Block>::local().take(h2.rows(), block_size());
+        r0.setZero();
+        for (auto i = 0; i < block_size(); ++i) {
+            r0(indices[i], i) = 1;
+        }
+        return r0;
+    }
+
+    /// Next vectors
+    template<class Matrix>
+    Block r1(Matrix const& h2, Block const& /*r0*/) const {
+        auto r1 = Arena<Block>::local().take(h2.rows(), block_size());
+        for (auto i = 0; i < block_size(); ++i) {
+            auto column = exval::make_r1(h2, indices[i]);
+            r1.col(i) = column;
+            Arena<decltype(column)>::local().give(std::move(column));
+        }
+        return r1;
+    }
+
+    /// Collect the first 2 moments which are computer outside the main KPM loop
+    void collect_initial(Block const& r0, Block const& r1) {
+        for (auto i = 0; i < block_size(); ++i) {
+            m0[i] = moments(0, i) = r0(indices[i], i) * scalar_t{0.5};
+            m1[i] = moments(1, i) = r1(indices[i], i);
+        }
+    }
+
+    /// Collect moments `n` and `n + 1` for each index in the block. Expects `n >= 2`.
+    void collect(int n, ArrayX<scalar_t> const& a, ArrayX<scalar_t> const& b) {
+        assert(n >= 2 && n <= size() / 2);
+        moments.row(2 * (n - 1)) = (scalar_t{2} * (a - m0)).transpose();
+        moments.row(2 * (n - 1) + 1) = (scalar_t{2} * b - m1).transpose();
+    }
+
+    template<class V1, class V2> void pre_process(V1 const&, V2 const&) {}
+    template<class V1, class V2> void post_process(V1 const&, V2 const&) {}
+
+private:
+    ArrayXX<scalar_t> moments;
+    ArrayXi indices;
+    ArrayX<scalar_t> m0;
+    ArrayX<scalar_t> m1;
+};
+
+/**
+ Stochastic evaluation of the trace moments: mu_n = Tr(T_n(H))
+
+ The trace is approximated by the average of `<r|T_n(H)|r>` over a number of random-phase
+ vectors `r`. The vectors are processed as a block (one column per random vector) so several
+ of them are advanced with a single pass over the Hamiltonian matrix, see `basic_block`.
+ Vector `first_vector + j` is stream `first_vector + j` of the counter-based generator, so the
+ vectors don't depend on how they are split into blocks.
+ */
+template<class scalar_t>
+class StochasticTraceMoments {
+    using Block = RowMajorMatrixX<scalar_t>;
+
+public:
+    StochasticTraceMoments(int num_moments, int num_random, std::uint64_t seed,
+                           int first_vector = 0)
+        : moments(num_moments, num_random), m0(num_random), m1(num_random), seed(seed),
+          first_vector(first_vector) {}
+
+    int size() const { return static_cast<int>(moments.rows()); }
+    int block_size() const { return static_cast<int>(moments.cols()); }
+    ArrayXX<scalar_t>& get() { return moments; }
+
+    /// Initial vectors: random phase factors on every site
+    template<class Matrix>
+    Block r0(Matrix const& h2) const {
+        auto r0 = Arena<Block>::local().take(h2.rows(), block_size());
+        for (auto j = 0; j < block_size(); ++j) {
+            auto const rng = num::Philox(seed, static_cast<std::uint64_t>(first_vector + j));
+            for (auto i = 0; i < r0.rows(); ++i) {
+                r0(i, j) = num::random_phase<scalar_t>(rng, static_cast<std::uint64_t>(i));
+            }
+        }
+        return r0;
+    }
+
+    /// Next vectors: r1 = h * r0
+    template<class Matrix>
+    Block r1(Matrix const& h2, Block const& r0) const {
+        auto r1 = Arena<Block>::local().take(h2.rows(), block_size());
+        r1.setZero();
+        compute::kpm_spmm(0, static_cast<int>(h2.rows()), h2, r0, r1);
+        r1 *= scalar_t{0.5}; // because H2 was pre-multiplied by 2
+        return r1;
+    }
+
+    /// Collect the first 2 moments which are computer outside the main KPM loop
+    void collect_initial(Block const& r0, Block const& r1) {
+        for (auto i = 0; i < block_size(); ++i) {
+            m0[i] = moments(0, i) = r0.col(i).squaredNorm() * scalar_t{0.5};
+            m1[i] = moments(1, i) = r1.col(i).dot(r0.col(i));
+        }
+    }
+
+    /// Collect moments `n` and `n + 1` for each random vector. Expects `n >= 2`.
+    void collect(int n, ArrayX<scalar_t> const& a, ArrayX<scalar_t> const& b) {
+        assert(n >= 2 && n <= size() / 2);
+        moments.row(2 * (n - 1)) = (scalar_t{2} * (a - m0)).transpose();
+        moments.row(2 * (n - 1) + 1) = (scalar_t{2} * b - m1).transpose();
+    }
+
+    template<class V1, class V2> void pre_process(V1 const&, V2 const&) {}
+    template<class V1, class V2> void post_process(V1 const&, V2 const&) {}
+
+private:
+    ArrayXX<scalar_t> moments;
+    ArrayX<scalar_t> m0;
+    ArrayX<scalar_t> m1;
+    std::uint64_t seed;
+    int first_vector;
+};
+
+/**
+ Diagonal moments `<r|T_n(H)|r>` of a block of given start vectors, e.g. the plane waves of
+ the spectral function. The same as `StochasticTraceMoments` except for the `r0` vectors:
+ they must already be in the order of the optimized matrix.
+ */
+template<class scalar_t>
+class StartVectorMoments : public StochasticTraceMoments<scalar_t> {
+    using Block = RowMajorMatrixX<scalar_t>;
+
+public:
+    StartVectorMoments(int num_moments, Block const& start)
+        : StochasticTraceMoments<scalar_t>(num_moments, static_cast<int>(start.cols()), 0),
+          start(start) {}
+
+    /// Initial vectors: a copy of the `start` block
+    template<class Matrix>
+    Block r0(Matrix const& h2) const {
+        assert(h2.rows() == start.rows());
+        auto r0 = Arena<Block>::local().take(h2.rows(), this->block_size());
+        r0 = start;
+        return r0;
+    }
+
+private:
+    Block const& start;
+};
+
+/**
+ Stochastic trace moments projected on disjoint parts of the system: mu_n^p = Tr(P_p T_n(H))
+
+ Part `p` is the set of rows with `labels[row] == p` (rows labeled -1 are not included in any
+ of them) and `P_p` is its diagonal projector. Since the projectors don't commute with `H`,
+ the doubling trick of `StochasticTraceMoments` doesn't apply: each moment `<r|P_p|r_n>` is
+ collected from the vector `r_n = T_n(H) r` of every iteration, as with the off-diagonal
+ algorithm. The cost of that is one pass over the block per moment, independent of the number
+ of parts, so all of the projections come out of the same random vectors. The moments are
+ summed over the block, one column per part. The `labels` follow the optimized matrix order.
+ */
+template<class scalar_t>
+class ProjectedTraceMoments {
+    using Block = RowMajorMatrixX<scalar_t>;
+
+public:
+    ProjectedTraceMoments(int num_moments, int num_random, std::uint64_t seed, int first_vector,
+                          ArrayXi const& labels, int num_labels)
+        : random(2, num_random, seed, first_vector), labels(labels),
+          moments(ArrayXX<scalar_t>::Zero(num_moments, num_labels)) {}
+
+    int size() const { return static_cast<int>(moments.rows()); }
+    int block_size() const { return random.block_size(); }
+    ArrayXX<scalar_t>& get() { return moments; }
+
+    /// Initial vectors: the same random phase factors as `StochasticTraceMoments`
+    template<class Matrix>
+    Block r0(Matrix const& h2) const { return random.r0(h2); }
+
+    /// Next vectors: r1 = h * r0
+    template<class Matrix>
+    Block r1(Matrix const& h2, Block const& r0) const { return random.r1(h2, r0); }
+
+    /// Keep the random vectors: they are the left side of every moment
+    void collect_initial(Block const& r0, Block const& r1) {
+        left = r0;
+        collect(0, r0);
+        moments.row(0) *= scalar_t{0.5}; // 0.5 is special for the moment zero
+        collect(1, r1);
+    }
+
+    /// Collect moment `n` of every part from the result vectors `r`
+    void collect(int n, Block const& r) {
+        assert(n < size() && r.rows() == labels.size());
+        auto const cols = static_cast<int>(r.cols());
+        for (auto row = 0; row < labels.size(); ++row) {
+            auto const label = labels[row];
+            if (label < 0) { continue; }
+
+            auto const l_row = left.data() + row * cols;
+            auto const r_row = r.data() + row * cols;
+            auto sum = scalar_t{0};
+            for (auto b = 0; b < cols; ++b) {
+                sum += num::conjugate(l_row[b]) * r_row[b];
+            }
+            moments(n, label) += sum;
+        }
+    }
+
+    template<class V1, class V2> void pre_process(V1 const&, V2 const&) {}
+    template<class V1, class V2> void post_process(V1 const&, V2 const&) {}
+
+private:
+    StochasticTraceMoments<scalar_t> random; ///< only generates the vectors
+    ArrayXi const& labels;
+    ArrayXX<scalar_t> moments;
+    Block left;
+};
+
+/**
+ Off-diagonal moments `mu_n^k = <j_k|T_n(H)|i_k>` of many bonds `k` from a single recurrence
+
+ Stochastic: the average of `|r><r|` over random-phase vectors is the identity, so the average
+ of `<j|r_n><r|i>` with `r_n = T_n(H) r` is the moment of every pair `(i, j)` at once. The
+ statistical error of each element only decreases as `1 / sqrt(num_random)`: unlike the trace,
+ there's no self-averaging over the sites. Exact: the block consists of the unit vectors of
+ some of the `rows` and `slots[k]` is the column of the row of bond `k` in the block (-1 if
+ it isn't part of it). Either way, all the bonds are collected from the same vectors as with
+ the off-diagonal algorithm. The indices follow the optimized matrix order.
+ */
+template<class scalar_t>
+class BondMoments {
+    using Block = RowMajorMatrixX<scalar_t>;
+
+public:
+    /// Stochastic: `num_random` vectors starting from stream `first_vector` of the `seed`
+    BondMoments(int num_moments, int num_random, std::uint64_t seed, int first_vector,
+                ArrayXi const& rows, ArrayXi const& cols)
+        : random(2, num_random, seed, first_vector), rows(rows), cols(cols),
+          moments(ArrayXX<scalar_t>::Zero(num_moments, rows.size())) {}
+    /// Exact: the unit vectors of the `sources`, see `slots` above
+    BondMoments(int num_moments, ArrayXi const& sources, ArrayXi const& slots,
+                ArrayXi const& rows, ArrayXi const& cols)
+        : random(2, static_cast<int>(sources.size()), 0), rows(rows), cols(cols),
+          moments(ArrayXX<scalar_t>::Zero(num_moments, rows.size())), sources(sources),
+          slots(slots) {}
+
+    int size() const { return static_cast<int>(moments.rows()); }
+    int block_size() const { return random.block_size(); }
+    /// One column per bond
+    ArrayXX<scalar_t>& get() { return moments; }
+
+    /// Initial vectors: random phase factors or the unit vectors of the `sources`
+    template<class Matrix>
+    Block r0(Matrix const& h2) const {
+        if (sources.size() == 0) { return random.r0(h2); }
+
+        auto r0 = Arena<Block>::local().take(h2.rows(), block_size());
+        r0.setZero();
+        for (auto s = 0; s < sources.size(); ++s) {
+            r0(sources[s], s) = 1;
+        }
+        return r0;
+    }
+
+    /// Next vectors: r1 = h * r0
+    template<class Matrix>
+    Block r1(Matrix const& h2, Block const& r0) const { return random.r1(h2, r0); }
+
+    /// Keep the random vectors: they are the `<r|i>` side of every moment
+    void collect_initial(Block const& r0, Block const& r1) {
+        if (sources.size() == 0) { start = r0; }
+        collect(0, r0);
+        moments.row(0) *= scalar_t{0.5}; // 0.5 is special for the moment zero
+        collect(1, r1);
+    }
+
+    /// Collect moment `n` of every bond from the result vectors `r`
+    void collect(int n, Block const& r) {
+        assert(n < size());
+        auto const num_cols = static_cast<int>(r.cols());
+        for (auto k = 0; k < rows.size(); ++k) {
+            if (sources.size() != 0) {
+                if (slots[k] >= 0) { moments(n, k) = r(cols[k], slots[k]); }
+                continue;
+            }
+
+            auto const r_row = r.data() + cols[k] * num_cols;
+            auto const start_row = start.data() + rows[k] * num_cols;
+            auto sum = scalar_t{0};
+            for (auto b = 0; b < num_cols; ++b) {
+                sum += r_row[b] * num::conjugate(start_row[b]);
+            }
+            moments(n, k) = sum;
+        }
+    }
+
+    template<class V1, class V2> void pre_process(V1 const&, V2 const&) {}
+    template<class V1, class V2> void post_process(V1 const&, V2 const&) {}
+
+private:
+    StochasticTraceMoments<scalar_t> random; ///< only generates the vectors
+    ArrayXi const& rows;
+    ArrayXi const& cols;
+    ArrayXX<scalar_t> moments;
+    ArrayXi sources; ///< empty for the stochastic version
+    ArrayXi slots;
+    Block start;
+};
+
+/**
+ Diagonal of the Fermi operator `f(H) = sum_n c_n * T_n(H)` from a block of `start` vectors
+
+ The vectors `r_n = T_n(H) r` of the off-diagonal algorithm are summed with the Chebyshev
+ `coefficients` into `f(H) r` and `conj(r_i) * (f(H) r)_i` is collected for every row `i`.
+ The average over random-phase vectors is `f(H)_ii`. For probing vectors (the indicator of
+ a set of sites which are far apart), the sum over the vectors is `f(H)_ii` plus the elements
+ between the sites of the same set, which decay with distance since `f(H)` is local. Either
+ way, a block costs one pass over the matrix per coefficient for all the rows at once.
+ */
+template<class scalar_t>
+class FermiDensityMoments {
+    using real_t = num::get_real_t<scalar_t>;
+    using Block = RowMajorMatrixX<scalar_t>;
+
+public:
+    FermiDensityMoments(ArrayX<real_t> const& coefficients, Block const& start)
+        : coefficients(coefficients), start(start) {}
+
+    int size() const { return static_cast<int>(coefficients.size()); }
+    int block_size() const { return static_cast<int>(start.cols()); }
+
+    /// Initial vectors: a copy of the `start` vectors
+    template<class Matrix>
+    Block r0(Matrix const& h2) const {
+        auto r0 = Arena<Block>::local().take(h2.rows(), block_size());
+        r0 = start;
+        return r0;
+    }
+
+    /// Next vectors: r1 = h * r0
+    template<class Matrix>
+    Block r1(Matrix const& h2, Block const& r0) const {
+        auto r1 = Arena<Block>::local().take(h2.rows(), block_size());
+        r1.setZero();
+        compute::kpm_spmm(0, static_cast<int>(h2.rows()), h2, r0, r1);
+        r1 *= scalar_t{0.5}; // because H2 was pre-multiplied by 2
+        return r1;
+    }
+
+    void collect_initial(Block const& r0, Block const& r1) {
+        sum = scalar_t{coefficients[0]} * r0 + scalar_t{coefficients[1]} * r1;
+    }
+
+    /// Add term `n` of the series
+    void collect(int n, Block const& r) {
+        assert(n < size());
+        sum += scalar_t{coefficients[n]} * r;
+    }
+
+    /// `conj(r_i) * (f(H) r)_i` of each row summed over the block
+    ArrayX<scalar_t> diagonal() const {
+        return (start.conjugate().array() * sum.array()).rowwise().sum();
+    }
+
+    template<class V1, class V2> void pre_process(V1 const&, V2 const&) {}
+    template<class V1, class V2> void post_process(V1 const&, V2 const&) {}
+
+private:
+    ArrayX<real_t> const& coefficients;
+    Block const& start;
+    Block sum;
+};
+
+/**
+ Two-dimensional moments of the Kubo-Bastin conductivity
+
+     mu_nm = <r| v_l T_m(H) v_r T_n(H) |r> = dot(T_m(H) v_l r, v_r T_n(H) r)
+
+ for a random-phase vector `r`: the average over several vectors approximates the trace.
+ The velocity operators come from `ham::velocity` which omits the `i` factor. This makes
+ them anti-Hermitian and the two omitted `i` factors cancel out in the dot product form.
+ The moments are accumulated over consecutive `calc_moments::dense_matrix` calls.
+ */
+template<class scalar_t>
+class DenseMatrixMoments {
+    using Block = MatrixX<scalar_t>;
+
+public:
+    DenseMatrixMoments(int num_moments, SparseMatrixX<scalar_t> const& velocity_l,
+                       SparseMatrixX<scalar_t> const& velocity_r)
+        : moments(Block::Zero(num_moments, num_moments)),
+          velocity_l(velocity_l), velocity_r(velocity_r) {}
+
+    int size() const { return static_cast<int>(moments.rows()); }
+    MatrixX<scalar_t>& get() { return moments; }
+
+    /// Initial vector of the left recurrence: `v_l * r`
+    VectorX<scalar_t> left(VectorX<scalar_t> const& r) const { return velocity_l * r; }
+
+    /// The right vector of moment `n`: `v_r * T_n(H) r`
+    template<class Column>
+    void right(VectorX<scalar_t> const& t_n, Column&& column) const {
+        column = velocity_r * t_n;
+    }
+
+    /// Collect the block of moments starting at (n0, m0) from the right vectors `r`
+    /// (one column per `n`) and the left vectors `l` (one column per `m`)
+    template<class B1, class B2>
+    void collect(int n0, int m0, B1 const& r, B2 const& l) {
+        moments.block(n0, m0, r.cols(), l.cols()).noalias() += r.transpose() * l.conjugate();
+    }
+
+private:
+    Block moments;
+    SparseMatrixX<scalar_t> const& velocity_l;
+    SparseMatrixX<scalar_t> const& velocity_r;
 };
 
 /**
@@ -184,4 +1078,78 @@ private:
     std::vector<ArrayX<scalar_t>> data;
 };
 
+/**
+ Like `ExvalOffDiagonalMoments` but for a block of `rows` which are computed together
+
+ The KPM vectors of all the rows are stored side by side in a single row-major matrix
+ (one column per row) and advanced with a single pass over the Hamiltonian matrix. Each
+ iteration collects the elements `cols` of every vector: the moments of element (i, j)
+ of the block are column `i * cols.size() + j` of the result.
+ */
+template<class scalar_t>
+class ExvalOffDiagonalBlockMoments {
+    using Block = RowMajorMatrixX<scalar_t>;
+
+public:
+    ExvalOffDiagonalBlockMoments(int num_moments, ArrayXi const& rows, ArrayXi const& cols)
+        : moments(num_moments, rows.size() * cols.size()), rows(rows), cols(cols) {}
+
+    int size() const { return static_cast<int>(moments.rows()); }
+    int block_size() const { return static_cast<int>(rows.size()); }
+    ArrayXX<scalar_t>& get() { return moments; }
+
+    /// Initial vectors
+    template<class Matrix>
+    Block r0(Matrix const& h2) const {
+        auto r0 = Arena<Block>::local().take(h2.rows(), block_size());
+        r0.setZero();
+        for (auto i = 0; i < block_size(); ++i) {
+            r0(rows[i], i) = 1;
+        }
+        return r0;
+    }
+
+    /// Next vectors
+    template<class Matrix>
+    Block r1(Matrix const& h2, Block const& /*r0*/) const {
+        auto r1 = Arena<Block>::local().take(h2.rows(), block_size());
+        for (auto i = 0; i < block_size(); ++i) {
+            auto column = exval::make_r1(h2, rows[i]);
+            r1.col(i) = column;
+            Arena<decltype(column)>::local().give(std::move(column));
+        }
+        return r1;
+    }
+
+    /// Collect the first 2 moments which are computer outside the main KPM loop
+    void collect_initial(Block const& r0, Block const& r1) {
+        using real_t = num::get_real_t<scalar_t>;
+
+        for (auto i = 0; i < block_size(); ++i) {
+            for (auto j = 0; j < cols.size(); ++j) {
+                moments(0, i * cols.size() + j) = r0(cols[j], i) * real_t{0.5};
+                moments(1, i * cols.size() + j) = r1(cols[j], i);
+            }
+        }
+    }
+
+    /// Collect moment `n` of every (row, col) pair from the result vectors `r1`
+    void collect(int n, Block const& r1) {
+        assert(n >= 2 && n < size());
+        for (auto i = 0; i < block_size(); ++i) {
+            for (auto j = 0; j < cols.size(); ++j) {
+                moments(n, i * cols.size() + j) = r1(cols[j], i);
+            }
+        }
+    }
+
+    template<class V1, class V2> void pre_process(V1 const&, V2 const&) {}
+    template<class V1, class V2> void post_process(V1 const&, V2 const&) {}
+
+private:
+    ArrayXX<scalar_t> moments;
+    ArrayXi rows;
+    ArrayXi cols;
+};
+
 }} // namespace cpb::kpm
@@ -3,12 +3,24 @@
 #include "OptimizedSizes.hpp"
 
 #include "numeric/sparse.hpp"
+#include "numeric/bsrmatrix.hpp"
+#include "numeric/bulkboundary.hpp"
 #include "numeric/ellmatrix.hpp"
+#include "numeric/permuted.hpp"
+#include "numeric/sellmatrix.hpp"
+#include "numeric/symmetric.hpp"
 
 #include "support/variant.hpp"
 #include "utils/Chrono.hpp"
+#include "utils/ThreadPool.hpp"
 #include "detail/macros.hpp"
 
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+
 namespace cpb { namespace kpm {
 
 /**
@@ -30,7 +42,7 @@ struct Indices {
     bool is_diagonal() const { return cols.size() == 1 && row == cols[0]; }
 
     friend bool operator==(Indices const& l, Indices const& r) {
-        return l.row == r.row && all_of(l.cols == r.cols);
+        return l.row == r.row && l.cols.size() == r.cols.size() && all_of(l.cols == r.cols);
     }
 };
 
@@ -38,11 +50,43 @@ struct Indices {
  Matrix configuration for `OptimizedHamiltonian`
  */
 struct MatrixConfig {
-    enum class Reorder { ON, OFF };
-    enum class Format { CSR, ELL };
+    /// PERMUTE keeps a single scaled CSR matrix and computes only the reordering permutation
+    /// for each new target index, see `num::PermutedMatrix`. The format is always CSR.
+    enum class Reorder { ON, OFF, PERMUTE };
+    /// BSR (only without reordering) stores dense blocks of `block_size`, see `num::BsrMatrix`.
+    /// SYMMETRIC (only without reordering) stores the upper triangle, see `num::SymmetricMatrix`.
+    /// BULK_BOUNDARY stores the real elements apart from the complex ones (e.g. the Bloch
+    /// phases of periodic boundaries), see `num::BulkBoundaryMatrix`
+    enum class Format { CSR, ELL, SELL, BSR, SYMMETRIC, BULK_BOUNDARY };
+    /// ELL and SELL only: COMPRESSED stores 16-bit column offsets when they fit
+    enum class Indices { FULL, COMPRESSED };
+    /// Complex ELL only: SPLIT adds separate real and imaginary planes of the values
+    enum class Layout { INTERLEAVED, SPLIT };
+    /// SHARED (only without reordering): a single read-only copy of the matrix (per NUMA
+    /// node) is shared by all the `OptimizedHamiltonian`s of the same original matrix,
+    /// scale and config
+    enum class Sharing { PRIVATE, SHARED };
+    /// ELL only: INDEXED stores 8-bit ids into a table of the distinct values, if there
+    /// are few enough of them, see `EllMatrix::index_values()`. REDUCED adds a bfloat16
+    /// copy of the values, see `EllMatrix::reduce_precision()`. INDEXED_OR_REDUCED is
+    /// INDEXED if there are few enough distinct values and REDUCED otherwise.
+    enum class Values { DIRECT, INDEXED, REDUCED, INDEXED_OR_REDUCED };
 
     Reorder reorder;
     Format format;
+    Indices indices; ///< value-initialized to FULL when omitted
+    Layout layout; ///< value-initialized to INTERLEAVED when omitted
+    Sharing sharing; ///< value-initialized to PRIVATE when omitted
+    Values values; ///< value-initialized to DIRECT when omitted
+    /// BSR only: rows per block, 0 to pick the best with `num::find_block_size()`.
+    /// The matrix stays CSR if no block size needs less memory.
+    int block_size;
+
+    friend bool operator==(MatrixConfig const& l, MatrixConfig const& r) {
+        return l.reorder == r.reorder && l.format == r.format && l.indices == r.indices
+               && l.layout == r.layout && l.sharing == r.sharing && l.values == r.values
+               && l.block_size == r.block_size;
+    }
 };
 
 /**
@@ -59,63 +103,251 @@ struct MatrixConfig {
 
  3) Convert the sparse matrix into the ELLPACK format. The sparse matrix-vector
     multiplication algorithm for this format is much easier to vectorize compared
-    to the classic CSR format.
+    to the classic CSR format. Alternatively, the sliced ELLPACK format (SELL-C-sigma)
+    keeps most of the vectorization benefits while avoiding the padding overhead of
+    matrices with an uneven number of non-zeros per row (e.g. defects and generators).
+
+ The reordering may also be applied only as a permutation (see `MatrixConfig::Reorder`):
+ the scaled CSR matrix is then kept as is and shared by all target indices, each of which
+ only needs a breadth-first search for its order and `optimized_sizes`.
+
+ With a `ThreadPool`, the breadth-first search of the reordering is level-synchronous and
+ the reordered (or only scaled) rows and the ELLPACK columns are filled in parallel. The
+ result doesn't depend on the number of threads: it's identical to the serial one. Each
+ thread writes the rows which it multiplies later, so the memory pages are placed on its
+ NUMA node (first touch).
+
+ Previous optimizations are kept in a least-recently-used cache (within a memory budget)
+ so that alternating between a few target indices doesn't redo the same work every time.
+
+ Without reordering, the matrix doesn't depend on the target indices. With the SHARED
+ config, it's built once and then referenced by every instance (e.g. one per thread in a
+ parameter sweep) which targets the same original matrix: the per-instance state is just
+ a pointer and the target indices. The shared matrix is released with its last user. On a
+ multi-socket machine, each NUMA node gets its own copy, built by a thread on that node.
+
+ The `index_t` of the original matrix is kept by the CSR, ELLPACK and SELL formats, e.g.
+ `std::int64_t` for more than 2^31 non-zeros, see `ham::make_csr()`. The permutation and
+ the BSR, SYMMETRIC and BULK_BOUNDARY formats need the default 32-bit indices.
  */
-template<class scalar_t>
+template<class scalar_t, class index_t = int>
 class OptimizedHamiltonian {
     using real_t = num::get_real_t<scalar_t>;
-    using OptMatrix = var::variant<SparseMatrixX<scalar_t>, num::EllMatrix<scalar_t>>;
+    using Csr = SparseMatrixX<scalar_t, index_t>;
+    using OptMatrix = var::variant<Csr, num::EllMatrix<scalar_t, index_t>,
+                                   num::SellMatrix<scalar_t, index_t>,
+                                   num::PermutedMatrix<scalar_t>, num::BsrMatrix<scalar_t>,
+                                   num::SymmetricMatrix<scalar_t>,
+                                   num::BulkBoundaryMatrix<scalar_t>>;
+
+    /// A previous optimization, see the identically named members below
+    struct CacheEntry {
+        OptMatrix optimized_matrix;
+        std::uint64_t matrix_id;
+        Indices optimized_idx;
+        OptimizedSizes optimized_sizes;
+        ArrayXi original_rows;
+        Indices original_idx;
+        Scale<real_t> original_scale;
+        bool original_multi_source;
+    };
 
     OptMatrix optimized_matrix; ///< reordered for faster compute
+    std::shared_ptr<OptMatrix const> shared_matrix; ///< used instead if it's not null
+    std::uint64_t matrix_id = 0; ///< unique for each new `optimized_matrix`, 0 if none
     Indices optimized_idx; ///< reordered target indices in the optimized matrix
     OptimizedSizes optimized_sizes; ///< optimal matrix sizes for each KPM iteration
+    ArrayXi original_rows; ///< original index of each optimized row, empty if not reordered
+    /// `MatrixConfig::Reorder::PERMUTE`: the scaled matrix which all the permutations view
+    std::shared_ptr<Csr const> scaled_matrix;
+    Scale<real_t> scaled_matrix_scale; ///< scaling factors of the `scaled_matrix`
 
-    SparseMatrixX<scalar_t> const* original_matrix;
+    Csr const* original_matrix;
     Indices original_idx; ///< original target indices for which the optimization was done
+    Scale<real_t> original_scale; ///< scaling factors for which the optimization was done
+    bool original_multi_source = false; ///< was the reordering done from all `idx.cols`
 
     MatrixConfig config;
     Chrono timer;
+    Chrono reorder_timer; ///< scaling and reordering part of `timer`, zero if cached
+    Chrono convert_timer; ///< format conversion part of `timer`, zero if cached
+
+    std::list<CacheEntry> cache; ///< most recently used first, doesn't include the current one
+    std::size_t cache_budget; ///< max memory (bytes) for the current matrix and the cache
+    std::size_t num_cache_hits = 0;
+    std::size_t num_cache_misses = 0;
+
+    mutable std::shared_ptr<void> backend; ///< see `backend_state()`
+    ThreadPool* pool; ///< for the reordering and format conversion, serial if null
 
 public:
-    OptimizedHamiltonian(SparseMatrixX<scalar_t> const* m, MatrixConfig const& config)
-        : optimized_sizes(m->rows()), original_matrix(m), config(config) {}
+    OptimizedHamiltonian(Csr const* m, MatrixConfig const& config,
+                         std::size_t cache_budget = 0, ThreadPool* pool = nullptr)
+        : optimized_sizes(m->rows()), original_matrix(m), config(config),
+          cache_budget(cache_budget), pool(pool) {
+        if (!std::is_same<index_t, int>::value
+            && (config.reorder == MatrixConfig::Reorder::PERMUTE
+                || config.format == MatrixConfig::Format::BSR
+                || config.format == MatrixConfig::Format::SYMMETRIC
+                || config.format == MatrixConfig::Format::BULK_BOUNDARY)) {
+            throw std::invalid_argument("OptimizedHamiltonian: the PERMUTE reordering and the "
+                                        "BSR, SYMMETRIC and BULK_BOUNDARY formats need 32-bit "
+                                        "indices.");
+        }
+    }
 
     /// Create the optimized Hamiltonian targeting specific indices and scale factors
-    void optimize_for(Indices const& idx, Scale<real_t> scale);
+    void optimize_for(Indices const& idx, Scale<real_t> scale) { optimize(idx, scale, false); }
+    /// Like `optimize_for` but the reordering starts from all of the `idx.cols` at once
+    /// (multi-source). The `sizes()` are then valid for every one of the target indices,
+    /// so the diagonal elements of all of them can be computed with this single matrix.
+    void optimize_for_block(Indices const& idx, Scale<real_t> scale) {
+        optimize(idx, scale, true);
+    }
+
+    /// Replace the diagonal of the current optimized matrix with the scaled diagonal of `m`,
+    /// which must have the same structure as the original matrix (e.g. a new realization
+    /// of onsite disorder). The reordering and format conversion are not repeated, only
+    /// the values are written. The cache of previous optimizations is dropped since it holds
+    /// the old values. Returns false if the matrix is shared, not optimized yet or doesn't
+    /// store every diagonal element: then nothing is changed.
+    bool update_diagonal(Csr const* m);
+
+    /// Free the current optimized matrix once it has been copied elsewhere, e.g. written to a
+    /// `MatrixStream`. The `idx()` and `sizes()` stay as they are, but the next `optimize_for`
+    /// builds a new matrix, even for the same target. The cache of previous ones is kept.
+    void release_matrix();
+
+    /// Number of `optimize_for` calls which were served from the cache or the current matrix
+    std::size_t cache_hits() const { return num_cache_hits; }
+    /// Number of `optimize_for` calls which needed to compute a new optimized matrix
+    std::size_t cache_misses() const { return num_cache_misses; }
 
     Indices const& idx() const { return optimized_idx; }
+    /// The original target indices and scaling factors of the current optimized matrix
+    Indices const& target_idx() const { return original_idx; }
+    Scale<real_t> const& target_scale() const { return original_scale; }
+    /// Original index of each optimized row, empty if the rows keep the original order
+    ArrayXi const& original_order() const { return original_rows; }
     OptimizedSizes const& sizes() const { return optimized_sizes; }
+    /// Identifies the current optimized matrix: the id changes only when the matrix does.
+    /// It's never reused, not even by a different `OptimizedHamiltonian`, except for the
+    /// instances which share the same matrix.
+    std::uint64_t id() const { return matrix_id; }
+
+    /// Opaque state which a compute backend keeps together with this Hamiltonian, e.g.
+    /// copies of the optimized matrices in GPU memory. It's released with the Hamiltonian.
+    std::shared_ptr<void>& backend_state() const { return backend; }
+
+    bool is_csr() const { return matrix().template is<Csr>(); }
+    Csr const& csr() const {
+        assert(matrix().template is<Csr>());
+        return matrix().template get<Csr>();
+    }
+
+    bool is_ell() const { return matrix().template is<num::EllMatrix<scalar_t, index_t>>(); }
+    num::EllMatrix<scalar_t, index_t> const& ell() const {
+        assert((matrix().template is<num::EllMatrix<scalar_t, index_t>>()));
+        return matrix().template get<num::EllMatrix<scalar_t, index_t>>();
+    }
+
+    num::SellMatrix<scalar_t, index_t> const& sell() const {
+        assert((matrix().template is<num::SellMatrix<scalar_t, index_t>>()));
+        return matrix().template get<num::SellMatrix<scalar_t, index_t>>();
+    }
+
+    /// With `MatrixConfig::Reorder::PERMUTE` instead of `csr()`
+    bool is_permuted() const { return matrix().template is<num::PermutedMatrix<scalar_t>>(); }
+    num::PermutedMatrix<scalar_t> const& permuted() const {
+        assert(matrix().template is<num::PermutedMatrix<scalar_t>>());
+        return matrix().template get<num::PermutedMatrix<scalar_t>>();
+    }
 
-    SparseMatrixX<scalar_t> const& csr() const {
-        assert(optimized_matrix.template is<SparseMatrixX<scalar_t>>());
-        return optimized_matrix.template get<SparseMatrixX<scalar_t>>();
+    /// With `MatrixConfig::Format::BSR` instead of `csr()`, if a block size applies
+    bool is_bsr() const { return matrix().template is<num::BsrMatrix<scalar_t>>(); }
+    num::BsrMatrix<scalar_t> const& bsr() const {
+        assert(matrix().template is<num::BsrMatrix<scalar_t>>());
+        return matrix().template get<num::BsrMatrix<scalar_t>>();
     }
 
-    num::EllMatrix<scalar_t> const& ell() const {
-        assert(optimized_matrix.template is<num::EllMatrix<scalar_t>>());
-        return optimized_matrix.template get<num::EllMatrix<scalar_t>>();
+    /// With `MatrixConfig::Format::SYMMETRIC` instead of `csr()`
+    bool is_symmetric() const { return matrix().template is<num::SymmetricMatrix<scalar_t>>(); }
+    num::SymmetricMatrix<scalar_t> const& symmetric() const {
+        assert(matrix().template is<num::SymmetricMatrix<scalar_t>>());
+        return matrix().template get<num::SymmetricMatrix<scalar_t>>();
+    }
+
+    /// With `MatrixConfig::Format::BULK_BOUNDARY` instead of `csr()`
+    bool is_bulk_boundary() const {
+        return matrix().template is<num::BulkBoundaryMatrix<scalar_t>>();
+    }
+    num::BulkBoundaryMatrix<scalar_t> const& bulk_boundary() const {
+        assert(matrix().template is<num::BulkBoundaryMatrix<scalar_t>>());
+        return matrix().template get<num::BulkBoundaryMatrix<scalar_t>>();
     }
 
     /// The unoptimized compute area is matrix.nonZeros() * num_moments
     size_t optimized_area(int num_moments) const;
     /// The number of mul + add operations needed to compute `num_moments` of this Hamiltonian
     size_t operations(int num_moments) const;
+    /// Same as `operations` but for a block of `block_size` diagonal elements
+    size_t block_operations(int num_moments, int block_size, bool full_system = false) const;
+    /// Is the current matrix shared with other instances, see `MatrixConfig::Sharing`
+    bool is_shared() const { return static_cast<bool>(shared_matrix); }
     /// Memory used by the Hamiltonian matrix (in bytes)
     size_t memory_usage() const;
+    /// Estimated memory traffic (bytes) of the `operations()`: the matrix and vector elements
+    /// are loaded from main memory once per multiplication (ideal caching, a lower bound).
+    /// With `block_size > 1`, the matrix is shared by that many vectors (off-diagonal blocks).
+    size_t memory_traffic(int num_moments, int block_size = 1) const;
+    /// Same as `memory_traffic` but for `block_operations()`
+    size_t block_memory_traffic(int num_moments, int block_size,
+                                bool full_system = false) const;
+
+    /// Time spent in the last `optimize_for` to scale and reorder the matrix
+    Chrono const& get_reorder_timer() const { return reorder_timer; }
+    /// Time spent in the last `optimize_for` to convert the matrix format
+    Chrono const& get_convert_timer() const { return convert_timer; }
 
     std::string report(int num_moments, bool shortform = false) const;
 
 private:
+    OptMatrix const& matrix() const { return shared_matrix ? *shared_matrix : optimized_matrix; }
+    void optimize(Indices const& idx, Scale<real_t> scale, bool multi_source);
+    /// `optimize()` with `MatrixConfig::Sharing::SHARED`: find or create the shared matrix
+    void optimize_shared(Indices const& idx, Scale<real_t> scale, bool multi_source);
+    /// Convert the scaled (and maybe reordered) CSR matrix to the configured format
+    void convert_format();
+    /// Bytes of the matrix elements and vectors read and written by all the multiplications
+    /// of `num_moments` of the full (not diagonal) algorithm with `block_size` vectors
+    double traffic_area(int num_moments, int block_size) const;
     /// Just scale the Hamiltonian: H2 = (H - I*b) * (2/a)
     void create_scaled(Indices const& idx, Scale<real_t> scale);
+    /// The `create_scaled()` matrix into `h2`, the rows are filled in parallel
+    static void scale_matrix(Csr const& h, Scale<real_t> scale, Csr& h2,
+                             ThreadPool* pool = nullptr);
     /// Scale and reorder the Hamiltonian so that idx is at the start of the optimized matrix
-    void create_reordered(Indices const& idx, Scale<real_t> scale);
-    /// Convert CSR matrix into ELLPACK format
-    static num::EllMatrix<scalar_t> convert_to_ellpack(SparseMatrixX<scalar_t> const& csr);
+    void create_reordered(Indices const& idx, Scale<real_t> scale, bool multi_source);
+    /// Same order as `create_reordered()`, but only as a permutation of the `scaled_matrix`
+    /// which is made once per scale: a breadth-first search instead of a new matrix
+    void create_permuted(Indices const& idx, Scale<real_t> scale, bool multi_source);
+    /// Convert CSR matrix into ELLPACK format, filled column by column in parallel
+    static num::EllMatrix<scalar_t, index_t> convert_to_ellpack(Csr const& csr,
+                                                                ThreadPool* pool = nullptr);
+    /// Sort the rows by their number of non-zeros within windows of `sigma` rows. This is
+    /// a symmetric permutation which never crosses the `optimized_sizes` boundaries.
+    void sort_rows_for_sell(int sigma);
+    /// Convert CSR matrix into sliced ELLPACK format with chunks of `chunk_size` rows
+    static num::SellMatrix<scalar_t, index_t> convert_to_sell(Csr const& csr, int chunk_size);
     /// Get optimized indices which map to the given originals
     static Indices reorder_indices(Indices const& original_idx, ArrayXi const& reorder_map);
+    /// Try to restore a previous optimization from the cache, return false if it's not there
+    bool restore_from_cache(Indices const& idx, Scale<real_t> scale, bool multi_source);
+    /// Save the current optimization to the cache and evict old entries to fit the budget
+    void save_to_cache();
 };
 
 CPB_EXTERN_TEMPLATE_CLASS(OptimizedHamiltonian)
+CPB_EXTERN_TEMPLATE_CLASS_VARGS(OptimizedHamiltonian, std::int64_t)
 
 }} // namespace cpb::kpm
@@ -0,0 +1,75 @@
+#pragma once
+#include "kpm/Bounds.hpp"
+#include "kpm/OptimizedHamiltonian.hpp"
+
+#include "numeric/dense.hpp"
+#include "detail/macros.hpp"
+
+namespace cpb { namespace kpm {
+
+/**
+ Bessel functions of the first kind `J_n(x)` for `n = 0 .. num - 1`
+
+ Computed with Miller's backward recurrence which is stable for all orders,
+ starting well above both `num` and `x` and normalized with `J_0 + 2 * sum(J_2k) = 1`.
+ */
+ArrayXd bessel_j(int num, double x);
+
+/**
+ Time evolution `exp(-i*H*t)` using the Chebyshev expansion of the propagator
+
+     exp(-i*H*t) = exp(-i*b*t) * sum_n (2 - delta_n0) * (-i)^n * J_n(a*t) * T_n((H - b) / a)
+
+ The Bessel functions `J_n` decay super-exponentially once `n > a*t`, so the expansion is
+ truncated at the machine precision. The number of terms (matrix-vector multiplications)
+ grows linearly with the time step and the cost per unit of time is the same for any step
+ longer than a few `hbar / a`. The norm is conserved up to the truncation precision.
+
+ The scaled Hamiltonian is an `OptimizedHamiltonian` without reordering, so the state
+ vector keeps the original site order, and the recurrence uses the same SIMD matrix-vector
+ kernels as the KPM moments. The state is always complex: for a real Hamiltonian, the real
+ and imaginary parts are propagated as two independent real vectors.
+ */
+template<class scalar_t>
+class Propagator {
+    using real_t = num::get_real_t<scalar_t>;
+    using complex_t = num::get_complex_t<scalar_t>;
+
+public:
+    /// `format` may be CSR, ELL, SELL or BSR (all without reordering)
+    Propagator(SparseMatrixX<scalar_t> const* hamiltonian, Scale<real_t> scale,
+               MatrixConfig::Format format = MatrixConfig::Format::ELL);
+
+    /// Return `exp(-i*H*t) * state` where the `time` is in femtoseconds
+    VectorX<complex_t> evolve(VectorX<complex_t> const& state, double time) const;
+    /// Evolve `state` in `num_steps` steps of `time_step` (fs) and return the state
+    /// after each step as the columns of the result. The expansion coefficients are
+    /// computed only once for all the steps.
+    MatrixX<complex_t> evolve_steps(VectorX<complex_t> const& state, double time_step,
+                                    int num_steps) const;
+
+    /// Number of Chebyshev terms (matrix-vector multiplications) needed for `time` (fs)
+    int num_terms(double time) const { return static_cast<int>(coefficients(time).size()); }
+    Scale<real_t> scaling_factors() const { return scale; }
+    /// Memory used by the scaled Hamiltonian matrix (in bytes)
+    std::size_t memory_usage() const { return oh.memory_usage(); }
+
+private:
+    /// Expansion coefficients `(2 - delta_n0) * (-i)^n * J_n(a*t) * exp(-i*b*t)`
+    ArrayXcd coefficients(double time) const;
+    /// A single step with the given `coefficients`
+    VectorX<complex_t> step(VectorX<complex_t> const& state, ArrayXcd const& c) const;
+    template<class Matrix>
+    VectorX<complex_t> step(Matrix const& h2, VectorX<complex_t> const& state,
+                            ArrayXcd const& c) const;
+
+private:
+    Scale<real_t> scale;
+    MatrixConfig::Format format;
+    int num_rows;
+    OptimizedHamiltonian<scalar_t> oh;
+};
+
+CPB_EXTERN_TEMPLATE_CLASS(Propagator)
+
+}} // namespace cpb::kpm
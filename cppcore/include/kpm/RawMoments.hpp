@@ -0,0 +1,51 @@
+#pragma once
+#include "kpm/Kernel.hpp"
+#include "kpm/Moments.hpp"
+
+#include "numeric/dense.hpp"
+
+namespace cpb { namespace kpm {
+
+/**
+ Raw KPM moments of a single Green's function matrix element (no kernel applied)
+
+ Together with the Hamiltonian scaling factors `a` and `b`, this is all that's needed to
+ reconstruct the Green's function or LDOS for any kernel, broadening or energy range
+ without repeating the expensive Chebyshev recursion. It's just plain data which is easy
+ to save and load again later.
+ */
+struct RawMoments {
+    ArrayXcd data; ///< the moments, always stored as complex double regardless of the model
+    double a = 1; ///< scaling factors of the Hamiltonian: H_scaled = (H - b) / a
+    double b = 0;
+
+    /// Optional checkpoint which makes it possible to continue the calculation to more
+    /// moments: the Hamiltonian `index` of the diagonal element and the last two vectors
+    /// of the recurrence (in the ordering of the optimized Hamiltonian for that index)
+    int index = -1;
+    VectorXcd r0;
+    VectorXcd r1;
+
+    RawMoments() = default;
+    RawMoments(ArrayXcd data, double a, double b) : data(std::move(data)), a(a), b(b) {}
+
+    int size() const { return static_cast<int>(data.size()); }
+    bool is_resumable() const { return index >= 0 && r0.size() != 0; }
+
+    /// The number of moments needed to reproduce the given `broadening` with `kernel`.
+    /// Throws if that's more than what's available in this object.
+    int required_num_moments(double broadening, Kernel const& kernel) const;
+
+    /// Reconstruct the Green's function with the given kernel, broadening and energy range
+    ArrayXcd greens(ArrayXd const& energy, double broadening, Kernel const& kernel,
+                    Reconstruction method = Reconstruction::Direct) const;
+    /// Reconstruct the LDOS (only meaningful for diagonal elements)
+    ArrayXd ldos(ArrayXd const& energy, double broadening, Kernel const& kernel,
+                 Reconstruction method = Reconstruction::Direct) const;
+
+private:
+    /// Return the first `num_moments` with the `kernel` damping applied
+    ArrayXcd damped(int num_moments, Kernel const& kernel) const;
+};
+
+}} // namespace cpb::kpm
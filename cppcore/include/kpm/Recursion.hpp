@@ -0,0 +1,105 @@
+#pragma once
+#include "kpm/Bounds.hpp"
+#include "kpm/OptimizedHamiltonian.hpp"
+
+#include "numeric/dense.hpp"
+#include "detail/macros.hpp"
+
+namespace cpb {
+
+class ThreadPool;
+
+namespace kpm {
+
+/// How the continued fraction of the recursion method is closed after the last level
+enum class Termination {
+    /// Nothing below the last level: the result is the LDOS of a finite chain, i.e. a set
+    /// of discrete poles which only the broadening smooths out
+    Truncate,
+    /// The tail of a chain with the average coefficients of the last levels, which has the
+    /// continuous square-root band of a bulk system
+    SquareRoot
+};
+
+/**
+ Lanczos coefficients of a normalized start vector in scaled energy units
+
+ `alpha[n]` is the diagonal of level `n` and `beta[n]` couples level `n` to `n + 1`.
+ Unless the Krylov space was exhausted (`exact`), there is one `beta` for each `alpha`:
+ the last one couples to the first level which wasn't computed.
+ */
+struct Tridiagonal {
+    ArrayXd alpha;
+    ArrayXd beta;
+    bool exact = false;
+};
+
+/// Evaluate the continued fraction `<start|(E + i*broadening - H)^-1|start>` of the
+/// coefficients, with the energy and broadening in the same scaled units
+ArrayXcd continued_fraction(Tridiagonal const& coefficients, ArrayXd const& scaled_energy,
+                            double scaled_broadening, Termination termination);
+
+/**
+ The recursion (Haydock) method: Green's functions from a Lanczos tridiagonalization
+
+ Each level of the Lanczos recursion of a start vector costs one matrix-vector
+ multiplication and gives one more level of the continued fraction of its Green's function.
+ For smooth spectra, a terminated continued fraction needs fewer levels than the Chebyshev
+ expansion needs moments for the same resolution. There is no kernel: the broadening is
+ the imaginary part of the energy, i.e. a Lorentzian.
+
+ Like the `Propagator`, the scaled Hamiltonian is an `OptimizedHamiltonian` without
+ reordering and the recursion uses the same SIMD matrix-vector kernels as the KPM moments.
+ With a `ThreadPool`, the rows of each multiplication are split between the threads.
+ The results are in the same (scaled) units as the KPM results of a `kpm::Strategy`.
+ */
+template<class scalar_t>
+class Recursion {
+    using real_t = num::get_real_t<scalar_t>;
+
+public:
+    /// `format` may be CSR, ELL, SELL or BSR (all without reordering)
+    Recursion(SparseMatrixX<scalar_t> const* hamiltonian, Scale<real_t> scale,
+              Termination termination = Termination::SquareRoot,
+              MatrixConfig::Format format = MatrixConfig::Format::ELL,
+              ThreadPool* pool = nullptr);
+
+    /// Coefficients of the first `num_levels` levels of the normalized `start` vector,
+    /// fewer if the Krylov space is exhausted before that
+    Tridiagonal coefficients(VectorX<scalar_t> const& start, int num_levels) const;
+
+    /// Return the LDOS at the given Hamiltonian index
+    ArrayXd ldos(int index, ArrayXd const& energy, double broadening) const;
+    /// Return the DOS as the stochastic trace over `num_random` random phase vectors,
+    /// normalized to the number of states like `kpm::Strategy::dos()`
+    ArrayXd dos(ArrayXd const& energy, double broadening, int num_random) const;
+    /// Return the Green's function `G_{col,row}`, same as `kpm::Strategy::greens()`.
+    /// The off-diagonal elements come from the diagonal ones of `|col> +- |row>`
+    /// (and `|col> +- i|row>` for a complex Hamiltonian): 2 or 4 recursions.
+    ArrayXcd greens(int row, int col, ArrayXd const& energy, double broadening) const;
+
+    /// Number of levels which resolve the `broadening`
+    int required_num_levels(double broadening) const;
+    Scale<real_t> scaling_factors() const { return scale; }
+    /// Memory used by the scaled Hamiltonian matrix (in bytes)
+    std::size_t memory_usage() const { return oh.memory_usage(); }
+
+private:
+    template<class Matrix>
+    Tridiagonal coefficients(Matrix const& h2, VectorX<scalar_t> q, int num_levels) const;
+    /// Continued fraction of the normalized `start` vector
+    ArrayXcd diagonal(VectorX<scalar_t> const& start, ArrayXd const& energy,
+                      double broadening) const;
+
+private:
+    Scale<real_t> scale;
+    Termination termination;
+    MatrixConfig::Format format;
+    ThreadPool* pool;
+    int num_rows;
+    OptimizedHamiltonian<scalar_t> oh;
+};
+
+CPB_EXTERN_TEMPLATE_CLASS(Recursion)
+
+}} // namespace cpb::kpm
@@ -0,0 +1,71 @@
+#pragma once
+#include "numeric/dense.hpp"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace cpb { namespace kpm {
+
+/**
+ Destination for KPM results which are passed on one index at a time
+
+ A strategy calls `begin()` once, then `write()` for each target index as soon as its
+ result is reconstructed and finally `finish()`. The results don't need to be collected
+ in memory, e.g. for a large number of indices and a fine energy grid.
+ */
+class Sink {
+public:
+    virtual ~Sink() = default;
+
+    /// All the `num_results` share the same `energy` points. Real results (e.g. LDOS)
+    /// are passed as complex values with a zero imaginary part.
+    virtual void begin(ArrayXd const& energy, int num_results, bool is_complex) = 0;
+    /// The result for the Hamiltonian `index`: one value for each energy
+    virtual void write(int index, ArrayXcd const& result) = 0;
+    /// No more results after this
+    virtual void finish() = 0;
+};
+
+/**
+ Write the results to a chunked binary file, see `read_results()`
+
+ Layout (native byte order): the magic "PBKPMRES", then int32 format version, is_complex,
+ number of energies and number of results, followed by the float64 energies. After that,
+ chunks of up to `chunk_size` results: int32 count, `count` int32 indices and the values
+ (float64 or complex128) of each result in turn. A chunk is written as soon as it's full,
+ so only a single chunk is kept in memory.
+ */
+class BinaryFileSink final : public Sink {
+public:
+    explicit BinaryFileSink(std::string filename, int chunk_size = 64);
+
+    void begin(ArrayXd const& energy, int num_results, bool is_complex) override;
+    void write(int index, ArrayXcd const& result) override;
+    void finish() override;
+
+private:
+    void write_chunk();
+    void raw(void const* data, std::size_t bytes);
+
+private:
+    std::string filename;
+    int chunk_size;
+    std::ofstream file;
+    bool is_complex = true;
+    std::vector<int> chunk_indices;
+    ArrayXXcd chunk; ///< one column for each of `chunk_indices`
+};
+
+/// Results of a `BinaryFileSink` loaded back into memory
+struct StreamedResults {
+    ArrayXd energy;
+    ArrayXi indices; ///< in the order they were written
+    ArrayXXcd values; ///< one column for each of the `indices`
+    bool is_complex = true;
+};
+
+/// Load all the results from a file written by `BinaryFileSink`
+StreamedResults read_results(std::string const& filename);
+
+}} // namespace cpb::kpm
@@ -10,28 +10,61 @@ inline std::string format_report(std::string msg, Chrono const& time, bool short
 
 /**
  Stats of the KPM calculation
+
+ The `num_bytes` estimate assumes that each matrix and vector element is loaded from main
+ memory once per multiplication. That's a lower bound on the real traffic, so `bandwidth()`
+ is a lower bound on the achieved bandwidth. SpMV is memory bound: when `bandwidth()` is
+ close to the peak of the machine, only a smaller matrix (or a faster memory) will help.
+ The `intensity()` (operations per byte) places the calculation on the roofline.
  */
 struct Stats {
     int num_moments = 0;
+    /// The moments which were actually computed: fewer than `num_moments` if the adaptive
+    /// mode stopped early, see `Config::convergence_tolerance`
+    int used_moments = 0;
+    int opt_level = 0; ///< the level which was used, also when `Config::opt_level` is automatic
     size_t num_operations = 0; ///< approximate number of executed mul + add operations
+    size_t num_bytes = 0; ///< approximate number of bytes moved to and from main memory
     size_t matrix_memory = 0; ///< memory used by the Hamiltonian matrix
     size_t vector_memory = 0; ///< memory used by a single KPM vector
-    Chrono moments_timer;
+    size_t cache_hits = 0; ///< optimized matrix reused from a previous calculation
+    size_t cache_misses = 0; ///< optimized matrix had to be computed
+    size_t streamed_bytes = 0; ///< read from the out-of-core matrix, see `Config::matrix_file`
+    Chrono bounds_timer; ///< spectrum bounds, zero if they were already known
+    Chrono tune_timer; ///< `opt_level_auto` trials, zero if the level was already known
+    Chrono reorder_timer; ///< scaling and reordering of the matrix, zero if it was cached
+    Chrono convert_timer; ///< conversion to the ELLPACK or SELL format, zero if it was cached
+    Chrono moments_timer; ///< the main KPM loop
+    Chrono reconstruction_timer; ///< kernel and reconstruction of the result from the moments
 
     Stats() = default;
-    Stats(int num_moments, size_t num_operations, size_t matrix_memory, size_t vector_memory)
-        : num_moments(num_moments), num_operations(num_operations),
-          matrix_memory(matrix_memory), vector_memory(vector_memory) {}
+    Stats(int num_moments, size_t num_operations, size_t num_bytes, size_t matrix_memory,
+          size_t vector_memory)
+        : num_moments(num_moments), used_moments(num_moments), num_operations(num_operations),
+          num_bytes(num_bytes), matrix_memory(matrix_memory), vector_memory(vector_memory) {}
 
     /// Operations per second
     double ops() const { return num_operations / moments_timer.elapsed_seconds(); }
+    /// Achieved memory bandwidth (bytes per second)
+    double bandwidth() const { return num_bytes / moments_timer.elapsed_seconds(); }
+    /// Arithmetic intensity: operations per byte of memory traffic
+    double intensity() const {
+        return num_bytes ? static_cast<double>(num_operations) / num_bytes : 0;
+    }
+    /// Memory traffic per computed moment (bytes)
+    double bytes_per_moment() const {
+        return used_moments ? static_cast<double>(num_bytes) / used_moments : 0;
+    }
 
     std::string report(bool shortform) const {
-        auto const fmt_str = shortform ? "{} @ {}ops"
-                                       : "KPM calculated {} moments at {} operations per second";
+        auto const fmt_str = shortform ? "{} @ {}ops {}B/s"
+                                       : "KPM calculated {} moments at {} operations per second "
+                                         "and {}B/s ({:.2f} ops/byte)";
         auto const msg = fmt::format(fmt_str,
-                                     fmt::with_suffix(num_moments),
-                                     fmt::with_suffix(ops()));
+                                     fmt::with_suffix(used_moments),
+                                     fmt::with_suffix(ops()),
+                                     fmt::with_suffix(bandwidth()),
+                                     intensity());
         return format_report(msg, moments_timer, shortform);
     }
 };
@@ -4,15 +4,26 @@
 
 #include "kpm/Kernel.hpp"
 #include "kpm/Bounds.hpp"
+#include "kpm/MatrixStream.hpp"
 #include "kpm/Moments.hpp"
 #include "kpm/OptimizedHamiltonian.hpp"
+#include "kpm/Propagator.hpp"
+#include "kpm/RawMoments.hpp"
+#include "kpm/Recursion.hpp"
+#include "kpm/Sink.hpp"
 #include "kpm/Stats.hpp"
 
 #include "utils/Chrono.hpp"
+#include "utils/ThreadPool.hpp"
 #include "detail/strategy.hpp"
 
 namespace cpb { namespace kpm {
 
+/// `Config::opt_level` which picks the fastest level for each Hamiltonian, see `StrategyTemplate`
+constexpr auto opt_level_auto = -1;
+/// `Config::block_size` which picks the size that needs the least memory, if any
+constexpr auto block_size_auto = -1;
+
 /**
  KPM configuration struct with defaults
  */
@@ -21,10 +32,105 @@ struct Config {
     float max_energy = 0.0f; ///< highest eigenvalue of the Hamiltonian
     Kernel kernel = lorentz_kernel(4.0f); ///< produces the damping coefficients
 
-    int opt_level = 3; ///< 0 to 3, higher levels apply more complex optimizations
+    int opt_level = 3; ///< 0 to 4 or `opt_level_auto`, higher levels apply more optimizations
+    /// KPM iterations per pass over the matrix for the diagonal elements at levels 2 to 4.
+    /// Deeper passes save memory bandwidth when the vectors don't fit into the CPU cache.
+    int interleave_depth = 2;
     float lanczos_precision = 0.002f; ///< how precise should the min/max energy estimation be
+    /// How to find the min/max energy if they are not given, see `BoundsMethod`
+    BoundsMethod bounds_method = BoundsMethod::Lanczos;
+    /// Reuse the Lanczos result of an identical Hamiltonian, e.g. from a previous job.
+    /// Each call hashes the matrix and a copy is kept to verify hits, see `Bounds`.
+    bool cache_bounds = false;
+    int num_threads = 1; ///< number of threads which share the work of a single calculation
+    bool pin_threads = false; ///< pin each of the `num_threads` to a CPU, see `ThreadPool`
+    /// Memory budget (bytes) for caching optimized matrices of previous target indices
+    std::size_t cache_memory = 256u * 1024u * 1024u;
+    /// Accumulate the diagonal moments in double precision even for a single precision model
+    bool mixed_precision = false;
+    /// Store complex ELL matrices (level 3) also as separate real and imaginary planes and
+    /// run the diagonal moments on split vectors: no SIMD lane shuffles for complex products
+    bool split_complex = false;
+    /// Store the ELL matrix values (level 3) also as 8-bit ids into a table of the distinct
+    /// values, if there are at most 256 of them (e.g. a model without modifiers). The diagonal
+    /// moments then load a byte per element instead of a value. Takes priority over splitting.
+    bool indexed_values = false;
+    /// Store a bfloat16 copy of the ELL matrix values (level 3) for the diagonal moments:
+    /// half the bytes per value, while the vectors and sums keep the full precision. The
+    /// values are rounded to a relative 2^-9, e.g. for LDOS at a moderate broadening.
+    /// Exact `indexed_values` take priority if there are few enough distinct values,
+    /// otherwise the reduced values are used.
+    bool reduced_precision = false;
+    /// Out-of-core LDOS and diagonal Green's function moments (level 3, single-threaded):
+    /// the optimized matrix is written to this file and read back in row blocks during the
+    /// interleaved passes, so only `interleave_depth + 1` blocks are in memory at a time.
+    /// Deeper passes read the file fewer times. The matrix is kept in memory as CSR only
+    /// while the file is written, and the file is reused by the following calls for the
+    /// same target until the Hamiltonian changes. Empty (the default) keeps it in memory.
+    std::string matrix_file;
+    /// Don't reorder the matrix for the target indices. Instead, a single read-only copy is
+    /// shared by all the strategies of the same Hamiltonian, e.g. the jobs of a parallel
+    /// sweep over target indices. Needs identical energy bounds: the Lanczos procedure is
+    /// deterministic for the same Hamiltonian and `cache_bounds` only skips repeating it.
+    bool share_matrix = false;
+    /// Keep a single scaled CSR matrix and only compute the reordering permutation for each
+    /// new target index instead of a reordered copy of the matrix (at levels 1 to 4, which
+    /// then all use CSR). The multiplications go through the permutation, so this pays off
+    /// for many target indices with few moments each, e.g. the LDOS at many positions.
+    bool permute_only = false;
+    /// Store the scaled matrix in dense blocks of this many rows and columns (BSR format)
+    /// at every level, without reordering. This suits models made of dense blocks of
+    /// consecutive sites, e.g. multi-orbital sites or whole unit cells with
+    /// `SiteOrder::UnitCell`: a column index is read once per block instead of once per
+    /// element. 0 disables it, `block_size_auto` detects it from the matrix (up to 8) and
+    /// keeps the CSR format if no block size needs less memory.
+    int block_size = 0;
+    /// Store only the upper triangle of the scaled Hermitian matrix at every level, without
+    /// reordering: the matrix takes half the memory, but every multiplication covers the
+    /// whole matrix on a single thread, see `num::SymmetricMatrix`. This is for matrices
+    /// which wouldn't fit otherwise, not for speed. Takes priority over `block_size`.
+    bool symmetric_storage = false;
+    /// Complex Hamiltonians only: store the real elements as a real matrix and only the
+    /// complex ones (e.g. the Bloch phases of periodic boundaries) as complex values, at
+    /// every level, see `num::BulkBoundaryMatrix`. This replaces the ELL and SELL formats.
+    /// For large periodic models with few boundary hoppings, the matrix traffic is about
+    /// half or two thirds. The out-of-core `matrix_file`, `permute_only`, `block_size` and
+    /// `symmetric_storage` take priority.
+    bool bulk_boundary = false;
+    /// How to compute the final function from the moments, the default is the reference path
+    Reconstruction reconstruction = Reconstruction::Direct;
+    /// Opt-in early termination of the LDOS and diagonal Green's function moments: stop once
+    /// the kernel-weighted magnitude of the latest moments falls below this fraction of all
+    /// the moments so far. The rest are taken as zero. 0 always computes all the moments.
+    /// The stages use the resumable single-threaded loop, like `calc_moments`. Several LDOS
+    /// indices (`ldos_vector`, the spatial LDOS) are computed one by one, each with its own
+    /// stop, and `Stats::used_moments` is the most any of them needed. The off-diagonal
+    /// elements ignore it, while `greens_block` and damping reject it.
+    float convergence_tolerance = 0.0f;
+    /// Compute the LDOS, DOS and Green's functions with the recursion method (a continued
+    /// fraction of Lanczos coefficients) instead of the Chebyshev expansion, see `Recursion`.
+    /// The broadening is Lorentzian regardless of the kernel. The other results, including
+    /// the raw moments, don't change.
+    bool recursion = false;
+    Termination termination = Termination::SquareRoot; ///< of the `recursion` method
+};
+
+/// Memory of a KPM calculation, in addition to the Hamiltonian itself
+struct MemoryEstimate {
+    std::size_t matrix_bytes = 0; ///< the scaled matrix and its optimized format
+    std::size_t vector_bytes = 0; ///< the vectors of the recurrence and the results
+
+    std::size_t total_bytes() const { return matrix_bytes + vector_bytes; }
 };
 
+/// Estimate the KPM memory for the Hamiltonian of a model estimate (see `Model::estimate_memory`)
+/// with the given `config`. An automatic `opt_level` counts as the level which needs the most.
+MemoryEstimate estimate_memory(cpb::MemoryEstimate const& model, Config const& config);
+
+/// Energy bounds (min, max) of the Hamiltonian found with the `config` method, e.g. of the
+/// clean system before the onsite energies are replaced, see `Strategy::change_onsite()`
+std::pair<double, double> energy_bounds(Hamiltonian const& h, Config const& config);
+
 /**
  Abstract base which defines the interface for a KPM strategy
 
@@ -38,16 +144,96 @@ class Strategy {
 public:
     virtual ~Strategy() = default;
 
-    /// Returns false if the given Hamiltonian is the wrong type for this GreensStrategy
-    virtual bool change_hamiltonian(Hamiltonian const& h) = 0;
+    /// Returns false if the given Hamiltonian is the wrong type for this GreensStrategy.
+    /// If `diagonal_only`, the new Hamiltonian differs from the current one only in the
+    /// onsite energies which allows a cheaper update of the energy bounds.
+    virtual bool change_hamiltonian(Hamiltonian const& h, bool diagonal_only = false) = 0;
+    /// Replace the onsite energies (the main diagonal, one value per row) of the current
+    /// Hamiltonian. The structure, the energy bounds and the current matrix reordering are
+    /// kept and only the values are rewritten, e.g. for each realization of a disorder
+    /// ensemble. Returns false if the matrix doesn't store every diagonal element.
+    virtual bool change_onsite(ArrayXd const& onsite) = 0;
+    /// Damp the KPM vectors in every iteration by a factor `0 < d <= 1` for each Hamiltonian
+    /// row, e.g. an absorbing boundary. Applies to `ldos()`, `greens*()` of a single row and
+    /// `moments()`: they switch to the off-diagonal algorithm. Empty disables the damping.
+    virtual void set_damping(ArrayXf const& damping) = 0;
 
     /// Return the LDOS at the given Hamiltonian index for the energy range and broadening
     virtual ArrayXd ldos(int index, ArrayXd const& energy, double broadening) = 0;
+    /// Return the LDOS for multiple indices at once: one column for each of the `indices`
+    virtual ArrayXXd ldos_vector(std::vector<int> const& indices, ArrayXd const& energy,
+                                 double broadening) = 0;
+    /// Same as `ldos_vector` but the results are passed to the `sink` as soon as each block
+    /// of indices is done: the memory doesn't grow with the number of indices
+    virtual void ldos_stream(std::vector<int> const& indices, ArrayXd const& energy,
+                             double broadening, Sink& sink) = 0;
+    /// Return the total DOS using stochastic trace evaluation with `num_random` vectors
+    virtual ArrayXd dos(ArrayXd const& energy, double broadening, int num_random) = 0;
+    /// Return the spectral function `A(k, E) = <k|delta(E - H)|k>` of the normalized plane
+    /// waves `|k> ~ sum_i w_i exp(i k.r_i) |i>` with the site `positions` and `weights`:
+    /// one column for each of the `k_points`. The plane waves are processed in blocks which
+    /// share each pass over the matrix, like the random vectors of `dos()`.
+    virtual ArrayXXd spectral_function(CartesianArray const& positions, ArrayXf const& weights,
+                                       std::vector<Cartesian> const& k_points,
+                                       ArrayXd const& energy, double broadening) = 0;
+    /// Return the DOS projected on disjoint parts of the system from a single stochastic
+    /// trace: one column for each part `0 <= p < num_labels` which contains the sites with
+    /// `labels[i] == p`. The columns add up to `dos()` if every site is labeled.
+    virtual ArrayXXd projected_dos(ArrayXi const& labels, int num_labels, ArrayXd const& energy,
+                                   double broadening, int num_random) = 0;
+    /// Return the local current `Im(H_ij * G_ji(E))` of each bond `(i, j) = (rows[k], cols[k])`,
+    /// one column per bond. The Green's functions of all of them come from a single run with
+    /// `num_random` random vectors or, if it's 0, exactly from the unit vectors of the rows.
+    virtual ArrayXXd bond_currents(ArrayXi const& rows, ArrayXi const& cols,
+                                   ArrayXd const& energy, double broadening,
+                                   int num_random) = 0;
+    /// Return the electron density `f(H)_ii` of every row for the Fermi-Dirac distribution at
+    /// the `chemical_potential` and `temperature` (Kelvin), from a Chebyshev expansion of the
+    /// Fermi operator with the resolution of `broadening`. The diagonal is estimated with
+    /// `num_random` random vectors or, if `probing_distance > 0`, with probing vectors:
+    /// the rows which are at most `probing_distance` hoppings apart are never combined.
+    virtual ArrayXd density(double chemical_potential, double broadening, double temperature,
+                            int num_random, int probing_distance) = 0;
+    /// Raw diagonal moments at multiple `indices` computed together like `ldos_vector`
+    virtual std::vector<RawMoments> ldos_moments(std::vector<int> const& indices,
+                                                 int num_moments) = 0;
+    /// Raw moments of the stochastic trace (the DOS) averaged over `num_random` vectors.
+    /// Different `seed` values give independent random vectors, 0 is the same as `dos()`.
+    virtual RawMoments dos_moments(int num_moments, int num_random, int seed = 0) = 0;
     /// Return the Green's function matrix element (row, col) for the given energy range
     virtual ArrayXcd greens(int row, int col, ArrayXd const& energy, double broadening) = 0;
     /// Return multiple Green's matrix elements for a single `row` and multiple `cols`
     virtual std::vector<ArrayXcd> greens_vector(int row, std::vector<int> const& cols,
                                                 ArrayXd const& energy, double broadening) = 0;
+    /// Return the block of Green's matrix elements (rows x cols), row by row: element
+    /// (rows[i], cols[j]) is `i * cols.size() + j`. The vectors of all the `rows` are
+    /// advanced together with a single reordered matrix, see `ExvalOffDiagonalBlockMoments`.
+    virtual std::vector<ArrayXcd> greens_block(std::vector<int> const& rows,
+                                               std::vector<int> const& cols,
+                                               ArrayXd const& energy, double broadening) = 0;
+    /// Same as `greens_vector` but each result is passed to the `sink` as soon as it's
+    /// reconstructed. Only the moments of all the `cols` are kept in memory.
+    virtual void greens_stream(int row, std::vector<int> const& cols, ArrayXd const& energy,
+                               double broadening, Sink& sink) = 0;
+    /// Return the raw moments (no kernel) of the Green's matrix elements (row, cols)
+    /// which can be reconstructed later for any kernel, broadening or energy range.
+    /// The `num_moments` may be rounded up to suit the KPM algorithms.
+    virtual std::vector<RawMoments> moments(int row, std::vector<int> const& cols,
+                                            int num_moments) = 0;
+    /// Return the raw diagonal moments at `index` with a checkpoint of the recurrence.
+    /// If `previous` is resumable, the calculation continues from there to `num_moments`.
+    virtual RawMoments resume_moments(int index, RawMoments const& previous,
+                                      int num_moments) = 0;
+    /// Return the Kubo-Bastin conductivity for the given chemical potentials using stochastic
+    /// trace evaluation with `num_random` vectors. The velocity operators must be built with
+    /// `ham::velocity` from this Hamiltonian. The `temperature` is in Kelvin and the energy
+    /// integral uses `num_points`. See `detail::kubo_bastin` for the units of the result.
+    virtual ArrayXcd conductivity(Hamiltonian const& velocity_l, Hamiltonian const& velocity_r,
+                                  ArrayXd const& chemical_potential, double broadening,
+                                  double temperature, int num_random, int num_points) = 0;
+    /// Evolve the `state` by `exp(-i*H*t)` in `num_steps` steps of `time_step` (in fs) and
+    /// return the state after each step as the columns of the result, see `Propagator`
+    virtual ArrayXXcd evolve(VectorXcd const& state, double time_step, int num_steps) = 0;
 
     /// Get some information about what happened during the last calculation
     virtual std::string report(bool shortform = false) const = 0;
@@ -61,6 +247,8 @@ public:
  See `DefaultCalcMoments` for example. An implementation should be declared as follows:
 
  struct Impl {
+     /// The highest optimization level: `opt_level_auto` tries all of them
+     static constexpr int max_opt_level = 4;
      /// Return the `OptimizedHamiltonian` matrix configuration for the given optimization level
      static MatrixConfig matrix_config(int opt_level);
 
@@ -73,6 +261,12 @@ public:
      static ArrayX<scalar_t> moments_diag(OptimizedHamiltonian<scalar_t> const& oh,
                                           int num_moments, int opt_level);
  };
+
+ With `Config::opt_level == opt_level_auto`, the level is chosen the first time the scaling
+ factors are needed: a short diagonal calculation is timed with every level on the actual
+ Hamiltonian and the fastest one is used. The result is cached by the structure of the matrix
+ (size, number of non-zeros, row lengths and threads), so Hamiltonians of the same shape,
+ e.g. in a parameter sweep, are only tuned once per process.
  */
 template<class scalar_t, class Impl>
 class StrategyTemplate final : public Strategy {
@@ -83,23 +277,102 @@ public:
     using Config = kpm::Config;
     explicit StrategyTemplate(SparseMatrixRC<scalar_t> hamiltonian, Config const& config = {});
 
-    bool change_hamiltonian(Hamiltonian const& h) final;
+    bool change_hamiltonian(Hamiltonian const& h, bool diagonal_only) final;
+    bool change_onsite(ArrayXd const& onsite) final;
+    void set_damping(ArrayXf const& damping) final { this->damping = damping; }
 
     ArrayXd ldos(int index, ArrayXd const& energy, double broadening) final;
+    ArrayXXd ldos_vector(std::vector<int> const& indices, ArrayXd const& energy,
+                         double broadening) final;
+    void ldos_stream(std::vector<int> const& indices, ArrayXd const& energy,
+                     double broadening, Sink& sink) final;
+    ArrayXd dos(ArrayXd const& energy, double broadening, int num_random) final;
+    ArrayXXd spectral_function(CartesianArray const& positions, ArrayXf const& weights,
+                               std::vector<Cartesian> const& k_points, ArrayXd const& energy,
+                               double broadening) final;
+    ArrayXXd projected_dos(ArrayXi const& labels, int num_labels, ArrayXd const& energy,
+                           double broadening, int num_random) final;
+    ArrayXXd bond_currents(ArrayXi const& rows, ArrayXi const& cols, ArrayXd const& energy,
+                           double broadening, int num_random) final;
+    ArrayXd density(double chemical_potential, double broadening, double temperature,
+                    int num_random, int probing_distance) final;
+    std::vector<RawMoments> ldos_moments(std::vector<int> const& indices,
+                                         int num_moments) final;
+    RawMoments dos_moments(int num_moments, int num_random, int seed) final;
     ArrayXcd greens(int row, int col, ArrayXd const& energy, double broadening) final;
     std::vector<ArrayXcd> greens_vector(int row, std::vector<int> const& cols,
                                         ArrayXd const& energy, double broadening) final;
+    std::vector<ArrayXcd> greens_block(std::vector<int> const& rows, std::vector<int> const& cols,
+                                       ArrayXd const& energy, double broadening) final;
+    void greens_stream(int row, std::vector<int> const& cols, ArrayXd const& energy,
+                       double broadening, Sink& sink) final;
+    std::vector<RawMoments> moments(int row, std::vector<int> const& cols,
+                                    int num_moments) final;
+    RawMoments resume_moments(int index, RawMoments const& previous, int num_moments) final;
+    ArrayXcd conductivity(Hamiltonian const& velocity_l, Hamiltonian const& velocity_r,
+                          ArrayXd const& chemical_potential, double broadening,
+                          double temperature, int num_random, int num_points) final;
+    ArrayXXcd evolve(VectorXcd const& state, double time_step, int num_steps) final;
 
     std::string report(bool shortform) const final;
     Stats const& get_stats() const final { return stats; }
 
+private:
+    /// The `Impl::matrix_config()` of the given level (`opt_level_auto` is taken as 0)
+    /// adjusted for the options of the `config`
+    MatrixConfig matrix_config(int level) const;
+    /// Get the scaling factors from the `bounds` and time it for the `stats`.
+    /// This also resolves `opt_level_auto` since the trials need the scaling factors.
+    Scale<real_t> scaling_factors();
+    /// Time a short calculation with each optimization level and return the fastest one
+    int tune_opt_level(Scale<real_t> scale);
+    /// Start new `stats` for a calculation with the current `optimized_hamiltonian`
+    void reset_stats(int num_moments, size_t num_operations, size_t num_bytes,
+                     size_t vector_memory);
+    /// Compute the raw diagonal moments for the currently optimized index
+    template<class acc_t>
+    ArrayX<acc_t> diagonal_moments(int num_moments);
+    /// Same as `diagonal_moments` but in growing stages until `config.convergence_tolerance`
+    /// is reached. The result has `num_moments` elements with zeros for the ones skipped.
+    template<class acc_t>
+    ArrayX<acc_t> adaptive_diagonal_moments(int num_moments);
+    /// Compute the raw off-diagonal moments for the currently optimized indices
+    std::vector<ArrayX<scalar_t>> off_diagonal_moments(int num_moments);
+    /// The `damping` in the row order of the `optimized_hamiltonian`
+    ArrayX<real_t> optimized_damping() const;
+    /// Stochastic trace moments averaged over `num_random` vectors: vector `j` is stream `j`
+    /// of the `seed`, so the result doesn't depend on the size of the blocks
+    ArrayX<scalar_t> trace_moments(int num_moments, int num_random, std::uint64_t seed);
+    /// The recursion method engine of the current Hamiltonian, see `Config::recursion`,
+    /// with new `stats` for `num_starts` start vectors at the `broadening`. The engine is
+    /// kept until the Hamiltonian or its scaling factors change.
+    Recursion<scalar_t> const& make_recursion(double broadening, int num_starts);
+    /// The `config.matrix_file` stream of the currently optimized matrix, which is released
+    /// from memory afterwards. The file is kept for the next call with the same target.
+    MatrixStream<scalar_t>& stream_matrix();
+    /// Prepare the `reconstruction_plan` if it's worth it for `num_results` on this energy grid
+    bool use_reconstruction_plan(int num_results, ArrayX<real_t> const& scaled_energy,
+                                 int num_moments);
+
 private:
     SparseMatrixRC<scalar_t> hamiltonian;
+    /// The copy written by `change_onsite()`, patched in place while no one else holds it
+    std::shared_ptr<SparseMatrixX<scalar_t>> onsite_matrix;
     Config config;
 
     Bounds<scalar_t> bounds;
     OptimizedHamiltonian<scalar_t> optimized_hamiltonian;
     Stats stats;
+    Chrono bounds_timer; ///< the last `scaling_factors()` call
+    Chrono tune_timer; ///< the last `tune_opt_level()` call
+    int opt_level; ///< `config.opt_level` or the autotuned level, `opt_level_auto` until tuned
+    std::unique_ptr<ThreadPool> thread_pool; ///< only created if `config.num_threads > 1`
+    detail::ReconstructionPlan<real_t> reconstruction_plan; ///< kept for the next call
+    ArrayXf damping; ///< see `set_damping()`, in the original row order
+    std::unique_ptr<Recursion<scalar_t>> recursion_engine; ///< see `make_recursion()`
+    std::unique_ptr<MatrixStream<scalar_t>> matrix_stream; ///< see `stream_matrix()`
+    Indices matrix_stream_idx; ///< the target indices of the `matrix_stream`
+    Scale<real_t> matrix_stream_scale; ///< and its scaling factors
 };
 
 /**
@@ -120,6 +393,15 @@ CPB_EXTERN_TEMPLATE_CLASS_VARGS(StrategyTemplate, CudaCalcMoments)
 
 template<class scalar_t>
 using CudaStrategy = StrategyTemplate<scalar_t, CudaCalcMoments>;
+
+/**
+ Multi-GPU implementation: the vectors of block calculations are split across all GPUs
+ */
+struct MultiGpuCalcMoments;
+CPB_EXTERN_TEMPLATE_CLASS_VARGS(StrategyTemplate, MultiGpuCalcMoments)
+
+template<class scalar_t>
+using MultiGpuStrategy = StrategyTemplate<scalar_t, MultiGpuCalcMoments>;
 #endif // CPB_USE_CUDA
 
 } // namespace kpm
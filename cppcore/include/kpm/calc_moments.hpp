@@ -1,10 +1,45 @@
 #pragma once
 #include "Bounds.hpp"
+#include "MatrixStream.hpp"
 
 #include "compute/kernel_polynomial.hpp"
+#include "utils/ThreadPool.hpp"
+#include "utils/Arena.hpp"
+
+#include <limits>
+#include <numeric>
+#include <type_traits>
 
 namespace cpb { namespace kpm { namespace calc_moments {
 
+/**
+ The state of a resumable KPM calculation: the last two vectors of the recurrence
+ */
+template<class scalar_t>
+struct Checkpoint {
+    VectorX<scalar_t> r0;
+    VectorX<scalar_t> r1;
+    int n = 0; ///< the next iteration of the main KPM loop, 0 if nothing was computed yet
+};
+
+/**
+ Put two new KPM vectors of `rows` into the thread's `Arena`, first touched by the `pool`
+
+ Each thread zeroes the rows which it multiplies in `opt_size_parallel` once the optimal
+ size reaches the full system, so their pages are placed on its NUMA node instead of the
+ calling thread's. On a multi-socket machine, the threads then mostly read and write local
+ memory. Vectors which the arena already holds are used as they are, e.g. the ones of the
+ previous calculation.
+ */
+template<class Vector>
+void first_touch_vectors(int rows, ThreadPool& pool) {
+    Arena<Vector>::local().reserve(rows, 1, 2, [&](Vector& v) {
+        pool.parallel_for(0, rows, [&](int, int start, int end) {
+            v.segment(start, end - start).setZero();
+        });
+    });
+}
+
 /**
  Diagonal KPM implementation: the left and right vectors are identical
  */
@@ -23,6 +58,8 @@ void basic(Moments& moments, Matrix const& h2) {
     // the stochastic trace evaluation variant.
     auto r0 = moments.r0(h2);
     auto r1 = moments.r1(h2, r0);
+    // Both vectors go back to the thread's arena for the next calculation
+    auto const recycle = return_to_arena(r0, r1);
     moments.collect_initial(r0, r1);
 
     // The diagonal KPM algorithm computes 2 moments per iteration
@@ -59,6 +96,7 @@ template<class Moments, class Matrix>
 void opt_size(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes) {
     auto r0 = moments.r0(h2);
     auto r1 = moments.r1(h2, r0);
+    auto const recycle = return_to_arena(r0, r1);
     moments.collect_initial(r0, r1);
 
     auto const num_moments = moments.size();
@@ -77,16 +115,98 @@ void opt_size(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes) {
     }
 }
 
+/**
+ Resumable version of `opt_size`
+
+ Starts from the vectors saved in the `checkpoint` (or from the beginning if it's empty)
+ and saves the final vectors back into it so the calculation can be continued to even
+ more moments later. The sizes only grow here: the usual shrinking near the end of the
+ calculation would leave the final vectors incomplete. Thus, they are derived for an
+ unlimited number of moments. The `moments` need to be resumed by the caller.
+ */
+template<class Moments, class Matrix, class scalar_t = typename Matrix::Scalar>
+void opt_size_resumable(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes,
+                        Checkpoint<scalar_t>& checkpoint) {
+    if (checkpoint.n == 0) {
+        checkpoint.r0 = moments.r0(h2);
+        checkpoint.r1 = moments.r1(h2, checkpoint.r0);
+        moments.collect_initial(checkpoint.r0, checkpoint.r1);
+        checkpoint.n = 2;
+    }
+    auto& r0 = checkpoint.r0;
+    auto& r1 = checkpoint.r1;
+
+    auto const num_moments = moments.size();
+    assert(num_moments % 2 == 0);
+
+    constexpr auto unlimited = std::numeric_limits<int>::max();
+    for (auto n = checkpoint.n; n <= num_moments / 2; ++n) {
+        auto const opt_size = sizes.optimal(n, unlimited);
+
+        moments.pre_process(r0.head(opt_size), r1.head(opt_size));
+        compute::kpm_spmv(0, opt_size, h2, r1, r0);
+        moments.post_process(r0.head(opt_size), r1.head(opt_size));
+
+        r1.swap(r0);
+        moments.collect(n, r0.head(opt_size), r1.head(opt_size));
+    }
+    checkpoint.n = std::max(checkpoint.n, num_moments / 2 + 1);
+}
+
+/**
+ Multithreaded version of `opt_size` (or `basic` if the sizes span the full system)
+
+ The rows of each matrix-vector multiplication are split among the threads of the `pool`.
+ Each thread accumulates partial dot products for its own rows which are summed at the end
+ of the iteration. The interleaved variants can't be split this way because the second
+ multiplication depends on the results of the first one within the same loop.
+ */
+template<class Moments, class Matrix, class acc_t = typename Moments::accumulator_t>
+void opt_size_parallel(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes,
+                       ThreadPool& pool) {
+    using Vector = typename std::decay<decltype(moments.r0(h2))>::type;
+    first_touch_vectors<Vector>(static_cast<int>(h2.rows()), pool);
+    auto r0 = moments.r0(h2);
+    auto r1 = moments.r1(h2, r0);
+    auto const recycle = return_to_arena(r0, r1);
+    moments.collect_initial(r0, r1);
+
+    auto const num_moments = moments.size();
+    assert(num_moments % 2 == 0);
+
+    auto partial_m2 = std::vector<acc_t>(pool.size());
+    auto partial_m3 = std::vector<acc_t>(pool.size());
+    for (auto n = 2; n <= num_moments / 2; ++n) {
+        auto const opt_size = sizes.optimal(n, num_moments);
+        std::fill(partial_m2.begin(), partial_m2.end(), acc_t{0});
+        std::fill(partial_m3.begin(), partial_m3.end(), acc_t{0});
+
+        moments.pre_process(r0.head(opt_size), r1.head(opt_size));
+        pool.parallel_for(0, opt_size, [&](int thread_id, int start, int end) {
+            auto m2 = acc_t{0}, m3 = acc_t{0};
+            compute::kpm_spmv_diagonal(start, end, h2, r1, r0, m2, m3);
+            partial_m2[thread_id] = m2;
+            partial_m3[thread_id] = m3;
+        });
+        moments.post_process(r0.head(opt_size), r1.head(opt_size));
+
+        r1.swap(r0);
+        moments.collect(n, std::accumulate(partial_m2.begin(), partial_m2.end(), acc_t{0}),
+                        std::accumulate(partial_m3.begin(), partial_m3.end(), acc_t{0}));
+    }
+}
+
 /**
  Interleave two moment calculations, requires a specially ordered matrix as input
 
  The two concurrent operations share some of the same data, thus promoting cache
  usage and reducing main memory bandwidth.
  */
-template<class Moments, class Matrix, class scalar_t = typename Matrix::Scalar>
+template<class Moments, class Matrix, class acc_t = typename Moments::accumulator_t>
 void interleaved(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes) {
     auto r0 = moments.r0(h2);
     auto r1 = moments.r1(h2, r0);
+    auto const recycle = return_to_arena(r0, r1);
     moments.collect_initial(r0, r1);
 
     auto const num_moments = moments.size();
@@ -95,7 +215,7 @@ void interleaved(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes
     // Interleave moments `n` and `n + 1` for better data locality
     // Diagonal + interleaved computes 4 moments per iteration
     for (auto n = 2; n <= num_moments / 2; n += 2) {
-        auto m2 = scalar_t{0}, m3 = scalar_t{0}, m4 = scalar_t{0}, m5 = scalar_t{0};
+        auto m2 = acc_t{0}, m3 = acc_t{0}, m4 = acc_t{0}, m5 = acc_t{0};
 
         auto const max = sizes.max_index();
         for (auto k = 0, p0 = 0, p1 = 0; k <= max; ++k) {
@@ -113,35 +233,268 @@ void interleaved(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes
     }
 }
 
+namespace detail {
+    template<class Matrix>
+    bool is_split(Matrix const&) { return false; }
+
+    template<class scalar_t, class index_t>
+    bool is_split(num::EllMatrix<scalar_t, index_t> const& h2) { return h2.is_split(); }
+
+    template<class Matrix>
+    bool is_indexed(Matrix const&) { return false; }
+
+    template<class scalar_t, class index_t>
+    bool is_indexed(num::EllMatrix<scalar_t, index_t> const& h2) { return h2.is_indexed(); }
+
+    template<class Matrix>
+    bool is_reduced(Matrix const&) { return false; }
+
+    template<class scalar_t, class index_t>
+    bool is_reduced(num::EllMatrix<scalar_t, index_t> const& h2) { return h2.is_reduced(); }
+
+    /// An out-of-core matrix for `interleaved_passes`, see `MatrixStream`
+    template<class scalar_t>
+    struct StreamRef {
+        MatrixStream<scalar_t>& stream;
+    };
+
+    /// Make sure blocks [first, last] of the matrix are in memory: regular matrices always are
+    template<class Matrix> CPB_ALWAYS_INLINE
+    void load_blocks(Matrix const&, int /*first*/, int /*last*/) {}
+
+    template<class scalar_t>
+    void load_blocks(StreamRef<scalar_t> const& h2, int first, int last) {
+        h2.stream.window(first, last);
+    }
+
+    /// The matrix which holds the rows of the given block
+    template<class Matrix> CPB_ALWAYS_INLINE
+    Matrix const& block_matrix(Matrix const& h2, int /*block*/) { return h2; }
+
+    template<class scalar_t> CPB_ALWAYS_INLINE
+    num::EllRowBlock<scalar_t> const& block_matrix(StreamRef<scalar_t> const& h2, int block) {
+        return h2.stream[block];
+    }
+
+    /// The passes of `opt_size_and_interleaved()` starting from the initial `r0` and `r1`
+    template<class acc_t, class Moments, class Matrix, class Vector>
+    void interleaved_passes(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes,
+                            int depth, Vector& r0, Vector& r1) {
+        auto const num_moments = moments.size();
+        assert(num_moments % 2 == 0);
+
+        auto max = std::vector<int>(depth); // the last block of each iteration in the pass
+        auto m2 = std::vector<acc_t>(depth);
+        auto m3 = std::vector<acc_t>(depth);
+        for (auto n = 2; n <= num_moments / 2; n += depth) {
+            auto const num_steps = std::min(depth, num_moments / 2 + 1 - n);
+            auto last_wave = 0;
+            auto last_block = 0;
+            for (auto s = 0; s < num_steps; ++s) {
+                max[s] = sizes.index(n + s, num_moments);
+                m2[s] = m3[s] = acc_t{0};
+                last_wave = std::max(last_wave, max[s] + s);
+                last_block = std::max(last_block, max[s]);
+            }
+
+            for (auto k = 0; k <= last_wave; ++k) {
+                load_blocks(h2, std::max(k - num_steps + 1, 0), std::min(k, last_block));
+                for (auto s = 0; s < num_steps; ++s) {
+                    auto const block = k - s;
+                    if (block < 0 || block > max[s]) {
+                        continue;
+                    }
+                    auto const start = block > 0 ? sizes[block - 1] : 0;
+                    // Even iterations compute `r0 = h2 * r1 - r0` and odd ones the opposite
+                    auto const end = sizes[block];
+                    auto const& matrix = block_matrix(h2, block);
+                    if (s % 2 == 0) {
+                        compute::kpm_spmv_diagonal(start, end, matrix, r1, r0, m2[s], m3[s]);
+                    } else {
+                        compute::kpm_spmv_diagonal(start, end, matrix, r0, r1, m2[s], m3[s]);
+                    }
+                }
+            }
+
+            for (auto s = 0; s < num_steps; ++s) {
+                moments.collect(n + s, m2[s], m3[s]);
+            }
+            if (num_steps % 2 != 0) {
+                r1.swap(r0); // the next pass expects the latest result in `r1`
+            }
+        }
+    }
+
+    /// Only the split-complex ELLPACK matrices need different vectors
+    template<class acc_t, class Moments, class Matrix, class Vector>
+    void split_interleaved_passes(Moments& moments, Matrix const& h2,
+                                  OptimizedSizes const& sizes, int depth, Vector& r0, Vector& r1) {
+        interleaved_passes<acc_t>(moments, h2, sizes, depth, r0, r1);
+    }
+
+    template<class acc_t, class Moments, class real_t, class index_t>
+    void split_interleaved_passes(Moments& moments,
+                                  num::EllMatrix<std::complex<real_t>, index_t> const& h2,
+                                  OptimizedSizes const& sizes, int depth,
+                                  VectorX<std::complex<real_t>>& r0,
+                                  VectorX<std::complex<real_t>>& r1) {
+        auto s0 = num::SplitVector<real_t>(r0);
+        auto s1 = num::SplitVector<real_t>(r1);
+        interleaved_passes<acc_t>(moments, h2, sizes, depth, s0, s1);
+    }
+
+    /// Only the indexed ELLPACK matrices read their values from a table
+    template<class acc_t, class Moments, class Matrix, class Vector>
+    void indexed_interleaved_passes(Moments& moments, Matrix const& h2,
+                                    OptimizedSizes const& sizes, int depth,
+                                    Vector& r0, Vector& r1) {
+        interleaved_passes<acc_t>(moments, h2, sizes, depth, r0, r1);
+    }
+
+    template<class acc_t, class Moments, class scalar_t, class index_t, class Vector>
+    void indexed_interleaved_passes(Moments& moments, num::EllMatrix<scalar_t, index_t> const& h2,
+                                    OptimizedSizes const& sizes, int depth,
+                                    Vector& r0, Vector& r1) {
+        auto const indexed = num::IndexedEllRef<scalar_t, index_t>{h2};
+        interleaved_passes<acc_t>(moments, indexed, sizes, depth, r0, r1);
+    }
+
+    /// Only the reduced precision ELLPACK matrices have bfloat16 values
+    template<class acc_t, class Moments, class Matrix, class Vector>
+    void reduced_interleaved_passes(Moments& moments, Matrix const& h2,
+                                    OptimizedSizes const& sizes, int depth,
+                                    Vector& r0, Vector& r1) {
+        interleaved_passes<acc_t>(moments, h2, sizes, depth, r0, r1);
+    }
+
+    template<class acc_t, class Moments, class scalar_t, class index_t, class Vector>
+    void reduced_interleaved_passes(Moments& moments, num::EllMatrix<scalar_t, index_t> const& h2,
+                                    OptimizedSizes const& sizes, int depth,
+                                    Vector& r0, Vector& r1) {
+        auto const reduced = num::ReducedEllRef<scalar_t, index_t>{h2};
+        interleaved_passes<acc_t>(moments, reduced, sizes, depth, r0, r1);
+    }
+} // namespace detail
+
 /**
- Optimal size + interleaved
+ Optimal size + interleaved: `depth` KPM iterations per pass over the matrix
+
+ The reordered matrix is split into blocks of rows (`sizes`) which only couple to the
+ neighbouring blocks. Iteration `s` of a pass can compute block `k - s` as soon as iteration
+ `s - 1` has finished block `k - s + 1`, so all the iterations of a pass sweep the matrix
+ together as a wavefront. Each block of the matrix and vectors is loaded from main memory
+ once per pass instead of once per iteration, which matters when the vectors don't fit into
+ the CPU cache. Two vectors are still enough: an iteration overwrites a block only after the
+ next iteration is done reading it. Depth 2 is the classic interleaved algorithm and depth 1
+ is the same as `opt_size`. A split-complex ELLPACK matrix (see `EllMatrix::split()`) gets
+ split vectors as well, so the complex arithmetic doesn't need any SIMD lane shuffles.
+ An indexed ELLPACK matrix (see `EllMatrix::index_values()`) gathers its values from a table
+ and a reduced one (see `EllMatrix::reduce_precision()`) reads them as bfloat16.
+ */
+template<class Moments, class Matrix, class acc_t = typename Moments::accumulator_t>
+void opt_size_and_interleaved(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes,
+                              int depth = 2) {
+    assert(depth >= 1);
+    auto r0 = moments.r0(h2);
+    auto r1 = moments.r1(h2, r0);
+    auto const recycle = return_to_arena(r0, r1);
+    moments.collect_initial(r0, r1);
+
+    if (detail::is_indexed(h2)) {
+        detail::indexed_interleaved_passes<acc_t>(moments, h2, sizes, depth, r0, r1);
+    } else if (detail::is_reduced(h2)) {
+        detail::reduced_interleaved_passes<acc_t>(moments, h2, sizes, depth, r0, r1);
+    } else if (detail::is_split(h2)) {
+        // Separate real and imaginary planes, see `EllMatrix::split()`: the final vectors
+        // are not copied back since only the moments are needed from the passes
+        detail::split_interleaved_passes<acc_t>(moments, h2, sizes, depth, r0, r1);
+    } else {
+        detail::interleaved_passes<acc_t>(moments, h2, sizes, depth, r0, r1);
+    }
+}
+
+/**
+ Out-of-core version of the above: the matrix is read from a file in row blocks during each
+ pass, see `MatrixStream`. A pass of depth `d` reads every block once and uses it for `d`
+ iterations, so a deeper pass directly reduces the I/O. The target indices must be in the
+ first block, which is always the case for a reordered matrix.
+ */
+template<class Moments, class scalar_t, class acc_t = typename Moments::accumulator_t>
+void opt_size_and_interleaved(Moments& moments, MatrixStream<scalar_t>& stream,
+                              OptimizedSizes const& sizes, int depth = 2) {
+    assert(depth >= 1);
+    stream.window(0, 0);
+    auto r0 = moments.r0(stream[0]);
+    auto r1 = moments.r1(stream[0], r0);
+    auto const recycle = return_to_arena(r0, r1);
+    moments.collect_initial(r0, r1);
+
+    detail::interleaved_passes<acc_t>(moments, detail::StreamRef<scalar_t>{stream}, sizes, depth,
+                                      r0, r1);
+}
+
+/**
+ Block version of the reference implementation: several diagonal elements at once
+
+ The `Moments` class provides a block of initial vectors (one column per target index)
+ and all of them are advanced together using sparse matrix-matrix multiplication. Each
+ matrix element is read only once per iteration for the entire block, which is a big
+ win over separate `basic` calls given that KPM is usually bound by memory bandwidth.
  */
 template<class Moments, class Matrix, class scalar_t = typename Matrix::Scalar>
-void opt_size_and_interleaved(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes) {
+void basic_block(Moments& moments, Matrix const& h2) {
     auto r0 = moments.r0(h2);
     auto r1 = moments.r1(h2, r0);
+    auto const recycle = return_to_arena(r0, r1);
     moments.collect_initial(r0, r1);
 
     auto const num_moments = moments.size();
-    assert((num_moments - 2) % 4 == 0);
+    assert(num_moments % 2 == 0);
 
-    for (auto n = 2; n <= num_moments / 2; n += 2) {
-        auto m2 = scalar_t{0}, m3 = scalar_t{0}, m4 = scalar_t{0}, m5 = scalar_t{0};
+    auto m2 = ArrayX<scalar_t>(moments.block_size());
+    auto m3 = ArrayX<scalar_t>(moments.block_size());
+    for (auto n = 2; n <= num_moments / 2; ++n) {
+        m2.setZero();
+        m3.setZero();
 
-        auto const max1 = sizes.index(n, num_moments);
-        for (auto k = 0, p0 = 0, p1 = 0; k <= max1; ++k) {
-            auto const p2 = sizes[k];
-            compute::kpm_spmv_diagonal(p1, p2, h2, r1, r0, m2, m3);
-            compute::kpm_spmv_diagonal(p0, p1, h2, r0, r1, m4, m5);
+        moments.pre_process(r0, r1);
+        compute::kpm_spmm_diagonal(0, h2.rows(), h2, r1, r0, m2, m3);
+        moments.post_process(r0, r1);
 
-            p0 = p1;
-            p1 = p2;
-        }
-        auto const max2 = sizes.index(n + 1, num_moments);
-        compute::kpm_spmv_diagonal(sizes[max1 - 1], sizes[max2], h2, r0, r1, m4, m5);
+        r1.swap(r0);
+        moments.collect(n, m2, m3);
+    }
+}
+
+/**
+ Block version of `opt_size`, requires a matrix reordered from all of the block indices
+
+ See `OptimizedHamiltonian::optimize_for_block`: the optimal sizes from a multi-source
+ reordering are valid for every vector in the block.
+ */
+template<class Moments, class Matrix, class scalar_t = typename Matrix::Scalar>
+void opt_size_block(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes) {
+    auto r0 = moments.r0(h2);
+    auto r1 = moments.r1(h2, r0);
+    auto const recycle = return_to_arena(r0, r1);
+    moments.collect_initial(r0, r1);
 
+    auto const num_moments = moments.size();
+    assert(num_moments % 2 == 0);
+
+    auto m2 = ArrayX<scalar_t>(moments.block_size());
+    auto m3 = ArrayX<scalar_t>(moments.block_size());
+    for (auto n = 2; n <= num_moments / 2; ++n) {
+        auto const opt_size = sizes.optimal(n, num_moments);
+        m2.setZero();
+        m3.setZero();
+
+        moments.pre_process(r0.topRows(opt_size), r1.topRows(opt_size));
+        compute::kpm_spmm_diagonal(0, opt_size, h2, r1, r0, m2, m3);
+        moments.post_process(r0.topRows(opt_size), r1.topRows(opt_size));
+
+        r1.swap(r0);
         moments.collect(n, m2, m3);
-        moments.collect(n + 1, m4, m5);
     }
 }
 
@@ -164,6 +517,7 @@ template<class Moments, class Matrix>
 void basic(Moments& moments, Matrix const& h2) {
     auto r0 = moments.r0(h2);
     auto r1 = moments.r1(h2, r0);
+    auto const recycle = return_to_arena(r0, r1);
     moments.collect_initial(r0, r1);
 
     auto const num_moments = moments.size();
@@ -186,6 +540,7 @@ template<class Moments, class Matrix>
 void opt_size(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes) {
     auto r0 = moments.r0(h2);
     auto r1 = moments.r1(h2, r0);
+    auto const recycle = return_to_arena(r0, r1);
     moments.collect_initial(r0, r1);
 
     auto const num_moments = moments.size();
@@ -201,6 +556,34 @@ void opt_size(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes) {
     }
 }
 
+/**
+ Multithreaded version of `opt_size`, see the diagonal version for more information
+ */
+template<class Moments, class Matrix>
+void opt_size_parallel(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes,
+                       ThreadPool& pool) {
+    using Vector = typename std::decay<decltype(moments.r0(h2))>::type;
+    first_touch_vectors<Vector>(static_cast<int>(h2.rows()), pool);
+    auto r0 = moments.r0(h2);
+    auto r1 = moments.r1(h2, r0);
+    auto const recycle = return_to_arena(r0, r1);
+    moments.collect_initial(r0, r1);
+
+    auto const num_moments = moments.size();
+    for (auto n = 2; n < num_moments; ++n) {
+        auto const optimized_size = sizes.optimal(n, num_moments);
+
+        moments.pre_process(r0, r1);
+        pool.parallel_for(0, optimized_size, [&](int, int start, int end) {
+            compute::kpm_spmv(start, end, h2, r1, r0); // r0 = matrix * r1 - r0
+        });
+        moments.post_process(r0, r1);
+
+        r1.swap(r0);
+        moments.collect(n, r1);
+    }
+}
+
 /**
  Interleave two moment calculations, requires a specially ordered matrix as input
 
@@ -210,6 +593,7 @@ template<class Moments, class Matrix, class scalar_t = typename Matrix::Scalar>
 void interleaved(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes) {
     auto r0 = moments.r0(h2);
     auto r1 = moments.r1(h2, r0);
+    auto const recycle = return_to_arena(r0, r1);
     moments.collect_initial(r0, r1);
 
     auto const num_moments = moments.size();
@@ -240,6 +624,7 @@ template<class Moments, class Matrix, class scalar_t = typename Matrix::Scalar>
 void opt_size_and_interleaved(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes) {
     auto r0 = moments.r0(h2);
     auto r1 = moments.r1(h2, r0);
+    auto const recycle = return_to_arena(r0, r1);
     moments.collect_initial(r0, r1);
 
     auto const num_moments = moments.size();
@@ -264,6 +649,145 @@ void opt_size_and_interleaved(Moments& moments, Matrix const& h2, OptimizedSizes
     }
 }
 
+/**
+ Block version of `basic`: the vectors of several rows are advanced together
+
+ Used with `ExvalOffDiagonalBlockMoments`: each matrix element is loaded once per
+ iteration for the entire block, see `compute::kpm_spmm`.
+ */
+template<class Moments, class Matrix>
+void basic_block(Moments& moments, Matrix const& h2) {
+    auto r0 = moments.r0(h2);
+    auto r1 = moments.r1(h2, r0);
+    auto const recycle = return_to_arena(r0, r1);
+    moments.collect_initial(r0, r1);
+
+    auto const num_moments = moments.size();
+    for (auto n = 2; n < num_moments; ++n) {
+        moments.pre_process(r0, r1);
+        compute::kpm_spmm(0, static_cast<int>(h2.rows()), h2, r1, r0);
+        moments.post_process(r0, r1);
+
+        r1.swap(r0);
+        moments.collect(n, r1);
+    }
+}
+
+/**
+ Block version of `opt_size`, requires a matrix reordered from all of the rows and cols
+
+ See `OptimizedHamiltonian::optimize_for_block`: the sizes of a multi-source reordering
+ are valid for the vector of every row and keep all the cols within reach at the end.
+ */
+template<class Moments, class Matrix>
+void opt_size_block(Moments& moments, Matrix const& h2, OptimizedSizes const& sizes) {
+    auto r0 = moments.r0(h2);
+    auto r1 = moments.r1(h2, r0);
+    auto const recycle = return_to_arena(r0, r1);
+    moments.collect_initial(r0, r1);
+
+    auto const num_moments = moments.size();
+    for (auto n = 2; n < num_moments; ++n) {
+        auto const optimized_size = sizes.optimal(n, num_moments);
+
+        moments.pre_process(r0, r1);
+        compute::kpm_spmm(0, optimized_size, h2, r1, r0); // r0 = matrix * r1 - r0
+        moments.post_process(r0, r1);
+
+        r1.swap(r0);
+        moments.collect(n, r1);
+    }
+}
+
+/**
+ Same as `basic` with a damping factor `d <= 1` for each row: r_{n+1} = d * (2H r_n - r_{n-1})
+
+ The vectors decay as they reach the damped rows, so a damped region at the edges of a finite
+ sample absorbs them like an open boundary (a complex absorbing potential). The damping is
+ fused with the multiplication, see `compute::kpm_spmv_damped`. The size optimization doesn't
+ apply: the damping is only useful if the vectors reach the edges.
+ */
+template<class Moments, class Matrix, class real_t>
+void damped(Moments& moments, Matrix const& h2, ArrayX<real_t> const& damping) {
+    using scalar_t = typename Matrix::Scalar;
+    assert(damping.size() == h2.rows());
+
+    auto r0 = moments.r0(h2);
+    auto r1 = moments.r1(h2, r0);
+    r1.array() *= damping.template cast<scalar_t>();
+    auto const recycle = return_to_arena(r0, r1);
+    moments.collect_initial(r0, r1);
+
+    auto const num_moments = moments.size();
+    for (auto n = 2; n < num_moments; ++n) {
+        moments.pre_process(r0, r1);
+        compute::kpm_spmv_damped(0, static_cast<int>(h2.rows()), h2, r1, r0, damping);
+        moments.post_process(r0, r1);
+
+        r1.swap(r0);
+        moments.collect(n, r1);
+    }
+}
+
 } // namespace off_diagonal
 
+/**
+ Two-dimensional moments mu_nm, e.g. for the Kubo-Bastin conductivity
+
+ Used with `DenseMatrixMoments`: mu_nm = dot(l_m, r_n) with the left vectors `l_m = T_m(H) l`
+ and the right vectors `r_n = v * T_n(H) r`. Storing all of them would need two dense
+ matrices of `num_moments` vectors. Instead, the left vectors are computed in blocks of
+ `block_size` and, for each left block, the right recurrence is restarted and also collected
+ in blocks. Each pair of blocks is reduced by a dense matrix product which reuses every
+ vector element from cache across a whole block instead of a separate dot product per `nm`.
+ With `block_size >= num_moments`, both recurrences run exactly once.
+ */
+namespace dense_matrix {
+
+template<class Moments, class Matrix, class scalar_t = typename Matrix::Scalar>
+void basic(Moments& moments, Matrix const& h2, VectorX<scalar_t> const& r, int block_size) {
+    auto const num_moments = moments.size();
+    auto const rows = static_cast<int>(h2.rows());
+    block_size = std::max(1, std::min(block_size, num_moments));
+
+    // Chebyshev recurrence: (t0, t1) = (T_n(H) x, T_n+1(H) x) -> (T_n+1(H) x, T_n+2(H) x)
+    auto const next = [&](VectorX<scalar_t>& t0, VectorX<scalar_t>& t1) {
+        compute::kpm_spmv(0, rows, h2, t1, t0);
+        t0.swap(t1);
+    };
+    auto const start = [&](VectorX<scalar_t> const& x, VectorX<scalar_t>& t0,
+                           VectorX<scalar_t>& t1) {
+        t0 = x;
+        t1 = VectorX<scalar_t>::Zero(rows);
+        compute::kpm_spmv(0, rows, h2, t0, t1);
+        t1 *= scalar_t{0.5}; // because H2 was pre-multiplied by 2
+    };
+
+    auto left = MatrixX<scalar_t>(rows, block_size);
+    auto right = MatrixX<scalar_t>(rows, block_size);
+    auto l0 = VectorX<scalar_t>(), l1 = VectorX<scalar_t>();
+    auto r0 = VectorX<scalar_t>(), r1 = VectorX<scalar_t>();
+    start(moments.left(r), l0, l1);
+
+    for (auto m0 = 0; m0 < num_moments; m0 += block_size) {
+        auto const m_size = std::min(block_size, num_moments - m0);
+        for (auto m = 0; m < m_size; ++m) {
+            left.col(m) = l0;
+            next(l0, l1);
+        }
+
+        start(r, r0, r1);
+        for (auto n0 = 0; n0 < num_moments; n0 += block_size) {
+            auto const n_size = std::min(block_size, num_moments - n0);
+            for (auto n = 0; n < n_size; ++n) {
+                moments.right(r0, right.col(n));
+                next(r0, r1);
+            }
+            moments.collect(n0, m0, right.leftCols(n_size), left.leftCols(m_size));
+        }
+    }
+}
+
+} // namespace dense_matrix
+
 }}} // namespace cpb::kpm::calc_moments
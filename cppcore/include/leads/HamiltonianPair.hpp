@@ -8,7 +8,6 @@ namespace detail {
     Hamiltonian make_h0(System const& lead_system, HamiltonianModifiers const& modifiers) {
         auto h0 = std::make_shared<SparseMatrixX<scalar_t>>();
         cpb::detail::build_main(*h0, lead_system, modifiers);
-        h0->makeCompressed();
         cpb::detail::throw_if_invalid(*h0);
         return h0;
     }
@@ -16,17 +15,20 @@ namespace detail {
     template<class scalar_t>
     Hamiltonian make_h1(System const& system, HamiltonianModifiers const& modifiers) {
         auto h1 = std::make_shared<SparseMatrixX<scalar_t>>();
-        auto& matrix = *h1;
+        auto const& hoppings = system.boundaries[0].hoppings;
 
+        // Only the (i, j) hoppings: one slot per element of the boundary structure
         auto const num_sites = system.num_sites();
-        matrix.resize(num_sites, num_sites);
-        matrix.reserve(ArrayXi::Constant(num_sites, system.lattice.max_hoppings()));
+        auto capacity = ArrayXi(num_sites);
+        for (auto i = 0; i < num_sites; ++i) {
+            capacity[i] = hoppings.outerIndexPtr()[i + 1] - hoppings.outerIndexPtr()[i];
+        }
 
+        auto builder = cpb::detail::CsrBuilder<scalar_t>(*h1, capacity);
         modifiers.apply_to_hoppings<scalar_t>(system, 0, [&](int i, int j, scalar_t hopping) {
-            matrix.insert(i, j) = hopping;
+            builder.insert(i, j, hopping);
         });
-
-        h1->makeCompressed();
+        builder.finish(modifiers.num_threads);
         cpb::detail::throw_if_invalid(*h1);
 
         return h1;
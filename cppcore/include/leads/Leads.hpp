@@ -45,10 +45,17 @@ public:
     /// Modify the `foundation` so that all leads can be attached
     void create_attachment_area(Foundation& foundation) const;
 
-    /// Create the structure of each lead
-    void make_structure(Foundation const& foundation, HamiltonianIndices const& indices);
+    /// Create the structure of each lead. The leads are built concurrently on `num_threads`
+    /// if all of the lead shapes are thread-safe.
+    void make_structure(Foundation const& foundation, HamiltonianIndices const& indices,
+                        int num_threads = 1);
+    /// Follow the main system into a new site order, see `System::original_indices`
+    void reorder_structure(ArrayXi const& original_indices);
 
-    /// Create a Hamiltonian pair for each lead
+    /// Create a Hamiltonian pair for each lead. The leads are built concurrently on
+    /// `modifiers.num_threads` if the modifiers are thread-safe. Without any modifiers,
+    /// leads with identical structures (e.g. the same cross-section and orientation on
+    /// opposite sides of the system) share the same Hamiltonian pair.
     void make_hamiltonian(HamiltonianModifiers const& modifiers, bool is_double, bool is_complex);
 
     /// Clear any existing structural data, implies clearing Hamiltonian
@@ -0,0 +1,65 @@
+#pragma once
+#include "leads/Leads.hpp"
+
+#include "numeric/dense.hpp"
+
+#include <complex>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace cpb { namespace leads {
+
+/**
+ Retarded self-energy of a semi-infinite lead at the sites where it's attached to the system
+
+ The lead is a semi-infinite repetition of the unit cell `h0`. Each cell is connected to the
+ previous one by `h1`: its rows belong to the outer cell and its columns to the inner one, so
+ the first lead cell is connected to the system by the same `h1`. The surface Green's function
+ `g` of the first lead cell is found using the Sancho-Rubio decimation: each iteration
+ eliminates every other cell, so the remaining coupling spans `2^n` cells after `n` iterations
+ and only a few tens of iterations are needed even close to the band edges. The self-energy is
+ `h1^dagger * g * h1` for the `Lead::indices()` sites, in that order.
+
+ The matrices are dense with the size of the lead cross-section and the precision is given by
+ `real_t` (float or double), regardless of the scalar type of the lead Hamiltonian. Results are
+ cached per energy and a batch of new energies is distributed over `num_threads`.
+ */
+template<class real_t>
+class SelfEnergy {
+public:
+    using complex_t = std::complex<real_t>;
+    using Matrix = MatrixX<complex_t>;
+
+    /// The `broadening` is the imaginary part of the energy (eV). The decimation stops once
+    /// the remaining coupling is below `tolerance` relative to the largest `h1` element.
+    explicit SelfEnergy(Lead const& lead, double broadening = 1e-6, double tolerance = 0,
+                        int max_iterations = 100);
+
+    /// Number of lead sites in the cross-section: the size of the self-energy matrix
+    int size() const { return static_cast<int>(h0.rows()); }
+
+    /// Self-energy at each of the `energies` (eV): new energies are computed in parallel
+    std::vector<Matrix> calc(ArrayXd const& energies, int num_threads = 1) const;
+    /// Self-energy at a single energy
+    Matrix calc(double energy) const;
+    /// Surface Green's function of the first lead cell (not cached)
+    Matrix surface_greens(double energy) const;
+
+    void clear_cache();
+
+private:
+    Matrix h0;
+    Matrix h1;
+    double broadening;
+    real_t tolerance;
+    int max_iterations;
+
+    mutable std::mutex mutex;
+    mutable std::map<double, Matrix> cache;
+};
+
+extern template class SelfEnergy<float>;
+extern template class SelfEnergy<double>;
+
+}} // namespace cpb::leads
@@ -0,0 +1,56 @@
+#pragma once
+#include <complex>
+#include <cstdint>
+#include <cstring>
+
+namespace cpb { namespace num {
+
+/**
+ The upper half of an IEEE single precision float: the same 8 exponent bits, but only
+ 7 explicit mantissa bits (relative precision 2^-9). The conversion to float is just
+ a 16-bit shift, so it's cheap enough to be done in registers right after a load.
+ */
+using bfloat16_t = std::uint16_t;
+
+/// Round to the nearest bfloat16, ties to even. NaN stays NaN.
+inline bfloat16_t to_bfloat16(float value) {
+    std::uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7fffffffu) > 0x7f800000u) {
+        return static_cast<bfloat16_t>((bits >> 16) | 0x0040u); // quiet NaN
+    }
+    auto const rounding = 0x7fffu + ((bits >> 16) & 1u);
+    return static_cast<bfloat16_t>((bits + rounding) >> 16);
+}
+
+inline float from_bfloat16(bfloat16_t value) {
+    auto const bits = static_cast<std::uint32_t>(value) << 16;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+namespace detail {
+    template<class scalar_t>
+    struct Bfloat16Value {
+        static scalar_t call(bfloat16_t const* parts) {
+            return static_cast<scalar_t>(from_bfloat16(parts[0]));
+        }
+    };
+
+    template<class real_t>
+    struct Bfloat16Value<std::complex<real_t>> {
+        static std::complex<real_t> call(bfloat16_t const* parts) {
+            return {static_cast<real_t>(from_bfloat16(parts[0])),
+                    static_cast<real_t>(from_bfloat16(parts[1]))};
+        }
+    };
+} // namespace detail
+
+/// Convert one or two (real and imaginary) bfloat16 `parts` into a `scalar_t` value
+template<class scalar_t>
+scalar_t bfloat16_value(bfloat16_t const* parts) {
+    return detail::Bfloat16Value<scalar_t>::call(parts);
+}
+
+}} // namespace cpb::num
@@ -0,0 +1,141 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "numeric/sparse.hpp"
+
+#include <cstddef>
+#include <vector>
+
+namespace cpb { namespace num {
+
+/**
+ Block sparse row (BSR) matrix with dense square blocks of `block_size` rows and columns
+
+ Block row `i` covers the rows `[i * block_size, (i + 1) * block_size)` and holds the blocks
+ `block_ptr[i]` to `block_ptr[i + 1]` in `block_cols` order. The values of block `k` are
+ `data[k * block_size^2]` onward, row-major: each row of a block is contiguous. A single
+ column index covers `block_size^2` values (including any zeros within a block), so this
+ saves index bandwidth for matrices made of dense blocks, e.g. the all-to-all hoppings
+ between the orbitals of multi-orbital sites. The number of rows must be a multiple of the
+ block size.
+ */
+template<class scalar_t, class index_t = int>
+class BsrMatrix {
+public:
+    index_t _rows, _cols;
+    index_t block_size;
+    ArrayX<index_t> block_ptr; ///< start of each block row in `block_cols`
+    ArrayX<index_t> block_cols; ///< block column index of each block
+    ArrayX<scalar_t> data; ///< `block_size^2` values of each block
+
+public:
+    using Scalar = scalar_t;
+    using Index = index_t;
+
+    BsrMatrix() = default;
+    /// Convert a CSR matrix: the number of rows must be a multiple of the `block_size`
+    BsrMatrix(SparseMatrixX<scalar_t> const& csr, index_t block_size)
+        : _rows(static_cast<index_t>(csr.rows())), _cols(static_cast<index_t>(csr.cols())),
+          block_size(block_size), block_ptr(_rows / block_size + 1) {
+        assert(_rows % block_size == 0 && _cols % block_size == 0);
+        auto const block_rows = _rows / block_size;
+        auto const indptr = csr.outerIndexPtr();
+        auto const indices = csr.innerIndexPtr();
+        auto const values = csr.valuePtr();
+
+        // Position of each block column within the current block row, -1 if not present
+        auto slot = ArrayX<index_t>::Constant(_cols / block_size, -1).eval();
+        auto cols = std::vector<index_t>();
+        auto block_data = std::vector<scalar_t>();
+        block_ptr[0] = 0;
+        for (auto i = 0; i < block_rows; ++i) {
+            auto const first = static_cast<index_t>(cols.size());
+            for (auto row = i * block_size; row < (i + 1) * block_size; ++row) {
+                for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                    auto const block_col = indices[n] / block_size;
+                    if (slot[block_col] < 0) {
+                        slot[block_col] = static_cast<index_t>(cols.size());
+                        cols.push_back(block_col);
+                        block_data.resize(block_data.size() + block_size * block_size,
+                                          scalar_t{0});
+                    }
+                    auto const k = static_cast<std::size_t>(slot[block_col]);
+                    auto const r = row - i * block_size;
+                    auto const c = indices[n] - block_col * block_size;
+                    block_data[(k * block_size + r) * block_size + c] = values[n];
+                }
+            }
+            for (auto k = first; k < static_cast<index_t>(cols.size()); ++k) {
+                slot[cols[k]] = -1;
+            }
+            block_ptr[i + 1] = static_cast<index_t>(cols.size());
+        }
+        block_cols = eigen_cast<ArrayX>(cols);
+        data = eigen_cast<ArrayX>(block_data);
+    }
+
+    Index rows() const { return _rows; }
+    Index cols() const { return _cols; }
+    /// Includes the zeros within the blocks, same as `EllMatrix::nonZeros()` with padding
+    Index nonZeros() const { return num_blocks() * block_size * block_size; }
+    Index num_blocks() const { return static_cast<Index>(block_cols.size()); }
+
+    /// Loop over all the elements of a single row (including the zeros within the blocks)
+    template<class F>
+    void for_each_in_row(index_t row, F lambda) const {
+        auto const i = row / block_size;
+        auto const r = row - i * block_size;
+        for (auto k = block_ptr[i]; k < block_ptr[i + 1]; ++k) {
+            auto const values = data.data() + (k * block_size + r) * block_size;
+            for (auto c = 0; c < block_size; ++c) {
+                lambda(block_cols[k] * block_size + c, values[c]);
+            }
+        }
+    }
+};
+
+/**
+ The block size from 2 to `max_block_size` with which the BSR format of `csr` would need
+ the least memory, or 0 if none of them needs less than the CSR format itself
+
+ The sparse matrix-vector multiplication is bound by memory bandwidth, so the smallest
+ format is also the fastest one: the blocks need to be dense enough to make up for the
+ zeros they contain with the index bandwidth they save.
+ */
+template<class scalar_t>
+int find_block_size(SparseMatrixX<scalar_t> const& csr, int max_block_size = 8) {
+    auto const rows = static_cast<int>(csr.rows());
+    auto const indptr = csr.outerIndexPtr();
+    auto const indices = csr.innerIndexPtr();
+
+    auto const csr_bytes = static_cast<std::size_t>(csr.nonZeros())
+                           * (sizeof(scalar_t) + sizeof(int)) + (rows + 1) * sizeof(int);
+    auto best_bytes = csr_bytes;
+    auto best_size = 0;
+    for (auto block_size = 2; block_size <= max_block_size; ++block_size) {
+        if (rows % block_size != 0 || csr.cols() % block_size != 0) { continue; }
+
+        // Count the distinct block columns of each block row
+        auto last_seen = ArrayXi::Constant(csr.cols() / block_size, -1).eval();
+        auto num_blocks = std::size_t{0};
+        for (auto i = 0; i < rows / block_size; ++i) {
+            for (auto n = indptr[i * block_size]; n < indptr[(i + 1) * block_size]; ++n) {
+                auto const block_col = indices[n] / block_size;
+                if (last_seen[block_col] != i) {
+                    last_seen[block_col] = i;
+                    ++num_blocks;
+                }
+            }
+        }
+
+        auto const values_per_block = static_cast<std::size_t>(block_size * block_size);
+        auto const bytes = num_blocks * (values_per_block * sizeof(scalar_t) + sizeof(int))
+                           + (rows / block_size + 1) * sizeof(int);
+        if (bytes < best_bytes) {
+            best_bytes = bytes;
+            best_size = block_size;
+        }
+    }
+    return best_size;
+}
+
+}} // namespace cpb::num
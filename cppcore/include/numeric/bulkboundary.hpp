@@ -0,0 +1,179 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "numeric/sparse.hpp"
+#include "numeric/traits.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+namespace cpb { namespace num {
+
+/**
+ Hamiltonian with periodic boundaries split into a real bulk and a complex boundary part
+
+ Translational symmetry makes the whole Hamiltonian complex, but usually only the boundary
+ hoppings carry the Bloch phase. Here `bulk` holds the onsite energies and the main hoppings
+ as a real CSR matrix and `boundary` holds only the rows which have periodic boundary
+ elements: `boundary.row(n)` belongs to the matrix row `boundary_rows[n]`. The bulk values
+ and indices take half (double) or two thirds (float) of the memory traffic of the complex
+ CSR matrix and its products with the complex vectors are real by complex.
+
+ Every row of `bulk` has a diagonal slot (possibly an explicit zero) so that `scaled()` can
+ shift the spectrum without touching the boundary. The rows are independent: unlike
+ `SymmetricMatrix`, the kernels accept any row range.
+ */
+template<class scalar_t>
+class BulkBoundaryMatrix {
+public:
+    using Scalar = scalar_t;
+    using Index = int;
+    using real_t = get_real_t<scalar_t>;
+
+    SparseMatrixX<real_t> bulk; ///< onsite energies and main hoppings
+    ArrayXi boundary_rows; ///< ascending matrix rows which have boundary elements
+    SparseMatrixX<scalar_t> boundary; ///< one row for each of `boundary_rows`
+
+public:
+    BulkBoundaryMatrix() = default;
+    /// Keep only the non-empty rows of the `full_boundary` matrix (same size as `bulk`)
+    BulkBoundaryMatrix(SparseMatrixX<real_t> bulk, SparseMatrixX<scalar_t> const& full_boundary)
+        : bulk(std::move(bulk)) {
+        assert(this->bulk.isCompressed() && full_boundary.isCompressed());
+        auto const indptr = full_boundary.outerIndexPtr();
+        auto const indices = full_boundary.innerIndexPtr();
+        auto const data = full_boundary.valuePtr();
+
+        auto num_rows = 0;
+        for (auto row = 0; row < full_boundary.rows(); ++row) {
+            if (indptr[row + 1] > indptr[row]) { ++num_rows; }
+        }
+
+        boundary_rows.resize(num_rows);
+        boundary.resize(num_rows, full_boundary.cols());
+        auto inserter = compressed_inserter(boundary, static_cast<int>(full_boundary.nonZeros()));
+        auto n = 0;
+        for (auto row = 0; row < full_boundary.rows(); ++row) {
+            if (indptr[row + 1] == indptr[row]) { continue; }
+            boundary_rows[n++] = row;
+            inserter.start_row();
+            for (auto k = indptr[row]; k < indptr[row + 1]; ++k) {
+                inserter.insert(indices[k], data[k]);
+            }
+        }
+        inserter.compress();
+    }
+
+    /// Split a full matrix: the real elements (and the whole diagonal) go into the bulk and
+    /// the ones with an imaginary part into the boundary, e.g. the Bloch phases. The onsite
+    /// energies must be real, as they are for any Hermitian matrix.
+    static BulkBoundaryMatrix from_full(SparseMatrixX<scalar_t> const& full) {
+        auto const num_rows = static_cast<int>(full.rows());
+        auto const indptr = full.outerIndexPtr();
+        auto const indices = full.innerIndexPtr();
+        auto const data = full.valuePtr();
+        auto const is_bulk = [&](int row, int n) {
+            return indices[n] == row || std::imag(data[n]) == 0;
+        };
+
+        auto bulk_nnz = 0;
+        auto boundary_nnz = 0;
+        for (auto row = 0; row < num_rows; ++row) {
+            auto has_diagonal = false;
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                if (indices[n] == row && std::imag(data[n]) != 0) {
+                    throw std::invalid_argument("BulkBoundaryMatrix: "
+                                                "the onsite energies must be real.");
+                }
+                has_diagonal = has_diagonal || indices[n] == row;
+                if (is_bulk(row, n)) { ++bulk_nnz; } else { ++boundary_nnz; }
+            }
+            if (!has_diagonal) { ++bulk_nnz; }
+        }
+
+        auto bulk = SparseMatrixX<real_t>(num_rows, num_rows);
+        auto boundary = SparseMatrixX<scalar_t>(num_rows, num_rows);
+        auto bulk_inserter = compressed_inserter(bulk, bulk_nnz);
+        auto boundary_inserter = compressed_inserter(boundary, boundary_nnz);
+        for (auto row = 0; row < num_rows; ++row) {
+            bulk_inserter.start_row();
+            boundary_inserter.start_row();
+            auto diagonal_done = false;
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                if (!diagonal_done && indices[n] >= row) {
+                    // An explicit zero if it's missing, see `scaled()`
+                    if (indices[n] != row) { bulk_inserter.insert(row, real_t{0}); }
+                    diagonal_done = true;
+                }
+                if (is_bulk(row, n)) {
+                    bulk_inserter.insert(indices[n], std::real(data[n]));
+                } else {
+                    boundary_inserter.insert(indices[n], data[n]);
+                }
+            }
+            if (!diagonal_done) { bulk_inserter.insert(row, real_t{0}); }
+        }
+        bulk_inserter.compress();
+        boundary_inserter.compress();
+        return {std::move(bulk), boundary};
+    }
+
+    Index rows() const { return static_cast<Index>(bulk.rows()); }
+    Index cols() const { return rows(); }
+    /// Number of stored elements of both parts
+    Index nonZeros() const { return static_cast<Index>(bulk.nonZeros() + boundary.nonZeros()); }
+
+    /// Return `factor * (matrix - shift * I)`, e.g. to fit the spectrum into (-1, 1)
+    BulkBoundaryMatrix scaled(real_t factor, real_t shift) const {
+        auto result = *this;
+        auto const indptr = result.bulk.outerIndexPtr();
+        auto const indices = result.bulk.innerIndexPtr();
+        auto const bulk_data = result.bulk.valuePtr();
+        for (auto row = 0; row < rows(); ++row) {
+            auto const it = std::lower_bound(indices + indptr[row], indices + indptr[row + 1], row);
+            assert(it != indices + indptr[row + 1] && *it == row);
+            bulk_data[it - indices] -= shift;
+        }
+        for (auto n = 0; n < static_cast<int>(bulk.nonZeros()); ++n) {
+            bulk_data[n] *= factor;
+        }
+
+        auto const boundary_data = result.boundary.valuePtr();
+        for (auto n = 0; n < static_cast<int>(boundary.nonZeros()); ++n) {
+            boundary_data[n] *= factor;
+        }
+        return result;
+    }
+
+    /// Index of the first `boundary_rows` entry which is `>= row`
+    Index first_boundary_row(Index row) const {
+        auto const begin = boundary_rows.data();
+        auto const end = begin + boundary_rows.size();
+        return static_cast<Index>(std::lower_bound(begin, end, row) - begin);
+    }
+
+    /// Loop over all the stored elements: `lambda(row, col, value)`, first the bulk, then
+    /// the boundary. The same position may be visited twice, the values should be summed.
+    template<class F>
+    void for_each(F lambda) const {
+        auto const indptr = bulk.outerIndexPtr();
+        auto const indices = bulk.innerIndexPtr();
+        auto const data = bulk.valuePtr();
+        for (auto row = 0; row < rows(); ++row) {
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                lambda(row, indices[n], scalar_t{data[n]});
+            }
+        }
+
+        auto const b_indptr = boundary.outerIndexPtr();
+        auto const b_indices = boundary.innerIndexPtr();
+        auto const b_data = boundary.valuePtr();
+        for (auto k = 0; k < boundary_rows.size(); ++k) {
+            for (auto n = b_indptr[k]; n < b_indptr[k + 1]; ++n) {
+                lambda(boundary_rows[k], b_indices[n], b_data[n]);
+            }
+        }
+    }
+};
+
+}} // namespace cpb::num
@@ -12,6 +12,8 @@ namespace cpb { namespace constant {
     constexpr float hbar = 6.58211899e-16f;
     // electron rest mass [kg]
     constexpr float m0 = 9.10938188e-31f;
+    // Boltzmann constant [eV/K]
+    constexpr float kb = 8.6173303e-5f;
     // vacuum permittivity [F/m == C/V/m]
     constexpr float epsilon0 = 8.854e-12f;
     // magnetic flux quantum (h/e)
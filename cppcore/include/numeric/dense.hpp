@@ -51,6 +51,10 @@ template<class T> using ArrayX = Eigen::Array<T, Eigen::Dynamic, 1>;
 template<class T> using ArrayXX = Eigen::Array<T, Eigen::Dynamic, Eigen::Dynamic>;
 template<class T> using VectorX = Eigen::Matrix<T, Eigen::Dynamic, 1>;
 template<class T> using MatrixX = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic>;
+template<class T> using RowMajorMatrixX = Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic,
+                                                 Eigen::RowMajor>;
+template<class T> using RowMajorArrayXX = Eigen::Array<T, Eigen::Dynamic, Eigen::Dynamic,
+                                               Eigen::RowMajor>;
 
 // array variants
 using num::arrayref;
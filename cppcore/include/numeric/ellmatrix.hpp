@@ -1,23 +1,61 @@
 #pragma once
+#include "numeric/bfloat16.hpp"
 #include "numeric/dense.hpp"
 #include "numeric/sparseref.hpp"
 
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
 namespace cpb { namespace num {
 
 /**
  ELLPACK format sparse matrix
+
+ The column indices may be compressed into 16-bit `offsets` relative to the first row of
+ each block of `offset_block` rows, see `compress()`. After a bandwidth-reducing reorder,
+ lattice Hamiltonians have small offsets, so this saves half of the index bytes.
+
+ Complex values may additionally be stored as separate real and imaginary planes for
+ the split-complex kernels, see `split()`. Or, if there are only a few distinct values
+ (e.g. a model without modifiers), as 8-bit indices into a table, see `index_values()`.
+ The full `data` of an indexed matrix may then be freed, see `drop_data()`.
+ A lower precision bfloat16 copy of the values halves their size, see `reduce_precision()`.
  */
 template<class scalar_t, class index_t = int>
 class EllMatrix {
+public:
+    using offset_t = std::int16_t;
+    using value_id_t = std::uint8_t;
+
+private:
     using DataArray = Eigen::Array<scalar_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor>;
     using IndexArray = Eigen::Array<index_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor>;
+    using OffsetArray = Eigen::Array<offset_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor>;
+    using PlaneArray = Eigen::Array<get_real_t<scalar_t>, Eigen::Dynamic, Eigen::Dynamic,
+                                    Eigen::ColMajor>;
+    using ValueIdArray = Eigen::Array<value_id_t, Eigen::Dynamic, Eigen::Dynamic,
+                                      Eigen::ColMajor>;
+    using ReducedArray = Eigen::Array<bfloat16_t, Eigen::Dynamic, Eigen::Dynamic,
+                                      Eigen::ColMajor>;
     static constexpr auto align_bytes = 32;
 
 public:
     index_t _rows, _cols;
     index_t nnz_per_row;
-    DataArray data;
-    IndexArray indices;
+    DataArray data; ///< empty after `drop_data()`
+    IndexArray indices; ///< column indices, empty if `is_compressed()`
+    OffsetArray offsets; ///< column minus the first row of its block, if compressed
+    index_t offset_block = 0; ///< number of rows per block of `offsets`, 0 if not compressed
+    PlaneArray data_real; ///< real parts of `data` if `is_split()`, otherwise empty
+    PlaneArray data_imag; ///< imaginary parts of `data` if `is_split()`, otherwise empty
+    ValueIdArray value_ids; ///< position of each value in `value_table` if `is_indexed()`
+    ArrayX<scalar_t> value_table; ///< the distinct values if `is_indexed()`, otherwise empty
+    /// bfloat16 copy of `data` if `is_reduced()`, with the real and imaginary parts of
+    /// complex values interleaved: `reduced_parts()` rows for each row of `data`
+    ReducedArray reduced;
 
 public:
     using Scalar = scalar_t;
@@ -35,11 +73,33 @@ public:
     Index cols() const { return _cols; }
     Index nonZeros() const { return _rows * nnz_per_row; }
 
+    bool is_compressed() const { return offset_block != 0; }
+    bool is_split() const { return data_real.size() != 0; }
+    bool is_indexed() const { return value_table.size() != 0; }
+    bool is_reduced() const { return reduced.size() != 0; }
+    /// False after `drop_data()`: the values are only in the `value_table`
+    bool has_data() const { return data.size() != 0; }
+    /// Number of rows of `data` including the alignment padding, also after `drop_data()`
+    Index padded_rows() const { return has_data() ? data.rows() : value_ids.rows(); }
+
+    /// Number of bfloat16 values for each element of `reduced`
+    static constexpr int reduced_parts() { return is_complex<scalar_t>() ? 2 : 1; }
+
+    /// The column index of element `n` of the given `row`
+    Index column(index_t row, index_t n) const {
+        return is_compressed() ? row - row % offset_block + offsets(row, n) : indices(row, n);
+    }
+
+    /// The value of element `n` of the given `row`, also after `drop_data()`
+    scalar_t value(index_t row, index_t n) const {
+        return has_data() ? data(row, n) : value_table[value_ids(row, n)];
+    }
+
     template<class F>
     void for_each(F lambda) const {
         for (auto n = 0; n < nnz_per_row; ++n) {
             for (auto row = 0; row < _rows; ++row) {
-                lambda(row, indices(row, n), data(row, n));
+                lambda(row, column(row, n), value(row, n));
             }
         }
     }
@@ -48,17 +108,190 @@ public:
     void for_slice(index_t start, index_t end, F lambda) const {
         for (auto n = 0; n < nnz_per_row; ++n) {
             for (auto row = start; row < end; ++row) {
-                lambda(row, indices(row, n), data(row, n));
+                lambda(row, column(row, n), value(row, n));
+            }
+        }
+    }
+
+    /// Replace `indices` with 16-bit `offsets` relative to blocks of `block_size` rows.
+    /// Returns false and leaves the matrix unchanged if some columns are out of reach.
+    bool compress(index_t block_size) {
+        if (is_compressed()) {
+            return offset_block == block_size;
+        }
+
+        auto new_offsets = OffsetArray(OffsetArray::Zero(indices.rows(), indices.cols()));
+        for (auto n = 0; n < nnz_per_row; ++n) {
+            for (auto row = 0; row < _rows; ++row) {
+                auto const relative = indices(row, n) - (row - row % block_size);
+                if (relative < std::numeric_limits<offset_t>::min()
+                    || relative > std::numeric_limits<offset_t>::max()) {
+                    return false;
+                }
+                new_offsets(row, n) = static_cast<offset_t>(relative);
+            }
+        }
+
+        offsets = std::move(new_offsets);
+        offset_block = block_size;
+        indices.resize(0, 0);
+        return true;
+    }
+
+    /// Also store the values as separate real and imaginary planes. The interleaved `data`
+    /// is kept for the kernels which work with regular complex vectors. Returns false and
+    /// leaves the matrix unchanged if the values are real.
+    bool split() {
+        if (!is_complex<scalar_t>()) {
+            return false;
+        }
+        auto const& values = data;
+        data_real = values.real();
+        data_imag = values.imag();
+        return true;
+    }
+
+    /// Also store the values as 8-bit `value_ids` into the `value_table` of distinct values.
+    /// The `data` is kept until `drop_data()`. Returns false and leaves the matrix unchanged
+    /// if there are more distinct values than an 8-bit index can reach. The padding rows for
+    /// alignment point to the first value: their result is discarded.
+    bool index_values() {
+        assert(has_data());
+        constexpr auto max_size = std::size_t{std::numeric_limits<value_id_t>::max()} + 1;
+        auto table = std::vector<scalar_t>();
+        auto ids = ValueIdArray(ValueIdArray::Zero(data.rows(), data.cols()));
+        auto last = 0; // consecutive elements usually repeat the same value
+        for (auto i = 0; i < data.size(); ++i) {
+            if (i % data.rows() >= _rows) {
+                continue; // alignment padding
+            }
+            auto const value = data.data()[i];
+            if (table.empty() || table[last] != value) {
+                auto const it = std::find(table.begin(), table.end(), value);
+                if (it != table.end()) {
+                    last = static_cast<int>(it - table.begin());
+                } else if (table.size() < max_size) {
+                    last = static_cast<int>(table.size());
+                    table.push_back(value);
+                } else {
+                    return false;
+                }
+            }
+            ids.data()[i] = static_cast<value_id_t>(last);
+        }
+
+        if (table.empty()) {
+            return false;
+        }
+        value_ids = std::move(ids);
+        value_table = ArrayX<scalar_t>::Map(table.data(), static_cast<int>(table.size()));
+        return true;
+    }
+
+    /// Also store a bfloat16 copy of the values for the kernels which trade accuracy for
+    /// memory bandwidth. The full precision `data` is kept for all the other kernels.
+    void reduce_precision() {
+        using real_t = get_real_t<scalar_t>;
+        auto const parts = reinterpret_cast<real_t const*>(data.data());
+        reduced.resize(data.rows() * reduced_parts(), data.cols());
+        for (auto i = 0; i < reduced.size(); ++i) {
+            reduced.data()[i] = to_bfloat16(static_cast<float>(parts[i]));
+        }
+    }
+
+    /// Free the full `data` of an indexed matrix: the kernels gather the values from the
+    /// `value_table` instead, which is lossless. See `restore_data()` to modify the values.
+    void drop_data() {
+        assert(is_indexed());
+        data.resize(0, 0);
+    }
+
+    /// Recreate the full `data` from the `value_table`: the inverse of `drop_data()`
+    void restore_data() {
+        if (has_data()) {
+            return;
+        }
+        data.resize(value_ids.rows(), value_ids.cols());
+        for (auto i = 0; i < data.size(); ++i) {
+            data.data()[i] = value_table[value_ids.data()[i]];
+        }
+    }
+
+    /// Remove the `value_table`, e.g. after `data` was modified. The `data` is restored first.
+    void clear_index() {
+        restore_data();
+        value_ids.resize(0, 0);
+        value_table.resize(0);
+    }
+
+    /// Restore the full `indices`: the inverse of `compress()`
+    void decompress() {
+        if (!is_compressed()) {
+            return;
+        }
+
+        indices = IndexArray::Zero(offsets.rows(), offsets.cols());
+        for (auto n = 0; n < nnz_per_row; ++n) {
+            for (auto row = 0; row < _rows; ++row) {
+                indices(row, n) = column(row, n);
             }
         }
+        offset_block = 0;
+        offsets.resize(0, 0);
     }
 };
 
+/**
+ An indexed ELLPACK matrix for the KPM kernels which gather the values from the small
+ `value_table` instead of streaming the full `data`, see `EllMatrix::index_values()`
+ */
+template<class scalar_t, class index_t = int>
+struct IndexedEllRef {
+    using Scalar = scalar_t;
+    EllMatrix<scalar_t, index_t> const& matrix;
+};
+
+/**
+ A reduced precision ELLPACK matrix for the KPM kernels which read the bfloat16 `reduced`
+ values instead of the full `data`, see `EllMatrix::reduce_precision()`
+ */
+template<class scalar_t, class index_t = int>
+struct ReducedEllRef {
+    using Scalar = scalar_t;
+    EllMatrix<scalar_t, index_t> const& matrix;
+};
+
+/**
+ Rows [first_row, last_row) of an ELLPACK matrix with full column indices, e.g. a block
+ of an out-of-core matrix (see `kpm::MatrixStream`). The row and column indices are those
+ of the full matrix, so `rows()` and `cols()` are its size and not the size of the block.
+ */
+template<class scalar_t, class index_t = int>
+struct EllRowBlock {
+    using Scalar = scalar_t;
+    using Index = index_t;
+    using DataArray = Eigen::Array<scalar_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor>;
+    using IndexArray = Eigen::Array<index_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::ColMajor>;
+
+    index_t first_row = 0;
+    index_t last_row = 0;
+    index_t size = 0; ///< number of rows (and columns) of the full matrix
+    DataArray data; ///< `last_row - first_row` rows and `nnz_per_row` columns
+    IndexArray indices; ///< same shape as `data`
+
+    Index rows() const { return size; }
+    Index cols() const { return size; }
+    Index nnz_per_row() const { return static_cast<Index>(data.cols()); }
+    bool contains(index_t row) const { return row >= first_row && row < last_row; }
+};
+
 /**
  Return an ELLPACK matrix reference
  */
 template<class scalar_t>
 inline EllConstRef<scalar_t> ellref(EllMatrix<scalar_t> const& m) {
+    assert(!m.is_compressed());
+    assert(m.has_data());
     return {m.rows(), m.cols(), m.nnz_per_row, static_cast<int>(m.data.rows()),
             m.data.data(), m.indices.data()};
 }
@@ -0,0 +1,62 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "numeric/sparse.hpp"
+
+#include <memory>
+#include <utility>
+
+namespace cpb { namespace num {
+
+/**
+ Symmetric permutation of a CSR matrix which is shared instead of copied
+
+ Element `(i, j)` is `matrix(order[i], order[j])`: row `i` is read from row `order[i]` of
+ the shared `matrix` and its column indices are mapped by `position`, the inverse of `order`.
+ A new permutation of the same matrix costs a few integers per row instead of the values and
+ indices of a reordered copy. The kernels pay for it with an indirect row access and one more
+ gather per element, so this suits many different target indices (e.g. the LDOS at many
+ positions) better than many moments of the same one.
+ */
+template<class scalar_t>
+class PermutedMatrix {
+public:
+    using Scalar = scalar_t;
+    using Index = int;
+
+    std::shared_ptr<SparseMatrixX<scalar_t> const> matrix;
+    ArrayXi order; ///< the original index of each permuted index
+    ArrayXi position; ///< the permuted index of each original index
+    ArrayXi row_starts; ///< non-zeros before each permuted row, `rows() + 1` entries
+
+public:
+    PermutedMatrix() = default;
+    PermutedMatrix(std::shared_ptr<SparseMatrixX<scalar_t> const> m, ArrayXi order_)
+        : matrix(std::move(m)), order(std::move(order_)) {
+        auto const size = rows();
+        auto const indptr = matrix->outerIndexPtr();
+        position.resize(size);
+        row_starts.resize(size + 1);
+        row_starts[0] = 0;
+        for (auto i = 0; i < size; ++i) {
+            position[order[i]] = i;
+            row_starts[i + 1] = row_starts[i] + indptr[order[i] + 1] - indptr[order[i]];
+        }
+    }
+
+    Index rows() const { return static_cast<Index>(order.size()); }
+    Index cols() const { return rows(); }
+    Index nonZeros() const { return rows() != 0 ? row_starts[rows()] : 0; }
+
+    /// Loop over the elements of permuted row `i`: `lambda(permuted_col, value)`
+    template<class F>
+    void for_each_in_row(int i, F lambda) const {
+        auto const data = matrix->valuePtr();
+        auto const indices = matrix->innerIndexPtr();
+        auto const indptr = matrix->outerIndexPtr();
+        for (auto n = indptr[order[i]]; n < indptr[order[i] + 1]; ++n) {
+            lambda(position[indices[n]], data[n]);
+        }
+    }
+};
+
+}} // namespace cpb::num
@@ -1,40 +1,158 @@
 #pragma once
 #include "numeric/dense.hpp"
+#include "numeric/constant.hpp"
 #include "support/cppfuture.hpp"
 
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <limits>
 #include <random>
 
 namespace cpb { namespace num {
 
+/**
+ Philox4x32-10 counter-based random number generator (Salmon et al., SC'11)
+
+ The output is a pure function of a 64-bit key and a 128-bit counter: there's no state which
+ needs to be advanced. Here, the key is the seed and the counter is (index, stream), so any
+ element of any stream can be generated on its own. A container may be filled in parallel,
+ in any order and split in any way with results identical to a serial fill.
+ */
+class Philox {
+public:
+    using Block = std::array<std::uint32_t, 4>;
+
+    explicit Philox(std::uint64_t seed, std::uint64_t stream = 0)
+        : key{{lo(seed), hi(seed)}}, stream{{lo(stream), hi(stream)}} {}
+
+    /// Four random 32-bit words for element `index` of the stream
+    Block operator()(std::uint64_t index) const {
+        return generate({{lo(index), hi(index), stream[0], stream[1]}});
+    }
+
+    /// Raw output for an arbitrary 128-bit counter (ignores the stream)
+    Block generate(Block counter) const {
+        auto k = key;
+        for (auto round = 0; round < 10; ++round) {
+            auto const p0 = std::uint64_t{0xD2511F53} * counter[0];
+            auto const p1 = std::uint64_t{0xCD9E8D57} * counter[2];
+            counter = {{hi(p1) ^ counter[1] ^ k[0], lo(p1), hi(p0) ^ counter[3] ^ k[1], lo(p0)}};
+            k[0] += 0x9E3779B9; // Weyl sequence: golden ratio and sqrt(3) - 1
+            k[1] += 0xBB67AE85;
+        }
+        return counter;
+    }
+
+private:
+    static std::uint32_t lo(std::uint64_t x) { return static_cast<std::uint32_t>(x); }
+    static std::uint32_t hi(std::uint64_t x) { return static_cast<std::uint32_t>(x >> 32); }
+
+private:
+    std::array<std::uint32_t, 2> key;
+    std::array<std::uint32_t, 2> stream;
+};
+
 namespace detail {
     template<class Container>
     using get_element_t = get_real_t<std14::decay_t<decltype(std::declval<Container>()[0])>>;
 
-    template<class scalar_t>
-    using select_distribution = std14::conditional_t<
-        std::is_floating_point<scalar_t>::value,
-        std::uniform_real_distribution<scalar_t>,
-        std::uniform_int_distribution<scalar_t>
-    >;
+    inline std::uint64_t bits64(Philox::Block const& b) {
+        return (std::uint64_t{b[0]} << 32) | b[1];
+    }
+
+    /// Uniformly distributed on [0, 1): all the bits of the mantissa are random
+    template<class real_t>
+    std14::enable_if_t<std::is_floating_point<real_t>::value, real_t>
+    uniform(Philox::Block const& b) {
+        constexpr auto digits = std::numeric_limits<real_t>::digits;
+        auto const scale = real_t{1} / static_cast<real_t>(std::uint64_t{1} << digits);
+        return static_cast<real_t>(bits64(b) >> (64 - digits)) * scale;
+    }
+
+    /// Uniformly distributed on [0, int_max]
+    template<class int_t>
+    std14::enable_if_t<std::is_integral<int_t>::value, int_t>
+    uniform(Philox::Block const& b) {
+        auto const mask = static_cast<std::uint64_t>(std::numeric_limits<int_t>::max());
+        return static_cast<int_t>(bits64(b) & mask); // max is always 2^n - 1
+    }
+
+    template<class real_t>
+    real_t random_phase(real_t, Philox::Block const& b) {
+        return (b[0] & 1u) ? real_t{1} : real_t{-1};
+    }
+
+    template<class real_t>
+    std::complex<real_t> random_phase(std::complex<real_t>, Philox::Block const& b) {
+        auto const phi = 2 * constant::pi * uniform<double>(b);
+        return {static_cast<real_t>(std::cos(phi)), static_cast<real_t>(std::sin(phi))};
+    }
+
+    inline std::uint32_t float_bits(float x) {
+        x += 0.f; // -0 -> +0
+        std::uint32_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        return bits;
+    }
 }
 
-/*
- Fill the container with uniformly distributed random data
+/**
+ Fill the container with uniformly distributed random data: on the interval [0, 1) for real
+ numbers or [0, int_max] for integers. Element `i` (in memory order) only depends on `seed`,
+ `stream` and `i`, see `Philox`.
  */
 template<class Container>
-void random_fill(Container& container, std::uint_fast32_t seed = std::mt19937::default_seed) {
+void random_fill(Container& container, std::uint64_t seed = std::mt19937::default_seed,
+                 std::uint64_t stream = 0) {
     using scalar_t = detail::get_element_t<Container>;
     static_assert(std::is_arithmetic<scalar_t>::value, "");
 
-    auto generator = std::mt19937(seed);
-    auto distribution = detail::select_distribution<scalar_t>();
+    auto const rng = Philox(seed, stream);
+    auto index = std::uint64_t{0};
+    for (auto& value : container) {
+        value = detail::uniform<scalar_t>(rng(index++));
+    }
+}
 
+/**
+ Random phase factor for element `index` of a stream: exp(i*phi) for complex numbers
+ with a uniformly distributed phi or randomly +1 and -1 for real numbers
+ */
+template<class scalar_t>
+scalar_t random_phase(Philox const& rng, std::uint64_t index) {
+    return detail::random_phase(scalar_t{}, rng(index));
+}
+
+/**
+ Fill the container with random phase factors, see `random_phase()`. Element `i` is the same
+ as element `first_index + i` of the full vector, e.g. for the local part of a distributed
+ vector.
+ */
+template<class Container>
+void random_phase_fill(Container& container, std::uint64_t seed = std::mt19937::default_seed,
+                       std::uint64_t stream = 0, std::uint64_t first_index = 0) {
+    using scalar_t = std14::decay_t<decltype(container[0])>;
+    auto const rng = Philox(seed, stream);
+    auto index = first_index;
     for (auto& value : container) {
-        value = distribution(generator);
+        value = random_phase<scalar_t>(rng, index++);
     }
 }
 
-/*
+/**
+ Uniformly distributed on [0, 1) and keyed by a position and an id instead of an index
+
+ The result doesn't depend on the order of the sites or how they are split into chunks.
+ Different ids (e.g. sublattices) give independent values for the same position.
+ */
+inline float position_uniform(Philox const& rng, float x, float y, float z, std::uint32_t id) {
+    using detail::float_bits;
+    auto const block = rng.generate({{float_bits(x), float_bits(y), float_bits(z), id}});
+    return detail::uniform<float>(block);
+}
+
+/**
  Initialize `Container` with `args` and fill with random data uniformly distributed
  on the interval [0, 1) for real numbers or [0, int_max] for integers
  */
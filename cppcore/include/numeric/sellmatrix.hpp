@@ -0,0 +1,128 @@
+#pragma once
+#include "numeric/dense.hpp"
+
+#include <cstdint>
+#include <limits>
+
+namespace cpb { namespace num {
+
+/**
+ Sliced ELLPACK format sparse matrix (SELL-C-sigma)
+
+ The rows are grouped into chunks of `chunk_size` (C) consecutive rows. Each chunk is
+ stored like a small ELLPACK matrix: padded only to the max number of non-zeros of its
+ own rows (`chunk_width`) instead of the max of the entire matrix. Within a chunk, the
+ elements are column-major: entry `n` of all the rows in the chunk are contiguous, so a
+ chunk column can be loaded directly into a SIMD register when C matches the SIMD width.
+
+ The sigma part (sorting the rows by length within a window of sigma rows in order to
+ reduce the padding even more) is not done here: it's a permutation of the matrix which
+ needs to be applied by the owner, see `OptimizedHamiltonian`.
+
+ The column indices may be compressed into 16-bit `offsets` relative to the first row of
+ their chunk, see `compress()`. This halves the index bandwidth for matrices with a small
+ bandwidth, e.g. after a reordering which keeps neighboring sites close to each other.
+ */
+template<class scalar_t, class index_t = int>
+class SellMatrix {
+public:
+    using offset_t = std::int16_t;
+
+    index_t _rows, _cols;
+    index_t chunk_size;
+    ArrayX<index_t> chunk_width; ///< padded number of non-zeros per row within each chunk
+    ArrayX<index_t> chunk_ptr; ///< start of each chunk in `data` and `indices`
+    ArrayX<scalar_t> data;
+    ArrayX<index_t> indices; ///< column indices, empty if `is_compressed()`
+    ArrayX<offset_t> offsets; ///< column minus the first row of the chunk, if compressed
+
+public:
+    using Scalar = scalar_t;
+    using Index = index_t;
+
+    SellMatrix() = default;
+    /// The number of non-zeros per row of each chunk is given by `widths`
+    SellMatrix(index_t rows, index_t cols, index_t chunk_size, ArrayX<index_t> const& widths)
+        : _rows(rows), _cols(cols), chunk_size(chunk_size), chunk_width(widths),
+          chunk_ptr(widths.size() + 1) {
+        assert(widths.size() == (rows + chunk_size - 1) / chunk_size);
+        chunk_ptr[0] = 0;
+        for (auto c = 0; c < widths.size(); ++c) {
+            chunk_ptr[c + 1] = chunk_ptr[c] + widths[c] * chunk_size;
+        }
+        data.resize(chunk_ptr[widths.size()]);
+        indices.resize(chunk_ptr[widths.size()]);
+    }
+
+    Index rows() const { return _rows; }
+    Index cols() const { return _cols; }
+    /// Includes the padding, same as `EllMatrix::nonZeros()`
+    Index nonZeros() const { return chunk_ptr[num_chunks()]; }
+    Index num_chunks() const { return static_cast<Index>(chunk_width.size()); }
+
+    /// Position of element `n` of the given `row` in `data` and `indices`
+    Index offset(index_t row, index_t n) const {
+        auto const chunk = row / chunk_size;
+        return chunk_ptr[chunk] + n * chunk_size + (row - chunk * chunk_size);
+    }
+
+    bool is_compressed() const { return indices.size() == 0 && data.size() != 0; }
+
+    /// The column index of element `k` which belongs to the given `chunk`
+    Index column(index_t k, index_t chunk) const {
+        return is_compressed() ? chunk * chunk_size + offsets[k] : indices[k];
+    }
+
+    /// Loop over all the elements of a single row (including padding)
+    template<class F>
+    void for_each_in_row(index_t row, F lambda) const {
+        auto const chunk = row / chunk_size;
+        for (auto n = 0; n < chunk_width[chunk]; ++n) {
+            auto const k = offset(row, n);
+            lambda(column(k, chunk), data[k]);
+        }
+    }
+
+    /// Replace `indices` with 16-bit `offsets` if all the columns are within reach of
+    /// their chunk. Returns false and leaves the matrix unchanged if they are not.
+    bool compress() {
+        if (is_compressed() || data.size() == 0) {
+            return is_compressed();
+        }
+
+        auto new_offsets = ArrayX<offset_t>(indices.size());
+        for (auto chunk = index_t{0}; chunk < num_chunks(); ++chunk) {
+            auto const base = chunk * chunk_size;
+            for (auto k = chunk_ptr[chunk]; k < chunk_ptr[chunk + 1]; ++k) {
+                auto const relative = indices[k] - base;
+                if (relative < std::numeric_limits<offset_t>::min()
+                    || relative > std::numeric_limits<offset_t>::max()) {
+                    return false;
+                }
+                new_offsets[k] = static_cast<offset_t>(relative);
+            }
+        }
+
+        offsets = std::move(new_offsets);
+        indices.resize(0);
+        return true;
+    }
+
+    /// Restore the full `indices`: the inverse of `compress()`
+    void decompress() {
+        if (!is_compressed()) {
+            return;
+        }
+
+        indices.resize(offsets.size());
+        for (auto chunk = index_t{0}; chunk < num_chunks(); ++chunk) {
+            auto const base = chunk * chunk_size;
+            for (auto k = chunk_ptr[chunk]; k < chunk_ptr[chunk + 1]; ++k) {
+                indices[k] = base + offsets[k];
+            }
+        }
+        offsets.resize(0);
+    }
+};
+
+}} // namespace cpb::num
@@ -1,13 +1,21 @@
 #pragma once
 #include "detail/config.hpp"
+#include "numeric/dense.hpp"
 #include "numeric/sparseref.hpp"
 
 #include <Eigen/SparseCore>
 
+#include <algorithm>
+#include <cassert>
+#include <numeric>
+#include <stdexcept>
+
 namespace cpb {
 
-template <class scalar_t>
-using SparseMatrixX = Eigen::SparseMatrix<scalar_t, Eigen::RowMajor, int>;
+/// The default 32-bit `index_t` is enough for up to 2^31 non-zeros. The compute kernels
+/// accept any index type, e.g. `std::int64_t` for larger matrices.
+template <class scalar_t, class index_t = int>
+using SparseMatrixX = Eigen::SparseMatrix<scalar_t, Eigen::RowMajor, index_t>;
 
 using SparseMatrixXf = SparseMatrixX<float>;
 using SparseMatrixXcf = SparseMatrixX<std::complex<float>>;
@@ -167,11 +175,11 @@ inline Loop<scalar_t> make_loop(SparseMatrixX<scalar_t> const& m) { return {m};
 /**
  Return the maximum number of non-zeros per row
  */
-template<class scalar_t>
-int max_nnz_per_row(SparseMatrixX<scalar_t> const& m) {
+template<class scalar_t, class index_t>
+int max_nnz_per_row(SparseMatrixX<scalar_t, index_t> const& m) {
     auto max = 0;
     for (auto i = 0; i < m.outerSize(); ++i) {
-        auto const nnz = m.outerIndexPtr()[i + 1] - m.outerIndexPtr()[i];
+        auto const nnz = static_cast<int>(m.outerIndexPtr()[i + 1] - m.outerIndexPtr()[i]);
         if (nnz > max) {
             max = nnz;
         }
@@ -179,4 +187,97 @@ int max_nnz_per_row(SparseMatrixX<scalar_t> const& m) {
     return max;
 }
 
+/**
+ Remove the rows and columns `i` of a square matrix where `new_index[i] < 0` and move the
+ others to `new_index[i]`, which must keep them in the same relative order
+
+ The elements keep their order within each row. Two passes over the non-zeros (count and
+ copy) fill an exactly sized result without any sorting or temporary triplets.
+ */
+template<class scalar_t>
+SparseMatrixX<scalar_t> remove_rows_and_cols(SparseMatrixX<scalar_t> const& m,
+                                             ArrayXi const& new_index) {
+    assert(m.isCompressed() && m.rows() == m.cols() && m.rows() == new_index.size());
+    auto const rows = static_cast<int>(m.rows());
+    auto const new_size = rows - static_cast<int>((new_index < 0).count());
+    auto const indptr = m.outerIndexPtr();
+    auto const indices = m.innerIndexPtr();
+    auto const data = m.valuePtr();
+
+    auto result = SparseMatrixX<scalar_t>(new_size, new_size);
+    auto const result_indptr = result.outerIndexPtr();
+    result_indptr[0] = 0;
+    for (auto row = 0; row < rows; ++row) {
+        if (new_index[row] < 0) { continue; }
+        auto nnz = 0;
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            if (new_index[indices[n]] >= 0) { ++nnz; }
+        }
+        result_indptr[new_index[row] + 1] = nnz;
+    }
+    std::partial_sum(result_indptr, result_indptr + new_size + 1, result_indptr);
+    result.resizeNonZeros(result_indptr[new_size]);
+
+    auto const result_indices = result.innerIndexPtr();
+    auto const result_data = result.valuePtr();
+    for (auto row = 0; row < rows; ++row) {
+        if (new_index[row] < 0) { continue; }
+        auto k = result_indptr[new_index[row]];
+        for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+            auto const col = new_index[indices[n]];
+            if (col < 0) { continue; }
+            result_indices[k] = col;
+            result_data[k] = data[n];
+            ++k;
+        }
+    }
+    return result;
+}
+
+/**
+ Copy an external CSR matrix, e.g. the arrays of a `scipy.sparse.csr_matrix`
+
+ Each of the three arrays is copied in bulk into an exactly sized result: there are no
+ temporary triplets and no sorting. The arrays are checked first (row pointers, column
+ range and order) since they don't come from a `SparseMatrixX`. The column indices must
+ be sorted within each row and a row must not contain duplicate columns.
+
+ A copy instead of an `Eigen::MappedSparseMatrix` view because the `Hamiltonian` owns its
+ matrix (`SparseMatrixRC`) and may outlive the external arrays, e.g. a Python object.
+ */
+template<class scalar_t>
+SparseMatrixX<scalar_t> from_csr(num::CsrConstRef<scalar_t> const& ref) {
+    if (ref.rows < 0 || ref.cols < 0 || ref.nnz < 0) {
+        throw std::logic_error("from_csr(): negative matrix size");
+    }
+    if (ref.indptr[0] != 0 || ref.indptr[ref.rows] != ref.nnz) {
+        throw std::logic_error("from_csr(): the row pointers don't match the non-zeros");
+    }
+    // All the row pointers before any of the indices: each row must stay within `nnz`
+    for (auto row = 0; row < ref.rows; ++row) {
+        if (ref.indptr[row + 1] < ref.indptr[row] || ref.indptr[row + 1] > ref.nnz) {
+            throw std::logic_error("from_csr(): the row pointers must not decrease or "
+                                   "exceed the non-zeros");
+        }
+    }
+    for (auto row = 0; row < ref.rows; ++row) {
+        auto const start = ref.indptr[row];
+        auto const end = ref.indptr[row + 1];
+        for (auto n = start; n < end; ++n) {
+            auto const col = ref.indices[n];
+            if (col < 0 || col >= ref.cols || (n > start && col <= ref.indices[n - 1])) {
+                throw std::logic_error("from_csr(): the column indices must be in range and "
+                                       "strictly increasing within each row");
+            }
+        }
+    }
+
+    auto result = SparseMatrixX<scalar_t>(ref.rows, ref.cols);
+    result.resizeNonZeros(ref.nnz);
+    std::copy_n(ref.indptr, ref.rows + 1, result.outerIndexPtr());
+    std::copy_n(ref.indices, ref.nnz, result.innerIndexPtr());
+    std::copy_n(ref.data(), ref.nnz, result.valuePtr());
+    return result.markAsRValue();
+}
+
 }} // namespace cpb::sparse
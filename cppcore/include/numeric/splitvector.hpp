@@ -0,0 +1,37 @@
+#pragma once
+#include "numeric/dense.hpp"
+
+namespace cpb { namespace num {
+
+/**
+ Complex vector stored as separate real and imaginary planes (structure of arrays)
+
+ Interleaved `std::complex` values need lane shuffles for every SIMD multiplication.
+ With split planes, a complex multiply-add is four real ones on full registers.
+ */
+template<class real_t>
+struct SplitVector {
+    using Scalar = std::complex<real_t>;
+
+    VectorX<real_t> real;
+    VectorX<real_t> imag;
+
+    SplitVector() = default;
+    explicit SplitVector(VectorX<Scalar> const& v) : real(v.real()), imag(v.imag()) {}
+
+    int size() const { return static_cast<int>(real.size()); }
+    void swap(SplitVector& other) {
+        real.swap(other.real);
+        imag.swap(other.imag);
+    }
+
+    /// Back to interleaved complex values
+    VectorX<Scalar> interleaved() const {
+        auto v = VectorX<Scalar>(real.size());
+        v.real() = real;
+        v.imag() = imag;
+        return v;
+    }
+};
+
+}} // namespace cpb::num
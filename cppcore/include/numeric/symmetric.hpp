@@ -0,0 +1,105 @@
+#pragma once
+#include "numeric/dense.hpp"
+#include "numeric/sparse.hpp"
+#include "numeric/traits.hpp"
+
+#include <utility>
+
+namespace cpb { namespace num {
+
+/**
+ Hermitian sparse matrix which stores only the upper triangle
+
+ `upper` is a CSR matrix with the elements `(i, j)` where `j >= i`. The lower triangle is
+ implied: `H(j, i) == conj(H(i, j))`. Compared to the full Hermitian CSR matrix, this halves
+ the memory of both the values and the column indices. The diagonal is always stored, even
+ if it's zero, and it's the first element of each row, which keeps `scaled()` trivial and
+ lets the kernels peel it off.
+
+ Each stored off-diagonal element contributes to two rows of a matrix-vector product:
+ `y[i] += a * x[j]` (gather) and `y[j] += conj(a) * x[i]` (transposed scatter). The scatter
+ writes to rows which aren't known in advance, so the kernels always cover the whole matrix
+ on a single thread. The row-range optimizations (reordering, optimal size, interleaving)
+ don't apply either. This is the memory-bound alternative, not the fast one.
+ */
+template<class scalar_t>
+class SymmetricMatrix {
+public:
+    using Scalar = scalar_t;
+    using Index = int;
+
+    SparseMatrixX<scalar_t> upper; ///< upper triangle, including the diagonal
+
+public:
+    SymmetricMatrix() = default;
+    explicit SymmetricMatrix(SparseMatrixX<scalar_t> upper) : upper(std::move(upper)) {
+        assert(this->upper.isCompressed());
+    }
+
+    /// Keep only the upper triangle (and the whole diagonal) of a full Hermitian matrix
+    static SymmetricMatrix from_full(SparseMatrixX<scalar_t> const& full) {
+        auto const num_rows = static_cast<int>(full.rows());
+        auto const indptr = full.outerIndexPtr();
+        auto const indices = full.innerIndexPtr();
+        auto const data = full.valuePtr();
+
+        auto nnz = 0;
+        for (auto row = 0; row < num_rows; ++row) {
+            ++nnz;
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                if (indices[n] > row) { ++nnz; }
+            }
+        }
+
+        auto upper = SparseMatrixX<scalar_t>(num_rows, num_rows);
+        auto inserter = compressed_inserter(upper, nnz);
+        for (auto row = 0; row < num_rows; ++row) {
+            inserter.start_row();
+            auto diagonal = scalar_t{0};
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                if (indices[n] == row) { diagonal = data[n]; }
+            }
+            inserter.insert(row, diagonal);
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                if (indices[n] > row) { inserter.insert(indices[n], data[n]); }
+            }
+        }
+        inserter.compress();
+        return SymmetricMatrix(std::move(upper));
+    }
+
+    Index rows() const { return static_cast<Index>(upper.rows()); }
+    Index cols() const { return rows(); }
+    /// Number of stored elements
+    Index nonZeros() const { return static_cast<Index>(upper.nonZeros()); }
+
+    /// Return `factor * (matrix - shift * I)`, e.g. to fit the spectrum into (-1, 1)
+    SymmetricMatrix scaled(scalar_t factor, scalar_t shift) const {
+        auto result = *this;
+        auto const indptr = result.upper.outerIndexPtr();
+        auto const data = result.upper.valuePtr();
+        for (auto row = 0; row < rows(); ++row) {
+            data[indptr[row]] -= shift;
+        }
+        for (auto n = 0; n < nonZeros(); ++n) {
+            data[n] *= factor;
+        }
+        return result;
+    }
+
+    /// Loop over all the stored elements: `lambda(row, col, value)`. The diagonal element
+    /// comes first in each row, followed by the elements with `col > row`.
+    template<class F>
+    void for_each(F lambda) const {
+        auto const indptr = upper.outerIndexPtr();
+        auto const indices = upper.innerIndexPtr();
+        auto const data = upper.valuePtr();
+        for (auto row = 0; row < rows(); ++row) {
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                lambda(row, indices[n], data[n]);
+            }
+        }
+    }
+};
+
+}} // namespace cpb::num
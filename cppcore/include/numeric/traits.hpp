@@ -44,6 +44,18 @@ using get_real_t = typename detail::complex_traits<scalar_t>::real_t;
 template<class scalar_t>
 using get_complex_t = typename detail::complex_traits<scalar_t>::complex_t;
 
+/**
+ Return the double precision type corresponding to the given scalar type
+
+ For example:
+   std::complex<float> -> std::complex<double>
+   float               -> double
+ */
+template<class scalar_t>
+using get_double_t = typename std::conditional<
+    detail::complex_traits<scalar_t>::is_complex, std::complex<double>, double
+>::type;
+
 /**
  Is the given scalar type complex?
  */
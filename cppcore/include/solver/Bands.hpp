@@ -0,0 +1,23 @@
+#pragma once
+#include "Model.hpp"
+
+#include "numeric/dense.hpp"
+
+#include <vector>
+
+namespace cpb {
+
+/**
+ Compute the eigenvalues of a periodic model at many k-points in a single call
+
+ The Bloch Hamiltonians are assembled from the wave vector independent parts of the model's
+ Hamiltonian, see `Model::periodic_hamiltonian()`, so the modifiers are not evaluated again
+ for each k-point. Each Hamiltonian is diagonalized as a dense matrix and the k-points are
+ distributed over `num_threads` threads.
+
+ Returns a (num_kpoints x num_sites) array: row `n` holds the sorted eigenvalues for `kpoints[n]`.
+ */
+RowMajorArrayXX<double> calc_bands(Model const& model, std::vector<Cartesian> const& kpoints,
+                                   int num_threads = 1);
+
+} // namespace cpb
@@ -0,0 +1,78 @@
+#pragma once
+#include "solver/Solver.hpp"
+#include "utils/ThreadPool.hpp"
+#include "detail/macros.hpp"
+
+namespace cpb {
+
+struct ChebFilterConfig {
+    // required user config
+    double energy_min = 0; ///< lowest eigenvalue of the window
+    double energy_max = 0; ///< highest eigenvalue of the window
+    int initial_size_guess = 0; ///< subspace size, ideally 1.5x the number of eigenvalues
+
+    // optional user config
+    int filter_degree = 0; ///< degree of the Chebyshev filter, at least 2 or 0 for automatic
+    double tolerance = 0; ///< relative residual, 0 for automatic: sqrt(epsilon) of the scalar
+    int max_iterations = 50; ///< the calculation fails if it doesn't converge by then
+    int num_threads = 1; ///< threads which share the sparse matrix-matrix multiplications
+    float lanczos_precision = 0.002f; ///< for the spectrum bounds needed by the filter
+};
+
+/**
+ Chebyshev-filtered subspace iteration for all the eigenvalues in an energy window
+
+ A block of vectors is repeatedly multiplied by a Chebyshev expansion of the window's
+ indicator function (with Jackson damping). This amplifies the eigenvectors within the
+ window compared to all the others. Each filter is followed by orthonormalization and
+ a Rayleigh-Ritz projection. Unlike FEAST, no factorization is needed: the only large
+ operations are the block SpMMs of the scaled KPM Hamiltonian, see `compute::kpm_spmm`.
+
+ If the window contains too many eigenvalues for the subspace, it's enlarged automatically.
+ */
+template<class scalar_t>
+class ChebFilter : public SolverStrategy {
+    using real_t = num::get_real_t<scalar_t>;
+
+public:
+    struct Info {
+        int final_size = 0; ///< final subspace size
+        int filter_degree = 0;
+        int iterations = 0; ///< number of filter + Rayleigh-Ritz steps
+        real_t max_residual = 0; ///< biggest `|H x - E x|` of the eigenpairs in the window
+        bool size_warning = false; ///< the initial subspace size was too small
+    };
+
+public:
+    using Config = ChebFilterConfig;
+    explicit ChebFilter(SparseMatrixRC<scalar_t> hamiltonian, Config const& config = {});
+
+public: // overrides
+    bool change_hamiltonian(Hamiltonian const& h) override;
+    void solve() override;
+    std::string report(bool shortform) const override;
+
+    RealArrayConstRef eigenvalues() const override { return arrayref(_eigenvalues); }
+    ComplexArrayConstRef eigenvectors() const override { return arrayref(_eigenvectors); }
+
+private: // implementation
+    /// Apply the Chebyshev polynomial with the given `coefficients` of `h2` to each column
+    void filter(SparseMatrixX<scalar_t> const& h2, ArrayX<real_t> const& coefficients,
+                MatrixX<scalar_t>& x);
+    /// `y = h2 * x - y` split among the threads of the pool, if there is one
+    void spmm(SparseMatrixX<scalar_t> const& h2, RowMajorMatrixX<scalar_t> const& x,
+              RowMajorMatrixX<scalar_t>& y);
+
+private:
+    SparseMatrixRC<scalar_t> hamiltonian;
+    Config config;
+    std::unique_ptr<ThreadPool> thread_pool;
+
+    ArrayX<real_t> _eigenvalues;
+    ArrayXX<scalar_t> _eigenvectors;
+    Info info;
+};
+
+CPB_EXTERN_TEMPLATE_CLASS(ChebFilter)
+
+} // namespace cpb
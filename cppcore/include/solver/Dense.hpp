@@ -0,0 +1,47 @@
+#pragma once
+#include "solver/Solver.hpp"
+#include "detail/macros.hpp"
+
+namespace cpb {
+
+struct DenseConfig {
+    double energy_min = 0; ///< lowest eigenvalue of the window
+    double energy_max = 0; ///< highest eigenvalue of the window, all if `min == max`
+    int num_threads = 0; ///< LAPACK threads (MKL builds only), 0 for the library default
+};
+
+/**
+ Dense Hermitian eigensolver for small and medium systems (up to a few thousand sites)
+
+ The dense matrix is filled straight from the CSR Hamiltonian, without any intermediate
+ copies, and diagonalized with LAPACK's MRRR driver (`heevr`) in MKL builds or with
+ Eigen's `SelfAdjointEigenSolver` otherwise. With an energy window, only the eigenpairs
+ within it are kept: LAPACK doesn't compute the others at all.
+ */
+template<class scalar_t>
+class Dense : public SolverStrategy {
+    using real_t = num::get_real_t<scalar_t>;
+
+public:
+    using Config = DenseConfig;
+    explicit Dense(SparseMatrixRC<scalar_t> hamiltonian, Config const& config = {});
+
+public: // overrides
+    bool change_hamiltonian(Hamiltonian const& h) override;
+    void solve() override;
+    std::string report(bool shortform) const override;
+
+    RealArrayConstRef eigenvalues() const override { return arrayref(_eigenvalues); }
+    ComplexArrayConstRef eigenvectors() const override { return arrayref(_eigenvectors); }
+
+private:
+    SparseMatrixRC<scalar_t> hamiltonian;
+    Config config;
+
+    ArrayX<real_t> _eigenvalues;
+    ArrayXX<scalar_t> _eigenvectors;
+};
+
+CPB_EXTERN_TEMPLATE_CLASS(Dense)
+
+} // namespace cpb
@@ -0,0 +1,81 @@
+#pragma once
+#include "Model.hpp"
+#include "utils/Chrono.hpp"
+
+#include "numeric/dense.hpp"
+
+#include <Eigen/SparseLU>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cpb {
+
+/**
+ Green's functions `G(E) = (E + i*broadening - H)^-1` from sparse LU factorizations
+
+ The number of KPM moments (or recursion levels) grows as `bandwidth / broadening`, which
+ becomes prohibitive for a very small broadening. For moderate system sizes, it's cheaper
+ to factorize `z - H` directly. Only the diagonal changes with the energy, so the symbolic
+ analysis (fill-reducing ordering and elimination tree) is done once per sparsity pattern
+ and kept between calls: each energy costs a numeric factorization and one solve with the
+ unit vectors of the requested rows.
+
+ The energies are distributed over `num_threads` and each thread has its own copy of the
+ matrix and its own factorization. The element (row, col) is `G_{col,row}` like the results
+ of `kpm::Strategy::greens()`, but in plain units of 1/eV: the KPM and recursion results
+ are scaled, i.e. multiplied by the scaling factor `a` of the Hamiltonian. The computation
+ is always done in complex double precision.
+ */
+class DirectGreens {
+    using ColMajorComplex = Eigen::SparseMatrix<std::complex<double>, Eigen::ColMajor, int>;
+    using LU = Eigen::SparseLU<ColMajorComplex>;
+
+public:
+    explicit DirectGreens(Model const& model, int num_threads = 1);
+
+    /// Replace the model: the symbolic analysis is kept if the sparsity pattern is the same
+    void set_model(Model const& model);
+    Model const& get_model() const { return model; }
+    void set_num_threads(int n) { num_threads = n; }
+
+    /// Return the Green's function matrix element (row, col) for the given energy range
+    ArrayXcd greens(int row, int col, ArrayXd const& energy, double broadening);
+    /// Return multiple Green's matrix elements for a single `row` and multiple `cols`
+    std::vector<ArrayXcd> greens_vector(int row, std::vector<int> const& cols,
+                                        ArrayXd const& energy, double broadening);
+    /// Return the block of Green's matrix elements (rows x cols), row by row: element
+    /// (rows[i], cols[j]) is `i * cols.size() + j`. The factorization of each energy
+    /// is solved for all the `rows` at once.
+    std::vector<ArrayXcd> greens_block(std::vector<int> const& rows,
+                                       std::vector<int> const& cols,
+                                       ArrayXd const& energy, double broadening);
+
+    /// Number of symbolic analyses and numeric factorizations done so far
+    int num_analyses() const { return analysis_count; }
+    int num_factorizations() const { return factorization_count; }
+
+    std::string report(bool shortform = false) const;
+
+private:
+    /// The factorization of one thread which keeps its symbolic analysis between calls
+    struct Worker {
+        ColMajorComplex matrix;
+        std::unique_ptr<LU> lu;
+        bool is_analyzed = false;
+    };
+
+    Model model;
+    int num_threads;
+    ColMajorComplex negative_h; ///< `-H` with every diagonal element stored
+    std::vector<int> diagonal; ///< position of each diagonal element in the values
+    ArrayXcd onsite; ///< diagonal of `negative_h`
+    std::vector<Worker> workers;
+
+    int analysis_count = 0;
+    int factorization_count = 0;
+    Chrono calculation_timer; ///< time of the last calculation
+};
+
+} // namespace cpb
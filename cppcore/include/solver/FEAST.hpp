@@ -4,8 +4,38 @@
 #ifdef CPB_USE_FEAST
 #include "solver/Solver.hpp"
 
+#include <map>
+#include <memory>
+#include <mutex>
+
 namespace cpb {
 
+/**
+ Subspaces shared between the FEAST solvers of a parameter sweep
+
+ Each solver stores its converged subspace under the index of its point in the sweep.
+ A solver which has no data of its own starts from the subspace of the nearest point
+ which was already computed, instead of a random guess. The jobs of a sweep may run on
+ different threads, so access is guarded by a mutex. At most `capacity` subspaces are
+ kept: the ones farthest from the newly stored point are dropped first.
+ */
+class FEASTSweep {
+public:
+    explicit FEASTSweep(int capacity = 8) : capacity(capacity) {}
+
+    /// Save the subspace of the sweep point `index`
+    void store(int index, ArrayXXcd subspace);
+    /// The subspace closest to the sweep point `index` or an empty array if there is none
+    ArrayXXcd nearest(int index) const;
+    /// Number of subspaces which are currently stored
+    int size() const;
+
+private:
+    int capacity;
+    std::map<int, ArrayXXcd> subspaces;
+    mutable std::mutex mutex;
+};
+
 struct FEASTConfig {
     // required user config
     double energy_min = 0; ///< lowest eigenvalue
@@ -23,6 +53,12 @@ struct FEASTConfig {
     int dp_stop_criteria = 10; ///< [12] double precision error trace stopping criteria
     bool residual_convergence = false; /**< [false] use residual stop criteria
                                            instead of error trace criteria */
+    int num_threads = 1; /**< [1] contour points which are factorized and solved concurrently,
+                                  1 uses MKL's FEAST driver */
+
+    // parameter sweep config
+    std::shared_ptr<FEASTSweep> sweep; ///< [none] shares subspaces between the sweep points
+    int sweep_index = 0; ///< [0] position of this solver's point in the sweep
 
     // implementation detail config
     char matrix_format = 'F'; ///<  full matrix 'F' or triangular: lower 'L' and upper 'U'
@@ -74,6 +110,8 @@ private: // implementation
     void init_pardiso(); ///< initialize PARDISO (sparse linear solver) parameters
     void call_feast(); ///< setup and call FEAST solver
     void call_feast_impl(); ///< call for scalar_t specific solver
+    void call_contour_parallel(); ///< contour integration with concurrent contour points
+    bool load_sweep_subspace(); ///< start from the nearest subspace of `config.sweep`
     void force_clear(); ///< clear eigenvalue, eigenvector and residual data
 
 private:
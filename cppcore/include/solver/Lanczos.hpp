@@ -0,0 +1,87 @@
+#pragma once
+#include "solver/Solver.hpp"
+#include "utils/ThreadPool.hpp"
+#include "detail/macros.hpp"
+
+#include <Eigen/SparseLU>
+
+namespace cpb {
+
+/**
+ How the `Lanczos` solver reaches the eigenvalues closest to `sigma`
+
+ ShiftInvert: Lanczos on `(H - sigma)^-1` using a sparse LU factorization, fast convergence
+              but the factorization needs memory and it's not parallel
+ Folded: Lanczos on `(H - sigma)^2` using only sparse matrix-vector multiplication (which
+         can be multithreaded), no extra memory but the convergence is much slower
+ */
+enum class LanczosMode { ShiftInvert, Folded };
+
+struct LanczosConfig {
+    int num_eigenvalues = 6; ///< the number of eigenvalues closest to `sigma`
+    double sigma = 0; ///< target energy
+    LanczosMode mode = LanczosMode::ShiftInvert;
+
+    int subspace_size = 0; ///< number of Lanczos vectors, 0 for automatic: max(2k + 1, 20)
+    double tolerance = 0; ///< residual relative to the operator norm, 0 for sqrt(epsilon)
+    int max_restarts = 1000; ///< the calculation fails if it doesn't converge until then
+    int num_threads = 1; ///< threads which share the matrix-vector multiplications
+};
+
+/**
+ Thick-restart Lanczos eigensolver for a few eigenvalues of a sparse Hermitian matrix
+
+ When the subspace is full, it's contracted to the best Ritz vectors (roughly half of the
+ subspace) and the Lanczos procedure continues from the last residual vector. The basis
+ is always fully reorthogonalized so there are no spurious eigenvalues. The final
+ eigenvalues are the Rayleigh quotients of the original Hamiltonian, sorted ascending.
+ */
+template<class scalar_t>
+class Lanczos : public SolverStrategy {
+    using real_t = num::get_real_t<scalar_t>;
+    using ColMajorSparse = Eigen::SparseMatrix<scalar_t, Eigen::ColMajor, int>;
+
+public:
+    struct Info {
+        int subspace_size = 0;
+        int restarts = 0; ///< number of thick restarts until convergence
+        int operations = 0; ///< number of times the Lanczos operator was applied
+        real_t max_residual = 0; ///< biggest `|H x - E x|` of the final eigenpairs
+    };
+
+public:
+    using Config = LanczosConfig;
+    explicit Lanczos(SparseMatrixRC<scalar_t> hamiltonian, Config const& config = {});
+
+public: // overrides
+    bool change_hamiltonian(Hamiltonian const& h) override;
+    void solve() override;
+    std::string report(bool shortform) const override;
+
+    RealArrayConstRef eigenvalues() const override { return arrayref(_eigenvalues); }
+    ComplexArrayConstRef eigenvectors() const override { return arrayref(_eigenvectors); }
+
+private: // implementation
+    /// Factorize the shifted matrix if needed, must be called before `apply()`
+    void prepare_operator();
+    /// `y = op(x)` where `op` is `(H - sigma)^-1` or `(H - sigma)^2` depending on the mode
+    void apply(VectorX<scalar_t> const& x, VectorX<scalar_t>& y);
+    /// `y = H * x` split among the threads of the pool, if there is one
+    void spmv(VectorX<scalar_t> const& x, VectorX<scalar_t>& y);
+
+private:
+    SparseMatrixRC<scalar_t> hamiltonian;
+    Config config;
+    std::unique_ptr<ThreadPool> thread_pool;
+
+    Eigen::SparseLU<ColMajorSparse> lu;
+    VectorX<scalar_t> tmp; ///< scratch for `apply()`
+
+    ArrayX<real_t> _eigenvalues;
+    ArrayXX<scalar_t> _eigenvectors;
+    Info info;
+};
+
+CPB_EXTERN_TEMPLATE_CLASS(Lanczos)
+
+} // namespace cpb
@@ -4,12 +4,63 @@
 
 #include "utils/Chrono.hpp"
 #include "numeric/dense.hpp"
+#include "numeric/constant.hpp"
 #include "detail/strategy.hpp"
 
 #include <memory>
 
 namespace cpb {
 
+/**
+ Spatial LDOS at a few target energies, accumulated from chunks of eigenpairs
+
+ The result is the same as `BaseSolver::calc_spatial_ldos` for each energy, but the
+ eigenvectors don't need to be stored after `solve()`: a strategy passes them in while it
+ still holds its working subspace, so this saves the stored copy and not the peak memory.
+ */
+class SpatialLDOSStream {
+public:
+    SpatialLDOSStream(ArrayXf energies, float broadening)
+        : energies(std::move(energies)), broadening(broadening) {}
+
+    /// Start a new accumulation for a system with `num_sites`
+    void reset(int num_sites) { ldos = ArrayXXd::Zero(num_sites, energies.size()); }
+
+    /// Add the contribution of the eigenpairs: one column of `vectors` for each of `values`
+    template<class Values, class Vectors>
+    void add(Values const& values, Vectors const& vectors) {
+        auto const scale = 1 / (broadening * std::sqrt(2 * constant::pi));
+        auto const constant = -0.5f / (broadening * broadening);
+
+        auto weights = MatrixX<double>(values.size(), energies.size());
+        for (auto e = 0; e < energies.size(); ++e) {
+            for (auto n = 0; n < values.size(); ++n) {
+                auto const delta = static_cast<float>(values[n]) - energies[e];
+                weights(n, e) = scale * std::exp(delta * delta * constant);
+            }
+        }
+        MatrixX<double> const psi2 = vectors.matrix().cwiseAbs2().template cast<double>();
+        ldos.matrix() += psi2 * weights;
+    }
+
+    /// The LDOS column for the given target, -1 if it's not one of the streamed energies
+    int find(float energy, float target_broadening) const {
+        if (target_broadening != broadening) { return -1; }
+        for (auto i = 0; i < energies.size(); ++i) {
+            if (energies[i] == energy) { return i; }
+        }
+        return -1;
+    }
+
+    /// One column for each of the target energies
+    ArrayXXd const& get() const { return ldos; }
+
+private:
+    ArrayXf energies;
+    float broadening;
+    ArrayXXd ldos;
+};
+
 /**
  Abstract base class for an eigensolver
  */
@@ -17,6 +68,10 @@ class SolverStrategy {
 public:
     virtual ~SolverStrategy() = default;
 
+    /// Pass the eigenvectors to `stream` during `solve()` instead of storing them.
+    /// The `eigenvectors()` are not available in that case, but the eigenvalues are.
+    void set_stream(SpatialLDOSStream* s) { stream = s; }
+
     /// Returns false if the given Hamiltonian is the wrong type for this SolverStrategy
     virtual bool change_hamiltonian(Hamiltonian const& h) = 0;
     virtual void solve() = 0;
@@ -24,6 +79,9 @@ public:
 
     virtual RealArrayConstRef eigenvalues() const = 0;
     virtual ComplexArrayConstRef eigenvectors() const = 0;
+
+protected:
+    SpatialLDOSStream* stream = nullptr;
 };
 
 /**
@@ -44,8 +102,15 @@ public:
     RealArrayConstRef eigenvalues();
     ComplexArrayConstRef eigenvectors();
 
-    ArrayXd calc_dos(ArrayXf energies, float broadening);
-    ArrayXd calc_spatial_ldos(float energy, float broadening);
+    /// Both are split over `num_threads`: the DOS by energy and the LDOS by site
+    ArrayXd calc_dos(ArrayXf energies, float broadening, int num_threads = 1);
+    ArrayXd calc_spatial_ldos(float energy, float broadening, int num_threads = 1);
+
+    /// Compute the spatial LDOS at the given `energies` during `solve()` without keeping the
+    /// eigenvectors afterwards. The peak memory of the solve is unchanged: the strategy still
+    /// needs its working subspace. Afterwards, `calc_spatial_ldos` only works for these
+    /// energies and broadening and `eigenvectors()` is unavailable. Empty `energies` disable it.
+    void stream_spatial_ldos(ArrayXf energies, float broadening);
 
 protected:
     using MakeStrategy = std::function<std::unique_ptr<SolverStrategy>(Hamiltonian const&)>;
@@ -55,6 +120,7 @@ private:
     Model model;
     MakeStrategy make_strategy;
     std::unique_ptr<SolverStrategy> strategy;
+    std::unique_ptr<SpatialLDOSStream> ldos_stream;
 
     bool is_solved = false;
     mutable Chrono calculation_timer; ///< last calculation time
@@ -0,0 +1,49 @@
+#pragma once
+#include "Model.hpp"
+
+#include "numeric/dense.hpp"
+
+#include <vector>
+
+namespace cpb {
+
+/**
+ Partition of the system sites into slices which make the Hamiltonian block tridiagonal
+
+ Slice 0 holds the sites where the `from` lead is attached and each following slice is the
+ next layer of neighbors, i.e. a breadth-first search over the hoppings. This way each slice
+ is only connected to the previous and the next one. With leads on opposite sides, the layers
+ are the lattice slices along `leads::Spec::axis`, but any lead placement works. The first
+ layer which touches the `to` lead and everything behind it are merged into the last slice.
+ Sites which can't be reached from the `from` lead don't take part in the transport.
+ */
+struct TransportSlices {
+    std::vector<std::vector<int>> sites; ///< system indices of the sites in each slice
+    ArrayXi slice_of; ///< slice of each system site, -1 if it can't be reached
+    ArrayXi local_index; ///< position of each system site within its slice
+
+    TransportSlices(System const& system, std::vector<int> const& from,
+                    std::vector<int> const& to);
+
+    int size() const { return static_cast<int>(sites.size()); }
+    /// Number of sites in the largest slice
+    int max_width() const;
+};
+
+/**
+ Two-terminal transmission using the recursive Green's function (RGF) method
+
+ The system is partitioned into `TransportSlices` between the `from` and `to` leads. Only the
+ dense diagonal and coupling blocks of the slices are formed and a single forward sweep per
+ energy gives the Green's function `G_1N` between the first and the last slice:
+
+     T(E) = Tr[Gamma_from * G_1N * Gamma_to * G_1N^dagger],  Gamma = i * (Sigma - Sigma^dagger)
+
+ The lead self-energies `Sigma` come from `leads::SelfEnergy`. The cost is `O(N_slices * W^3)`
+ for a slice width `W` and the energies are distributed over `num_threads`. The `broadening`
+ is the imaginary part of the energy (eV) for both the leads and the scattering region.
+ */
+ArrayXd calc_transmission(Model const& model, ArrayXd const& energies, int from = 0,
+                          int to = 1, double broadening = 1e-6, int num_threads = 1);
+
+} // namespace cpb
@@ -19,6 +19,7 @@
 #endif
 
 #include "detail/macros.hpp"
+#include "numeric/bfloat16.hpp"
 #include <complex>
 
 namespace cpb { namespace simd {
@@ -193,6 +194,54 @@ Vec gather(Scalar const* data, Index const* indices) {
     return detail::Gather<Vec>::call(data, indices);
 }
 
+namespace detail {
+    /// Fallback: convert one element at a time
+    template<class Vec>
+    struct LoadBfloat16 {
+        using element_t = typename Vec::element_type;
+
+        static Vec call(num::bfloat16_t const* p) {
+            alignas(Vec::length_bytes) element_t values[Vec::length];
+            for (auto i = 0u; i < Vec::length; ++i) {
+                values[i] = static_cast<element_t>(num::from_bfloat16(p[i]));
+            }
+            return load<Vec>(values);
+        }
+    };
+
+#if SIMDPP_USE_SSE2
+    template<>
+    struct LoadBfloat16<float32x4> {
+        static float32x4 call(num::bfloat16_t const* p) {
+            // Each 16-bit value becomes the upper half of a 32-bit float
+            auto const v = _mm_loadl_epi64(reinterpret_cast<__m128i const*>(p));
+            return _mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), v));
+        }
+    };
+
+    template<>
+    struct LoadBfloat16<float64x2> {
+        static float64x2 call(num::bfloat16_t const* p) {
+            std::int32_t two;
+            std::memcpy(&two, p, sizeof(two));
+            auto const v = _mm_cvtsi32_si128(two);
+            return _mm_cvtps_pd(_mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), v)));
+        }
+    };
+#endif // SIMDPP_USE_SSE2
+} // namespace detail
+
+/**
+ Load a vector `Vec` of float or double elements from the same number of (unaligned)
+ bfloat16 values. The conversion happens in registers, so only 16 bits per element are
+ read from memory. For complex scalars, the real and imaginary parts are interleaved
+ the same way as in the float vector.
+ */
+template<class Vec> CPB_ALWAYS_INLINE
+Vec load_bfloat16(num::bfloat16_t const* p) {
+    return detail::LoadBfloat16<Vec>::call(p);
+}
+
 /**
  Alternatively add and subtract elements
 
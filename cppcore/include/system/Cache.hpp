@@ -0,0 +1,123 @@
+#pragma once
+#include "system/System.hpp"
+#include "hamiltonian/Hamiltonian.hpp"
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace cpb { namespace cache {
+
+/**
+ Versioned binary file with a built System and its Hamiltonian
+
+ The file starts with a magic string, the `format_version` and the scalar type of the
+ Hamiltonian. It's followed by the arrays of the System (positions, sublattices, the
+ `hoppings` CSR, boundaries, original indices) and the Hamiltonian CSR. Each array is
+ preceded by its size in bytes and its raw data starts at a 64-byte aligned offset, so the
+ file can also be memory-mapped. The Lattice is not stored: it's a part of the key and the caller
+ supplies it on load.
+ */
+constexpr std::uint32_t format_version = 2; ///< files with a different version are ignored
+
+/**
+ Incremental 64-bit FNV-1a hash, used to build the cache key
+
+ It only needs to be stable across processes and machines with the same endianness.
+ All the added bytes are also kept as the full `key()`: different keys may have the same
+ hash, so the `MemoryCache` compares them on a hit.
+ */
+class Hasher {
+public:
+    Hasher& add(void const* data, std::size_t size);
+    /// Prefixed by the size, so that consecutive strings are unambiguous
+    Hasher& add(std::string const& s) { return add(s.size()).add(s.data(), s.size()); }
+    Hasher& add(Cartesian const& v) { return add(v.data(), 3 * sizeof(float)); }
+    Hasher& add(Index3D const& v) { return add(v.data(), 3 * sizeof(int)); }
+    template<class T>
+    Hasher& add(T const& value) { return add(&value, sizeof(T)); }
+
+    std::uint64_t get() const { return hash; }
+    /// Fixed width hexadecimal string, usable as a filename
+    std::string hex() const;
+    /// Everything which was added, in order
+    std::string const& key() const { return bytes; }
+
+private:
+    std::uint64_t hash = 14695981039346656037ull;
+    std::string bytes;
+};
+
+/// Write to a uniquely named temporary file which is then renamed to `filename`:
+/// concurrent readers and writers, e.g. other processes of the same batch job, never
+/// see or produce a partial file
+void save(std::string const& filename, System const& system, Hamiltonian const& hamiltonian);
+
+/// Read the data written by `save()`. Returns false if the file doesn't exist or if it
+/// has a different format version or is truncated, without modifying the outputs.
+/// The file is memory-mapped and each array is copied straight from the mapping into
+/// the storage of the result: the Eigen containers own their memory, so it's the only copy.
+bool load(std::string const& filename, Lattice const& lattice,
+          std::shared_ptr<System>& system, Hamiltonian& hamiltonian);
+
+/**
+ Built systems and Hamiltonians shared by all the models of the process
+
+ E.g. the jobs of a parallel sweep whose variable only affects the post-processing, or which
+ repeat the same disorder seed, build each distinct model only once. The key is the same
+ parameter hash as the cache file name, see `Model::set_memory_cache()`. A hit doesn't copy
+ anything: the models share the immutable system and Hamiltonian matrix, so the KPM
+ `Bounds` cache and `share_matrix` recognize them as well. The least recently used entries
+ are dropped once their memory exceeds the capacity. The models which hold them keep them
+ alive, but they are no longer found by new models.
+ */
+class MemoryCache {
+public:
+    struct Stats {
+        std::size_t hits = 0;
+        std::size_t misses = 0;
+        std::size_t evictions = 0;
+        std::size_t num_entries = 0;
+        std::size_t memory = 0; ///< bytes held by the entries
+        std::size_t capacity = 0;
+    };
+
+    /// The cache of the process
+    static MemoryCache& instance();
+
+    /// Return true and set the outputs if there is an entry with this `key`: the same hash
+    /// and the same full `Hasher::key()`
+    bool find(Hasher const& key, std::shared_ptr<System const>& system, Hamiltonian& hamiltonian);
+    void insert(Hasher const& key, std::shared_ptr<System const> const& system,
+                Hamiltonian const& hamiltonian);
+
+    /// Maximum memory of all the entries in bytes (1 GiB by default), 0 disables the cache
+    void set_capacity(std::size_t bytes);
+    /// Remove all the entries and reset the counters
+    void clear();
+    Stats stats() const;
+
+private:
+    struct Entry {
+        std::uint64_t hash;
+        std::string key; ///< the full `Hasher::key()`
+        std::shared_ptr<System const> system;
+        Hamiltonian hamiltonian;
+        std::size_t bytes;
+    };
+
+    /// Drop the least recently used entries until the memory is within the capacity
+    void evict();
+
+private:
+    mutable std::mutex mutex;
+    std::list<Entry> entries; ///< most recently used first
+    std::unordered_map<std::uint64_t, std::list<Entry>::iterator> index; ///< by hash
+    std::size_t capacity = std::size_t{1} << 30;
+    Stats counters;
+};
+
+}} // namespace cpb::cache
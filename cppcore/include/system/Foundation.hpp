@@ -5,7 +5,9 @@
 #include "numeric/dense.hpp"
 #include "support/cppfuture.hpp"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <vector>
 #include <cstdint>
 
@@ -20,28 +22,61 @@ namespace detail {
     /// Return the lower and upper bounds of the shape in lattice vector coordinates
     std::pair<Index3D, Index3D> find_bounds(Shape const& shape, Lattice const& lattice);
     /// Generate real space coordinates for a block of lattice sites
-    CartesianArray generate_positions(Cartesian origin, Index3D size, Lattice const& lattice);
+    CartesianArray generate_positions(Cartesian origin, Index3D size, Lattice const& lattice,
+                                      int num_threads = 1);
     /// Initialize the neighbor count for each site
-    ArrayX<int16_t> count_neighbors(Foundation const& foundation);
-    /// Reduce this site's neighbor count to zero and inform its neighbors of the change
-    void clear_neighbors(Site& site, ArrayX<int16_t>& neighbor_count, int min_neighbors);
+    ArrayX<int16_t> count_neighbors(Foundation const& foundation, int num_threads = 1);
+    /// Neighbor counts which may be decremented concurrently, `removed_site` marks sites
+    /// which are invalid and must not be counted anymore
+    using AtomicCounts = std::vector<std::atomic<int16_t>>;
+    constexpr int16_t removed_site = -1;
+    /// Remove the (invalid) sites in the `worklist` from the counts of their neighbors.
+    /// The neighbors which drop below `min_neighbors` are invalidated and appended to
+    /// the worklist which is processed until it's empty. Each removal is claimed by
+    /// a single thread, so several threads may share the `counts`.
+    void prune_neighbors(std::vector<Site>& worklist, AtomicCounts& counts, int min_neighbors);
     /// Make an array of sublattice ids for the entire foundation
     ArrayX<sub_id> make_sublattice_ids(Foundation const& foundation);
 } // namespace detail
 
-/// Remove sites which have a neighbor count lower than `min_neighbors`
-void remove_dangling(Foundation& foundation, int min_neighbors);
+/// Remove sites which have a neighbor count lower than `min_neighbors`. The pruning starts
+/// from the invalid sites of `num_threads` chunks of the foundation in parallel.
+void remove_dangling(Foundation& foundation, int min_neighbors, int num_threads = 1);
 
 /**
  The foundation class creates a lattice-vector-aligned set of sites. The number of sites is high
  enough to encompass the given shape. After creation, the foundation can be cut down to the shape.
+
+ The bounding box may be split into tiles of unit cells. In that case only the tiles which
+ have at least one site within the shape are stored, so the memory scales with the size of
+ the final system instead of the volume of the box. Sites in the missing tiles are never valid
+ and they are skipped as neighbors. By default, there is a single tile: the entire box.
  */
 class Foundation {
+public:
+    /// Block of unit cells with contiguous storage (sublattice-major, same as the entire box)
+    struct Tile {
+        Index3D origin; ///< index of the first unit cell in the foundation
+        Index3D size; ///< number of unit cells in each lattice vector direction
+        int offset; ///< flat index of the first site
+    };
+
+private:
     Lattice const& lattice;
     std::pair<Index3D, Index3D> bounds; ///< in lattice vector coordinates
     Index3D size; ///< number of unit cells in each lattice vector direction
     int nsub; ///< number of sites in a unit cell
-    int num_sites; ///< total number of sites: product of all sizes (3D and sublattice)
+    int num_sites; ///< total number of stored sites (3D and sublattice)
+
+    Index3D tile_size; ///< only the tiles at the upper edges of the box may be smaller
+    Index3D num_tiles; ///< number of tiles in each lattice vector direction
+    std::vector<Tile> tiles; ///< only the stored tiles, ordered by `offset`
+    ArrayXi tile_ids; ///< position of each tile in `tiles` or -1 if it's not stored
+
+    /// Flat index distance of each [sublattice][hopping] neighbor within a full size tile
+    std::vector<std::vector<int>> neighbor_offsets;
+    Index3D reach_below; ///< largest negative relative index of any hopping (as a distance)
+    Index3D reach_above; ///< largest positive relative index of any hopping
 
     CartesianArray positions; ///< real space coordinates of lattice sites
     ArrayX<bool> is_valid; ///< indicates if the site should be included in the final system
@@ -58,13 +93,19 @@ private:
     using NonConstSlice = Slice<false>;
 
 public:
-    Foundation(Lattice const& lattice, Primitive const& shape);
-    Foundation(Lattice const& lattice, Shape const& shape);
+    /// The site positions are generated in parallel using `num_threads`
+    Foundation(Lattice const& lattice, Primitive const& shape, int num_threads = 1);
+    /// Only keep tiles of `tile_size` unit cells which intersect the shape, 0 means no tiling
+    Foundation(Lattice const& lattice, Shape const& shape, int num_threads = 1,
+               int tile_size = 0);
 
     ConstIterator begin() const;
     ConstIterator end() const;
     NonConstIterator begin();
     NonConstIterator end();
+    /// Iterator pointing to the site with the given flat index: `[begin_at(i), begin_at(j))`
+    /// is a contiguous block of sites which can be processed independently of the others
+    ConstIterator begin_at(int idx) const;
 
     ConstSlice operator[](SliceIndex3D const& index) const;
     NonConstSlice operator[](SliceIndex3D const& index);
@@ -74,11 +115,34 @@ public:
     Index3D const& get_size() const { return size; }
     int get_num_sublattices() const { return nsub; }
     int get_num_sites() const { return num_sites; }
+    std::vector<Tile> const& get_tiles() const { return tiles; }
 
     CartesianArray const& get_positions() const { return positions; }
     CartesianArray& get_positions() { return positions; }
     ArrayX<bool> const& get_states() const { return is_valid; }
     ArrayX<bool>& get_states() { return is_valid; }
+
+private:
+    /// Split the box into a grid of tiles: all of them are stored initially
+    void make_tiles(Index3D max_tile_size);
+    /// Evaluate the shape tile by tile and only store the tiles which intersect it
+    void fill_tiles(Shape const& shape, int num_threads);
+    /// Precompute `neighbor_offsets` and the reach of the hoppings for the `tile_size`
+    void make_neighbor_offsets();
+
+    /// Are all the neighbors of the unit cell at `index` within the same full size tile?
+    /// Then `neighbor_offsets` apply directly and no bounds checks are needed.
+    bool is_interior(Index3D const& index) const {
+        auto const single_tile = num_tiles.prod() == 1;
+        for (auto i = 0; i < 3; ++i) {
+            auto const local = single_tile ? index[i] : index[i] % tile_size[i];
+            if (local < reach_below[i] || local >= tile_size[i] - reach_above[i]
+                || index[i] - local + tile_size[i] > size[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
 };
 
 /**
@@ -91,12 +155,28 @@ protected:
     Foundation* foundation; ///< the site's parent foundation
     Index3D index; ///< unit cell spatial index
     int sublattice; ///< sublattice index
-    int idx; ///< flat index for array addressing
+    int idx; ///< flat index for array addressing, -1 if the site is in a tile which isn't stored
 
     /// Recalculate flat `idx` from spatial `index` and `sublattice`
     void reset_idx() {
-        auto const& size = foundation->size;
-        idx = ((sublattice * size[2] + index[2]) * size[1] + index[1]) * size[0] + index[0];
+        auto const& f = *foundation;
+        if (f.num_tiles.prod() == 1 && !f.tiles.empty()) { // single tile: the entire box
+            auto const& size = f.size;
+            idx = ((sublattice * size[2] + index[2]) * size[1] + index[1]) * size[0] + index[0];
+            return;
+        }
+
+        Index3D const t = (index.array() / f.tile_size.array()).matrix();
+        auto const tile_id = f.tile_ids[(t[2] * f.num_tiles[1] + t[1]) * f.num_tiles[0] + t[0]];
+        if (tile_id < 0) {
+            idx = -1;
+            return;
+        }
+
+        auto const& tile = f.tiles[tile_id];
+        Index3D const i = index - tile.origin;
+        idx = tile.offset + ((sublattice * tile.size[2] + i[2]) * tile.size[1] + i[1])
+                            * tile.size[0] + i[0];
     }
 
 public:
@@ -114,20 +194,38 @@ public:
 
     Cartesian get_position() const { return foundation->positions[idx]; }
 
-    bool is_valid() const { return foundation->is_valid[idx]; }
-    void set_valid(bool state) {foundation->is_valid[idx] = state; }
+    bool is_valid() const { return idx >= 0 && foundation->is_valid[idx]; }
+    void set_valid(bool state) {
+        if (idx >= 0) { foundation->is_valid[idx] = state; } // missing tiles: never valid
+    }
 
     Site shifted(Index3D shift) const { return {foundation, index + shift, sublattice}; }
 
     /// Loop over all neighbours of this site
     template<class Fn>
     void for_each_neighbour(Fn lambda) const  {
-        for (auto const& hopping : foundation->lattice[sublattice].hoppings) {
+        auto const& hoppings = foundation->lattice[sublattice].hoppings;
+        if (idx >= 0 && foundation->is_interior(index)) {
+            // Fast path for the vast majority of sites: the neighbors can't be out of bounds
+            auto const& offsets = foundation->neighbor_offsets[sublattice];
+            for (auto n = std::size_t{0}; n < hoppings.size(); ++n) {
+                auto const& hopping = hoppings[n];
+                lambda(Site(foundation, index + hopping.relative_index, hopping.to_sublattice,
+                            idx + offsets[n]), hopping);
+            }
+            return;
+        }
+
+        for (auto const& hopping : hoppings) {
             Array3i const neighbor_index = (index + hopping.relative_index).array();
             if (any_of(neighbor_index < 0) || any_of(neighbor_index >= foundation->size.array()))
                 continue; // out of bounds
 
-            lambda(Site(foundation, neighbor_index, hopping.to_sublattice), hopping);
+            auto const neighbor = Site(foundation, neighbor_index, hopping.to_sublattice);
+            if (neighbor.idx < 0)
+                continue; // the tile is not stored
+
+            lambda(neighbor, hopping);
         }
     }
 
@@ -159,27 +257,56 @@ class Foundation::Iterator
     using Ref = std14::conditional_t<is_const, Site const&, Site&>;
 
 public:
-    Iterator(Foundation* foundation, int idx) : Site(foundation, {0, 0, 0}, 0, idx) {}
+    Iterator(Foundation* foundation, int idx) : Site(foundation, {0, 0, 0}, 0, idx) {
+        auto const& tiles = foundation->tiles;
+        if (idx >= foundation->num_sites) {
+            tile = static_cast<int>(tiles.size());
+            return;
+        }
+
+        // Recover the spatial index and sublattice from the flat `idx` (inverse of `reset_idx`)
+        auto const it = std::upper_bound(tiles.begin(), tiles.end(), idx,
+                                         [](int i, Tile const& t) { return i < t.offset; });
+        tile = static_cast<int>(it - tiles.begin()) - 1;
+        auto const& size = tiles[tile].size;
+        auto n = idx - tiles[tile].offset;
+        index[0] = n % size[0]; n /= size[0];
+        index[1] = n % size[1]; n /= size[1];
+        index[2] = n % size[2]; n /= size[2];
+        index += tiles[tile].origin;
+        sublattice = n;
+    }
 
     Ref operator*() { return *this; }
 
     Iterator& operator++() {
+        auto const& t = foundation->tiles[tile];
         ++idx;
         ++index[0];
-        if (index[0] == foundation->size[0]) {
-            index[0] = 0;
+        if (index[0] == t.origin[0] + t.size[0]) {
+            index[0] = t.origin[0];
             ++index[1];
-            if (index[1] == foundation->size[1]) {
-                index[1] = 0;
+            if (index[1] == t.origin[1] + t.size[1]) {
+                index[1] = t.origin[1];
                 ++index[2];
-                if (index[2] == foundation->size[2]) {
-                    index[2] = 0;
+                if (index[2] == t.origin[2] + t.size[2]) {
+                    index[2] = t.origin[2];
                     ++sublattice;
+                    if (sublattice == foundation->nsub) { // continue with the next tile
+                        ++tile;
+                        if (tile < static_cast<int>(foundation->tiles.size())) {
+                            index = foundation->tiles[tile].origin;
+                            sublattice = 0;
+                        }
+                    }
                 }
             }
         }
         return *this;
     }
+
+private:
+    int tile = 0; ///< position in `Foundation::tiles`
 };
 
 template<bool is_const>
@@ -277,6 +404,10 @@ inline Foundation::NonConstIterator Foundation::end() {
     return {this, num_sites};
 }
 
+inline Foundation::ConstIterator Foundation::begin_at(int idx) const {
+    return {const_cast<Foundation*>(this), idx};
+}
+
 inline Foundation::ConstSlice Foundation::operator[](SliceIndex3D const& index) const {
     return {const_cast<Foundation*>(this), index};
 }
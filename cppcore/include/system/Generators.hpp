@@ -24,9 +24,11 @@ public:
     std::string name; ///< friendly hopping identifier - will be added to lattice registry
     std::complex<double> energy; ///< hopping energy - also added to lattice registry
     Function make; ///< function which will generate the new hopping index pairs
+    bool is_thread_safe = false; ///< `make` may be called concurrently (not for Python functions)
 
-    HoppingGenerator(std::string const& name, std::complex<double> energy, Function const& make)
-        : name(name), energy(energy), make(make) {}
+    HoppingGenerator(std::string const& name, std::complex<double> energy, Function const& make,
+                     bool is_thread_safe = false)
+        : name(name), energy(energy), make(make), is_thread_safe(is_thread_safe) {}
 
     explicit operator bool() const { return static_cast<bool>(make); }
 };
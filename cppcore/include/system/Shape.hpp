@@ -38,6 +38,12 @@ public:
     Vertices vertices; ///< bounding vertices which define the initial volume
     Contains contains; ///< return `true` for `positions` located within the shape
     Cartesian lattice_offset = {0, 0, 0}; ///< set a specific lattice offset, see Lattice class
+    /// `contains` may be called concurrently for different parts of the positions,
+    /// see `detail::contains()`. False for user-defined (e.g. Python) functions.
+    bool is_thread_safe = false;
+    /// `contains` is fully determined by the `vertices`, so the shape can be identified
+    /// by them, see `Model::parameter_hash()`. False for user-defined functions.
+    bool is_vertex_defined = false;
 };
 
 /**
@@ -70,14 +76,38 @@ namespace detail {
     // Is the angle formed by three points acute? The vertex is `b`.
     ArrayX<bool> is_acute_angle(Cartesian a, Cartesian b, CartesianArray const& c);
 
-    /// Function object which determines if a point is within a polygon
+    /// Evaluate `shape.contains(positions)` on `num_threads` chunks of the positions
+    /// if the shape is thread-safe, otherwise with a single call on this thread
+    ArrayX<bool> contains(Shape const& shape, CartesianArray const& positions,
+                          int num_threads = 1);
+
+    /**
+     Function object which determines if a point is within a polygon
+
+     The sides are bucketed into horizontal bands: the ray cast from a point only needs
+     to be tested against the sides which overlap the point's band. For polygons with many
+     vertices, this is much cheaper than testing every side for every point. The inner loop
+     over the sides of a band is branchless over contiguous arrays so it can be vectorized.
+     */
     class WithinPolygon {
     public:
         WithinPolygon(Shape::Vertices const& vertices);
         ArrayX<bool> operator()(CartesianArray const& positions) const;
 
     private:
-        ArrayX<float> x, y;
+        /// Index of the band which contains `y`, clamped to the valid range
+        int band(float y) const;
+
+    private:
+        static constexpr auto max_bands = 1 << 16;
+
+        float y_min = 0, y_max = 0; ///< vertical extent of the polygon
+        float band_scale = 0; ///< number of bands per unit of `y`
+        int num_bands = 0;
+        std::vector<int> band_start; ///< the sides of band `b` are `[band_start[b], [b + 1])`
+        /// Sides (excluding horizontal ones) grouped by band: `y1` and `x1` of the first
+        /// vertex, `y2` of the second vertex and the inverse slope `k = dx/dy`
+        ArrayX<float> side_x1, side_y1, side_y2, side_k;
     };
 } // namespace detail
 
@@ -0,0 +1,54 @@
+#pragma once
+#include "Lattice.hpp"
+#include "numeric/dense.hpp"
+
+#include <vector>
+
+namespace cpb {
+
+/**
+ Uniform grid of the site positions for nearest neighbour and radius queries
+
+ The bounding box of the sites is split into cubic cells which hold about two sites each.
+ A lattice fills the grid evenly, so a query only needs to look at a few cells around the
+ target instead of scanning the whole system. Flat directions, e.g. z for a 2D system,
+ have a single layer of cells.
+
+ The positions and sublattices are copied in cell order (CSR-like: `cell_start` points
+ into `sites`), which keeps each cell contiguous in memory: 17 bytes per site in total.
+ */
+class SpatialIndex {
+public:
+    SpatialIndex() = default;
+    SpatialIndex(CartesianArray const& positions, ArrayX<sub_id> const& sublattices);
+
+    /// Index of the site nearest to `target` or -1 if there are none. If `sublattice` isn't
+    /// negative, only the sites of that sublattice are considered. Equal distances resolve
+    /// to the lowest index, the same as a linear scan.
+    int nearest(Cartesian target, sub_id sublattice = -1) const;
+    /// Indices of all the sites within `radius` of `target` in ascending order, optionally
+    /// only for the given sublattice
+    std::vector<int> within(Cartesian target, float radius, sub_id sublattice = -1) const;
+
+    int num_sites() const { return static_cast<int>(sites.size()); }
+    Index3D const& get_size() const { return size; }
+
+private:
+    Index3D cell_of(Cartesian position) const;
+    int flat_cell(int a, int b, int c) const { return (c * size[1] + b) * size[0] + a; }
+
+    /// Check the sites in cell (a, b, c) against the current best distance and index
+    void nearest_in_cell(int a, int b, int c, Cartesian target, sub_id sublattice,
+                         float& best_distance, int& best_index) const;
+
+private:
+    Cartesian origin = Cartesian::Zero(); ///< lower corner of the bounding box
+    float cell_width = 1; ///< the same in every direction
+    Index3D size = Index3D::Ones(); ///< number of cells in each direction
+    std::vector<int> cell_start = {0, 0}; ///< start of each cell in the arrays below
+    std::vector<int> sites; ///< the original index of each site
+    CartesianArray positions;
+    ArrayX<sub_id> sublattices;
+};
+
+} // namespace cpb
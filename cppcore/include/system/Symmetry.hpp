@@ -38,6 +38,7 @@ public:
     void apply(Foundation& foundation) const;
 
     explicit operator bool() const { return enabled_directions != Vector3b{false, false, false}; }
+    Cartesian const& get_length() const { return length; }
 
 private:
     Cartesian length;
@@ -1,6 +1,7 @@
 #pragma once
 #include "Lattice.hpp"
 #include "system/Generators.hpp"
+#include "system/SpatialIndex.hpp"
 
 #include "numeric/dense.hpp"
 #include "numeric/sparse.hpp"
@@ -14,27 +15,108 @@ class Foundation;
 class HamiltonianIndices;
 class TranslationalSymmetry;
 
+/**
+ The order of the lattice sites in a `System`, i.e. of the rows of the Hamiltonian matrix
+
+ The default follows the foundation: sublattice-major (within each tile), so the neighbours
+ of a site may be a whole sublattice plane apart. The other orders keep the neighbours close
+ together, which improves the cache reuse of every sparse matrix-vector multiplication.
+ */
+enum class SiteOrder {
+    Foundation, ///< as built: sublattice-major
+    UnitCell, ///< the sites of each unit cell are consecutive
+    RCM, ///< reverse Cuthill-McKee: minimizes the bandwidth of the hopping matrix
+    Morton ///< Z-order space-filling curve of the site positions
+};
+
+/**
+ Site positions of a perfect crystal stored as indices
+
+ The real space position of a site is already given by its unit cell and its (unique, not
+ alias) sublattice. Both fit into a single 32-bit flat index in the bounding box of the
+ foundation, `((sublattice * size[2] + c) * size[1] + b) * size[0] + a`, which replaces the
+ three floats of `System::positions`: 8 bytes less per site. The positions are computed on
+ the fly when needed, e.g. one chunk of hoppings at a time for the modifier buffers.
+
+ This only applies as long as the positions follow the lattice, i.e. without position
+ modifiers, and the box must have fewer than 2^31 sites.
+ */
+struct CompactPositions {
+    Cartesian origin; ///< position of the first unit cell of the box
+    Index3D size; ///< number of unit cells of the box in each lattice vector direction
+    ArrayXi cells; ///< flat index of each site in the box, empty if not used
+
+    bool empty() const { return cells.size() == 0; }
+
+    Cartesian position(int i, Lattice const& lattice) const {
+        auto idx = cells[i];
+        auto const a = idx % size[0];
+        idx /= size[0];
+        auto const b = idx % size[1];
+        idx /= size[1];
+        auto const c = idx % size[2];
+        auto const sublattice = idx / size[2];
+
+        // Same order of operations as `detail::generate_positions()`
+        Cartesian p = origin + lattice[sublattice].position;
+        if (c != 0) { p += static_cast<float>(c) * lattice.vector(2); }
+        if (b != 0) { p += static_cast<float>(b) * lattice.vector(1); }
+        if (a != 0) { p += static_cast<float>(a) * lattice.vector(0); }
+        return p;
+    }
+};
+
 /**
  Stores the positions, sublattice and hopping IDs for all lattice sites.
  */
 struct System {
     struct Boundary;
+    /// Boundaries in the foundation order, i.e. before any `SiteOrder`. They only depend on
+    /// the valid sites of the foundation and the symmetry, not on the positions.
+    using BoundaryCache = std::shared_ptr<std::vector<Boundary> const>;
 
     Lattice lattice;
-    CartesianArray positions;
+    CartesianArray positions; ///< empty if the system has `compact` positions instead
     ArrayX<sub_id> sublattices;
     SparseMatrixX<hop_id> hoppings;
     std::vector<Boundary> boundaries;
     bool has_unbalanced_hoppings = false; ///< some sites have a lot more hopping than others
+    /// The index of each site in the default `SiteOrder::Foundation`, empty if not reordered
+    ArrayXi original_indices;
+    /// Unit cell and sublattice indices which may replace `positions`
+    CompactPositions compact;
+    /// The positions before the position modifiers, only kept for `Model::set_keep_topology()`
+    CartesianArray lattice_positions;
+    /// Built on the first query, see `spatial_index()`
+    mutable std::shared_ptr<SpatialIndex const> cached_spatial_index;
 
     System(Lattice const& lattice) : lattice(lattice) {}
+    /// If the `boundary_cache` is given, its boundaries are used instead of finding them
+    /// again. If it's empty, it receives the new boundaries.
     System(Foundation const& foundation, HamiltonianIndices const& hamiltonian_indices,
-           TranslationalSymmetry const& symmetry, HoppingGenerators const& hopping_generators);
+           TranslationalSymmetry const& symmetry, HoppingGenerators const& hopping_generators,
+           int num_threads = 1, SiteOrder order = SiteOrder::Foundation,
+           bool compact_positions = false, BoundaryCache* boundary_cache = nullptr);
 
-    int num_sites() const { return positions.size(); }
+    int num_sites() const { return static_cast<int>(sublattices.size()); }
 
+    /// Position of site `i`, also with `compact` positions
+    Cartesian position(int i) const {
+        return compact.empty() ? positions[i] : compact.position(i, lattice);
+    }
+    /// Return `positions` or, if they are `compact`, compute all of them into `buffer`
+    CartesianArray const& expanded_positions(CartesianArray& buffer) const;
+
+    /// Grid of the site positions for the queries below, built on first use (thread-safe)
+    SpatialIndex const& spatial_index() const;
     /// Find the index of the site nearest to the given position. Optional: filter by sublattice.
     int find_nearest(Cartesian position, std::string const& sublattice = "") const;
+    /// Batched version of the above, the queries are split between `num_threads`
+    ArrayXi find_nearest(CartesianArray const& targets, std::string const& sublattice = "",
+                         int num_threads = 1) const;
+    /// Indices of all the sites within `radius` of `position` in ascending order
+    ArrayXi find_within(Cartesian position, float radius,
+                        std::string const& sublattice = "") const;
 };
 
 /**
@@ -46,12 +128,40 @@ struct System::Boundary {
 };
 
 namespace detail {
+    /// The foundation is split into `num_threads` contiguous blocks of sites which are
+    /// processed in parallel and then stitched together in the final hopping matrix
     void populate_system(System& system, Foundation const& foundation,
-                         HamiltonianIndices const& indices);
+                         HamiltonianIndices const& indices, int num_threads = 1);
+    /// The boundary rows of all the translations are split between `num_threads`
     void populate_boundaries(System& system, Foundation const& foundation,
                              HamiltonianIndices const& indices,
-                             TranslationalSymmetry const& symmetry);
-    void add_extra_hoppings(System& system, HoppingGenerator const& gen);
+                             TranslationalSymmetry const& symmetry, int num_threads = 1);
+    /// The pairs of all the `generators` are merged into the hopping matrix in a single pass,
+    /// the rows are split between `num_threads`. Thread-safe generators also run concurrently.
+    void add_extra_hoppings(System& system, HoppingGenerators const& generators,
+                            int num_threads = 1);
+    /// Do the row lengths (including the lower triangle) vary enough to call them unbalanced?
+    bool is_unbalanced(SparseMatrixX<hop_id> const& hoppings);
+
+    /// Return the permutation for the given `order`: the current index of each site
+    ArrayXi site_order(System const& system, Foundation const& foundation,
+                       HamiltonianIndices const& indices, SiteOrder order);
+    /// Move the sites into the new `order` (see `site_order()`) and record it in
+    /// `System::original_indices`. Each hopping keeps its (i, j) direction.
+    void reorder_sites(System& system, ArrayXi const& order);
+    /// Return the new index of each site after removing the given `indices`, -1 for the
+    /// removed ones. With `min_neighbors > 0`, the sites which lose a neighbor and are left
+    /// with fewer than `min_neighbors` are also removed, repeatedly (like the dangling sites
+    /// of a `SiteStateModifier`). Only the neighbors of removed sites are candidates.
+    ArrayXi removal_index(System const& system, std::vector<int> const& indices,
+                          int min_neighbors = 0);
+    /// Remove the sites with `new_index < 0` (see `removal_index()`) and renumber the rest in
+    /// the same order. `System::original_indices` keeps referring to the sites as built.
+    void remove_sites(System& system, ArrayXi const& new_index);
+    /// Replace `System::positions` with `CompactPositions`, returns false (and leaves the
+    /// system unchanged) if the foundation box is too large for 32-bit flat indices
+    bool compact_positions(System& system, Foundation const& foundation,
+                           HamiltonianIndices const& indices);
 } // namespace detail
 
 /**
@@ -0,0 +1,64 @@
+#pragma once
+#include <vector>
+
+namespace cpb {
+
+/**
+ Pin the calling thread to a single CPU for the lifetime of this object
+
+ The CPU is the `n`-th one (modulo their number) of the CPUs which the process is allowed
+ to run on, so pinning stays within e.g. a `taskset` or a batch scheduler's CPU set. That's
+ the CPU set of the main thread: the one of the calling thread may be a single CPU which it
+ inherited from a pinned thread, see `reset_affinity()`.
+ The previous affinity is restored by the destructor because the threads of the shared
+ pools are reused for other work afterwards. A negative `n` doesn't pin anything.
+ Pinning is only supported on Linux, elsewhere this does nothing.
+ */
+class ScopedAffinity {
+public:
+    explicit ScopedAffinity(int n);
+    ~ScopedAffinity();
+
+    ScopedAffinity(ScopedAffinity const&) = delete;
+    ScopedAffinity& operator=(ScopedAffinity const&) = delete;
+
+    bool is_pinned() const { return !previous.empty(); }
+
+private:
+    std::vector<unsigned char> previous; ///< raw copy of the previous CPU set, if pinned
+};
+
+/**
+ The CPUs for the `count` pinned threads of one pool, e.g. the `n`-th thread pins itself to
+ `ScopedAffinity(reservation[n])`. Concurrent reservations get different CPUs as long as
+ there are enough of them: each one starts at the CPUs which are the least reserved by the
+ others. The CPUs are released by the destructor.
+ */
+class CpuReservation {
+public:
+    explicit CpuReservation(int count);
+    ~CpuReservation();
+
+    CpuReservation(CpuReservation const&) = delete;
+    CpuReservation& operator=(CpuReservation const&) = delete;
+
+    int operator[](int n) const { return first + n; }
+
+private:
+    int count;
+    int first = 0;
+    int num_cpus; ///< of the process at the time of the reservation
+};
+
+/// Number of CPUs which the process is allowed to run on, 1 where it's unknown
+int num_process_cpus();
+
+/// Let the calling thread run on all the CPUs of the process again. A new thread inherits
+/// the CPU set of the thread which creates it, which may have been pinned to a single CPU.
+void reset_affinity();
+
+/// The NUMA node (socket) of the CPU which the calling thread is currently running on.
+/// It's stable for pinned threads, see `ScopedAffinity`. Always 0 where it's unknown.
+int current_numa_node();
+
+} // namespace cpb
@@ -0,0 +1,133 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <vector>
+#include <cstddef>
+#include <functional>
+#include <utility>
+
+namespace cpb {
+
+namespace detail {
+    /// Ask the OS to back the given memory with huge pages, no-op where it's not supported
+    void advise_huge_pages(void* data, std::size_t bytes);
+    /// Remember the `clear` function of an arena of the calling thread, see `release_arenas()`
+    void register_arena(std::function<void()> clear);
+}
+
+/// Free the matrices cached by all the arenas of the calling thread, e.g. when the thread
+/// goes idle. The threads of `TaskPool::shared()` live as long as the process, so without
+/// this, each of them would hold on to the biggest matrices it had ever used.
+void release_arenas();
+
+/**
+ Per-thread cache of dense Eigen vectors or matrices which are reused between calculations
+
+ `take()` returns an uninitialized matrix of the requested shape, recycling the memory of
+ one which was given back earlier on the same thread. The worker threads of `ThreadPool`
+ and `parallel_for` live for the whole sweep so, e.g. the KPM vectors are allocated once
+ per thread instead of once per job. There is no locking since it's never shared between
+ threads. New allocations are aligned by Eigen and advised to use huge pages.
+
+ The cache holds at most `max_cached` matrices and it's emptied by `release_arenas()`:
+ the workers of `TaskPool` call it once they run out of tasks.
+ */
+template<class Matrix>
+class Arena {
+    using Index = typename Matrix::Index;
+
+public:
+    /// The number of recycled matrices which are kept per thread, the oldest are freed first
+    static constexpr std::size_t max_cached = 4;
+
+    /// The arena of the calling thread
+    static Arena& local() {
+        thread_local Arena arena;
+        thread_local bool const is_registered = (detail::register_arena([] { local().clear(); }),
+                                                 true);
+        (void)is_registered;
+        return arena;
+    }
+
+    Matrix take(Index rows, Index cols = 1) {
+        for (auto it = cache.rbegin(); it != cache.rend(); ++it) {
+            if (it->rows() == rows && it->cols() == cols) {
+                auto m = std::move(*it);
+                cache.erase(std::next(it).base());
+                return m;
+            }
+        }
+
+        return allocate(rows, cols);
+    }
+
+    /// Make sure that at least `n` matrices of the given shape are cached. The memory of
+    /// the new ones is initialized by `first_touch(matrix)`: the OS places each page on the
+    /// NUMA node of the thread which writes to it first, see `calc_moments`.
+    template<class F>
+    void reserve(Index rows, Index cols, std::size_t n, F first_touch) {
+        assert(n <= max_cached);
+        auto const is_match = [&](Matrix const& m) { return m.rows() == rows && m.cols() == cols; };
+        while (static_cast<std::size_t>(std::count_if(cache.begin(), cache.end(), is_match)) < n) {
+            auto m = allocate(rows, cols);
+            first_touch(m);
+            give(std::move(m));
+        }
+    }
+
+    void give(Matrix&& m) {
+        if (m.size() == 0) {
+            return;
+        }
+        if (cache.size() >= max_cached) {
+            cache.erase(cache.begin());
+        }
+        cache.push_back(std::move(m));
+    }
+
+    std::size_t size() const { return cache.size(); }
+    void clear() { cache.clear(); }
+
+private:
+    static Matrix allocate(Index rows, Index cols) {
+        auto m = Matrix();
+        m.resize(rows, cols);
+        detail::advise_huge_pages(m.data(), static_cast<std::size_t>(m.size())
+                                            * sizeof(typename Matrix::Scalar));
+        return m;
+    }
+
+private:
+    std::vector<Matrix> cache;
+};
+
+template<class Matrix>
+constexpr std::size_t Arena<Matrix>::max_cached;
+
+/**
+ Gives the two matrices back to the thread's `Arena` at the end of the scope
+
+ Used for the pair of KPM vectors: they are swapped every iteration, so both need to go back.
+ */
+template<class Matrix>
+class ArenaReturn {
+public:
+    ArenaReturn(Matrix& a, Matrix& b) : a(&a), b(&b) {}
+    ArenaReturn(ArenaReturn&& other) : a(other.a), b(other.b) { other.a = other.b = nullptr; }
+    ArenaReturn(ArenaReturn const&) = delete;
+    ArenaReturn& operator=(ArenaReturn const&) = delete;
+
+    ~ArenaReturn() {
+        if (a) { Arena<Matrix>::local().give(std::move(*a)); }
+        if (b) { Arena<Matrix>::local().give(std::move(*b)); }
+    }
+
+private:
+    Matrix* a;
+    Matrix* b;
+};
+
+template<class Matrix>
+ArenaReturn<Matrix> return_to_arena(Matrix& a, Matrix& b) { return {a, b}; }
+
+} // namespace cpb
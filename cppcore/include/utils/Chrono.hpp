@@ -21,6 +21,12 @@ public:
         return *this;
     }
 
+    /// Like `toc()` but add the time since the last `tic()` to the previous total
+    Chrono& toc_add() {
+        elapsed += std::chrono::high_resolution_clock::now() - tic_time;
+        return *this;
+    }
+
     template<class Fn>
     Chrono& timeit(Fn lambda) {
         tic(); lambda(); toc();
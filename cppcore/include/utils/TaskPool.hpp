@@ -0,0 +1,65 @@
+#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+
+namespace cpb {
+
+/**
+ Pool of threads which run independent tasks in submission order
+
+ Unlike `ThreadPool`, which splits a single job between all of its threads and waits for
+ it, tasks are queued and `submit()` returns immediately. The pool may be shared by any
+ number of producers. The remaining tasks are still executed when the pool is destroyed.
+
+ The process-wide `shared()` pool keeps its threads for the lifetime of the process. It's
+ used by `parallel_for` and it also provides the worker threads of every `ThreadPool`, so
+ repeated parallel calls don't create any new threads once the pool is large enough. It
+ grows up to a small multiple of the number of hardware threads. A forked child process
+ gets a new shared pool since it doesn't inherit the threads.
+ */
+class TaskPool {
+public:
+    /// `start()` may add threads up to `max_threads`, 0 means no limit
+    explicit TaskPool(int num_threads, int max_threads = 0);
+    ~TaskPool();
+
+    TaskPool(TaskPool const&) = delete;
+    TaskPool& operator=(TaskPool const&) = delete;
+
+    int size() const { return static_cast<int>(workers.size()); }
+
+    /// Queue a `task` which will run on one of the worker threads. It must not throw:
+    /// e.g. a `std::packaged_task` passes any exception on to its future.
+    void submit(std::function<void()> task);
+    /// Start all the `tasks` right away: threads are added if there aren't enough idle ones.
+    /// Unlike `submit()`, this is safe for tasks which wait on each other, e.g. a producer
+    /// and its consumers, or long-running worker loops. Beyond `max_threads`, the remaining
+    /// tasks are queued: they must still make progress if they're started later, in order.
+    void start(std::vector<std::function<void()>> tasks);
+    /// Number of tasks which were submitted but haven't started yet
+    int num_queued() const;
+
+    /// The process-wide pool: it starts with a single thread and grows on demand
+    static TaskPool& shared();
+    /// Maximum size of the `shared()` pool: 4 threads per hardware thread, at least 16
+    static int max_shared_threads();
+
+private:
+    void work();
+
+private:
+    std::vector<std::thread> workers;
+    int max_threads; ///< 0 means no limit
+
+    mutable std::mutex mutex;
+    std::condition_variable cv; ///< notifies workers about new tasks
+    std::deque<std::function<void()>> queue;
+    int num_busy = 0; ///< threads which are currently running a task
+    bool is_stopping = false;
+};
+
+} // namespace cpb
@@ -0,0 +1,97 @@
+#pragma once
+#include "utils/Affinity.hpp"
+
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+namespace cpb {
+
+/**
+ Persistent pool of threads for fork-join parallelism
+
+ The worker threads are reserved once and reused for every `run` or `parallel_for` call.
+ The calling thread also participates in the work (as thread id 0). This keeps the cost
+ of a fork-join low enough that it can be done once per KPM iteration, i.e. around each
+ sparse matrix-vector multiplication.
+
+ The workers are borrowed from `TaskPool::shared()` for the lifetime of this pool, so
+ creating a new pool (e.g. for each job of a parallel sweep) doesn't create new threads.
+ With `pin_threads`, worker `id` is pinned to a CPU for as long as it belongs to this pool,
+ which keeps each chunk of `parallel_for` on the same core, see `ScopedAffinity`. The CPUs
+ are reserved for the pool, so the pinned threads of concurrent pools don't share them.
+
+ The shared pool has a limited size, so a worker may still be queued there when a task is
+ run, e.g. if all the threads are busy with the jobs of a parallel sweep. The calling thread
+ then does the share of that worker itself instead of waiting for it.
+ */
+class ThreadPool {
+public:
+    explicit ThreadPool(int num_threads, bool pin_threads = false);
+    ~ThreadPool();
+
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    /// Total number of threads, including the calling thread
+    int size() const { return num_threads; }
+
+    /// Call `fn(thread_id)` once on each thread and wait for all of them to finish.
+    /// If any of the calls throw, the first exception is rethrown after all of them are done.
+    void run(std::function<void(int thread_id)> const& fn);
+
+    /// Split [start, end) into contiguous chunks, one per thread, and call
+    /// `fn(thread_id, chunk_start, chunk_end)`. A thread id always gets the same
+    /// part of the range for the same arguments which keeps the data close to it.
+    template<class Fn>
+    void parallel_for(int start, int end, Fn fn) {
+        auto const size = std::int64_t{end - start};
+        if (num_threads == 1 || size < min_chunk_size * num_threads) {
+            fn(0, start, end);
+            return;
+        }
+
+        run([&](int id) {
+            auto const chunk_start = start + static_cast<int>(size * id / num_threads);
+            auto const chunk_end = start + static_cast<int>(size * (id + 1) / num_threads);
+            fn(id, chunk_start, chunk_end);
+        });
+    }
+
+private:
+    /// Shared with the workers: one which is still queued in the `TaskPool` when this pool
+    /// is destroyed may start later, but it finds the pool stopped and returns right away
+    struct State {
+        std::mutex mutex;
+        std::condition_variable start_cv; ///< notifies workers about a new task
+        std::condition_variable done_cv; ///< notifies the calling thread that workers are done
+
+        std::function<void(int)> const* task = nullptr;
+        std::exception_ptr error; ///< the first exception thrown by the current task
+        unsigned generation = 0; ///< incremented for each new task
+        /// The last generation of the task which was run for each thread id, by its worker
+        /// or by the calling thread (if the worker hadn't started yet)
+        std::vector<unsigned> claimed;
+        int num_pending = 0; ///< number of thread ids which haven't finished the current task
+        int num_running = 0; ///< workers which started and haven't returned to the shared pool
+        bool is_stopping = false;
+    };
+
+    /// Pinned to `ScopedAffinity(cpu)` unless `cpu` is negative
+    static void work(std::shared_ptr<State> const& state, int thread_id, int cpu);
+    /// Call `fn(thread_id)` and keep the first exception in `state.error`
+    static void call(State& state, std::function<void(int)> const& fn, int thread_id);
+
+private:
+    static constexpr auto min_chunk_size = 1024; ///< smaller ranges are not worth splitting
+
+    int num_threads;
+    std::unique_ptr<CpuReservation> cpus; ///< only with `pin_threads`
+    std::shared_ptr<State> state;
+};
+
+} // namespace cpb
@@ -0,0 +1,82 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace cpb { namespace trace {
+
+/**
+ A completed span: a named interval on one thread
+
+ The times are in microseconds since the trace was enabled or cleared. Spans on the same
+ thread are properly nested and `depth` is the number of enclosing spans.
+ */
+struct Event {
+    char const* name;
+    std::int64_t start;
+    std::int64_t duration;
+    int thread; ///< small sequential id, not the OS thread id
+    int depth;
+};
+
+namespace detail {
+    extern std::atomic<bool> is_enabled;
+}
+
+/// Start (or stop) recording spans. Recording is off by default.
+void enable(bool on = true);
+inline bool is_enabled() { return detail::is_enabled.load(std::memory_order_relaxed); }
+/// Remove all recorded events and restart the clock
+void clear();
+/// At most this many events are kept, new ones are dropped after that (default 1M)
+void set_capacity(std::size_t max_events);
+/// Number of events which didn't fit into the capacity since the last `clear()`
+std::size_t num_dropped();
+
+/// Copy of all the recorded events in order of completion
+std::vector<Event> events();
+/// The events in the Chrome trace event format (JSON): chrome://tracing, Perfetto, etc.
+std::string to_chrome_json();
+
+/**
+ Records the lifetime of this object as an `Event` if tracing is enabled
+
+ The `name` must be a string literal (or have static storage): only the pointer is kept.
+ When tracing is disabled, the cost is a single atomic load. An enabled span costs a clock
+ read on construction and a short critical section on destruction, so the spans should be
+ coarse (build stages, whole calculations) rather than inner loop iterations.
+
+     {
+         auto const span = trace::Span("Foundation");
+         // ...
+     } // recorded here or by an earlier `stop()`
+ */
+class Span {
+public:
+    explicit Span(char const* name) : name(is_enabled() ? name : nullptr) {
+        if (this->name) { begin(); }
+    }
+    ~Span() { if (name) { end(); } }
+
+    Span(Span&& other) noexcept : name(other.name), start(other.start) { other.name = nullptr; }
+    Span(Span const&) = delete;
+    Span& operator=(Span const&) = delete;
+    Span& operator=(Span&&) = delete;
+
+    /// End the span before the end of the scope, e.g. next to a `Chrono::toc()`
+    void stop() {
+        if (name) { end(); }
+        name = nullptr;
+    }
+
+private:
+    void begin();
+    void end();
+
+private:
+    char const* name;
+    std::int64_t start = 0;
+};
+
+}} // namespace cpb::trace
@@ -0,0 +1,36 @@
+#include "AsyncKPM.hpp"
+
+namespace cpb {
+
+AsyncResult<ArrayXcd> AsyncKPM::calc_greens(Model const& model, int row, int col,
+                                            ArrayXd const& energy, double broadening) const {
+    return submit<ArrayXcd>(model, [=](KPM const& kpm) {
+        return kpm.calc_greens(row, col, energy, broadening);
+    });
+}
+
+AsyncResult<ArrayXd> AsyncKPM::calc_ldos(Model const& model, ArrayXd const& energy,
+                                         double broadening, Cartesian position,
+                                         std::string const& sublattice) const {
+    return submit<ArrayXd>(model, [=](KPM const& kpm) {
+        return kpm.calc_ldos(energy, broadening, position, sublattice);
+    });
+}
+
+AsyncResult<ArrayXXd> AsyncKPM::calc_ldos_vector(Model const& model,
+                                                 std::vector<int> const& indices,
+                                                 ArrayXd const& energy,
+                                                 double broadening) const {
+    return submit<ArrayXXd>(model, [=](KPM const& kpm) {
+        return kpm.calc_ldos_vector(indices, energy, broadening);
+    });
+}
+
+AsyncResult<ArrayXd> AsyncKPM::calc_dos(Model const& model, ArrayXd const& energy,
+                                        double broadening, int num_random) const {
+    return submit<ArrayXd>(model, [=](KPM const& kpm) {
+        return kpm.calc_dos(energy, broadening, num_random);
+    });
+}
+
+} // namespace cpb
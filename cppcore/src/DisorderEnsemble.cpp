@@ -0,0 +1,203 @@
+#include "DisorderEnsemble.hpp"
+#include "utils/Trace.hpp"
+
+#include "support/format.hpp"
+
+#include <atomic>
+#include <exception>
+
+namespace cpb {
+
+DisorderEnsemble::DisorderEnsemble(Model const& model, Realization realization,
+                                   double min_disorder, double max_disorder,
+                                   MakeStrategy const& make_strategy, kpm::Config const& config,
+                                   int num_threads)
+    : hamiltonian(ham::with_diagonal(model.hamiltonian())),
+      onsite(ham::real_diagonal(hamiltonian)),
+      realization(std::move(realization)), min_disorder(min_disorder),
+      max_disorder(max_disorder), config(config) {
+    if (min_disorder > max_disorder) {
+        throw std::invalid_argument("DisorderEnsemble: invalid disorder range (min > max).");
+    }
+    if (num_threads < 1) {
+        throw std::invalid_argument("DisorderEnsemble: the number of threads must be at "
+                                    "least 1.");
+    }
+
+    // Adding a diagonal matrix moves each eigenvalue by at most its min and max values
+    // (Weyl's inequality), so the widened bounds are valid for every realization
+    if (this->config.min_energy == this->config.max_energy) {
+        auto const clean = kpm::energy_bounds(hamiltonian, this->config);
+        this->config.min_energy = static_cast<float>(clean.first + min_disorder);
+        this->config.max_energy = static_cast<float>(clean.second + max_disorder);
+    }
+    this->config.num_threads = 1; // the threads work on different realizations instead
+    this->config.share_matrix = false; // a shared matrix is read-only
+
+    pool = std14::make_unique<ThreadPool>(num_threads);
+    for (auto i = 0; i < num_threads; ++i) {
+        strategies.push_back(make_strategy(hamiltonian, this->config));
+    }
+}
+
+std::vector<kpm::RawMoments> DisorderEnsemble::ldos_moments(std::vector<int> const& indices,
+                                                            int num_moments,
+                                                            int num_realizations) const {
+    auto const size = hamiltonian.rows();
+    auto const index_error = std::any_of(indices.begin(), indices.end(),
+                                         [&](int i) { return i < 0 || i >= size; });
+    if (indices.empty() || index_error) {
+        throw std::logic_error("DisorderEnsemble::ldos_moments(indices): invalid index value.");
+    }
+    if (num_moments < 2) {
+        throw std::logic_error("DisorderEnsemble::ldos_moments(): at least 2 moments are "
+                               "required.");
+    }
+
+    auto const span = trace::Span("DisorderEnsemble::ldos_moments");
+    calculation_timer.tic();
+    auto moments = average(num_realizations, [&](kpm::Strategy& strategy, int) {
+        return strategy.ldos_moments(indices, num_moments);
+    });
+    calculation_timer.toc();
+    return moments;
+}
+
+kpm::RawMoments DisorderEnsemble::dos_moments(int num_moments, int num_realizations,
+                                              int num_random) const {
+    if (num_random < 1) {
+        throw std::logic_error("DisorderEnsemble::dos_moments(): at least one random vector "
+                               "is required.");
+    }
+    if (num_moments < 2) {
+        throw std::logic_error("DisorderEnsemble::dos_moments(): at least 2 moments are "
+                               "required.");
+    }
+
+    auto const span = trace::Span("DisorderEnsemble::dos_moments");
+    calculation_timer.tic();
+    auto moments = average(num_realizations, [&](kpm::Strategy& strategy, int n) {
+        return std::vector<kpm::RawMoments>{strategy.dos_moments(num_moments, num_random, n)};
+    });
+    calculation_timer.toc();
+    return std::move(moments.front());
+}
+
+ArrayXXd DisorderEnsemble::calc_ldos(std::vector<int> const& indices, ArrayXd const& energy,
+                                     double broadening, int num_realizations) const {
+    auto const moments = ldos_moments(indices, required_num_moments(broadening),
+                                      num_realizations);
+    auto const num_indices = static_cast<int>(moments.size());
+    if (num_indices > 1 && config.reconstruction == kpm::Reconstruction::Direct) {
+        // The averages share the same scaling factors: a single product with the basis
+        auto const num_moments = static_cast<int>(moments.front().data.size());
+        auto damped = MatrixX<double>(num_moments, num_indices);
+        for (auto i = 0; i < num_indices; ++i) {
+            auto m = ArrayXcd{moments[i].data};
+            config.kernel.apply(m);
+            damped.col(i) = m.real().matrix();
+        }
+        auto plan = kpm::detail::ReconstructionPlan<double>();
+        plan.prepare((energy - moments.front().b) / moments.front().a, num_moments);
+        return plan.functions(damped).array();
+    }
+
+    auto ldos = ArrayXXd(energy.size(), num_indices);
+    for (auto i = 0; i < ldos.cols(); ++i) {
+        ldos.col(i) = reconstruct(moments[i], energy);
+    }
+    return ldos;
+}
+
+ArrayXd DisorderEnsemble::calc_dos(ArrayXd const& energy, double broadening,
+                                   int num_realizations, int num_random) const {
+    auto const moments = dos_moments(required_num_moments(broadening), num_realizations,
+                                     num_random);
+    return reconstruct(moments, energy);
+}
+
+std::vector<kpm::RawMoments> DisorderEnsemble::average(int num_realizations,
+                                                       Compute const& compute) const {
+    if (num_realizations < 1) {
+        throw std::logic_error("DisorderEnsemble: at least one realization is required.");
+    }
+
+    // The realizations are handed out one at a time since some threads may be slower.
+    // Each thread sums its own moments and the sums are added up in thread order.
+    auto const num_threads = pool->size();
+    auto sums = std::vector<std::vector<kpm::RawMoments>>(num_threads);
+    auto errors = std::vector<std::exception_ptr>(num_threads);
+    std::atomic<int> next(0);
+    pool->run([&](int id) {
+        try {
+            auto& strategy = *strategies[id];
+            for (auto n = next++; n < num_realizations; n = next++) {
+                auto const disorder = realization(n);
+                if (disorder.size() != onsite.size()) {
+                    throw std::invalid_argument(fmt::format(
+                        "DisorderEnsemble: realization {} has {} values instead of {}.",
+                        n, disorder.size(), onsite.size()
+                    ));
+                }
+                if (disorder.size() != 0 && (disorder.minCoeff() < min_disorder
+                                             || disorder.maxCoeff() > max_disorder)) {
+                    throw std::invalid_argument(fmt::format(
+                        "DisorderEnsemble: realization {} is outside of the disorder range "
+                        "[{}, {}].", n, min_disorder, max_disorder
+                    ));
+                }
+                if (!strategy.change_onsite(onsite + disorder)) {
+                    throw std::runtime_error("DisorderEnsemble: the onsite energies of the "
+                                             "KPM strategy could not be replaced.");
+                }
+
+                auto moments = compute(strategy, n);
+                auto& sum = sums[id];
+                if (sum.empty()) {
+                    sum = std::move(moments);
+                } else {
+                    for (auto i = size_t{0}; i < sum.size(); ++i) {
+                        sum[i].data += moments[i].data;
+                    }
+                }
+            }
+        } catch (...) {
+            errors[id] = std::current_exception();
+            next = num_realizations; // the other threads stop after their current one
+        }
+    });
+    for (auto const& error : errors) {
+        if (error) { std::rethrow_exception(error); }
+    }
+
+    auto result = std::vector<kpm::RawMoments>();
+    for (auto& sum : sums) {
+        if (result.empty()) {
+            result = std::move(sum);
+        } else {
+            for (auto i = size_t{0}; i < sum.size(); ++i) {
+                result[i].data += sum[i].data;
+            }
+        }
+    }
+    for (auto& moments : result) {
+        moments.data /= static_cast<double>(num_realizations);
+    }
+    return result;
+}
+
+int DisorderEnsemble::required_num_moments(double broadening) const {
+    auto const scale = kpm::Scale<double>(config.min_energy, config.max_energy);
+    return config.kernel.required_num_moments(broadening / scale.a);
+}
+
+ArrayXd DisorderEnsemble::reconstruct(kpm::RawMoments const& moments,
+                                      ArrayXd const& energy) const {
+    auto damped = ArrayXcd{moments.data};
+    config.kernel.apply(damped);
+    ArrayXd const scaled_energy = (energy - moments.b) / moments.a;
+    return kpm::detail::reconstruct_function<double>(scaled_energy, damped.real(),
+                                                     config.reconstruction);
+}
+
+} // namespace cpb
@@ -1,23 +1,144 @@
 #include "KPM.hpp"
+#include "solver/Transmission.hpp"
+#include "utils/Trace.hpp"
 
 namespace cpb {
 
 KPM::KPM(Model const& model, MakeStrategy const& make_strategy)
-    : model(model), make_strategy(make_strategy), strategy(make_strategy(model.hamiltonian())) {}
+    : model(model), make_strategy(make_strategy) {}
 
 void KPM::set_model(Model const& new_model) {
+    symmetry.reset();
+    if (damping.size() != 0 && damping.size() != new_model.hamiltonian().rows()) {
+        damping.resize(0);
+    }
+    if (!strategy) { // nothing was built yet, so there is nothing to reuse
+        model = new_model;
+        return;
+    }
+
+    auto const diagonal_only = ham::differs_only_in_onsite(model.hamiltonian(),
+                                                           new_model.hamiltonian());
     model = new_model;
 
-    if (strategy) { // try to assign a new Hamiltonian to the existing strategy
-        bool success = strategy->change_hamiltonian(model.hamiltonian());
-        if (!success) { // fails if the they have incompatible scalar types
-            strategy.reset();
-        }
+    // try to assign a new Hamiltonian to the existing strategy
+    bool success = strategy->change_hamiltonian(model.hamiltonian(), diagonal_only);
+    strategy->set_damping(damping);
+    if (!success) { // fails if the they have incompatible scalar types
+        strategy.reset(); // a new one will be created on demand
     }
+}
 
+kpm::Strategy& KPM::get_strategy() const {
     if (!strategy) { // create a new strategy with a scalar type suited to the Hamiltonian
         strategy = make_strategy(model.hamiltonian());
+        strategy->set_damping(damping);
+    }
+    return *strategy;
+}
+
+void KPM::set_damping(ArrayXf const& new_damping) {
+    if (new_damping.size() != 0) {
+        auto const size = model.hamiltonian().rows();
+        auto const is_valid = (new_damping > 0).all() && (new_damping <= 1).all();
+        if (new_damping.size() != size || !is_valid) {
+            throw std::logic_error("KPM::set_damping(): expected one factor 0 < d <= 1 "
+                                   "for each of the " + std::to_string(size) + " sites.");
+        }
+    }
+    damping = new_damping;
+    if (strategy) {
+        strategy->set_damping(damping);
+    }
+}
+
+void KPM::set_absorbing_boundary(Shape const& interior, int width, float strength) {
+    if (width < 1 || strength <= 0 || strength >= 1) {
+        throw std::logic_error("KPM::set_absorbing_boundary(): expected width >= 1 "
+                               "and 0 < strength < 1.");
+    }
+
+    auto const& system = *model.system();
+    auto buffer = CartesianArray();
+    auto const is_inside = detail::contains(interior, system.expanded_positions(buffer));
+    auto sources = std::vector<int>();
+    for (auto i = 0; i < is_inside.size(); ++i) {
+        if (is_inside[i]) { sources.push_back(i); }
+    }
+    if (sources.empty()) {
+        throw std::logic_error("KPM::set_absorbing_boundary(): no sites in the interior.");
+    }
+
+    // The layers of neighbors are the slices of a breadth-first search over the hoppings
+    auto const layer = TransportSlices(system, sources, {}).slice_of;
+    auto new_damping = ArrayXf(system.num_sites());
+    for (auto i = 0; i < new_damping.size(); ++i) {
+        auto const x = layer[i] >= 0 ? std::min(1.f, static_cast<float>(layer[i]) / width)
+                                     : 1.f;
+        new_damping[i] = 1 - strength * x * x;
+    }
+    set_damping(new_damping);
+}
+
+void KPM::set_lead_absorbing_boundary(int width, float strength) {
+    if (width < 1 || strength <= 0 || strength >= 1) {
+        throw std::logic_error("KPM::set_lead_absorbing_boundary(): expected width >= 1 "
+                               "and 0 < strength < 1.");
     }
+
+    auto const& leads = model.leads();
+    auto sources = std::vector<int>();
+    for (auto i = 0; i < leads.size(); ++i) {
+        auto const lead = leads[i];
+        sources.insert(sources.end(), lead.indices().begin(), lead.indices().end());
+    }
+    if (sources.empty()) {
+        throw std::logic_error("KPM::set_lead_absorbing_boundary(): the model has no leads.");
+    }
+
+    auto const& system = *model.system();
+    auto const layer = TransportSlices(system, sources, {}).slice_of;
+    auto new_damping = ArrayXf(system.num_sites());
+    for (auto i = 0; i < new_damping.size(); ++i) {
+        auto const x = layer[i] >= 0 ? std::max(0.f, 1 - static_cast<float>(layer[i]) / width)
+                                     : 0.f;
+        new_damping[i] = 1 - strength * x * x;
+    }
+    set_damping(new_damping);
+}
+
+PointSymmetry const& KPM::point_symmetry() const {
+    if (!symmetry) {
+        auto const span = trace::Span("KPM::point_symmetry");
+        symmetry = std::make_shared<PointSymmetry const>(
+            ham::find_point_symmetry(*model.system(), model.hamiltonian())
+        );
+    }
+    return *symmetry;
+}
+
+ArrayXXd KPM::ldos_vector(std::vector<int> const& indices, ArrayXd const& energy,
+                          double broadening) const {
+    if (!use_symmetry || point_symmetry().empty()) {
+        return get_strategy().ldos_vector(indices, energy, broadening);
+    }
+
+    // Compute each distinct representative once and copy its column to the whole orbit
+    auto const& representatives = point_symmetry().representatives;
+    auto unique = std::vector<int>();
+    unique.reserve(indices.size());
+    for (auto i : indices) { unique.push_back(representatives[i]); }
+    std::sort(unique.begin(), unique.end());
+    unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+
+    auto const unique_ldos = get_strategy().ldos_vector(unique, energy, broadening);
+    auto ldos = ArrayXXd(unique_ldos.rows(), static_cast<int>(indices.size()));
+    for (auto n = 0u; n < indices.size(); ++n) {
+        auto const it = std::lower_bound(unique.begin(), unique.end(),
+                                         representatives[indices[n]]);
+        ldos.col(n) = unique_ldos.col(static_cast<int>(it - unique.begin()));
+    }
+    return ldos;
 }
 
 ArrayXcd KPM::calc_greens(int row, int col, ArrayXd const& energy,
@@ -27,8 +148,10 @@ ArrayXcd KPM::calc_greens(int row, int col, ArrayXd const& energy,
         throw std::logic_error("KPM::calc_greens(i,j): invalid value for i or j.");
     }
 
+    auto& s = get_strategy(); // may build the Hamiltonian: not part of the timing
+    auto const span = trace::Span("KPM::calc_greens");
     calculation_timer.tic();
-    auto greens_function = strategy->greens(row, col, energy, broadening);
+    auto greens_function = s.greens(row, col, energy, broadening);
     calculation_timer.toc();
     return greens_function;
 }
@@ -44,28 +167,373 @@ std::vector<ArrayXcd> KPM::calc_greens_vector(int row, std::vector<int> const& c
         throw std::logic_error("KPM::calc_greens(i,j): invalid value for i or j.");
     }
 
+    auto& s = get_strategy();
+    auto const span = trace::Span("KPM::calc_greens_vector");
     calculation_timer.tic();
-    auto greens_functions = strategy->greens_vector(row, cols, energy, broadening);
+    auto greens_functions = s.greens_vector(row, cols, energy, broadening);
     calculation_timer.toc();
     return greens_functions;
 }
 
+std::vector<ArrayXcd> KPM::calc_greens_block(std::vector<int> const& rows,
+                                             std::vector<int> const& cols,
+                                             ArrayXd const& energy, double broadening) const {
+    auto const size = model.hamiltonian().rows();
+    auto const is_invalid = [&](int index) { return index < 0 || index >= size; };
+    if (rows.empty() || cols.empty() || std::any_of(rows.begin(), rows.end(), is_invalid)
+        || std::any_of(cols.begin(), cols.end(), is_invalid)) {
+        throw std::logic_error("KPM::calc_greens_block(i,j): invalid value for i or j.");
+    }
+
+    auto& s = get_strategy();
+    auto const span = trace::Span("KPM::calc_greens_block");
+    calculation_timer.tic();
+    auto greens_functions = s.greens_block(rows, cols, energy, broadening);
+    calculation_timer.toc();
+    return greens_functions;
+}
+
+void KPM::calc_greens_stream(int row, std::vector<int> const& cols, ArrayXd const& energy,
+                             double broadening, kpm::Sink& sink) const {
+    auto const size = model.hamiltonian().rows();
+    auto const row_error = row < 0 || row >= size;
+    auto const col_error = std::any_of(cols.begin(), cols.end(),
+                                       [&](int col) { return col < 0 || col >= size; });
+    if (cols.empty() || row_error || col_error) {
+        throw std::logic_error("KPM::calc_greens_stream(i,j): invalid value for i or j.");
+    }
+
+    auto& s = get_strategy();
+    auto const span = trace::Span("KPM::calc_greens_stream");
+    calculation_timer.tic();
+    s.greens_stream(row, cols, energy, broadening, sink);
+    calculation_timer.toc();
+}
+
 ArrayXd KPM::calc_ldos(ArrayXd const& energy, double broadening,
                        Cartesian position, std::string const& sublattice) const {
     auto const index = model.system()->find_nearest(position, sublattice);
 
+    auto& s = get_strategy();
+    auto const span = trace::Span("KPM::calc_ldos");
+    calculation_timer.tic();
+    auto ldos = s.ldos(index, energy, broadening);
+    calculation_timer.toc();
+    return ldos;
+}
+
+ArrayXd KPM::calc_dos(ArrayXd const& energy, double broadening, int num_random) const {
+    if (num_random < 1) {
+        throw std::logic_error("KPM::calc_dos(): at least one random vector is required.");
+    }
+
+    auto& s = get_strategy();
+    auto const span = trace::Span("KPM::calc_dos");
+    calculation_timer.tic();
+    auto dos = s.dos(energy, broadening, num_random);
+    calculation_timer.toc();
+    return dos;
+}
+
+ArrayXXd KPM::calc_sublattice_dos(ArrayXd const& energy, double broadening,
+                                  int num_random) const {
+    auto const& system = *model.system();
+    auto const labels = ArrayXi{system.sublattices.cast<int>()};
+    auto const num_sublattices = static_cast<int>(system.lattice.get_sites().structure.size());
+    return projected_dos(labels, num_sublattices, energy, broadening, num_random,
+                         "KPM::calc_sublattice_dos");
+}
+
+ArrayXXd KPM::calc_region_dos(ArrayXd const& energy, double broadening,
+                              std::vector<Shape> const& regions, int num_random) const {
+    if (regions.empty()) {
+        throw std::logic_error("KPM::calc_region_dos(): at least one region is required.");
+    }
+
+    auto const& system = *model.system();
+    auto buffer = CartesianArray();
+    auto const& positions = system.expanded_positions(buffer);
+    auto labels = ArrayXi::Constant(system.num_sites(), -1).eval();
+    for (auto p = static_cast<int>(regions.size()) - 1; p >= 0; --p) {
+        auto const is_inside = detail::contains(regions[p], positions);
+        for (auto i = 0; i < labels.size(); ++i) {
+            if (is_inside[i]) { labels[i] = p; }
+        }
+    }
+    return projected_dos(labels, static_cast<int>(regions.size()), energy, broadening,
+                         num_random, "KPM::calc_region_dos");
+}
+
+ArrayXXd KPM::calc_bond_currents(ArrayXd const& energy, double broadening, Shape const& shape,
+                                 int num_random) const {
+    if (num_random < 0) {
+        throw std::logic_error("KPM::calc_bond_currents(): num_random can't be negative.");
+    }
+    auto const& system = *model.system();
+    if (model.hamiltonian().rows() != system.num_sites()) {
+        throw std::logic_error("KPM::calc_bond_currents(): only for a single orbital per site.");
+    }
+
+    auto buffer = CartesianArray();
+    auto const is_inside = detail::contains(shape, system.expanded_positions(buffer));
+    auto const& hoppings = system.hoppings;
+    auto const indptr = hoppings.outerIndexPtr();
+    auto const indices = hoppings.innerIndexPtr();
+    auto bonds = std::vector<int>(); // non-zeros of `hoppings` within the shape
+    auto rows = std::vector<int>();
+    auto cols = std::vector<int>();
+    for (auto i = 0; i < hoppings.outerSize(); ++i) {
+        if (!is_inside[i]) { continue; }
+        for (auto n = indptr[i]; n < indptr[i + 1]; ++n) {
+            if (!is_inside[indices[n]]) { continue; }
+            bonds.push_back(n);
+            rows.push_back(i);
+            cols.push_back(indices[n]);
+        }
+    }
+    if (bonds.empty()) {
+        throw std::logic_error("KPM::calc_bond_currents(): there are no bonds within the shape.");
+    }
+
+    auto& s = get_strategy();
+    auto const span = trace::Span("KPM::calc_bond_currents");
+    calculation_timer.tic();
+    auto const currents = s.bond_currents(eigen_cast<ArrayX>(rows), eigen_cast<ArrayX>(cols),
+                                          energy, broadening, num_random);
+    calculation_timer.toc();
+
+    auto result = ArrayXXd::Zero(energy.size(), hoppings.nonZeros()).eval();
+    for (auto k = 0; k < static_cast<int>(bonds.size()); ++k) {
+        result.col(bonds[k]) = currents.col(k);
+    }
+    return result;
+}
+
+ArrayXd KPM::calc_density(double chemical_potential, double broadening, double temperature,
+                          int num_random, int probing_distance) const {
+    if (num_random < 1 && probing_distance < 1) {
+        throw std::logic_error("KPM::calc_density(): at least one random vector is required.");
+    }
+    if (temperature < 0) {
+        throw std::logic_error("KPM::calc_density(): the temperature can't be negative.");
+    }
+
+    auto& s = get_strategy();
+    auto const span = trace::Span("KPM::calc_density");
+    calculation_timer.tic();
+    auto density = s.density(chemical_potential, broadening, temperature, num_random,
+                             probing_distance);
+    calculation_timer.toc();
+    return density;
+}
+
+ArrayXXd KPM::projected_dos(ArrayXi const& labels, int num_labels, ArrayXd const& energy,
+                            double broadening, int num_random, char const* name) const {
+    if (num_random < 1) {
+        throw std::logic_error(std::string(name) + "(): at least one random vector is required.");
+    }
+
+    auto& s = get_strategy();
+    auto const span = trace::Span(name);
+    calculation_timer.tic();
+    auto dos = s.projected_dos(labels, num_labels, energy, broadening, num_random);
+    calculation_timer.toc();
+    return dos;
+}
+
+ArrayXXd KPM::calc_spectral_function(std::vector<Cartesian> const& k_points,
+                                     ArrayXd const& energy, double broadening,
+                                     std::string const& sublattice) const {
+    if (k_points.empty()) {
+        throw std::logic_error("KPM::calc_spectral_function(): "
+                               "at least one k-point is required.");
+    }
+
+    auto const& system = *model.system();
+    auto buffer = CartesianArray();
+    auto const& positions = system.expanded_positions(buffer);
+    auto weights = ArrayXf::Ones(system.num_sites()).eval();
+    if (!sublattice.empty()) {
+        auto const id = system.lattice.get_sites().id_lookup(sublattice);
+        for (auto i = 0; i < weights.size(); ++i) {
+            weights[i] = system.sublattices[i] == id ? 1.f : 0.f;
+        }
+        if (weights.sum() == 0) {
+            throw std::logic_error("KPM::calc_spectral_function(): "
+                                   "no sites on sublattice '" + sublattice + "'.");
+        }
+    }
+
+    auto& s = get_strategy();
+    auto const span = trace::Span("KPM::calc_spectral_function");
+    calculation_timer.tic();
+    auto spectral = s.spectral_function(positions, weights, k_points, energy, broadening);
+    calculation_timer.toc();
+    return spectral;
+}
+
+ArrayXXd KPM::calc_ldos_vector(std::vector<int> const& indices, ArrayXd const& energy,
+                               double broadening) const {
+    auto const size = model.hamiltonian().rows();
+    auto const index_error = std::any_of(indices.begin(), indices.end(),
+                                         [&](int i) { return i < 0 || i >= size; });
+    if (indices.empty() || index_error) {
+        throw std::logic_error("KPM::calc_ldos_vector(indices): invalid index value.");
+    }
+
+    get_strategy(); // the Hamiltonian and the symmetries are not part of the timing
+    if (use_symmetry) { point_symmetry(); }
+    auto const span = trace::Span("KPM::calc_ldos_vector");
+    calculation_timer.tic();
+    auto ldos = ldos_vector(indices, energy, broadening);
+    calculation_timer.toc();
+    return ldos;
+}
+
+void KPM::calc_ldos_stream(std::vector<int> const& indices, ArrayXd const& energy,
+                           double broadening, kpm::Sink& sink) const {
+    auto const size = model.hamiltonian().rows();
+    auto const index_error = std::any_of(indices.begin(), indices.end(),
+                                         [&](int i) { return i < 0 || i >= size; });
+    if (indices.empty() || index_error) {
+        throw std::logic_error("KPM::calc_ldos_stream(indices): invalid index value.");
+    }
+
+    auto& s = get_strategy();
+    auto const span = trace::Span("KPM::calc_ldos_stream");
+    calculation_timer.tic();
+    s.ldos_stream(indices, energy, broadening, sink);
+    calculation_timer.toc();
+}
+
+ArrayXXd KPM::calc_spatial_ldos(ArrayXd const& energy, double broadening,
+                                Shape const& shape) const {
+    auto const indices = spatial_indices(shape);
+    if (indices.empty()) {
+        throw std::logic_error("KPM::calc_spatial_ldos(): there are no sites within the shape.");
+    }
+
+    get_strategy(); // the Hamiltonian and the symmetries are not part of the timing
+    if (use_symmetry) { point_symmetry(); }
+    auto const span = trace::Span("KPM::calc_spatial_ldos");
     calculation_timer.tic();
-    auto ldos = strategy->ldos(index, energy, broadening);
+    auto ldos = ldos_vector(indices, energy, broadening);
     calculation_timer.toc();
     return ldos;
 }
 
+std::vector<int> KPM::spatial_indices(Shape const& shape) const {
+    auto const& system = *model.system();
+    auto buffer = CartesianArray();
+    auto const is_inside = detail::contains(shape, system.expanded_positions(buffer));
+
+    auto indices = std::vector<int>();
+    for (auto i = 0; i < is_inside.size(); ++i) {
+        if (is_inside[i]) { indices.push_back(i); }
+    }
+    return indices;
+}
+
+std::vector<kpm::RawMoments> KPM::calc_moments(int row, std::vector<int> const& cols,
+                                               int num_moments) const {
+    auto const size = model.hamiltonian().rows();
+    auto const row_error = row < 0 || row >= size;
+    auto const col_error = std::any_of(cols.begin(), cols.end(),
+                                       [&](int col) { return col < 0 || col >= size; });
+    if (cols.empty() || row_error || col_error) {
+        throw std::logic_error("KPM::calc_moments(i,j): invalid value for i or j.");
+    }
+    if (num_moments < 2) {
+        throw std::logic_error("KPM::calc_moments(): at least 2 moments are required.");
+    }
+
+    auto& s = get_strategy();
+    auto const span = trace::Span("KPM::calc_moments");
+    calculation_timer.tic();
+    auto moments = s.moments(row, cols, num_moments);
+    calculation_timer.toc();
+    return moments;
+}
+
+kpm::RawMoments KPM::calc_resumable_moments(int index, int num_moments) const {
+    if (index < 0 || index >= model.hamiltonian().rows()) {
+        throw std::logic_error("KPM::calc_resumable_moments(i): invalid value for i.");
+    }
+    if (num_moments < 2) {
+        throw std::logic_error("KPM::calc_resumable_moments(): at least 2 moments are required.");
+    }
+
+    auto& s = get_strategy();
+    auto const span = trace::Span("KPM::calc_resumable_moments");
+    calculation_timer.tic();
+    auto moments = s.resume_moments(index, {}, num_moments);
+    calculation_timer.toc();
+    return moments;
+}
+
+kpm::RawMoments KPM::extend_moments(int index, kpm::RawMoments const& previous,
+                                    int num_moments) const {
+    if (!previous.is_resumable()) {
+        throw std::logic_error("KPM::extend_moments(): the given moments are not resumable.");
+    }
+
+    auto& s = get_strategy();
+    auto const span = trace::Span("KPM::extend_moments");
+    calculation_timer.tic();
+    auto moments = s.resume_moments(index, previous, num_moments);
+    calculation_timer.toc();
+    return moments;
+}
+
+ArrayXcd KPM::calc_conductivity(Cartesian direction_l, Cartesian direction_r,
+                                ArrayXd const& chemical_potential, double broadening,
+                                double temperature, int num_random, int num_points) const {
+    if (num_random < 1) {
+        throw std::logic_error("KPM::calc_conductivity(): at least one random vector is "
+                               "required.");
+    }
+    if (num_points < 1) {
+        throw std::logic_error("KPM::calc_conductivity(): invalid number of points.");
+    }
+
+    auto const& h = model.hamiltonian();
+    auto const& system = *model.system();
+    auto const velocity_l = ham::velocity(h, system, direction_l);
+    auto const velocity_r = ham::velocity(h, system, direction_r);
+
+    auto& s = get_strategy();
+    auto const span = trace::Span("KPM::calc_conductivity");
+    calculation_timer.tic();
+    auto sigma = s.conductivity(velocity_l, velocity_r, chemical_potential, broadening,
+                                temperature, num_random, num_points);
+    calculation_timer.toc();
+    return sigma;
+}
+
+ArrayXXcd KPM::calc_time_evolution(VectorXcd const& state, double time_step,
+                                   int num_steps) const {
+    if (num_steps < 1) {
+        throw std::logic_error("KPM::calc_time_evolution(): invalid number of steps.");
+    }
+    if (state.size() != model.hamiltonian().rows()) {
+        throw std::logic_error("KPM::calc_time_evolution(): the size of the state must match "
+                               "the Hamiltonian.");
+    }
+
+    auto& s = get_strategy(); // may build the Hamiltonian: not part of the timing
+    auto const span = trace::Span("KPM::calc_time_evolution");
+    calculation_timer.tic();
+    auto result = s.evolve(state, time_step, num_steps);
+    calculation_timer.toc();
+    return result;
+}
+
 std::string KPM::report(bool shortform) const {
-    return strategy->report(shortform) + " " + calculation_timer.str();
+    return get_strategy().report(shortform) + " " + calculation_timer.str();
 }
 
 kpm::Stats const& KPM::get_stats() const {
-    return strategy->get_stats();
+    return get_strategy().get_stats();
 }
 
 } // namespace cpb
@@ -0,0 +1,169 @@
+#include "MemoryEstimate.hpp"
+#include "Model.hpp"
+#include "system/Foundation.hpp"
+
+#include "support/format.hpp"
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace cpb {
+namespace {
+
+/// The shape's `contains` is evaluated for the sites of at most this many unit cells
+constexpr auto max_sample_cells = std::size_t{1} << 16;
+
+std::size_t num_cells(Index3D const& size) {
+    return static_cast<std::size_t>(size[0]) * static_cast<std::size_t>(size[1])
+           * static_cast<std::size_t>(size[2]);
+}
+
+struct ShapeSample {
+    double site_fraction; ///< of the sampled sites which are within the shape
+    std::size_t stored_cells; ///< of the tiles which are expected to intersect the shape
+};
+
+/**
+ Sample a single unit cell (all its sublattices) at the center of each block of the box
+
+ The blocks are the foundation tiles, or single unit cells without tiling, and they are
+ made coarser until there are few enough of them. A block is expected to be stored by a
+ tiled foundation if it, or one of its face neighbours, has a sampled site within the shape:
+ the neighbours account for the tiles which only intersect the edge of the shape.
+ */
+ShapeSample sample_shape(Shape const& shape, Lattice const& lattice,
+                         Index3D const& origin, Index3D const& size, int tile_size) {
+    Index3D step = Index3D::Constant(tile_size > 0 ? tile_size : 1);
+    auto const count_blocks = [&]{
+        return Index3D(((size + step - Index3D::Ones()).array() / step.array()).matrix());
+    };
+    auto num_blocks = count_blocks();
+    while (num_cells(num_blocks) > max_sample_cells) {
+        for (auto i = 0; i < 3; ++i) {
+            if (num_blocks[i] > 1) { step[i] *= 2; }
+        }
+        num_blocks = count_blocks();
+    }
+
+    auto const nsub = lattice.nsub();
+    auto const total = static_cast<int>(num_cells(num_blocks));
+    auto positions = CartesianArray(total * nsub);
+    for (auto s = 0, n = 0; s < nsub; ++s) {
+        for (auto c = 0; c < num_blocks[2]; ++c) {
+            for (auto b = 0; b < num_blocks[1]; ++b) {
+                for (auto a = 0; a < num_blocks[0]; ++a, ++n) {
+                    Array3i const block = Array3i(a, b, c) * step.array();
+                    Array3i const cell = (block + step.array() / 2).min(size.array() - 1);
+                    Index3D const index = origin + cell.matrix();
+                    positions[n] = lattice.calc_position(index) + lattice[s].position;
+                }
+            }
+        }
+    }
+    auto const is_inside = detail::contains(shape, positions);
+
+    auto inside_blocks = std::vector<bool>(total, false);
+    for (auto n = 0; n < total * nsub; ++n) {
+        if (is_inside[n]) { inside_blocks[n % total] = true; }
+    }
+
+    auto const flat = [&](int a, int b, int c) {
+        return (c * num_blocks[1] + b) * num_blocks[0] + a;
+    };
+    auto stored_cells = std::size_t{0};
+    for (auto c = 0; c < num_blocks[2]; ++c) {
+        for (auto b = 0; b < num_blocks[1]; ++b) {
+            for (auto a = 0; a < num_blocks[0]; ++a) {
+                bool is_stored = inside_blocks[flat(a, b, c)];
+                auto const neighbors = std::array<Array3i, 6>{{
+                    Array3i(a - 1, b, c), Array3i(a + 1, b, c), Array3i(a, b - 1, c),
+                    Array3i(a, b + 1, c), Array3i(a, b, c - 1), Array3i(a, b, c + 1)
+                }};
+                for (auto const& n : neighbors) {
+                    if ((n >= 0).all() && (n < num_blocks.array()).all()) {
+                        is_stored = is_stored || inside_blocks[flat(n[0], n[1], n[2])];
+                    }
+                }
+                if (is_stored) {
+                    Array3i const start = Array3i(a, b, c) * step.array();
+                    stored_cells += num_cells(step.array().min(size.array() - start).matrix());
+                }
+            }
+        }
+    }
+
+    auto const num_inside = static_cast<double>(is_inside.count());
+    return {num_inside / static_cast<double>(total * nsub), stored_cells};
+}
+
+} // anonymous namespace
+
+std::string MemoryEstimate::report() const {
+    auto const bytes = [](std::size_t n) {
+        return fmt::with_suffix(static_cast<double>(n)) + "B";
+    };
+    return fmt::format("About {} sites ({} in the foundation) and {} non-zero Hamiltonian "
+                       "values: foundation {}, system {}, Hamiltonian {}, peak {}",
+                       fmt::with_suffix(static_cast<double>(num_sites)),
+                       fmt::with_suffix(static_cast<double>(foundation_sites)),
+                       fmt::with_suffix(static_cast<double>(hamiltonian_nnz)),
+                       bytes(foundation_bytes), bytes(system_bytes), bytes(hamiltonian_bytes),
+                       bytes(peak_bytes()));
+}
+
+MemoryEstimate estimate_memory(Model const& model, int tile_size, bool compact_positions) {
+    auto const& lattice = model.get_lattice();
+    auto const& shape = model.get_shape();
+    auto const nsub = static_cast<std::size_t>(lattice.nsub());
+
+    auto estimate = MemoryEstimate();
+    if (shape) {
+        auto const bounds = detail::find_bounds(shape, lattice);
+        Index3D const size = (bounds.second - bounds.first) + Index3D::Ones();
+        auto const sample = sample_shape(shape, lattice, bounds.first, size, tile_size);
+        estimate.box_sites = num_cells(size) * nsub;
+        estimate.foundation_sites = tile_size > 0 ? sample.stored_cells * nsub
+                                                  : estimate.box_sites;
+        estimate.num_sites = static_cast<std::size_t>(
+            std::llround(sample.site_fraction * static_cast<double>(estimate.box_sites))
+        );
+    } else {
+        estimate.box_sites = num_cells(model.get_primitive().size) * nsub;
+        estimate.foundation_sites = estimate.box_sites;
+        estimate.num_sites = estimate.box_sites;
+    }
+
+    auto hoppings_per_cell = std::size_t{0};
+    for (auto s = 0; s < lattice.nsub(); ++s) {
+        hoppings_per_cell += lattice[s].hoppings.size();
+    }
+    auto const num_sites = estimate.num_sites;
+    auto const num_hoppings = num_sites * hoppings_per_cell / nsub;
+    auto const has_diagonal = lattice.has_onsite_energy() || !model.onsite_modifiers().empty();
+    estimate.hamiltonian_nnz = num_hoppings + (has_diagonal ? num_sites : 0);
+    estimate.max_nnz_per_row = lattice.max_hoppings() + (has_diagonal ? 1 : 0);
+    estimate.scalar_bytes = static_cast<int>(model.is_double() ? sizeof(double) : sizeof(float))
+                            * (model.is_complex() ? 2 : 1);
+
+    // Positions, states, neighbor counts, Hamiltonian indices and sublattice ids
+    constexpr auto foundation_site_bytes = sizeof(Cartesian) + sizeof(bool)
+                                           + sizeof(std::int16_t) + sizeof(int) + sizeof(sub_id);
+    estimate.foundation_bytes = estimate.foundation_sites * foundation_site_bytes;
+
+    // Positions (or compact indices), sublattice ids and the upper half of the hoppings
+    auto const position_bytes = compact_positions ? sizeof(int) : sizeof(Cartesian);
+    estimate.system_bytes = num_sites * (position_bytes + sizeof(sub_id) + sizeof(int))
+                            + num_hoppings / 2 * (sizeof(int) + sizeof(hop_id));
+    if (model.get_keep_topology() && !compact_positions) {
+        estimate.system_bytes += num_sites * sizeof(Cartesian); // the unmodified positions
+    }
+
+    auto const value_bytes = static_cast<std::size_t>(estimate.scalar_bytes);
+    estimate.hamiltonian_bytes = estimate.hamiltonian_nnz * (value_bytes + sizeof(int))
+                                 + (num_sites + 1) * sizeof(int);
+    return estimate;
+}
+
+} // namespace cpb
@@ -1,9 +1,28 @@
 #include "Model.hpp"
 #include "system/Foundation.hpp"
+#include "system/Cache.hpp"
+#include "utils/Trace.hpp"
 
 #include "support/format.hpp"
 
+#include <algorithm>
+#include <map>
+
 namespace cpb {
+namespace {
+
+/// Foundation tile size (unit cells) which is switched on to fit a memory budget
+constexpr auto budget_tile_size = 16;
+
+/// No tag for an empty string, see `Model::is_cacheable()`
+Model::CacheTag constant_tag(std::string const& tag) {
+    if (tag.empty()) {
+        return {};
+    }
+    return [tag] { return tag; };
+}
+
+} // anonymous namespace
 
 void Model::add(Primitive new_primitive) {
     primitive = new_primitive;
@@ -11,10 +30,17 @@ void Model::add(Primitive new_primitive) {
 }
 
 void Model::set_wave_vector(Cartesian const& new_wave_vector) {
-    if (wave_vector != new_wave_vector) {
-        wave_vector = new_wave_vector;
-        clear_hamiltonian();
+    if (wave_vector == new_wave_vector) {
+        return;
     }
+
+    wave_vector = new_wave_vector;
+    // A Hamiltonian was already built for a different wave vector: this looks like a sweep
+    // so the wave vector independent parts are worth keeping for the following k-points
+    is_k_sweep = is_k_sweep || static_cast<bool>(_hamiltonian);
+    _hamiltonian.reset();
+    is_onsite_outdated = false;
+    _leads.clear_hamiltonian();
 }
 
 void Model::add(Shape const& new_shape) {
@@ -49,12 +75,26 @@ void Model::add(SiteStateModifier const& m) {
 
 void Model::add(PositionModifier const& m) {
     system_modifiers.position.push_back(m);
-    clear_structure();
+    clear_positions();
+}
+
+void Model::clear_position_modifiers() {
+    system_modifiers.position.clear();
+    clear_positions();
 }
 
 void Model::add(OnsiteModifier const& m) {
+    auto const was_double = is_double();
+    auto const was_complex = is_complex();
     hamiltonian_modifiers.onsite.push_back(m);
-    clear_hamiltonian();
+    clear_onsite(was_double, was_complex);
+}
+
+void Model::clear_onsite_modifiers() {
+    auto const was_double = is_double();
+    auto const was_complex = is_complex();
+    hamiltonian_modifiers.onsite.clear();
+    clear_onsite(was_double, was_complex);
 }
 
 void Model::add(HoppingModifier const& m) {
@@ -68,6 +108,102 @@ void Model::add(HoppingGenerator const& g) {
     clear_structure();
 }
 
+void Model::set_cache(std::string const& directory, std::string const& tag) {
+    set_cache(directory, constant_tag(tag));
+}
+
+void Model::set_cache(std::string const& directory, CacheTag const& tag) {
+    cache_directory = directory;
+    cache_tag = tag;
+}
+
+void Model::set_memory_cache(bool enabled, std::string const& tag) {
+    set_memory_cache(enabled, constant_tag(tag));
+}
+
+void Model::set_memory_cache(bool enabled, CacheTag const& tag) {
+    memory_cache = enabled;
+    memory_cache_tag = tag;
+}
+
+std::string Model::cache_filename() const {
+    if (cache_directory.empty()) {
+        return {};
+    }
+    auto const tag = cache_tag ? cache_tag() : std::string();
+    if (!is_cacheable(tag)) {
+        return {};
+    }
+    return cache_directory + "/" + parameter_hash(tag).hex() + ".pbcache";
+}
+
+bool Model::has_opaque_functions() const {
+    auto const& onsite = hamiltonian_modifiers.onsite;
+    auto const& hopping = hamiltonian_modifiers.hopping;
+    return (shape && !shape.is_vertex_defined) || !system_modifiers.empty()
+           || !hopping_generators.empty()
+           || std::any_of(onsite.begin(), onsite.end(), [](OnsiteModifier const& m) {
+                  return m.fingerprint.empty();
+              })
+           || std::any_of(hopping.begin(), hopping.end(), [](HoppingModifier const& m) {
+                  return m.fingerprint.empty();
+              });
+}
+
+bool Model::is_cacheable(std::string const& tag) const {
+    // Leads are built together with the system and they are not part of the cache format.
+    // Neither are removed sites: the parameters would describe the system before removal.
+    // Two models which only differ in their functions would have the same hash without a tag.
+    return _leads.size() == 0 && !has_removed_sites && (!tag.empty() || !has_opaque_functions());
+}
+
+cache::Hasher Model::parameter_hash(std::string const& tag) const {
+    auto h = cache::Hasher();
+    h.add(cache::format_version).add(tag);
+
+    for (auto const& v : lattice.get_vectors()) { h.add(v); }
+    for (auto const& sublattice : lattice.get_sites().structure) {
+        h.add(sublattice.position).add(sublattice.alias);
+        for (auto const& hopping : sublattice.hoppings) {
+            h.add(hopping.relative_index).add(hopping.to_sublattice)
+             .add(hopping.id).add(hopping.is_conjugate);
+        }
+    }
+    for (auto const& energy : lattice.get_sites().energy) { h.add(energy); }
+    for (auto const& energy : lattice.get_hoppings().energy) { h.add(energy); }
+    // The modifiers see the names: sorted since the order of an `unordered_map` may differ
+    for (auto const& pair : std::map<std::string, sub_id>(lattice.get_sites().id.begin(),
+                                                          lattice.get_sites().id.end())) {
+        h.add(pair.first).add(pair.second);
+    }
+    for (auto const& pair : std::map<std::string, hop_id>(lattice.get_hoppings().id.begin(),
+                                                          lattice.get_hoppings().id.end())) {
+        h.add(pair.first).add(pair.second);
+    }
+    h.add(lattice.get_offset()).add(lattice.get_min_neighbors());
+
+    h.add(primitive.size).add(tile_size).add(site_order).add(compact_positions)
+     .add(keep_topology);
+    if (memory_budget != 0) {
+        h.add(memory_budget); // may change the tiling and thus the order of the sites
+    }
+    h.add(static_cast<bool>(shape.contains)).add(shape.is_vertex_defined).add(shape.lattice_offset);
+    for (auto const& v : shape.vertices) { h.add(v); }
+    h.add(static_cast<bool>(symmetry)).add(symmetry.get_length());
+
+    for (auto const& m : system_modifiers.state) { h.add(m.min_neighbors); }
+    h.add(system_modifiers.position.size());
+    for (auto const& m : hamiltonian_modifiers.onsite) {
+        h.add(m.is_complex).add(m.is_double).add(m.fingerprint);
+    }
+    for (auto const& m : hamiltonian_modifiers.hopping) {
+        h.add(m.is_complex).add(m.is_double).add(m.fingerprint);
+    }
+    for (auto const& g : hopping_generators) { h.add(g.name).add(g.energy); }
+    h.add(wave_vector);
+    return h;
+}
+
 bool Model::is_double() const {
     return hamiltonian_modifiers.any_double();
 }
@@ -77,24 +213,60 @@ bool Model::is_complex() const {
 }
 
 std::shared_ptr<System const> const& Model::system() const {
+    std::lock_guard<std::recursive_mutex> const lock(build_mutex);
+    if (_system && are_positions_outdated) {
+        auto const span = trace::Span("Model::system position update");
+        system_build_time.timeit([&]{
+            _system = update_positions();
+        });
+        are_positions_outdated = false;
+    }
+
     if (!_system) {
+        auto const span = trace::Span("Model::system");
         system_build_time.timeit([&]{
-            _system = make_system();
+            if (!load_cache()) {
+                _system = make_system();
+            }
         });
     }
     return _system;
 }
 
 Hamiltonian const& Model::hamiltonian() const {
-    if (!_hamiltonian) {
+    std::lock_guard<std::recursive_mutex> const lock(build_mutex);
+    if (_hamiltonian && is_onsite_outdated) {
+        auto const span = trace::Span("Model::hamiltonian onsite update");
         hamiltonian_build_time.timeit([&]{
-            _hamiltonian = make_hamiltonian();
+            _hamiltonian = update_onsite();
+        });
+        is_onsite_outdated = false;
+    }
+
+    if (!_hamiltonian) { // also if the onsite update was not possible
+        auto const span = trace::Span("Model::hamiltonian");
+        hamiltonian_build_time.timeit([&]{
+            if (is_k_sweep && !system()->boundaries.empty()) {
+                _hamiltonian = periodic_hamiltonian().at(wave_vector);
+            } else if (!load_cache()) {
+                _hamiltonian = make_hamiltonian();
+                save_cache();
+            }
         });
     }
     return _hamiltonian;
 }
 
+PeriodicHamiltonian const& Model::periodic_hamiltonian() const {
+    std::lock_guard<std::recursive_mutex> const lock(build_mutex);
+    if (!_periodic_hamiltonian) {
+        _periodic_hamiltonian = make_periodic_hamiltonian();
+    }
+    return _periodic_hamiltonian;
+}
+
 Leads const& Model::leads() const {
+    std::lock_guard<std::recursive_mutex> const lock(build_mutex);
     system();
     _leads.make_hamiltonian(hamiltonian_modifiers, is_double(), is_complex());
     return _leads;
@@ -109,40 +281,135 @@ std::string Model::report() {
     report += fmt::format("The Hamiltonian has {} non-zero values, {}",
                           fmt::with_suffix(built_hamiltonian.non_zeros()), hamiltonian_build_time);
 
+    if (memory_cache) {
+        auto const stats = cache::MemoryCache::instance().stats();
+        report += fmt::format("\nMemory cache: {} hits, {} misses, {} entries, {}B",
+                              stats.hits, stats.misses, stats.num_entries,
+                              fmt::with_suffix(static_cast<double>(stats.memory)));
+    }
+
     return report;
 }
 
-std::shared_ptr<System> Model::make_system() const {
-    auto foundation = shape ? Foundation(lattice, shape)
-                            : Foundation(lattice, primitive);
+Foundation Model::make_foundation(int foundation_tile_size, bool with_positions) const {
+    auto foundation_span = trace::Span("Foundation");
+    auto foundation = shape ? Foundation(lattice, shape, num_threads, foundation_tile_size)
+                            : Foundation(lattice, primitive, num_threads);
     if (symmetry)
         symmetry.apply(foundation);
+    foundation_span.stop();
 
     if (!system_modifiers.empty()) {
+        auto const span = trace::Span("system modifiers");
         auto const sublattices = detail::make_sublattice_ids(foundation);
 
         for (auto const& site_state_modifier : system_modifiers.state) {
             site_state_modifier.apply(foundation.get_states(), foundation.get_positions(),
                                        {sublattices, lattice.get_sites().id});
             if (site_state_modifier.min_neighbors > 0) {
-                remove_dangling(foundation, site_state_modifier.min_neighbors);
+                remove_dangling(foundation, site_state_modifier.min_neighbors, num_threads);
             }
         }
-        for (auto const& position_modifier : system_modifiers.position) {
-            position_modifier.apply(foundation.get_positions(),
-                                     {sublattices, lattice.get_sites().id});
+        if (with_positions) {
+            for (auto const& position_modifier : system_modifiers.position) {
+                position_modifier.apply(foundation.get_positions(),
+                                         {sublattices, lattice.get_sites().id});
+            }
         }
     }
 
+    return foundation;
+}
+
+MemoryEstimate Model::estimate_memory() const {
+    return cpb::estimate_memory(*this, _leads.size() == 0 ? tile_size : 0,
+                                compact_positions && system_modifiers.position.empty());
+}
+
+void Model::fit_memory_budget(int& foundation_tile_size, bool& is_compact) const {
+    auto estimate = cpb::estimate_memory(*this, foundation_tile_size, is_compact);
+    auto const fits = [&]{ return estimate.peak_bytes() <= memory_budget; };
+
+    if (!fits() && foundation_tile_size == 0 && _leads.size() == 0 && shape) {
+        foundation_tile_size = budget_tile_size;
+        estimate = cpb::estimate_memory(*this, foundation_tile_size, is_compact);
+    }
+    if (!fits() && !is_compact && system_modifiers.position.empty()) {
+        is_compact = true;
+        estimate = cpb::estimate_memory(*this, foundation_tile_size, is_compact);
+    }
+    if (!fits()) {
+        throw std::runtime_error(fmt::format(
+            "The model doesn't fit the memory budget of {}B. {}",
+            fmt::with_suffix(static_cast<double>(memory_budget)), estimate.report()
+        ));
+    }
+}
+
+std::shared_ptr<System> Model::make_system() const {
+    auto foundation_tile_size = _leads.size() == 0 ? tile_size : 0;
+    // The positions only follow the lattice if they haven't been modified
+    auto is_compact = compact_positions && system_modifiers.position.empty();
+    if (memory_budget > 0) {
+        fit_memory_budget(foundation_tile_size, is_compact);
+    }
+
+    // With a fixed topology, the position modifiers are applied to the system instead
+    auto const fixed_topology = is_topology_fixed();
+    auto foundation = make_foundation(foundation_tile_size, !fixed_topology);
     _leads.create_attachment_area(foundation);
 
     auto const hamiltonian_indices = HamiltonianIndices(foundation);
-    _leads.make_structure(foundation, hamiltonian_indices);
-    return std::make_shared<System>(foundation, hamiltonian_indices, symmetry, hopping_generators);
+    {
+        auto const span = trace::Span("lead structures");
+        _leads.make_structure(foundation, hamiltonian_indices, num_threads);
+    }
+    auto const span = trace::Span("System");
+    // The lead attachment and the memory budget may change the foundation layout
+    auto const use_boundary_cache = _leads.size() == 0 && memory_budget == 0;
+    auto system = std::make_shared<System>(foundation, hamiltonian_indices, symmetry,
+                                           hopping_generators, num_threads, site_order,
+                                           is_compact,
+                                           use_boundary_cache ? &boundary_cache : nullptr);
+    if (system->original_indices.size() != 0) {
+        _leads.reorder_structure(system->original_indices);
+    }
+    if (fixed_topology && system->compact.empty()) {
+        apply_position_modifiers(*system);
+    }
+    return system;
+}
+
+bool Model::is_topology_fixed() const {
+    // Generators find their pairs, and the Morton order its sites, from the positions
+    return keep_topology && hopping_generators.empty() && _leads.size() == 0
+           && site_order != SiteOrder::Morton;
+}
+
+void Model::apply_position_modifiers(System& system) const {
+    if (system.lattice_positions.size() == 0) {
+        auto buffer = CartesianArray();
+        system.lattice_positions = system.expanded_positions(buffer);
+        system.compact = CompactPositions();
+    }
+
+    system.positions = system.lattice_positions;
+    auto const sublattices = SubIdRef{system.sublattices, system.lattice.get_sites().id};
+    for (auto const& position_modifier : system_modifiers.position) {
+        position_modifier.apply(system.positions, sublattices);
+    }
+    system.cached_spatial_index.reset();
+}
+
+std::shared_ptr<System> Model::update_positions() const {
+    auto system = std::make_shared<System>(*_system);
+    apply_position_modifiers(*system);
+    return system;
 }
 
 Hamiltonian Model::make_hamiltonian() const {
     auto const& built_system = *system();
+    auto const span = trace::Span("Hamiltonian build");
 
     if (is_double()) {
         if (is_complex()) {
@@ -159,15 +426,215 @@ Hamiltonian Model::make_hamiltonian() const {
     }
 }
 
+Hamiltonian Model::hamiltonian_rows(int start, int end) const {
+    auto const& built_system = *system();
+    if (start < 0 || end < start || end > built_system.num_sites()) {
+        throw std::invalid_argument(fmt::format(
+            "Model::hamiltonian_rows(): the rows [{}, {}) are not within [0, {})",
+            start, end, built_system.num_sites()
+        ));
+    }
+    auto const& m = hamiltonian_modifiers;
+    auto const& k = wave_vector;
+
+    if (is_double()) {
+        if (is_complex()) {
+            return ham::make_rows<std::complex<double>>(built_system, m, k, start, end);
+        } else {
+            return ham::make_rows<double>(built_system, m, k, start, end);
+        }
+    } else {
+        if (is_complex()) {
+            return ham::make_rows<std::complex<float>>(built_system, m, k, start, end);
+        } else {
+            return ham::make_rows<float>(built_system, m, k, start, end);
+        }
+    }
+}
+
+PeriodicHamiltonian Model::make_periodic_hamiltonian() const {
+    auto const& built_system = *system();
+    auto const& m = hamiltonian_modifiers;
+
+    if (is_double()) {
+        if (is_complex()) {
+            return ham::make_periodic<std::complex<double>>(built_system, m);
+        } else {
+            return ham::make_periodic<double>(built_system, m);
+        }
+    } else {
+        if (is_complex()) {
+            return ham::make_periodic<std::complex<float>>(built_system, m);
+        } else {
+            return ham::make_periodic<float>(built_system, m);
+        }
+    }
+}
+
+Hamiltonian Model::update_onsite() const {
+    auto const& built_system = *system();
+    auto const& m = hamiltonian_modifiers;
+    auto const& k = wave_vector;
+
+    if (is_double()) {
+        if (is_complex()) {
+            return ham::update_onsite<std::complex<double>>(_hamiltonian, built_system, m, k);
+        } else {
+            return ham::update_onsite<double>(_hamiltonian, built_system, m, k);
+        }
+    } else {
+        if (is_complex()) {
+            return ham::update_onsite<std::complex<float>>(_hamiltonian, built_system, m, k);
+        } else {
+            return ham::update_onsite<float>(_hamiltonian, built_system, m, k);
+        }
+    }
+}
+
+bool Model::load_cache() const {
+    auto system = std::shared_ptr<System const>();
+    auto hamiltonian = Hamiltonian();
+    auto const tag = memory_cache && memory_cache_tag ? memory_cache_tag() : std::string();
+    auto const use_memory = memory_cache && is_cacheable(tag);
+    auto const key = use_memory ? parameter_hash(tag) : cache::Hasher();
+    auto& memory = cache::MemoryCache::instance();
+    // Building the Hamiltonian also builds the system: only the first one looks it up
+    if (!use_memory || key.get() == missed_key || !memory.find(key, system, hamiltonian)) {
+        missed_key = key.get();
+        auto const filename = cache_filename();
+        auto loaded = std::shared_ptr<System>();
+        if (filename.empty() || !cache::load(filename, lattice, loaded, hamiltonian)) {
+            return false;
+        }
+        system = std::move(loaded);
+        if (use_memory) {
+            memory.insert(key, system, hamiltonian);
+            missed_key = 0;
+        }
+    }
+
+    if (!_system) {
+        _system = std::move(system);
+    }
+    if (!_hamiltonian) {
+        _hamiltonian = std::move(hamiltonian);
+    }
+    return true;
+}
+
+void Model::save_cache() const {
+    if (memory_cache) {
+        auto const tag = memory_cache_tag ? memory_cache_tag() : std::string();
+        if (is_cacheable(tag)) {
+            auto& memory = cache::MemoryCache::instance();
+            memory.insert(parameter_hash(tag), system(), _hamiltonian);
+            missed_key = 0;
+        }
+    }
+    cache_error.clear();
+    auto const filename = cache_filename();
+    if (!filename.empty()) {
+        // The results are already built: failing to save them is not a reason to lose them
+        try {
+            cache::save(filename, *system(), _hamiltonian);
+        } catch (std::exception const& e) {
+            cache_error = e.what();
+        }
+    }
+}
+
+ArrayXi Model::remove_sites(std::vector<int> const& indices, int min_neighbors) {
+    if (_leads.size() != 0) {
+        throw std::logic_error("Sites can't be removed from a model with leads");
+    }
+
+    auto const span = trace::Span("Model::remove_sites");
+    auto const& built_system = *system();
+    auto const new_index = detail::removal_index(built_system, indices, min_neighbors);
+
+    // Copies of this model share the system and Hamiltonian: replace them, don't modify
+    auto reduced = std::make_shared<System>(built_system);
+    detail::remove_sites(*reduced, new_index);
+    if (_hamiltonian) { // an outdated diagonal is still updated later, on the new system
+        _hamiltonian = ham::remove_sites(_hamiltonian, new_index);
+    }
+    _system = std::move(reduced);
+    _periodic_hamiltonian.reset();
+    has_removed_sites = true;
+    return new_index;
+}
+
 void Model::clear_structure() {
     _system.reset();
+    boundary_cache.reset();
+    are_positions_outdated = false;
+    has_removed_sites = false;
     _leads.clear_structure();
     clear_hamiltonian();
 }
 
 void Model::clear_hamiltonian() {
     _hamiltonian.reset();
+    _periodic_hamiltonian.reset();
+    is_onsite_outdated = false;
     _leads.clear_hamiltonian();
 }
 
+void Model::clear_positions() {
+    auto const has_lattice_positions = _system && (_system->lattice_positions.size() != 0
+                                                   || !_system->compact.empty());
+    if (has_lattice_positions && is_topology_fixed()) {
+        are_positions_outdated = true;
+        clear_hamiltonian(); // the hopping values depend on the positions
+    } else {
+        // The site states and therefore the boundaries don't depend on the positions
+        auto const boundaries = boundary_cache;
+        clear_structure();
+        boundary_cache = boundaries;
+    }
+}
+
+void Model::clear_onsite(bool was_double, bool was_complex) {
+    if (is_double() != was_double || is_complex() != was_complex) {
+        clear_hamiltonian(); // a different scalar type requires a full rebuild
+    } else {
+        is_onsite_outdated = static_cast<bool>(_hamiltonian);
+        _periodic_hamiltonian.reset(); // its main part includes the old onsite energies
+        _leads.clear_hamiltonian();
+    }
+}
+
+template<class scalar_t>
+num::SymmetricMatrix<scalar_t> Model::make_symmetric() const {
+    if (symmetry) {
+        throw std::runtime_error("The symmetric Hamiltonian storage is only available for "
+                                 "models without translational symmetry");
+    }
+    return detail::build_symmetric<scalar_t>(*system(), hamiltonian_modifiers);
+}
+
+template num::SymmetricMatrix<float> Model::make_symmetric<float>() const;
+template num::SymmetricMatrix<std::complex<float>>
+Model::make_symmetric<std::complex<float>>() const;
+template num::SymmetricMatrix<double> Model::make_symmetric<double>() const;
+template num::SymmetricMatrix<std::complex<double>>
+Model::make_symmetric<std::complex<double>>() const;
+
+template<class scalar_t>
+num::BulkBoundaryMatrix<scalar_t> Model::make_bulk_boundary() const {
+    if (!symmetry) {
+        throw std::runtime_error("The bulk-boundary Hamiltonian requires translational symmetry");
+    }
+    if (lattice.has_complex_hoppings() || hamiltonian_modifiers.any_complex()) {
+        throw std::runtime_error("The bulk-boundary Hamiltonian is only available for models "
+                                 "with real hoppings and modifiers");
+    }
+    return detail::build_bulk_boundary<scalar_t>(*system(), hamiltonian_modifiers, wave_vector);
+}
+
+template num::BulkBoundaryMatrix<std::complex<float>>
+Model::make_bulk_boundary<std::complex<float>>() const;
+template num::BulkBoundaryMatrix<std::complex<double>>
+Model::make_bulk_boundary<std::complex<double>>() const;
+
 } // namespace cpb
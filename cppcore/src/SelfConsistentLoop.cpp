@@ -0,0 +1,205 @@
+#include "SelfConsistentLoop.hpp"
+#include "utils/Trace.hpp"
+
+#include "support/format.hpp"
+
+#include <Eigen/QR>
+
+namespace cpb {
+
+namespace scf {
+
+ArrayXd Mixer::next(ArrayXd const& input, ArrayXd const& residual) {
+    if (last_input.size() == input.size()) {
+        input_steps.push_back(input - last_input);
+        residual_steps.push_back(residual - last_residual);
+        if (static_cast<int>(input_steps.size()) > config.history) {
+            input_steps.pop_front();
+            residual_steps.pop_front();
+        }
+    }
+    last_input = input;
+    last_residual = residual;
+
+    if (input_steps.empty()) {
+        return input + config.mixing_parameter * residual;
+    }
+    switch (config.mixing) {
+        case Mixing::Anderson: return anderson(input, residual);
+        case Mixing::Broyden: return broyden(input, residual);
+        default: return input + config.mixing_parameter * residual;
+    }
+}
+
+void Mixer::reset() {
+    last_input.resize(0);
+    last_residual.resize(0);
+    input_steps.clear();
+    residual_steps.clear();
+    updates.clear();
+}
+
+ArrayXd Mixer::anderson(ArrayXd const& input, ArrayXd const& residual) const {
+    // The combination of the previous steps which minimizes the extrapolated residual
+    auto const size = static_cast<int>(residual.size());
+    auto const num_steps = static_cast<int>(residual_steps.size());
+    auto steps = MatrixX<double>(size, num_steps);
+    for (auto i = 0; i < num_steps; ++i) {
+        steps.col(i) = residual_steps[i].matrix();
+    }
+    VectorXd const gamma = steps.colPivHouseholderQr().solve(residual.matrix());
+
+    auto const alpha = config.mixing_parameter;
+    auto result = ArrayXd{input + alpha * residual};
+    for (auto i = 0; i < num_steps; ++i) {
+        result -= gamma[i] * (input_steps[i] + alpha * residual_steps[i]);
+    }
+    return result;
+}
+
+ArrayXd Mixer::broyden(ArrayXd const& input, ArrayXd const& residual) {
+    // Rank-1 update which makes the inverse Jacobian `G` map the last residual step to the
+    // last input step: `G += (dx - G df) dx^T G / (dx^T G df)`
+    auto const& dx = input_steps.back();
+    auto const& df = residual_steps.back();
+    auto const g_df = inverse_jacobian(df);
+    auto const denominator = (dx * g_df).sum();
+    if (std::abs(denominator) > 1e-12 * dx.matrix().squaredNorm()) {
+        updates.emplace_back(ArrayXd{(dx - g_df) / denominator}, inverse_jacobian(dx, true));
+        if (static_cast<int>(updates.size()) > config.history) {
+            updates.pop_front();
+        }
+    }
+    return input - inverse_jacobian(residual);
+}
+
+ArrayXd Mixer::inverse_jacobian(ArrayXd const& x, bool transpose) const {
+    auto result = ArrayXd{-config.mixing_parameter * x};
+    for (auto const& update : updates) {
+        auto const& u = transpose ? update.second : update.first;
+        auto const& v = transpose ? update.first : update.second;
+        result += (v * x).sum() * u;
+    }
+    return result;
+}
+
+SelfConsistentLoop::Density fermi_density(double chemical_potential, double broadening,
+                                          double temperature, int num_random,
+                                          int probing_distance) {
+    if (num_random < 1 && probing_distance < 1) {
+        throw std::invalid_argument("scf::fermi_density(): at least one random vector is "
+                                    "required.");
+    }
+    if (temperature < 0) {
+        throw std::invalid_argument("scf::fermi_density(): the temperature can't be "
+                                    "negative.");
+    }
+    return [=](kpm::Strategy& strategy) {
+        return strategy.density(chemical_potential, broadening, temperature, num_random,
+                                probing_distance);
+    };
+}
+
+SelfConsistentLoop::Potential linear_potential(SparseMatrixXd coupling, ArrayXd background) {
+    if (coupling.rows() != coupling.cols()) {
+        throw std::invalid_argument("scf::linear_potential(): the coupling must be square.");
+    }
+    if (background.size() != 0 && background.size() != coupling.rows()) {
+        throw std::invalid_argument("scf::linear_potential(): the background must have one "
+                                    "value per coupling row.");
+    }
+
+    auto const k = std::make_shared<SparseMatrixXd const>(std::move(coupling));
+    return [k, background](ArrayXd const& density) -> ArrayXd {
+        if (density.size() != k->cols()) {
+            throw std::invalid_argument("scf::linear_potential(): the density must have one "
+                                        "value per coupling row.");
+        }
+        VectorXd const excess = (background.size() != 0 ? ArrayXd{density - background}
+                                                        : density).matrix();
+        VectorXd const v = *k * excess;
+        return v.array();
+    };
+}
+
+} // namespace scf
+
+SelfConsistentLoop::SelfConsistentLoop(Model const& model, Density density, Potential potential,
+                                       MakeStrategy make_strategy,
+                                       kpm::Config const& kpm_config, scf::Config const& config)
+    : hamiltonian(ham::with_diagonal(model.hamiltonian())),
+      onsite(ham::real_diagonal(hamiltonian)),
+      density(std::move(density)), potential(std::move(potential)),
+      make_strategy(std::move(make_strategy)), kpm_config(kpm_config), config(config) {
+    if (config.mixing_parameter <= 0) {
+        throw std::invalid_argument("SelfConsistentLoop: the mixing parameter must be "
+                                    "positive.");
+    }
+    if (config.history < 0 || config.max_iterations < 1) {
+        throw std::invalid_argument("SelfConsistentLoop: invalid history or maximum number "
+                                    "of iterations.");
+    }
+
+    if (kpm_config.min_energy == kpm_config.max_energy) {
+        clean_range = kpm::energy_bounds(hamiltonian, kpm_config);
+    } else {
+        clean_range = {kpm_config.min_energy, kpm_config.max_energy};
+    }
+}
+
+bool SelfConsistentLoop::run(ArrayXd const& initial) {
+    if (initial.size() != 0 && initial.size() != onsite.size()) {
+        throw std::invalid_argument(fmt::format(
+            "SelfConsistentLoop: the initial potential has {} values instead of {}.",
+            initial.size(), onsite.size()
+        ));
+    }
+
+    auto const span = trace::Span("SelfConsistentLoop::run");
+    calculation_timer.tic();
+    residuals.clear();
+    auto mixer = scf::Mixer(config);
+    potential_in = initial.size() != 0 ? initial : ArrayXd::Zero(onsite.size()).eval();
+    for (auto i = 0; i < config.max_iterations; ++i) {
+        cover(potential_in);
+        if (!strategy->change_onsite(onsite + potential_in)) {
+            throw std::runtime_error("SelfConsistentLoop: the onsite energies of the KPM "
+                                     "strategy could not be replaced.");
+        }
+
+        density_out = density(*strategy);
+        auto const potential_out = ArrayXd{potential(density_out)};
+        if (potential_out.size() != onsite.size()) {
+            throw std::invalid_argument(fmt::format(
+                "SelfConsistentLoop: the potential has {} values instead of {}.",
+                potential_out.size(), onsite.size()
+            ));
+        }
+
+        auto const residual = ArrayXd{potential_out - potential_in};
+        residuals.push_back(residual.size() != 0 ? residual.abs().maxCoeff() : 0.0);
+        if (converged() || i + 1 == config.max_iterations) {
+            break; // keep the input potential which matches the density
+        }
+        potential_in = mixer.next(potential_in, residual);
+    }
+    calculation_timer.toc();
+    return converged();
+}
+
+void SelfConsistentLoop::cover(ArrayXd const& v) {
+    auto const min_v = v.size() != 0 ? v.minCoeff() : 0.0;
+    auto const max_v = v.size() != 0 ? v.maxCoeff() : 0.0;
+    if (strategy && min_v >= covered.first && max_v <= covered.second) {
+        return;
+    }
+
+    // The margin leaves room for the next iterations before the scaling changes again
+    auto const margin = 0.1 * (clean_range.second - clean_range.first);
+    covered = {min_v - margin, max_v + margin};
+    kpm_config.min_energy = static_cast<float>(clean_range.first + covered.first);
+    kpm_config.max_energy = static_cast<float>(clean_range.second + covered.second);
+    strategy = make_strategy(hamiltonian, kpm_config);
+}
+
+} // namespace cpb
@@ -0,0 +1,401 @@
+#include "compute/ell_dispatch.hpp"
+#include "compute/detail.hpp"
+#include "support/format.hpp"
+
+#include <stdexcept>
+
+#if defined(CPB_SIMD_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+# if defined(__x86_64__)
+#  define CPB_DISPATCH_X86
+#  include <immintrin.h>
+# elif defined(__aarch64__)
+#  define CPB_DISPATCH_ARM
+#  include <arm_neon.h>
+#  if defined(__ARM_FEATURE_SVE) && defined(__linux__)
+#   define CPB_DISPATCH_SVE
+#   include <arm_sve.h>
+#   include <sys/auxv.h>
+#   ifndef HWCAP_SVE
+#    define HWCAP_SVE (1 << 22)
+#   endif
+#  endif
+# endif
+#endif
+
+namespace cpb { namespace compute { namespace ell_dispatch {
+
+namespace {
+    /// Scalar code for the remainder rows which don't fill a whole register
+    template<class scalar_t>
+    inline void scalar_column(int start, int end, scalar_t const* data, int const* indices,
+                              scalar_t const* x, scalar_t* y) {
+        for (auto row = start; row < end; ++row) {
+            y[row] += compute::detail::mul(data[row], x[indices[row]]);
+        }
+    }
+
+#ifdef CPB_DISPATCH_X86
+# define CPB_TARGET_AVX2 __attribute__((target("avx2,fma")))
+# define CPB_TARGET_AVX512 __attribute__((target("avx512f")))
+
+    /// Complex product of interleaved (re, im) pairs: `a.re * b -+ a.im * swap(b)`
+    CPB_TARGET_AVX2 inline __m256 complex_mul(__m256 a, __m256 b) {
+        auto const a_re = _mm256_moveldup_ps(a);
+        auto const a_im = _mm256_movehdup_ps(a);
+        auto const b_swap = _mm256_permute_ps(b, 0xB1);
+        return _mm256_fmaddsub_ps(a_re, b, _mm256_mul_ps(a_im, b_swap));
+    }
+
+    CPB_TARGET_AVX2 inline __m256d complex_mul(__m256d a, __m256d b) {
+        auto const a_re = _mm256_movedup_pd(a);
+        auto const a_im = _mm256_permute_pd(a, 0xF);
+        auto const b_swap = _mm256_permute_pd(b, 0x5);
+        return _mm256_fmaddsub_pd(a_re, b, _mm256_mul_pd(a_im, b_swap));
+    }
+
+    CPB_TARGET_AVX2
+    void avx2_f32(int start, int end, float const* data, int const* indices,
+                  float const* x, float* y) {
+        auto row = start;
+        for (; row + 8 <= end; row += 8) {
+            auto const i = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(indices + row));
+            auto const b = _mm256_i32gather_ps(x, i, 4);
+            auto const a = _mm256_loadu_ps(data + row);
+            auto const c = _mm256_loadu_ps(y + row);
+            _mm256_storeu_ps(y + row, _mm256_fmadd_ps(a, b, c));
+        }
+        scalar_column(row, end, data, indices, x, y);
+    }
+
+    CPB_TARGET_AVX2
+    void avx2_cf32(int start, int end, std::complex<float> const* data, int const* indices,
+                   std::complex<float> const* x, std::complex<float>* y) {
+        auto row = start;
+        for (; row + 4 <= end; row += 4) {
+            // A complex float is 8 bytes: gather the (re, im) pairs as doubles
+            auto const i = _mm_loadu_si128(reinterpret_cast<__m128i const*>(indices + row));
+            auto const b = _mm256_castpd_ps(
+                _mm256_i32gather_pd(reinterpret_cast<double const*>(x), i, 8)
+            );
+            auto const a = _mm256_loadu_ps(reinterpret_cast<float const*>(data + row));
+            auto const yp = reinterpret_cast<float*>(y + row);
+            _mm256_storeu_ps(yp, _mm256_add_ps(_mm256_loadu_ps(yp), complex_mul(a, b)));
+        }
+        scalar_column(row, end, data, indices, x, y);
+    }
+
+    CPB_TARGET_AVX2
+    void avx2_f64(int start, int end, double const* data, int const* indices,
+                  double const* x, double* y) {
+        auto row = start;
+        for (; row + 4 <= end; row += 4) {
+            auto const i = _mm_loadu_si128(reinterpret_cast<__m128i const*>(indices + row));
+            auto const b = _mm256_i32gather_pd(x, i, 8);
+            auto const a = _mm256_loadu_pd(data + row);
+            auto const c = _mm256_loadu_pd(y + row);
+            _mm256_storeu_pd(y + row, _mm256_fmadd_pd(a, b, c));
+        }
+        scalar_column(row, end, data, indices, x, y);
+    }
+
+    CPB_TARGET_AVX2
+    void avx2_cf64(int start, int end, std::complex<double> const* data, int const* indices,
+                   std::complex<double> const* x, std::complex<double>* y) {
+        auto row = start;
+        for (; row + 2 <= end; row += 2) {
+            // A complex double is a whole 128-bit lane: two loads are cheaper than a gather
+            auto const lo = _mm_loadu_pd(reinterpret_cast<double const*>(x + indices[row]));
+            auto const hi = _mm_loadu_pd(reinterpret_cast<double const*>(x + indices[row + 1]));
+            auto const b = _mm256_insertf128_pd(_mm256_castpd128_pd256(lo), hi, 1);
+            auto const a = _mm256_loadu_pd(reinterpret_cast<double const*>(data + row));
+            auto const yp = reinterpret_cast<double*>(y + row);
+            _mm256_storeu_pd(yp, _mm256_add_pd(_mm256_loadu_pd(yp), complex_mul(a, b)));
+        }
+        scalar_column(row, end, data, indices, x, y);
+    }
+
+    CPB_TARGET_AVX512 inline __m512 complex_mul(__m512 a, __m512 b) {
+        auto const a_re = _mm512_moveldup_ps(a);
+        auto const a_im = _mm512_movehdup_ps(a);
+        auto const b_swap = _mm512_permute_ps(b, 0xB1);
+        return _mm512_fmaddsub_ps(a_re, b, _mm512_mul_ps(a_im, b_swap));
+    }
+
+    CPB_TARGET_AVX512 inline __m512d complex_mul(__m512d a, __m512d b) {
+        auto const a_re = _mm512_movedup_pd(a);
+        auto const a_im = _mm512_permute_pd(a, 0xFF);
+        auto const b_swap = _mm512_permute_pd(b, 0x55);
+        return _mm512_fmaddsub_pd(a_re, b, _mm512_mul_pd(a_im, b_swap));
+    }
+
+    CPB_TARGET_AVX512
+    void avx512_f32(int start, int end, float const* data, int const* indices,
+                    float const* x, float* y) {
+        auto row = start;
+        for (; row + 16 <= end; row += 16) {
+            auto const i = _mm512_loadu_si512(indices + row);
+            auto const b = _mm512_i32gather_ps(i, x, 4);
+            auto const a = _mm512_loadu_ps(data + row);
+            auto const c = _mm512_loadu_ps(y + row);
+            _mm512_storeu_ps(y + row, _mm512_fmadd_ps(a, b, c));
+        }
+        scalar_column(row, end, data, indices, x, y);
+    }
+
+    CPB_TARGET_AVX512
+    void avx512_cf32(int start, int end, std::complex<float> const* data, int const* indices,
+                     std::complex<float> const* x, std::complex<float>* y) {
+        auto row = start;
+        for (; row + 8 <= end; row += 8) {
+            auto const i = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(indices + row));
+            auto const b = _mm512_castpd_ps(
+                _mm512_i32gather_pd(i, reinterpret_cast<double const*>(x), 8)
+            );
+            auto const a = _mm512_loadu_ps(reinterpret_cast<float const*>(data + row));
+            auto const yp = reinterpret_cast<float*>(y + row);
+            _mm512_storeu_ps(yp, _mm512_add_ps(_mm512_loadu_ps(yp), complex_mul(a, b)));
+        }
+        scalar_column(row, end, data, indices, x, y);
+    }
+
+    CPB_TARGET_AVX512
+    void avx512_f64(int start, int end, double const* data, int const* indices,
+                    double const* x, double* y) {
+        auto row = start;
+        for (; row + 8 <= end; row += 8) {
+            auto const i = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(indices + row));
+            auto const b = _mm512_i32gather_pd(i, x, 8);
+            auto const a = _mm512_loadu_pd(data + row);
+            auto const c = _mm512_loadu_pd(y + row);
+            _mm512_storeu_pd(y + row, _mm512_fmadd_pd(a, b, c));
+        }
+        scalar_column(row, end, data, indices, x, y);
+    }
+
+    CPB_TARGET_AVX512
+    void avx512_cf64(int start, int end, std::complex<double> const* data, int const* indices,
+                     std::complex<double> const* x, std::complex<double>* y) {
+        auto row = start;
+        for (; row + 4 <= end; row += 4) {
+            // Gather doubles at [2i, 2i + 1] for each of the 4 complex indices `i`
+            auto const i = _mm_loadu_si128(reinterpret_cast<__m128i const*>(indices + row));
+            auto const re = _mm_add_epi32(i, i);
+            auto const im = _mm_add_epi32(re, _mm_set1_epi32(1));
+            auto const pairs = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_unpacklo_epi32(re, im)), _mm_unpackhi_epi32(re, im), 1
+            );
+            auto const b = _mm512_i32gather_pd(pairs, reinterpret_cast<double const*>(x), 8);
+            auto const a = _mm512_loadu_pd(reinterpret_cast<double const*>(data + row));
+            auto const yp = reinterpret_cast<double*>(y + row);
+            _mm512_storeu_pd(yp, _mm512_add_pd(_mm512_loadu_pd(yp), complex_mul(a, b)));
+        }
+        scalar_column(row, end, data, indices, x, y);
+    }
+
+# undef CPB_TARGET_AVX2
+# undef CPB_TARGET_AVX512
+#endif // CPB_DISPATCH_X86
+
+#ifdef CPB_DISPATCH_ARM
+    /// NEON has no gather instruction: the lanes are loaded one by one
+    void neon_f32(int start, int end, float const* data, int const* indices,
+                  float const* x, float* y) {
+        auto row = start;
+        for (; row + 4 <= end; row += 4) {
+            auto b = vdupq_n_f32(0);
+            b = vld1q_lane_f32(x + indices[row], b, 0);
+            b = vld1q_lane_f32(x + indices[row + 1], b, 1);
+            b = vld1q_lane_f32(x + indices[row + 2], b, 2);
+            b = vld1q_lane_f32(x + indices[row + 3], b, 3);
+            vst1q_f32(y + row, vfmaq_f32(vld1q_f32(y + row), vld1q_f32(data + row), b));
+        }
+        scalar_column(row, end, data, indices, x, y);
+    }
+
+    void neon_cf32(int start, int end, std::complex<float> const* data, int const* indices,
+                   std::complex<float> const* x, std::complex<float>* y) {
+        static float const sign_data[4] = {-1, 1, -1, 1};
+        auto const sign = vld1q_f32(sign_data);
+        auto row = start;
+        for (; row + 2 <= end; row += 2) {
+            auto const b = vcombine_f32(
+                vld1_f32(reinterpret_cast<float const*>(x + indices[row])),
+                vld1_f32(reinterpret_cast<float const*>(x + indices[row + 1]))
+            );
+            auto const a = vld1q_f32(reinterpret_cast<float const*>(data + row));
+            auto const a_re = vtrn1q_f32(a, a);
+            auto const a_im = vmulq_f32(vtrn2q_f32(a, a), sign);
+            auto const yp = reinterpret_cast<float*>(y + row);
+            auto c = vfmaq_f32(vld1q_f32(yp), a_re, b);
+            c = vfmaq_f32(c, a_im, vrev64q_f32(b));
+            vst1q_f32(yp, c);
+        }
+        scalar_column(row, end, data, indices, x, y);
+    }
+
+    void neon_f64(int start, int end, double const* data, int const* indices,
+                  double const* x, double* y) {
+        auto row = start;
+        for (; row + 2 <= end; row += 2) {
+            auto b = vdupq_n_f64(0);
+            b = vld1q_lane_f64(x + indices[row], b, 0);
+            b = vld1q_lane_f64(x + indices[row + 1], b, 1);
+            vst1q_f64(y + row, vfmaq_f64(vld1q_f64(y + row), vld1q_f64(data + row), b));
+        }
+        scalar_column(row, end, data, indices, x, y);
+    }
+
+    void neon_cf64(int start, int end, std::complex<double> const* data, int const* indices,
+                   std::complex<double> const* x, std::complex<double>* y) {
+        static double const sign_data[2] = {-1, 1};
+        auto const sign = vld1q_f64(sign_data);
+        for (auto row = start; row < end; ++row) {
+            auto const b = vld1q_f64(reinterpret_cast<double const*>(x + indices[row]));
+            auto const a = vld1q_f64(reinterpret_cast<double const*>(data + row));
+            auto const a_re = vdupq_laneq_f64(a, 0);
+            auto const a_im = vmulq_f64(vdupq_laneq_f64(a, 1), sign);
+            auto const yp = reinterpret_cast<double*>(y + row);
+            auto c = vfmaq_f64(vld1q_f64(yp), a_re, b);
+            c = vfmaq_f64(c, a_im, vextq_f64(b, b, 1));
+            vst1q_f64(yp, c);
+        }
+    }
+#endif // CPB_DISPATCH_ARM
+
+#ifdef CPB_DISPATCH_SVE
+    /// Vector-length agnostic: the predicate covers the remainder, no scalar loop needed
+    void sve_f32(int start, int end, float const* data, int const* indices,
+                 float const* x, float* y) {
+        for (auto row = start; row < end; row += static_cast<int>(svcntw())) {
+            auto const pg = svwhilelt_b32_s32(row, end);
+            auto const b = svld1_gather_s32index_f32(pg, x, svld1_s32(pg, indices + row));
+            auto const c = svmla_f32_x(pg, svld1_f32(pg, y + row), svld1_f32(pg, data + row), b);
+            svst1_f32(pg, y + row, c);
+        }
+    }
+
+    void sve_cf32(int start, int end, std::complex<float> const* data, int const* indices,
+                  std::complex<float> const* x, std::complex<float>* y) {
+        auto const xd = reinterpret_cast<double const*>(x);
+        for (auto row = start; row < end; row += static_cast<int>(svcntd())) {
+            // Gather whole (re, im) pairs as 64-bit lanes, then work on the float lanes
+            auto const pg64 = svwhilelt_b64_s32(row, end);
+            auto const pg32 = svwhilelt_b32_s32(2 * row, 2 * end);
+            auto const i = svld1sw_s64(pg64, indices + row);
+            auto const b = svreinterpret_f32_f64(svld1_gather_s64index_f64(pg64, xd, i));
+            auto const a = svld1_f32(pg32, reinterpret_cast<float const*>(data + row));
+            auto const yp = reinterpret_cast<float*>(y + row);
+            auto c = svld1_f32(pg32, yp);
+            c = svcmla_f32_x(pg32, c, a, b, 0);
+            c = svcmla_f32_x(pg32, c, a, b, 90);
+            svst1_f32(pg32, yp, c);
+        }
+    }
+
+    void sve_f64(int start, int end, double const* data, int const* indices,
+                 double const* x, double* y) {
+        for (auto row = start; row < end; row += static_cast<int>(svcntd())) {
+            auto const pg = svwhilelt_b64_s32(row, end);
+            auto const b = svld1_gather_s64index_f64(pg, x, svld1sw_s64(pg, indices + row));
+            auto const c = svmla_f64_x(pg, svld1_f64(pg, y + row), svld1_f64(pg, data + row), b);
+            svst1_f64(pg, y + row, c);
+        }
+    }
+
+    void sve_cf64(int start, int end, std::complex<double> const* data, int const* indices,
+                  std::complex<double> const* x, std::complex<double>* y) {
+        auto const xd = reinterpret_cast<double const*>(x);
+        for (auto row = start; row < end; row += static_cast<int>(svcntd())) {
+            // No 128-bit gather: deinterleave into separate real and imaginary registers
+            auto const pg = svwhilelt_b64_s32(row, end);
+            auto const i = svld1sw_s64(pg, indices + row);
+            auto const i_re = svadd_s64_x(pg, i, i);
+            auto const b_re = svld1_gather_s64index_f64(pg, xd, i_re);
+            auto const b_im = svld1_gather_s64index_f64(pg, xd, svadd_n_s64_x(pg, i_re, 1));
+            auto const a = svld2_f64(pg, reinterpret_cast<double const*>(data + row));
+            auto const a_re = svget2_f64(a, 0);
+            auto const a_im = svget2_f64(a, 1);
+            auto const yp = reinterpret_cast<double*>(y + row);
+            auto const c = svld2_f64(pg, yp);
+            auto re = svmla_f64_x(pg, svget2_f64(c, 0), a_re, b_re);
+            re = svmls_f64_x(pg, re, a_im, b_im);
+            auto im = svmla_f64_x(pg, svget2_f64(c, 1), a_re, b_im);
+            im = svmla_f64_x(pg, im, a_im, b_re);
+            svst2_f64(pg, yp, svcreate2_f64(re, im));
+        }
+    }
+#endif // CPB_DISPATCH_SVE
+
+    using detail::KernelTable;
+    KernelTable const generic_kernels = {"generic", nullptr, nullptr, nullptr, nullptr};
+#ifdef CPB_DISPATCH_X86
+    KernelTable const avx2_kernels = {"avx2", avx2_f32, avx2_cf32, avx2_f64, avx2_cf64};
+    KernelTable const avx512_kernels = {"avx512", avx512_f32, avx512_cf32,
+                                        avx512_f64, avx512_cf64};
+#endif
+#ifdef CPB_DISPATCH_ARM
+    KernelTable const neon_kernels = {"neon", neon_f32, neon_cf32, neon_f64, neon_cf64};
+#endif
+#ifdef CPB_DISPATCH_SVE
+    KernelTable const sve_kernels = {"sve", sve_f32, sve_cf32, sve_f64, sve_cf64};
+#endif
+
+    /// The kernel tables which are supported by this CPU, best last
+    std::vector<KernelTable const*> supported_tables() {
+        auto tables = std::vector<KernelTable const*>{&generic_kernels};
+#ifdef CPB_DISPATCH_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            tables.push_back(&avx2_kernels);
+        }
+        if (__builtin_cpu_supports("avx512f")) {
+            tables.push_back(&avx512_kernels);
+        }
+#endif
+#ifdef CPB_DISPATCH_ARM
+        tables.push_back(&neon_kernels);
+#endif
+#ifdef CPB_DISPATCH_SVE
+        if (getauxval(AT_HWCAP) & HWCAP_SVE) {
+            tables.push_back(&sve_kernels);
+        }
+#endif
+        return tables;
+    }
+} // anonymous namespace
+
+namespace detail {
+    std::atomic<KernelTable const*> active{nullptr};
+
+    KernelTable const* select_best() {
+        auto expected = static_cast<KernelTable const*>(nullptr);
+        active.compare_exchange_strong(expected, supported_tables().back());
+        return active.load();
+    }
+} // namespace detail
+
+std::string active_isa() {
+    return detail::table().isa;
+}
+
+std::vector<std::string> available_isas() {
+    auto names = std::vector<std::string>();
+    for (auto const t : supported_tables()) {
+        names.push_back(t->isa);
+    }
+    return names;
+}
+
+void set_isa(std::string const& name) {
+    for (auto const t : supported_tables()) {
+        if (name == t->isa) {
+            detail::active = t;
+            return;
+        }
+    }
+    throw std::invalid_argument(
+        fmt::format("The '{}' instruction set is not available on this CPU or build", name)
+    );
+}
+
+}}} // namespace cpb::compute::ell_dispatch
@@ -0,0 +1,100 @@
+#include "distributed/Communicator.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+#include <string>
+
+#ifdef CPB_USE_MPI
+# include <mpi.h>
+#endif
+
+namespace cpb { namespace dist {
+
+void SerialCommunicator::alltoallv(void const* send, int const* send_bytes,
+                                   int const* send_displs, void* recv, int const* recv_bytes,
+                                   int const* recv_displs) {
+    assert(send_bytes[0] == recv_bytes[0]);
+    static_cast<void>(recv_bytes);
+    auto const src = static_cast<char const*>(send) + send_displs[0];
+    std::copy_n(src, send_bytes[0], static_cast<char*>(recv) + recv_displs[0]);
+}
+
+#ifdef CPB_USE_MPI
+namespace {
+
+void check(int error) {
+    if (error != MPI_SUCCESS) {
+        char message[MPI_MAX_ERROR_STRING];
+        auto length = 0;
+        MPI_Error_string(error, message, &length);
+        throw std::runtime_error("MPI error: " + std::string(message, length));
+    }
+}
+
+class MpiCommunicator : public Communicator {
+public:
+    MpiCommunicator() {
+        auto is_initialized = 0;
+        check(MPI_Initialized(&is_initialized));
+        if (!is_initialized) {
+            throw std::runtime_error("MPI must be initialized before creating a communicator");
+        }
+        check(MPI_Comm_rank(MPI_COMM_WORLD, &this_rank));
+        check(MPI_Comm_size(MPI_COMM_WORLD, &num_ranks));
+    }
+
+    int rank() const override { return this_rank; }
+    int size() const override { return num_ranks; }
+
+    std::vector<int> allgather(int value) override {
+        auto result = std::vector<int>(num_ranks);
+        check(MPI_Allgather(&value, 1, MPI_INT, result.data(), 1, MPI_INT, MPI_COMM_WORLD));
+        return result;
+    }
+
+    void allreduce_sum(double* data, int size) override {
+        check(MPI_Allreduce(MPI_IN_PLACE, data, size, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD));
+    }
+
+    /// Point-to-point messages only between ranks which exchange data: with a spatial
+    /// partition, a rank only talks to its neighbors and the cost doesn't grow with `size()`
+    void alltoallv(void const* send, int const* send_bytes, int const* send_displs,
+                   void* recv, int const* recv_bytes, int const* recv_displs) override {
+        requests.clear();
+        for (auto r = 0; r < num_ranks; ++r) {
+            if (recv_bytes[r] > 0) {
+                requests.emplace_back();
+                check(MPI_Irecv(static_cast<char*>(recv) + recv_displs[r], recv_bytes[r],
+                                MPI_BYTE, r, tag, MPI_COMM_WORLD, &requests.back()));
+            }
+        }
+        for (auto r = 0; r < num_ranks; ++r) {
+            if (send_bytes[r] > 0) {
+                requests.emplace_back();
+                auto const data = static_cast<char const*>(send) + send_displs[r];
+                check(MPI_Isend(const_cast<char*>(data), send_bytes[r], MPI_BYTE, r, tag,
+                                MPI_COMM_WORLD, &requests.back()));
+            }
+        }
+        check(MPI_Waitall(static_cast<int>(requests.size()), requests.data(),
+                          MPI_STATUSES_IGNORE));
+    }
+
+private:
+    static constexpr int tag = 0x6b706d; // "kpm"
+    int this_rank = 0;
+    int num_ranks = 1;
+    std::vector<MPI_Request> requests;
+};
+
+constexpr int MpiCommunicator::tag;
+
+} // anonymous namespace
+
+std::unique_ptr<Communicator> make_mpi_communicator() {
+    return std::unique_ptr<Communicator>(new MpiCommunicator());
+}
+#endif // CPB_USE_MPI
+
+}} // namespace cpb::dist
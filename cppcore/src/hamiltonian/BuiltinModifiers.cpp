@@ -0,0 +1,208 @@
+#include "hamiltonian/BuiltinModifiers.hpp"
+#include "system/Cache.hpp"
+#include "numeric/constant.hpp"
+#include "numeric/random.hpp"
+#include "detail/sugar.hpp"
+
+#include "support/format.hpp"
+
+#include <atomic>
+#include <random>
+#include <stdexcept>
+
+namespace cpb { namespace builtin {
+
+namespace {
+    struct MagneticFieldOp {
+        float magnitude;
+        CartesianArray const& pos1;
+        CartesianArray const& pos2;
+
+        static constexpr auto scale = 1e-18f; // both A and the coordinates are in [nm]
+
+        template<class Array>
+        void operator()(Array) const {} // only complex Hamiltonians, see `is_complex`
+
+        template<class real_t>
+        void operator()(Map<ArrayX<std::complex<real_t>>> energy) const {
+            using scalar_t = std::complex<real_t>;
+            auto const k = static_cast<scalar_t>(scale * 2 * constant::pi / constant::phi0);
+            // integral of (A * dl) from position 1 to position 2
+            auto const vp_x = 0.5f * magnitude * (pos1.y + pos2.y);
+            auto const peierls = vp_x * (pos1.x - pos2.x);
+            energy *= exp(scalar_t{constant::i1} * k * peierls.template cast<scalar_t>());
+        }
+    };
+
+    struct AddPotentialOp {
+        ArrayXf const& potential;
+
+        template<class Array>
+        void operator()(Array energy) const {
+            using scalar_t = typename Array::Scalar;
+            energy += potential.template cast<scalar_t>();
+        }
+    };
+
+    struct ScaleOp {
+        ArrayXf const& factor;
+
+        template<class Array>
+        void operator()(Array energy) const {
+            using scalar_t = typename Array::Scalar;
+            energy *= factor.template cast<scalar_t>();
+        }
+    };
+
+    /// Pass the energy to a native function as an array of doubles (see `native_onsite()`):
+    /// `call(double* energy)`. Double precision values are passed without a copy.
+    template<class F>
+    struct NativeCallOp {
+        bool is_complex;
+        F call;
+
+        void operator()(Map<ArrayXd> energy) const { call(energy.data()); }
+
+        void operator()(Map<ArrayXf> energy) const {
+            ArrayXd values = energy.cast<double>();
+            call(values.data());
+            energy = values.cast<float>();
+        }
+
+        void operator()(Map<ArrayXcd> energy) const {
+            if (is_complex) {
+                call(reinterpret_cast<double*>(energy.data()));
+            } else {
+                ArrayXd values = energy.real();
+                call(values.data());
+                energy.real() = values;
+            }
+        }
+
+        void operator()(Map<ArrayXcf> energy) const {
+            if (is_complex) {
+                ArrayXcd values = energy.cast<std::complex<double>>();
+                call(reinterpret_cast<double*>(values.data()));
+                energy = values.cast<std::complex<float>>();
+            } else {
+                ArrayXd values = energy.real().cast<double>();
+                call(values.data());
+                energy.real() = values.cast<float>();
+            }
+        }
+    };
+
+    template<class F>
+    NativeCallOp<F> native_call(bool is_complex, F call) { return {is_complex, call}; }
+
+    /// The `name` and the exact bytes of the arguments (in hexadecimal), see
+    /// `Model::parameter_hash()`
+    template<class... Args>
+    std::string fingerprint(char const* name, Args const&... args) {
+        auto h = cache::Hasher();
+        detail::eval_ordered({(h.add(args), 0)...});
+        auto result = std::string(name) + ":";
+        for (auto const byte : h.key()) {
+            result += fmt::format("{:02x}", static_cast<unsigned char>(byte));
+        }
+        return result;
+    }
+
+    /// A native function can't be identified by its address: once it's freed, another one
+    /// may be compiled at the same address. Each modifier gets a new id instead, so only its
+    /// copies share the cached results. The random value keeps the cache files of other
+    /// processes from matching it.
+    std::string unique_native_id() {
+        static auto const nonce = (std::uint64_t{std::random_device{}()} << 32)
+                                  ^ std::random_device{}();
+        static std::atomic<std::uint64_t> counter{0};
+        return fmt::format("{:016x}-{}", nonce, counter++);
+    }
+} // anonymous namespace
+
+HoppingModifier constant_magnetic_field(float magnitude) {
+    auto modifier = HoppingModifier([magnitude](ComplexArrayRef energy,
+                                                CartesianArray const& pos1,
+                                                CartesianArray const& pos2, HopIdRef) {
+        num::match<ArrayX>(energy, MagneticFieldOp{magnitude, pos1, pos2});
+    }, /*is_complex*/true, /*is_double*/false, /*is_thread_safe*/true);
+    modifier.fingerprint = fingerprint("constant_magnetic_field", magnitude);
+    return modifier;
+}
+
+OnsiteModifier linear_electric_field(Cartesian field) {
+    auto modifier = OnsiteModifier([field](ComplexArrayRef energy, CartesianArray const& pos,
+                                           SubIdRef) {
+        ArrayXf const potential = field.x() * pos.x + field.y() * pos.y + field.z() * pos.z;
+        num::match<ArrayX>(energy, AddPotentialOp{potential});
+    }, /*is_complex*/false, /*is_double*/false, /*is_thread_safe*/true);
+    modifier.fingerprint = fingerprint("linear_electric_field", field);
+    return modifier;
+}
+
+HoppingModifier strained_hopping(float beta, float bond_length) {
+    auto modifier = HoppingModifier([beta, bond_length](ComplexArrayRef energy,
+                                                        CartesianArray const& pos1,
+                                                        CartesianArray const& pos2, HopIdRef) {
+        auto const l = sqrt((pos1.x - pos2.x).square() + (pos1.y - pos2.y).square()
+                            + (pos1.z - pos2.z).square());
+        ArrayXf const factor = exp(-beta * (l / bond_length - 1));
+        num::match<ArrayX>(energy, ScaleOp{factor});
+    }, /*is_complex*/false, /*is_double*/false, /*is_thread_safe*/true);
+    modifier.fingerprint = fingerprint("strained_hopping", beta, bond_length);
+    return modifier;
+}
+
+OnsiteModifier onsite_disorder(float width, std::uint32_t seed) {
+    auto modifier = OnsiteModifier([width, seed](ComplexArrayRef energy,
+                                                 CartesianArray const& pos, SubIdRef sub) {
+        // Generated in single precision regardless of the scalar type of the Hamiltonian
+        auto const rng = num::Philox(seed);
+        auto potential = ArrayXf(pos.size());
+        for (auto i = 0; i < potential.size(); ++i) {
+            auto const id = static_cast<std::uint32_t>(sub.ids[i]);
+            auto const u = num::position_uniform(rng, pos.x[i], pos.y[i], pos.z[i], id);
+            potential[i] = width * (u - 0.5f);
+        }
+        num::match<ArrayX>(energy, AddPotentialOp{potential});
+    }, /*is_complex*/false, /*is_double*/false, /*is_thread_safe*/true);
+    modifier.fingerprint = fingerprint("onsite_disorder", width, seed);
+    return modifier;
+}
+
+OnsiteModifier native_onsite(NativeOnsiteFunction function, bool is_complex, bool is_double) {
+    if (!function) {
+        throw std::invalid_argument("native_onsite: the function pointer is null.");
+    }
+    auto modifier = OnsiteModifier([function, is_complex](ComplexArrayRef energy,
+                                                          CartesianArray const& pos,
+                                                          SubIdRef sub) {
+        auto const n = static_cast<std::int64_t>(pos.size());
+        num::match<ArrayX>(energy, native_call(is_complex, [&](double* values) {
+            function(values, pos.x.data(), pos.y.data(), pos.z.data(), sub.ids.data(), n);
+        }));
+    }, is_complex, is_double, /*is_thread_safe*/true);
+    modifier.fingerprint = fingerprint("native_onsite", unique_native_id(), is_complex, is_double);
+    return modifier;
+}
+
+HoppingModifier native_hopping(NativeHoppingFunction function, bool is_complex,
+                               bool is_double) {
+    if (!function) {
+        throw std::invalid_argument("native_hopping: the function pointer is null.");
+    }
+    auto modifier = HoppingModifier([function, is_complex](ComplexArrayRef energy,
+                                                           CartesianArray const& pos1,
+                                                           CartesianArray const& pos2,
+                                                           HopIdRef hopping) {
+        auto const n = static_cast<std::int64_t>(pos1.size());
+        num::match<ArrayX>(energy, native_call(is_complex, [&](double* values) {
+            function(values, pos1.x.data(), pos1.y.data(), pos1.z.data(),
+                     pos2.x.data(), pos2.y.data(), pos2.z.data(), hopping.ids.data(), n);
+        }));
+    }, is_complex, is_double, /*is_thread_safe*/true);
+    modifier.fingerprint = fingerprint("native_hopping", unique_native_id(), is_complex, is_double);
+    return modifier;
+}
+
+}} // namespace cpb::builtin
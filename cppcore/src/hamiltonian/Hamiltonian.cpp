@@ -33,6 +33,159 @@ struct Cols {
     int operator()(SparseMatrixRC<scalar_t> const& m) const { return m->cols(); }
 };
 
+struct DiffersOnlyInOnsite {
+    Hamiltonian const& other;
+
+    template<class scalar_t>
+    bool operator()(SparseMatrixRC<scalar_t> const& p) const {
+        if (!p || !ham::is<scalar_t>(other) || !ham::get_shared_ptr<scalar_t>(other)) {
+            return false;
+        }
+
+        auto const& a = *p;
+        auto const& b = ham::get_reference<scalar_t>(other);
+        if (&a == &b) {
+            return true;
+        }
+        if (a.rows() != b.rows() || a.nonZeros() != b.nonZeros()
+            || !a.isCompressed() || !b.isCompressed()) {
+            return false;
+        }
+
+        auto const rows = static_cast<int>(a.rows());
+        auto const nnz = static_cast<int>(a.nonZeros());
+        if (!std::equal(a.outerIndexPtr(), a.outerIndexPtr() + rows + 1, b.outerIndexPtr())
+            || !std::equal(a.innerIndexPtr(), a.innerIndexPtr() + nnz, b.innerIndexPtr())) {
+            return false;
+        }
+
+        for (auto row = 0; row < rows; ++row) {
+            for (auto n = a.outerIndexPtr()[row]; n < a.outerIndexPtr()[row + 1]; ++n) {
+                if (a.innerIndexPtr()[n] != row && a.valuePtr()[n] != b.valuePtr()[n]) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+struct Velocity {
+    System const& system;
+    Cartesian direction;
+
+    template<class scalar_t>
+    Hamiltonian operator()(SparseMatrixRC<scalar_t> const& p) const {
+        using real_t = num::get_real_t<scalar_t>;
+        auto const& h = *p;
+        auto buffer = CartesianArray();
+        auto const& r = system.expanded_positions(buffer);
+        if (h.rows() != system.num_sites()) {
+            throw std::runtime_error("velocity: the Hamiltonian doesn't match the system");
+        }
+        ArrayX<real_t> const x = (r.x * direction.x() + r.y * direction.y()
+                                  + r.z * direction.z()).template cast<real_t>();
+
+        // Boundary hopping (i, j) connects site `i` to the image of `j` at `r_j - shift`
+        auto boundary_shift = SparseMatrixX<real_t>(h.rows(), h.cols());
+        if (!system.boundaries.empty()) {
+            auto triplets = std::vector<Eigen::Triplet<real_t>>();
+            for (auto const& b : system.boundaries) {
+                auto const s = static_cast<real_t>(b.shift.dot(direction));
+                sparse::make_loop(b.hoppings).for_each([&](int i, int j, hop_id) {
+                    triplets.emplace_back(i, j, -s);
+                    triplets.emplace_back(j, i, s);
+                });
+            }
+            boundary_shift.setFromTriplets(triplets.begin(), triplets.end());
+        }
+
+        auto v = std::make_shared<SparseMatrixX<scalar_t>>(h);
+        v->makeCompressed();
+        auto const indptr = v->outerIndexPtr();
+        auto const indices = v->innerIndexPtr();
+        auto const data = v->valuePtr();
+        for (auto i = 0; i < v->outerSize(); ++i) {
+            for (auto n = indptr[i]; n < indptr[i + 1]; ++n) {
+                auto const j = indices[n];
+                auto d = x[j] - x[i];
+                if (boundary_shift.nonZeros() > 0) {
+                    d += boundary_shift.coeff(i, j);
+                }
+                data[n] *= d;
+            }
+        }
+        return v;
+    }
+};
+
+struct RemoveSites {
+    ArrayXi const& new_index;
+
+    template<class scalar_t>
+    Hamiltonian operator()(SparseMatrixRC<scalar_t> const& p) const {
+        auto matrix = std::make_shared<SparseMatrixX<scalar_t>>();
+        auto reduced = sparse::remove_rows_and_cols(*p, new_index);
+        matrix->swap(reduced);
+        return matrix;
+    }
+};
+
+struct IsValidParts {
+    template<class T>
+    bool operator()(std::shared_ptr<T const> const& p) const { return p != nullptr; }
+};
+
+struct ResetParts {
+    template<class T>
+    void operator()(std::shared_ptr<T const>& p) const { p.reset(); }
+};
+
+struct AtWaveVector {
+    Cartesian k_vector;
+
+    template<class scalar_t>
+    Hamiltonian operator()(std::shared_ptr<detail::PeriodicParts<scalar_t> const> const& p) const {
+        auto matrix = std::make_shared<SparseMatrixX<scalar_t>>();
+        detail::assemble_periodic(*matrix, *p, k_vector);
+        return matrix;
+    }
+};
+
+struct WithDiagonal {
+    template<class scalar_t>
+    Hamiltonian operator()(SparseMatrixRC<scalar_t> const& h) const {
+        auto triplets = std::vector<Eigen::Triplet<scalar_t>>();
+        triplets.reserve(static_cast<size_t>(h->nonZeros() + h->rows()));
+        auto const h_view = sparse::make_loop(*h);
+        for (auto row = 0; row < h->rows(); ++row) {
+            triplets.emplace_back(row, row, scalar_t{0});
+            h_view.for_each_in_row(row, [&](int col, scalar_t value) {
+                triplets.emplace_back(row, col, value);
+            });
+        }
+
+        auto matrix = std::make_shared<SparseMatrixX<scalar_t>>(h->rows(), h->cols());
+        matrix->setFromTriplets(triplets.begin(), triplets.end()); // duplicates are summed
+        matrix->makeCompressed();
+        return matrix;
+    }
+};
+
+struct RealDiagonal {
+    template<class scalar_t>
+    ArrayXd operator()(SparseMatrixRC<scalar_t> const& h) const {
+        auto diagonal = ArrayXd{ArrayXd::Zero(h->rows())};
+        auto const h_view = sparse::make_loop(*h);
+        for (auto row = 0; row < h->rows(); ++row) {
+            h_view.for_each_in_row(row, [&](int col, scalar_t value) {
+                if (col == row) { diagonal[row] = static_cast<double>(std::real(value)); }
+            });
+        }
+        return diagonal;
+    }
+};
+
 } // namespace
 
 Hamiltonian::operator bool() const {
@@ -59,4 +212,39 @@ int Hamiltonian::cols() const {
     return var::apply_visitor(Cols(), variant_matrix);
 }
 
+PeriodicHamiltonian::operator bool() const {
+    return var::apply_visitor(IsValidParts(), variant_parts);
+}
+
+void PeriodicHamiltonian::reset() {
+    return var::apply_visitor(ResetParts(), variant_parts);
+}
+
+Hamiltonian PeriodicHamiltonian::at(Cartesian k_vector) const {
+    return var::apply_visitor(AtWaveVector{k_vector}, variant_parts);
+}
+
+namespace ham {
+
+bool differs_only_in_onsite(Hamiltonian const& a, Hamiltonian const& b) {
+    return var::apply_visitor(DiffersOnlyInOnsite{b}, a.get_variant());
+}
+
+Hamiltonian velocity(Hamiltonian const& h, System const& system, Cartesian direction) {
+    return var::apply_visitor(Velocity{system, direction}, h.get_variant());
+}
+
+Hamiltonian remove_sites(Hamiltonian const& h, ArrayXi const& new_index) {
+    return var::apply_visitor(RemoveSites{new_index}, h.get_variant());
+}
+
+Hamiltonian with_diagonal(Hamiltonian const& h) {
+    return var::apply_visitor(WithDiagonal{}, h.get_variant());
+}
+
+ArrayXd real_diagonal(Hamiltonian const& h) {
+    return var::apply_visitor(RealDiagonal{}, h.get_variant());
+}
+
+} // namespace ham
 } // namespace cpb
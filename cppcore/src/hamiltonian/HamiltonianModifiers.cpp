@@ -1,5 +1,9 @@
 #include "hamiltonian/HamiltonianModifiers.hpp"
 
+#ifdef __linux__
+# include <unistd.h>
+#endif
+
 namespace cpb {
 
 bool HamiltonianModifiers::any_complex() const {
@@ -22,9 +26,47 @@ bool HamiltonianModifiers::any_double() const {
     return double_potential || double_hoppings;
 }
 
+bool HamiltonianModifiers::all_thread_safe() const {
+    return std::all_of(hopping.begin(), hopping.end(),
+                       [](HoppingModifier const& h) { return h.is_thread_safe; });
+}
+
+bool HamiltonianModifiers::all_onsite_thread_safe() const {
+    return std::all_of(onsite.begin(), onsite.end(),
+                       [](OnsiteModifier const& o) { return o.is_thread_safe; });
+}
+
 void HamiltonianModifiers::clear() {
     onsite.clear();
     hopping.clear();
 }
 
+namespace detail {
+namespace {
+
+/// Size of the given cache level in bytes, or a conservative guess if it can't be determined
+long cache_size(int level) {
+#if defined(__linux__) && defined(_SC_LEVEL2_CACHE_SIZE) && defined(_SC_LEVEL3_CACHE_SIZE)
+    auto const size = sysconf(level == 2 ? _SC_LEVEL2_CACHE_SIZE : _SC_LEVEL3_CACHE_SIZE);
+    if (size > 0) {
+        return size;
+    }
+#endif
+    return level == 2 ? 256 * 1024 : 4 * 1024 * 1024;
+}
+
+} // anonymous namespace
+
+int hopping_chunk_size(int bytes_per_hopping, int max_hoppings, bool is_parallel) {
+    // Only half of the cache: the modifier functions also need room for temporaries
+    static auto const l2_size = cache_size(2);
+    static auto const l3_size = cache_size(3);
+    auto const bytes = (is_parallel ? l2_size : std::max(l2_size, l3_size)) / 2;
+
+    constexpr auto min_chunk_size = 4096; ///< amortize the cost of calling a (Python) modifier
+    auto const chunk_size = std::max(static_cast<int>(bytes / bytes_per_hopping), min_chunk_size);
+    return std::max(std::min(chunk_size, max_hoppings), 1);
+}
+
+} // namespace detail
 } // namespace cpb
@@ -0,0 +1,148 @@
+#include "hamiltonian/PointSymmetry.hpp"
+#include "numeric/constant.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+namespace cpb {
+namespace {
+
+/// Linear map of the xy plane (rotation or mirror), z is unchanged
+struct Transform {
+    float xx, xy, yx, yy;
+
+    Cartesian operator()(Cartesian p) const {
+        return {xx * p.x() + xy * p.y(), yx * p.x() + yy * p.y(), p.z()};
+    }
+};
+
+std::vector<Transform> candidate_transforms() {
+    using constant::pi;
+    auto result = std::vector<Transform>();
+    for (auto degrees : {60, 90, 120, 180, 240, 270, 300}) {
+        auto const t = degrees * pi / 180;
+        result.push_back({std::cos(t), -std::sin(t), std::sin(t), std::cos(t)});
+    }
+    for (auto degrees = 0; degrees < 180; degrees += 15) { // angle of the mirror line
+        auto const t = 2 * degrees * pi / 180;
+        result.push_back({std::cos(t), std::sin(t), std::sin(t), -std::cos(t)});
+    }
+    return result;
+}
+
+/// Site permutation of the `transform` about `center` or empty if it doesn't map the sites
+/// onto each other. A site of the same sublattice is preferred as the image, but others are
+/// also accepted, e.g. graphene's A and B are exchanged by a 180 degree rotation.
+ArrayXi site_permutation(System const& system, CartesianArray const& positions,
+                         Cartesian center, Transform const& transform, float tolerance) {
+    auto const& index = system.spatial_index();
+    auto const num_sites = system.num_sites();
+    auto permutation = ArrayXi(num_sites);
+    auto is_taken = std::vector<bool>(static_cast<std::size_t>(num_sites), false);
+    for (auto i = 0; i < num_sites; ++i) {
+        auto const image = Cartesian{center + transform(positions[i] - center)};
+        auto j = -1;
+        for (auto candidate : index.within(image, tolerance)) {
+            if (is_taken[candidate]) {
+                continue;
+            }
+            if (j < 0 || system.sublattices[candidate] == system.sublattices[i]) {
+                j = candidate;
+            }
+        }
+        if (j < 0) {
+            return {};
+        }
+        is_taken[j] = true;
+        permutation[i] = j;
+    }
+    return permutation;
+}
+
+/// Does the permutation `p` leave the Hamiltonian matrix unchanged?
+struct IsInvariant {
+    ArrayXi const& p;
+
+    template<class scalar_t>
+    bool operator()(SparseMatrixRC<scalar_t> const& matrix) const {
+        using real_t = num::get_real_t<scalar_t>;
+        auto const& h = *matrix;
+        assert(h.isCompressed());
+        auto const indptr = h.outerIndexPtr();
+        auto const indices = h.innerIndexPtr();
+        auto const data = h.valuePtr();
+
+        // Both have the same number of non-zeros, so each element only needs a partner
+        for (auto row = 0; row < h.rows(); ++row) {
+            auto const image_row = p[row];
+            auto const begin = indices + indptr[image_row];
+            auto const end = indices + indptr[image_row + 1];
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                auto const it = std::lower_bound(begin, end, p[indices[n]]);
+                if (it == end || *it != p[indices[n]]) {
+                    return false;
+                }
+                auto const value = data[n];
+                auto const image_value = data[it - indices];
+                if (std::abs(image_value - value) > real_t{1e-4f} * (1 + std::abs(value))) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+} // anonymous namespace
+
+std::vector<int> PointSymmetry::orbit_representatives() const {
+    auto result = std::vector<int>();
+    for (auto i = 0; i < representatives.size(); ++i) {
+        if (representatives[i] == i) { result.push_back(i); }
+    }
+    return result;
+}
+
+namespace ham {
+
+PointSymmetry find_point_symmetry(System const& system, Hamiltonian const& h, float tolerance) {
+    auto result = PointSymmetry();
+    auto const num_sites = system.num_sites();
+    result.representatives = ArrayXi::LinSpaced(num_sites, 0, num_sites - 1);
+    if (num_sites == 0 || !system.boundaries.empty() || h.rows() != num_sites) {
+        return result;
+    }
+
+    auto buffer = CartesianArray();
+    auto const& positions = system.expanded_positions(buffer);
+    Cartesian const center = {positions.x.mean(), positions.y.mean(), positions.z.mean()};
+
+    for (auto const& transform : candidate_transforms()) {
+        auto permutation = site_permutation(system, positions, center, transform, tolerance);
+        if (permutation.size() != 0
+            && var::apply_visitor(IsInvariant{permutation}, h.get_variant())) {
+            result.permutations.push_back(std::move(permutation));
+        }
+    }
+
+    // Orbits: repeatedly take the lowest representative of the images until nothing changes
+    auto& rep = result.representatives;
+    auto changed = !result.permutations.empty();
+    while (changed) {
+        changed = false;
+        for (auto const& p : result.permutations) {
+            for (auto i = 0; i < num_sites; ++i) {
+                auto const lowest = std::min(rep[i], rep[p[i]]);
+                if (rep[i] != lowest || rep[p[i]] != lowest) {
+                    rep[i] = rep[p[i]] = lowest;
+                    changed = true;
+                }
+            }
+        }
+    }
+    return result;
+}
+
+} // namespace ham
+} // namespace cpb
@@ -3,25 +3,234 @@
 
 #include "compute/lanczos.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <map>
+#include <deque>
+#include <tuple>
+
 namespace cpb { namespace kpm {
 
+namespace {
+    template<class scalar_t, class real_t = num::get_real_t<scalar_t>>
+    ArrayX<real_t> real_diagonal(SparseMatrixX<scalar_t> const& matrix) {
+        auto diagonal = ArrayX<real_t>::Zero(matrix.rows()).eval();
+        sparse::Loop<scalar_t>(matrix).for_each([&](int row, int col, scalar_t value) {
+            if (row == col) { diagonal[row] = std::real(value); }
+        });
+        return diagonal;
+    }
+
+    /// Lower and upper bound of the spectrum given by the union of Gershgorin discs
+    template<class scalar_t, class real_t = num::get_real_t<scalar_t>>
+    std::pair<real_t, real_t> gershgorin_bounds(SparseMatrixX<scalar_t> const& matrix) {
+        auto radius = ArrayX<real_t>::Zero(matrix.rows()).eval();
+        sparse::Loop<scalar_t>(matrix).for_each([&](int row, int col, scalar_t value) {
+            if (row != col) { radius[row] += std::abs(value); }
+        });
+        auto const center = real_diagonal(matrix);
+        return {(center - radius).minCoeff(), (center + radius).maxCoeff()};
+    }
+
+    /// Hash of the structure and values of the matrix (FNV-1a, 64-bit)
+    template<class scalar_t>
+    std::uint64_t fingerprint(SparseMatrixX<scalar_t> const& matrix, float precision) {
+        auto hash = std::uint64_t{14695981039346656037u};
+        auto const add = [&](void const* data, std::size_t bytes) {
+            auto const p = static_cast<unsigned char const*>(data);
+            for (auto i = std::size_t{0}; i < bytes; ++i) {
+                hash = (hash ^ p[i]) * std::uint64_t{1099511628211u};
+            }
+        };
+
+        auto const rows = matrix.rows();
+        auto const nnz = matrix.nonZeros();
+        add(&rows, sizeof(rows));
+        add(&nnz, sizeof(nnz));
+        add(&precision, sizeof(precision));
+        add(matrix.outerIndexPtr(), sizeof(*matrix.outerIndexPtr()) * (rows + 1));
+        add(matrix.innerIndexPtr(), sizeof(*matrix.innerIndexPtr()) * nnz);
+        add(matrix.valuePtr(), sizeof(scalar_t) * nnz);
+        return hash;
+    }
+
+    template<class scalar_t>
+    std::size_t matrix_bytes(SparseMatrixX<scalar_t> const& matrix) {
+        return static_cast<std::size_t>(matrix.nonZeros()) * (sizeof(scalar_t) + sizeof(int))
+               + static_cast<std::size_t>(matrix.rows() + 1) * sizeof(int);
+    }
+
+    /// Same structure and values, bit for bit
+    template<class scalar_t>
+    bool is_identical(SparseMatrixX<scalar_t> const& a, SparseMatrixX<scalar_t> const& b) {
+        auto const rows = a.rows();
+        auto const nnz = a.nonZeros();
+        return rows == b.rows() && a.cols() == b.cols() && nnz == b.nonZeros()
+               && std::equal(a.outerIndexPtr(), a.outerIndexPtr() + rows + 1, b.outerIndexPtr())
+               && std::equal(a.innerIndexPtr(), a.innerIndexPtr() + nnz, b.innerIndexPtr())
+               && std::memcmp(a.valuePtr(), b.valuePtr(), sizeof(scalar_t) * nnz) == 0;
+    }
+
+    /// Lanczos results of recent matrices, shared by all threads. Each entry keeps a copy of
+    /// its matrix: a hash match is only a hit if the matrices are identical.
+    template<class scalar_t>
+    class LanczosCache {
+        using real_t = num::get_real_t<scalar_t>;
+
+    public:
+        /// Total size of the matrix copies, the oldest entries are dropped to stay within it
+        static constexpr std::size_t max_bytes = 256u * 1024u * 1024u;
+
+        bool find(std::uint64_t key, SparseMatrixX<scalar_t> const& matrix, float precision,
+                  compute::LanczosBounds<real_t>& result) {
+            std::lock_guard<std::mutex> lk(mutex);
+            auto const it = entries.find(key);
+            if (it == entries.end() || it->second.precision != precision
+                || !is_identical(it->second.matrix, matrix)) {
+                return false;
+            }
+            result = it->second.result;
+            return true;
+        }
+
+        void insert(std::uint64_t key, SparseMatrixX<scalar_t> const& matrix, float precision,
+                    compute::LanczosBounds<real_t> const& result) {
+            auto const bytes = matrix_bytes(matrix);
+            if (bytes > max_bytes) {
+                return; // not worth evicting everything else
+            }
+
+            std::lock_guard<std::mutex> lk(mutex);
+            if (entries.count(key) != 0) {
+                return; // the first one stays, a collision is simply a miss for the other
+            }
+            while (!order.empty() && total_bytes + bytes > max_bytes) {
+                total_bytes -= matrix_bytes(entries.at(order.front()).matrix);
+                entries.erase(order.front());
+                order.pop_front();
+            }
+            entries.emplace(key, Entry{matrix, precision, result});
+            order.push_back(key);
+            total_bytes += bytes;
+        }
+
+        static LanczosCache& instance() {
+            static LanczosCache cache;
+            return cache;
+        }
+
+    private:
+        struct Entry {
+            SparseMatrixX<scalar_t> matrix;
+            float precision;
+            compute::LanczosBounds<real_t> result;
+        };
+
+        std::mutex mutex;
+        std::map<std::uint64_t, Entry> entries;
+        std::deque<std::uint64_t> order; ///< oldest first
+        std::size_t total_bytes = 0;
+    };
+} // anonymous namespace
+
+template<class scalar_t>
+constexpr float Bounds<scalar_t>::max_widening;
+
+template<class scalar_t>
+bool Bounds<scalar_t>::shift_diagonal(SparseMatrixX<scalar_t> const& previous,
+                                      SparseMatrixX<scalar_t> const* new_matrix) {
+    matrix = new_matrix;
+    if (!factors) {
+        return true; // nothing computed yet, Lanczos will be done on the new matrix if needed
+    }
+    if (matrix->rows() == 0 || matrix->rows() != previous.rows()) {
+        return false;
+    }
+
+    timer.tic();
+    // Adding a diagonal matrix `D` moves each eigenvalue by at least `min(D)` and at most
+    // `max(D)` (Weyl's inequality) and the Gershgorin discs of the new matrix may be tighter
+    ArrayX<real_t> const delta = real_diagonal(*matrix) - real_diagonal(previous);
+    auto const gershgorin = gershgorin_bounds(*matrix);
+    auto const new_min = std::max(min + delta.minCoeff(), gershgorin.first);
+    auto const new_max = std::min(max + delta.maxCoeff(), gershgorin.second);
+    timer.toc();
+
+    if (new_max - new_min > (max - min) * (1 + max_widening)) {
+        return false;
+    }
+
+    min = new_min;
+    max = new_max;
+    factors = {min, max};
+    is_shifted = true;
+    return true;
+}
+
 template<class scalar_t>
 void Bounds<scalar_t>::compute_factors() {
     timer.tic();
-    auto const lanczos = compute::minmax_eigenvalues(*matrix, precision_percent);
+    is_shifted = false;
+    if (method == BoundsMethod::Gershgorin) {
+        std::tie(min, max) = gershgorin_bounds(*matrix);
+        lanczos_loops = 0;
+    } else {
+        compute_lanczos();
+    }
+    factors = {min, max};
+    timer.toc();
+}
+
+template<class scalar_t>
+void Bounds<scalar_t>::compute_lanczos() {
+    auto lanczos = compute::LanczosBounds<real_t>();
+    auto const precision = static_cast<float>(precision_percent);
+    auto const key = use_cache ? fingerprint(*matrix, precision) : std::uint64_t{0};
+    auto& cache = LanczosCache<scalar_t>::instance();
+    is_cached = use_cache && cache.find(key, *matrix, precision, lanczos);
+
+    // A cache hit doesn't refresh the Ritz vector: `WarmLanczos` falls back to a random one
+    if (!is_cached) {
+        if (method == BoundsMethod::WarmLanczos) {
+            auto start = ritz_vector.size() == matrix->rows()
+                         ? std::move(ritz_vector)
+                         : num::make_random<VectorX<scalar_t>>(matrix->rows());
+            lanczos = compute::minmax_eigenvalues(*matrix, precision_percent, std::move(start),
+                                                  &ritz_vector);
+        } else {
+            lanczos = compute::minmax_eigenvalues(*matrix, precision_percent);
+        }
+
+        if (use_cache) {
+            cache.insert(key, *matrix, precision, lanczos);
+        }
+    }
+
     min = lanczos.min;
     max = lanczos.max;
     lanczos_loops = lanczos.loops;
-    factors = {min, max};
-    timer.toc();
 }
 
 template<class scalar_t>
 std::string Bounds<scalar_t>::report(bool shortform) const {
+    if (method == BoundsMethod::Gershgorin && !is_shifted) {
+        auto const fmt_str = shortform ? "{:.2f}, {:.2f}, -"
+                                       : "Spectrum bounds found ({:.2f}, {:.2f} eV) "
+                                         "using Gershgorin discs";
+        return format_report(fmt::format(fmt_str, min, max), timer, shortform);
+    }
+
     auto const fmt_str = shortform ? "{:.2f}, {:.2f}, {}"
                                    : "Spectrum bounds found ({:.2f}, {:.2f} eV) "
                                      "using Lanczos procedure with {} loops";
-    auto const msg = fmt::format(fmt_str, min, max, lanczos_loops);
+    auto msg = fmt::format(fmt_str, min, max, lanczos_loops);
+    if (is_shifted && !shortform) {
+        msg += ", shifted by the onsite energy change";
+    }
+    if (is_cached && !shortform) {
+        msg += " (cached)";
+    }
     return format_report(msg, timer, shortform);
 }
 
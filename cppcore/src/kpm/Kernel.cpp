@@ -3,15 +3,13 @@
 
 namespace cpb { namespace kpm {
 
-namespace {
-    // Moment calculations at higher optimization levels require specific rounding.
-    // `n - 2` considers only moments in the main KPM loop. Divisible by 4 because
-    // that is the strictest requirement imposed by `opt_size_and_interleaved`.
-    inline int round_num_moments(int n) {
-        while ((n - 2) % 4 != 0) { ++n; }
-        return n;
-    }
-} // anonymous namespace
+// Moment calculations at higher optimization levels require specific rounding.
+// `n - 2` considers only moments in the main KPM loop. Divisible by 4 because
+// that is the strictest requirement imposed by `opt_size_and_interleaved`.
+int round_num_moments(int n) {
+    while ((n - 2) % 4 != 0) { ++n; }
+    return n;
+}
 
 Kernel jackson_kernel() {
     using constant::pi;
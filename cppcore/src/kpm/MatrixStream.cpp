@@ -0,0 +1,190 @@
+#include "kpm/MatrixStream.hpp"
+
+#include "support/cppfuture.hpp"
+#include "support/format.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <stdexcept>
+
+namespace cpb { namespace kpm {
+
+template<class scalar_t>
+MatrixStream<scalar_t>::MatrixStream(std::string filename_,
+                                     SparseMatrixX<scalar_t> const& matrix,
+                                     OptimizedSizes const& sizes)
+    : filename(std::move(filename_)), num_rows(static_cast<int>(matrix.rows())),
+      nnz_per_row(sparse::max_nnz_per_row(matrix)) {
+    block_rows.push_back(0);
+    for (auto k = 0; k <= sizes.max_index(); ++k) {
+        block_rows.push_back(sizes[k]);
+    }
+
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error(fmt::format("Could not write the matrix file: {}", filename));
+    }
+
+    // Each block is stored as the column-major `data` followed by the `indices`. The padding
+    // repeats the column of the previous row, like `OptimizedHamiltonian::convert_format()`.
+    auto const indptr = matrix.outerIndexPtr();
+    auto const indices = matrix.innerIndexPtr();
+    auto const values = matrix.valuePtr();
+    auto position = std::int64_t{0};
+    auto block = Block();
+    ArrayXi previous = ArrayXi::Zero(nnz_per_row);
+    for (auto k = 0; k < num_blocks(); ++k) {
+        auto const first = block_rows[k];
+        auto const count = block_rows[k + 1] - first;
+        block.data.resize(count, nnz_per_row);
+        block.indices.resize(count, nnz_per_row);
+        for (auto n = 0; n < nnz_per_row; ++n) {
+            for (auto row = 0; row < count; ++row) {
+                auto const i = indptr[first + row] + n;
+                if (i < indptr[first + row + 1]) {
+                    block.data(row, n) = values[i];
+                    previous[n] = indices[i];
+                } else {
+                    block.data(row, n) = scalar_t{0};
+                }
+                block.indices(row, n) = previous[n];
+            }
+        }
+
+        auto const data_bytes = static_cast<std::streamsize>(block.data.size() * sizeof(scalar_t));
+        auto const index_bytes = static_cast<std::streamsize>(block.indices.size() * sizeof(int));
+        out.write(reinterpret_cast<char const*>(block.data.data()), data_bytes);
+        out.write(reinterpret_cast<char const*>(block.indices.data()), index_bytes);
+        block_offsets.push_back(position);
+        position += data_bytes + index_bytes;
+    }
+
+    out.close();
+    if (!out) {
+        throw std::runtime_error(fmt::format("Could not write the matrix file: {}", filename));
+    }
+    file.open(filename, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error(fmt::format("Could not read the matrix file: {}", filename));
+    }
+}
+
+template<class scalar_t>
+MatrixStream<scalar_t>::~MatrixStream() {
+    if (prefetch.valid()) {
+        prefetch.wait();
+    }
+    file.close();
+    std::remove(filename.c_str());
+}
+
+template<class scalar_t>
+void MatrixStream<scalar_t>::window(int first, int last) {
+    assert(0 <= first && first <= last && last < num_blocks());
+    for (auto& slot : slots) {
+        if (slot->index >= 0 && (slot->index < first || slot->index > last + 1)) {
+            slot->index = -1;
+        }
+    }
+
+    for (auto k = first; k <= last; ++k) {
+        if (find(k)) {
+            continue;
+        }
+        finish_prefetch(); // the file is read by one thread at a time
+        if (find(k)) {
+            continue;
+        }
+        auto const slot = free_slot();
+        read(k, slot->block);
+        slot->index = k;
+    }
+
+    auto const next = last + 1;
+    if (next < num_blocks() && !find(next) && prefetch_index != next) {
+        finish_prefetch();
+        auto const slot = free_slot();
+        prefetch_slot = slot;
+        prefetch_index = next;
+        prefetch = std::async(std::launch::async, [this, slot, next]() {
+            read(next, slot->block);
+        });
+    }
+}
+
+template<class scalar_t>
+typename MatrixStream<scalar_t>::Block const& MatrixStream<scalar_t>::operator[](int k) const {
+    auto const slot = find(k);
+    assert(slot);
+    return slot->block;
+}
+
+template<class scalar_t>
+std::size_t MatrixStream<scalar_t>::max_block_bytes() const {
+    auto max_rows = 0;
+    for (auto k = 0; k < num_blocks(); ++k) {
+        max_rows = std::max(max_rows, block_rows[k + 1] - block_rows[k]);
+    }
+    return static_cast<std::size_t>(max_rows) * nnz_per_row * (sizeof(scalar_t) + sizeof(int));
+}
+
+template<class scalar_t>
+typename MatrixStream<scalar_t>::Slot* MatrixStream<scalar_t>::find(int k) const {
+    for (auto const& slot : slots) {
+        if (slot->index == k) {
+            return slot.get();
+        }
+    }
+    return nullptr;
+}
+
+template<class scalar_t>
+typename MatrixStream<scalar_t>::Slot* MatrixStream<scalar_t>::free_slot() {
+    for (auto const& slot : slots) {
+        if (slot->index < 0 && slot.get() != prefetch_slot) {
+            return slot.get(); // keeps its arrays: same size blocks don't reallocate
+        }
+    }
+    slots.push_back(std14::make_unique<Slot>());
+    return slots.back().get();
+}
+
+template<class scalar_t>
+void MatrixStream<scalar_t>::read(int k, Block& block) {
+    auto const first = block_rows[k];
+    auto const count = block_rows[k + 1] - first;
+    block.first_row = first;
+    block.last_row = first + count;
+    block.size = num_rows;
+    block.data.resize(count, nnz_per_row);
+    block.indices.resize(count, nnz_per_row);
+
+    auto const data_bytes = static_cast<std::streamsize>(block.data.size() * sizeof(scalar_t));
+    auto const index_bytes = static_cast<std::streamsize>(block.indices.size() * sizeof(int));
+    file.seekg(block_offsets[k]);
+    file.read(reinterpret_cast<char*>(block.data.data()), data_bytes);
+    file.read(reinterpret_cast<char*>(block.indices.data()), index_bytes);
+    if (!file) {
+        throw std::runtime_error(fmt::format("Could not read the matrix file: {}", filename));
+    }
+    read_bytes += static_cast<std::size_t>(data_bytes + index_bytes);
+}
+
+template<class scalar_t>
+void MatrixStream<scalar_t>::finish_prefetch() {
+    if (!prefetch.valid()) {
+        return;
+    }
+
+    auto const slot = prefetch_slot;
+    auto const index = prefetch_index;
+    prefetch_slot = nullptr;
+    prefetch_index = -1;
+    prefetch.get(); // rethrows a read error
+    slot->index = index;
+}
+
+CPB_INSTANTIATE_TEMPLATE_CLASS(MatrixStream)
+
+}} // namespace cpb::kpm
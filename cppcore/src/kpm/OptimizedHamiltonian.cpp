@@ -1,5 +1,16 @@
 #include "kpm/OptimizedHamiltonian.hpp"
 #include "kpm/Stats.hpp"
+#include "utils/Affinity.hpp"
+#include "utils/Trace.hpp"
+
+#include "support/simd.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <numeric>
+#include <utility>
+#include <vector>
 
 namespace cpb { namespace kpm {
 
@@ -12,152 +23,1059 @@ OptimizedSizes::OptimizedSizes(std::vector<int> sizes, Indices const& idx) : dat
     offset = static_cast<int>(it - data.begin());
 }
 
-template<class scalar_t>
-void OptimizedHamiltonian<scalar_t>::optimize_for(Indices const& idx, Scale<real_t> scale) {
-    if (original_idx == idx) {
+namespace {
+    /// The SELL-C-sigma rows are sorted by length within windows of this many rows
+    constexpr auto sell_sigma = 32;
+
+    /// Return a new unique matrix id, shared by all instances and threads
+    std::uint64_t next_matrix_id() {
+        static std::atomic<std::uint64_t> last_id{0};
+        return ++last_id;
+    }
+
+    /**
+     Process-wide registry of the matrices of `MatrixConfig::Sharing::SHARED`
+
+     Only weak references are kept: a matrix is released together with its last user.
+     The original matrix address is a valid key since every user keeps it alive. There is
+     one copy per NUMA node: it's built (and its memory first touched) by a thread on that
+     node, so the workers of a sweep on each socket read it from local memory.
+     */
+    template<class Matrix, class real_t>
+    class SharedMatrices {
+    public:
+        struct Key {
+            void const* original;
+            Scale<real_t> scale;
+            MatrixConfig config;
+            int numa_node;
+
+            friend bool operator==(Key const& l, Key const& r) {
+                return l.original == r.original && l.scale == r.scale && l.config == r.config
+                       && l.numa_node == r.numa_node;
+            }
+        };
+
+        static SharedMatrices& instance() {
+            static SharedMatrices registry;
+            return registry;
+        }
+
+        /// Return the live matrix for the `key` (and set its `id`) or null if there is none
+        std::shared_ptr<Matrix const> find(Key const& key, std::uint64_t& id) {
+            std::lock_guard<std::mutex> lk(mutex);
+            for (auto const& entry : entries) {
+                if (entry.key == key) {
+                    if (auto matrix = entry.matrix.lock()) {
+                        id = entry.id;
+                        return matrix;
+                    }
+                }
+            }
+            return {};
+        }
+
+        /// Publish the `matrix` unless a live one for the `key` already exists:
+        /// return the one which should be used and set its `id`
+        std::shared_ptr<Matrix const> insert(Key const& key, std::shared_ptr<Matrix const> matrix,
+                                             std::uint64_t& id) {
+            std::lock_guard<std::mutex> lk(mutex);
+            entries.erase(std::remove_if(entries.begin(), entries.end(), [](Entry const& e) {
+                return e.matrix.expired();
+            }), entries.end());
+
+            for (auto const& entry : entries) {
+                if (entry.key == key) {
+                    id = entry.id;
+                    return entry.matrix.lock(); // not expired: just removed those
+                }
+            }
+            entries.push_back({key, matrix, id});
+            return matrix;
+        }
+
+    private:
+        struct Entry {
+            Key key;
+            std::weak_ptr<Matrix const> matrix;
+            std::uint64_t id;
+        };
+
+        std::mutex mutex;
+        std::vector<Entry> entries;
+    };
+
+    /// Return the data size in bytes
+    struct matrix_memory {
+        template<class scalar_t, class index_t>
+        size_t operator()(SparseMatrixX<scalar_t, index_t> const& csr) const {
+            auto const nnz = static_cast<size_t>(csr.nonZeros());
+            auto const row_starts = static_cast<size_t>(csr.rows() + 1);
+            return nnz * sizeof(scalar_t) + nnz * sizeof(index_t) + row_starts * sizeof(index_t);
+        }
+
+        template<class scalar_t, class index_t>
+        size_t operator()(num::EllMatrix<scalar_t, index_t> const& ell) const {
+            using offset_t = typename num::EllMatrix<scalar_t, index_t>::offset_t;
+            auto const nnz = static_cast<size_t>(ell.nonZeros());
+            auto const column_size = ell.is_compressed() ? sizeof(offset_t) : sizeof(index_t);
+            using value_id_t = typename num::EllMatrix<scalar_t, index_t>::value_id_t;
+            auto const data_size = ell.has_data() ? sizeof(scalar_t) : 0;
+            auto const planes_size = ell.is_split() ? sizeof(scalar_t) : 0; // a copy of `data`
+            auto const ids_size = ell.is_indexed() ? sizeof(value_id_t) : 0;
+            auto const reduced_parts = ell.is_reduced() ? ell.reduced_parts() : 0;
+            auto const reduced_size = reduced_parts * sizeof(num::bfloat16_t);
+            auto const table_size = static_cast<size_t>(ell.value_table.size());
+            return nnz * (data_size + planes_size + ids_size + reduced_size + column_size)
+                   + table_size * sizeof(scalar_t);
+        }
+
+        template<class scalar_t, class index_t>
+        size_t operator()(num::SellMatrix<scalar_t, index_t> const& sell) const {
+            using offset_t = typename num::SellMatrix<scalar_t, index_t>::offset_t;
+            auto const nnz = static_cast<size_t>(sell.nonZeros());
+            auto const chunks = static_cast<size_t>(sell.num_chunks());
+            auto const column_size = sell.is_compressed() ? sizeof(offset_t) : sizeof(index_t);
+            return nnz * sizeof(scalar_t) + nnz * column_size
+                   + 2 * chunks * sizeof(index_t) + sizeof(index_t);
+        }
+
+        /// Only the permutation: the scaled matrix is shared by all of them
+        template<class scalar_t>
+        size_t operator()(num::PermutedMatrix<scalar_t> const& permuted) const {
+            auto const rows = static_cast<size_t>(permuted.rows());
+            return (3 * rows + 1) * sizeof(int);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::BsrMatrix<scalar_t> const& bsr) const {
+            using index_t = typename num::BsrMatrix<scalar_t>::Index;
+            auto const values = static_cast<size_t>(bsr.nonZeros());
+            auto const blocks = static_cast<size_t>(bsr.num_blocks());
+            auto const block_rows = static_cast<size_t>(bsr.block_ptr.size());
+            return values * sizeof(scalar_t) + (blocks + block_rows) * sizeof(index_t);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::SymmetricMatrix<scalar_t> const& symmetric) const {
+            return (*this)(symmetric.upper);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::BulkBoundaryMatrix<scalar_t> const& split) const {
+            auto const boundary_rows = static_cast<size_t>(split.boundary_rows.size());
+            return (*this)(split.bulk) + (*this)(split.boundary) + boundary_rows * sizeof(int);
+        }
+    };
+}
+
+namespace {
+    /// The permutation and the BSR, SYMMETRIC and BULK_BOUNDARY formats have 32-bit indices:
+    /// the others are rejected by the constructor of `OptimizedHamiltonian`, so these are
+    /// never called
+    template<class scalar_t, class index_t>
+    num::PermutedMatrix<scalar_t>
+    make_permuted(std::shared_ptr<SparseMatrixX<scalar_t, index_t> const> const&, ArrayXi) {
+        throw std::logic_error("PermutedMatrix: only 32-bit indices are supported.");
+    }
+
+    template<class scalar_t>
+    num::PermutedMatrix<scalar_t>
+    make_permuted(std::shared_ptr<SparseMatrixX<scalar_t> const> const& m, ArrayXi order) {
+        return {m, std::move(order)};
+    }
+
+    template<class scalar_t, class index_t>
+    int find_block_size(SparseMatrixX<scalar_t, index_t> const&) { return 1; }
+
+    template<class scalar_t>
+    int find_block_size(SparseMatrixX<scalar_t> const& h2) { return num::find_block_size(h2); }
+
+    template<class scalar_t, class index_t>
+    num::BsrMatrix<scalar_t> make_bsr(SparseMatrixX<scalar_t, index_t> const&, int) {
+        throw std::logic_error("BsrMatrix: only 32-bit indices are supported.");
+    }
+
+    template<class scalar_t>
+    num::BsrMatrix<scalar_t> make_bsr(SparseMatrixX<scalar_t> const& h2, int block_size) {
+        return {h2, block_size};
+    }
+
+    template<class scalar_t, class index_t>
+    num::SymmetricMatrix<scalar_t> make_symmetric(SparseMatrixX<scalar_t, index_t> const&) {
+        throw std::logic_error("SymmetricMatrix: only 32-bit indices are supported.");
+    }
+
+    template<class scalar_t>
+    num::SymmetricMatrix<scalar_t> make_symmetric(SparseMatrixX<scalar_t> const& h2) {
+        return num::SymmetricMatrix<scalar_t>::from_full(h2);
+    }
+
+    template<class scalar_t, class index_t>
+    num::BulkBoundaryMatrix<scalar_t>
+    make_bulk_boundary(SparseMatrixX<scalar_t, index_t> const&) {
+        throw std::logic_error("BulkBoundaryMatrix: only 32-bit indices are supported.");
+    }
+
+    template<class scalar_t>
+    num::BulkBoundaryMatrix<scalar_t> make_bulk_boundary(SparseMatrixX<scalar_t> const& h2) {
+        return num::BulkBoundaryMatrix<scalar_t>::from_full(h2);
+    }
+} // anonymous namespace
+
+template<class scalar_t, class index_t>
+void OptimizedHamiltonian<scalar_t, index_t>::optimize(Indices const& idx, Scale<real_t> scale,
+                                                       bool multi_source) {
+    reorder_timer = {}; // remain zero if the matrix is reused
+    convert_timer = {};
+    if (original_idx == idx && original_scale == scale
+        && original_multi_source == multi_source) {
+        ++num_cache_hits;
         return; // already optimized for this idx
     }
 
+    if (config.reorder == MatrixConfig::Reorder::OFF && original_idx.row >= 0
+        && original_scale == scale) {
+        // Without reordering, the matrix doesn't depend on the target indices
+        optimized_idx = idx;
+        original_idx = idx;
+        original_multi_source = multi_source;
+        ++num_cache_hits;
+        return;
+    }
+
+    if (config.sharing == MatrixConfig::Sharing::SHARED) {
+        return optimize_shared(idx, scale, multi_source);
+    }
+
+    if (restore_from_cache(idx, scale, multi_source)) {
+        ++num_cache_hits;
+        return;
+    }
+    ++num_cache_misses;
+    save_to_cache();
+
+    auto const span = trace::Span("KPM optimize");
     timer.tic();
+    reorder_timer.tic();
     if (config.reorder == MatrixConfig::Reorder::ON) {
-        create_reordered(idx, scale);
+        create_reordered(idx, scale, multi_source);
+    } else if (config.reorder == MatrixConfig::Reorder::PERMUTE) {
+        create_permuted(idx, scale, multi_source);
     } else {
         create_scaled(idx, scale);
     }
+    reorder_timer.toc();
 
-    if (config.format == MatrixConfig::Format::ELL) {
-        optimized_matrix = convert_to_ellpack(csr());
-    }
+    convert_timer.tic();
+    convert_format();
+    convert_timer.toc();
+    matrix_id = next_matrix_id();
     timer.toc();
 
     original_idx = idx;
+    original_scale = scale;
+    original_multi_source = multi_source;
 }
 
-template<class scalar_t>
-void OptimizedHamiltonian<scalar_t>::create_scaled(Indices const& idx, Scale<real_t> scale) {
+template<class scalar_t, class index_t>
+void OptimizedHamiltonian<scalar_t, index_t>::optimize_shared(Indices const& idx,
+                                                              Scale<real_t> scale,
+                                                              bool multi_source) {
+    assert(config.reorder == MatrixConfig::Reorder::OFF);
+    using Shared = SharedMatrices<OptMatrix, real_t>;
+    auto& registry = Shared::instance();
+    auto const key = typename Shared::Key{original_matrix, scale, config, current_numa_node()};
+
+    shared_matrix = registry.find(key, matrix_id);
+    if (shared_matrix) {
+        ++num_cache_hits;
+    } else {
+        ++num_cache_misses;
+        auto const span = trace::Span("KPM optimize");
+        timer.tic();
+        reorder_timer.tic();
+        create_scaled(idx, scale);
+        reorder_timer.toc();
+        convert_timer.tic();
+        convert_format();
+        convert_timer.toc();
+        timer.toc();
+
+        // Another thread may have published the same matrix in the meantime
+        matrix_id = next_matrix_id();
+        shared_matrix = registry.insert(key, std::make_shared<OptMatrix const>(
+            std::move(optimized_matrix)
+        ), matrix_id);
+        optimized_matrix = Csr(); // only the shared copy is kept
+    }
+
     optimized_idx = idx;
+    optimized_sizes = OptimizedSizes(original_matrix->rows());
+    original_idx = idx;
+    original_scale = scale;
+    original_multi_source = multi_source;
+}
 
-    auto const& h = *original_matrix;
-    auto h2 = SparseMatrixX<scalar_t>();
-    if (scale.b == 0) { // just scale, no b offset
-        h2 = h * (2 / scale.a);
-    } else { // scale and offset
-        auto I = SparseMatrixX<scalar_t>{h.rows(), h.cols()};
-        I.setIdentity();
-        h2 = (h - I * scale.b) * (2 / scale.a);
-    }
-    h2.makeCompressed();
+template<class scalar_t, class index_t>
+void OptimizedHamiltonian<scalar_t, index_t>::convert_format() {
+    if (is_permuted()) {
+        return; // a view of the scaled CSR matrix
+    }
+
+    constexpr auto simd_size = static_cast<int>(simd::detail::traits<scalar_t>::size);
+    auto const compress = config.indices == MatrixConfig::Indices::COMPRESSED;
+    if (config.format == MatrixConfig::Format::ELL) {
+        auto ell = convert_to_ellpack(csr(), pool);
+        // The indexed or reduced values take priority: they need less bandwidth than planes
+        using Values = MatrixConfig::Values;
+        auto const indexed = (config.values == Values::INDEXED
+                              || config.values == Values::INDEXED_OR_REDUCED)
+                             && ell.index_values();
+        auto const reduced = config.values == Values::REDUCED
+                             || (config.values == Values::INDEXED_OR_REDUCED && !indexed);
+        if (reduced) {
+            ell.reduce_precision();
+        }
+        auto const split = !indexed && !reduced && config.layout == MatrixConfig::Layout::SPLIT
+                           && ell.split();
+        if (compress) {
+            // The split planes are real: their SIMD registers hold more rows
+            constexpr auto real_simd_size = static_cast<int>(simd::detail::traits<real_t>::size);
+            ell.compress(split ? real_simd_size : simd_size);
+        }
+        if (indexed) {
+            ell.drop_data(); // the kernels read the lossless `value_table` instead
+        }
+        optimized_matrix = std::move(ell);
+    } else if (config.format == MatrixConfig::Format::SELL) {
+        if (config.reorder == MatrixConfig::Reorder::ON) {
+            sort_rows_for_sell(sell_sigma);
+        }
+        auto sell = convert_to_sell(csr(), simd_size);
+        if (compress) {
+            sell.compress();
+        }
+        optimized_matrix = std::move(sell);
+    } else if (config.format == MatrixConfig::Format::BSR) {
+        assert(config.reorder == MatrixConfig::Reorder::OFF); // the blocks need the site order
+        auto const& h2 = csr();
+        auto const block_size = config.block_size > 0 ? config.block_size
+                                                      : find_block_size(h2);
+        if (block_size > 1 && h2.rows() % block_size == 0) {
+            optimized_matrix = make_bsr(h2, block_size);
+        }
+    } else if (config.format == MatrixConfig::Format::SYMMETRIC) {
+        // The transposed elements are scattered to any row: the whole matrix every time
+        assert(config.reorder == MatrixConfig::Reorder::OFF);
+        auto symmetric = make_symmetric(csr());
+        optimized_matrix = std::move(symmetric);
+    } else if (config.format == MatrixConfig::Format::BULK_BOUNDARY) {
+        // The rows stay independent: any reordering and row ranges still apply
+        auto split = make_bulk_boundary(csr());
+        optimized_matrix = std::move(split);
+    }
+}
+
+template<class scalar_t, class index_t>
+bool OptimizedHamiltonian<scalar_t, index_t>::restore_from_cache(Indices const& idx,
+                                                                 Scale<real_t> scale,
+                                                                 bool multi_source) {
+    auto const it = std::find_if(cache.begin(), cache.end(), [&](CacheEntry const& entry) {
+        return entry.original_idx == idx && entry.original_scale == scale
+               && entry.original_multi_source == multi_source;
+    });
+    if (it == cache.end()) {
+        return false;
+    }
+
+    auto entry = std::move(*it);
+    cache.erase(it);
+    save_to_cache();
+
+    optimized_matrix = std::move(entry.optimized_matrix);
+    matrix_id = entry.matrix_id;
+    optimized_idx = std::move(entry.optimized_idx);
+    optimized_sizes = std::move(entry.optimized_sizes);
+    original_rows = std::move(entry.original_rows);
+    original_idx = std::move(entry.original_idx);
+    original_scale = entry.original_scale;
+    original_multi_source = entry.original_multi_source;
+    return true;
+}
+
+template<class scalar_t, class index_t>
+void OptimizedHamiltonian<scalar_t, index_t>::save_to_cache() {
+    if (original_idx.row < 0) {
+        return; // nothing has been optimized yet
+    }
+
+    auto const current_memory = memory_usage();
+    if (current_memory > cache_budget) {
+        return; // it could never fit (this is always the case for a zero budget)
+    }
+
+    cache.push_front({std::move(optimized_matrix), matrix_id, std::move(optimized_idx),
+                      std::move(optimized_sizes), std::move(original_rows),
+                      std::move(original_idx), original_scale, original_multi_source});
+    optimized_sizes = OptimizedSizes(original_matrix->rows());
+    original_idx = {};
+    matrix_id = 0;
+
+    // The current matrix (to be created next) is not known yet, so assume it will have
+    // the same size as the one which was just saved. Evict the least recently used.
+    auto total_memory = current_memory;
+    for (auto it = cache.begin(); it != cache.end(); ++it) {
+        total_memory += var::apply_visitor(matrix_memory{}, it->optimized_matrix);
+        if (total_memory > cache_budget) {
+            cache.erase(it, cache.end());
+            break;
+        }
+    }
+}
+
+namespace {
+    /// `pool->parallel_for()` or, without a pool, the whole range on the calling thread
+    template<class Fn>
+    void parallel_for(ThreadPool* pool, int start, int end, Fn fn) {
+        if (pool) {
+            pool->parallel_for(start, end, fn);
+        } else {
+            fn(0, start, end);
+        }
+    }
+} // anonymous namespace
+
+template<class scalar_t, class index_t>
+void OptimizedHamiltonian<scalar_t, index_t>::create_scaled(Indices const& idx,
+                                                            Scale<real_t> scale) {
+    optimized_idx = idx;
+    original_rows.resize(0);
+
+    auto h2 = Csr();
+    scale_matrix(*original_matrix, scale, h2, pool);
     optimized_matrix = h2.markAsRValue();
 }
 
-template<class scalar_t>
-void OptimizedHamiltonian<scalar_t>::create_reordered(Indices const& idx, Scale<real_t> scale) {
+template<class scalar_t, class index_t>
+void OptimizedHamiltonian<scalar_t, index_t>::scale_matrix(Csr const& h, Scale<real_t> scale,
+                                                           Csr& h2, ThreadPool* pool) {
+    auto const rows = static_cast<int>(h.rows());
+    auto const factor = real_t{2 / scale.a};
+    auto const indptr = h.outerIndexPtr();
+    auto const indices = h.innerIndexPtr();
+    auto const data = h.valuePtr();
+
+    // The b offset needs a diagonal element in every row, which may not exist yet
+    auto const needs_diagonal = [&](int row) {
+        return scale.b != 0
+               && !std::binary_search(indices + indptr[row], indices + indptr[row + 1], row);
+    };
+
+    // Count and then fill the rows: the threads write (and first touch) the same rows
+    // which they later multiply, see `calc_moments::first_touch_vectors()`
+    h2 = Csr(rows, static_cast<int>(h.cols()));
+    auto const h2_indptr = h2.outerIndexPtr();
+    parallel_for(pool, 0, rows, [&](int, int start, int end) {
+        for (auto row = start; row < end; ++row) {
+            h2_indptr[row + 1] = indptr[row + 1] - indptr[row] + (needs_diagonal(row) ? 1 : 0);
+        }
+    });
+    h2_indptr[0] = 0;
+    std::partial_sum(h2_indptr + 1, h2_indptr + rows + 1, h2_indptr + 1);
+    h2.resizeNonZeros(h2_indptr[rows]);
+
+    auto const h2_indices = h2.innerIndexPtr();
+    auto const h2_data = h2.valuePtr();
+    parallel_for(pool, 0, rows, [&](int, int start, int end) {
+        for (auto row = start; row < end; ++row) {
+            auto missing_diagonal = needs_diagonal(row);
+            auto k = h2_indptr[row];
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n, ++k) {
+                if (missing_diagonal && indices[n] > row) {
+                    h2_indices[k] = row;
+                    h2_data[k] = scalar_t{-scale.b} * factor;
+                    missing_diagonal = false;
+                    ++k;
+                }
+                h2_indices[k] = indices[n];
+                h2_data[k] = (indices[n] == row ? data[n] - scalar_t{scale.b} : data[n]) * factor;
+            }
+            if (missing_diagonal) { // all the other elements are left of the diagonal
+                h2_indices[k] = row;
+                h2_data[k] = scalar_t{-scale.b} * factor;
+            }
+        }
+    });
+}
+
+namespace {
+    /// The result of `breadth_first()`
+    struct BreadthFirst {
+        ArrayXi order; ///< the original index of each reordered index
+        ArrayXi position; ///< the reordered index of each original index, the inverse
+        std::vector<int> sizes; ///< the number of indices up to the end of each level
+    };
+
+    /**
+     Breadth-first order of the rows of `h`, starting from `idx.row` (and all the `idx.cols`
+     if `multi_source`) which take the first indices
+
+     With a pool, each level is searched in two parallel passes over contiguous parts of it.
+     First, every new index is claimed by the earliest index of the level which reaches it
+     (an atomic minimum). Then each thread collects the indices claimed by its part in row
+     and column order. Appending the parts in thread order gives exactly the serial order,
+     so the result doesn't depend on the number of threads. Indices which are not connected
+     to the start go last, in their original order.
+     */
+    template<class scalar_t, class index_t>
+    BreadthFirst breadth_first(SparseMatrixX<scalar_t, index_t> const& h, Indices const& idx,
+                               bool multi_source, ThreadPool* pool) {
+        auto const size = static_cast<int>(h.rows());
+        auto const indptr = h.outerIndexPtr();
+        auto const indices = h.innerIndexPtr();
+
+        auto result = BreadthFirst{ArrayXi(size), ArrayXi::Constant(size, -1), {}};
+        auto& order = result.order;
+        auto& position = result.position;
+        auto count = 0;
+        auto const add = [&](int index) {
+            if (position[index] < 0) {
+                position[index] = count;
+                order[count++] = index;
+            }
+        };
+        add(idx.row);
+        if (multi_source) {
+            for (auto const col : idx.cols) {
+                add(col);
+            }
+        }
+        result.sizes.push_back(count);
+
+        auto const num_threads = pool ? pool->size() : 1;
+        auto claims = std::vector<std::atomic<int>>(num_threads > 1 ? size : 0);
+        for (auto& claim : claims) { claim.store(size, std::memory_order_relaxed); }
+        auto found = std::vector<std::vector<int>>(num_threads);
+
+        for (auto level_start = 0; level_start < count;) {
+            auto const level_end = count;
+            if (num_threads == 1) {
+                for (auto i = level_start; i < level_end; ++i) {
+                    for (auto n = indptr[order[i]]; n < indptr[order[i] + 1]; ++n) {
+                        add(indices[n]);
+                    }
+                }
+            } else {
+                pool->parallel_for(level_start, level_end, [&](int, int start, int end) {
+                    for (auto i = start; i < end; ++i) {
+                        for (auto n = indptr[order[i]]; n < indptr[order[i] + 1]; ++n) {
+                            if (position[indices[n]] >= 0) { continue; }
+                            auto& claim = claims[indices[n]];
+                            auto current = claim.load(std::memory_order_relaxed);
+                            while (i < current && !claim.compare_exchange_weak(
+                                current, i, std::memory_order_relaxed
+                            )) {}
+                        }
+                    }
+                });
+                for (auto& part : found) { part.clear(); }
+                pool->parallel_for(level_start, level_end, [&](int id, int start, int end) {
+                    for (auto i = start; i < end; ++i) {
+                        for (auto n = indptr[order[i]]; n < indptr[order[i] + 1]; ++n) {
+                            auto const index = indices[n];
+                            if (position[index] < 0
+                                && claims[index].load(std::memory_order_relaxed) == i) {
+                                found[id].push_back(index);
+                            }
+                        }
+                    }
+                });
+                for (auto const& part : found) {
+                    for (auto const index : part) { add(index); }
+                }
+            }
+            result.sizes.push_back(count);
+            level_start = level_end;
+        }
+        result.sizes.pop_back(); // the last level is empty: a duplicate of the previous size
+
+        // Sites which are not connected to the targets don't affect them: they simply go last
+        if (count < size) {
+            for (auto i = 0; i < size; ++i) {
+                add(i);
+            }
+            result.sizes.push_back(size);
+        }
+        return result;
+    }
+} // anonymous namespace
+
+template<class scalar_t, class index_t>
+void OptimizedHamiltonian<scalar_t, index_t>::create_reordered(Indices const& idx,
+                                                               Scale<real_t> scale,
+                                                               bool multi_source) {
     auto const& h = *original_matrix;
-    auto const system_size = h.rows();
+    auto const system_size = static_cast<int>(h.rows());
     auto const inverted_a = real_t{2 / scale.a};
+    auto const indptr = h.outerIndexPtr();
+    auto const indices = h.innerIndexPtr();
+    auto const data = h.valuePtr();
 
-    auto h2 = SparseMatrixX<scalar_t>(system_size, system_size);
-    // Reserve the same nnz per row as the original + 1 in case the scaling adds diagonal elements
-    h2.reserve(VectorXi::Constant(system_size, sparse::max_nnz_per_row(h) + 1));
+    // The point of the reordering is to have the target become index number 0. In the
+    // multi-source case, all the targets are placed at the start in the given order.
+    auto bfs = breadth_first(h, idx, multi_source, pool);
+    auto const& order = bfs.order;
+    auto const& position = bfs.position;
+
+    // A diagonal element may need to be inserted into the reordered matrix
+    // even if the original matrix doesn't have an element on the main diagonal
+    auto const needs_diagonal = [&](int row) {
+        return scale.b != 0
+               && !std::binary_search(indices + indptr[row], indices + indptr[row + 1], row);
+    };
+
+    // The rows are independent once the order is known: count them and then fill them
+    auto h2 = Csr(system_size, system_size);
+    auto const h2_indptr = h2.outerIndexPtr();
+    parallel_for(pool, 0, system_size, [&](int, int start, int end) {
+        for (auto h2_row = start; h2_row < end; ++h2_row) {
+            auto const row = order[h2_row];
+            h2_indptr[h2_row + 1] = indptr[row + 1] - indptr[row] + (needs_diagonal(row) ? 1 : 0);
+        }
+    });
+    h2_indptr[0] = 0;
+    std::partial_sum(h2_indptr + 1, h2_indptr + system_size + 1, h2_indptr + 1);
+    h2.resizeNonZeros(h2_indptr[system_size]);
+
+    using Element = std::pair<int, scalar_t>;
+    auto const h2_indices = h2.innerIndexPtr();
+    auto const h2_data = h2.valuePtr();
+    parallel_for(pool, 0, system_size, [&](int, int start, int end) {
+        auto elements = std::vector<Element>();
+        for (auto h2_row = start; h2_row < end; ++h2_row) {
+            auto const row = order[h2_row];
+            elements.clear();
+            if (needs_diagonal(row)) {
+                elements.emplace_back(h2_row, scalar_t{-scale.b * inverted_a});
+            }
+            for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                auto h2_value = data[n] * inverted_a;
+                if (indices[n] == row) { // diagonal elements
+                    h2_value -= scale.b * inverted_a;
+                }
+                elements.emplace_back(position[indices[n]], h2_value);
+            }
+            std::sort(elements.begin(), elements.end(), [](Element const& a, Element const& b) {
+                return a.first < b.first;
+            });
 
-    // Note: The following "queue" and "map" use vectors instead of other container types because
-    //       they serve a very simple purpose. Using preallocated vectors results in better
-    //       performance (this is not an assumption, it has been tested).
+            auto k = h2_indptr[h2_row];
+            for (auto const& element : elements) {
+                h2_indices[k] = element.first;
+                h2_data[k] = element.second;
+                ++k;
+            }
+        }
+    });
+    optimized_matrix = h2.markAsRValue();
 
-    // The index queue will contain the indices that need to be checked next
-    auto index_queue = std::vector<int>();
-    index_queue.reserve(system_size);
-    index_queue.push_back(idx.row); // starting from the given index
+    optimized_idx = reorder_indices(idx, position);
+    optimized_sizes = {std::move(bfs.sizes), optimized_idx};
+    original_rows = std::move(bfs.order);
+}
 
-    // Map from original matrix indices to reordered matrix indices
-    auto reorder_map = ArrayXi{ArrayXi::Constant(system_size, -1)};
-    // The point of the reordering is to have the target become index number 0
-    reorder_map[idx.row] = 0;
+template<class scalar_t, class index_t>
+void OptimizedHamiltonian<scalar_t, index_t>::create_permuted(Indices const& idx,
+                                                              Scale<real_t> scale,
+                                                              bool multi_source) {
+    if (!scaled_matrix || !(scaled_matrix_scale == scale)) {
+        auto h2 = std::make_shared<Csr>();
+        scale_matrix(*original_matrix, scale, *h2, pool);
+        scaled_matrix = std::move(h2);
+        scaled_matrix_scale = scale;
+    }
 
-    // As the reordered matrix is filled, the optimal size for the first few KPM steps is recorded
-    auto sizes = std::vector<int>();
-    sizes.push_back(1);
+    // The same order as `create_reordered()`
+    auto bfs = breadth_first(*scaled_matrix, idx, multi_source, pool);
+    optimized_idx = reorder_indices(idx, bfs.position);
+    optimized_sizes = {std::move(bfs.sizes), optimized_idx};
+    original_rows = bfs.order;
+    optimized_matrix = make_permuted(scaled_matrix, std::move(bfs.order));
+}
 
-    // Fill the reordered matrix row by row
-    auto const h_view = sparse::make_loop(h);
-    for (auto h2_row = 0; h2_row < system_size; ++h2_row) {
-        auto diagonal_inserted = false;
+namespace {
+    /// Position of the diagonal element of each row in the values of an optimized matrix
+    struct DiagonalSlots {
+        using Slots = std::vector<std::ptrdiff_t>;
 
-        // Loop over elements in the row of the original matrix
-        // corresponding to the h2_row of the reordered matrix
-        auto const row = index_queue[h2_row];
-        h_view.for_each_in_row(row, [&](int col, scalar_t value) {
-            // A diagonal element may need to be inserted into the reordered matrix
-            // even if the original matrix doesn't have an element on the main diagonal
-            if (scale.b != 0 && !diagonal_inserted && col > row) {
-                h2.insert(h2_row, h2_row) = -scale.b * inverted_a;
-                diagonal_inserted = true;
+        template<class scalar_t, class index_t>
+        Slots operator()(SparseMatrixX<scalar_t, index_t> const& csr) const {
+            auto const indptr = csr.outerIndexPtr();
+            auto const indices = csr.innerIndexPtr();
+            auto slots = Slots(static_cast<size_t>(csr.rows()), -1);
+            for (auto row = 0; row < csr.rows(); ++row) {
+                auto const end = indices + indptr[row + 1];
+                auto const it = std::lower_bound(indices + indptr[row], end, row);
+                if (it != end && *it == row) { slots[row] = it - indices; }
             }
+            return slots;
+        }
 
-            // This may be a new index, map it
-            if (reorder_map[col] < 0) {
-                reorder_map[col] = static_cast<int>(index_queue.size());
-                index_queue.push_back(col);
+        /// The padding follows the non-zeros of each row, so the first match is the real one
+        template<class scalar_t, class index_t>
+        Slots operator()(num::EllMatrix<scalar_t, index_t> const& ell) const {
+            auto slots = Slots(static_cast<size_t>(ell.rows()), -1);
+            for (auto row = 0; row < ell.rows(); ++row) {
+                for (auto n = 0; n < ell.nnz_per_row; ++n) {
+                    if (ell.column(row, n) == row) {
+                        slots[row] = std::ptrdiff_t{n} * ell.padded_rows() + row;
+                        break;
+                    }
+                }
             }
+            return slots;
+        }
+
+        /// The diagonal of a row is in the diagonal block of its block row, if there's one
+        template<class scalar_t>
+        Slots operator()(num::BsrMatrix<scalar_t> const& bsr) const {
+            auto const size = bsr.block_size;
+            auto slots = Slots(static_cast<size_t>(bsr.rows()), -1);
+            for (auto i = 0; i < bsr.rows() / size; ++i) {
+                for (auto k = bsr.block_ptr[i]; k < bsr.block_ptr[i + 1]; ++k) {
+                    if (bsr.block_cols[k] != i) { continue; }
+                    for (auto r = 0; r < size; ++r) {
+                        slots[i * size + r] = (k * size + r) * size + r;
+                    }
+                }
+            }
+            return slots;
+        }
+
+        /// The diagonal is always stored as the first element of each row
+        template<class scalar_t>
+        Slots operator()(num::SymmetricMatrix<scalar_t> const& symmetric) const {
+            auto const indptr = symmetric.upper.outerIndexPtr();
+            return Slots(indptr, indptr + symmetric.rows());
+        }
+
+        /// Every row of the real bulk has a diagonal slot
+        template<class scalar_t>
+        Slots operator()(num::BulkBoundaryMatrix<scalar_t> const& split) const {
+            return (*this)(split.bulk);
+        }
+
+        /// Not used: `update_diagonal()` rescales the shared matrix of a permutation instead
+        template<class scalar_t>
+        Slots operator()(num::PermutedMatrix<scalar_t> const& permuted) const {
+            return Slots(static_cast<size_t>(permuted.rows()), -1);
+        }
+
+        template<class scalar_t, class index_t>
+        Slots operator()(num::SellMatrix<scalar_t, index_t> const& sell) const {
+            auto slots = Slots(static_cast<size_t>(sell.rows()), -1);
+            for (auto row = 0; row < sell.rows(); ++row) {
+                auto const chunk = row / sell.chunk_size;
+                for (auto n = 0; n < sell.chunk_width[chunk]; ++n) {
+                    auto const k = sell.offset(row, n);
+                    if (sell.column(k, chunk) == row) {
+                        slots[row] = k;
+                        break;
+                    }
+                }
+            }
+            return slots;
+        }
+    };
+
+    /// Write the `values` of the diagonal into the `slots` found by `DiagonalSlots`
+    template<class scalar_t, class index_t>
+    struct SetDiagonal {
+        DiagonalSlots::Slots const& slots;
+        ArrayX<scalar_t> const& values;
 
-            // Get the reordered column index
-            auto const h2_col = reorder_map[col];
+        void operator()(SparseMatrixX<scalar_t, index_t>& csr) const {
+            auto const data = csr.valuePtr();
+            for (auto row = 0; row < values.size(); ++row) { data[slots[row]] = values[row]; }
+        }
 
-            // Calculate the new value that will be inserted into the scaled/reordered matrix
-            auto h2_value = value * inverted_a;
-            if (row == col) { // diagonal elements
-                h2_value -= scale.b * inverted_a;
-                diagonal_inserted = true;
+        void operator()(num::EllMatrix<scalar_t, index_t>& ell) const {
+            auto const indexed = ell.is_indexed();
+            if (indexed) {
+                ell.clear_index(); // restores the full `data`
+            }
+            auto const data = ell.data.data();
+            for (auto row = 0; row < values.size(); ++row) { data[slots[row]] = values[row]; }
+            if (ell.is_split()) {
+                for (auto row = 0; row < values.size(); ++row) {
+                    ell.data_real.data()[slots[row]] = std::real(values[row]);
+                    ell.data_imag.data()[slots[row]] = std::imag(values[row]);
+                }
+            }
+            if (indexed && ell.index_values()) {
+                ell.drop_data(); // keeps the full `data` if there are too many values now
             }
+            if (ell.is_reduced()) {
+                auto const parts = ell.reduced_parts();
+                auto const reduced = ell.reduced.data();
+                for (auto row = 0; row < values.size(); ++row) {
+                    auto const slot = slots[row] * parts;
+                    reduced[slot] = num::to_bfloat16(static_cast<float>(std::real(values[row])));
+                    if (parts == 2) {
+                        auto const imag = static_cast<float>(std::imag(values[row]));
+                        reduced[slot + 1] = num::to_bfloat16(imag);
+                    }
+                }
+            }
+        }
+
+        void operator()(num::SellMatrix<scalar_t, index_t>& sell) const {
+            for (auto row = 0; row < values.size(); ++row) { sell.data[slots[row]] = values[row]; }
+        }
 
-            h2.insert(h2_row, h2_col) = h2_value;
-        });
+        void operator()(num::BsrMatrix<scalar_t>& bsr) const {
+            for (auto row = 0; row < values.size(); ++row) { bsr.data[slots[row]] = values[row]; }
+        }
+
+        void operator()(num::SymmetricMatrix<scalar_t>& symmetric) const {
+            auto const data = symmetric.upper.valuePtr();
+            for (auto row = 0; row < values.size(); ++row) { data[slots[row]] = values[row]; }
+        }
 
-        // Store the system size for the next KPM iteration
-        if (h2_row == sizes.back() - 1) {
-            sizes.push_back(static_cast<int>(index_queue.size()));
+        /// The onsite energies of a Hermitian matrix are real
+        void operator()(num::BulkBoundaryMatrix<scalar_t>& split) const {
+            if ((values.imag() != 0).any()) {
+                throw std::invalid_argument("BulkBoundaryMatrix: "
+                                            "the onsite energies must be real.");
+            }
+            auto const data = split.bulk.valuePtr();
+            for (auto row = 0; row < values.size(); ++row) {
+                data[slots[row]] = std::real(values[row]);
+            }
         }
+
+        void operator()(num::PermutedMatrix<scalar_t>&) const {} // not used, see above
+    };
+} // anonymous namespace
+
+template<class scalar_t, class index_t>
+void OptimizedHamiltonian<scalar_t, index_t>::release_matrix() {
+    optimized_matrix = Csr();
+    shared_matrix.reset();
+    backend.reset();
+    matrix_id = 0;
+    original_idx = {}; // not optimized for any target now
+}
+
+template<class scalar_t, class index_t>
+bool OptimizedHamiltonian<scalar_t, index_t>::update_diagonal(Csr const* m) {
+    if (original_idx.row < 0 || is_shared() || m->rows() != original_matrix->rows()) {
+        return false;
     }
-    h2.makeCompressed();
-    optimized_matrix = h2.markAsRValue();
 
-    sizes.pop_back(); // the last element is a duplicate of the second to last
-    sizes.shrink_to_fit();
+    if (is_permuted()) {
+        // Only the scaled matrix has values: the current permutation stays valid
+        auto h2 = std::make_shared<Csr>();
+        scale_matrix(*m, original_scale, *h2, pool);
+        scaled_matrix = std::move(h2);
+        scaled_matrix_scale = original_scale;
+        auto updated = make_permuted(scaled_matrix, permuted().order);
+        optimized_matrix = std::move(updated);
+        original_matrix = m;
+        matrix_id = next_matrix_id();
+        cache.clear();
+        return true;
+    }
+
+    auto const slots = var::apply_visitor(DiagonalSlots{}, optimized_matrix);
+    if (std::find(slots.begin(), slots.end(), -1) != slots.end()) {
+        return false;
+    }
 
-    optimized_idx = reorder_indices(idx, reorder_map);
-    optimized_sizes = {std::move(sizes), optimized_idx};
+    // Same scaling as `create_scaled()` and `create_reordered()`
+    auto const size = static_cast<int>(m->rows());
+    auto const inverted_a = real_t{2 / original_scale.a};
+    auto const diagonal = DiagonalSlots{}(*m);
+    auto values = ArrayX<scalar_t>(size);
+    for (auto row = 0; row < size; ++row) {
+        auto const original_row = original_rows.size() != 0 ? original_rows[row] : row;
+        auto const value = diagonal[original_row] >= 0 ? m->valuePtr()[diagonal[original_row]]
+                                                       : scalar_t{0};
+        values[row] = value * inverted_a - original_scale.b * inverted_a;
+    }
+
+    var::apply_visitor(SetDiagonal<scalar_t, index_t>{slots, values}, optimized_matrix);
+    original_matrix = m;
+    matrix_id = next_matrix_id();
+    cache.clear();
+    return true;
 }
 
-template<class scalar_t>
-num::EllMatrix<scalar_t>
-OptimizedHamiltonian<scalar_t>::convert_to_ellpack(SparseMatrixX<scalar_t> const& h2_csr) {
-    auto h2_ell = num::EllMatrix<scalar_t>(h2_csr.rows(), h2_csr.cols(),
-                                           sparse::max_nnz_per_row(h2_csr));
-    auto const h2_csr_loop = sparse::make_loop(h2_csr);
-    for (auto row = 0; row < h2_csr.rows(); ++row) {
-        auto n = 0;
-        h2_csr_loop.for_each_in_row(row, [&](int col, scalar_t value) {
-            h2_ell.data(row, n) = value;
-            h2_ell.indices(row, n) = col;
-            ++n;
-        });
-        for (; n < h2_ell.nnz_per_row; ++n) {
-            h2_ell.data(row, n) = scalar_t{0};
-            h2_ell.indices(row, n) = (row > 0) ? h2_ell.indices(row - 1, n) : 0;
+template<class scalar_t, class index_t>
+num::EllMatrix<scalar_t, index_t>
+OptimizedHamiltonian<scalar_t, index_t>::convert_to_ellpack(Csr const& h2_csr, ThreadPool* pool) {
+    auto const rows = static_cast<int>(h2_csr.rows());
+    auto h2_ell = num::EllMatrix<scalar_t, index_t>(h2_csr.rows(), h2_csr.cols(),
+                                                    sparse::max_nnz_per_row(h2_csr));
+    auto const width = static_cast<int>(h2_ell.nnz_per_row);
+    auto const indptr = h2_csr.outerIndexPtr();
+    auto const indices = h2_csr.innerIndexPtr();
+    auto const data = h2_csr.valuePtr();
+
+    // The padding repeats the column of the previous row (0 for the first one). Each thread
+    // fills its own rows one ELLPACK column at a time (contiguous writes): the padding at the
+    // start of its rows refers to the previous thread's rows, so it's marked (-1) for now.
+    auto const num_parts = pool ? pool->size() : 1;
+    auto last_columns = std::vector<ArrayXi>(num_parts, ArrayXi{ArrayXi::Constant(width, -1)});
+    parallel_for(pool, 0, rows, [&](int id, int start, int end) {
+        for (auto n = 0; n < width; ++n) {
+            auto previous = -1;
+            for (auto row = start; row < end; ++row) {
+                auto const k = indptr[row] + n;
+                if (k < indptr[row + 1]) {
+                    h2_ell.data(row, n) = data[k];
+                    previous = static_cast<int>(indices[k]);
+                } else {
+                    h2_ell.data(row, n) = scalar_t{0};
+                }
+                h2_ell.indices(row, n) = previous;
+            }
+            last_columns[id][n] = previous;
         }
+    });
+
+    // The threads' rows are contiguous and in order: carry the last column of each over
+    auto carried = std::vector<ArrayXi>(num_parts);
+    ArrayXi column = ArrayXi::Zero(width);
+    for (auto id = 0; id < num_parts; ++id) {
+        carried[id] = column;
+        column = (last_columns[id] >= 0).select(last_columns[id], column);
     }
+    parallel_for(pool, 0, rows, [&](int id, int start, int end) {
+        for (auto n = 0; n < width; ++n) {
+            for (auto row = start; row < end && h2_ell.indices(row, n) < 0; ++row) {
+                h2_ell.indices(row, n) = carried[id][n];
+            }
+        }
+    });
     return h2_ell;
 }
 
-template<class scalar_t>
-Indices OptimizedHamiltonian<scalar_t>::reorder_indices(Indices const& original_idx,
-                                                        ArrayXi const& reorder_map) {
+template<class scalar_t, class index_t>
+void OptimizedHamiltonian<scalar_t, index_t>::sort_rows_for_sell(int sigma) {
+    auto const& h2 = csr();
+    auto const system_size = static_cast<int>(h2.rows());
+    auto const indptr = h2.outerIndexPtr();
+    auto const indices = h2.innerIndexPtr();
+    auto const data = h2.valuePtr();
+    auto const row_nnz = [&](int row) { return indptr[row + 1] - indptr[row]; };
+
+    // Map from the sorted matrix indices to current indices. The rows only move within
+    // the segments given by the optimized sizes so that the sizes remain valid. The first
+    // segment holds the target indices (the KPM source is always index 0) so it's skipped.
+    auto order = std::vector<int>(system_size);
+    std::iota(order.begin(), order.end(), 0);
+    auto boundaries = optimized_sizes.get_data();
+    if (boundaries.back() != system_size) {
+        boundaries.push_back(system_size);
+    }
+    for (auto k = size_t{1}; k < boundaries.size(); ++k) {
+        for (auto start = boundaries[k - 1]; start < boundaries[k]; start += sigma) {
+            auto const end = std::min(start + sigma, boundaries[k]);
+            std::stable_sort(order.begin() + start, order.begin() + end,
+                             [&](int a, int b) { return row_nnz(a) > row_nnz(b); });
+        }
+    }
+
+    auto is_identity = true;
+    auto sort_map = ArrayXi(system_size);
+    for (auto i = 0; i < system_size; ++i) {
+        sort_map[order[i]] = i;
+        is_identity = is_identity && order[i] == i;
+    }
+    if (is_identity) {
+        return;
+    }
+
+    auto triplets = std::vector<Eigen::Triplet<scalar_t>>();
+    triplets.reserve(static_cast<size_t>(h2.nonZeros()));
+    for (auto row = 0; row < system_size; ++row) {
+        for (auto n = indptr[order[row]]; n < indptr[order[row] + 1]; ++n) {
+            triplets.emplace_back(row, sort_map[indices[n]], data[n]);
+        }
+    }
+
+    auto sorted = Csr(system_size, system_size);
+    sorted.setFromTriplets(triplets.begin(), triplets.end());
+    sorted.makeCompressed();
+    optimized_matrix = sorted.markAsRValue();
+
+    auto sorted_rows = ArrayXi(system_size);
+    for (auto i = 0; i < system_size; ++i) {
+        sorted_rows[i] = original_rows.size() != 0 ? original_rows[order[i]] : order[i];
+    }
+    original_rows = std::move(sorted_rows);
+
+    auto const& idx = optimized_idx;
+    assert(sort_map[idx.row] == idx.row);
+    auto cols = ArrayXi(idx.cols.size());
+    for (auto i = 0; i < cols.size(); ++i) {
+        cols[i] = sort_map[idx.cols[i]];
+    }
+    optimized_idx = {idx.row, cols};
+    optimized_sizes = {optimized_sizes.get_data(), optimized_idx};
+}
+
+template<class scalar_t, class index_t>
+num::SellMatrix<scalar_t, index_t>
+OptimizedHamiltonian<scalar_t, index_t>::convert_to_sell(Csr const& h2_csr, int chunk_size) {
+    auto const rows = static_cast<int>(h2_csr.rows());
+    auto const num_chunks = (rows + chunk_size - 1) / chunk_size;
+    auto const indptr = h2_csr.outerIndexPtr();
+    auto const indices = h2_csr.innerIndexPtr();
+    auto const data = h2_csr.valuePtr();
+
+    auto widths = ArrayX<index_t>{ArrayX<index_t>::Zero(num_chunks)};
+    for (auto row = 0; row < rows; ++row) {
+        auto& width = widths[row / chunk_size];
+        width = std::max(width, indptr[row + 1] - indptr[row]);
+    }
+
+    auto h2_sell = num::SellMatrix<scalar_t, index_t>(rows, static_cast<int>(h2_csr.cols()),
+                                                      chunk_size, widths);
+    for (auto row = 0; row < num_chunks * chunk_size; ++row) {
+        auto n = 0;
+        // The diagonal is a safe default for empty rows: it stays close to the chunk
+        auto last_col = std::min(row, static_cast<int>(h2_csr.cols()) - 1);
+        if (row < rows) {
+            for (auto k = indptr[row]; k < indptr[row + 1]; ++k, ++n) {
+                auto const offset = h2_sell.offset(row, n);
+                h2_sell.data[offset] = data[k];
+                h2_sell.indices[offset] = indices[k];
+                last_col = static_cast<int>(indices[k]);
+            }
+        }
+        // Padding: zero values with a valid (and likely cached) column index
+        for (; n < widths[row / chunk_size]; ++n) {
+            auto const k = h2_sell.offset(row, n);
+            h2_sell.data[k] = scalar_t{0};
+            h2_sell.indices[k] = last_col;
+        }
+    }
+    return h2_sell;
+}
+
+template<class scalar_t, class index_t>
+Indices OptimizedHamiltonian<scalar_t, index_t>::reorder_indices(Indices const& original_idx,
+                                                                 ArrayXi const& reorder_map) {
     auto const size = original_idx.cols.size();
     ArrayXi cols(size);
     for (auto i = 0; i < size; ++i) {
         cols[i] = reorder_map[original_idx.cols[i]];
     }
     // original_idx.row is always reordered to 0, that's the whole purpose of the optimization
+    assert(reorder_map[original_idx.row] == 0);
     return {0, cols};
 }
 
@@ -166,31 +1084,69 @@ namespace {
     struct NonZeros {
         int rows;
 
-        template<class scalar_t>
-        size_t operator()(SparseMatrixX<scalar_t> const& csr) {
+        template<class scalar_t, class index_t>
+        size_t operator()(SparseMatrixX<scalar_t, index_t> const& csr) {
             return static_cast<size_t>(csr.outerIndexPtr()[rows]);
         }
 
-        template<class scalar_t>
-        size_t operator()(num::EllMatrix<scalar_t> const& ell) {
+        template<class scalar_t, class index_t>
+        size_t operator()(num::EllMatrix<scalar_t, index_t> const& ell) {
             return static_cast<size_t>((rows - 1) * ell.nnz_per_row);
         }
+
+        template<class scalar_t, class index_t>
+        size_t operator()(num::SellMatrix<scalar_t, index_t> const& sell) {
+            auto const chunks = (rows + sell.chunk_size - 1) / sell.chunk_size;
+            return static_cast<size_t>(sell.chunk_ptr[chunks]);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::PermutedMatrix<scalar_t> const& permuted) {
+            return static_cast<size_t>(permuted.row_starts[rows]);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::BsrMatrix<scalar_t> const& bsr) {
+            // Each row of a block row has the same number of values
+            auto const size = bsr.block_size;
+            auto const full = rows / size;
+            auto values = static_cast<size_t>(bsr.block_ptr[full]) * size * size;
+            if (rows % size != 0) {
+                auto const blocks = bsr.block_ptr[full + 1] - bsr.block_ptr[full];
+                values += static_cast<size_t>(blocks) * size * (rows % size);
+            }
+            return values;
+        }
+
+        /// Each off-diagonal element is applied twice: once as stored and once transposed
+        template<class scalar_t>
+        size_t operator()(num::SymmetricMatrix<scalar_t> const& symmetric) {
+            auto const stored = static_cast<size_t>(symmetric.upper.outerIndexPtr()[rows]);
+            return 2 * stored - static_cast<size_t>(rows);
+        }
+
+        template<class scalar_t>
+        size_t operator()(num::BulkBoundaryMatrix<scalar_t> const& split) {
+            auto const bulk = split.bulk.outerIndexPtr()[rows];
+            auto const boundary = split.boundary.outerIndexPtr()[split.first_boundary_row(rows)];
+            return static_cast<size_t>(bulk + boundary);
+        }
     };
 }
 
-template<class scalar_t>
-size_t OptimizedHamiltonian<scalar_t>::optimized_area(int num_moments) const {
+template<class scalar_t, class index_t>
+size_t OptimizedHamiltonian<scalar_t, index_t>::optimized_area(int num_moments) const {
     auto area = size_t{0};
     for (auto n = 0; n < num_moments; ++n) {
         auto const rows = optimized_sizes.optimal(n, num_moments);
-        auto const num_nonzeros = var::apply_visitor(NonZeros{rows}, optimized_matrix);
+        auto const num_nonzeros = var::apply_visitor(NonZeros{rows}, matrix());
         area += num_nonzeros;
     }
     return area;
 }
 
-template<class scalar_t>
-size_t OptimizedHamiltonian<scalar_t>::operations(int num_moments) const {
+template<class scalar_t, class index_t>
+size_t OptimizedHamiltonian<scalar_t, index_t>::operations(int num_moments) const {
     auto ops = optimized_area(num_moments);
     if (optimized_idx.is_diagonal()) {
         ops /= 2;
@@ -201,35 +1157,88 @@ size_t OptimizedHamiltonian<scalar_t>::operations(int num_moments) const {
     return ops;
 }
 
-namespace {
-    /// Return the data size in bytes
-    struct matrix_memory {
-        template<class scalar_t>
-        size_t operator()(SparseMatrixX<scalar_t> const& csr) const {
-            using index_t = typename SparseMatrixX<scalar_t>::Index;
-            auto const nnz = static_cast<size_t>(csr.nonZeros());
-            auto const row_starts = static_cast<size_t>(csr.rows() + 1);
-            return nnz * sizeof(scalar_t) + nnz * sizeof(index_t) + row_starts * sizeof(index_t);
+template<class scalar_t, class index_t>
+size_t OptimizedHamiltonian<scalar_t, index_t>::block_operations(int num_moments,
+                                                                 int block_size,
+                                                                 bool full_system) const {
+    // The diagonal algorithm does one multiplication and two dot products per two moments
+    auto ops = size_t{0};
+    if (full_system) {
+        auto const rows = original_matrix->rows();
+        auto const num_nonzeros = var::apply_visitor(NonZeros{rows}, matrix());
+        ops = (num_nonzeros + 2 * static_cast<size_t>(rows)) * (num_moments / 2);
+    } else {
+        ops = optimized_area(num_moments) / 2;
+        for (auto n = 0; n <= num_moments / 2; ++n) {
+            ops += 2 * static_cast<size_t>(optimized_sizes.optimal(n, num_moments));
         }
+    }
+    return ops * static_cast<size_t>(block_size);
+}
 
-        template<class scalar_t>
-        size_t operator()(num::EllMatrix<scalar_t> const& ell) const {
-            using index_t = typename num::EllMatrix<scalar_t>::Index;
-            auto const nnz = static_cast<size_t>(ell.nonZeros());
-            return nnz * sizeof(scalar_t) + nnz * sizeof(index_t);
+template<class scalar_t, class index_t>
+size_t OptimizedHamiltonian<scalar_t, index_t>::memory_usage() const {
+    return var::apply_visitor(matrix_memory{}, matrix());
+}
+
+template<class scalar_t, class index_t>
+double OptimizedHamiltonian<scalar_t, index_t>::traffic_area(int num_moments,
+                                                             int block_size) const {
+    auto const total_nonzeros = var::apply_visitor(NonZeros{original_matrix->rows()}, matrix());
+    auto const bytes_per_nonzero = total_nonzeros > 0
+                                   ? static_cast<double>(memory_usage()) / total_nonzeros
+                                   : 0.0;
+    // `y = h2 * x - y`: `x` and `y` are loaded and `y` is stored
+    auto const bytes_per_row = 3.0 * sizeof(scalar_t) * block_size;
+
+    auto bytes = 0.0;
+    for (auto n = 0; n < num_moments; ++n) {
+        auto const rows = optimized_sizes.optimal(n, num_moments);
+        auto const num_nonzeros = var::apply_visitor(NonZeros{rows}, matrix());
+        bytes += bytes_per_nonzero * num_nonzeros + bytes_per_row * rows;
+    }
+    return bytes;
+}
+
+template<class scalar_t, class index_t>
+size_t OptimizedHamiltonian<scalar_t, index_t>::memory_traffic(int num_moments,
+                                                               int block_size) const {
+    auto bytes = traffic_area(num_moments, block_size);
+    if (optimized_idx.is_diagonal()) {
+        // Half the multiplications, but the two dot products load `r0` and `r1` once more
+        bytes /= 2;
+        for (auto n = 0; n <= num_moments / 2; ++n) {
+            bytes += 2.0 * sizeof(scalar_t) * block_size
+                     * optimized_sizes.optimal(n, num_moments);
         }
-    };
+    }
+    return static_cast<size_t>(bytes);
 }
 
-template<class scalar_t>
-size_t OptimizedHamiltonian<scalar_t>::memory_usage() const {
-    return var::apply_visitor(matrix_memory{}, optimized_matrix);
+template<class scalar_t, class index_t>
+size_t OptimizedHamiltonian<scalar_t, index_t>::block_memory_traffic(int num_moments,
+                                                                     int block_size,
+                                                                     bool full_system) const {
+    // The matrix is loaded once for the whole block, the vectors once per block column
+    auto bytes = 0.0;
+    if (full_system) {
+        auto const rows = static_cast<double>(original_matrix->rows());
+        auto const vector_bytes = 5.0 * sizeof(scalar_t) * block_size * rows;
+        bytes = (static_cast<double>(memory_usage()) + vector_bytes) * (num_moments / 2);
+    } else {
+        bytes = traffic_area(num_moments, block_size) / 2;
+        for (auto n = 0; n <= num_moments / 2; ++n) {
+            bytes += 2.0 * sizeof(scalar_t) * block_size
+                     * optimized_sizes.optimal(n, num_moments);
+        }
+    }
+    return static_cast<size_t>(bytes);
 }
 
-template<class scalar_t>
-std::string OptimizedHamiltonian<scalar_t>::report(int num_moments, bool shortform) const {
+template<class scalar_t, class index_t>
+std::string OptimizedHamiltonian<scalar_t, index_t>::report(int num_moments, bool shortform) const {
     auto const removed_percent = [&]{
-        auto const nnz = var::apply_visitor(NonZeros{original_matrix->rows()}, optimized_matrix);
+        auto const nnz = var::apply_visitor(NonZeros{original_matrix->rows()}, matrix());
         auto const full_area = static_cast<double>(nnz) * num_moments;
         return 100 * (full_area - optimized_area(num_moments)) / full_area;
     }();
@@ -242,5 +1251,6 @@ std::string OptimizedHamiltonian<scalar_t>::report(int num_moments, bool shortfo
 }
 
 CPB_INSTANTIATE_TEMPLATE_CLASS(OptimizedHamiltonian)
+CPB_INSTANTIATE_TEMPLATE_CLASS_VARGS(OptimizedHamiltonian, std::int64_t)
 
 }} // namespace cpb::kpm
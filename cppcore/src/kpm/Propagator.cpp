@@ -0,0 +1,197 @@
+#include "kpm/Propagator.hpp"
+
+#include "compute/kernel_polynomial.hpp"
+#include "numeric/constant.hpp"
+
+#include <array>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+namespace cpb { namespace kpm {
+
+ArrayXd bessel_j(int num, double x) {
+    ArrayXd result = ArrayXd::Zero(num);
+    if (num == 0) {
+        return result;
+    } else if (x == 0) {
+        result[0] = 1;
+        return result;
+    }
+
+    // The backward recurrence is stable, but it must start well above `num` and `x`
+    auto const ax = std::abs(x);
+    auto const n = std::max(num, static_cast<int>(ax) + 1);
+    auto const start = 2 * ((n + static_cast<int>(std::sqrt(160.0 * n))) / 2) + 2;
+
+    constexpr auto big = 1e250;
+    constexpr auto small = 1e-250;
+    auto next = 0.0; // J_{k+1}
+    auto current = 1e-30; // J_k, arbitrary starting value
+    auto norm = 0.0; // J_0 + 2 * sum(J_2k)
+    for (auto k = start; k > 0; --k) {
+        auto const previous = 2 * k / ax * current - next;
+        next = current;
+        current = previous; // J_{k-1}
+        if (std::abs(current) > big) {
+            current *= small;
+            next *= small;
+            norm *= small;
+            result *= small;
+        }
+        if (k - 1 < num) {
+            result[k - 1] = current;
+        }
+        if ((k - 1) % 2 == 0) {
+            norm += (k - 1 == 0) ? current : 2 * current;
+        }
+    }
+    result /= norm;
+
+    if (x < 0) { // J_n(-x) = (-1)^n * J_n(x)
+        for (auto i = 1; i < num; i += 2) {
+            result[i] = -result[i];
+        }
+    }
+    return result;
+}
+
+namespace {
+    /// The complex state as vectors of the Hamiltonian scalar type: a real Hamiltonian
+    /// propagates the real and imaginary parts separately
+    template<class real_t>
+    std::vector<VectorX<real_t>> split(VectorX<std::complex<real_t>> const& state, real_t) {
+        return {state.real(), state.imag()};
+    }
+
+    template<class real_t>
+    std::vector<VectorX<std::complex<real_t>>> split(VectorX<std::complex<real_t>> const& state,
+                                                     std::complex<real_t>) {
+        return {state};
+    }
+
+    /// `result += c * v`
+    template<class complex_t, class scalar_t>
+    void accumulate(VectorX<complex_t>& result, complex_t c, VectorX<scalar_t> const& v) {
+        for (auto i = 0; i < result.size(); ++i) {
+            result[i] += c * v[i];
+        }
+    }
+} // anonymous namespace
+
+template<class scalar_t>
+Propagator<scalar_t>::Propagator(SparseMatrixX<scalar_t> const* hamiltonian,
+                                 Scale<real_t> scale, MatrixConfig::Format format)
+    : scale(scale), format(format), num_rows(static_cast<int>(hamiltonian->rows())),
+      oh(hamiltonian, {MatrixConfig::Reorder::OFF, format}) {
+    if (scale.a == 0) {
+        throw std::invalid_argument("Propagator: invalid Hamiltonian scaling factors.");
+    }
+    oh.optimize_for({0, 0}, scale);
+}
+
+template<class scalar_t>
+VectorX<typename Propagator<scalar_t>::complex_t>
+Propagator<scalar_t>::evolve(VectorX<complex_t> const& state, double time) const {
+    return step(state, coefficients(time));
+}
+
+template<class scalar_t>
+MatrixX<typename Propagator<scalar_t>::complex_t>
+Propagator<scalar_t>::evolve_steps(VectorX<complex_t> const& state, double time_step,
+                                   int num_steps) const {
+    if (num_steps < 0) {
+        throw std::invalid_argument("Propagator: the number of steps can't be negative.");
+    }
+    auto const c = coefficients(time_step);
+    auto result = MatrixX<complex_t>(state.size(), num_steps);
+    VectorX<complex_t> current = state;
+    for (auto i = 0; i < num_steps; ++i) {
+        current = step(current, c);
+        result.col(i) = current;
+    }
+    return result;
+}
+
+template<class scalar_t>
+ArrayXcd Propagator<scalar_t>::coefficients(double time) const {
+    // `time` in fs and energy in eV: the argument `a*t` is in units of hbar
+    auto const to_hbar_units = 1e-15 / static_cast<double>(constant::hbar);
+    auto const x = static_cast<double>(scale.a) * time * to_hbar_units;
+    auto const bt = static_cast<double>(scale.b) * time * to_hbar_units;
+
+    // `J_n(x)` falls off super-exponentially over a width of `~x^(1/3)` above `n = x`
+    auto const ax = std::abs(x);
+    auto const j = bessel_j(static_cast<int>(ax + 10 * std::cbrt(ax)) + 40, x);
+    auto const tolerance = static_cast<double>(std::numeric_limits<real_t>::epsilon());
+    auto num_terms = static_cast<int>(j.size());
+    while (num_terms > 1 && std::abs(j[num_terms - 1]) < tolerance) {
+        --num_terms;
+    }
+
+    auto const phase = std::exp(std::complex<double>{0, -bt});
+    auto const minus_i_powers = std::array<std::complex<double>, 4>{{{1, 0}, {0, -1},
+                                                                     {-1, 0}, {0, 1}}};
+    auto c = ArrayXcd(num_terms);
+    for (auto n = 0; n < num_terms; ++n) {
+        c[n] = (n == 0 ? 1.0 : 2.0) * minus_i_powers[n % 4] * j[n] * phase;
+    }
+    return c;
+}
+
+template<class scalar_t>
+VectorX<typename Propagator<scalar_t>::complex_t>
+Propagator<scalar_t>::step(VectorX<complex_t> const& state, ArrayXcd const& c) const {
+    if (state.size() != num_rows) {
+        throw std::invalid_argument("Propagator: the size of the state doesn't match "
+                                    "the Hamiltonian.");
+    }
+    switch (format) {
+        case MatrixConfig::Format::ELL: return step(oh.ell(), state, c);
+        case MatrixConfig::Format::SELL: return step(oh.sell(), state, c);
+        case MatrixConfig::Format::BSR:
+            return oh.is_bsr() ? step(oh.bsr(), state, c) : step(oh.csr(), state, c);
+        case MatrixConfig::Format::SYMMETRIC: return step(oh.symmetric(), state, c);
+        case MatrixConfig::Format::BULK_BOUNDARY: return step(oh.bulk_boundary(), state, c);
+        default: return step(oh.csr(), state, c);
+    }
+}
+
+template<class scalar_t>
+template<class Matrix>
+VectorX<typename Propagator<scalar_t>::complex_t>
+Propagator<scalar_t>::step(Matrix const& h2, VectorX<complex_t> const& state,
+                           ArrayXcd const& c) const {
+    auto const num_terms = static_cast<int>(c.size());
+    VectorX<complex_t> result = VectorX<complex_t>::Zero(num_rows);
+
+    auto parts = split(state, scalar_t{});
+    for (auto k = std::size_t{0}; k < parts.size(); ++k) {
+        auto const weight = (k == 0) ? complex_t{1} : complex_t{0, 1};
+        auto const coefficient = [&](int n) {
+            return weight * num::complex_cast<complex_t>(c[n]);
+        };
+
+        // Chebyshev recurrence: r0 = T_0 * state, r1 = T_1 * state = h2/2 * state, ...
+        auto& r0 = parts[k];
+        VectorX<scalar_t> r1 = VectorX<scalar_t>::Zero(num_rows);
+        accumulate(result, coefficient(0), r0);
+        if (num_terms < 2) { continue; }
+
+        compute::kpm_spmv(0, num_rows, h2, r0, r1);
+        r1 *= real_t{0.5};
+        accumulate(result, coefficient(1), r1);
+
+        for (auto n = 2; n < num_terms; ++n) {
+            compute::kpm_spmv(0, num_rows, h2, r1, r0); // r0 = h2 * r1 - r0
+            r1.swap(r0);
+            accumulate(result, coefficient(n), r1);
+        }
+    }
+    return result;
+}
+
+CPB_INSTANTIATE_TEMPLATE_CLASS(Propagator)
+
+}} // namespace cpb::kpm
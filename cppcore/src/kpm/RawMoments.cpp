@@ -0,0 +1,38 @@
+#include "kpm/RawMoments.hpp"
+
+#include "support/format.hpp"
+
+namespace cpb { namespace kpm {
+
+int RawMoments::required_num_moments(double broadening, Kernel const& kernel) const {
+    auto const num_moments = kernel.required_num_moments(broadening / a);
+    if (num_moments > size()) {
+        throw std::invalid_argument(fmt::format(
+            "KPM: The broadening requires {} moments, but only {} are available.",
+            num_moments, size()
+        ));
+    }
+    return num_moments;
+}
+
+ArrayXcd RawMoments::damped(int num_moments, Kernel const& kernel) const {
+    auto moments = ArrayXcd{data.head(num_moments)};
+    kernel.apply(moments);
+    return moments;
+}
+
+ArrayXcd RawMoments::greens(ArrayXd const& energy, double broadening, Kernel const& kernel,
+                            Reconstruction method) const {
+    auto const moments = damped(required_num_moments(broadening, kernel), kernel);
+    ArrayXd const scaled_energy = (energy - b) / a;
+    return detail::reconstruct_greens(scaled_energy, moments, method);
+}
+
+ArrayXd RawMoments::ldos(ArrayXd const& energy, double broadening, Kernel const& kernel,
+                         Reconstruction method) const {
+    auto const moments = damped(required_num_moments(broadening, kernel), kernel);
+    ArrayXd const scaled_energy = (energy - b) / a;
+    return detail::reconstruct_function<double>(scaled_energy, moments.real(), method);
+}
+
+}} // namespace cpb::kpm
@@ -0,0 +1,264 @@
+#include "kpm/Recursion.hpp"
+
+#include "compute/kernel_polynomial.hpp"
+#include "numeric/constant.hpp"
+#include "numeric/random.hpp"
+#include "utils/ThreadPool.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+
+namespace cpb { namespace kpm {
+
+namespace {
+    /// Call `fn(thread_id, start, end)` for the rows of each thread, or all at once
+    template<class Fn>
+    void parallel_rows(ThreadPool* pool, int size, Fn fn) {
+        if (pool) {
+            pool->parallel_for(0, size, fn);
+        } else {
+            fn(0, 0, size);
+        }
+    }
+
+    /// The imaginary unit, which only a complex Hamiltonian can use in its vectors
+    template<class real_t>
+    real_t imaginary_unit(real_t) { return real_t{0}; }
+
+    template<class real_t>
+    std::complex<real_t> imaginary_unit(std::complex<real_t>) { return {0, 1}; }
+} // anonymous namespace
+
+ArrayXcd continued_fraction(Tridiagonal const& coefficients, ArrayXd const& scaled_energy,
+                            double scaled_broadening, Termination termination) {
+    auto const& alpha = coefficients.alpha;
+    auto const& beta = coefficients.beta;
+    auto const num_levels = static_cast<int>(alpha.size());
+    auto const has_tail = !coefficients.exact && termination == Termination::SquareRoot
+                          && beta.size() == alpha.size() && num_levels > 0;
+
+    // The tail is a chain of the average coefficients of the last quarter of the levels
+    auto a_inf = 0.0, b_inf = 0.0;
+    if (has_tail) {
+        auto const num_average = std::max(1, num_levels / 4);
+        a_inf = alpha.tail(num_average).mean();
+        b_inf = beta.tail(num_average).mean();
+    }
+
+    auto result = ArrayXcd(scaled_energy.size());
+    for (auto k = 0; k < scaled_energy.size(); ++k) {
+        auto const z = std::complex<double>{scaled_energy[k], scaled_broadening};
+
+        // The Green's function of the constant tail: `t = 1 / (z - a - b^2 t)`, the root
+        // with `Im(t) <= 0` is the retarded one
+        auto tail = std::complex<double>{0, 0};
+        if (has_tail && b_inf > 0) {
+            auto const w = z - a_inf;
+            auto const s = std::sqrt(w * w - 4 * b_inf * b_inf);
+            auto t = (w - s) / (2 * b_inf * b_inf);
+            if (t.imag() > 0) {
+                t = (w + s) / (2 * b_inf * b_inf);
+            }
+            tail = beta[num_levels - 1] * beta[num_levels - 1] * t;
+        }
+
+        auto g = std::complex<double>{0, 0};
+        for (auto n = num_levels - 1; n >= 0; --n) {
+            g = 1.0 / (z - alpha[n] - tail);
+            if (n > 0) {
+                tail = beta[n - 1] * beta[n - 1] * g;
+            }
+        }
+        result[k] = g;
+    }
+    return result;
+}
+
+template<class scalar_t>
+Recursion<scalar_t>::Recursion(SparseMatrixX<scalar_t> const* hamiltonian, Scale<real_t> scale,
+                               Termination termination, MatrixConfig::Format format,
+                               ThreadPool* pool)
+    : scale(scale), termination(termination), format(format),
+      // The upper triangle scatters to any row: the rows can't be split between threads
+      pool(format == MatrixConfig::Format::SYMMETRIC ? nullptr : pool),
+      num_rows(static_cast<int>(hamiltonian->rows())),
+      oh(hamiltonian, {MatrixConfig::Reorder::OFF, format}, 0, pool) {
+    if (scale.a == 0) {
+        throw std::invalid_argument("Recursion: invalid Hamiltonian scaling factors.");
+    }
+    oh.optimize_for({0, 0}, scale);
+}
+
+template<class scalar_t>
+Tridiagonal Recursion<scalar_t>::coefficients(VectorX<scalar_t> const& start,
+                                              int num_levels) const {
+    if (start.size() != num_rows) {
+        throw std::invalid_argument("Recursion: the size of the start vector doesn't match "
+                                    "the Hamiltonian.");
+    }
+    switch (format) {
+        case MatrixConfig::Format::ELL: return coefficients(oh.ell(), start, num_levels);
+        case MatrixConfig::Format::SELL: return coefficients(oh.sell(), start, num_levels);
+        case MatrixConfig::Format::BSR:
+            return oh.is_bsr() ? coefficients(oh.bsr(), start, num_levels)
+                               : coefficients(oh.csr(), start, num_levels);
+        case MatrixConfig::Format::SYMMETRIC:
+            return coefficients(oh.symmetric(), start, num_levels);
+        case MatrixConfig::Format::BULK_BOUNDARY:
+            return coefficients(oh.bulk_boundary(), start, num_levels);
+        default: return coefficients(oh.csr(), start, num_levels);
+    }
+}
+
+template<class scalar_t>
+template<class Matrix>
+Tridiagonal Recursion<scalar_t>::coefficients(Matrix const& h2, VectorX<scalar_t> q,
+                                              int num_levels) const {
+    auto const norm = q.norm();
+    if (norm == 0) {
+        throw std::invalid_argument("Recursion: the start vector can't be zero.");
+    }
+    q /= norm;
+    VectorX<scalar_t> p = VectorX<scalar_t>::Zero(num_rows); // the previous level
+
+    auto alpha = std::vector<double>();
+    auto beta = std::vector<double>();
+    alpha.reserve(num_levels);
+    beta.reserve(num_levels);
+
+    // Below this, the Krylov space is exhausted and the continued fraction is exact
+    auto const breakdown = 10 * static_cast<double>(std::numeric_limits<real_t>::epsilon());
+    auto const num_threads = pool ? pool->size() : 1;
+    auto partial = std::vector<double>(num_threads);
+    auto b = 0.0;
+    auto exact = false;
+    for (auto n = 0; n < num_levels; ++n) {
+        // p = (h2 * q - 2b * p) / 2 = H q - b p, where `h2 = 2 * (H - b) / a` is scaled
+        std::fill(partial.begin(), partial.end(), 0.0);
+        parallel_rows(pool, num_rows, [&](int id, int start, int end) {
+            auto const size = end - start;
+            p.segment(start, size) *= static_cast<real_t>(2 * b);
+            compute::kpm_spmv(start, end, h2, q, p);
+            p.segment(start, size) *= real_t{0.5};
+            partial[id] = static_cast<double>(
+                std::real(q.segment(start, size).dot(p.segment(start, size)))
+            );
+        });
+        auto const a = std::accumulate(partial.begin(), partial.end(), 0.0);
+
+        std::fill(partial.begin(), partial.end(), 0.0);
+        parallel_rows(pool, num_rows, [&](int id, int start, int end) {
+            auto const size = end - start;
+            p.segment(start, size) -= static_cast<real_t>(a) * q.segment(start, size);
+            partial[id] = static_cast<double>(p.segment(start, size).squaredNorm());
+        });
+        b = std::sqrt(std::accumulate(partial.begin(), partial.end(), 0.0));
+
+        alpha.push_back(a);
+        if (b < breakdown) {
+            exact = true;
+            break;
+        }
+        beta.push_back(b);
+
+        parallel_rows(pool, num_rows, [&](int, int start, int end) {
+            p.segment(start, end - start) *= static_cast<real_t>(1 / b);
+        });
+        q.swap(p);
+    }
+
+    auto result = Tridiagonal();
+    result.alpha = eigen_cast<ArrayX>(alpha);
+    result.beta = eigen_cast<ArrayX>(beta);
+    result.exact = exact;
+    return result;
+}
+
+template<class scalar_t>
+ArrayXcd Recursion<scalar_t>::diagonal(VectorX<scalar_t> const& start, ArrayXd const& energy,
+                                       double broadening) const {
+    auto const num_levels = required_num_levels(broadening);
+    auto const a = static_cast<double>(scale.a);
+    auto const b = static_cast<double>(scale.b);
+    ArrayXd const scaled_energy = (energy - b) / a;
+    return continued_fraction(coefficients(start, num_levels), scaled_energy, broadening / a,
+                              termination);
+}
+
+template<class scalar_t>
+ArrayXd Recursion<scalar_t>::ldos(int index, ArrayXd const& energy, double broadening) const {
+    if (index < 0 || index >= num_rows) {
+        throw std::invalid_argument("Recursion: invalid index value.");
+    }
+    VectorX<scalar_t> start = VectorX<scalar_t>::Zero(num_rows);
+    start[index] = scalar_t{1};
+    return -diagonal(start, energy, broadening).imag() / static_cast<double>(constant::pi);
+}
+
+template<class scalar_t>
+ArrayXd Recursion<scalar_t>::dos(ArrayXd const& energy, double broadening,
+                                 int num_random) const {
+    if (num_random < 1) {
+        throw std::invalid_argument("Recursion: at least one random vector is required.");
+    }
+    auto result = ArrayXd{ArrayXd::Zero(energy.size())};
+    auto start = VectorX<scalar_t>(num_rows);
+    for (auto n = 0; n < num_random; ++n) {
+        num::random_phase_fill(start, std::mt19937::default_seed, static_cast<std::uint64_t>(n));
+        result -= diagonal(start, energy, broadening).imag();
+    }
+    // The start vectors are normalized while the trace needs `|r|^2 = N` as in `Strategy`
+    return result * (static_cast<double>(num_rows)
+                     / (static_cast<double>(constant::pi) * num_random));
+}
+
+template<class scalar_t>
+ArrayXcd Recursion<scalar_t>::greens(int row, int col, ArrayXd const& energy,
+                                     double broadening) const {
+    if (row < 0 || row >= num_rows || col < 0 || col >= num_rows) {
+        throw std::invalid_argument("Recursion: invalid index value.");
+    }
+
+    auto unit = [&](int index) {
+        VectorX<scalar_t> v = VectorX<scalar_t>::Zero(num_rows);
+        v[index] = scalar_t{1};
+        return v;
+    };
+    if (row == col) {
+        return diagonal(unit(row), energy, broadening);
+    }
+
+    // With normalized `|c> +- |r>`: `G_cr + G_rc = G_+ - G_-`
+    auto const c = unit(col);
+    auto const r = unit(row);
+    ArrayXcd const sum = diagonal(c + r, energy, broadening)
+                         - diagonal(c - r, energy, broadening);
+    if (!num::is_complex<scalar_t>()) {
+        return sum / 2.0; // symmetric: `G_cr = G_rc`
+    }
+
+    // With normalized `|c> +- i|r>`: `G_cr - G_rc = -i * (G_+i - G_-i)`
+    auto const i = imaginary_unit(scalar_t{});
+    ArrayXcd const difference = diagonal(c + i * r, energy, broadening)
+                                - diagonal(c - i * r, energy, broadening);
+    return (sum - std::complex<double>{0, 1} * difference) / 2.0;
+}
+
+template<class scalar_t>
+int Recursion<scalar_t>::required_num_levels(double broadening) const {
+    if (broadening <= 0) {
+        throw std::invalid_argument("Recursion: the broadening must be positive.");
+    }
+    // A level resolves about `2 / num_levels` of the scaled spectrum
+    auto const levels = std::ceil(2 * static_cast<double>(scale.a) / broadening);
+    return static_cast<int>(std::min(levels, static_cast<double>(std::max(num_rows, 2))));
+}
+
+CPB_INSTANTIATE_TEMPLATE_CLASS(Recursion)
+
+}} // namespace cpb::kpm
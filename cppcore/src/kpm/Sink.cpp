@@ -0,0 +1,132 @@
+#include "kpm/Sink.hpp"
+
+#include "support/format.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+namespace cpb { namespace kpm {
+namespace {
+
+constexpr char magic[8] = {'P', 'B', 'K', 'P', 'M', 'R', 'E', 'S'};
+constexpr auto version = std::int32_t{1};
+
+template<class T>
+void read_raw(std::ifstream& file, T* data, std::size_t count) {
+    file.read(reinterpret_cast<char*>(data), static_cast<std::streamsize>(count * sizeof(T)));
+}
+
+} // anonymous namespace
+
+BinaryFileSink::BinaryFileSink(std::string filename, int chunk_size)
+    : filename(std::move(filename)), chunk_size(std::max(chunk_size, 1)) {}
+
+void BinaryFileSink::begin(ArrayXd const& energy, int num_results, bool complex_results) {
+    file.open(filename, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        throw std::runtime_error(fmt::format("Could not write the results file: {}", filename));
+    }
+
+    is_complex = complex_results;
+    chunk_indices.clear();
+    chunk.resize(energy.size(), chunk_size);
+
+    auto const header = std::vector<std::int32_t>{
+        version, is_complex, static_cast<std::int32_t>(energy.size()), num_results
+    };
+    raw(magic, sizeof(magic));
+    raw(header.data(), header.size() * sizeof(std::int32_t));
+    raw(energy.data(), static_cast<std::size_t>(energy.size()) * sizeof(double));
+}
+
+void BinaryFileSink::write(int index, ArrayXcd const& result) {
+    assert(result.size() == chunk.rows());
+    chunk.col(static_cast<int>(chunk_indices.size())) = result;
+    chunk_indices.push_back(index);
+    if (static_cast<int>(chunk_indices.size()) == chunk_size) {
+        write_chunk();
+    }
+}
+
+void BinaryFileSink::finish() {
+    write_chunk();
+    file.close();
+    if (!file) {
+        throw std::runtime_error(fmt::format("Could not write the results file: {}", filename));
+    }
+}
+
+void BinaryFileSink::write_chunk() {
+    auto const count = static_cast<std::int32_t>(chunk_indices.size());
+    if (count == 0) {
+        return;
+    }
+
+    raw(&count, sizeof(count));
+    raw(chunk_indices.data(), chunk_indices.size() * sizeof(int));
+    auto const num_values = static_cast<std::size_t>(chunk.rows() * count);
+    if (is_complex) {
+        raw(chunk.data(), num_values * sizeof(std::complex<double>));
+    } else {
+        ArrayXXd const real = chunk.leftCols(count).real();
+        raw(real.data(), num_values * sizeof(double));
+    }
+    chunk_indices.clear();
+}
+
+void BinaryFileSink::raw(void const* data, std::size_t bytes) {
+    file.write(static_cast<char const*>(data), static_cast<std::streamsize>(bytes));
+}
+
+StreamedResults read_results(std::string const& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    auto const error = [&]() {
+        return std::runtime_error(fmt::format("Invalid KPM results file: {}", filename));
+    };
+
+    char file_magic[sizeof(magic)] = {};
+    auto header = std::vector<std::int32_t>(4);
+    read_raw(file, file_magic, sizeof(magic));
+    read_raw(file, header.data(), header.size());
+    if (!file || std::memcmp(file_magic, magic, sizeof(magic)) != 0 || header[0] != version
+        || header[2] < 0 || header[3] < 0) {
+        throw error();
+    }
+
+    auto results = StreamedResults();
+    results.is_complex = header[1] != 0;
+    auto const num_energies = header[2];
+    auto const num_results = header[3];
+    results.energy.resize(num_energies);
+    results.indices.resize(num_results);
+    results.values.resize(num_energies, num_results);
+    read_raw(file, results.energy.data(), static_cast<std::size_t>(num_energies));
+
+    auto done = 0;
+    while (done < num_results) {
+        auto count = std::int32_t{0};
+        read_raw(file, &count, 1);
+        if (!file || count <= 0 || done + count > num_results) {
+            throw error();
+        }
+
+        read_raw(file, results.indices.data() + done, static_cast<std::size_t>(count));
+        auto const num_values = static_cast<std::size_t>(num_energies) * count;
+        if (results.is_complex) {
+            read_raw(file, results.values.col(done).data(), num_values);
+        } else {
+            auto real = ArrayXXd(num_energies, count);
+            read_raw(file, real.data(), num_values);
+            results.values.middleCols(done, count) = real.cast<std::complex<double>>();
+        }
+        if (!file) {
+            throw error();
+        }
+        done += count;
+    }
+    return results;
+}
+
+}} // namespace cpb::kpm
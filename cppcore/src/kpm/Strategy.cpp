@@ -1,120 +1,1529 @@
 #include "kpm/Strategy.hpp"
 
 #include "kpm/calc_moments.hpp"
+#include "utils/Trace.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <tuple>
 #ifdef CPB_USE_CUDA
 # include "cuda/kpm/calc_moments.hpp"
+# include <exception>
 #endif
 
 namespace cpb { namespace kpm {
 
 namespace {
+    /// Max number of random vectors which are computed together in a single block
+    constexpr auto max_random_block_size = 16;
+    /// Max number of target indices of `ldos_vector` which are computed together. The matrix
+    /// is reordered only once for all of them, but each block needs 3 vectors per index.
+    constexpr auto max_ldos_block_size = 32;
+    /// Memory budget (bytes) for the blocks of vectors of the 2D conductivity moments
+    constexpr auto conductivity_block_memory = std::size_t{512} * 1024 * 1024;
+    /// The first stage of `adaptive_diagonal_moments`, each of the following ones doubles it
+    constexpr auto min_adaptive_moments = 64;
+    /// Memory budget (bytes) for the Chebyshev basis of a `detail::ReconstructionPlan`
+    constexpr auto reconstruction_plan_memory = std::size_t{256} * 1024 * 1024;
+    /// Max number of Green's function results which are reconstructed together
+    constexpr auto max_greens_batch_size = 64;
+
+    /// Store the plane wave `c + i*s` of `k` index `j` in `row` of the start vectors: a real
+    /// matrix gets the real and imaginary parts as two separate columns
+    template<class real_t>
+    void set_plane_wave(RowMajorMatrixX<real_t>& start, int row, int j, double c, double s) {
+        start(row, 2 * j) = static_cast<real_t>(c);
+        start(row, 2 * j + 1) = static_cast<real_t>(s);
+    }
+
+    template<class real_t>
+    void set_plane_wave(RowMajorMatrixX<std::complex<real_t>>& start, int row, int j,
+                        double c, double s) {
+        start(row, j) = {static_cast<real_t>(c), static_cast<real_t>(s)};
+    }
+
+    /// Fill the `start` vectors with the normalized plane waves of `k_points[first]` to
+    /// `k_points[first + size - 1]`. The rows follow the `original_order` of the optimized
+    /// matrix, which is empty if it isn't reordered.
+    template<class scalar_t>
+    void fill_plane_waves(RowMajorMatrixX<scalar_t>& start, CartesianArray const& positions,
+                          ArrayXf const& weights, std::vector<Cartesian> const& k_points,
+                          int first, int size, ArrayXi const& original_order) {
+        auto const parts = num::is_complex<scalar_t>() ? 1 : 2;
+        auto const rows = static_cast<int>(weights.size());
+        auto const norm = 1 / std::sqrt(weights.cast<double>().square().sum());
+        start.resize(rows, parts * size);
+        for (auto row = 0; row < rows; ++row) {
+            auto const i = original_order.size() != 0 ? original_order[row] : row;
+            auto const r = positions[i].cast<double>().eval();
+            auto const w = weights[i] * norm;
+            for (auto j = 0; j < size; ++j) {
+                // Double precision: the phase of a site far from the origin is a large number
+                auto const phase = k_points[first + j].cast<double>().dot(r);
+                set_plane_wave(start, row, j, w * std::cos(phase), w * std::sin(phase));
+            }
+        }
+    }
+
+    /// Greedy coloring of the sparsity graph of `matrix`: the rows which are at most `distance`
+    /// hoppings apart get different colors. Each color is one probing vector of `density()`.
+    template<class scalar_t>
+    ArrayXi probing_colors(SparseMatrixX<scalar_t> const& matrix, int distance) {
+        auto const rows = static_cast<int>(matrix.rows());
+        auto const indptr = matrix.outerIndexPtr();
+        auto const indices = matrix.innerIndexPtr();
+        auto colors = ArrayXi::Constant(rows, -1).eval();
+        auto visited_by = ArrayXi::Constant(rows, -1).eval();
+        auto num_colors = 0;
+        auto is_used = std::vector<bool>();
+        auto reached = std::vector<int>();
+        auto frontier = std::vector<int>();
+        auto next = std::vector<int>();
+        for (auto i = 0; i < rows; ++i) {
+            // Breadth-first search up to `distance` hoppings away
+            visited_by[i] = i;
+            reached.assign(1, i);
+            frontier.assign(1, i);
+            for (auto d = 0; d < distance && !frontier.empty(); ++d) {
+                next.clear();
+                for (auto const row : frontier) {
+                    for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                        auto const j = indices[n];
+                        if (visited_by[j] == i) { continue; }
+                        visited_by[j] = i;
+                        next.push_back(j);
+                        reached.push_back(j);
+                    }
+                }
+                frontier.swap(next);
+            }
+
+            is_used.assign(num_colors + 1, false);
+            for (auto const j : reached) {
+                if (colors[j] >= 0) { is_used[colors[j]] = true; }
+            }
+            colors[i] = static_cast<int>(std::find(is_used.begin(), is_used.end(), false)
+                                         - is_used.begin());
+            num_colors = std::max(num_colors, colors[i] + 1);
+        }
+        return colors;
+    }
+
+    /// Fill the `start` vectors with the probing vectors of colors `first` to
+    /// `first + size - 1` or, without any `colors`, with random phase vectors of the same
+    /// streams as the trace. The rows follow the `original_order` (empty if not reordered).
+    template<class scalar_t>
+    void fill_density_vectors(RowMajorMatrixX<scalar_t>& start, ArrayXi const& colors,
+                              int rows, int first, int size, ArrayXi const& original_order) {
+        start.resize(rows, size);
+        if (colors.size() == 0) {
+            for (auto j = 0; j < size; ++j) {
+                auto const rng = num::Philox(std::mt19937::default_seed,
+                                             static_cast<std::uint64_t>(first + j));
+                for (auto row = 0; row < rows; ++row) {
+                    start(row, j) = num::random_phase<scalar_t>(rng,
+                                                                static_cast<std::uint64_t>(row));
+                }
+            }
+            return;
+        }
+
+        start.setZero();
+        for (auto row = 0; row < rows; ++row) {
+            auto const i = original_order.size() != 0 ? original_order[row] : row;
+            auto const j = colors[i] - first;
+            if (j >= 0 && j < size) { start(row, j) = 1; }
+        }
+    }
+
+    /// Collects the results in memory for the `_vector` functions: real results (LDOS) are
+    /// kept as real values, only complex results (Green's function) take twice the memory
+    class MemorySink final : public Sink {
+    public:
+        void begin(ArrayXd const& energy, int num_results, bool complex_results) override {
+            is_complex = complex_results;
+            if (is_complex) {
+                results.resize(energy.size(), num_results);
+            } else {
+                real_results.resize(energy.size(), num_results);
+            }
+            count = 0;
+        }
+        void write(int, ArrayXcd const& result) override {
+            if (is_complex) {
+                results.col(count++) = result;
+            } else {
+                real_results.col(count++) = result.real();
+            }
+        }
+        void finish() override {}
+
+        ArrayXXcd results; ///< one column for each complex result
+        ArrayXXd real_results; ///< one column for each real result
+    private:
+        bool is_complex = true;
+        int count = 0;
+    };
+
     template<class scalar_t>
     Bounds<scalar_t> reset_bounds(SparseMatrixX<scalar_t> const* hamiltonian,
                                   Config const& config) {
         if (config.min_energy == config.max_energy) {
-            return {hamiltonian, config.lanczos_precision}; // will be automatically computed
+            // will be automatically computed
+            return {hamiltonian, config.lanczos_precision, config.bounds_method,
+                    config.cache_bounds};
         } else {
             return {config.min_energy, config.max_energy}; // user-defined bounds
         }
     }
+
+    /// Number of moments of each autotuning trial: `(n - 2) % 4 == 0` suits every kernel
+    constexpr auto tune_num_moments = 66;
+    /// Each level is timed this many times and the best run counts
+    constexpr auto tune_repeats = 3;
+
+    /// Matrices with the same fingerprint are expected to prefer the same `opt_level`:
+    /// rows, non-zeros, min and max row length and the number of threads
+    using Fingerprint = std::tuple<int, int, int, int, int>;
+
+    template<class scalar_t>
+    Fingerprint fingerprint(SparseMatrixX<scalar_t> const& h, int num_threads) {
+        auto const outer = h.outerIndexPtr();
+        auto min_row = h.rows() > 0 ? outer[1] - outer[0] : 0;
+        auto max_row = min_row;
+        for (auto i = 1; i < h.rows(); ++i) {
+            auto const length = outer[i + 1] - outer[i];
+            min_row = std::min(min_row, length);
+            max_row = std::max(max_row, length);
+        }
+        return Fingerprint{static_cast<int>(h.rows()), static_cast<int>(h.nonZeros()),
+                           static_cast<int>(min_row), static_cast<int>(max_row), num_threads};
+    }
+
+    /// The autotuned levels are shared by all strategies of the same type
+    std::mutex tuned_levels_mutex;
+
+    template<class scalar_t, class Impl>
+    std::map<Fingerprint, int>& tuned_levels() {
+        static std::map<Fingerprint, int> levels;
+        return levels;
+    }
 } // anonymous namespace
 
+MemoryEstimate estimate_memory(cpb::MemoryEstimate const& model, Config const& config) {
+    auto const rows = model.num_sites;
+    auto const value_bytes = static_cast<std::size_t>(model.scalar_bytes);
+
+    // The scaled CSR matrix is always made first and the other formats are converted from it
+    auto result = MemoryEstimate();
+    result.matrix_bytes = model.hamiltonian_nnz * (value_bytes + sizeof(int))
+                          + (rows + 1) * sizeof(int);
+    if (config.symmetric_storage) {
+        // The upper triangle and the whole diagonal
+        auto const nnz = (model.hamiltonian_nnz + rows) / 2;
+        result.matrix_bytes += nnz * (value_bytes + sizeof(int)) + (rows + 1) * sizeof(int);
+    } else if (config.permute_only) {
+        // Only the permutation of each target: the order, its inverse and the row starts
+        result.matrix_bytes += (3 * rows + 1) * sizeof(int);
+    } else if (config.opt_level >= 3 || config.opt_level == opt_level_auto) {
+        // ELLPACK is padded to the longest row (SELL only to the longest row of each chunk)
+        auto bytes_per_value = value_bytes + sizeof(int);
+        if (config.indexed_values) {
+            // The peak: the full values are only freed after they are indexed
+            bytes_per_value += sizeof(std::uint8_t);
+        } else if (config.reduced_precision) {
+            bytes_per_value += value_bytes / 2;
+        } else if (config.split_complex) {
+            bytes_per_value += value_bytes;
+        }
+        result.matrix_bytes += rows * static_cast<std::size_t>(model.max_nnz_per_row)
+                               * bytes_per_value;
+    }
+
+    // `r0` and `r1` of the recurrence and one more for the results
+    result.vector_bytes = 3 * rows * value_bytes;
+    return result;
+}
+
+namespace {
+    struct EnergyBounds {
+        Config const& config;
+
+        template<class scalar_t>
+        std::pair<double, double> operator()(SparseMatrixRC<scalar_t> const& h) const {
+            auto bounds = Bounds<scalar_t>(h.get(), config.lanczos_precision,
+                                           config.bounds_method, config.cache_bounds);
+            return {bounds.min_energy(), bounds.max_energy()};
+        }
+    };
+} // anonymous namespace
+
+std::pair<double, double> energy_bounds(Hamiltonian const& h, Config const& config) {
+    return var::apply_visitor(EnergyBounds{config}, h.get_variant());
+}
+
 template<class scalar_t, class Impl>
 StrategyTemplate<scalar_t, Impl>::StrategyTemplate(SparseMatrixRC<scalar_t> h,
                                                    Config const& config)
     : hamiltonian(std::move(h)), config(config), bounds(reset_bounds(hamiltonian.get(), config)),
-      optimized_hamiltonian(hamiltonian.get(), Impl::matrix_config(config.opt_level)) {
+      optimized_hamiltonian(hamiltonian.get(),
+                            matrix_config(config.opt_level), config.cache_memory),
+      opt_level(config.opt_level) {
     if (config.min_energy > config.max_energy) {
         throw std::invalid_argument("KPM: Invalid energy range specified (min > max).");
     }
+    if (config.num_threads < 1) {
+        throw std::invalid_argument("KPM: The number of threads must be at least 1.");
+    }
+    if (config.interleave_depth < 1) {
+        throw std::invalid_argument("KPM: The interleave depth must be at least 1.");
+    }
+    if (config.num_threads > 1) {
+        thread_pool = std14::make_unique<ThreadPool>(config.num_threads, config.pin_threads);
+        // The threads also reorder and convert the matrix
+        optimized_hamiltonian = {hamiltonian.get(), matrix_config(config.opt_level),
+                                 config.cache_memory, thread_pool.get()};
+    }
+}
+
+template<class scalar_t, class Impl>
+bool StrategyTemplate<scalar_t, Impl>::change_hamiltonian(Hamiltonian const& h,
+                                                          bool diagonal_only) {
+    if (!ham::is<scalar_t>(h)) {
+        return false;
+    }
+
+    auto const previous = hamiltonian; // keep it alive until the bounds are updated
+    hamiltonian = ham::get_shared_ptr<scalar_t>(h);
+    onsite_matrix.reset();
+    if (config.opt_level == opt_level_auto
+        && fingerprint(*hamiltonian, config.num_threads)
+           != fingerprint(*previous, config.num_threads)) {
+        opt_level = opt_level_auto; // a different structure may need a different level
+    }
+    optimized_hamiltonian = {hamiltonian.get(), matrix_config(opt_level), config.cache_memory,
+                             thread_pool.get()};
+    recursion_engine.reset();
+    matrix_stream.reset();
+
+    auto const is_automatic = config.min_energy == config.max_energy;
+    if (!(diagonal_only && is_automatic && bounds.shift_diagonal(*previous, hamiltonian.get()))) {
+        auto new_bounds = reset_bounds(hamiltonian.get(), config);
+        new_bounds.warm_start(std::move(bounds));
+        bounds = std::move(new_bounds);
+    }
+
+    return true;
+}
+
+template<class scalar_t, class Impl>
+bool StrategyTemplate<scalar_t, Impl>::change_onsite(ArrayXd const& onsite) {
+    if (onsite.size() != hamiltonian->rows()) {
+        throw std::invalid_argument("KPM: The number of onsite energies must match the "
+                                    "Hamiltonian size.");
+    }
+    scaling_factors(); // the bounds are final from here on: they won't need the old matrix
+
+    // The first call copies the matrix, which is shared with the model. The following calls
+    // (e.g. the next realizations) patch that copy in place while no one else holds it.
+    auto const in_place = onsite_matrix && onsite_matrix == hamiltonian
+                          && hamiltonian.use_count() == 2 && !config.share_matrix;
+    auto h = in_place ? onsite_matrix : std::make_shared<SparseMatrixX<scalar_t>>(*hamiltonian);
+    auto const indptr = h->outerIndexPtr();
+    auto const indices = h->innerIndexPtr();
+    auto slots = std::vector<std::ptrdiff_t>(static_cast<std::size_t>(h->rows()));
+    for (auto row = 0; row < h->rows(); ++row) {
+        auto const end = indices + indptr[row + 1];
+        auto const it = std::lower_bound(indices + indptr[row], end, row);
+        if (it == end || *it != row) {
+            return false; // before anything is written
+        }
+        slots[row] = it - indices;
+    }
+    auto const data = h->valuePtr();
+    for (auto row = 0; row < h->rows(); ++row) {
+        data[slots[row]] = static_cast<scalar_t>(onsite[row]);
+    }
+
+    if (optimized_hamiltonian.id() == 0 || !optimized_hamiltonian.update_diagonal(h.get())) {
+        // Nothing optimized yet or released to a stream, or it can't be patched: start over
+        optimized_hamiltonian = {h.get(), matrix_config(opt_level), config.cache_memory,
+                                 thread_pool.get()};
+    }
+    onsite_matrix = h;
+    hamiltonian = std::move(h);
+    recursion_engine.reset();
+    matrix_stream.reset();
+    return true;
+}
+
+template<class scalar_t, class Impl>
+ArrayXd StrategyTemplate<scalar_t, Impl>::ldos(int index, ArrayXd const& energy,
+                                               double broadening) {
+    if (config.recursion) {
+        auto const& recursion = make_recursion(broadening, 1);
+        stats.moments_timer.tic();
+        auto ldos = recursion.ldos(index, energy, broadening);
+        stats.moments_timer.toc();
+        return ldos;
+    }
+
+    auto const scale = scaling_factors();
+    auto const scaled_energy = bounds.scaled(energy.template cast<real_t>());
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+
+    optimized_hamiltonian.optimize_for({index, index}, scale);
+    reset_stats(num_moments, optimized_hamiltonian.operations(num_moments),
+                optimized_hamiltonian.memory_traffic(num_moments),
+                hamiltonian->rows() * sizeof(scalar_t));
+
+    if (damping.size() != 0) {
+        if (config.convergence_tolerance > 0) {
+            throw std::invalid_argument("KPM: The convergence tolerance doesn't support "
+                                        "damping (absorbing boundaries).");
+        }
+        auto moments = std::move(off_diagonal_moments(num_moments).front());
+        stats.reconstruction_timer.tic();
+        config.kernel.apply(moments);
+        auto ldos = detail::reconstruct_function<real_t>(scaled_energy, moments.real(),
+                                                         config.reconstruction);
+        stats.reconstruction_timer.toc();
+        return ldos.template cast<double>();
+    } else if (config.mixed_precision) {
+        auto moments = diagonal_moments<num::get_double_t<scalar_t>>(num_moments);
+        stats.reconstruction_timer.tic();
+        config.kernel.apply(moments);
+        ArrayXd const energy_d = scaled_energy.template cast<double>();
+        auto ldos = detail::reconstruct_function<double>(energy_d, moments.real(),
+                                                         config.reconstruction);
+        stats.reconstruction_timer.toc();
+        return ldos;
+    } else {
+        auto moments = diagonal_moments<scalar_t>(num_moments);
+        stats.reconstruction_timer.tic();
+        config.kernel.apply(moments);
+        auto ldos = detail::reconstruct_function<real_t>(scaled_energy, moments.real(),
+                                                         config.reconstruction);
+        stats.reconstruction_timer.toc();
+        return ldos.template cast<double>();
+    }
+}
+
+template<class scalar_t, class Impl>
+ArrayXXd StrategyTemplate<scalar_t, Impl>::ldos_vector(std::vector<int> const& indices,
+                                                       ArrayXd const& energy,
+                                                       double broadening) {
+    auto sink = MemorySink();
+    ldos_stream(indices, energy, broadening, sink);
+    return std::move(sink.real_results);
+}
+
+template<class scalar_t, class Impl>
+void StrategyTemplate<scalar_t, Impl>::ldos_stream(std::vector<int> const& indices,
+                                                   ArrayXd const& energy, double broadening,
+                                                   Sink& sink) {
+    assert(!indices.empty());
+    if (config.recursion) {
+        auto const num_indices = static_cast<int>(indices.size());
+        auto const& recursion = make_recursion(broadening, num_indices);
+        sink.begin(energy, num_indices, false);
+        for (auto const index : indices) {
+            stats.moments_timer.tic();
+            ArrayXcd const ldos = recursion.ldos(index, energy, broadening);
+            stats.moments_timer.toc_add();
+            sink.write(index, ldos);
+        }
+        sink.finish();
+        return;
+    }
+
+    if (config.convergence_tolerance > 0) {
+        // Each index stops at its own number of moments: one adaptive `ldos()` after another
+        // instead of the block kernels which compute the same number for all of them
+        auto const num_indices = static_cast<int>(indices.size());
+        auto max_used = 0;
+        sink.begin(energy, num_indices, false);
+        for (auto const index : indices) {
+            ArrayXcd const result = ldos(index, energy, broadening);
+            max_used = std::max(max_used, stats.used_moments);
+            sink.write(index, result);
+        }
+        sink.finish();
+        stats.used_moments = max_used;
+        return;
+    }
+
+    auto const scale = scaling_factors();
+    auto const scaled_energy = bounds.scaled(energy.template cast<real_t>());
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    auto const num_indices = static_cast<int>(indices.size());
+    auto const block_size = std::min(num_indices, max_ldos_block_size);
+
+    optimized_hamiltonian.optimize_for_block({indices.front(), indices}, scale);
+    reset_stats(num_moments, optimized_hamiltonian.block_operations(num_moments, num_indices),
+                optimized_hamiltonian.block_memory_traffic(num_moments, num_indices),
+                hamiltonian->rows() * block_size * sizeof(scalar_t));
+
+    sink.begin(energy, num_indices, false);
+    auto const use_plan = use_reconstruction_plan(num_indices, scaled_energy, num_moments);
+    auto const& optimized_indices = optimized_hamiltonian.idx().cols;
+    for (auto done = 0; done < num_indices; done += block_size) {
+        auto const size = std::min(block_size, num_indices - done);
+        auto moments = ExvalDiagonalBlockMoments<scalar_t>(
+            num_moments, optimized_indices.segment(done, size)
+        );
+
+        auto moments_span = trace::Span("KPM moments");
+        stats.moments_timer.tic();
+        Impl::diagonal_block(moments, optimized_hamiltonian, opt_level);
+        stats.moments_timer.toc_add();
+        moments_span.stop();
+
+        stats.reconstruction_timer.tic();
+        config.kernel.apply(moments.get());
+        if (use_plan) {
+            MatrixX<real_t> const m = moments.get().real().matrix();
+            MatrixX<real_t> const f = reconstruction_plan.functions(m);
+            for (auto i = 0; i < size; ++i) {
+                ArrayXcd const result = f.col(i).array().template cast<std::complex<double>>();
+                sink.write(indices[done + i], result);
+            }
+        } else {
+            for (auto i = 0; i < size; ++i) {
+                auto const m = ArrayX<real_t>{moments.get().col(i).real()};
+                auto const f = detail::reconstruct_function<real_t>(scaled_energy, m,
+                                                                    config.reconstruction);
+                sink.write(indices[done + i], f.template cast<std::complex<double>>());
+            }
+        }
+        stats.reconstruction_timer.toc_add();
+    }
+    sink.finish();
+}
+
+template<class scalar_t, class Impl>
+ArrayXd StrategyTemplate<scalar_t, Impl>::dos(ArrayXd const& energy, double broadening,
+                                              int num_random) {
+    assert(num_random > 0);
+    if (config.recursion) {
+        auto const& recursion = make_recursion(broadening, num_random);
+        stats.moments_timer.tic();
+        auto dos = recursion.dos(energy, broadening, num_random);
+        stats.moments_timer.toc();
+        return dos;
+    }
+
+    auto const scale = scaling_factors();
+    auto const scaled_energy = bounds.scaled(energy.template cast<real_t>());
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    auto moments = trace_moments(num_moments, num_random, std::mt19937::default_seed);
+
+    stats.reconstruction_timer.tic();
+    config.kernel.apply(moments);
+    auto dos = detail::reconstruct_function<real_t>(scaled_energy, moments.real(),
+                                                    config.reconstruction);
+    stats.reconstruction_timer.toc();
+    return dos.template cast<double>();
+}
+
+template<class scalar_t, class Impl>
+ArrayXXd StrategyTemplate<scalar_t, Impl>::spectral_function(CartesianArray const& positions,
+                                                             ArrayXf const& weights,
+                                                             std::vector<Cartesian> const& k_points,
+                                                             ArrayXd const& energy,
+                                                             double broadening) {
+    assert(!k_points.empty() && weights.size() == hamiltonian->rows());
+    auto const scale = scaling_factors();
+    auto const scaled_energy = bounds.scaled(energy.template cast<real_t>());
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    auto const num_k = static_cast<int>(k_points.size());
+    auto const parts = num::is_complex<scalar_t>() ? 1 : 2; // vectors per plane wave
+    auto const block_size = std::max(1, std::min(num_k, max_random_block_size / parts));
+
+    // Like the random vectors of the trace, the plane waves span the full system:
+    // any ordering will do as long as they follow it
+    if (optimized_hamiltonian.idx().row < 0) {
+        optimized_hamiltonian.optimize_for({0, 0}, scale);
+    }
+    reset_stats(num_moments,
+                optimized_hamiltonian.block_operations(num_moments, parts * num_k, true),
+                optimized_hamiltonian.block_memory_traffic(num_moments, parts * num_k, true),
+                hamiltonian->rows() * parts * block_size * sizeof(scalar_t));
+
+    auto const use_plan = use_reconstruction_plan(num_k, scaled_energy, num_moments);
+    auto result = ArrayXXd(energy.size(), num_k);
+    auto start = RowMajorMatrixX<scalar_t>();
+    for (auto done = 0; done < num_k; done += block_size) {
+        auto const size = std::min(block_size, num_k - done);
+        fill_plane_waves(start, positions, weights, k_points, done, size,
+                         optimized_hamiltonian.original_order());
+        auto moments = StartVectorMoments<scalar_t>(num_moments, start);
+
+        auto moments_span = trace::Span("KPM moments");
+        stats.moments_timer.tic();
+        Impl::trace_block(moments, optimized_hamiltonian, opt_level);
+        stats.moments_timer.toc_add();
+        moments_span.stop();
+
+        stats.reconstruction_timer.tic();
+        // The moments of the real and imaginary parts of a plane wave add up
+        auto mu = ArrayXX<scalar_t>(num_moments, size);
+        for (auto j = 0; j < size; ++j) {
+            mu.col(j) = moments.get().col(parts * j);
+            if (parts == 2) { mu.col(j) += moments.get().col(2 * j + 1); }
+        }
+        config.kernel.apply(mu);
+        if (use_plan) {
+            MatrixX<real_t> const m = mu.real().matrix();
+            MatrixX<real_t> const f = reconstruction_plan.functions(m);
+            result.middleCols(done, size) = f.array().template cast<double>();
+        } else {
+            for (auto j = 0; j < size; ++j) {
+                auto const m = ArrayX<real_t>{mu.col(j).real()};
+                auto const f = detail::reconstruct_function<real_t>(scaled_energy, m,
+                                                                    config.reconstruction);
+                result.col(done + j) = f.template cast<double>();
+            }
+        }
+        stats.reconstruction_timer.toc_add();
+    }
+    return result;
+}
+
+template<class scalar_t, class Impl>
+ArrayXXd StrategyTemplate<scalar_t, Impl>::projected_dos(ArrayXi const& labels, int num_labels,
+                                                         ArrayXd const& energy,
+                                                         double broadening, int num_random) {
+    assert(num_random > 0 && num_labels > 0 && labels.size() == hamiltonian->rows());
+    auto const scale = scaling_factors();
+    auto const scaled_energy = bounds.scaled(energy.template cast<real_t>());
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    auto const block_size = std::min(num_random, max_random_block_size);
+
+    if (optimized_hamiltonian.idx().row < 0) {
+        optimized_hamiltonian.optimize_for({0, 0}, scale);
+    }
+    // One moment per iteration: twice as many iterations as the trace
+    reset_stats(num_moments,
+                optimized_hamiltonian.block_operations(2 * num_moments, num_random, true),
+                optimized_hamiltonian.block_memory_traffic(2 * num_moments, num_random, true),
+                hamiltonian->rows() * 3 * block_size * sizeof(scalar_t));
+
+    auto const& order = optimized_hamiltonian.original_order();
+    auto optimized_labels = ArrayXi(labels.size());
+    for (auto row = 0; row < labels.size(); ++row) {
+        optimized_labels[row] = labels[order.size() != 0 ? order[row] : row];
+    }
+
+    auto total = ArrayXX<scalar_t>::Zero(num_moments, num_labels).eval();
+    auto moments_span = trace::Span("KPM moments");
+    stats.moments_timer.tic();
+    for (auto done = 0; done < num_random; done += block_size) {
+        auto const size = std::min(block_size, num_random - done);
+        auto moments = ProjectedTraceMoments<scalar_t>(num_moments, size,
+                                                       std::mt19937::default_seed, done,
+                                                       optimized_labels, num_labels);
+        Impl::projected_block(moments, optimized_hamiltonian, opt_level);
+        total += moments.get();
+    }
+    stats.moments_timer.toc();
+    moments_span.stop();
+
+    stats.reconstruction_timer.tic();
+    total /= static_cast<real_t>(num_random);
+    config.kernel.apply(total);
+    auto result = ArrayXXd(energy.size(), num_labels);
+    if (use_reconstruction_plan(num_labels, scaled_energy, num_moments)) {
+        MatrixX<real_t> const m = total.real().matrix();
+        MatrixX<real_t> const f = reconstruction_plan.functions(m);
+        result = f.array().template cast<double>();
+    } else {
+        for (auto p = 0; p < num_labels; ++p) {
+            auto const m = ArrayX<real_t>{total.col(p).real()};
+            auto const f = detail::reconstruct_function<real_t>(scaled_energy, m,
+                                                                config.reconstruction);
+            result.col(p) = f.template cast<double>();
+        }
+    }
+    stats.reconstruction_timer.toc();
+    return result;
+}
+
+template<class scalar_t, class Impl>
+ArrayXXd StrategyTemplate<scalar_t, Impl>::bond_currents(ArrayXi const& rows, ArrayXi const& cols,
+                                                         ArrayXd const& energy,
+                                                         double broadening, int num_random) {
+    assert(num_random >= 0 && rows.size() > 0 && rows.size() == cols.size());
+    auto const scale = scaling_factors();
+    auto const scaled_energy = bounds.scaled(energy.template cast<real_t>());
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    auto const num_bonds = static_cast<int>(rows.size());
+
+    if (optimized_hamiltonian.idx().row < 0) {
+        optimized_hamiltonian.optimize_for({0, 0}, scale);
+    }
+    auto const& order = optimized_hamiltonian.original_order();
+    auto position = ArrayXi(order.size());
+    for (auto row = 0; row < order.size(); ++row) {
+        position[order[row]] = row;
+    }
+    auto optimized_rows = ArrayXi(num_bonds);
+    auto optimized_cols = ArrayXi(num_bonds);
+    for (auto k = 0; k < num_bonds; ++k) {
+        optimized_rows[k] = order.size() != 0 ? position[rows[k]] : rows[k];
+        optimized_cols[k] = order.size() != 0 ? position[cols[k]] : cols[k];
+    }
+
+    // The exact version starts from the unit vector of each distinct row
+    auto source_list = std::vector<int>();
+    auto source_of_bond = ArrayXi(num_bonds);
+    if (num_random == 0) {
+        auto source_of_row = ArrayXi::Constant(hamiltonian->rows(), -1).eval();
+        for (auto k = 0; k < num_bonds; ++k) {
+            auto& source = source_of_row[optimized_rows[k]];
+            if (source < 0) {
+                source = static_cast<int>(source_list.size());
+                source_list.push_back(optimized_rows[k]);
+            }
+            source_of_bond[k] = source;
+        }
+    }
+    ArrayXi const sources = eigen_cast<ArrayX>(source_list);
+    auto const num_vectors = num_random > 0 ? num_random : static_cast<int>(sources.size());
+    auto const block_size = std::min(num_vectors, num_random > 0 ? max_random_block_size
+                                                                 : max_ldos_block_size);
+
+    // One moment per iteration, same as `projected_dos()`
+    reset_stats(num_moments,
+                optimized_hamiltonian.block_operations(2 * num_moments, num_vectors, true),
+                optimized_hamiltonian.block_memory_traffic(2 * num_moments, num_vectors, true),
+                hamiltonian->rows() * 3 * block_size * sizeof(scalar_t));
+
+    auto total = ArrayXX<scalar_t>::Zero(num_moments, num_bonds).eval();
+    auto moments_span = trace::Span("KPM moments");
+    stats.moments_timer.tic();
+    for (auto done = 0; done < num_vectors; done += block_size) {
+        auto const size = std::min(block_size, num_vectors - done);
+        if (num_random > 0) {
+            auto moments = BondMoments<scalar_t>(num_moments, size, std::mt19937::default_seed,
+                                                 done, optimized_rows, optimized_cols);
+            Impl::projected_block(moments, optimized_hamiltonian, opt_level);
+            total += moments.get();
+        } else {
+            auto slots = (source_of_bond - done).eval();
+            for (auto k = 0; k < num_bonds; ++k) {
+                if (slots[k] >= size) { slots[k] = -1; }
+            }
+            auto moments = BondMoments<scalar_t>(num_moments, sources.segment(done, size),
+                                                 slots, optimized_rows, optimized_cols);
+            Impl::projected_block(moments, optimized_hamiltonian, opt_level);
+            total += moments.get();
+        }
+    }
+    stats.moments_timer.toc();
+    moments_span.stop();
+
+    stats.reconstruction_timer.tic();
+    if (num_random > 0) {
+        total /= static_cast<real_t>(num_random);
+    }
+    config.kernel.apply(total);
+    auto greens = ArrayXXcd(energy.size(), num_bonds);
+    if (use_reconstruction_plan(num_bonds, scaled_energy, num_moments)) {
+        MatrixX<scalar_t> const m = total.matrix();
+        MatrixX<complex_t> const g = reconstruction_plan.greens(m);
+        greens = g.array().template cast<std::complex<double>>();
+    } else {
+        for (auto k = 0; k < num_bonds; ++k) {
+            auto const m = ArrayX<scalar_t>{total.col(k)};
+            auto const g = detail::reconstruct_greens(scaled_energy, m, config.reconstruction);
+            greens.col(k) = g.template cast<std::complex<double>>();
+        }
+    }
+
+    // The hoppings of the original (unscaled) matrix
+    auto result = ArrayXXd(energy.size(), num_bonds);
+    for (auto k = 0; k < num_bonds; ++k) {
+        auto const hopping = std::complex<double>(hamiltonian->coeff(rows[k], cols[k]));
+        result.col(k) = (hopping * greens.col(k)).imag();
+    }
+    stats.reconstruction_timer.toc();
+    return result;
+}
+
+template<class scalar_t, class Impl>
+ArrayXd StrategyTemplate<scalar_t, Impl>::density(double chemical_potential, double broadening,
+                                                  double temperature, int num_random,
+                                                  int probing_distance) {
+    assert(num_random > 0 || probing_distance > 0);
+    auto const scale = scaling_factors();
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    auto const rows = static_cast<int>(hamiltonian->rows());
+
+    // The kernel damps the Fermi operator expansion like any other
+    auto const scaled_mu = (chemical_potential - scale.b) / scale.a;
+    auto const scaled_kt = constant::kb * temperature / scale.a;
+    auto fermi = detail::fermi_coefficients(num_moments, scaled_mu, scaled_kt);
+    config.kernel.apply(fermi);
+    ArrayX<real_t> const coefficients = fermi.template cast<real_t>();
+
+    auto const colors = probing_distance > 0 ? probing_colors(*hamiltonian, probing_distance)
+                                             : ArrayXi();
+    auto const num_vectors = colors.size() != 0 ? colors.maxCoeff() + 1 : num_random;
+    auto const block_size = std::min(num_vectors, max_random_block_size);
+
+    // Like the random vectors of the trace, the start vectors span the full system
+    if (optimized_hamiltonian.idx().row < 0) {
+        optimized_hamiltonian.optimize_for({0, 0}, scale);
+    }
+    // One term per iteration, same as `projected_dos()`
+    reset_stats(num_moments,
+                optimized_hamiltonian.block_operations(2 * num_moments, num_vectors, true),
+                optimized_hamiltonian.block_memory_traffic(2 * num_moments, num_vectors, true),
+                static_cast<std::size_t>(rows) * 4 * block_size * sizeof(scalar_t));
+
+    auto const& order = optimized_hamiltonian.original_order();
+    auto total = ArrayX<scalar_t>::Zero(rows).eval();
+    auto start = RowMajorMatrixX<scalar_t>();
+    auto moments_span = trace::Span("KPM moments");
+    stats.moments_timer.tic();
+    for (auto done = 0; done < num_vectors; done += block_size) {
+        auto const size = std::min(block_size, num_vectors - done);
+        fill_density_vectors(start, colors, rows, done, size, order);
+        auto moments = FermiDensityMoments<scalar_t>(coefficients, start);
+        Impl::projected_block(moments, optimized_hamiltonian, opt_level);
+        total += moments.diagonal();
+    }
+    stats.moments_timer.toc();
+    moments_span.stop();
+
+    if (colors.size() == 0) {
+        total /= static_cast<real_t>(num_random);
+    }
+    auto result = ArrayXd(rows);
+    for (auto row = 0; row < rows; ++row) {
+        result[order.size() != 0 ? order[row] : row] = static_cast<double>(std::real(total[row]));
+    }
+    return result;
+}
+
+template<class scalar_t, class Impl>
+std::vector<RawMoments>
+StrategyTemplate<scalar_t, Impl>::ldos_moments(std::vector<int> const& indices,
+                                               int num_moments) {
+    assert(!indices.empty());
+    auto const scale = scaling_factors();
+    num_moments = round_num_moments(num_moments);
+    auto const num_indices = static_cast<int>(indices.size());
+    auto const block_size = std::min(num_indices, max_ldos_block_size);
+
+    optimized_hamiltonian.optimize_for_block({indices.front(), indices}, scale);
+    reset_stats(num_moments, optimized_hamiltonian.block_operations(num_moments, num_indices),
+                optimized_hamiltonian.block_memory_traffic(num_moments, num_indices),
+                hamiltonian->rows() * block_size * sizeof(scalar_t));
+
+    auto result = std::vector<RawMoments>();
+    result.reserve(indices.size());
+    auto const& optimized_indices = optimized_hamiltonian.idx().cols;
+    for (auto done = 0; done < num_indices; done += block_size) {
+        auto const size = std::min(block_size, num_indices - done);
+        auto moments = ExvalDiagonalBlockMoments<scalar_t>(
+            num_moments, optimized_indices.segment(done, size)
+        );
+
+        auto moments_span = trace::Span("KPM moments");
+        stats.moments_timer.tic();
+        Impl::diagonal_block(moments, optimized_hamiltonian, opt_level);
+        stats.moments_timer.toc_add();
+        moments_span.stop();
+
+        for (auto i = 0; i < size; ++i) {
+            auto data = ArrayXcd{moments.get().col(i).template cast<std::complex<double>>()};
+            result.emplace_back(std::move(data), scale.a, scale.b);
+        }
+    }
+    return result;
+}
+
+template<class scalar_t, class Impl>
+RawMoments StrategyTemplate<scalar_t, Impl>::dos_moments(int num_moments, int num_random,
+                                                         int seed) {
+    assert(num_random > 0 && seed >= 0);
+    auto const scale = scaling_factors();
+    num_moments = round_num_moments(num_moments);
+
+    auto const key = std::uint64_t{std::mt19937::default_seed} + static_cast<std::uint64_t>(seed);
+    auto const moments = trace_moments(num_moments, num_random, key);
+    return {moments.template cast<std::complex<double>>(), scale.a, scale.b};
+}
+
+template<class scalar_t, class Impl>
+ArrayXcd StrategyTemplate<scalar_t, Impl>::greens(int row, int col, ArrayXd const& energy,
+                                                  double broadening) {
+    return std::move(greens_vector(row, {col}, energy, broadening).front());
+}
+
+template<class scalar_t, class Impl>
+std::vector<ArrayXcd>
+StrategyTemplate<scalar_t, Impl>::greens_vector(int row, std::vector<int> const& cols,
+                                                ArrayXd const& energy, double broadening) {
+    auto sink = MemorySink();
+    greens_stream(row, cols, energy, broadening, sink);
+
+    auto greens = std::vector<ArrayXcd>();
+    greens.reserve(cols.size());
+    for (auto i = 0; i < sink.results.cols(); ++i) {
+        greens.push_back(sink.results.col(i));
+    }
+    return greens;
+}
+
+template<class scalar_t, class Impl>
+std::vector<ArrayXcd>
+StrategyTemplate<scalar_t, Impl>::greens_block(std::vector<int> const& rows,
+                                               std::vector<int> const& cols,
+                                               ArrayXd const& energy, double broadening) {
+    assert(!rows.empty() && !cols.empty());
+    if (config.convergence_tolerance > 0) {
+        throw std::invalid_argument("KPM: The convergence tolerance only applies to the LDOS "
+                                    "and the diagonal Green's function, not to a block.");
+    }
+    auto const scale = scaling_factors();
+    auto const scaled_energy = bounds.scaled(energy.template cast<real_t>());
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    auto const num_rows = static_cast<int>(rows.size());
+    auto const num_cols = static_cast<int>(cols.size());
+    auto const block_size = std::min(num_rows, max_ldos_block_size);
+
+    // A single multi-source reordering: every row starts a vector and the cols must be
+    // within reach of the last iterations, so all of them are sources
+    auto sources = rows;
+    sources.insert(sources.end(), cols.begin(), cols.end());
+    optimized_hamiltonian.optimize_for_block({rows.front(), sources}, scale);
+    reset_stats(num_moments, optimized_hamiltonian.operations(num_moments) * block_size,
+                optimized_hamiltonian.memory_traffic(num_moments, block_size),
+                hamiltonian->rows() * block_size * sizeof(scalar_t));
+
+    auto greens = std::vector<ArrayXcd>();
+    greens.reserve(rows.size() * cols.size());
+    auto const use_plan = use_reconstruction_plan(num_rows * num_cols, scaled_energy,
+                                                  num_moments);
+    auto const& optimized_indices = optimized_hamiltonian.idx().cols;
+    ArrayXi const optimized_cols = optimized_indices.tail(num_cols);
+    for (auto done = 0; done < num_rows; done += block_size) {
+        auto const size = std::min(block_size, num_rows - done);
+        auto moments = ExvalOffDiagonalBlockMoments<scalar_t>(
+            num_moments, optimized_indices.segment(done, size), optimized_cols
+        );
+
+        auto moments_span = trace::Span("KPM moments");
+        stats.moments_timer.tic();
+        Impl::off_diagonal_block(moments, optimized_hamiltonian, opt_level);
+        stats.moments_timer.toc_add();
+        moments_span.stop();
+
+        stats.reconstruction_timer.tic();
+        config.kernel.apply(moments.get());
+        if (use_plan) {
+            MatrixX<scalar_t> const m = moments.get().matrix();
+            MatrixX<complex_t> const g = reconstruction_plan.greens(m);
+            for (auto i = 0; i < g.cols(); ++i) {
+                greens.emplace_back(g.col(i).array().template cast<std::complex<double>>());
+            }
+        } else {
+            for (auto i = 0; i < moments.get().cols(); ++i) {
+                auto const m = ArrayX<scalar_t>{moments.get().col(i)};
+                auto const g = detail::reconstruct_greens(scaled_energy, m,
+                                                          config.reconstruction);
+                greens.emplace_back(g.template cast<std::complex<double>>());
+            }
+        }
+        stats.reconstruction_timer.toc_add();
+    }
+    return greens;
+}
+
+template<class scalar_t, class Impl>
+void StrategyTemplate<scalar_t, Impl>::greens_stream(int row, std::vector<int> const& cols,
+                                                     ArrayXd const& energy, double broadening,
+                                                     Sink& sink) {
+    assert(!cols.empty());
+    if (config.recursion) {
+        // An off-diagonal element needs 2 recursions, or 4 for a complex Hamiltonian
+        auto const num_starts = static_cast<int>(cols.size())
+                                * (num::is_complex<scalar_t>() ? 4 : 2);
+        auto const& recursion = make_recursion(broadening, num_starts);
+        sink.begin(energy, static_cast<int>(cols.size()), true);
+        for (auto const col : cols) {
+            stats.moments_timer.tic();
+            auto const greens = recursion.greens(row, col, energy, broadening);
+            stats.moments_timer.toc_add();
+            sink.write(col, greens);
+        }
+        sink.finish();
+        return;
+    }
+
+    auto const scale = scaling_factors();
+    auto const scaled_energy = bounds.scaled(energy.template cast<real_t>());
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+
+    optimized_hamiltonian.optimize_for({row, cols}, scale);
+    auto const& idx = optimized_hamiltonian.idx();
+    reset_stats(num_moments, optimized_hamiltonian.operations(num_moments),
+                optimized_hamiltonian.memory_traffic(num_moments),
+                hamiltonian->rows() * sizeof(scalar_t));
+
+    sink.begin(energy, static_cast<int>(cols.size()), true);
+    auto const is_diagonal = idx.is_diagonal() && damping.size() == 0;
+    if (is_diagonal && config.mixed_precision) {
+        auto moments = diagonal_moments<num::get_double_t<scalar_t>>(num_moments);
+        stats.reconstruction_timer.tic();
+        config.kernel.apply(moments);
+        ArrayXd const energy_d = scaled_energy.template cast<double>();
+        auto const greens = detail::reconstruct_greens(energy_d, moments,
+                                                       config.reconstruction);
+        stats.reconstruction_timer.toc();
+        sink.write(cols.front(), greens);
+    } else if (is_diagonal) {
+        auto moments = diagonal_moments<scalar_t>(num_moments);
+        stats.reconstruction_timer.tic();
+        config.kernel.apply(moments);
+        auto const greens = detail::reconstruct_greens(scaled_energy, moments,
+                                                       config.reconstruction);
+        stats.reconstruction_timer.toc();
+        sink.write(cols.front(), greens.template cast<std::complex<double>>());
+    } else {
+        // The moments of all the `cols` come from a single pass, but the results are
+        // passed on as soon as they're reconstructed instead of collecting them all
+        auto moments_vector = off_diagonal_moments(num_moments);
+        auto const num_cols = static_cast<int>(moments_vector.size());
+        stats.reconstruction_timer.tic();
+        if (use_reconstruction_plan(num_cols, scaled_energy, num_moments)) {
+            for (auto done = 0; done < num_cols; done += max_greens_batch_size) {
+                auto const size = std::min(max_greens_batch_size, num_cols - done);
+                auto batch = MatrixX<scalar_t>(num_moments, size);
+                for (auto i = 0; i < size; ++i) {
+                    auto& moments = moments_vector[done + i];
+                    config.kernel.apply(moments);
+                    batch.col(i) = moments.matrix();
+                    ArrayX<scalar_t>().swap(moments); // release the moments which are done
+                }
+                MatrixX<complex_t> const g = reconstruction_plan.greens(batch);
+                for (auto i = 0; i < size; ++i) {
+                    ArrayXcd const result = g.col(i).array().template cast<std::complex<double>>();
+                    sink.write(cols[done + i], result);
+                }
+            }
+        } else {
+            for (auto i = 0; i < num_cols; ++i) {
+                auto& moments = moments_vector[i];
+                config.kernel.apply(moments);
+                auto const g = detail::reconstruct_greens(scaled_energy, moments,
+                                                          config.reconstruction);
+                sink.write(cols[i], g.template cast<std::complex<double>>());
+                ArrayX<scalar_t>().swap(moments); // release the moments which are done
+            }
+        }
+        stats.reconstruction_timer.toc();
+    }
+    sink.finish();
+}
+
+template<class scalar_t, class Impl>
+std::vector<RawMoments>
+StrategyTemplate<scalar_t, Impl>::moments(int row, std::vector<int> const& cols,
+                                          int num_moments) {
+    assert(!cols.empty());
+    auto const scale = scaling_factors();
+    num_moments = round_num_moments(num_moments);
+
+    optimized_hamiltonian.optimize_for({row, cols}, scale);
+    reset_stats(num_moments, optimized_hamiltonian.operations(num_moments),
+                optimized_hamiltonian.memory_traffic(num_moments),
+                hamiltonian->rows() * sizeof(scalar_t));
+
+    using complex_d = std::complex<double>;
+    if (optimized_hamiltonian.idx().is_diagonal() && damping.size() == 0) {
+        auto data = ArrayXcd();
+        if (config.mixed_precision) {
+            auto const moments = diagonal_moments<num::get_double_t<scalar_t>>(num_moments);
+            data = moments.template cast<complex_d>();
+        } else {
+            auto const moments = diagonal_moments<scalar_t>(num_moments);
+            data = moments.template cast<complex_d>();
+        }
+        return {RawMoments(std::move(data), scale.a, scale.b)};
+    } else {
+        auto raw = std::vector<RawMoments>();
+        for (auto const& moments : off_diagonal_moments(num_moments)) {
+            raw.emplace_back(moments.template cast<complex_d>(), scale.a, scale.b);
+        }
+        return raw;
+    }
+}
+
+template<class scalar_t, class Impl>
+RawMoments StrategyTemplate<scalar_t, Impl>::resume_moments(int index,
+                                                            RawMoments const& previous,
+                                                            int num_moments) {
+    auto const scale = scaling_factors();
+    num_moments = round_num_moments(num_moments);
+
+    auto const is_resumed = previous.is_resumable();
+    if (is_resumed && (previous.index != index || previous.a != scale.a
+                       || previous.b != scale.b)) {
+        throw std::invalid_argument("KPM: The previous moments were computed for a different "
+                                    "index or Hamiltonian and they can't be resumed.");
+    }
+    if (is_resumed && num_moments <= previous.size()) {
+        return previous; // nothing more to compute
+    }
+
+    optimized_hamiltonian.optimize_for({index, index}, scale);
+    reset_stats(num_moments, optimized_hamiltonian.operations(num_moments),
+                optimized_hamiltonian.memory_traffic(num_moments),
+                hamiltonian->rows() * sizeof(scalar_t));
+
+    auto const to_scalar = [](std::complex<double> v) { return num::complex_cast<scalar_t>(v); };
+    auto moments = ExvalDiagonalMoments<scalar_t>(num_moments, optimized_hamiltonian.idx().row);
+    auto checkpoint = calc_moments::Checkpoint<scalar_t>();
+    if (is_resumed) {
+        moments.resume(previous.data.unaryExpr(to_scalar));
+        checkpoint.r0 = previous.r0.unaryExpr(to_scalar);
+        checkpoint.r1 = previous.r1.unaryExpr(to_scalar);
+        checkpoint.n = previous.size() / 2 + 1;
+    }
+
+    auto moments_span = trace::Span("KPM moments");
+    stats.moments_timer.tic();
+    Impl::diagonal_resumable(moments, optimized_hamiltonian, opt_level, checkpoint);
+    stats.moments_timer.toc();
+    moments_span.stop();
+
+    using complex_d = std::complex<double>;
+    auto result = RawMoments(moments.get().template cast<complex_d>(), scale.a, scale.b);
+    result.index = index;
+    result.r0 = checkpoint.r0.template cast<complex_d>();
+    result.r1 = checkpoint.r1.template cast<complex_d>();
+    return result;
+}
+
+template<class scalar_t, class Impl>
+ArrayXcd StrategyTemplate<scalar_t, Impl>::conductivity(Hamiltonian const& velocity_l,
+                                                        Hamiltonian const& velocity_r,
+                                                        ArrayXd const& chemical_potential,
+                                                        double broadening, double temperature,
+                                                        int num_random, int num_points) {
+    if (!ham::is<scalar_t>(velocity_l) || !ham::is<scalar_t>(velocity_r)) {
+        throw std::invalid_argument("KPM: The velocity operators must have the same scalar "
+                                    "type as the Hamiltonian.");
+    }
+    assert(num_random > 0 && num_points > 0);
+    auto const& vl = ham::get_reference<scalar_t>(velocity_l);
+    auto const& vr = ham::get_reference<scalar_t>(velocity_r);
+    auto const scale = scaling_factors();
+    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+
+    // The velocity operators follow the original site order: no reordering
+    auto oh = OptimizedHamiltonian<scalar_t>(
+        hamiltonian.get(), {MatrixConfig::Reorder::OFF, MatrixConfig::Format::CSR}
+    );
+    oh.optimize_for({0, 0}, scale);
+    auto const& h2 = oh.csr();
+
+    auto const rows = static_cast<std::size_t>(h2.rows());
+    auto const block_size = static_cast<int>(std::max(
+        std::size_t{1}, conductivity_block_memory / (2 * rows * sizeof(scalar_t))
+    ));
+    auto const num_blocks = (num_moments + block_size - 1) / block_size;
+    auto const nnz = static_cast<std::size_t>(h2.nonZeros() + vl.nonZeros() + vr.nonZeros());
+    auto const moments_squared = static_cast<std::size_t>(num_moments) * num_moments;
+    // Each multiplication loads the CSR matrices (a value and an index per element) and three
+    // vectors, the dot products load each pair of blocks of stored vectors once
+    auto const spmv_bytes = nnz * (sizeof(scalar_t) + sizeof(int)) + 3 * rows * sizeof(scalar_t);
+    auto const dot_bytes = 2 * moments_squared * rows * sizeof(scalar_t) / block_size;
+    stats = {num_moments,
+             num_random * ((num_blocks + 1) * num_moments * nnz + moments_squared * rows),
+             num_random * ((num_blocks + 1) * num_moments * spmv_bytes + dot_bytes),
+             oh.memory_usage(), rows * sizeof(scalar_t)};
+    stats.bounds_timer = bounds_timer;
+
+    auto moments = DenseMatrixMoments<scalar_t>(num_moments, vl, vr);
+    auto r = VectorX<scalar_t>(h2.rows());
+    auto moments_span = trace::Span("KPM moments");
+    stats.moments_timer.tic();
+    for (auto j = 0; j < num_random; ++j) {
+        num::random_phase_fill(r, std::mt19937::default_seed, static_cast<std::uint64_t>(j));
+        calc_moments::dense_matrix::basic(moments, h2, r, block_size);
+    }
+    stats.moments_timer.toc();
+    moments_span.stop();
+
+    // Kernel damping in both directions and the (1 + delta_n0) * (1 + delta_m0) factor
+    auto const g = config.kernel.damping_coefficients(num_moments);
+    MatrixX<scalar_t> mu = moments.get() / static_cast<real_t>(num_random);
+    for (auto m = 0; m < num_moments; ++m) {
+        for (auto n = 0; n < num_moments; ++n) {
+            mu(n, m) *= static_cast<real_t>(g[n] * g[m] / ((n == 0 ? 2 : 1) * (m == 0 ? 2 : 1)));
+        }
+    }
+
+    ArrayXd const scaled_mu = (chemical_potential - scale.b) / scale.a;
+    auto const scaled_kt = constant::kb * temperature / scale.a;
+    return detail::kubo_bastin(mu, scaled_mu, scaled_kt, scale.a, num_points);
+}
+
+template<class scalar_t, class Impl>
+ArrayXXcd StrategyTemplate<scalar_t, Impl>::evolve(VectorXcd const& state, double time_step,
+                                                   int num_steps) {
+    auto const scale = scaling_factors(); // before `opt_level` which it may resolve
+    auto const propagator = Propagator<scalar_t>(hamiltonian.get(), scale,
+                                                 matrix_config(opt_level).format);
+    auto const num_terms = propagator.num_terms(time_step);
+    auto const num_parts = num::is_complex<scalar_t>() ? 1 : 2;
+    auto const rows = static_cast<std::size_t>(hamiltonian->rows());
+    auto const num_multiplications = static_cast<std::size_t>(num_parts * num_terms * num_steps);
+    stats = {num_terms * num_steps,
+             num_multiplications * static_cast<std::size_t>(hamiltonian->nonZeros()),
+             num_multiplications * (propagator.memory_usage() + 3 * rows * sizeof(scalar_t)),
+             propagator.memory_usage(), rows * sizeof(scalar_t)};
+    stats.opt_level = opt_level;
+    stats.bounds_timer = bounds_timer;
+    stats.tune_timer = tune_timer;
+
+    auto moments_span = trace::Span("KPM moments");
+    stats.moments_timer.tic();
+    auto const result = propagator.evolve_steps(state.template cast<complex_t>(), time_step,
+                                                num_steps);
+    stats.moments_timer.toc();
+    moments_span.stop();
+    return result.template cast<std::complex<double>>().array();
+}
+
+template<class scalar_t, class Impl>
+Scale<num::get_real_t<scalar_t>> StrategyTemplate<scalar_t, Impl>::scaling_factors() {
+    auto bounds_span = trace::Span("KPM bounds");
+    bounds_timer.tic();
+    auto const scale = bounds.scaling_factors();
+    bounds_timer.toc();
+    bounds_span.stop();
+
+    tune_timer = {};
+    if (opt_level == opt_level_auto) {
+        tune_timer.tic();
+        opt_level = tune_opt_level(scale);
+        optimized_hamiltonian = {hamiltonian.get(), matrix_config(opt_level),
+                                 config.cache_memory, thread_pool.get()};
+        tune_timer.toc();
+    }
+    return scale;
+}
+
+template<class scalar_t, class Impl>
+MatrixConfig StrategyTemplate<scalar_t, Impl>::matrix_config(int level) const {
+    auto result = Impl::matrix_config(std::max(level, 0));
+    if (config.split_complex) {
+        result.layout = MatrixConfig::Layout::SPLIT;
+    }
+    if (config.reduced_precision) {
+        result.values = MatrixConfig::Values::REDUCED;
+    }
+    if (config.indexed_values) {
+        // Too many distinct values for the index: the reduced ones are the next best thing
+        result.values = config.reduced_precision ? MatrixConfig::Values::INDEXED_OR_REDUCED
+                                                 : MatrixConfig::Values::INDEXED;
+    }
+    auto const streamed = !config.matrix_file.empty() && level == 3 && config.num_threads == 1
+                          && result.format == MatrixConfig::Format::ELL;
+    if (streamed) {
+        // `stream_matrix()` writes the ELLPACK blocks straight from the CSR rows
+        result.format = MatrixConfig::Format::CSR;
+    } else if (config.bulk_boundary && Impl::supports_bulk_boundary
+               && num::is_complex<scalar_t>()) {
+        result.format = MatrixConfig::Format::BULK_BOUNDARY;
+    }
+    if (config.permute_only && Impl::supports_permuted
+        && result.reorder == MatrixConfig::Reorder::ON) {
+        result.reorder = MatrixConfig::Reorder::PERMUTE;
+        result.format = MatrixConfig::Format::CSR;
+    }
+    if (config.block_size != 0 && Impl::supports_bsr) {
+        // The blocks follow the site order: reordering would break them up
+        result.reorder = MatrixConfig::Reorder::OFF;
+        result.format = MatrixConfig::Format::BSR;
+        result.block_size = std::max(config.block_size, 0);
+    }
+    if (config.symmetric_storage && Impl::supports_symmetric) {
+        result.reorder = MatrixConfig::Reorder::OFF;
+        result.format = MatrixConfig::Format::SYMMETRIC;
+    }
+    if (config.share_matrix) {
+        result.reorder = MatrixConfig::Reorder::OFF;
+        result.sharing = MatrixConfig::Sharing::SHARED;
+    }
+    return result;
+}
+
+template<class scalar_t, class Impl>
+int StrategyTemplate<scalar_t, Impl>::tune_opt_level(Scale<real_t> scale) {
+    auto const key = fingerprint(*hamiltonian, config.num_threads);
+    // Hold the lock during the trials: concurrent ones would only disturb each other's timing
+    std::lock_guard<std::mutex> lock(tuned_levels_mutex);
+    auto& levels = tuned_levels<scalar_t, Impl>();
+    auto const it = levels.find(key);
+    if (it != levels.end()) {
+        return it->second;
+    }
+
+    auto const span = trace::Span("KPM autotune");
+    auto const index = static_cast<int>(hamiltonian->rows() / 2);
+    auto best_level = 0;
+    auto best_time = std::numeric_limits<double>::max();
+    for (auto level = 0; level <= Impl::max_opt_level; ++level) {
+        // The reordering and format conversion are not timed: they are cached between calls
+        auto oh = OptimizedHamiltonian<scalar_t>(hamiltonian.get(), matrix_config(level), 0,
+                                                 thread_pool.get());
+        oh.optimize_for({index, index}, scale);
+
+        for (auto n = 0; n < tune_repeats; ++n) {
+            auto moments = ExvalDiagonalMoments<scalar_t>(tune_num_moments, oh.idx().row);
+            auto timer = Chrono();
+            if (thread_pool) {
+                Impl::diagonal(moments, oh, level, *thread_pool);
+            } else {
+                Impl::diagonal(moments, oh, level, config.interleave_depth);
+            }
+            auto const time = timer.toc().elapsed_seconds();
+            if (time < best_time) {
+                best_time = time;
+                best_level = level;
+            }
+        }
+    }
+
+    levels[key] = best_level;
+    return best_level;
+}
+
+template<class scalar_t, class Impl>
+Recursion<scalar_t> const& StrategyTemplate<scalar_t, Impl>::make_recursion(double broadening,
+                                                                           int num_starts) {
+    if (damping.size() != 0) {
+        throw std::logic_error("KPM: the recursion method doesn't support damping.");
+    }
+    auto const scale = scaling_factors(); // before `opt_level` which it may resolve
+    if (!recursion_engine || recursion_engine->scaling_factors() != scale) {
+        recursion_engine = std14::make_unique<Recursion<scalar_t>>(
+            hamiltonian.get(), scale, config.termination, matrix_config(opt_level).format,
+            thread_pool.get()
+        );
+    }
+    auto const& recursion = *recursion_engine;
+
+    // Three vectors per start: the current and previous levels and the start itself
+    auto const num_levels = recursion.required_num_levels(broadening);
+    auto const rows = static_cast<std::size_t>(hamiltonian->rows());
+    auto const num_multiplications = static_cast<std::size_t>(num_levels)
+                                     * static_cast<std::size_t>(num_starts);
+    stats = {num_levels,
+             num_multiplications * static_cast<std::size_t>(hamiltonian->nonZeros()),
+             num_multiplications * (recursion.memory_usage() + 3 * rows * sizeof(scalar_t)),
+             recursion.memory_usage(), 3 * rows * sizeof(scalar_t)};
+    stats.opt_level = opt_level;
+    stats.bounds_timer = bounds_timer;
+    stats.tune_timer = tune_timer;
+    return recursion;
+}
+
+template<class scalar_t, class Impl>
+void StrategyTemplate<scalar_t, Impl>::reset_stats(int num_moments, size_t num_operations,
+                                                   size_t num_bytes, size_t vector_memory) {
+    stats = {num_moments, num_operations, num_bytes, optimized_hamiltonian.memory_usage(),
+             vector_memory};
+    stats.cache_hits = optimized_hamiltonian.cache_hits();
+    stats.cache_misses = optimized_hamiltonian.cache_misses();
+    stats.opt_level = opt_level;
+    stats.bounds_timer = bounds_timer;
+    stats.tune_timer = tune_timer;
+    stats.reorder_timer = optimized_hamiltonian.get_reorder_timer();
+    stats.convert_timer = optimized_hamiltonian.get_convert_timer();
+}
+
+template<class scalar_t, class Impl>
+MatrixStream<scalar_t>& StrategyTemplate<scalar_t, Impl>::stream_matrix() {
+    auto const& idx = optimized_hamiltonian.target_idx();
+    auto const& scale = optimized_hamiltonian.target_scale();
+    if (!matrix_stream || !(matrix_stream_idx == idx) || !(matrix_stream_scale == scale)) {
+        matrix_stream.reset(); // remove the previous file before writing the new one
+        matrix_stream = std14::make_unique<MatrixStream<scalar_t>>(
+            config.matrix_file, optimized_hamiltonian.csr(), optimized_hamiltonian.sizes()
+        );
+        matrix_stream_idx = idx;
+        matrix_stream_scale = scale;
+    }
+    // Only the file and a few blocks stay: the next call with the same target reorders
+    // the matrix again, which is cheaper than writing the file
+    optimized_hamiltonian.release_matrix();
+    return *matrix_stream;
 }
 
 template<class scalar_t, class Impl>
-bool StrategyTemplate<scalar_t, Impl>::change_hamiltonian(Hamiltonian const& h) {
-    if (!ham::is<scalar_t>(h)) {
-        return false;
+template<class acc_t>
+ArrayX<acc_t> StrategyTemplate<scalar_t, Impl>::diagonal_moments(int num_moments) {
+    if (config.convergence_tolerance > 0) {
+        return adaptive_diagonal_moments<acc_t>(num_moments);
     }
 
-    hamiltonian = ham::get_shared_ptr<scalar_t>(h);
-    optimized_hamiltonian = {hamiltonian.get(), Impl::matrix_config(config.opt_level)};
-    bounds = reset_bounds(hamiltonian.get(), config);
+    auto moments = ExvalDiagonalMoments<scalar_t, acc_t>(num_moments,
+                                                         optimized_hamiltonian.idx().row);
 
-    return true;
+    auto moments_span = trace::Span("KPM moments");
+    stats.moments_timer.tic();
+    if (thread_pool) {
+        Impl::diagonal(moments, optimized_hamiltonian, opt_level, *thread_pool);
+    } else if (!config.matrix_file.empty() && opt_level == 3 && optimized_hamiltonian.is_csr()) {
+        // Out-of-core: see `matrix_config()`, the CSR rows are converted block by block
+        auto const& sizes = optimized_hamiltonian.sizes(); // kept after the matrix is released
+        auto& stream = stream_matrix();
+        auto const bytes_before = stream.bytes_read();
+        calc_moments::diagonal::opt_size_and_interleaved(moments, stream, sizes,
+                                                         config.interleave_depth);
+        stats.streamed_bytes = stream.bytes_read() - bytes_before;
+    } else {
+        Impl::diagonal(moments, optimized_hamiltonian, opt_level, config.interleave_depth);
+    }
+    stats.moments_timer.toc();
+    moments_span.stop();
+
+    return std::move(moments.get());
 }
 
 template<class scalar_t, class Impl>
-ArrayXd StrategyTemplate<scalar_t, Impl>::ldos(int index, ArrayXd const& energy,
-                                               double broadening) {
-    auto const scale = bounds.scaling_factors();
-    auto const scaled_energy = bounds.scaled(energy.template cast<real_t>());
-    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
-
-    optimized_hamiltonian.optimize_for({index, index}, scale);
-    stats = {num_moments, optimized_hamiltonian.operations(num_moments),
-             optimized_hamiltonian.memory_usage(), hamiltonian->rows() * sizeof(scalar_t)};
+template<class acc_t>
+ArrayX<acc_t> StrategyTemplate<scalar_t, Impl>::adaptive_diagonal_moments(int num_moments) {
+    // The damping of the full number of moments: the skipped ones are zero after all
+    auto const g = config.kernel.damping_coefficients(num_moments);
+    auto const tolerance = static_cast<double>(config.convergence_tolerance);
+    auto const index = optimized_hamiltonian.idx().row;
 
-    auto moments = ExvalDiagonalMoments<scalar_t>(num_moments, optimized_hamiltonian.idx().row);
+    auto computed = ArrayX<acc_t>();
+    auto checkpoint = calc_moments::Checkpoint<scalar_t>();
+    auto weighted_sum = 0.0; // of `|g_n * mu_n|`, a bound on the reconstructed series
 
+    auto moments_span = trace::Span("KPM moments");
     stats.moments_timer.tic();
-    Impl::diagonal(moments, optimized_hamiltonian, config.opt_level);
+    for (auto size = std::min(round_num_moments(min_adaptive_moments), num_moments);;
+         size = std::min(round_num_moments(2 * size), num_moments)) {
+        auto moments = ExvalDiagonalMoments<scalar_t, acc_t>(size, index);
+        auto const previous = static_cast<int>(computed.size());
+        if (previous > 0) {
+            moments.resume(computed);
+        }
+        Impl::diagonal_resumable(moments, optimized_hamiltonian, opt_level, checkpoint);
+        computed = std::move(moments.get());
+
+        auto latest = 0.0;
+        for (auto n = previous; n < size; ++n) {
+            latest += g[n] * std::abs(computed[n]);
+        }
+        weighted_sum += latest;
+        if (size == num_moments || (previous > 0 && latest <= tolerance * weighted_sum)) {
+            break;
+        }
+    }
     stats.moments_timer.toc();
+    moments_span.stop();
 
-    config.kernel.apply(moments.get());
+    auto const used = static_cast<int>(computed.size());
+    stats.used_moments = used;
+    stats.num_operations = optimized_hamiltonian.operations(used);
+    stats.num_bytes = optimized_hamiltonian.memory_traffic(used);
 
-    auto ldos = detail::reconstruct_function<real_t>(scaled_energy, moments.get().real());
-    return ldos.template cast<double>();
+    ArrayX<acc_t> result = ArrayX<acc_t>::Zero(num_moments);
+    result.head(used) = computed;
+    return result;
 }
 
 template<class scalar_t, class Impl>
-ArrayXcd StrategyTemplate<scalar_t, Impl>::greens(int row, int col, ArrayXd const& energy,
-                                                  double broadening) {
-    return std::move(greens_vector(row, {col}, energy, broadening).front());
-}
+ArrayX<scalar_t> StrategyTemplate<scalar_t, Impl>::trace_moments(int num_moments, int num_random,
+                                                                 std::uint64_t seed) {
+    auto const scale = scaling_factors();
+    auto const block_size = std::min(num_random, max_random_block_size);
 
-template<class scalar_t, class Impl>
-std::vector<ArrayXcd>
-StrategyTemplate<scalar_t, Impl>::greens_vector(int row, std::vector<int> const& cols,
-                                                ArrayXd const& energy, double broadening) {
-    assert(!cols.empty());
-    auto const scale = bounds.scaling_factors();
-    auto const scaled_energy = bounds.scaled(energy.template cast<real_t>());
-    auto const num_moments = config.kernel.required_num_moments(broadening / scale.a);
+    // The trace doesn't depend on the ordering so any index will do: the matrix
+    // is only optimized for the first call and then reused for subsequent ones
+    if (optimized_hamiltonian.idx().row < 0) {
+        optimized_hamiltonian.optimize_for({0, 0}, scale);
+    }
+    reset_stats(num_moments,
+                optimized_hamiltonian.block_operations(num_moments, num_random, true),
+                optimized_hamiltonian.block_memory_traffic(num_moments, num_random, true),
+                hamiltonian->rows() * block_size * sizeof(scalar_t));
 
-    optimized_hamiltonian.optimize_for({row, cols}, scale);
-    auto const& idx = optimized_hamiltonian.idx();
-    stats = {num_moments, optimized_hamiltonian.operations(num_moments),
-             optimized_hamiltonian.memory_usage(), hamiltonian->rows() * sizeof(scalar_t)};
+    auto total = ArrayX<scalar_t>::Zero(num_moments).eval();
+    auto moments_span = trace::Span("KPM moments");
+    stats.moments_timer.tic();
+    for (auto done = 0; done < num_random; done += block_size) {
+        auto const size = std::min(block_size, num_random - done);
+        auto moments = StochasticTraceMoments<scalar_t>(num_moments, size, seed, done);
+        Impl::trace_block(moments, optimized_hamiltonian, opt_level);
+        total += moments.get().rowwise().sum();
+    }
+    stats.moments_timer.toc();
+    moments_span.stop();
 
-    if (idx.is_diagonal()) {
-        auto moments = ExvalDiagonalMoments<scalar_t>(num_moments, idx.row);
+    return total / static_cast<real_t>(num_random);
+}
 
-        stats.moments_timer.tic();
-        Impl::diagonal(moments, optimized_hamiltonian, config.opt_level);
-        stats.moments_timer.toc();
+template<class scalar_t, class Impl>
+bool StrategyTemplate<scalar_t, Impl>::use_reconstruction_plan(int num_results,
+                                                               ArrayX<real_t> const& scaled_energy,
+                                                               int num_moments) {
+    // The basis replaces the direct evaluation: the other methods are kept as requested
+    auto const basis_bytes = static_cast<std::size_t>(scaled_energy.size()) * num_moments
+                             * sizeof(complex_t);
+    if (num_results < 2 || config.reconstruction != Reconstruction::Direct
+        || basis_bytes > reconstruction_plan_memory) {
+        return false;
+    }
+    reconstruction_plan.prepare(scaled_energy, num_moments);
+    return true;
+}
 
-        config.kernel.apply(moments.get());
+template<class scalar_t, class Impl>
+std::vector<ArrayX<scalar_t>> StrategyTemplate<scalar_t, Impl>::off_diagonal_moments(
+    int num_moments
+) {
+    auto moments = ExvalOffDiagonalMoments<scalar_t>(num_moments, optimized_hamiltonian.idx());
 
-        auto const greens = detail::reconstruct_greens(scaled_energy, moments.get());
-        return {greens.template cast<std::complex<double>>()};
+    auto moments_span = trace::Span("KPM moments");
+    stats.moments_timer.tic();
+    if (damping.size() != 0) {
+        Impl::damped(moments, optimized_hamiltonian, opt_level, optimized_damping());
+    } else if (thread_pool) {
+        Impl::off_diagonal(moments, optimized_hamiltonian, opt_level, *thread_pool);
     } else {
-        auto moments_vector = ExvalOffDiagonalMoments<scalar_t>(num_moments, idx);
-
-        stats.moments_timer.tic();
-        Impl::off_diagonal(moments_vector, optimized_hamiltonian, config.opt_level);
-        stats.moments_timer.toc();
+        Impl::off_diagonal(moments, optimized_hamiltonian, opt_level);
+    }
+    stats.moments_timer.toc();
+    moments_span.stop();
 
-        for (auto& moments : moments_vector.get()) {
-            config.kernel.apply(moments);
-        }
+    return std::move(moments.get());
+}
 
-        auto greens = std::vector<ArrayXcd>();
-        greens.reserve(idx.cols.size());
-        for (auto const& moments : moments_vector.get()) {
-            auto const g = detail::reconstruct_greens(scaled_energy, moments);
-            greens.push_back(g.template cast<std::complex<double>>());
-        }
-        return greens;
+template<class scalar_t, class Impl>
+ArrayX<num::get_real_t<scalar_t>> StrategyTemplate<scalar_t, Impl>::optimized_damping() const {
+    assert(damping.size() == hamiltonian->rows());
+    auto const& order = optimized_hamiltonian.original_order();
+    auto result = ArrayX<real_t>(damping.size());
+    for (auto row = 0; row < result.size(); ++row) {
+        result[row] = static_cast<real_t>(damping[order.size() != 0 ? order[row] : row]);
     }
+    return result;
 }
 
 template<class scalar_t, class Impl>
@@ -126,26 +1535,213 @@ std::string StrategyTemplate<scalar_t, Impl>::report(bool shortform) const {
 }
 
 struct DefaultCalcMoments {
+    static constexpr int max_opt_level = 4;
+    static constexpr bool supports_permuted = true; ///< see `Config::permute_only`
+    static constexpr bool supports_bsr = true; ///< see `Config::block_size`
+    /// See `Config::symmetric_storage`: the upper triangle is always multiplied as a whole,
+    /// so it takes the basic (full matrix, single-threaded) variant of every algorithm
+    static constexpr bool supports_symmetric = true;
+    static constexpr bool supports_bulk_boundary = true; ///< see `Config::bulk_boundary`
+
     static MatrixConfig matrix_config(int opt_level) {
         switch (opt_level) {
             case 0: return {MatrixConfig::Reorder::OFF, MatrixConfig::Format::CSR};
             case 1: return {MatrixConfig::Reorder::ON, MatrixConfig::Format::CSR};
             case 2: return {MatrixConfig::Reorder::ON, MatrixConfig::Format::CSR};
-            default: return {MatrixConfig::Reorder::ON, MatrixConfig::Format::ELL};
+            case 3: return {MatrixConfig::Reorder::ON, MatrixConfig::Format::ELL,
+                            MatrixConfig::Indices::COMPRESSED};
+            default: return {MatrixConfig::Reorder::ON, MatrixConfig::Format::SELL,
+                             MatrixConfig::Indices::COMPRESSED};
         }
     };
 
     template<class Moments, class scalar_t>
     static void diagonal(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
-                         int opt_level) {
+                         int opt_level, int depth = 2) {
         assert(oh.idx().is_diagonal());
         using namespace calc_moments::diagonal;
 
+        if (oh.is_permuted()) {
+            return opt_size_and_interleaved(moments, oh.permuted(), oh.sizes(), depth);
+        }
+        if (oh.is_bsr()) {
+            return opt_size_and_interleaved(moments, oh.bsr(), oh.sizes(), depth);
+        }
+        if (oh.is_bulk_boundary()) {
+            return opt_size_and_interleaved(moments, oh.bulk_boundary(), oh.sizes(), depth);
+        }
+        if (oh.is_symmetric()) {
+            return basic(moments, oh.symmetric());
+        }
         switch (opt_level) {
             case 0: basic(moments, oh.csr()); break;
             case 1: opt_size(moments, oh.csr(), oh.sizes()); break;
-            case 2: opt_size_and_interleaved(moments, oh.csr(), oh.sizes()); break;
-            default: opt_size_and_interleaved(moments, oh.ell(), oh.sizes()); break;
+            case 2: opt_size_and_interleaved(moments, oh.csr(), oh.sizes(), depth); break;
+            case 3: opt_size_and_interleaved(moments, oh.ell(), oh.sizes(), depth); break;
+            default: opt_size_and_interleaved(moments, oh.sell(), oh.sizes(), depth); break;
+        }
+    }
+
+    /// Multithreaded: the interleaved variants are sequential so levels 2 and 3 use `opt_size`
+    template<class Moments, class scalar_t>
+    static void diagonal(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                         int opt_level, ThreadPool& pool) {
+        assert(oh.idx().is_diagonal());
+        using namespace calc_moments::diagonal;
+
+        if (oh.is_permuted()) {
+            return opt_size_parallel(moments, oh.permuted(), oh.sizes(), pool);
+        }
+        if (oh.is_bsr()) {
+            return opt_size_parallel(moments, oh.bsr(), oh.sizes(), pool);
+        }
+        if (oh.is_bulk_boundary()) {
+            return opt_size_parallel(moments, oh.bulk_boundary(), oh.sizes(), pool);
+        }
+        if (oh.is_symmetric()) {
+            return basic(moments, oh.symmetric());
+        }
+        switch (opt_level) {
+            case 0:
+            case 1:
+            case 2: opt_size_parallel(moments, oh.csr(), oh.sizes(), pool); break;
+            case 3: opt_size_parallel(moments, oh.ell(), oh.sizes(), pool); break;
+            default: opt_size_parallel(moments, oh.sell(), oh.sizes(), pool); break;
+        }
+    }
+
+    /// The final vectors are saved in the `checkpoint`: only the growing size optimization
+    template<class Moments, class scalar_t>
+    static void diagonal_resumable(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                                   int opt_level,
+                                   calc_moments::Checkpoint<scalar_t>& checkpoint) {
+        using namespace calc_moments::diagonal;
+
+        if (oh.is_permuted()) {
+            return opt_size_resumable(moments, oh.permuted(), oh.sizes(), checkpoint);
+        }
+        if (oh.is_bsr()) {
+            return opt_size_resumable(moments, oh.bsr(), oh.sizes(), checkpoint);
+        }
+        if (oh.is_bulk_boundary()) {
+            return opt_size_resumable(moments, oh.bulk_boundary(), oh.sizes(), checkpoint);
+        }
+        if (oh.is_symmetric()) {
+            return opt_size_resumable(moments, oh.symmetric(), oh.sizes(), checkpoint);
+        }
+        switch (opt_level) {
+            case 0:
+            case 1:
+            case 2: opt_size_resumable(moments, oh.csr(), oh.sizes(), checkpoint); break;
+            case 3: opt_size_resumable(moments, oh.ell(), oh.sizes(), checkpoint); break;
+            default: opt_size_resumable(moments, oh.sell(), oh.sizes(), checkpoint); break;
+        }
+    }
+
+    template<class Moments, class scalar_t>
+    static void diagonal_block(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                               int opt_level) {
+        using namespace calc_moments::diagonal;
+
+        if (oh.is_permuted()) {
+            return opt_size_block(moments, oh.permuted(), oh.sizes());
+        }
+        if (oh.is_bsr()) {
+            return opt_size_block(moments, oh.bsr(), oh.sizes());
+        }
+        if (oh.is_bulk_boundary()) {
+            return opt_size_block(moments, oh.bulk_boundary(), oh.sizes());
+        }
+        if (oh.is_symmetric()) {
+            return basic_block(moments, oh.symmetric());
+        }
+        switch (opt_level) {
+            case 0: basic_block(moments, oh.csr()); break;
+            case 1:
+            case 2: opt_size_block(moments, oh.csr(), oh.sizes()); break;
+            case 3: opt_size_block(moments, oh.ell(), oh.sizes()); break;
+            default: opt_size_block(moments, oh.sell(), oh.sizes()); break;
+        }
+    }
+
+    /// The random vectors of the stochastic trace span the full system: no size optimization
+    template<class Moments, class scalar_t>
+    static void trace_block(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                            int opt_level) {
+        using namespace calc_moments::diagonal;
+
+        if (oh.is_permuted()) {
+            return basic_block(moments, oh.permuted());
+        }
+        if (oh.is_bsr()) {
+            return basic_block(moments, oh.bsr());
+        }
+        if (oh.is_bulk_boundary()) {
+            return basic_block(moments, oh.bulk_boundary());
+        }
+        if (oh.is_symmetric()) {
+            return basic_block(moments, oh.symmetric());
+        }
+        switch (opt_level) {
+            case 0:
+            case 1:
+            case 2: basic_block(moments, oh.csr()); break;
+            case 3: basic_block(moments, oh.ell()); break;
+            default: basic_block(moments, oh.sell()); break;
+        }
+    }
+
+    /// The damped recursion is only available as a full-system off-diagonal algorithm
+    template<class Moments, class scalar_t, class real_t>
+    static void damped(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                       int opt_level, ArrayX<real_t> const& damping) {
+        namespace cm = calc_moments::off_diagonal;
+
+        if (oh.is_permuted()) {
+            return cm::damped(moments, oh.permuted(), damping);
+        }
+        if (oh.is_bsr()) {
+            return cm::damped(moments, oh.bsr(), damping);
+        }
+        if (oh.is_bulk_boundary()) {
+            return cm::damped(moments, oh.bulk_boundary(), damping);
+        }
+        if (oh.is_symmetric()) {
+            return cm::damped(moments, oh.symmetric(), damping);
+        }
+        switch (opt_level) {
+            case 0:
+            case 1:
+            case 2: cm::damped(moments, oh.csr(), damping); break;
+            case 3: cm::damped(moments, oh.ell(), damping); break;
+            default: cm::damped(moments, oh.sell(), damping); break;
+        }
+    }
+
+    /// The projected trace collects one moment per iteration: the off-diagonal algorithm
+    template<class Moments, class scalar_t>
+    static void projected_block(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                                int opt_level) {
+        using namespace calc_moments::off_diagonal;
+
+        if (oh.is_permuted()) {
+            return basic_block(moments, oh.permuted());
+        }
+        if (oh.is_bsr()) {
+            return basic_block(moments, oh.bsr());
+        }
+        if (oh.is_bulk_boundary()) {
+            return basic_block(moments, oh.bulk_boundary());
+        }
+        if (oh.is_symmetric()) {
+            return basic_block(moments, oh.symmetric());
+        }
+        switch (opt_level) {
+            case 0:
+            case 1:
+            case 2: basic_block(moments, oh.csr()); break;
+            case 3: basic_block(moments, oh.ell()); break;
+            default: basic_block(moments, oh.sell()); break;
         }
     }
 
@@ -154,11 +1750,76 @@ struct DefaultCalcMoments {
                              int opt_level) {
         using namespace calc_moments::off_diagonal;
 
+        if (oh.is_permuted()) {
+            return opt_size_and_interleaved(moments, oh.permuted(), oh.sizes());
+        }
+        if (oh.is_bsr()) {
+            return opt_size_and_interleaved(moments, oh.bsr(), oh.sizes());
+        }
+        if (oh.is_bulk_boundary()) {
+            return opt_size_and_interleaved(moments, oh.bulk_boundary(), oh.sizes());
+        }
+        if (oh.is_symmetric()) {
+            return basic(moments, oh.symmetric());
+        }
         switch (opt_level) {
             case 0: basic(moments, oh.csr()); break;
             case 1: opt_size(moments, oh.csr(), oh.sizes()); break;
             case 2: opt_size_and_interleaved(moments, oh.csr(), oh.sizes()); break;
-            default: opt_size_and_interleaved(moments, oh.ell(), oh.sizes()); break;
+            case 3: opt_size_and_interleaved(moments, oh.ell(), oh.sizes()); break;
+            default: opt_size_and_interleaved(moments, oh.sell(), oh.sizes()); break;
+        }
+    }
+
+    template<class Moments, class scalar_t>
+    static void off_diagonal(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                             int opt_level, ThreadPool& pool) {
+        using namespace calc_moments::off_diagonal;
+
+        if (oh.is_permuted()) {
+            return opt_size_parallel(moments, oh.permuted(), oh.sizes(), pool);
+        }
+        if (oh.is_bsr()) {
+            return opt_size_parallel(moments, oh.bsr(), oh.sizes(), pool);
+        }
+        if (oh.is_bulk_boundary()) {
+            return opt_size_parallel(moments, oh.bulk_boundary(), oh.sizes(), pool);
+        }
+        if (oh.is_symmetric()) {
+            return basic(moments, oh.symmetric());
+        }
+        switch (opt_level) {
+            case 0:
+            case 1:
+            case 2: opt_size_parallel(moments, oh.csr(), oh.sizes(), pool); break;
+            case 3: opt_size_parallel(moments, oh.ell(), oh.sizes(), pool); break;
+            default: opt_size_parallel(moments, oh.sell(), oh.sizes(), pool); break;
+        }
+    }
+
+    template<class Moments, class scalar_t>
+    static void off_diagonal_block(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                                   int opt_level) {
+        using namespace calc_moments::off_diagonal;
+
+        if (oh.is_permuted()) {
+            return opt_size_block(moments, oh.permuted(), oh.sizes());
+        }
+        if (oh.is_bsr()) {
+            return opt_size_block(moments, oh.bsr(), oh.sizes());
+        }
+        if (oh.is_bulk_boundary()) {
+            return opt_size_block(moments, oh.bulk_boundary(), oh.sizes());
+        }
+        if (oh.is_symmetric()) {
+            return basic_block(moments, oh.symmetric());
+        }
+        switch (opt_level) {
+            case 0: basic_block(moments, oh.csr()); break;
+            case 1:
+            case 2: opt_size_block(moments, oh.csr(), oh.sizes()); break;
+            case 3: opt_size_block(moments, oh.ell(), oh.sizes()); break;
+            default: opt_size_block(moments, oh.sell(), oh.sizes()); break;
         }
     }
 };
@@ -166,7 +1827,71 @@ struct DefaultCalcMoments {
 CPB_INSTANTIATE_TEMPLATE_CLASS_VARGS(StrategyTemplate, DefaultCalcMoments)
 
 #ifdef CPB_USE_CUDA
+namespace {
+    /// GPU resources which are kept together with an `OptimizedHamiltonian`
+    class GpuState {
+    public:
+        /// Matrix cache of the given GPU, created on first use
+        cuda::DeviceCache& cache(int device) {
+            if (device >= static_cast<int>(caches.size())) {
+                caches.resize(device + 1);
+            }
+            if (!caches[device]) {
+                // The cache belongs to the selected GPU: select it only for the creation
+                auto const current = cuda::get_device();
+                cuda::set_device(device);
+                try {
+                    caches[device] = std14::make_unique<cuda::DeviceCache>();
+                } catch (...) {
+                    cuda::set_device(current);
+                    throw;
+                }
+                cuda::set_device(current);
+            }
+            return *caches[device];
+        }
+
+        /// One host thread per GPU
+        ThreadPool& pool(int num_devices) {
+            if (!threads || threads->size() != num_devices) {
+                threads = std14::make_unique<ThreadPool>(num_devices);
+            }
+            return *threads;
+        }
+
+    private:
+        std::vector<std::unique_ptr<cuda::DeviceCache>> caches;
+        std::unique_ptr<ThreadPool> threads;
+    };
+
+    template<class scalar_t>
+    GpuState& gpu_state(OptimizedHamiltonian<scalar_t> const& oh) {
+        auto& state = oh.backend_state();
+        if (!state) {
+            state = std::make_shared<GpuState>();
+        }
+        return *std::static_pointer_cast<GpuState>(state);
+    }
+} // anonymous namespace
+
+/**
+ The GPU runs only the main loop: the initial vectors are prepared and the results are
+ collected on the host by the same `Moments` classes as `DefaultCalcMoments`. The ThreadPool
+ overloads ignore the pool since all the work is done by the GPU.
+
+ Level 0 is the reference implementation on the full system, level 1 adds the optimal
+ size reordering and level 2 fuses the dot products into the matrix-vector multiplication
+ kernel. The interleaved CPU algorithms only reuse the CPU cache, which doesn't apply here.
+ Level 2 gets the same kind of bandwidth savings from the fused kernel and it also avoids
+ waiting for the GPU after each iteration.
+ */
 struct CudaCalcMoments {
+    static constexpr int max_opt_level = 2;
+    static constexpr bool supports_permuted = false; ///< the device kernels are ELL only
+    static constexpr bool supports_bsr = false;
+    static constexpr bool supports_symmetric = false;
+    static constexpr bool supports_bulk_boundary = false;
+
     static MatrixConfig matrix_config(int opt_level) {
         switch (opt_level) {
             case 0: return {MatrixConfig::Reorder::OFF, MatrixConfig::Format::ELL};
@@ -174,33 +1899,276 @@ struct CudaCalcMoments {
         }
     };
 
+    /// Start uploading the matrix to the GPU (unless it's already there) and return the cache
+    /// which holds it. The cache lives as long as the `OptimizedHamiltonian`, so the matrix
+    /// stays resident between calls with the same target indices (or any indices if the
+    /// matrix isn't reordered). The host prepares the initial vectors while the copy runs.
     template<class scalar_t>
-    static MomentsMatrix<scalar_t> moments_vector(OptimizedHamiltonian<scalar_t> const& oh,
-                                                  int num_moments, int opt_level) {
-        switch (opt_level) {
-            default: return calc_moments2(oh.ell(), oh.idx(), num_moments, oh.sizes());
+    static cuda::DeviceCache& upload(OptimizedHamiltonian<scalar_t> const& oh) {
+        auto& cache = gpu_state(oh).cache(0);
+        cuda::I<scalar_t>::upload(cache, oh.id(), ellref(oh.ell()));
+        return cache;
+    }
+
+    /// Number of rows to compute in each KPM iteration `first <= n <= last`
+    static std::vector<int> iteration_sizes(OptimizedSizes const& sizes, int first, int last,
+                                            int num_moments) {
+        auto result = std::vector<int>();
+        for (auto n = first; n <= last; ++n) {
+            result.push_back(sizes.optimal(n, num_moments));
         }
+        return result;
     }
 
-    template<class scalar_t>
-    static ArrayX<scalar_t> moments_diag(OptimizedHamiltonian<scalar_t> const& oh,
-                                         int num_moments, int opt_level) {
+    /// Pass the dot products computed by `cuda::I::diagonal` to `Moments::collect()`
+    template<class Moments, class scalar_t, class acc_t = typename Moments::accumulator_t>
+    static void collect_diagonal(Moments& moments, int first,
+                                 thr::host_vector<scalar_t> const& m) {
+        for (auto k = 0; k < static_cast<int>(m.size()) / 2; ++k) {
+            moments.collect(first + k, static_cast<acc_t>(m[2 * k]),
+                            static_cast<acc_t>(m[2 * k + 1]));
+        }
+    }
+
+    /// The GPU doesn't use the interleaved algorithm, so the `depth` doesn't apply here
+    template<class Moments, class scalar_t>
+    static void diagonal(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                         int opt_level, int /*depth*/ = 2) {
         assert(oh.idx().is_diagonal());
-        using Cuda = cuda::I<scalar_t>;
-        auto const i = oh.idx().row;
-        auto const ell = ellref(oh.ell());
+        auto& cache = upload(oh);
+        auto r0 = moments.r0(oh.ell());
+        auto r1 = moments.r1(oh.ell(), r0);
+        moments.collect_initial(r0, r1);
+
+        auto const num_moments = moments.size();
+        assert(num_moments % 2 == 0);
+        auto const sizes = iteration_sizes(oh.sizes(), 2, num_moments / 2, num_moments);
+        auto const m = cuda::I<scalar_t>::diagonal(cache, oh.id(), ellref(oh.ell()), sizes,
+                                                   r0.data(), r1.data(), 1, opt_level >= 2);
+        collect_diagonal(moments, 2, m);
+    }
+
+    template<class Moments, class scalar_t>
+    static void diagonal(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                         int opt_level, ThreadPool&) {
+        diagonal(moments, oh, opt_level);
+    }
+
+    template<class Moments, class scalar_t>
+    static void diagonal_resumable(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                                   int opt_level,
+                                   calc_moments::Checkpoint<scalar_t>& checkpoint) {
+        auto& cache = upload(oh);
+        if (checkpoint.n == 0) {
+            checkpoint.r0 = moments.r0(oh.ell());
+            checkpoint.r1 = moments.r1(oh.ell(), checkpoint.r0);
+            moments.collect_initial(checkpoint.r0, checkpoint.r1);
+            checkpoint.n = 2;
+        }
+
+        auto const num_moments = moments.size();
+        assert(num_moments % 2 == 0);
+        if (checkpoint.n > num_moments / 2) {
+            return;
+        }
+
+        // Same as `calc_moments::diagonal::opt_size_resumable`: the sizes only grow
+        constexpr auto unlimited = std::numeric_limits<int>::max();
+        auto const sizes = iteration_sizes(oh.sizes(), checkpoint.n, num_moments / 2,
+                                           unlimited);
+        auto const m = cuda::I<scalar_t>::diagonal(cache, oh.id(), ellref(oh.ell()), sizes,
+                                                   checkpoint.r0.data(), checkpoint.r1.data(),
+                                                   1, opt_level >= 2);
+        collect_diagonal(moments, checkpoint.n, m);
+        checkpoint.n = num_moments / 2 + 1;
+    }
+
+    /// Advance all the vectors of a block `Moments` class with the given iteration sizes
+    template<class Moments, class scalar_t>
+    static void block(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                      std::vector<int> const& sizes) {
+        auto& cache = upload(oh);
+        auto r0 = moments.r0(oh.ell());
+        auto r1 = moments.r1(oh.ell(), r0);
+        moments.collect_initial(r0, r1);
+
+        auto const block_size = moments.block_size();
+        auto const m = cuda::I<scalar_t>::diagonal(cache, oh.id(), ellref(oh.ell()), sizes,
+                                                   r0.data(), r1.data(), block_size, true);
+
+        auto m2 = ArrayX<scalar_t>(block_size);
+        auto m3 = ArrayX<scalar_t>(block_size);
+        for (auto k = 0; k < static_cast<int>(sizes.size()); ++k) {
+            for (auto i = 0; i < block_size; ++i) {
+                m2[i] = m[2 * (k * block_size + i)];
+                m3[i] = m[2 * (k * block_size + i) + 1];
+            }
+            moments.collect(2 + k, m2, m3);
+        }
+    }
+
+    /// The block kernel always fuses the dot products, even at level 0
+    template<class Moments, class scalar_t>
+    static void diagonal_block(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                               int /*opt_level*/) {
+        auto const num_moments = moments.size();
+        assert(num_moments % 2 == 0);
+        block(moments, oh, iteration_sizes(oh.sizes(), 2, num_moments / 2, num_moments));
+    }
+
+    /// The random vectors of the stochastic trace span the full system: no size optimization
+    template<class Moments, class scalar_t>
+    static void trace_block(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                            int /*opt_level*/) {
+        auto const num_moments = moments.size();
+        assert(num_moments % 2 == 0);
+        block(moments, oh, std::vector<int>(num_moments / 2 - 1, oh.ell().rows()));
+    }
+
+    /// The device kernels only return norms and dot products, not the projected moments:
+    /// this runs the host version on the same ELLPACK matrix
+    template<class Moments, class scalar_t>
+    static void projected_block(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                                int /*opt_level*/) {
+        calc_moments::off_diagonal::basic_block(moments, oh.ell());
+    }
+
+    /// Same as `projected_block`: the device kernels have no damping
+    template<class Moments, class scalar_t, class real_t>
+    static void damped(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                       int /*opt_level*/, ArrayX<real_t> const& damping) {
+        calc_moments::off_diagonal::damped(moments, oh.ell(), damping);
+    }
+
+    template<class Moments, class scalar_t>
+    static void off_diagonal(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                             int /*opt_level*/) {
+        auto& cache = upload(oh);
+        auto r0 = moments.r0(oh.ell());
+        auto r1 = moments.r1(oh.ell(), r0);
+        moments.collect_initial(r0, r1);
+
+        auto const num_moments = moments.size();
+        auto const& cols = oh.idx().cols;
+        auto const num_cols = static_cast<int>(cols.size());
+        auto const sizes = iteration_sizes(oh.sizes(), 2, num_moments - 1, num_moments);
+        auto const values = cuda::I<scalar_t>::off_diagonal(cache, oh.id(), ellref(oh.ell()),
+                                                            sizes, r0.data(), r1.data(),
+                                                            cols.data(), num_cols);
 
-        auto moments = [&]{
-            switch (opt_level) {
-                case 0: return Cuda::calc_diag_moments0(ell, i, num_moments);
-                default: return Cuda::calc_diag_moments1(ell, i, num_moments, oh.sizes());
+        auto& data = moments.get();
+        for (auto k = 0; k < static_cast<int>(sizes.size()); ++k) {
+            for (auto i = 0; i < num_cols; ++i) {
+                data[i][2 + k] = values[k * num_cols + i];
             }
-        }();
-        return eigen_cast<ArrayX>(moments);
+        }
+    }
+
+    template<class Moments, class scalar_t>
+    static void off_diagonal(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                             int opt_level, ThreadPool&) {
+        off_diagonal(moments, oh, opt_level);
+    }
+
+    /// There is no GPU kernel which collects off-diagonal elements from a block of vectors:
+    /// the same ELLPACK matrix is used on the host
+    template<class Moments, class scalar_t>
+    static void off_diagonal_block(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                                   int /*opt_level*/) {
+        calc_moments::off_diagonal::opt_size_block(moments, oh.ell(), oh.sizes());
     }
 };
 
 CPB_INSTANTIATE_TEMPLATE_CLASS_VARGS(StrategyTemplate, CudaCalcMoments)
+
+/**
+ Distributes the vectors of block calculations across all the visible GPUs
+
+ Each GPU holds a full replica of the Hamiltonian and computes a contiguous share of the
+ columns of the block: the random vectors of the stochastic trace (DOS) or the target
+ indices of `ldos_vector`. The initial vectors are prepared and the moments are collected
+ on the host. A calculation with a single vector runs on the first GPU, as in `CudaCalcMoments`.
+ */
+struct MultiGpuCalcMoments : CudaCalcMoments {
+    template<class Moments, class scalar_t>
+    static void block(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                      std::vector<int> const& sizes) {
+        auto const block_size = moments.block_size();
+        auto const num_devices = std::min(cuda::num_devices(), block_size);
+        if (num_devices <= 1) {
+            return CudaCalcMoments::block(moments, oh, sizes);
+        }
+
+        auto& state = gpu_state(oh);
+        auto const current_device = cuda::get_device();
+        for (auto device = 0; device < num_devices; ++device) {
+            state.cache(device); // not thread safe: create them all up front
+        }
+
+        auto r0 = moments.r0(oh.ell());
+        auto r1 = moments.r1(oh.ell(), r0);
+        moments.collect_initial(r0, r1);
+
+        auto results = std::vector<thr::host_vector<scalar_t>>(num_devices);
+        auto errors = std::vector<std::exception_ptr>(num_devices);
+        auto const first_col = [&](int device) { return block_size * device / num_devices; };
+
+        state.pool(num_devices).run([&](int device) {
+            try {
+                cuda::set_device(device);
+                auto const col = first_col(device);
+                auto const num_cols = first_col(device + 1) - col;
+                RowMajorMatrixX<scalar_t> r0_part = r0.middleCols(col, num_cols);
+                RowMajorMatrixX<scalar_t> r1_part = r1.middleCols(col, num_cols);
+                results[device] = cuda::I<scalar_t>::diagonal(
+                    state.cache(device), oh.id(), ellref(oh.ell()), sizes,
+                    r0_part.data(), r1_part.data(), num_cols, true
+                );
+            } catch (...) {
+                errors[device] = std::current_exception();
+            }
+        });
+        cuda::set_device(current_device); // the calling thread also ran a share of the work
+        for (auto const& error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+
+        auto m2 = ArrayX<scalar_t>(block_size);
+        auto m3 = ArrayX<scalar_t>(block_size);
+        for (auto k = 0; k < static_cast<int>(sizes.size()); ++k) {
+            for (auto device = 0; device < num_devices; ++device) {
+                auto const col = first_col(device);
+                auto const num_cols = first_col(device + 1) - col;
+                auto const& m = results[device];
+                for (auto i = 0; i < num_cols; ++i) {
+                    m2[col + i] = m[2 * (k * num_cols + i)];
+                    m3[col + i] = m[2 * (k * num_cols + i) + 1];
+                }
+            }
+            moments.collect(2 + k, m2, m3);
+        }
+    }
+
+    template<class Moments, class scalar_t>
+    static void diagonal_block(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                               int /*opt_level*/) {
+        auto const num_moments = moments.size();
+        assert(num_moments % 2 == 0);
+        block(moments, oh, iteration_sizes(oh.sizes(), 2, num_moments / 2, num_moments));
+    }
+
+    template<class Moments, class scalar_t>
+    static void trace_block(Moments& moments, OptimizedHamiltonian<scalar_t> const& oh,
+                            int /*opt_level*/) {
+        auto const num_moments = moments.size();
+        assert(num_moments % 2 == 0);
+        block(moments, oh, std::vector<int>(num_moments / 2 - 1, oh.ell().rows()));
+    }
+};
+
+CPB_INSTANTIATE_TEMPLATE_CLASS_VARGS(StrategyTemplate, MultiGpuCalcMoments)
 #endif // CPB_USE_CUDA
 
 }} // namespace cpb::kpm
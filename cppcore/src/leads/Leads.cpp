@@ -1,20 +1,104 @@
 #include "leads/Leads.hpp"
 
+#include "utils/ThreadPool.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <memory>
+
 namespace cpb {
 
+namespace {
+    /// Call `fn(i)` for each `i` in [0, size) interleaved over the threads. The first
+    /// exception thrown by a worker is rethrown on the calling thread.
+    template<class F>
+    void for_each_lead(int size, int num_threads, F fn) {
+        if (num_threads <= 1 || size <= 1) {
+            for (auto i = 0; i < size; ++i) { fn(i); }
+            return;
+        }
+
+        auto errors = std::vector<std::exception_ptr>(static_cast<size_t>(size));
+        ThreadPool pool(std::min(num_threads, size));
+        pool.run([&](int thread_id) {
+            for (auto i = thread_id; i < size; i += pool.size()) {
+                try {
+                    fn(i);
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            }
+        });
+
+        for (auto const& e : errors) {
+            if (e) { std::rethrow_exception(e); }
+        }
+    }
+
+    template<class T>
+    bool equal_arrays(T const* a, T const* b, std::ptrdiff_t size) {
+        return std::equal(a, a + size, b);
+    }
+
+    bool same_structure(SparseMatrixX<hop_id> const& a, SparseMatrixX<hop_id> const& b) {
+        return a.rows() == b.rows() && a.cols() == b.cols() && a.nonZeros() == b.nonZeros()
+               && equal_arrays(a.outerIndexPtr(), b.outerIndexPtr(), a.outerSize() + 1)
+               && equal_arrays(a.innerIndexPtr(), b.innerIndexPtr(), a.nonZeros())
+               && equal_arrays(a.valuePtr(), b.valuePtr(), a.nonZeros());
+    }
+
+    /// Without modifiers, the lead Hamiltonian depends only on the sublattices and hopping IDs
+    bool same_structure(System const& a, System const& b) {
+        if (a.num_sites() != b.num_sites() || (a.sublattices != b.sublattices).any()
+            || !same_structure(a.hoppings, b.hoppings)
+            || a.boundaries.size() != b.boundaries.size()) {
+            return false;
+        }
+        for (auto n = size_t{0}; n < a.boundaries.size(); ++n) {
+            if (!same_structure(a.boundaries[n].hoppings, b.boundaries[n].hoppings)) {
+                return false;
+            }
+        }
+        return true;
+    }
+} // anonymous namespace
+
 void Leads::create_attachment_area(Foundation& foundation) const {
     for (auto const& spec : specs) {
         leads::create_attachment_area(foundation, spec);
     }
 }
 
-void Leads::make_structure(Foundation const& foundation, HamiltonianIndices const& indices) {
+void Leads::make_structure(Foundation const& foundation, HamiltonianIndices const& indices,
+                           int num_threads) {
     if (!structures.empty()) {
         return;
     }
 
-    for (auto const& spec : specs) {
-        structures.emplace_back(foundation, indices, spec);
+    auto const is_thread_safe = std::all_of(specs.begin(), specs.end(), [](leads::Spec const& s) {
+        return s.shape.is_thread_safe;
+    });
+
+    auto built = std::vector<std::unique_ptr<leads::Structure>>(specs.size());
+    for_each_lead(size(), is_thread_safe ? num_threads : 1, [&](int i) {
+        built[i].reset(new leads::Structure(foundation, indices, specs[i]));
+    });
+
+    structures.reserve(specs.size());
+    for (auto& s : built) {
+        structures.push_back(std::move(*s));
+    }
+}
+
+void Leads::reorder_structure(ArrayXi const& original_indices) {
+    auto new_indices = ArrayXi(original_indices.size());
+    for (auto i = 0; i < original_indices.size(); ++i) {
+        new_indices[original_indices[i]] = i;
+    }
+    for (auto& structure : structures) {
+        for (auto& index : structure.indices) {
+            index = new_indices[index];
+        }
     }
 }
 
@@ -24,8 +108,41 @@ void Leads::make_hamiltonian(HamiltonianModifiers const& modifiers,
         return;
     }
 
-    for (auto const& structure : structures) {
-        hamiltonians.emplace_back(structure.system, modifiers, is_double, is_complex);
+    // Leads which are identical to an earlier one reuse its Hamiltonian pair
+    auto const num_leads = static_cast<int>(structures.size());
+    auto original = std::vector<int>(structures.size());
+    auto const has_modifiers = !modifiers.onsite.empty() || !modifiers.hopping.empty();
+    for (auto i = 0; i < num_leads; ++i) {
+        original[i] = i;
+        for (auto j = 0; j < i && !has_modifiers; ++j) {
+            if (original[j] == j && same_structure(structures[i].system, structures[j].system)) {
+                original[i] = j;
+                break;
+            }
+        }
+    }
+
+    // Python modifiers can't be called from the worker threads. A single lead is small,
+    // so the threads are better spent on different leads than within a lead.
+    auto const is_thread_safe = modifiers.all_onsite_thread_safe() && modifiers.all_thread_safe();
+    auto lead_modifiers = modifiers;
+    lead_modifiers.num_threads = 1;
+
+    auto built = std::vector<std::unique_ptr<leads::HamiltonianPair>>(structures.size());
+    auto unique = std::vector<int>();
+    for (auto i = 0; i < num_leads; ++i) {
+        if (original[i] == i) { unique.push_back(i); }
+    }
+    for_each_lead(static_cast<int>(unique.size()), is_thread_safe ? modifiers.num_threads : 1,
+                  [&](int n) {
+        auto const i = unique[n];
+        built[i].reset(new leads::HamiltonianPair(structures[i].system, lead_modifiers,
+                                                  is_double, is_complex));
+    });
+
+    hamiltonians.reserve(structures.size());
+    for (auto i = 0; i < num_leads; ++i) {
+        hamiltonians.push_back(*built[original[i]]);
     }
 }
 
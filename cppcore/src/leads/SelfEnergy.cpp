@@ -0,0 +1,148 @@
+#include "leads/SelfEnergy.hpp"
+
+#include "utils/ThreadPool.hpp"
+
+#include <Eigen/LU>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <limits>
+#include <stdexcept>
+
+namespace cpb { namespace leads {
+
+namespace {
+    /// Dense complex copy of any Hamiltonian variant with the given precision
+    template<class real_t>
+    struct ToDense {
+        template<class scalar_t>
+        MatrixX<std::complex<real_t>> operator()(SparseMatrixRC<scalar_t> const& m) const {
+            using complex_t = std::complex<real_t>;
+            MatrixX<complex_t> result = MatrixX<complex_t>::Zero(m->rows(), m->cols());
+            for (auto row = 0; row < m->outerSize(); ++row) {
+                for (auto it = typename SparseMatrixX<scalar_t>::InnerIterator(*m, row);
+                     it; ++it) {
+                    result(it.row(), it.col()) = {static_cast<real_t>(std::real(it.value())),
+                                                  static_cast<real_t>(std::imag(it.value()))};
+                }
+            }
+            return result;
+        }
+    };
+} // anonymous namespace
+
+template<class real_t>
+SelfEnergy<real_t>::SelfEnergy(Lead const& lead, double broadening, double tolerance,
+                               int max_iterations)
+    : h0(var::apply_visitor(ToDense<real_t>(), lead.h0().get_variant())),
+      h1(var::apply_visitor(ToDense<real_t>(), lead.h1().get_variant())),
+      broadening(broadening),
+      tolerance(tolerance > 0 ? static_cast<real_t>(tolerance)
+                              : 100 * std::numeric_limits<real_t>::epsilon()),
+      max_iterations(max_iterations) {
+    if (broadening <= 0) {
+        throw std::invalid_argument("SelfEnergy: the broadening must be positive.");
+    }
+}
+
+template<class real_t>
+typename SelfEnergy<real_t>::Matrix SelfEnergy<real_t>::surface_greens(double energy) const {
+    auto const n = size();
+    if (n == 0) {
+        return {};
+    }
+    auto const z = complex_t{static_cast<real_t>(energy), static_cast<real_t>(broadening)};
+    Matrix const z_identity = Matrix::Identity(n, n) * z;
+    auto const threshold = tolerance * std::max(h1.cwiseAbs().maxCoeff(), real_t{1e-30f});
+
+    // Effective surface and bulk cells, and the couplings to the next (alpha) and
+    // previous (beta) remaining cell: the previous cell is the inner one, see `h1`
+    Matrix surface = h0;
+    Matrix bulk = h0;
+    Matrix alpha = h1.adjoint();
+    Matrix beta = h1;
+    for (auto i = 0; i < max_iterations; ++i) {
+        Matrix const g = (z_identity - bulk).partialPivLu().inverse();
+        Matrix const alpha_g = alpha * g;
+        Matrix const beta_g = beta * g;
+        Matrix const alpha_g_beta = alpha_g * beta;
+
+        surface += alpha_g_beta;
+        bulk += alpha_g_beta + beta_g * alpha;
+        alpha = alpha_g * alpha;
+        beta = beta_g * beta;
+
+        if (alpha.cwiseAbs().maxCoeff() < threshold && beta.cwiseAbs().maxCoeff() < threshold) {
+            return (z_identity - surface).partialPivLu().inverse();
+        }
+    }
+
+    throw std::runtime_error("SelfEnergy: the decimation did not converge. Try a larger "
+                             "broadening or more iterations.");
+}
+
+template<class real_t>
+std::vector<typename SelfEnergy<real_t>::Matrix>
+SelfEnergy<real_t>::calc(ArrayXd const& energies, int num_threads) const {
+    auto const num_energies = static_cast<int>(energies.size());
+    auto result = std::vector<Matrix>(num_energies);
+
+    auto missing = std::vector<int>();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto i = 0; i < num_energies; ++i) {
+            auto const it = cache.find(energies[i]);
+            if (it != cache.end()) {
+                result[i] = it->second;
+            } else {
+                missing.push_back(i);
+            }
+        }
+    }
+    if (missing.empty()) {
+        return result;
+    }
+
+    // Every energy costs the same, so interleaving keeps the threads balanced
+    auto const num_missing = static_cast<int>(missing.size());
+    ThreadPool pool(std::max(1, std::min(num_threads, num_missing)));
+    auto errors = std::vector<std::exception_ptr>(static_cast<size_t>(pool.size()));
+    std::atomic<bool> failed{false};
+    pool.run([&](int thread_id) {
+        try {
+            for (auto n = thread_id; n < num_missing && !failed; n += pool.size()) {
+                auto const i = missing[n];
+                result[i] = h1.adjoint() * surface_greens(energies[i]) * h1;
+            }
+        } catch (...) {
+            errors[thread_id] = std::current_exception();
+            failed = true; // the other threads stop at their next energy
+        }
+    });
+    for (auto const& error : errors) {
+        if (error) { std::rethrow_exception(error); }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto i : missing) {
+        cache.emplace(energies[i], result[i]);
+    }
+    return result;
+}
+
+template<class real_t>
+typename SelfEnergy<real_t>::Matrix SelfEnergy<real_t>::calc(double energy) const {
+    return calc(ArrayXd::Constant(1, energy)).front();
+}
+
+template<class real_t>
+void SelfEnergy<real_t>::clear_cache() {
+    std::lock_guard<std::mutex> lock(mutex);
+    cache.clear();
+}
+
+template class SelfEnergy<float>;
+template class SelfEnergy<double>;
+
+}} // namespace cpb::leads
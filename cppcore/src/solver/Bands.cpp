@@ -0,0 +1,62 @@
+#include "solver/Bands.hpp"
+#include "compute/eigensolver.hpp"
+#include "utils/ThreadPool.hpp"
+
+#include <atomic>
+
+namespace cpb {
+namespace {
+
+struct CalcBands {
+    std::vector<Cartesian> const& kpoints;
+    int num_threads;
+
+    template<class scalar_t>
+    RowMajorArrayXX<double>
+    operator()(std::shared_ptr<detail::PeriodicParts<scalar_t> const> const& parts) const {
+        using real_t = num::get_real_t<scalar_t>;
+        auto const size = static_cast<int>(parts->matrix.rows());
+        auto const num_kpoints = static_cast<int>(kpoints.size());
+        auto bands = RowMajorArrayXX<double>(num_kpoints, size);
+        std::atomic<bool> is_converged{true};
+
+        ThreadPool pool(std::max(1, std::min(num_threads, num_kpoints)));
+        pool.run([&](int thread_id) {
+            // The k-points are already concurrent: LAPACK shouldn't add threads of its own
+            compute::set_local_lapack_threads(1);
+            auto matrix = SparseMatrixX<scalar_t>();
+            auto dense = MatrixX<scalar_t>(size, size);
+            auto values = ArrayX<real_t>(size);
+            auto vectors = MatrixX<scalar_t>();
+
+            // Interleaved k-points: every point costs the same, so the threads stay balanced
+            for (auto n = thread_id; n < num_kpoints; n += pool.size()) {
+                detail::assemble_periodic(matrix, *parts, kpoints[n]);
+                dense = matrix;
+                auto const all = real_t{0}; // no energy window
+                if (!compute::hermitian_eigensolve(dense, all, all, false, values, vectors)) {
+                    is_converged = false; // can't throw from a worker thread
+                    break;
+                }
+                bands.row(n) = values.transpose().template cast<double>();
+            }
+            compute::set_local_lapack_threads(0);
+        });
+
+        if (!is_converged) {
+            throw std::runtime_error("calc_bands: the eigensolver did not converge.");
+        }
+        return bands;
+    }
+};
+
+} // namespace
+
+RowMajorArrayXX<double> calc_bands(Model const& model, std::vector<Cartesian> const& kpoints,
+                                   int num_threads) {
+    auto const& periodic_hamiltonian = model.periodic_hamiltonian();
+    return var::apply_visitor(CalcBands{kpoints, num_threads},
+                              periodic_hamiltonian.get_variant());
+}
+
+} // namespace cpb
@@ -0,0 +1,252 @@
+#include "solver/ChebFilter.hpp"
+
+#include "kpm/OptimizedHamiltonian.hpp"
+#include "kpm/Kernel.hpp"
+#include "compute/kernel_polynomial.hpp"
+#include "numeric/random.hpp"
+#include "numeric/constant.hpp"
+#include "support/format.hpp"
+
+#include <Eigen/Eigenvalues>
+#include <Eigen/QR>
+
+using namespace fmt::literals;
+
+namespace cpb {
+
+namespace {
+    /// Chebyshev coefficients (Jackson damped) of the indicator function of [lo, hi] which
+    /// are given in scaled units, within (-1, 1). The `degree` is automatic if it's zero,
+    /// otherwise at least 2: `filter()` needs the first two coefficients.
+    template<class real_t>
+    ArrayX<real_t> window_coefficients(double lo, double hi, int degree) {
+        auto const theta_lo = std::acos(std::max(-1.0, std::min(1.0, lo)));
+        auto const theta_hi = std::acos(std::max(-1.0, std::min(1.0, hi)));
+        if (degree == 0) {
+            // The Jackson broadening is `pi / N`: a quarter of the window's width
+            auto const width = std::max(theta_lo - theta_hi, 1e-6);
+            degree = static_cast<int>(std::ceil(4 * constant::pi / width));
+            degree = std::max(20, std::min(degree, 20000));
+        }
+
+        auto const damping = kpm::jackson_kernel().damping_coefficients(degree);
+        auto c = ArrayX<real_t>(degree);
+        c[0] = static_cast<real_t>((theta_lo - theta_hi) / constant::pi);
+        for (auto n = 1; n < degree; ++n) {
+            auto const integral = (std::sin(n * theta_lo) - std::sin(n * theta_hi)) / n;
+            c[n] = static_cast<real_t>(2 / constant::pi * integral * damping[n]);
+        }
+        return c;
+    }
+
+    /// Replace the columns of `x` with an orthonormal basis of the same space
+    template<class scalar_t>
+    void orthonormalize(MatrixX<scalar_t>& x) {
+        auto const qr = Eigen::HouseholderQR<MatrixX<scalar_t>>(x);
+        x = qr.householderQ() * MatrixX<scalar_t>::Identity(x.rows(), x.cols());
+    }
+} // anonymous namespace
+
+template<class scalar_t>
+ChebFilter<scalar_t>::ChebFilter(SparseMatrixRC<scalar_t> h, Config const& config)
+    : hamiltonian(std::move(h)), config(config) {
+    if (config.num_threads < 1) {
+        throw std::invalid_argument("ChebFilter: The number of threads must be at least 1.");
+    }
+    if (config.num_threads > 1) {
+        thread_pool = std14::make_unique<ThreadPool>(config.num_threads);
+    }
+}
+
+template<class scalar_t>
+bool ChebFilter<scalar_t>::change_hamiltonian(Hamiltonian const& h) {
+    if (!ham::is<scalar_t>(h)) {
+        return false;
+    }
+
+    hamiltonian = ham::get_shared_ptr<scalar_t>(h);
+    _eigenvalues.resize(0);
+    _eigenvectors.resize(0, 0);
+    return true;
+}
+
+template<class scalar_t>
+void ChebFilter<scalar_t>::spmm(SparseMatrixX<scalar_t> const& h2,
+                                RowMajorMatrixX<scalar_t> const& x,
+                                RowMajorMatrixX<scalar_t>& y) {
+    auto const rows = static_cast<int>(h2.rows());
+    if (!thread_pool) {
+        compute::kpm_spmm(0, rows, h2, x, y);
+        return;
+    }
+
+    thread_pool->parallel_for(0, rows, [&](int, int start, int end) {
+        compute::kpm_spmm(start, end, h2, x, y);
+    });
+}
+
+template<class scalar_t>
+void ChebFilter<scalar_t>::filter(SparseMatrixX<scalar_t> const& h2,
+                                  ArrayX<real_t> const& coefficients, MatrixX<scalar_t>& x) {
+    using Block = RowMajorMatrixX<scalar_t>;
+    auto const degree = static_cast<int>(coefficients.size());
+
+    // The usual KPM recurrence, but for the whole block: r1 = h2 * r0 - r1
+    auto r0 = Block{x};
+    auto r1 = Block{Block::Zero(x.rows(), x.cols())};
+    spmm(h2, r0, r1);
+    r1 *= real_t{0.5}; // because h2 was pre-multiplied by 2
+
+    auto y = Block{scalar_t{coefficients[0]} * r0 + scalar_t{coefficients[1]} * r1};
+    for (auto n = 2; n < degree; ++n) {
+        spmm(h2, r1, r0);
+        r1.swap(r0);
+        y += scalar_t{coefficients[n]} * r1;
+    }
+    x = y;
+}
+
+template<class scalar_t>
+void ChebFilter<scalar_t>::solve() {
+    if (config.energy_min >= config.energy_max) {
+        throw std::invalid_argument("ChebFilter: Invalid energy window (min >= max).");
+    }
+    if (config.initial_size_guess < 1) {
+        throw std::invalid_argument("ChebFilter: The initial size guess must be at least 1.");
+    }
+    if (config.filter_degree != 0 && config.filter_degree < 2) {
+        throw std::invalid_argument("ChebFilter: The filter degree must be at least 2 "
+                                    "(or 0 for automatic).");
+    }
+
+    auto const size = static_cast<int>(hamiltonian->rows());
+    info = Info();
+
+    // The same scaled matrix as KPM, without reordering since there are no target indices
+    auto bounds = kpm::Bounds<scalar_t>(hamiltonian.get(), config.lanczos_precision);
+    auto const scale = bounds.scaling_factors();
+    auto oh = kpm::OptimizedHamiltonian<scalar_t>(
+        hamiltonian.get(), {kpm::MatrixConfig::Reorder::OFF, kpm::MatrixConfig::Format::CSR}
+    );
+    oh.optimize_for({0, 0}, scale);
+
+    auto const coefficients = window_coefficients<real_t>(
+        (config.energy_min - scale.b) / scale.a, (config.energy_max - scale.b) / scale.a,
+        config.filter_degree
+    );
+    info.filter_degree = static_cast<int>(coefficients.size());
+
+    auto const tolerance = (config.tolerance > 0
+                            ? static_cast<real_t>(config.tolerance)
+                            : std::sqrt(std::numeric_limits<real_t>::epsilon())) * scale.a;
+    auto const is_inside = [&](real_t energy) {
+        return energy >= config.energy_min && energy <= config.energy_max;
+    };
+
+    auto x = MatrixX<scalar_t>{num::make_random<MatrixX<scalar_t>>(
+        size, std::min(config.initial_size_guess, size)
+    )};
+    x.array() -= scalar_t{0.5};
+    orthonormalize(x);
+
+    auto hx = MatrixX<scalar_t>();
+    auto solver = Eigen::SelfAdjointEigenSolver<MatrixX<scalar_t>>();
+    for (auto iteration = 1; ; ++iteration) {
+        ++info.iterations;
+        filter(oh.csr(), coefficients, x);
+        orthonormalize(x);
+
+        // Rayleigh-Ritz
+        hx = (*hamiltonian) * x;
+        solver.compute(x.adjoint() * hx);
+        x = x * solver.eigenvectors();
+        hx = hx * solver.eigenvectors();
+        auto const& energies = solver.eigenvalues();
+
+        auto num_inside = 0;
+        auto max_residual = real_t{0};
+        for (auto i = 0; i < energies.size(); ++i) {
+            if (is_inside(energies[i])) {
+                ++num_inside;
+                auto const residual = (hx.col(i) - scalar_t{energies[i]} * x.col(i)).norm();
+                max_residual = std::max(max_residual, residual);
+            }
+        }
+        info.max_residual = max_residual;
+
+        // The subspace needs a buffer of vectors outside the window to converge quickly
+        auto const subspace = static_cast<int>(x.cols());
+        if (4 * num_inside > 3 * subspace && subspace < size) {
+            info.size_warning = true;
+            auto const new_size = std::min(size, std::max(subspace + 1, 3 * subspace / 2));
+            auto extended = MatrixX<scalar_t>(size, new_size);
+            extended.leftCols(subspace) = x;
+            extended.rightCols(new_size - subspace) = num::make_random<MatrixX<scalar_t>>(
+                size, new_size - subspace
+            ).array() - scalar_t{0.5};
+            x = extended;
+            orthonormalize(x);
+            iteration = 0;
+            continue;
+        }
+
+        if (max_residual <= tolerance) {
+            break;
+        }
+        if (iteration >= config.max_iterations) {
+            throw std::runtime_error("ChebFilter: Failed to converge within the maximum "
+                                     "number of iterations.");
+        }
+    }
+    info.final_size = static_cast<int>(x.cols());
+
+    // The Ritz values are already sorted: only keep the ones within the window
+    auto const& energies = solver.eigenvalues();
+    auto inside = std::vector<int>();
+    for (auto i = 0; i < energies.size(); ++i) {
+        if (is_inside(energies[i])) { inside.push_back(i); }
+    }
+
+    auto const num_inside = static_cast<int>(inside.size());
+    _eigenvalues.resize(num_inside);
+    for (auto i = 0; i < num_inside; ++i) {
+        _eigenvalues[i] = energies[inside[i]];
+    }
+
+    if (stream) { // the inside columns are contiguous since the Ritz values are sorted
+        stream->reset(size);
+        _eigenvectors.resize(0, 0);
+        auto constexpr chunk = 64;
+        for (auto i = 0; i < num_inside; i += chunk) {
+            auto const n = std::min(chunk, num_inside - i);
+            stream->add(_eigenvalues.segment(i, n), x.middleCols(inside[i], n));
+        }
+    } else {
+        _eigenvectors.resize(size, num_inside);
+        for (auto i = 0; i < num_inside; ++i) {
+            _eigenvectors.col(i) = x.col(inside[i]);
+        }
+    }
+}
+
+template<class scalar_t>
+std::string ChebFilter<scalar_t>::report(bool shortform) const {
+    auto report = std::string();
+    if (info.size_warning && !shortform) {
+        report += fmt::format("Resized the subspace: {}\n", info.final_size);
+    }
+
+    auto const fmt_str = shortform
+        ? "ChebFilter({num}|{size}|{degree}|{iterations}|{residual:.2e})"
+        : "Found {num} eigenvalues with a subspace of {size}\n"
+          "Converged after {iterations} filter(s) of degree {degree}\n"
+          "Max. residual: {residual:.2e}\n"
+          "\nCompleted in";
+    return report + fmt::format(fmt_str, "num"_a=_eigenvalues.size(), "size"_a=info.final_size,
+                                "degree"_a=info.filter_degree, "iterations"_a=info.iterations,
+                                "residual"_a=info.max_residual);
+}
+
+CPB_INSTANTIATE_TEMPLATE_CLASS(ChebFilter)
+
+} // namespace cpb
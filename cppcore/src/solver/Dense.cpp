@@ -0,0 +1,74 @@
+#include "solver/Dense.hpp"
+
+#include "compute/eigensolver.hpp"
+#include "support/format.hpp"
+
+using namespace fmt::literals;
+
+namespace cpb {
+
+template<class scalar_t>
+Dense<scalar_t>::Dense(SparseMatrixRC<scalar_t> h, Config const& config)
+    : hamiltonian(std::move(h)), config(config) {
+    if (config.energy_min > config.energy_max) {
+        throw std::invalid_argument("Dense: Invalid energy window (min > max).");
+    }
+    if (config.num_threads < 0) {
+        throw std::invalid_argument("Dense: The number of threads can't be negative.");
+    }
+}
+
+template<class scalar_t>
+bool Dense<scalar_t>::change_hamiltonian(Hamiltonian const& h) {
+    if (!ham::is<scalar_t>(h)) {
+        return false;
+    }
+
+    hamiltonian = ham::get_shared_ptr<scalar_t>(h);
+    _eigenvalues.resize(0);
+    _eigenvectors.resize(0, 0);
+    return true;
+}
+
+template<class scalar_t>
+void Dense<scalar_t>::solve() {
+    auto const size = static_cast<int>(hamiltonian->rows());
+    auto matrix = MatrixX<scalar_t>(*hamiltonian);
+    auto vectors = MatrixX<scalar_t>();
+
+    if (config.num_threads > 0) {
+        compute::set_local_lapack_threads(config.num_threads);
+    }
+    auto const is_converged = compute::hermitian_eigensolve(
+        matrix, static_cast<real_t>(config.energy_min), static_cast<real_t>(config.energy_max),
+        true, _eigenvalues, vectors
+    );
+    if (config.num_threads > 0) {
+        compute::set_local_lapack_threads(0); // back to the global setting
+    }
+    if (!is_converged) {
+        throw std::runtime_error("Dense: The eigensolver did not converge.");
+    }
+
+    MatrixX<scalar_t>().swap(matrix); // release it before the eigenvectors are copied
+    if (stream) {
+        stream->reset(size);
+        _eigenvectors.resize(0, 0);
+        stream->add(_eigenvalues, vectors.array());
+    } else {
+        _eigenvectors = vectors.array();
+    }
+}
+
+template<class scalar_t>
+std::string Dense<scalar_t>::report(bool shortform) const {
+    auto const size = hamiltonian->rows();
+    auto const fmt_str = shortform ? "Dense({num}|{size})"
+                                   : "Found {num} eigenvalues of a {size}x{size} matrix\n"
+                                     "\nCompleted in";
+    return fmt::format(fmt_str, "num"_a=_eigenvalues.size(), "size"_a=size);
+}
+
+CPB_INSTANTIATE_TEMPLATE_CLASS(Dense)
+
+} // namespace cpb
@@ -0,0 +1,180 @@
+#include "solver/DirectGreens.hpp"
+#include "utils/ThreadPool.hpp"
+#include "utils/Trace.hpp"
+
+#include "support/cppfuture.hpp"
+#include "support/format.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+
+using namespace fmt::literals;
+
+namespace cpb {
+namespace {
+
+using complex_t = std::complex<double>;
+using ColMajorComplex = Eigen::SparseMatrix<complex_t, Eigen::ColMajor, int>;
+
+/// `-H` in complex double precision with every diagonal element stored (zero if missing)
+struct NegativeWithDiagonal {
+    template<class scalar_t>
+    ColMajorComplex operator()(SparseMatrixRC<scalar_t> const& h) const {
+        auto triplets = std::vector<Eigen::Triplet<complex_t>>();
+        triplets.reserve(static_cast<size_t>(h->nonZeros() + h->rows()));
+        auto const h_view = sparse::make_loop(*h);
+        for (auto row = 0; row < h->rows(); ++row) {
+            triplets.emplace_back(row, row, complex_t{0});
+            h_view.for_each_in_row(row, [&](int col, scalar_t value) {
+                auto const v = complex_t{std::real(value), std::imag(value)};
+                triplets.emplace_back(row, col, -v);
+            });
+        }
+
+        auto matrix = ColMajorComplex(h->rows(), h->cols());
+        matrix.setFromTriplets(triplets.begin(), triplets.end()); // duplicates are summed
+        matrix.makeCompressed();
+        return matrix;
+    }
+};
+
+bool same_pattern(ColMajorComplex const& a, ColMajorComplex const& b) {
+    return a.rows() == b.rows() && a.nonZeros() == b.nonZeros()
+           && std::equal(a.outerIndexPtr(), a.outerIndexPtr() + a.outerSize() + 1,
+                         b.outerIndexPtr())
+           && std::equal(a.innerIndexPtr(), a.innerIndexPtr() + a.nonZeros(),
+                         b.innerIndexPtr());
+}
+
+} // anonymous namespace
+
+DirectGreens::DirectGreens(Model const& model, int num_threads)
+    : model(model), num_threads(num_threads) {
+    set_model(model);
+}
+
+void DirectGreens::set_model(Model const& new_model) {
+    model = new_model;
+    auto next = var::apply_visitor(NegativeWithDiagonal{}, model.hamiltonian().get_variant());
+    if (!same_pattern(next, negative_h)) {
+        workers.clear(); // the symbolic analysis is only valid for the old pattern
+    }
+    negative_h = std::move(next);
+
+    auto const size = static_cast<int>(negative_h.cols());
+    diagonal.resize(static_cast<size_t>(size));
+    onsite.resize(size);
+    for (auto col = 0; col < size; ++col) {
+        auto const start = negative_h.outerIndexPtr()[col];
+        auto const end = negative_h.outerIndexPtr()[col + 1];
+        auto const it = std::lower_bound(negative_h.innerIndexPtr() + start,
+                                         negative_h.innerIndexPtr() + end, col);
+        auto const n = static_cast<int>(it - negative_h.innerIndexPtr());
+        diagonal[col] = n;
+        onsite[col] = negative_h.valuePtr()[n];
+    }
+}
+
+ArrayXcd DirectGreens::greens(int row, int col, ArrayXd const& energy, double broadening) {
+    return std::move(greens_block({row}, {col}, energy, broadening).front());
+}
+
+std::vector<ArrayXcd> DirectGreens::greens_vector(int row, std::vector<int> const& cols,
+                                                  ArrayXd const& energy, double broadening) {
+    return greens_block({row}, cols, energy, broadening);
+}
+
+std::vector<ArrayXcd> DirectGreens::greens_block(std::vector<int> const& rows,
+                                                 std::vector<int> const& cols,
+                                                 ArrayXd const& energy, double broadening) {
+    auto const size = static_cast<int>(negative_h.rows());
+    auto const is_valid = [&](int i) { return i >= 0 && i < size; };
+    if (rows.empty() || cols.empty() || !std::all_of(rows.begin(), rows.end(), is_valid)
+        || !std::all_of(cols.begin(), cols.end(), is_valid)) {
+        throw std::invalid_argument("DirectGreens: invalid index value.");
+    }
+    if (broadening <= 0) {
+        throw std::invalid_argument("DirectGreens: the broadening must be positive.");
+    }
+
+    auto const span = trace::Span("DirectGreens::greens_block");
+    calculation_timer.tic();
+    auto const num_rows = static_cast<int>(rows.size());
+    auto const num_cols = static_cast<int>(cols.size());
+    auto const num_energies = static_cast<int>(energy.size());
+    auto results = std::vector<ArrayXcd>(rows.size() * cols.size(), ArrayXcd(num_energies));
+
+    // `(z - H) x = e_row` gives `x[col] = G_{col,row}`
+    MatrixX<complex_t> unit_vectors = MatrixX<complex_t>::Zero(size, num_rows);
+    for (auto i = 0; i < num_rows; ++i) {
+        unit_vectors(rows[i], i) = 1;
+    }
+
+    ThreadPool pool(std::max(1, std::min(num_threads, num_energies)));
+    if (static_cast<int>(workers.size()) < pool.size()) {
+        workers.resize(static_cast<size_t>(pool.size()));
+    }
+    auto analyses = std::vector<int>(static_cast<size_t>(pool.size()), 0);
+    auto errors = std::vector<std::exception_ptr>(static_cast<size_t>(pool.size()));
+    std::atomic<bool> failed{false};
+    pool.run([&](int thread_id) {
+        try {
+            auto& worker = workers[thread_id];
+            if (!worker.lu) {
+                worker.lu = std14::make_unique<LU>();
+            }
+            worker.matrix = negative_h;
+            auto const values = worker.matrix.valuePtr();
+
+            for (auto e = thread_id; e < num_energies && !failed; e += pool.size()) {
+                auto const z = complex_t{energy[e], broadening};
+                for (auto i = 0; i < size; ++i) {
+                    values[diagonal[i]] = z + onsite[i];
+                }
+
+                if (!worker.is_analyzed) {
+                    worker.lu->analyzePattern(worker.matrix);
+                    worker.is_analyzed = true;
+                    ++analyses[thread_id];
+                }
+                worker.lu->factorize(worker.matrix);
+                if (worker.lu->info() != Eigen::Success) {
+                    throw std::runtime_error("DirectGreens: the factorization of `z - H` failed.");
+                }
+
+                MatrixX<complex_t> const x = worker.lu->solve(unit_vectors);
+                for (auto i = 0; i < num_rows; ++i) {
+                    for (auto j = 0; j < num_cols; ++j) {
+                        results[i * num_cols + j][e] = x(cols[j], i);
+                    }
+                }
+            }
+        } catch (...) {
+            errors[thread_id] = std::current_exception();
+            failed = true; // the other threads stop at their next energy
+        }
+    });
+    for (auto const& error : errors) {
+        if (error) { std::rethrow_exception(error); }
+    }
+
+    for (auto n : analyses) { analysis_count += n; }
+    factorization_count += num_energies;
+    calculation_timer.toc();
+    return results;
+}
+
+std::string DirectGreens::report(bool shortform) const {
+    auto const fmt_str = shortform
+        ? "DirectGreens({analyses}|{factorizations})"
+        : "Sparse direct Green's function of {size} sites: {analyses} symbolic analyses, "
+          "{factorizations} numeric factorizations\n"
+          "\nLast calculation completed in";
+    return fmt::format(fmt_str, "size"_a=negative_h.rows(), "analyses"_a=analysis_count,
+                       "factorizations"_a=factorization_count)
+           + " " + calculation_timer.str();
+}
+
+} // namespace cpb
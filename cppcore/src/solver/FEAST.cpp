@@ -3,10 +3,141 @@
 #ifdef CPB_USE_FEAST
 # include "support/format.hpp"
 # include "compute/mkl/wrapper.hpp"
+# include "compute/eigensolver.hpp"
+# include "numeric/random.hpp"
+# include "utils/ThreadPool.hpp"
+# include "support/cppfuture.hpp"
+
+# include <Eigen/Eigenvalues>
+# include <Eigen/QR>
+# include <Eigen/SparseLU>
+# include <algorithm>
+# include <atomic>
+# include <exception>
+# include <iterator>
+# include <limits>
+# include <stdexcept>
 
 using namespace fmt::literals;
 using namespace cpb;
 
+namespace {
+    constexpr auto pi = 3.14159265358979323846; // `constant::pi` is only single precision
+
+    /// Gauss-Legendre quadrature nodes and weights on [-1, 1]
+    void gauss_legendre(int n, ArrayXd& nodes, ArrayXd& weights) {
+        nodes.resize(n);
+        weights.resize(n);
+        for (auto i = 0; i < n; ++i) {
+            auto x = std::cos(pi * (i + 0.75) / (n + 0.5));
+            auto derivative = 1.0;
+            for (auto iteration = 0; iteration < 100; ++iteration) {
+                // Legendre recurrence: `p1` ends up as P_n(x) and `p0` as P_{n-1}(x)
+                auto p0 = 1.0;
+                auto p1 = x;
+                for (auto k = 2; k <= n; ++k) {
+                    auto const p2 = ((2 * k - 1) * x * p1 - (k - 1) * p0) / k;
+                    p0 = p1;
+                    p1 = p2;
+                }
+                derivative = n * (x * p1 - p0) / (x * x - 1);
+                auto const dx = p1 / derivative;
+                x -= dx;
+                if (std::abs(dx) < 1e-15) { break; }
+            }
+            nodes[i] = x;
+            weights[i] = 2 / ((1 - x * x) * derivative * derivative);
+        }
+    }
+
+    template<class complex_t>
+    struct ContourPoint {
+        complex_t z; ///< where the resolvent `(z - H)^-1` is evaluated
+        complex_t weight; ///< of the resolvent in the projector sum
+    };
+
+    /**
+     Quadrature of the projector `1/(2 pi i) \oint (z - H)^-1 dz` on the circle through
+     `emin` and `emax`. For a real Hamiltonian the lower half of the circle is the complex
+     conjugate of the upper half so only the upper points are needed (and the real part is
+     taken at the end). A complex Hamiltonian needs both halves.
+     */
+    template<class complex_t>
+    std::vector<ContourPoint<complex_t>> contour(double emin, double emax, int num_points,
+                                                 bool full_circle) {
+        auto nodes = ArrayXd();
+        auto weights = ArrayXd();
+        gauss_legendre(num_points, nodes, weights);
+
+        auto const center = 0.5 * (emin + emax);
+        auto const radius = 0.5 * (emax - emin);
+        auto points = std::vector<ContourPoint<complex_t>>();
+        for (auto k = 0; k < num_points; ++k) {
+            auto const theta = 0.5 * pi * (1 + nodes[k]);
+            auto const phase = std::polar(1.0, theta);
+            if (!full_circle) {
+                points.push_back({complex_t(center + radius * phase),
+                                  complex_t(0.5 * radius * weights[k] * phase)});
+            } else {
+                for (auto const p : {phase, std::conj(phase)}) {
+                    points.push_back({complex_t(center + radius * p),
+                                      complex_t(0.25 * radius * weights[k] * p)});
+                }
+            }
+        }
+        return points;
+    }
+
+    /// The projected subspace in the scalar type of the Hamiltonian
+    template<class real_t>
+    MatrixX<real_t> from_complex(MatrixX<std::complex<real_t>> const& m, real_t) {
+        return m.real();
+    }
+    template<class real_t>
+    MatrixX<std::complex<real_t>> from_complex(MatrixX<std::complex<real_t>> const& m,
+                                               std::complex<real_t>) {
+        return m;
+    }
+
+    template<class scalar_t>
+    void orthonormalize(MatrixX<scalar_t>& x) {
+        auto const qr = Eigen::HouseholderQR<MatrixX<scalar_t>>(x);
+        x = qr.householderQ() * MatrixX<scalar_t>::Identity(x.rows(), x.cols());
+    }
+} // anonymous namespace
+
+void FEASTSweep::store(int index, ArrayXXcd subspace) {
+    std::lock_guard<std::mutex> lock(mutex);
+    subspaces[index] = std::move(subspace);
+    while (static_cast<int>(subspaces.size()) > std::max(capacity, 1)) {
+        auto const first = subspaces.begin();
+        auto const last = std::prev(subspaces.end());
+        subspaces.erase(index - first->first > last->first - index ? first : last);
+    }
+}
+
+ArrayXXcd FEASTSweep::nearest(int index) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (subspaces.empty()) {
+        return {};
+    }
+
+    auto const above = subspaces.lower_bound(index);
+    if (above == subspaces.begin()) {
+        return above->second;
+    }
+    auto const below = std::prev(above);
+    if (above == subspaces.end() || index - below->first <= above->first - index) {
+        return below->second;
+    }
+    return above->second;
+}
+
+int FEASTSweep::size() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return static_cast<int>(subspaces.size());
+}
+
 template<class scalar_t>
 void FEAST<scalar_t>::solve() {
     // size of the matrix
@@ -15,11 +146,14 @@ void FEAST<scalar_t>::solve() {
     info.recycle_warning = false;
     info.recycle_warning_loops = 0;
     info.size_warning = false;
+
+    // a sweep point without data of its own starts from its nearest neighbour's subspace
+    auto const from_sweep = config.sweep && _eigenvalues.size() == 0 && load_sweep_subspace();
     
     // call the solver
     call_feast();
     
-    if (config.recycle_subspace) {
+    if (config.recycle_subspace || from_sweep) {
         // check for errors in case of recycled subspace
         while (info.refinement_loops >= config.max_refinement_loops || info.return_code == 3) {
             // refinement loop count is greater than allowed or subspace is too small
@@ -65,6 +199,20 @@ void FEAST<scalar_t>::solve() {
     info.max_residual = residual.head(info.final_size).maxCoeff();
     if (info.recycle_warning)
         info.refinement_loops += info.recycle_warning_loops;
+
+    if (config.sweep && info.final_size > 0) {
+        using complex_double = std::complex<double>;
+        config.sweep->store(config.sweep_index, _eigenvectors.template cast<complex_double>());
+    }
+
+    if (stream) {
+        stream->reset(config.system_size);
+        stream->add(_eigenvalues.head(info.final_size),
+                    _eigenvectors.leftCols(info.final_size));
+        if (!config.recycle_subspace) { // the next solve would need them as the initial guess
+            _eigenvectors.resize(0, 0);
+        }
+    }
 }
 
 template<class scalar_t>
@@ -117,6 +265,27 @@ void FEAST<scalar_t>::force_clear()
     residual.resize(0);
 }
 
+template<class scalar_t>
+bool FEAST<scalar_t>::load_sweep_subspace() {
+    auto const subspace = config.sweep->nearest(config.sweep_index);
+    if (subspace.rows() != config.system_size || subspace.cols() == 0) {
+        return false; // nothing computed yet or a differently sized system
+    }
+
+    auto const size = static_cast<int>(subspace.cols());
+    _eigenvectors.resize(subspace.rows(), size);
+    for (auto j = 0; j < size; ++j) {
+        for (auto i = 0; i < subspace.rows(); ++i) {
+            _eigenvectors(i, j) = num::complex_cast<scalar_t>(subspace(i, j));
+        }
+    }
+    // a non-empty `_eigenvalues` marks the subspace as recyclable, see `init_feast()`
+    _eigenvalues.setZero(size);
+    residual.setZero(size);
+    info.suggested_size = size;
+    return true;
+}
+
 template<class scalar_t>
 void FEAST<scalar_t>::init_feast()
 {
@@ -125,7 +294,7 @@ void FEAST<scalar_t>::init_feast()
     
     // the subspace can only be recycled if we actually have data to recycle
     int can_recycle = (_eigenvalues.size() != 0) ? 1 : 0;
-    fpm[4] = config.recycle_subspace ? can_recycle : 0;
+    fpm[4] = (config.recycle_subspace || config.sweep) ? can_recycle : 0;
     
     fpm[1] = config.contour_points;
     fpm[2] = config.dp_stop_criteria;
@@ -200,7 +369,11 @@ void FEAST<scalar_t>::call_feast()
         _eigenvectors.resize(config.system_size, config.initial_size_guess);
 
     // solve real or complex Hamiltonian
-    call_feast_impl();
+    if (config.num_threads > 1) {
+        call_contour_parallel();
+    } else {
+        call_feast_impl();
+    }
 }
 
 template<class scalar_t>
@@ -239,6 +412,153 @@ void FEAST<scalar_t>::call_feast_impl() {
     );
 }
 
+/**
+ The same FEAST iteration as MKL's driver, but the contour points are spread over a pool
+ of threads. MKL's high-level driver solves the points one after another, so here each
+ point gets its own sparse LU factorization of `z - H` which is computed concurrently in
+ the first refinement loop and reused by the following ones. Each thread sums the
+ projections of its points and the partial sums are added up at the end.
+ */
+template<class scalar_t>
+void FEAST<scalar_t>::call_contour_parallel() {
+    using ComplexMatrix = MatrixX<complex_t>;
+    using ColMajorComplex = Eigen::SparseMatrix<complex_t, Eigen::ColMajor, int>;
+    using LU = Eigen::SparseLU<ColMajorComplex>;
+
+    auto const size = config.system_size;
+    auto const m0 = static_cast<int>(_eigenvectors.cols());
+    auto const& h = *hamiltonian;
+    auto const points = contour<complex_t>(config.energy_min, config.energy_max,
+                                           config.contour_points, num::is_complex<scalar_t>());
+    auto const num_points = static_cast<int>(points.size());
+
+    auto y = MatrixX<scalar_t>();
+    if (fpm[4] == 1) {
+        y = _eigenvectors.matrix();
+    } else {
+        y = num::make_random<MatrixX<scalar_t>>(size, m0);
+        y.array() -= scalar_t{0.5};
+    }
+
+    ColMajorComplex const h_complex = h.template cast<complex_t>();
+    auto identity = ColMajorComplex(size, size);
+    identity.setIdentity();
+
+    ThreadPool pool(std::min(config.num_threads, num_points));
+    auto factors = std::vector<std::unique_ptr<LU>>(num_points);
+    auto partial = std::vector<ComplexMatrix>(pool.size());
+
+    auto const exponent = std::is_same<real_t, float>::value ? config.sp_stop_criteria
+                                                             : config.dp_stop_criteria;
+    auto const tolerance = std::pow(10.0, -exponent);
+    auto const scale = std::max({std::abs(config.energy_min), std::abs(config.energy_max),
+                                 std::numeric_limits<double>::min()});
+    auto previous_trace = 0.0;
+
+    auto eigen = Eigen::SelfAdjointEigenSolver<MatrixX<scalar_t>>();
+    for (info.refinement_loops = 1; ; ++info.refinement_loops) {
+        ComplexMatrix const y_complex = y.template cast<complex_t>();
+        auto errors = std::vector<std::exception_ptr>(static_cast<size_t>(pool.size()));
+        std::atomic<bool> failed{false};
+        pool.run([&](int thread_id) {
+            try {
+                compute::set_local_lapack_threads(1); // the threads are already saturated
+                partial[thread_id].setZero(size, m0);
+                for (auto k = thread_id; k < num_points && !failed; k += pool.size()) {
+                    auto& lu = factors[k];
+                    if (!lu) {
+                        lu = std14::make_unique<LU>();
+                        ColMajorComplex const shifted = points[k].z * identity - h_complex;
+                        lu->compute(shifted);
+                    }
+                    if (lu->info() != Eigen::Success) {
+                        throw std::runtime_error{"FEAST: factorization failed at a contour point."};
+                    }
+                    ComplexMatrix const x = lu->solve(y_complex);
+                    partial[thread_id] += points[k].weight * x;
+                }
+            } catch (...) {
+                errors[thread_id] = std::current_exception();
+                failed = true; // the other threads stop at their next contour point
+            }
+        });
+        for (auto const& error : errors) {
+            if (error) { std::rethrow_exception(error); }
+        }
+
+        for (auto t = 1; t < pool.size(); ++t) {
+            partial[0] += partial[t];
+        }
+        MatrixX<scalar_t> q = from_complex(partial[0], scalar_t{});
+        orthonormalize(q);
+
+        // Rayleigh-Ritz: the eigenvalues are sorted so those inside the window are contiguous
+        MatrixX<scalar_t> const hq = h * q;
+        eigen.compute(q.adjoint() * hq);
+        auto const& values = eigen.eigenvalues();
+        y = q * eigen.eigenvectors();
+        MatrixX<scalar_t> const hy = hq * eigen.eigenvectors();
+
+        auto first = -1;
+        auto num_inside = 0;
+        auto trace = 0.0;
+        auto max_residual = 0.0;
+        residual.setZero(m0);
+        for (auto i = 0; i < m0; ++i) {
+            auto const r = (hy.col(i) - values[i] * y.col(i)).norm() / scale;
+            residual[i] = static_cast<real_t>(r);
+            if (values[i] >= config.energy_min && values[i] <= config.energy_max) {
+                if (first < 0) { first = i; }
+                ++num_inside;
+                trace += values[i];
+                max_residual = std::max(max_residual, r);
+            }
+        }
+
+        // the eigenpairs inside the window go first, the rest are kept for recycling
+        if (num_inside > 0) {
+            auto order = std::vector<int>();
+            for (auto i = first; i < first + num_inside; ++i) { order.push_back(i); }
+            for (auto i = 0; i < m0; ++i) {
+                if (i < first || i >= first + num_inside) { order.push_back(i); }
+            }
+            auto const sorted_residual = residual;
+            for (auto i = 0; i < m0; ++i) {
+                _eigenvalues[i] = values[order[i]];
+                _eigenvectors.col(i) = y.col(order[i]);
+                residual[i] = sorted_residual[order[i]];
+            }
+        } else {
+            _eigenvalues = values;
+            _eigenvectors = y;
+        }
+        y = _eigenvectors.matrix();
+
+        info.final_size = num_inside;
+        info.error_trace = static_cast<real_t>(
+            std::abs(trace - previous_trace) / std::max(std::abs(trace), scale)
+        );
+        previous_trace = trace;
+
+        auto const is_converged = config.residual_convergence
+                                  ? num_inside > 0 && max_residual < tolerance
+                                  : info.refinement_loops > 1 && info.error_trace < tolerance;
+        if (num_inside == 0) {
+            info.return_code = 1; // no eigenvalues found in the given energy range
+            break;
+        } else if (num_inside == m0 && m0 < size) {
+            info.return_code = 3; // subspace guess M0 is too small
+            break;
+        } else if (is_converged) {
+            info.return_code = 0;
+            break;
+        } else if (info.refinement_loops >= config.max_refinement_loops) {
+            info.return_code = 2; // no convergence
+            break;
+        }
+    }
+}
+
 template class cpb::FEAST<float>;
 template class cpb::FEAST<std::complex<float>>;
 template class cpb::FEAST<double>;
@@ -0,0 +1,254 @@
+#include "solver/Lanczos.hpp"
+
+#include "compute/linear_algebra.hpp"
+#include "numeric/random.hpp"
+#include "support/format.hpp"
+
+#include <Eigen/Eigenvalues>
+#include <algorithm>
+#include <numeric>
+
+using namespace fmt::literals;
+
+namespace cpb {
+
+namespace {
+    /// Orthogonalize `w` against the first `size` columns of `basis`, twice for stability.
+    /// Returns the projection of `w` on the last column (the first pass is dominant).
+    template<class Matrix, class Vector>
+    typename Vector::Scalar orthogonalize(Matrix const& basis, int size, Vector& w) {
+        auto projection = typename Vector::Scalar{0};
+        for (auto pass = 0; pass < 2; ++pass) {
+            auto const v = basis.leftCols(size);
+            Vector const h = v.adjoint() * w;
+            w -= v * h;
+            projection += h[size - 1];
+        }
+        return projection;
+    }
+} // anonymous namespace
+
+template<class scalar_t>
+Lanczos<scalar_t>::Lanczos(SparseMatrixRC<scalar_t> h, Config const& config)
+    : hamiltonian(std::move(h)), config(config) {
+    if (config.num_threads < 1) {
+        throw std::invalid_argument("Lanczos: The number of threads must be at least 1.");
+    }
+    if (config.num_threads > 1) {
+        thread_pool = std14::make_unique<ThreadPool>(config.num_threads);
+    }
+}
+
+template<class scalar_t>
+bool Lanczos<scalar_t>::change_hamiltonian(Hamiltonian const& h) {
+    if (!ham::is<scalar_t>(h)) {
+        return false;
+    }
+
+    hamiltonian = ham::get_shared_ptr<scalar_t>(h);
+    _eigenvalues.resize(0);
+    _eigenvectors.resize(0, 0);
+    return true;
+}
+
+template<class scalar_t>
+void Lanczos<scalar_t>::prepare_operator() {
+    auto const size = static_cast<int>(hamiltonian->rows());
+    tmp.resize(size);
+    if (config.mode != LanczosMode::ShiftInvert) {
+        return;
+    }
+
+    auto identity = ColMajorSparse(size, size);
+    identity.setIdentity();
+    ColMajorSparse const shifted = ColMajorSparse(*hamiltonian)
+                                   - static_cast<real_t>(config.sigma) * identity;
+    lu.compute(shifted);
+    if (lu.info() != Eigen::Success) {
+        throw std::runtime_error("Lanczos: The shifted matrix (H - sigma) is singular. "
+                                 "Try a slightly different sigma.");
+    }
+}
+
+template<class scalar_t>
+void Lanczos<scalar_t>::spmv(VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    if (!thread_pool) {
+        compute::matrix_vector_mul(*hamiltonian, x, y);
+        return;
+    }
+
+    y.resize(x.size());
+    auto const& h = *hamiltonian;
+    thread_pool->parallel_for(0, static_cast<int>(h.rows()), [&](int, int start, int end) {
+        y.segment(start, end - start) = h.middleRows(start, end - start) * x;
+    });
+}
+
+template<class scalar_t>
+void Lanczos<scalar_t>::apply(VectorX<scalar_t> const& x, VectorX<scalar_t>& y) {
+    auto const sigma = scalar_t{static_cast<real_t>(config.sigma)};
+    if (config.mode == LanczosMode::ShiftInvert) {
+        y = lu.solve(x);
+    } else {
+        spmv(x, tmp);
+        tmp -= sigma * x;
+        spmv(tmp, y);
+        y -= sigma * tmp;
+    }
+    ++info.operations;
+}
+
+template<class scalar_t>
+void Lanczos<scalar_t>::solve() {
+    auto const size = static_cast<int>(hamiltonian->rows());
+    auto const k = config.num_eigenvalues;
+    if (k < 1 || k >= size) {
+        throw std::invalid_argument("Lanczos: The number of eigenvalues must be between 1 and "
+                                    "the size of the Hamiltonian minus 1.");
+    }
+
+    auto const m = std::min(config.subspace_size > 0 ? config.subspace_size
+                                                     : std::max(2 * k + 1, 20), size);
+    if (m <= k) {
+        throw std::invalid_argument("Lanczos: The subspace must be larger than the number of "
+                                    "eigenvalues.");
+    }
+    auto const tolerance = config.tolerance > 0
+                           ? static_cast<real_t>(config.tolerance)
+                           : std::sqrt(std::numeric_limits<real_t>::epsilon());
+
+    info = Info();
+    info.subspace_size = m;
+    prepare_operator();
+
+    // The eigenvalues closest to sigma are the largest in magnitude for shift-invert and
+    // the smallest for the folded spectrum: `score` puts the wanted ones in front
+    auto const score = [&](real_t theta) {
+        return config.mode == LanczosMode::ShiftInvert ? std::abs(theta) : -theta;
+    };
+
+    auto basis = MatrixX<scalar_t>(size, m + 1);
+    VectorX<scalar_t> start = num::make_random<VectorX<scalar_t>>(size);
+    basis.col(0) = start.normalized();
+    auto tridiagonal = MatrixX<real_t>{MatrixX<real_t>::Zero(m, m)};
+
+    auto x = VectorX<scalar_t>(size);
+    auto w = VectorX<scalar_t>(size);
+    auto last_beta = real_t{0};
+    auto solver = Eigen::SelfAdjointEigenSolver<MatrixX<real_t>>();
+    auto order = std::vector<int>(m);
+
+    for (auto num_kept = 0; ; ++info.restarts) {
+        for (auto j = num_kept; j < m; ++j) {
+            x = basis.col(j);
+            apply(x, w);
+            auto const alpha = std::real(orthogonalize(basis, j + 1, w));
+            auto beta = w.norm();
+
+            tridiagonal(j, j) = alpha;
+            if (beta <= std::numeric_limits<real_t>::epsilon() * std::abs(alpha)) {
+                // Invariant subspace: continue with a new random direction
+                w = num::make_random<VectorX<scalar_t>>(size);
+                orthogonalize(basis, j + 1, w);
+                beta = 0;
+                basis.col(j + 1) = w.normalized();
+            } else {
+                basis.col(j + 1) = w / beta;
+            }
+
+            if (j + 1 < m) {
+                tridiagonal(j, j + 1) = tridiagonal(j + 1, j) = beta;
+            }
+            last_beta = beta;
+        }
+
+        solver.compute(tridiagonal);
+        auto const& theta = solver.eigenvalues();
+        auto const& y = solver.eigenvectors();
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            return score(theta[a]) > score(theta[b]);
+        });
+
+        // The residual is relative to the largest Ritz value (an estimate of the operator
+        // norm): a wanted value of the folded operator goes to zero when sigma is exactly
+        // on an eigenvalue, e.g. a zero mode
+        auto const norm_estimate = std::max(theta.cwiseAbs().maxCoeff(), real_t{1e-30f});
+        auto const is_converged = std::all_of(order.begin(), order.begin() + k, [&](int i) {
+            auto const residual = std::abs(last_beta * y(m - 1, i));
+            return residual <= tolerance * std::max(std::abs(theta[i]), norm_estimate);
+        });
+        if (is_converged) {
+            break;
+        }
+        if (info.restarts >= config.max_restarts) {
+            throw std::runtime_error("Lanczos: Failed to converge within the maximum number "
+                                     "of restarts.");
+        }
+
+        // Thick restart: keep the best Ritz vectors and continue from the residual vector
+        num_kept = std::min(k + (m - k) / 2, m - 1);
+        auto kept = MatrixX<real_t>(m, num_kept);
+        for (auto i = 0; i < num_kept; ++i) {
+            kept.col(i) = y.col(order[i]);
+        }
+        MatrixX<scalar_t> const ritz = basis.leftCols(m) * kept.template cast<scalar_t>();
+        basis.leftCols(num_kept) = ritz;
+        basis.col(num_kept) = basis.col(m);
+
+        tridiagonal.setZero();
+        for (auto i = 0; i < num_kept; ++i) {
+            tridiagonal(i, i) = theta[order[i]];
+            tridiagonal(i, num_kept) = tridiagonal(num_kept, i) = last_beta * kept(m - 1, i);
+        }
+    }
+
+    // Final eigenpairs: Rayleigh quotients of the Hamiltonian, sorted by energy
+    auto const& y = solver.eigenvectors();
+    auto vectors = MatrixX<scalar_t>(size, k);
+    auto values = ArrayX<real_t>(k);
+    for (auto i = 0; i < k; ++i) {
+        x = basis.leftCols(m) * y.col(order[i]).template cast<scalar_t>();
+        x.normalize();
+        spmv(x, w);
+        values[i] = std::real(x.dot(w));
+        info.max_residual = std::max(info.max_residual, (w - scalar_t{values[i]} * x).norm());
+        vectors.col(i) = x;
+    }
+
+    auto sorted = std::vector<int>(k);
+    std::iota(sorted.begin(), sorted.end(), 0);
+    std::sort(sorted.begin(), sorted.end(), [&](int a, int b) { return values[a] < values[b]; });
+    _eigenvalues.resize(k);
+    for (auto i = 0; i < k; ++i) {
+        _eigenvalues[i] = values[sorted[i]];
+    }
+
+    if (stream) {
+        stream->reset(size);
+        stream->add(values, vectors);
+        _eigenvectors.resize(0, 0);
+    } else {
+        _eigenvectors.resize(size, k);
+        for (auto i = 0; i < k; ++i) {
+            _eigenvectors.col(i) = vectors.col(sorted[i]);
+        }
+    }
+}
+
+template<class scalar_t>
+std::string Lanczos<scalar_t>::report(bool shortform) const {
+    auto const fmt_str = shortform
+        ? "Lanczos({num}|{subspace}|{restarts}|{residual:.2e})"
+        : "Found {num} eigenvalues near {sigma} with a subspace of {subspace}\n"
+          "Converged after {restarts} restart(s) and {ops} operations\n"
+          "Max. residual: {residual:.2e}\n"
+          "\nCompleted in";
+    return fmt::format(fmt_str, "num"_a=_eigenvalues.size(), "sigma"_a=config.sigma,
+                       "subspace"_a=info.subspace_size, "restarts"_a=info.restarts,
+                       "ops"_a=info.operations, "residual"_a=info.max_residual);
+}
+
+CPB_INSTANTIATE_TEMPLATE_CLASS(Lanczos)
+
+} // namespace cpb
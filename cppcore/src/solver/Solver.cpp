@@ -1,42 +1,133 @@
 #include "solver/Solver.hpp"
+#include "utils/ThreadPool.hpp"
+#include "utils/Trace.hpp"
+#include "support/simd.hpp"
+
+#include <algorithm>
 
 namespace cpb { namespace compute {
 
+/// Gaussian terms further than this many broadenings from the target energy are dropped:
+/// exp(-0.5 * 8^2) is ~1e-14, below the precision of the result
+constexpr auto gaussian_cutoff = 8.0f;
+
 struct CalcDOS {
     ArrayXf const& target_energies;
     float broadening;
+    int num_threads;
 
     template<class Array>
     ArrayXd operator()(Array En) {
+        using real_t = typename Array::Scalar;
         auto const scale = 1 / (broadening * sqrt(2 * constant::pi));
         auto const constant = -0.5f / pow(broadening, 2);
+        auto const reach = gaussian_cutoff * broadening;
+
+        // With sorted eigenvalues, each target energy only needs the ones within `reach`.
+        // This is effectively binning: a narrow broadening touches just a few eigenvalues.
+        ArrayX<real_t> sorted = En;
+        std::sort(sorted.data(), sorted.data() + sorted.size());
+        auto const begin = sorted.data();
+        auto const end = sorted.data() + sorted.size();
 
         // DOS(E) = 1 / (broadening * sqrt(2pi)) * sum(exp(-0.5 * (En-E)^2 / broadening^2))
-        ArrayXd dos(target_energies.size());
-        transform(target_energies, dos, [&](float E) {
-            auto gaussian = exp((En - E).square() * constant);
-            return scale * sum(gaussian);
+        auto const num_energies = static_cast<int>(target_energies.size());
+        ArrayXd dos(num_energies);
+        ThreadPool pool(std::max(1, std::min(num_threads, num_energies)));
+        pool.run([&](int thread_id) {
+            // Interleaved energies: a dense part of the spectrum may sit in one energy range
+            for (auto i = thread_id; i < num_energies; i += pool.size()) {
+                auto const E = target_energies[i];
+                auto const first = std::lower_bound(begin, end, static_cast<real_t>(E - reach));
+                auto const last = std::upper_bound(first, end, static_cast<real_t>(E + reach));
+                auto const window = sorted.segment(first - begin, last - first);
+                dos[i] = scale * sum(exp((window - E).square() * constant));
+            }
         });
         return dos;
     }
 };
 
+/**
+ Add `w * |x|^2` to `acc` in [start, end)
+
+ Complex vectors are passed as interleaved real and imaginary parts so the squares of both
+ go into neighbouring elements of `acc`. The caller adds up the pairs at the end.
+ */
+template<class real_t>
+void add_weighted_abs2(real_t* acc, real_t const* x, real_t w, int start, int end) {
+    using simd_register_t = simd::select_vector_t<real_t>;
+    auto const w_vec = simd::make_float<simd_register_t>(w);
+
+    auto const loop = simd::split_loop(acc, start, end);
+    for (auto i = loop.start; i < loop.peel_end; ++i) {
+        acc[i] += w * x[i] * x[i];
+    }
+    for (auto i = loop.peel_end; i < loop.vec_end; i += loop.step) {
+        auto const a = simd::load_u<simd_register_t>(x + i);
+        auto const r = simd::load<simd_register_t>(acc + i);
+        simd_register_t const wa = a * w_vec;
+        simd::store(acc + i, simd::madd_rc<real_t>(wa, a, r));
+    }
+    for (auto i = loop.vec_end; i < loop.end; ++i) {
+        acc[i] += w * x[i] * x[i];
+    }
+}
+
 struct CalcSpatialLDOS {
     float target_energy;
     float broadening;
+    int num_threads;
 
     template<class Array1D, class Array2D>
     ArrayXd operator()(Array1D En, Array2D psi) {
-        using scalar_t = typename Array1D::Scalar;
+        using real_t = typename Array1D::Scalar;
+        using scalar_t = typename Array2D::Scalar;
         auto const scale = 1 / (broadening * sqrt(2 * constant::pi));
         auto const constant = -0.5f / pow(broadening, 2);
+        auto const reach = gaussian_cutoff * broadening;
+
+        // The Gaussian weights don't depend on the site: compute them once and only keep
+        // the eigenstates which are close enough to the target energy to contribute
+        auto states = std::vector<int>();
+        auto weights = std::vector<real_t>();
+        for (auto n = 0; n < En.size(); ++n) {
+            auto const delta = En[n] - target_energy;
+            if (std::abs(delta) <= reach) {
+                states.push_back(n);
+                weights.push_back(static_cast<real_t>(scale * std::exp(delta * delta * constant)));
+            }
+        }
 
         // DOS(r) = 1 / (b * sqrt(2pi)) * sum(|psi(r)|^2 * exp(-0.5 * (En-E)^2 / b^2))
-        ArrayXd ldos(psi.rows());
-        for (auto i = 0; i < ldos.size(); ++i) {
-            ArrayX<scalar_t> psi2 = psi.row(i).abs2();
-            auto gaussian = exp((En - target_energy).square() * constant);
-            ldos[i] = scale * sum(psi2 * gaussian);
+        // Complex scalars are handled as twice as many real numbers, see `add_weighted_abs2`
+        constexpr auto k = static_cast<int>(sizeof(scalar_t) / sizeof(real_t));
+        auto const num_sites = static_cast<int>(psi.rows());
+        auto const data = reinterpret_cast<real_t const*>(psi.data());
+        ArrayX<real_t> acc = ArrayX<real_t>::Zero(k * num_sites);
+
+        // Split the sites between threads and go over the states in tiles
+        // of sites which are small enough for `acc` to stay in cache
+        constexpr auto tile_size = 2048;
+        ThreadPool pool(num_threads);
+        pool.parallel_for(0, num_sites, [&](int, int start, int end) {
+            for (auto tile_start = start; tile_start < end; tile_start += tile_size) {
+                auto const tile_end = std::min(tile_start + tile_size, end);
+                for (auto j = size_t{0}; j < states.size(); ++j) {
+                    auto const column = data + std::ptrdiff_t{k} * num_sites * states[j];
+                    add_weighted_abs2(acc.data(), column, weights[j],
+                                      k * tile_start, k * tile_end);
+                }
+            }
+        });
+
+        ArrayXd ldos(num_sites);
+        for (auto i = 0; i < num_sites; ++i) {
+            auto value = real_t{0};
+            for (auto j = 0; j < k; ++j) {
+                value += acc[k * i + j];
+            }
+            ldos[i] = value;
         }
         return ldos;
     }
@@ -60,13 +151,25 @@ void BaseSolver::set_model(Model const& new_model) {
 
     if (!strategy) { // creates a SolverStrategy with a scalar type suited to the Hamiltonian
         strategy = make_strategy(model.hamiltonian());
+        strategy->set_stream(ldos_stream.get());
+    }
+}
+
+void BaseSolver::stream_spatial_ldos(ArrayXf energies, float broadening) {
+    is_solved = false;
+    if (energies.size() != 0) {
+        ldos_stream = std14::make_unique<SpatialLDOSStream>(std::move(energies), broadening);
+    } else {
+        ldos_stream.reset();
     }
+    strategy->set_stream(ldos_stream.get());
 }
 
 void BaseSolver::solve() {
     if (is_solved)
         return;
 
+    auto const span = trace::Span("Solver::solve");
     calculation_timer.tic();
     strategy->solve();
     calculation_timer.toc();
@@ -80,18 +183,34 @@ RealArrayConstRef BaseSolver::eigenvalues() {
 }
 
 ComplexArrayConstRef BaseSolver::eigenvectors() {
+    if (ldos_stream) {
+        throw std::runtime_error("The eigenvectors were not kept because the spatial LDOS "
+                                 "is being streamed, see `stream_spatial_ldos()`.");
+    }
     solve();
     return strategy->eigenvectors();
 }
 
-ArrayXd BaseSolver::calc_dos(ArrayXf target_energies, float broadening) {
-    return num::match<ArrayX>(eigenvalues(), compute::CalcDOS{target_energies, broadening});
+ArrayXd BaseSolver::calc_dos(ArrayXf target_energies, float broadening, int num_threads) {
+    return num::match<ArrayX>(eigenvalues(),
+                              compute::CalcDOS{target_energies, broadening, num_threads});
 }
 
-ArrayXd BaseSolver::calc_spatial_ldos(float target_energy, float broadening) {
+ArrayXd BaseSolver::calc_spatial_ldos(float target_energy, float broadening,
+                                      int num_threads) {
+    if (ldos_stream) {
+        auto const column = ldos_stream->find(target_energy, broadening);
+        if (column < 0) {
+            throw std::runtime_error("The spatial LDOS is streamed only for the energies and "
+                                     "broadening given to `stream_spatial_ldos()`.");
+        }
+        solve();
+        return ldos_stream->get().col(column);
+    }
+
     return num::match2sp<ArrayX, ArrayXX>(
         eigenvalues(), eigenvectors(),
-        compute::CalcSpatialLDOS{target_energy, broadening}
+        compute::CalcSpatialLDOS{target_energy, broadening, num_threads}
     );
 }
 
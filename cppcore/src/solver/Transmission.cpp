@@ -0,0 +1,226 @@
+#include "solver/Transmission.hpp"
+#include "leads/SelfEnergy.hpp"
+#include "utils/ThreadPool.hpp"
+
+#include <Eigen/LU>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace cpb {
+
+TransportSlices::TransportSlices(System const& system, std::vector<int> const& from,
+                                 std::vector<int> const& to)
+    : slice_of(ArrayXi::Constant(system.num_sites(), -1)),
+      local_index(ArrayXi::Constant(system.num_sites(), -1)) {
+    // Both directions of the triangular hoppings: a plain CSR adjacency structure
+    auto const num_sites = system.num_sites();
+    auto const& hoppings = system.hoppings;
+    auto const counts = nonzeros_per_row(hoppings);
+    auto adjacency_ptr = std::vector<int>(num_sites + 1, 0);
+    for (auto i = 0; i < num_sites; ++i) {
+        adjacency_ptr[i + 1] = adjacency_ptr[i] + counts[i];
+    }
+    auto adjacency = std::vector<int>(adjacency_ptr.back());
+    auto cursor = std::vector<int>(adjacency_ptr.begin(), adjacency_ptr.end() - 1);
+    for (auto i = 0; i < num_sites; ++i) {
+        for (auto n = hoppings.outerIndexPtr()[i]; n < hoppings.outerIndexPtr()[i + 1]; ++n) {
+            auto const j = hoppings.innerIndexPtr()[n];
+            adjacency[cursor[i]++] = j;
+            adjacency[cursor[j]++] = i;
+        }
+    }
+
+    auto is_target = ArrayX<bool>::Constant(num_sites, false).eval();
+    for (auto i : to) { is_target[i] = true; }
+
+    auto layer = std::vector<int>();
+    for (auto i : from) {
+        if (slice_of[i] < 0) {
+            slice_of[i] = 0;
+            layer.push_back(i);
+        }
+    }
+
+    // Once a layer touches the `to` lead, all the remaining sites go into that layer
+    auto last_slice = -1;
+    for (auto k = 0; !layer.empty(); ++k) {
+        auto const slice = (last_slice >= 0) ? last_slice : k;
+        if (slice == static_cast<int>(sites.size())) {
+            sites.emplace_back();
+        }
+        for (auto i : layer) {
+            slice_of[i] = slice;
+            local_index[i] = static_cast<int>(sites[slice].size());
+            sites[slice].push_back(i);
+        }
+        if (last_slice < 0 && std::any_of(layer.begin(), layer.end(),
+                                          [&](int i) { return is_target[i]; })) {
+            last_slice = slice;
+        }
+
+        auto next = std::vector<int>();
+        for (auto i : layer) {
+            for (auto n = adjacency_ptr[i]; n < adjacency_ptr[i + 1]; ++n) {
+                auto const j = adjacency[n];
+                if (slice_of[j] < 0) {
+                    slice_of[j] = k + 1; // only marks it as visited, the slice is set above
+                    next.push_back(j);
+                }
+            }
+        }
+        layer.swap(next);
+    }
+
+    if (std::any_of(to.begin(), to.end(), [&](int i) { return slice_of[i] < 0; })) {
+        throw std::runtime_error("calc_transmission: the leads are not connected "
+                                 "through the system");
+    }
+}
+
+int TransportSlices::max_width() const {
+    auto result = 0;
+    for (auto const& s : sites) {
+        result = std::max(result, static_cast<int>(s.size()));
+    }
+    return result;
+}
+
+namespace {
+
+using complex_t = std::complex<double>;
+using Matrix = MatrixX<complex_t>;
+
+/// The dense blocks of a block tridiagonal Hamiltonian
+struct SliceBlocks {
+    std::vector<Matrix> diagonal; ///< H_kk
+    std::vector<Matrix> upper; ///< H_k,k+1 (the lower blocks are the adjoints)
+};
+
+struct MakeBlocks {
+    TransportSlices const& slices;
+
+    template<class scalar_t>
+    SliceBlocks operator()(SparseMatrixRC<scalar_t> const& h) const {
+        auto const num_slices = slices.size();
+        auto blocks = SliceBlocks();
+        for (auto k = 0; k < num_slices; ++k) {
+            auto const n = static_cast<int>(slices.sites[k].size());
+            blocks.diagonal.push_back(Matrix::Zero(n, n));
+            if (k + 1 < num_slices) {
+                auto const m = static_cast<int>(slices.sites[k + 1].size());
+                blocks.upper.push_back(Matrix::Zero(n, m));
+            }
+        }
+
+        auto const indptr = h->outerIndexPtr();
+        auto const indices = h->innerIndexPtr();
+        auto const data = h->valuePtr();
+        for (auto k = 0; k < num_slices; ++k) {
+            for (auto i : slices.sites[k]) {
+                auto const row = slices.local_index[i];
+                for (auto n = indptr[i]; n < indptr[i + 1]; ++n) {
+                    auto const j = indices[n];
+                    auto const value = complex_t{std::real(data[n]), std::imag(data[n])};
+                    if (slices.slice_of[j] == k) {
+                        blocks.diagonal[k](row, slices.local_index[j]) += value;
+                    } else if (slices.slice_of[j] == k + 1) {
+                        blocks.upper[k](row, slices.local_index[j]) += value;
+                    }
+                    // `k - 1` is the adjoint of the upper block of the previous slice
+                }
+            }
+        }
+        return blocks;
+    }
+};
+
+/// Add the self-energy of a lead to the matching sites of a slice
+void add_self_energy(Matrix& block, Matrix const& sigma, std::vector<int> const& lead_indices,
+                     TransportSlices const& slices) {
+    auto const n = static_cast<int>(lead_indices.size());
+    for (auto a = 0; a < n; ++a) {
+        for (auto b = 0; b < n; ++b) {
+            block(slices.local_index[lead_indices[a]], slices.local_index[lead_indices[b]])
+                += sigma(a, b);
+        }
+    }
+}
+
+/// Broadening `i * (sigma - sigma^dagger)` expanded to the full size of a slice
+Matrix slice_gamma(Matrix const& sigma, std::vector<int> const& lead_indices,
+                   TransportSlices const& slices, int slice) {
+    auto const n = static_cast<int>(slices.sites[slice].size());
+    Matrix gamma = Matrix::Zero(n, n);
+    Matrix const lead_gamma = complex_t{0, 1} * (sigma - sigma.adjoint());
+    add_self_energy(gamma, lead_gamma, lead_indices, slices);
+    return gamma;
+}
+
+} // anonymous namespace
+
+ArrayXd calc_transmission(Model const& model, ArrayXd const& energies, int from, int to,
+                          double broadening, int num_threads) {
+    auto const num_leads = model.leads().size();
+    if (from < 0 || to < 0 || from >= num_leads || to >= num_leads || from == to) {
+        throw std::invalid_argument("calc_transmission: the model needs two different leads.");
+    }
+    auto const& system = *model.system();
+    if (!system.boundaries.empty()) {
+        throw std::runtime_error("calc_transmission: the scattering region can't have "
+                                 "translational symmetry.");
+    }
+
+    auto const lead_from = model.lead(static_cast<size_t>(from));
+    auto const lead_to = model.lead(static_cast<size_t>(to));
+    auto const slices = TransportSlices(system, lead_from.indices(), lead_to.indices());
+    auto const blocks = var::apply_visitor(MakeBlocks{slices},
+                                           model.hamiltonian().get_variant());
+    auto const first = 0;
+    auto const last = slices.size() - 1;
+
+    auto const sigma_from = leads::SelfEnergy<double>(lead_from, broadening)
+        .calc(energies, num_threads);
+    auto const sigma_to = leads::SelfEnergy<double>(lead_to, broadening)
+        .calc(energies, num_threads);
+
+    auto const num_energies = static_cast<int>(energies.size());
+    auto transmission = ArrayXd(num_energies);
+    ThreadPool pool(std::max(1, std::min(num_threads, num_energies)));
+    pool.run([&](int thread_id) {
+        for (auto e = thread_id; e < num_energies; e += pool.size()) {
+            auto const z = complex_t{energies[e], broadening};
+            auto const inverse_block = [&](int k, Matrix const& extra) -> Matrix {
+                auto const n = blocks.diagonal[k].rows();
+                Matrix a = Matrix::Identity(n, n) * z - blocks.diagonal[k] - extra;
+                if (k == first) {
+                    add_self_energy(a, -sigma_from[e], lead_from.indices(), slices);
+                }
+                if (k == last) {
+                    add_self_energy(a, -sigma_to[e], lead_to.indices(), slices);
+                }
+                return a.partialPivLu().inverse();
+            };
+
+            // Forward sweep: `g` is the Green's function of slices [0, k] at slice `k`
+            // and `g_1k` connects the first slice to slice `k`
+            auto const n0 = blocks.diagonal[first].rows();
+            Matrix g = inverse_block(first, Matrix::Zero(n0, n0));
+            Matrix g_1k = g;
+            for (auto k = 1; k <= last; ++k) {
+                auto const& v = blocks.upper[k - 1];
+                g = inverse_block(k, v.adjoint() * g * v);
+                g_1k = g_1k * v * g;
+            }
+
+            auto const gamma_from = slice_gamma(sigma_from[e], lead_from.indices(), slices,
+                                                first);
+            auto const gamma_to = slice_gamma(sigma_to[e], lead_to.indices(), slices, last);
+            transmission[e] = (gamma_from * g_1k * gamma_to * g_1k.adjoint()).trace().real();
+        }
+    });
+
+    return transmission;
+}
+
+} // namespace cpb
@@ -0,0 +1,498 @@
+#include "system/Cache.hpp"
+
+#include "support/format.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+#include <vector>
+
+#ifdef _WIN32
+# include <process.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+namespace cpb { namespace cache {
+namespace {
+
+/// A temporary file in the same directory as `filename` with a name which is unique to
+/// this write: the process id and a random suffix (different for each thread and call)
+std::string unique_tmp_filename(std::string const& filename) {
+#ifdef _WIN32
+    auto const pid = static_cast<long>(_getpid());
+#else
+    auto const pid = static_cast<long>(getpid());
+#endif
+    static std::atomic<unsigned> counter{0};
+    auto const suffix = std::random_device{}() ^ (counter++ * 2654435761u);
+    return fmt::format("{}.{}-{:08x}.tmp", filename, pid, suffix);
+}
+
+constexpr char magic[8] = {'P', 'B', 'C', 'A', 'C', 'H', 'E', '\0'};
+constexpr auto alignment = 64;
+
+class Writer {
+public:
+    explicit Writer(std::string const& filename)
+        : file(filename, std::ios::binary | std::ios::trunc) {
+        if (!file) {
+            throw std::runtime_error(fmt::format("Could not write the cache file: {}", filename));
+        }
+    }
+
+    template<class T>
+    void value(T const& v) { raw(&v, sizeof(T)); }
+
+    /// The size in bytes followed by the data at an aligned position
+    template<class T>
+    void array(T const* data, std::int64_t size) {
+        auto const bytes = static_cast<std::int64_t>(size * sizeof(T));
+        value(bytes);
+        pad();
+        raw(data, static_cast<std::size_t>(bytes));
+    }
+
+    template<class scalar_t>
+    void sparse(SparseMatrixX<scalar_t> const& m) {
+        assert(m.isCompressed());
+        value(static_cast<std::int32_t>(m.rows()));
+        value(static_cast<std::int32_t>(m.cols()));
+        array(m.outerIndexPtr(), m.outerSize() + 1);
+        array(m.innerIndexPtr(), m.nonZeros());
+        array(m.valuePtr(), m.nonZeros());
+    }
+
+    bool good() const { return static_cast<bool>(file); }
+    void close() { file.close(); }
+
+    void raw(void const* data, std::size_t bytes) {
+        file.write(static_cast<char const*>(data), static_cast<std::streamsize>(bytes));
+        offset += bytes;
+    }
+
+private:
+    void pad() {
+        static constexpr char zeros[alignment] = {};
+        raw(zeros, (alignment - offset % alignment) % alignment);
+    }
+
+private:
+    std::ofstream file;
+    std::size_t offset = 0;
+};
+
+/**
+ Read-only view of a whole file: memory-mapped on POSIX systems, so the arrays are copied
+ straight from the page cache into their final storage without any intermediate buffers.
+ Elsewhere, the file is read into memory.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(std::string const& filename) {
+#ifdef _WIN32
+        std::ifstream file(filename, std::ios::binary | std::ios::ate);
+        if (!file) {
+            return;
+        }
+        buffer.resize(static_cast<std::size_t>(file.tellg()));
+        file.seekg(0);
+        if (file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()))) {
+            bytes = buffer.data();
+            size = buffer.size();
+        }
+#else
+        auto const fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info;
+        if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+            auto const length = static_cast<std::size_t>(info.st_size);
+            auto const address = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address != MAP_FAILED) {
+                ::madvise(address, length, MADV_SEQUENTIAL);
+                bytes = static_cast<char const*>(address);
+                size = length;
+            }
+        }
+        ::close(fd); // the mapping stays valid
+#endif
+    }
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (bytes) {
+            ::munmap(const_cast<char*>(bytes), size);
+        }
+#endif
+    }
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    char const* data() const { return bytes; }
+    std::size_t length() const { return size; }
+
+private:
+    char const* bytes = nullptr;
+    std::size_t size = 0;
+#ifdef _WIN32
+    std::vector<char> buffer;
+#endif
+};
+
+class Reader {
+public:
+    explicit Reader(std::string const& filename) : file(filename) {
+        is_good = file.data() != nullptr;
+    }
+
+    bool good() const { return is_good; }
+
+    template<class T>
+    T value() {
+        auto v = T{};
+        raw(&v, sizeof(T));
+        return v;
+    }
+
+    /// Resize the Eigen array and copy the data straight into it
+    template<class Array>
+    bool array(Array& a) {
+        using T = typename Array::Scalar;
+        auto const size = array_size<T>();
+        if (size < 0) {
+            return false;
+        }
+        a.resize(static_cast<typename Array::Index>(size));
+        raw(a.data(), static_cast<std::size_t>(size) * sizeof(T));
+        return good();
+    }
+
+    /// The arrays are copied straight into the storage of the matrix
+    template<class scalar_t>
+    bool sparse(SparseMatrixX<scalar_t>& m) {
+        auto const rows = value<std::int32_t>();
+        auto const cols = value<std::int32_t>();
+        if (!good() || rows < 0 || cols < 0) {
+            return false;
+        }
+
+        auto result = SparseMatrixX<scalar_t>(rows, cols);
+        auto const outer_size = result.outerSize();
+        auto const inner_size = result.innerSize();
+        auto const outer = result.outerIndexPtr();
+        if (array_size<int>() != outer_size + 1) {
+            return false;
+        }
+        raw(outer, static_cast<std::size_t>(outer_size + 1) * sizeof(int));
+        if (!good() || outer[0] != 0 || !std::is_sorted(outer, outer + outer_size + 1)) {
+            return false;
+        }
+
+        auto const nnz = outer[outer_size];
+        if (array_size<int>() != nnz) {
+            return false;
+        }
+        result.resizeNonZeros(nnz);
+        auto const inner = result.innerIndexPtr();
+        raw(inner, static_cast<std::size_t>(nnz) * sizeof(int));
+        if (!good() || std::any_of(inner, inner + nnz, [&](int i) {
+                return i < 0 || i >= inner_size;
+            })) {
+            return false;
+        }
+
+        if (array_size<scalar_t>() != nnz) {
+            return false;
+        }
+        raw(result.valuePtr(), static_cast<std::size_t>(nnz) * sizeof(scalar_t));
+        if (!good()) {
+            return false;
+        }
+        m.swap(result);
+        return true;
+    }
+
+    void raw(void* data, std::size_t bytes) {
+        if (!is_good || bytes > file.length() - offset) {
+            is_good = false;
+            return;
+        }
+        std::copy_n(file.data() + offset, bytes, static_cast<char*>(data));
+        offset += bytes;
+    }
+
+private:
+    /// Read the size of the next array (in elements of `T`) and skip to its aligned data,
+    /// -1 if it's invalid
+    template<class T>
+    std::int64_t array_size() {
+        auto const bytes = value<std::int64_t>();
+        if (!good() || bytes < 0 || bytes % static_cast<std::int64_t>(sizeof(T)) != 0) {
+            return -1;
+        }
+        auto const padding = (alignment - offset % alignment) % alignment;
+        if (padding > file.length() - offset) {
+            is_good = false;
+            return -1;
+        }
+        offset += padding;
+        return bytes / static_cast<std::int64_t>(sizeof(T));
+    }
+
+private:
+    MappedFile file;
+    std::size_t offset = 0;
+    bool is_good;
+};
+
+struct WriteHamiltonian {
+    Writer& writer;
+
+    template<class scalar_t>
+    void operator()(SparseMatrixRC<scalar_t> const& m) const {
+        writer.value(num::detail::get_tag<scalar_t>());
+        writer.sparse(*m);
+    }
+};
+
+template<class scalar_t>
+bool read_hamiltonian(Reader& reader, Hamiltonian& hamiltonian) {
+    auto matrix = std::make_shared<SparseMatrixX<scalar_t>>();
+    if (!reader.sparse(*matrix)) {
+        return false;
+    }
+    hamiltonian = matrix;
+    return true;
+}
+
+} // anonymous namespace
+
+Hasher& Hasher::add(void const* data, std::size_t size) {
+    auto const values = static_cast<unsigned char const*>(data);
+    for (auto i = std::size_t{0}; i < size; ++i) {
+        hash ^= values[i];
+        hash *= 1099511628211ull;
+    }
+    bytes.append(static_cast<char const*>(data), size);
+    return *this;
+}
+
+std::string Hasher::hex() const {
+    return fmt::format("{:016x}", hash);
+}
+
+void save(std::string const& filename, System const& system, Hamiltonian const& hamiltonian) {
+    auto const tmp_filename = unique_tmp_filename(filename);
+    {
+        auto writer = Writer(tmp_filename);
+        writer.raw(magic, sizeof(magic));
+        writer.value(format_version);
+        var::apply_visitor(WriteHamiltonian{writer}, hamiltonian.get_variant());
+
+        auto const num_sites = system.num_sites();
+        auto buffer = CartesianArray(); // the cache always has the full positions
+        auto const& positions = system.expanded_positions(buffer);
+        writer.array(positions.x.data(), num_sites);
+        writer.array(positions.y.data(), num_sites);
+        writer.array(positions.z.data(), num_sites);
+        writer.array(system.sublattices.data(), num_sites);
+        writer.sparse(system.hoppings);
+        writer.value(static_cast<std::uint8_t>(system.has_unbalanced_hoppings));
+
+        writer.value(static_cast<std::int32_t>(system.boundaries.size()));
+        for (auto const& boundary : system.boundaries) {
+            writer.raw(boundary.shift.data(), 3 * sizeof(float));
+            writer.sparse(boundary.hoppings);
+        }
+        writer.array(system.original_indices.data(), system.original_indices.size());
+
+        if (!writer.good()) {
+            writer.close();
+            std::remove(tmp_filename.c_str());
+            throw std::runtime_error(fmt::format("Could not write the cache file: {}", filename));
+        }
+    }
+    // POSIX replaces an existing file atomically, but Windows needs it to be removed first
+    if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        std::remove(filename.c_str());
+        if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+            std::remove(tmp_filename.c_str());
+            throw std::runtime_error(fmt::format("Could not write the cache file: {}", filename));
+        }
+    }
+}
+
+bool load(std::string const& filename, Lattice const& lattice,
+          std::shared_ptr<System>& system, Hamiltonian& hamiltonian) {
+    Reader reader(filename);
+    if (!reader.good()) {
+        return false;
+    }
+
+    char file_magic[sizeof(magic)];
+    reader.raw(file_magic, sizeof(file_magic));
+    if (!reader.good() || !std::equal(magic, magic + sizeof(magic), file_magic)
+        || reader.value<std::uint32_t>() != format_version) {
+        return false;
+    }
+
+    auto new_hamiltonian = Hamiltonian();
+    auto const is_valid_hamiltonian = [&]{
+        switch (reader.value<num::Tag>()) {
+            case num::Tag::f32: return read_hamiltonian<float>(reader, new_hamiltonian);
+            case num::Tag::cf32: return read_hamiltonian<std::complex<float>>(reader,
+                                                                            new_hamiltonian);
+            case num::Tag::f64: return read_hamiltonian<double>(reader, new_hamiltonian);
+            case num::Tag::cf64: return read_hamiltonian<std::complex<double>>(reader,
+                                                                             new_hamiltonian);
+            default: return false;
+        }
+    }();
+    if (!is_valid_hamiltonian) {
+        return false;
+    }
+
+    auto new_system = std::make_shared<System>(lattice);
+    auto& positions = new_system->positions;
+    if (!reader.array(positions.x) || !reader.array(positions.y) || !reader.array(positions.z)
+        || !reader.array(new_system->sublattices) || !reader.sparse(new_system->hoppings)) {
+        return false;
+    }
+    new_system->has_unbalanced_hoppings = reader.value<std::uint8_t>() != 0;
+
+    auto const num_boundaries = reader.value<std::int32_t>();
+    if (!reader.good() || num_boundaries < 0) {
+        return false;
+    }
+    for (auto n = 0; n < num_boundaries; ++n) {
+        auto boundary = System::Boundary();
+        reader.raw(boundary.shift.data(), 3 * sizeof(float));
+        if (!reader.sparse(boundary.hoppings)) {
+            return false;
+        }
+        new_system->boundaries.push_back(std::move(boundary));
+    }
+    if (!reader.array(new_system->original_indices)) {
+        return false;
+    }
+
+    auto const num_sites = new_system->num_sites();
+    if (positions.x.size() != num_sites || positions.y.size() != num_sites
+        || positions.z.size() != num_sites
+        || new_system->sublattices.size() != num_sites || new_hamiltonian.rows() != num_sites
+        || (new_system->original_indices.size() != 0
+            && new_system->original_indices.size() != num_sites)) {
+        return false;
+    }
+
+    system = std::move(new_system);
+    hamiltonian = std::move(new_hamiltonian);
+    return true;
+}
+
+namespace {
+
+template<class scalar_t>
+std::size_t sparse_bytes(SparseMatrixX<scalar_t> const& m) {
+    auto const index_bytes = sizeof(*m.innerIndexPtr());
+    return static_cast<std::size_t>(m.outerSize() + 1) * index_bytes
+           + static_cast<std::size_t>(m.nonZeros()) * (index_bytes + sizeof(scalar_t));
+}
+
+struct HamiltonianBytes {
+    template<class scalar_t>
+    std::size_t operator()(SparseMatrixRC<scalar_t> const& h) const {
+        return h ? sparse_bytes(*h) : 0;
+    }
+};
+
+std::size_t memory_usage(System const& system, Hamiltonian const& hamiltonian) {
+    auto const num_sites = static_cast<std::size_t>(system.num_sites());
+    auto bytes = num_sites * sizeof(sub_id) + sparse_bytes(system.hoppings)
+                 + static_cast<std::size_t>(system.positions.size()) * 3 * sizeof(float)
+                 + static_cast<std::size_t>(system.lattice_positions.size()) * 3 * sizeof(float)
+                 + static_cast<std::size_t>(system.compact.cells.size()) * sizeof(int)
+                 + static_cast<std::size_t>(system.original_indices.size()) * sizeof(int);
+    for (auto const& boundary : system.boundaries) {
+        bytes += sparse_bytes(boundary.hoppings);
+    }
+    return bytes + var::apply_visitor(HamiltonianBytes{}, hamiltonian.get_variant());
+}
+
+} // anonymous namespace
+
+MemoryCache& MemoryCache::instance() {
+    static MemoryCache cache;
+    return cache;
+}
+
+bool MemoryCache::find(Hasher const& key, std::shared_ptr<System const>& system,
+                       Hamiltonian& hamiltonian) {
+    std::lock_guard<std::mutex> lk(mutex);
+    auto const it = index.find(key.get());
+    if (it == index.end() || it->second->key != key.key()) {
+        ++counters.misses;
+        return false;
+    }
+
+    ++counters.hits;
+    entries.splice(entries.begin(), entries, it->second);
+    system = it->second->system;
+    hamiltonian = it->second->hamiltonian;
+    return true;
+}
+
+void MemoryCache::insert(Hasher const& key, std::shared_ptr<System const> const& system,
+                         Hamiltonian const& hamiltonian) {
+    auto const bytes = memory_usage(*system, hamiltonian) + key.key().size();
+    std::lock_guard<std::mutex> lk(mutex);
+    if (bytes > capacity || index.count(key.get()) != 0) {
+        return; // too large, or another model just inserted the same one (or the same hash)
+    }
+
+    entries.push_front({key.get(), key.key(), system, hamiltonian, bytes});
+    index[key.get()] = entries.begin();
+    counters.memory += bytes;
+    evict();
+}
+
+void MemoryCache::set_capacity(std::size_t bytes) {
+    std::lock_guard<std::mutex> lk(mutex);
+    capacity = bytes;
+    evict();
+}
+
+void MemoryCache::clear() {
+    std::lock_guard<std::mutex> lk(mutex);
+    entries.clear();
+    index.clear();
+    counters = Stats();
+}
+
+MemoryCache::Stats MemoryCache::stats() const {
+    std::lock_guard<std::mutex> lk(mutex);
+    auto result = counters;
+    result.num_entries = entries.size();
+    result.capacity = capacity;
+    return result;
+}
+
+void MemoryCache::evict() {
+    while (counters.memory > capacity && !entries.empty()) {
+        counters.memory -= entries.back().bytes;
+        ++counters.evictions;
+        index.erase(entries.back().hash);
+        entries.pop_back();
+    }
+}
+
+}} // namespace cpb::cache
@@ -1,6 +1,11 @@
 #include "system/Foundation.hpp"
 #include "system/Shape.hpp"
 
+#include "utils/ThreadPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+
 namespace cpb { namespace detail {
 
 std::pair<Index3D, Index3D> find_bounds(Shape const& shape, Lattice const& lattice) {
@@ -21,72 +26,82 @@ std::pair<Index3D, Index3D> find_bounds(Shape const& shape, Lattice const& latti
     return {lower_bound, upper_bound};
 }
 
-CartesianArray generate_positions(Cartesian origin, Index3D size, Lattice const& lattice) {
-    // The nested loops look messy, but it's the fastest way to calculate all the positions
-    // because the intermediate a, b, c positions are reused.
+CartesianArray generate_positions(Cartesian origin, Index3D size, Lattice const& lattice,
+                                  int num_threads) {
     auto const nsub = lattice.nsub();
     auto const num_sites = size.prod() * nsub;
     CartesianArray positions(num_sites);
 
-    auto idx = 0;
-    for (auto s = 0; s < nsub; ++s) {
-        Cartesian ps = origin + lattice[s].position;
-        for (auto c = 0; c < size[2]; ++c) {
-            Cartesian pc = (c == 0) ? ps : ps + static_cast<float>(c) * lattice.vector(2);
-            for (auto b = 0; b < size[1]; ++b) {
-                Cartesian pb = (b == 0) ? pc : pc + static_cast<float>(b) * lattice.vector(1);
-                for (auto a = 0; a < size[0]; ++a) {
-                    Cartesian pa = pb + static_cast<float>(a) * lattice.vector(0);
-                    positions[idx++] = pa;
-                } // a
-            } // b
-        } // c
-    } // sub
+    // The flat site index is split into contiguous blocks, one per thread. A block covers
+    // a number of lines along the first lattice vector: the start of each line is calculated
+    // from the higher dimensions in the same order as a serial loop would, so the result
+    // does not depend on the number of threads.
+    ThreadPool pool(num_threads);
+    pool.parallel_for(0, num_sites, [&](int, int start, int end) {
+        auto const line_size = size[0];
+        for (auto line_start = start - start % line_size; line_start < end;
+             line_start += line_size) {
+            auto const line = line_start / line_size;
+            auto const b = line % size[1];
+            auto const c = (line / size[1]) % size[2];
+            auto const s = line / (size[1] * size[2]);
+
+            Cartesian const ps = origin + lattice[s].position;
+            Cartesian const pc = (c == 0) ? ps : ps + static_cast<float>(c) * lattice.vector(2);
+            Cartesian const pb = (b == 0) ? pc : pc + static_cast<float>(b) * lattice.vector(1);
+
+            auto const a_start = std::max(start - line_start, 0);
+            auto const a_end = std::min(end - line_start, line_size);
+            for (auto a = a_start; a < a_end; ++a) {
+                positions[line_start + a] = pb + static_cast<float>(a) * lattice.vector(0);
+            }
+        }
+    });
 
     return positions;
 }
 
-ArrayX<int16_t> count_neighbors(Foundation const& foundation) {
+ArrayX<int16_t> count_neighbors(Foundation const& foundation, int num_threads) {
     ArrayX<int16_t> neighbor_count(foundation.get_num_sites());
 
-    auto const& lattice = foundation.get_lattice();
-    auto const size = foundation.get_size().array();
-
-    for (auto const& site : foundation) {
-        auto const& sublattice = lattice[site.get_sublattice()];
-        auto num_neighbors = static_cast<int16_t>(sublattice.hoppings.size());
-
-        // Reduce the neighbor count for sites on the edges
-        for (auto const& hopping : sublattice.hoppings) {
-            auto const index = (site.get_index() + hopping.relative_index).array();
-            if (any_of(index < 0) || any_of(index >= size))
-                num_neighbors -= 1;
+    ThreadPool pool(num_threads);
+    pool.parallel_for(0, foundation.get_num_sites(), [&](int, int start, int end) {
+        for (auto it = foundation.begin_at(start), last = foundation.begin_at(end);
+             it != last; ++it) {
+            auto const& site = *it;
+            // Sites on the edges (of the box or missing tiles) have fewer neighbors
+            auto num_neighbors = int16_t{0};
+            site.for_each_neighbour([&](Site, Hopping) { ++num_neighbors; });
+            neighbor_count[site.get_idx()] = num_neighbors;
         }
-
-        neighbor_count[site.get_idx()] = num_neighbors;
-    }
+    });
 
     return neighbor_count;
 }
 
-void clear_neighbors(Site& site, ArrayX<int16_t>& neighbor_count, int min_neighbors) {
-    if (neighbor_count[site.get_idx()] == 0)
-        return;
+void prune_neighbors(std::vector<Site>& worklist, AtomicCounts& counts, int min_neighbors) {
+    while (!worklist.empty()) {
+        auto const site = worklist.back();
+        worklist.pop_back();
 
-    site.for_each_neighbour([&](Site neighbor, Hopping) {
-        if (!neighbor.is_valid())
-            return;
+        site.for_each_neighbour([&](Site neighbor, Hopping) {
+            auto& count = counts[neighbor.get_idx()];
+            auto current = count.load(std::memory_order_relaxed);
+            auto next = int16_t{0};
+            do {
+                if (current == removed_site) {
+                    return; // already invalid
+                }
+                next = (current - 1 < min_neighbors) ? removed_site
+                                                     : static_cast<int16_t>(current - 1);
+            } while (!count.compare_exchange_weak(current, next, std::memory_order_relaxed));
 
-        auto const neighbor_idx = neighbor.get_idx();
-        neighbor_count[neighbor_idx] -= 1;
-        if (neighbor_count[neighbor_idx] < min_neighbors) {
-            neighbor.set_valid(false);
-            // recursive call... but it will not be very deep
-            clear_neighbors(neighbor, neighbor_count, min_neighbors);
-        }
-    });
-
-    neighbor_count[site.get_idx()] = 0;
+            if (next == removed_site) { // this thread claimed the removal
+                neighbor.set_valid(false);
+                worklist.push_back(neighbor);
+            }
+        });
+    }
 }
 
 ArrayX<sub_id> make_sublattice_ids(Foundation const& foundation) {
@@ -99,33 +114,153 @@ ArrayX<sub_id> make_sublattice_ids(Foundation const& foundation) {
 
 } // namespace detail
 
-void remove_dangling(Foundation& foundation, int min_neighbors) {
-    auto neighbor_count = detail::count_neighbors(foundation);
-    for (auto& site : foundation) {
-        if (!site.is_valid()) {
-            detail::clear_neighbors(site, neighbor_count, min_neighbors);
+void remove_dangling(Foundation& foundation, int min_neighbors, int num_threads) {
+    if (min_neighbors <= 0) {
+        return; // no site can drop below the minimum
+    }
+
+    auto const num_sites = foundation.get_num_sites();
+    auto const& states = foundation.get_states();
+    auto counts = detail::AtomicCounts(static_cast<std::size_t>(num_sites));
+    {
+        auto const neighbor_count = detail::count_neighbors(foundation, num_threads);
+        for (auto i = 0; i < num_sites; ++i) {
+            counts[i].store(states[i] ? neighbor_count[i] : detail::removed_site,
+                            std::memory_order_relaxed);
         }
     }
+
+    // The initially invalid sites of each chunk are collected before any pruning starts
+    ThreadPool pool(num_threads);
+    auto worklists = std::vector<std::vector<Site>>(pool.size());
+    pool.parallel_for(0, num_sites, [&](int id, int start, int end) {
+        for (auto it = foundation.begin_at(start), last = foundation.begin_at(end);
+             it != last; ++it) {
+            auto const& site = *it;
+            if (!states[site.get_idx()]) {
+                worklists[id].push_back(site);
+            }
+        }
+    });
+
+    // Each thread starts from its own chunk, but the removals may spread into any other
+    // chunk: the atomic counts make sure that each site is removed exactly once, so the
+    // result doesn't depend on the number of threads or the order of the removals
+    pool.run([&](int id) {
+        detail::prune_neighbors(worklists[id], counts, min_neighbors);
+    });
 }
 
-Foundation::Foundation(Lattice const& lattice, Primitive const& primitive)
+Foundation::Foundation(Lattice const& lattice, Primitive const& primitive, int num_threads)
     : lattice(lattice),
       bounds(-primitive.size.array() / 2, (primitive.size.array() - 1) / 2),
       size(primitive.size),
       nsub(lattice.nsub()),
       num_sites(size.prod() * nsub),
-      positions(detail::generate_positions(lattice.calc_position(bounds.first), size, lattice)),
-      is_valid(ArrayX<bool>::Constant(num_sites, true)) {}
+      positions(detail::generate_positions(lattice.calc_position(bounds.first), size, lattice,
+                                           num_threads)),
+      is_valid(ArrayX<bool>::Constant(num_sites, true)) {
+    make_tiles(size);
+}
 
-Foundation::Foundation(Lattice const& lattice, Shape const& shape)
+Foundation::Foundation(Lattice const& lattice, Shape const& shape, int num_threads,
+                       int tile_size)
     : lattice(lattice),
       bounds(detail::find_bounds(shape, lattice)),
       size((bounds.second - bounds.first) + Index3D::Ones()),
       nsub(lattice.nsub()),
-      num_sites(size.prod() * nsub),
-      positions(detail::generate_positions(lattice.calc_position(bounds.first), size, lattice)),
-      is_valid(shape.contains(positions)) {
-    remove_dangling(*this, lattice.get_min_neighbors());
+      num_sites(size.prod() * nsub) {
+    if (tile_size > 0) {
+        make_tiles(Index3D::Constant(tile_size));
+        fill_tiles(shape, num_threads);
+    } else {
+        make_tiles(size);
+        positions = detail::generate_positions(lattice.calc_position(bounds.first), size,
+                                               lattice, num_threads);
+        is_valid = detail::contains(shape, positions, num_threads);
+    }
+    remove_dangling(*this, lattice.get_min_neighbors(), num_threads);
+}
+
+void Foundation::make_tiles(Index3D max_tile_size) {
+    tile_size = size.array().min(max_tile_size.array()).matrix();
+    num_tiles = ((size + tile_size - Index3D::Ones()).array() / tile_size.array()).matrix();
+
+    tiles.clear();
+    tiles.reserve(num_tiles.prod());
+    tile_ids.resize(num_tiles.prod());
+
+    auto offset = 0;
+    for (auto c = 0; c < num_tiles[2]; ++c) {
+        for (auto b = 0; b < num_tiles[1]; ++b) {
+            for (auto a = 0; a < num_tiles[0]; ++a) {
+                Index3D const origin = (Array3i(a, b, c) * tile_size.array()).matrix();
+                Index3D const tile = tile_size.array().min(size.array() - origin.array());
+                tile_ids[static_cast<int>(tiles.size())] = static_cast<int>(tiles.size());
+                tiles.push_back({origin, tile, offset});
+                offset += tile.prod() * nsub;
+            }
+        }
+    }
+
+    make_neighbor_offsets();
+}
+
+void Foundation::make_neighbor_offsets() {
+    reach_below.setZero();
+    reach_above.setZero();
+    neighbor_offsets.assign(nsub, {});
+    for (auto sub = 0; sub < nsub; ++sub) {
+        for (auto const& hopping : lattice[sub].hoppings) {
+            auto const& d = hopping.relative_index;
+            reach_below = reach_below.cwiseMax(-d);
+            reach_above = reach_above.cwiseMax(d);
+
+            // Same as the difference of the flat indices in `Site::reset_idx()`
+            auto const& t = tile_size;
+            auto const dsub = static_cast<int>(hopping.to_sublattice) - sub;
+            neighbor_offsets[sub].push_back(((dsub * t[2] + d[2]) * t[1] + d[1]) * t[0] + d[0]);
+        }
+    }
+}
+
+void Foundation::fill_tiles(Shape const& shape, int num_threads) {
+    // The positions of tiles which don't intersect the shape are discarded right away
+    auto tile_positions = std::vector<CartesianArray>();
+    auto tile_states = std::vector<ArrayX<bool>>();
+    auto stored_tiles = std::vector<Tile>();
+
+    num_sites = 0;
+    for (auto i = 0; i < static_cast<int>(tiles.size()); ++i) {
+        auto const& tile = tiles[i];
+        auto p = detail::generate_positions(lattice.calc_position(bounds.first + tile.origin),
+                                            tile.size, lattice, num_threads);
+        auto states = detail::contains(shape, p, num_threads);
+        if (none_of(states)) {
+            tile_ids[i] = -1;
+            continue;
+        }
+
+        tile_ids[i] = static_cast<int>(stored_tiles.size());
+        stored_tiles.push_back({tile.origin, tile.size, num_sites});
+        num_sites += p.size();
+        tile_positions.push_back(std::move(p));
+        tile_states.push_back(std::move(states));
+    }
+    tiles = std::move(stored_tiles);
+
+    positions.resize(num_sites);
+    is_valid.resize(num_sites);
+    for (auto i = 0u; i < tiles.size(); ++i) {
+        auto const offset = tiles[i].offset;
+        auto const n = tile_positions[i].size();
+        positions.x.segment(offset, n) = tile_positions[i].x;
+        positions.y.segment(offset, n) = tile_positions[i].y;
+        positions.z.segment(offset, n) = tile_positions[i].z;
+        is_valid.segment(offset, n) = tile_states[i];
+        tile_positions[i] = {};
+        tile_states[i] = {};
+    }
 }
 
 HamiltonianIndices::HamiltonianIndices(Foundation const& foundation)
@@ -1,5 +1,12 @@
 #include "system/Shape.hpp"
 
+#include "utils/ThreadPool.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+
 namespace cpb {
 
 Primitive::Primitive(int a1, int a2, int a3) : size(a1, a2, a3) {
@@ -15,6 +22,8 @@ Shape::Shape(Vertices const& vertices, Contains const& contains)
 }
 
 Line::Line(Cartesian a, Cartesian b) : Shape({a, b}) {
+    is_thread_safe = true;
+    is_vertex_defined = true;
     contains = [a, b](CartesianArray const& positions) -> ArrayX<bool> {
         // Return `true` for all `positions` which are in the perpendicular space
         // between the two end points of the line
@@ -41,47 +50,127 @@ ArrayX<bool> is_acute_angle(Cartesian a, Cartesian b, CartesianArray const& c) {
     return cos_theta >= 0; // acute angle
 };
 
-WithinPolygon::WithinPolygon(Shape::Vertices const& vertices)
-    : x(vertices.size()), y(vertices.size()) {
-    for (auto i = size_t{0}, size = vertices.size(); i < size; ++i) {
-        x[i] = vertices[i].x();
-        y[i] = vertices[i].y();
+ArrayX<bool> contains(Shape const& shape, CartesianArray const& positions, int num_threads) {
+    if (!shape.is_thread_safe || num_threads <= 1) {
+        return shape.contains(positions);
     }
+
+    auto result = ArrayX<bool>(positions.size());
+    ThreadPool pool(num_threads);
+    pool.parallel_for(0, positions.size(), [&](int, int start, int end) {
+        auto const n = end - start;
+        auto const chunk = CartesianArray(positions.x.segment(start, n),
+                                          positions.y.segment(start, n),
+                                          positions.z.segment(start, n));
+        result.segment(start, n) = shape.contains(chunk);
+    });
+    return result;
 }
 
-ArrayX<bool> WithinPolygon::operator()(CartesianArray const& positions) const {
-    // Raycasting algorithm checks if `positions` are inside this polygon
-    ArrayX<bool> is_within = ArrayX<bool>::Constant(positions.size(), false);
+constexpr int WithinPolygon::max_bands;
 
-    // Loop over all the sides of the polygon (neighbouring vertices)
-    auto const num_vertices = static_cast<int>(x.size());
+WithinPolygon::WithinPolygon(Shape::Vertices const& vertices) {
+    // Sides which aren't parallel to the ray: (x1, y1) is the current vertex, y2 the previous
+    struct Side { float x1, y1, y2, k; };
+    auto sides = std::vector<Side>();
+    auto const num_vertices = static_cast<int>(vertices.size());
     for (auto i = 0, j = num_vertices - 1; i < num_vertices; j = i++) {
-        // Aliases for readability
-        auto const& x1 = x[i]; auto const& x2 = x[j];
-        auto const& y1 = y[i]; auto const& y2 = y[j];
-
-        // Check if ray is parallel to this side of the polygon
+        auto const x1 = vertices[i].x(); auto const x2 = vertices[j].x();
+        auto const y1 = vertices[i].y(); auto const y2 = vertices[j].y();
         if (num::approx_equal(y1, y2)) {
-            continue; // avoid division by zero in the next step
+            continue; // avoid division by zero, a parallel side can't be crossed anyway
         }
+        sides.push_back({x1, y1, y2, (x2 - x1) / (y2 - y1)});
+    }
+    if (sides.empty()) {
+        band_start = {0, 0};
+        num_bands = 1;
+        return;
+    }
 
-        // The slope of this side
-        auto const k = (x2 - x1) / (y2 - y1);
+    y_min = std::numeric_limits<float>::max();
+    y_max = std::numeric_limits<float>::lowest();
+    for (auto const& side : sides) {
+        y_min = std::min({y_min, side.y1, side.y2});
+        y_max = std::max({y_max, side.y1, side.y2});
+    }
 
-        // Shoot the ray along the x direction and see if it passes between `y1` and `y2`
-        auto intersects_y = (y1 > positions.y) != (y2 > positions.y);
+    // About one band per side, but fewer if long sides would be repeated in too many bands
+    auto const count_entries = [&] {
+        auto count = std::int64_t{0};
+        for (auto const& side : sides) {
+            count += band(std::max(side.y1, side.y2)) - band(std::min(side.y1, side.y2)) + 1;
+        }
+        return count;
+    };
+    auto const num_sides = static_cast<int>(sides.size());
+    auto const max_entries = std::int64_t{8} * num_sides;
+    num_bands = std::min(num_sides, max_bands);
+    band_scale = num_bands / (y_max - y_min);
+    auto num_entries = count_entries();
+    while (num_entries > max_entries && num_bands > 1) {
+        num_bands /= 2;
+        band_scale = num_bands / (y_max - y_min);
+        num_entries = count_entries();
+    }
 
-        // The ray is moving from left to right and may cross a side of the polygon
-        auto x_side = k * (positions.y - y1) + x1;
-        auto intersects_x = positions.x > x_side;
+    // Counting sort of the sides into their bands
+    band_start.assign(num_bands + 1, 0);
+    for (auto const& side : sides) {
+        for (auto b = band(std::min(side.y1, side.y2)); b <= band(std::max(side.y1, side.y2));
+             ++b) {
+            ++band_start[b + 1];
+        }
+    }
+    std::partial_sum(band_start.begin(), band_start.end(), band_start.begin());
+
+    auto const size = static_cast<int>(num_entries);
+    side_x1.resize(size); side_y1.resize(size); side_y2.resize(size); side_k.resize(size);
+    auto next = std::vector<int>(band_start.begin(), band_start.end() - 1);
+    for (auto const& side : sides) {
+        for (auto b = band(std::min(side.y1, side.y2)); b <= band(std::max(side.y1, side.y2));
+             ++b) {
+            auto const n = next[b]++;
+            side_x1[n] = side.x1;
+            side_y1[n] = side.y1;
+            side_y2[n] = side.y2;
+            side_k[n] = side.k;
+        }
+    }
+}
+
+int WithinPolygon::band(float y) const {
+    auto const b = static_cast<int>((y - y_min) * band_scale);
+    return std::min(std::max(b, 0), num_bands - 1);
+}
 
-        // Eigen doesn't support `operator!`, so this will have to do...
-        auto negate = is_within.select(
-            ArrayX<bool>::Constant(is_within.size(), false),
-            ArrayX<bool>::Constant(is_within.size(), true)
-        );
-        // Flip the states which intersect the side
-        is_within = (intersects_y && intersects_x).select(negate, is_within);
+ArrayX<bool> WithinPolygon::operator()(CartesianArray const& positions) const {
+    // Raycasting algorithm checks if `positions` are inside this polygon
+    auto is_within = ArrayX<bool>(positions.size());
+    auto const x1 = side_x1.data();
+    auto const y1 = side_y1.data();
+    auto const y2 = side_y2.data();
+    auto const k = side_k.data();
+
+    for (auto i = 0; i < positions.size(); ++i) {
+        auto const px = positions.x[i];
+        auto const py = positions.y[i];
+        // No side can be crossed by a ray outside of [y_min, y_max), this also skips NaN
+        if (!(py >= y_min && py < y_max)) {
+            is_within[i] = false;
+            continue;
+        }
+
+        // Shoot the ray along the x direction and count the sides it crosses: it must pass
+        // between `y1` and `y2` and the side must be to the left of the point
+        auto const b = band(py);
+        auto crossings = 0;
+        for (auto n = band_start[b], end = band_start[b + 1]; n < end; ++n) {
+            auto const intersects_y = (y1[n] > py) != (y2[n] > py);
+            auto const intersects_x = px > k[n] * (py - y1[n]) + x1[n];
+            crossings += static_cast<int>(intersects_y & intersects_x);
+        }
+        is_within[i] = (crossings % 2) != 0;
     }
 
     return is_within;
@@ -90,7 +179,10 @@ ArrayX<bool> WithinPolygon::operator()(CartesianArray const& positions) const {
 } // namespace detail
 
 Polygon::Polygon(Vertices const& vertices)
-    : Shape(vertices, detail::WithinPolygon(vertices)) {}
+    : Shape(vertices, detail::WithinPolygon(vertices)) {
+    is_thread_safe = true;
+    is_vertex_defined = true;
+}
 
 namespace {
 
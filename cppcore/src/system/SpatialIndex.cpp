@@ -0,0 +1,168 @@
+#include "system/SpatialIndex.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+namespace cpb {
+
+SpatialIndex::SpatialIndex(CartesianArray const& all_positions,
+                           ArrayX<sub_id> const& all_sublattices) {
+    auto const num_sites = all_positions.size();
+    if (num_sites == 0) {
+        return;
+    }
+
+    Cartesian const min = {all_positions.x.minCoeff(), all_positions.y.minCoeff(),
+                           all_positions.z.minCoeff()};
+    Cartesian const max = {all_positions.x.maxCoeff(), all_positions.y.maxCoeff(),
+                           all_positions.z.maxCoeff()};
+    Cartesian const extent = max - min;
+    origin = min;
+
+    // About two sites per cell in the directions where the system isn't flat
+    auto num_dims = 0;
+    auto volume = 1.0;
+    for (auto d = 0; d < 3; ++d) {
+        if (extent[d] > 0) {
+            ++num_dims;
+            volume *= extent[d];
+        }
+    }
+    cell_width = (num_dims == 0) ? 1.f : static_cast<float>(
+        std::pow(volume / std::max(num_sites / 2.0, 1.0), 1.0 / num_dims)
+    );
+
+    // Very elongated boxes could end up with a lot more cells than sites
+    auto const max_cells = 2 * static_cast<double>(num_sites) + 8;
+    auto const num_cells = [&]() {
+        auto result = 1.0;
+        for (auto d = 0; d < 3; ++d) {
+            result *= std::floor(extent[d] / cell_width) + 1;
+        }
+        return result;
+    };
+    while (num_cells() > max_cells) {
+        cell_width *= 1.25f;
+    }
+    for (auto d = 0; d < 3; ++d) {
+        size[d] = static_cast<int>(std::floor(extent[d] / cell_width)) + 1;
+    }
+
+    // Counting sort of the sites by cell
+    auto cells = ArrayXi(num_sites);
+    cell_start.assign(static_cast<std::size_t>(size.prod()) + 1, 0);
+    for (auto i = 0; i < num_sites; ++i) {
+        Index3D const c = cell_of(all_positions[i]);
+        cells[i] = flat_cell(c[0], c[1], c[2]);
+        ++cell_start[cells[i] + 1];
+    }
+    std::partial_sum(cell_start.begin(), cell_start.end(), cell_start.begin());
+
+    auto next = std::vector<int>(cell_start.begin(), cell_start.end() - 1);
+    sites.resize(static_cast<std::size_t>(num_sites));
+    positions.resize(num_sites);
+    sublattices.resize(num_sites);
+    for (auto i = 0; i < num_sites; ++i) { // ascending indices within each cell
+        auto const n = next[cells[i]]++;
+        sites[n] = i;
+        positions[n] = all_positions[i];
+        sublattices[n] = all_sublattices[i];
+    }
+}
+
+Index3D SpatialIndex::cell_of(Cartesian position) const {
+    Index3D c;
+    for (auto d = 0; d < 3; ++d) {
+        auto const v = std::floor((position[d] - origin[d]) / cell_width);
+        c[d] = static_cast<int>(std::min(std::max(v, 0.f), static_cast<float>(size[d] - 1)));
+    }
+    return c;
+}
+
+void SpatialIndex::nearest_in_cell(int a, int b, int c, Cartesian target, sub_id sublattice,
+                                   float& best_distance, int& best_index) const {
+    auto const cell = flat_cell(a, b, c);
+    for (auto n = cell_start[cell]; n < cell_start[cell + 1]; ++n) {
+        if (sublattice >= 0 && sublattices[n] != sublattice) {
+            continue;
+        }
+        auto const distance = (positions[n] - target).norm();
+        if (distance < best_distance || (distance == best_distance && sites[n] < best_index)) {
+            best_distance = distance;
+            best_index = sites[n];
+        }
+    }
+}
+
+int SpatialIndex::nearest(Cartesian target, sub_id sublattice) const {
+    auto best_distance = std::numeric_limits<float>::max();
+    auto best_index = -1;
+
+    // Search shells of cells at an increasing (Chebyshev) distance from the target's cell.
+    // The sites beyond shell `r` are at least `r * cell_width` away from the target, also
+    // if it's outside of the box. One more shell makes up for the rounding of `cell_of()`.
+    Index3D const center = cell_of(target);
+    auto const max_shell = size.maxCoeff();
+    for (auto r = 0; r <= max_shell; ++r) {
+        Index3D const lo = (center.array() - r).max(Array3i::Zero()).matrix();
+        Index3D const hi = (center.array() + r).min(size.array() - 1).matrix();
+        for (auto c = lo[2]; c <= hi[2]; ++c) {
+            for (auto b = lo[1]; b <= hi[1]; ++b) {
+                auto const is_inner = std::abs(c - center[2]) < r && std::abs(b - center[1]) < r;
+                if (is_inner) { // only the two ends of the line are on the shell
+                    if (center[0] - r >= 0) {
+                        nearest_in_cell(center[0] - r, b, c, target, sublattice,
+                                        best_distance, best_index);
+                    }
+                    if (r > 0 && center[0] + r < size[0]) {
+                        nearest_in_cell(center[0] + r, b, c, target, sublattice,
+                                        best_distance, best_index);
+                    }
+                } else {
+                    for (auto a = lo[0]; a <= hi[0]; ++a) {
+                        nearest_in_cell(a, b, c, target, sublattice, best_distance, best_index);
+                    }
+                }
+            }
+        }
+
+        if (best_index >= 0 && best_distance < static_cast<float>(r - 1) * cell_width) {
+            break;
+        }
+    }
+    return best_index;
+}
+
+std::vector<int> SpatialIndex::within(Cartesian target, float radius, sub_id sublattice) const {
+    auto result = std::vector<int>();
+    if (sites.empty()) {
+        return result;
+    }
+
+    // One more cell on each side for the rounding of `cell_of()`
+    Index3D const lo = (cell_of(target - Cartesian::Constant(radius)).array() - 1)
+                       .max(Array3i::Zero()).matrix();
+    Index3D const hi = (cell_of(target + Cartesian::Constant(radius)).array() + 1)
+                       .min(size.array() - 1).matrix();
+    for (auto c = lo[2]; c <= hi[2]; ++c) {
+        for (auto b = lo[1]; b <= hi[1]; ++b) {
+            for (auto a = lo[0]; a <= hi[0]; ++a) {
+                auto const cell = flat_cell(a, b, c);
+                for (auto n = cell_start[cell]; n < cell_start[cell + 1]; ++n) {
+                    if (sublattice >= 0 && sublattices[n] != sublattice) {
+                        continue;
+                    }
+                    if ((positions[n] - target).norm() <= radius) {
+                        result.push_back(sites[n]);
+                    }
+                }
+            }
+        }
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+} // namespace cpb
@@ -3,167 +3,819 @@
 #include "system/Foundation.hpp"
 #include "system/Symmetry.hpp"
 
+#include "utils/ThreadPool.hpp"
+#include "support/format.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
+
 namespace cpb {
 
 System::System(Foundation const& foundation, HamiltonianIndices const& hamiltonian_indices,
-               TranslationalSymmetry const& symmetry, HoppingGenerators const& hopping_generators)
+               TranslationalSymmetry const& symmetry, HoppingGenerators const& hopping_generators,
+               int num_threads, SiteOrder order, bool compact_positions,
+               BoundaryCache* boundary_cache)
     : lattice(foundation.get_lattice()) {
-    detail::populate_system(*this, foundation, hamiltonian_indices);
+    detail::populate_system(*this, foundation, hamiltonian_indices, num_threads);
     if (symmetry) {
-        detail::populate_boundaries(*this, foundation, hamiltonian_indices, symmetry);
+        if (boundary_cache && *boundary_cache) {
+            boundaries = **boundary_cache;
+        } else {
+            detail::populate_boundaries(*this, foundation, hamiltonian_indices, symmetry,
+                                        num_threads);
+            if (boundary_cache) {
+                *boundary_cache = std::make_shared<std::vector<Boundary> const>(boundaries);
+            }
+        }
     }
 
     if (!hopping_generators.empty()) {
-        for (auto const& gen : hopping_generators) {
-            detail::add_extra_hoppings(*this, gen);
-        }
-        hoppings.makeCompressed();
-        has_unbalanced_hoppings = true;
+        detail::add_extra_hoppings(*this, hopping_generators, num_threads);
+        has_unbalanced_hoppings = detail::is_unbalanced(hoppings);
     }
 
     if (num_sites() == 0)
         throw std::runtime_error{"Impossible system: built 0 lattice sites"};
+
+    if (order != SiteOrder::Foundation) {
+        detail::reorder_sites(*this, detail::site_order(*this, foundation, hamiltonian_indices,
+                                                        order));
+    }
+
+    if (compact_positions) {
+        detail::compact_positions(*this, foundation, hamiltonian_indices);
+    }
 }
 
-int System::find_nearest(Cartesian target_position, std::string const& sublattice) const {
-    auto nearest_index = 0;
-    auto min_distance = (positions[0] - target_position).norm();
+CartesianArray const& System::expanded_positions(CartesianArray& buffer) const {
+    if (compact.empty()) {
+        return positions;
+    }
 
-    auto check_index = [&](int i) {
-        auto const distance = (positions[i] - target_position).norm();
-        if (distance < min_distance) {
-            min_distance = distance;
-            nearest_index = i;
-        }
-    };
+    buffer.resize(num_sites());
+    for (auto i = 0; i < num_sites(); ++i) {
+        buffer[i] = compact.position(i, lattice);
+    }
+    return buffer;
+}
 
-    if (sublattice.empty()) { // check all sites
-        for (auto i = 1; i < num_sites(); ++i) {
-            check_index(i);
+SpatialIndex const& System::spatial_index() const {
+    auto index = std::atomic_load(&cached_spatial_index);
+    if (!index) {
+        // Concurrent first queries may each build one, but they are identical
+        auto buffer = CartesianArray();
+        index = std::make_shared<SpatialIndex const>(expanded_positions(buffer), sublattices);
+        std::atomic_store(&cached_spatial_index, index);
+    }
+    return *index;
+}
+
+namespace {
+    /// The sublattice ID to look for or -1 for any
+    sub_id target_sublattice(Lattice const& lattice, std::string const& sublattice) {
+        return sublattice.empty() ? sub_id{-1} : lattice.get_sites().id_lookup(sublattice);
+    }
+
+    void throw_no_sites(std::string const& sublattice) {
+        auto const which = sublattice.empty() ? std::string() : " of sublattice " + sublattice;
+        throw std::runtime_error("find_nearest(): the system has no sites" + which);
+    }
+
+    /// Call `f(site, index)` for the valid foundation sites in [start, end), where `index`
+    /// is the Hamiltonian index of the site
+    template<class F>
+    void for_each_valid_site(Foundation const& foundation, HamiltonianIndices const& indices,
+                             int start, int end, F f) {
+        for (auto it = foundation.begin_at(start), last = foundation.begin_at(end);
+             it != last; ++it) {
+            auto const index = indices[*it];
+            if (index >= 0) { f(*it, index); } // else invalid site
         }
-    } else { // only sites belonging to the target sublattice
-        auto const target_sublattice = lattice.get_sites().id_lookup(sublattice);
-        for (auto i = 1; i < num_sites(); ++i) {
-            if (sublattices[i] == target_sublattice) { check_index(i); }
+    }
+}
+
+int System::find_nearest(Cartesian target_position, std::string const& sublattice) const {
+    auto const index = spatial_index().nearest(target_position,
+                                               target_sublattice(lattice, sublattice));
+    if (index < 0) {
+        throw_no_sites(sublattice);
+    }
+    return index;
+}
+
+ArrayXi System::find_nearest(CartesianArray const& targets, std::string const& sublattice,
+                             int num_threads) const {
+    auto const& index = spatial_index();
+    auto const id = target_sublattice(lattice, sublattice);
+    auto result = ArrayXi(targets.size());
+    ThreadPool pool(num_threads);
+    pool.parallel_for(0, targets.size(), [&](int, int start, int end) {
+        for (auto n = start; n < end; ++n) {
+            result[n] = index.nearest(targets[n], id);
         }
+    });
+    if (targets.size() != 0 && result.minCoeff() < 0) {
+        throw_no_sites(sublattice);
     }
+    return result;
+}
 
-    return nearest_index;
+ArrayXi System::find_within(Cartesian position, float radius,
+                            std::string const& sublattice) const {
+    auto const indices = spatial_index().within(position, radius,
+                                                target_sublattice(lattice, sublattice));
+    return eigen_cast<ArrayX>(indices);
 }
 
 namespace detail {
 
 void populate_system(System& system, Foundation const& foundation,
-                     HamiltonianIndices const& hamiltonian_indices) {
+                     HamiltonianIndices const& hamiltonian_indices, int num_threads) {
     auto const size = hamiltonian_indices.size();
     system.positions.resize(size);
     system.sublattices.resize(size);
     system.hoppings.resize(size, size);
 
+    // The rows are written straight into the final hopping matrix in two passes over the
+    // foundation: the first one counts the hoppings of each row and the second one fills
+    // them in. Only the exact final storage is allocated: there are no per-thread blocks
+    // which would need to be reserved for the worst case and then copied together.
+    // The valid sites of a contiguous block of the foundation map to a contiguous block of
+    // Hamiltonian indices, i.e. matrix rows, so each thread works on its own rows.
     auto const& lattice = foundation.get_lattice();
-    auto const reserve_nonzeros = (lattice.max_hoppings() * size) / 2;
-    auto matrix_view = compressed_inserter(system.hoppings, reserve_nonzeros);
+    auto const outer = system.hoppings.outerIndexPtr();
+
+    ThreadPool pool(num_threads);
+    pool.parallel_for(0, foundation.get_num_sites(), [&](int, int start, int end) {
+        for_each_valid_site(foundation, hamiltonian_indices, start, end,
+                            [&](Site const& site, int index) {
+            system.positions[index] = site.get_position();
+            system.sublattices[index] = lattice[site.get_sublattice()].alias;
+
+            auto count = 0;
+            site.for_each_neighbour([&](Site neighbor, Hopping hopping) {
+                // only make half the matrix, other half is the conjugate
+                if (!hopping.is_conjugate && hamiltonian_indices[neighbor] >= 0)
+                    ++count;
+            });
+            outer[index + 1] = count;
+        });
+    });
+
+    outer[0] = 0;
+    std::partial_sum(outer + 1, outer + size + 1, outer + 1);
+    system.hoppings.resizeNonZeros(outer[size]);
+
+    auto const inner = system.hoppings.innerIndexPtr();
+    auto const values = system.hoppings.valuePtr();
+    pool.parallel_for(0, foundation.get_num_sites(), [&](int, int start, int end) {
+        for_each_valid_site(foundation, hamiltonian_indices, start, end,
+                            [&](Site const& site, int index) {
+            auto const row_start = outer[index];
+            auto n = row_start;
+            site.for_each_neighbour([&](Site neighbor, Hopping hopping) {
+                auto const column = hamiltonian_indices[neighbor];
+                if (column < 0 || hopping.is_conjugate)
+                    return;
+
+                // Keep the columns of each row sorted, same as `CompressedInserter`
+                auto k = n++;
+                while (k > row_start && inner[k - 1] > column) {
+                    inner[k] = inner[k - 1];
+                    values[k] = values[k - 1];
+                    --k;
+                }
+                inner[k] = column;
+                values[k] = hopping.id;
+            });
+        });
+    });
+}
 
-    for (auto const& site : foundation) {
-        auto const index = hamiltonian_indices[site];
-        if (index < 0)
-            continue; // invalid site
+void populate_boundaries(System& system, Foundation const& foundation,
+                         HamiltonianIndices const& hamiltonian_indices,
+                         TranslationalSymmetry const& symmetry, int num_threads) {
+    auto const size = hamiltonian_indices.size();
+    auto const translations = symmetry.translations(foundation);
+    auto const num_translations = static_cast<int>(translations.size());
+
+    // The valid sites of all the boundary slices are gathered first: this is only a surface
+    // of the foundation. Then the rows of all translations are split between the threads.
+    struct Row { int translation; Site site; int index; };
+    auto rows = std::vector<Row>();
+    for (auto t = 0; t < num_translations; ++t) {
+        for (auto const& site : foundation[translations[t].boundary_slice]) {
+            if (site.is_valid()) {
+                rows.push_back({t, site, hamiltonian_indices[site]});
+            }
+        }
+    }
 
-        system.positions[index] = site.get_position();
-        system.sublattices[index] = lattice[site.get_sublattice()].alias;
+    auto matrices = std::vector<SparseMatrixX<hop_id>>(translations.size());
+    for (auto& matrix : matrices) {
+        matrix.resize(size, size);
+    }
 
-        matrix_view.start_row(index);
-        site.for_each_neighbour([&](Site neighbor, Hopping hopping) {
-            auto const neighbor_index = hamiltonian_indices[neighbor];
-            if (neighbor_index < 0)
-                return; // invalid
+    // Same two passes as `populate_system()`: count the hoppings of each row, then fill them
+    // in. The site is shifted to the opposite edge of the translation unit and its neighbors
+    // are found by the usual interior fast path or the bounds checked one at the edges.
+    auto const num_rows = static_cast<int>(rows.size());
+    ThreadPool pool(num_threads);
+    pool.parallel_for(0, num_rows, [&](int, int start, int end) {
+        for (auto n = start; n < end; ++n) {
+            auto const& row = rows[n];
+            auto count = 0;
+            row.site.shifted(translations[row.translation].shift_index)
+               .for_each_neighbour([&](Site neighbor, Hopping) {
+                   if (hamiltonian_indices[neighbor] >= 0)
+                       ++count;
+               });
+            matrices[row.translation].outerIndexPtr()[row.index + 1] = count;
+        }
+    });
 
-            if (!hopping.is_conjugate) // only make half the matrix, other half is the conjugate
-                matrix_view.insert(neighbor_index, hopping.id);
-        });
+    for (auto& matrix : matrices) {
+        auto const outer = matrix.outerIndexPtr();
+        outer[0] = 0;
+        std::partial_sum(outer + 1, outer + size + 1, outer + 1);
+        matrix.resizeNonZeros(outer[size]);
+    }
+
+    pool.parallel_for(0, num_rows, [&](int, int start, int end) {
+        for (auto n = start; n < end; ++n) {
+            auto const& row = rows[n];
+            auto& matrix = matrices[row.translation];
+            auto const inner = matrix.innerIndexPtr();
+            auto const values = matrix.valuePtr();
+            auto const row_start = matrix.outerIndexPtr()[row.index];
+            auto k = row_start;
+            row.site.shifted(translations[row.translation].shift_index)
+               .for_each_neighbour([&](Site neighbor, Hopping hopping) {
+                   auto const column = hamiltonian_indices[neighbor];
+                   if (column < 0)
+                       return; // invalid
+
+                   // Keep the columns of each row sorted, same as `CompressedInserter`
+                   auto i = k++;
+                   while (i > row_start && inner[i - 1] > column) {
+                       inner[i] = inner[i - 1];
+                       values[i] = values[i - 1];
+                       --i;
+                   }
+                   inner[i] = column;
+                   values[i] = hopping.id;
+               });
+        }
+    });
+
+    for (auto t = 0; t < num_translations; ++t) {
+        if (matrices[t].nonZeros() == 0)
+            continue;
+
+        // a boundary is added first to prevent copying of Eigen::SparseMatrix
+        system.boundaries.emplace_back();
+        system.boundaries.back().shift = translations[t].shift_lenght;
+        system.boundaries.back().hoppings.swap(matrices[t]);
     }
-    matrix_view.compress();
 }
 
-void populate_boundaries(System& system, Foundation const& foundation,
-                         HamiltonianIndices const& hamiltonian_indices,
-                         TranslationalSymmetry const& symmetry) {
-    // a boundary is added first to prevent copying of Eigen::SparseMatrix
-    // --> revise when Eigen types become movable
+namespace {
+    /// The indices which sort the `keys`, ties keep their current order
+    template<class Key>
+    ArrayXi sorted_indices(std::vector<Key> const& keys) {
+        auto order = ArrayXi(static_cast<int>(keys.size()));
+        std::iota(order.data(), order.data() + order.size(), 0);
+        std::stable_sort(order.data(), order.data() + order.size(),
+                         [&](int a, int b) { return keys[a] < keys[b]; });
+        return order;
+    }
 
-    auto const size = hamiltonian_indices.size();
-    auto const& lattice = foundation.get_lattice();
+    ArrayXi unit_cell_order(Foundation const& foundation, HamiltonianIndices const& indices) {
+        auto const& size = foundation.get_size();
+        auto const nsub = foundation.get_num_sublattices();
+        auto keys = std::vector<std::int64_t>(indices.size());
+        for (auto const& site : foundation) {
+            auto const i = indices[site];
+            if (i < 0) { continue; }
+
+            auto const& index = site.get_index();
+            auto const cell = (static_cast<std::int64_t>(index[2]) * size[1] + index[1])
+                              * size[0] + index[0];
+            keys[i] = cell * nsub + site.get_sublattice();
+        }
+        return sorted_indices(keys);
+    }
 
-    system.boundaries.emplace_back();
-    for (const auto& translation : symmetry.translations(foundation)) {
-        auto& boundary = system.boundaries.back();
+    /// Insert two zero bits between each of the lowest 21 bits of `v`
+    std::uint64_t spread_bits(std::uint64_t v) {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffull;
+        v = (v | v << 16) & 0x1f0000ff0000ffull;
+        v = (v | v << 8) & 0x100f00f00f00f00full;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
 
-        boundary.shift = translation.shift_lenght;
-        boundary.hoppings.resize(size, size);
+    ArrayXi morton_order(CartesianArray const& positions) {
+        auto const num_sites = positions.size();
+        if (num_sites == 0) {
+            return ArrayXi();
+        }
 
-        // the reservation number is intentionally overestimated
-        auto const reserve_nonzeros = [&]{
-            auto nz = lattice.nsub() * lattice.max_hoppings() / 2;
-            for (auto i = 0; i < translation.boundary_slice.ndims(); ++i) {
-                if (translation.boundary_slice[i].end < 0)
-                    nz *= foundation.get_size()[i];
+        // The same scale in all directions: the curve shouldn't depend on the aspect ratio
+        Cartesian const min = {positions.x.minCoeff(), positions.y.minCoeff(),
+                               positions.z.minCoeff()};
+        Cartesian const max = {positions.x.maxCoeff(), positions.y.maxCoeff(),
+                               positions.z.maxCoeff()};
+        auto const extent = (max - min).maxCoeff();
+        auto const scale = extent > 0 ? static_cast<float>(0x1fffff) / extent : 0.0f;
+        auto const quantize = [&](float value, float origin) {
+            return spread_bits(static_cast<std::uint64_t>((value - origin) * scale));
+        };
+
+        auto keys = std::vector<std::uint64_t>(num_sites);
+        for (auto i = 0; i < num_sites; ++i) {
+            keys[i] = quantize(positions.x[i], min.x())
+                      | quantize(positions.y[i], min.y()) << 1
+                      | quantize(positions.z[i], min.z()) << 2;
+        }
+        return sorted_indices(keys);
+    }
+
+    /// Symmetric adjacency lists (CSR) of the sites: `hoppings` only has one of (i, j), (j, i)
+    struct Graph {
+        std::vector<int> offsets;
+        std::vector<int> neighbors;
+
+        explicit Graph(SparseMatrixX<hop_id> const& hoppings)
+            : offsets(static_cast<std::size_t>(hoppings.rows()) + 1, 0) {
+            auto const num_sites = static_cast<int>(hoppings.rows());
+            auto const indptr = hoppings.outerIndexPtr();
+            auto const indices = hoppings.innerIndexPtr();
+            for (auto row = 0; row < num_sites; ++row) {
+                for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                    if (indices[n] == row) { continue; }
+                    ++offsets[row + 1];
+                    ++offsets[indices[n] + 1];
+                }
             }
-            return nz;
-        }();
-        auto boundary_matrix_view = compressed_inserter(boundary.hoppings, reserve_nonzeros);
+            std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+            neighbors.resize(offsets.back());
+            auto fill = std::vector<int>(offsets.begin(), offsets.end() - 1);
+            for (auto row = 0; row < num_sites; ++row) {
+                for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                    auto const col = indices[n];
+                    if (col == row) { continue; }
+                    neighbors[fill[row]++] = col;
+                    neighbors[fill[col]++] = row;
+                }
+            }
+        }
 
-        for (auto const& site : foundation[translation.boundary_slice]) {
-            if (!site.is_valid())
-                continue;
+        int size() const { return static_cast<int>(offsets.size()) - 1; }
+        int degree(int i) const { return offsets[i + 1] - offsets[i]; }
+        /// Ties are broken by index to keep the result deterministic
+        bool is_lower_degree(int a, int b) const {
+            return degree(a) < degree(b) || (degree(a) == degree(b) && a < b);
+        }
+    };
 
-            boundary_matrix_view.start_row(hamiltonian_indices[site]);
+    /// Breadth-first search from `start` (Cuthill-McKee): the unvisited neighbours of each site
+    /// are appended to `order` by increasing degree. The visited sites are marked with `id`.
+    /// Returns the number of levels, `last_level` is the position in `order` of the last one.
+    int cuthill_mckee(Graph const& graph, int start, std::vector<int>& mark, int id,
+                      std::vector<int>& order, std::size_t& last_level) {
+        auto const by_degree = [&](int a, int b) { return graph.is_lower_degree(a, b); };
+
+        order.push_back(start);
+        mark[start] = id;
+        auto num_levels = 0;
+        for (auto k = order.size() - 1; k < order.size(); ++num_levels) {
+            auto const level_end = order.size();
+            last_level = k;
+            for (; k < level_end; ++k) {
+                auto const first_new = order.size();
+                auto const site = order[k];
+                for (auto n = graph.offsets[site]; n < graph.offsets[site + 1]; ++n) {
+                    auto const neighbor = graph.neighbors[n];
+                    if (mark[neighbor] != id) {
+                        mark[neighbor] = id;
+                        order.push_back(neighbor);
+                    }
+                }
+                std::sort(order.begin() + static_cast<std::ptrdiff_t>(first_new), order.end(),
+                          by_degree);
+            }
+        }
+        return num_levels;
+    }
 
-            auto const shifted_site = site.shifted(translation.shift_index);
-            // the site is shifted to the opposite edge of the translation unit
-            shifted_site.for_each_neighbour([&](Site neighbor, Hopping hopping) {
-                auto const neighbor_index = hamiltonian_indices[neighbor];
-                if (neighbor_index < 0)
-                    return; // invalid
+    ArrayXi rcm_order(SparseMatrixX<hop_id> const& hoppings) {
+        auto const graph = Graph(hoppings);
+        auto const num_sites = graph.size();
+        auto const by_degree = [&](int a, int b) { return graph.is_lower_degree(a, b); };
+
+        auto candidates = std::vector<int>(num_sites);
+        std::iota(candidates.begin(), candidates.end(), 0);
+        std::sort(candidates.begin(), candidates.end(), by_degree);
+
+        constexpr auto done = -2;
+        auto mark = std::vector<int>(num_sites, -1);
+        auto order = std::vector<int>();
+        order.reserve(num_sites);
+        auto trial = std::vector<int>();
+        auto trial_id = 0;
+        auto last_level = std::size_t{0};
+
+        // Each connected component starts from a pseudo-peripheral site (George-Liu): the
+        // search is repeated from the far end for as long as that adds more levels
+        for (auto candidate : candidates) {
+            if (mark[candidate] == done) { continue; }
+
+            auto start = candidate;
+            auto num_levels = 0;
+            for (auto attempt = 0; attempt < 8; ++attempt) {
+                trial.clear();
+                auto const levels = cuthill_mckee(graph, start, mark, ++trial_id, trial,
+                                                  last_level);
+                if (levels <= num_levels) { break; }
+                num_levels = levels;
+                start = *std::min_element(trial.begin() + static_cast<std::ptrdiff_t>(last_level),
+                                          trial.end(), by_degree);
+            }
+            cuthill_mckee(graph, start, mark, done, order, last_level);
+        }
+
+        std::reverse(order.begin(), order.end());
+        return Eigen::Map<ArrayXi const>(order.data(), num_sites);
+    }
 
-                boundary_matrix_view.insert(neighbor_index, hopping.id);
+    SparseMatrixX<hop_id> permuted(SparseMatrixX<hop_id> const& m, ArrayXi const& order,
+                                   ArrayXi const& new_indices) {
+        auto result = SparseMatrixX<hop_id>(m.rows(), m.cols());
+        auto inserter = compressed_inserter(result, static_cast<int>(m.nonZeros()));
+        auto const indptr = m.outerIndexPtr();
+        auto const indices = m.innerIndexPtr();
+        auto const data = m.valuePtr();
+        for (auto row = 0; row < m.rows(); ++row) {
+            inserter.start_row(row);
+            auto const old_row = order[row];
+            for (auto n = indptr[old_row]; n < indptr[old_row + 1]; ++n) {
+                inserter.insert(new_indices[indices[n]], data[n]);
+            }
+        }
+        inserter.compress();
+        return result;
+    }
+
+    /// Call `lambda(i, j)` for each hopping, including the periodic boundaries
+    template<class F>
+    void for_each_hopping(System const& system, F lambda) {
+        auto matrices = std::vector<SparseMatrixX<hop_id> const*>{&system.hoppings};
+        for (auto const& boundary : system.boundaries) {
+            matrices.push_back(&boundary.hoppings);
+        }
+        for (auto const m : matrices) {
+            auto const indptr = m->outerIndexPtr();
+            auto const indices = m->innerIndexPtr();
+            for (auto row = 0; row < m->outerSize(); ++row) {
+                for (auto n = indptr[row]; n < indptr[row + 1]; ++n) {
+                    lambda(row, indices[n]);
+                }
+            }
+        }
+    }
+
+    /// Move element `i` to `new_index[i]` and drop the ones with `new_index[i] < 0`.
+    /// The new index is never larger than the old one, so everything moves in place.
+    template<class T>
+    void compress(ArrayX<T>& v, ArrayXi const& new_index, int new_size) {
+        for (auto i = 0; i < new_index.size(); ++i) {
+            if (new_index[i] >= 0) { v[new_index[i]] = v[i]; }
+        }
+        v.conservativeResize(new_size);
+    }
+} // anonymous namespace
+
+ArrayXi site_order(System const& system, Foundation const& foundation,
+                   HamiltonianIndices const& indices, SiteOrder order) {
+    switch (order) {
+        case SiteOrder::UnitCell: return unit_cell_order(foundation, indices);
+        case SiteOrder::RCM: return rcm_order(system.hoppings);
+        case SiteOrder::Morton: {
+            auto buffer = CartesianArray();
+            return morton_order(system.expanded_positions(buffer));
+        }
+        default: {
+            auto identity = ArrayXi(system.num_sites());
+            std::iota(identity.data(), identity.data() + identity.size(), 0);
+            return identity;
+        }
+    }
+}
+
+void reorder_sites(System& system, ArrayXi const& order) {
+    auto const num_sites = system.num_sites();
+    assert(order.size() == num_sites);
+    auto new_indices = ArrayXi(num_sites);
+    for (auto i = 0; i < num_sites; ++i) {
+        new_indices[order[i]] = i;
+    }
+
+    auto const permute = [&](ArrayXf& v) {
+        ArrayXf const previous = v;
+        for (auto i = 0; i < num_sites; ++i) { v[i] = previous[order[i]]; }
+    };
+    if (system.compact.empty()) {
+        system.positions.for_each(permute);
+    } else {
+        ArrayXi const cells = system.compact.cells;
+        for (auto i = 0; i < num_sites; ++i) {
+            system.compact.cells[i] = cells[order[i]];
+        }
+    }
+    ArrayX<sub_id> const sublattices = system.sublattices;
+    for (auto i = 0; i < num_sites; ++i) {
+        system.sublattices[i] = sublattices[order[i]];
+    }
+
+    system.cached_spatial_index.reset();
+    system.hoppings = permuted(system.hoppings, order, new_indices);
+    for (auto& boundary : system.boundaries) {
+        boundary.hoppings = permuted(boundary.hoppings, order, new_indices);
+    }
+
+    // Compose with a previous reordering so the result always refers to the foundation
+    if (system.original_indices.size() == num_sites) {
+        ArrayXi const previous = system.original_indices;
+        for (auto i = 0; i < num_sites; ++i) {
+            system.original_indices[i] = previous[order[i]];
+        }
+    } else {
+        system.original_indices = order;
+    }
+}
+
+ArrayXi removal_index(System const& system, std::vector<int> const& indices,
+                      int min_neighbors) {
+    enum State : std::int8_t { Kept, JustRemoved, Removed };
+    auto const num_sites = system.num_sites();
+    auto state = ArrayX<std::int8_t>::Constant(num_sites, Kept).eval();
+    auto just_removed = 0;
+    for (auto const i : indices) {
+        if (i < 0 || i >= num_sites) {
+            throw std::out_of_range(fmt::format("Site index {} is out of range: the system "
+                                                "has {} sites", i, num_sites));
+        }
+        if (state[i] == Kept) {
+            state[i] = JustRemoved;
+            ++just_removed;
+        }
+    }
+
+    // Peel off the sites left with too few neighbors: each round is one pass over the
+    // hoppings which takes away the neighbors removed in the previous round
+    if (min_neighbors > 0) {
+        auto neighbors = ArrayXi::Zero(num_sites).eval();
+        for_each_hopping(system, [&](int i, int j) { ++neighbors[i]; ++neighbors[j]; });
+
+        auto touched = std::vector<int>();
+        while (just_removed > 0) {
+            touched.clear();
+            for_each_hopping(system, [&](int i, int j) {
+                if (state[i] == JustRemoved && state[j] == Kept) {
+                    --neighbors[j];
+                    touched.push_back(j);
+                } else if (state[j] == JustRemoved && state[i] == Kept) {
+                    --neighbors[i];
+                    touched.push_back(i);
+                }
             });
+            for (auto i = 0; i < num_sites; ++i) {
+                if (state[i] == JustRemoved) { state[i] = Removed; }
+            }
+            just_removed = 0;
+            for (auto const i : touched) {
+                if (state[i] == Kept && neighbors[i] < min_neighbors) {
+                    state[i] = JustRemoved;
+                    ++just_removed;
+                }
+            }
         }
-        boundary_matrix_view.compress();
+    }
 
-        if (boundary.hoppings.nonZeros() > 0)
-            system.boundaries.emplace_back();
+    auto new_index = ArrayXi(num_sites);
+    for (auto i = 0, n = 0; i < num_sites; ++i) {
+        new_index[i] = state[i] == Kept ? n++ : -1;
     }
-    system.boundaries.pop_back();
+    return new_index;
 }
 
-void add_extra_hoppings(System& system, HoppingGenerator const& gen) {
+void remove_sites(System& system, ArrayXi const& new_index) {
+    auto const num_sites = system.num_sites();
+    assert(new_index.size() == num_sites);
+    auto const new_size = num_sites - static_cast<int>((new_index < 0).count());
+
+    if (system.compact.empty()) {
+        system.positions.for_each([&](ArrayXf& v) { compress(v, new_index, new_size); });
+    } else {
+        compress(system.compact.cells, new_index, new_size);
+    }
+    system.lattice_positions.for_each([&](ArrayXf& v) {
+        if (v.size() == num_sites) { compress(v, new_index, new_size); }
+    });
+    compress(system.sublattices, new_index, new_size);
+
+    if (system.original_indices.size() != num_sites) {
+        system.original_indices.resize(num_sites);
+        std::iota(system.original_indices.data(),
+                  system.original_indices.data() + num_sites, 0);
+    }
+    compress(system.original_indices, new_index, new_size);
+
+    system.cached_spatial_index.reset();
+    system.hoppings = sparse::remove_rows_and_cols(system.hoppings, new_index);
+    for (auto& boundary : system.boundaries) {
+        boundary.hoppings = sparse::remove_rows_and_cols(boundary.hoppings, new_index);
+    }
+    system.has_unbalanced_hoppings = is_unbalanced(system.hoppings);
+}
+
+bool compact_positions(System& system, Foundation const& foundation,
+                       HamiltonianIndices const& indices) {
+    auto const& size = foundation.get_size();
+    auto const box_sites = static_cast<std::int64_t>(size.prod())
+                           * foundation.get_num_sublattices();
+    if (box_sites > std::numeric_limits<int>::max()) {
+        return false;
+    }
+
+    // Foundation order first, then follow a possible reordering of the system
+    auto cells = ArrayXi(system.num_sites());
+    for (auto const& site : foundation) {
+        auto const i = indices[site];
+        if (i < 0) { continue; }
+
+        auto const& index = site.get_index();
+        cells[i] = ((site.get_sublattice() * size[2] + index[2]) * size[1] + index[1])
+                   * size[0] + index[0];
+    }
+    if (system.original_indices.size() == system.num_sites()) {
+        ArrayXi const previous = cells;
+        for (auto i = 0; i < system.num_sites(); ++i) {
+            cells[i] = previous[system.original_indices[i]];
+        }
+    }
+
+    auto const& lattice = foundation.get_lattice();
+    system.compact.origin = lattice.calc_position(foundation.get_bounds().first);
+    system.compact.size = size;
+    system.compact.cells = std::move(cells);
+    system.positions = CartesianArray();
+    return true;
+}
+
+void add_extra_hoppings(System& system, HoppingGenerators const& generators, int num_threads) {
     auto const& lattice = system.lattice;
-    auto const pairs = gen.make(system.positions, {system.sublattices, lattice.get_sites().id});
+    auto const size = system.num_sites();
+    auto buffer = CartesianArray();
+    auto const& positions = system.expanded_positions(buffer);
+    auto const sublattices = SubIdRef{system.sublattices, lattice.get_sites().id};
+
+    // Python generators need the GIL so they stay on this thread, the rest run concurrently
+    auto results = std::vector<HoppingGenerator::Result>(generators.size());
+    auto errors = std::vector<std::exception_ptr>(generators.size());
+    auto const num_generators = static_cast<int>(generators.size());
+    for (auto g = 0; g < num_generators; ++g) {
+        if (!generators[g].is_thread_safe || num_threads <= 1) {
+            results[g] = generators[g].make(positions, sublattices);
+        }
+    }
+    ThreadPool pool(num_threads);
+    if (num_threads > 1) {
+        pool.run([&](int thread_id) {
+            for (auto g = thread_id; g < num_generators; g += pool.size()) {
+                if (!generators[g].is_thread_safe) { continue; }
+                try {
+                    results[g] = generators[g].make(positions, sublattices);
+                } catch (...) {
+                    errors[g] = std::current_exception();
+                }
+            }
+        });
+    }
+    for (auto const& error : errors) {
+        if (error) { std::rethrow_exception(error); }
+    }
 
-    system.hoppings.reserve([&]{
-        auto reserve = ArrayXi(ArrayXi::Zero(system.num_sites()));
+    // Bucket the new pairs by row: upper triangular format, in the order of the generators
+    auto new_outer = std::vector<int>(size + 1, 0);
+    for (auto const& pairs : results) {
         for (auto i = 0; i < pairs.from.size(); ++i) {
-            auto const row = std::min(pairs.from[i], pairs.to[i]); // upper triangular format
-            reserve[row] += 1;
+            ++new_outer[std::min(pairs.from[i], pairs.to[i]) + 1];
         }
-        return reserve;
-    }());
+    }
+    std::partial_sum(new_outer.begin(), new_outer.end(), new_outer.begin());
 
-    auto const hopping_id = [&]{
+    using Entry = std::pair<int, hop_id>; // column and hopping ID
+    auto entries = std::vector<Entry>(new_outer[size]);
+    {
+        auto fill = std::vector<int>(new_outer.begin(), new_outer.end() - 1);
         auto const& ids = lattice.get_hoppings().id;
-        auto const it = ids.find(gen.name);
-        assert(it != ids.end());
-        return it->second;
-    }();
+        for (auto g = 0; g < num_generators; ++g) {
+            auto const it = ids.find(generators[g].name);
+            assert(it != ids.end());
+            auto const& pairs = results[g];
+            for (auto i = 0; i < pairs.from.size(); ++i) {
+                auto const m = std::min(pairs.from[i], pairs.to[i]);
+                auto const n = std::max(pairs.from[i], pairs.to[i]);
+                entries[fill[m]++] = {n, it->second};
+            }
+        }
+    }
 
-    for (auto i = 0; i < pairs.from.size(); ++i) {
-        auto m = pairs.from[i];
-        auto n = pairs.to[i];
-        if (m > n) { // ensure that only the upper triangle of the matrix is populated
-            std::swap(m, n);
+    // Sort the new entries of each row and count the merged row lengths. A repeated column
+    // takes the last value: later generators override earlier ones and the lattice.
+    auto const& hoppings = system.hoppings;
+    auto const outer = hoppings.outerIndexPtr();
+    auto const inner = hoppings.innerIndexPtr();
+    auto const values = hoppings.valuePtr();
+    auto new_count = std::vector<int>(size);
+    SparseMatrixX<hop_id> merged(size, size);
+    auto const merged_outer = merged.outerIndexPtr();
+    pool.parallel_for(0, size, [&](int, int start, int end) {
+        for (auto row = start; row < end; ++row) {
+            auto const first = entries.begin() + new_outer[row];
+            auto const last = entries.begin() + new_outer[row + 1];
+            std::stable_sort(first, last, [](Entry const& a, Entry const& b) {
+                return a.first < b.first;
+            });
+            auto unique_end = first;
+            for (auto it = first; it != last; ++it) {
+                if (it + 1 != last && (it + 1)->first == it->first) { continue; }
+                *unique_end++ = *it;
+            }
+            new_count[row] = static_cast<int>(unique_end - first);
+
+            auto count = new_count[row];
+            for (auto k = outer[row]; k < outer[row + 1]; ++k) {
+                if (!std::binary_search(first, unique_end, Entry{inner[k], 0},
+                                        [](Entry const& a, Entry const& b) {
+                                            return a.first < b.first;
+                                        })) {
+                    ++count;
+                }
+            }
+            merged_outer[row + 1] = count;
         }
-        system.hoppings.coeffRef(m, n) = hopping_id;
+    });
+
+    merged_outer[0] = 0;
+    std::partial_sum(merged_outer + 1, merged_outer + size + 1, merged_outer + 1);
+    merged.resizeNonZeros(merged_outer[size]);
+
+    auto const merged_inner = merged.innerIndexPtr();
+    auto const merged_values = merged.valuePtr();
+    pool.parallel_for(0, size, [&](int, int start, int end) {
+        for (auto row = start; row < end; ++row) {
+            auto k = outer[row];
+            auto const k_end = outer[row + 1];
+            auto e = new_outer[row];
+            auto const e_end = new_outer[row] + new_count[row];
+            for (auto n = merged_outer[row]; n < merged_outer[row + 1]; ++n) {
+                if (e == e_end || (k < k_end && inner[k] < entries[e].first)) {
+                    merged_inner[n] = inner[k];
+                    merged_values[n] = values[k++];
+                } else {
+                    if (k < k_end && inner[k] == entries[e].first) { ++k; } // overridden
+                    merged_inner[n] = entries[e].first;
+                    merged_values[n] = entries[e++].second;
+                }
+            }
+        }
+    });
+    system.hoppings.swap(merged);
+}
+
+bool is_unbalanced(SparseMatrixX<hop_id> const& hoppings) {
+    // The rows may be stored with the same length (e.g. ELLPACK padding) as long as
+    // the standard deviation of the lengths is within this fraction of the mean
+    constexpr auto max_relative_deviation = 0.5;
+
+    auto const nnz = nonzeros_per_row(hoppings);
+    if (nnz.size() == 0) {
+        return false;
     }
+    auto const mean = nnz.cast<double>().mean();
+    auto const variance = (nnz.cast<double>() - mean).square().mean();
+    return variance > max_relative_deviation * max_relative_deviation * mean * mean;
 }
 
 } // namespace detail
@@ -0,0 +1,133 @@
+#include "utils/Affinity.hpp"
+
+#include <algorithm>
+#include <mutex>
+
+#ifdef __linux__
+# include <pthread.h>
+# include <sched.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+# include <cstring>
+#endif
+
+namespace cpb {
+namespace {
+
+#ifdef __linux__
+/// The CPU set of the main thread: the threads of this library never pin it
+bool get_process_cpus(cpu_set_t& cpus) {
+    return sched_getaffinity(getpid(), sizeof(cpus), &cpus) == 0;
+}
+#endif
+
+std::mutex reservation_mutex;
+std::vector<int> num_reservations; ///< of each CPU of the process, see `CpuReservation`
+
+} // anonymous namespace
+
+ScopedAffinity::ScopedAffinity(int n) {
+#ifdef __linux__
+    cpu_set_t current, allowed;
+    if (n < 0 || pthread_getaffinity_np(pthread_self(), sizeof(current), &current) != 0
+        || !get_process_cpus(allowed)) {
+        return;
+    }
+    auto const count = CPU_COUNT(&allowed);
+    if (count <= 1) {
+        return; // nothing to choose from
+    }
+
+    auto remaining = n % count;
+    auto cpu = 0;
+    for (; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && remaining-- == 0) {
+            break;
+        }
+    }
+
+    cpu_set_t single;
+    CPU_ZERO(&single);
+    CPU_SET(cpu, &single);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(single), &single) == 0) {
+        auto const bytes = reinterpret_cast<unsigned char const*>(&current);
+        previous.assign(bytes, bytes + sizeof(current));
+    }
+#else
+    static_cast<void>(n);
+#endif
+}
+
+ScopedAffinity::~ScopedAffinity() {
+#ifdef __linux__
+    if (is_pinned()) {
+        cpu_set_t allowed;
+        std::memcpy(&allowed, previous.data(), sizeof(allowed));
+        pthread_setaffinity_np(pthread_self(), sizeof(allowed), &allowed);
+    }
+#endif
+}
+
+CpuReservation::CpuReservation(int count)
+    : count(std::max(count, 0)), num_cpus(num_process_cpus()) {
+    std::lock_guard<std::mutex> lk(reservation_mutex);
+    if (static_cast<int>(num_reservations.size()) < num_cpus) {
+        num_reservations.resize(static_cast<size_t>(num_cpus), 0);
+    }
+
+    // The window of `count` consecutive CPUs (wrapping around) with the fewest reservations
+    auto const window = std::min(this->count, num_cpus);
+    auto min_load = -1;
+    for (auto start = 0; start < num_cpus; ++start) {
+        auto load = 0;
+        for (auto i = 0; i < window; ++i) {
+            load += num_reservations[(start + i) % num_cpus];
+        }
+        if (min_load < 0 || load < min_load) {
+            min_load = load;
+            first = start;
+        }
+    }
+
+    for (auto i = 0; i < this->count; ++i) {
+        ++num_reservations[(first + i) % num_cpus];
+    }
+}
+
+CpuReservation::~CpuReservation() {
+    std::lock_guard<std::mutex> lk(reservation_mutex);
+    for (auto i = 0; i < count; ++i) {
+        --num_reservations[(first + i) % num_cpus];
+    }
+}
+
+int num_process_cpus() {
+#ifdef __linux__
+    cpu_set_t cpus;
+    if (get_process_cpus(cpus)) {
+        return std::max(CPU_COUNT(&cpus), 1);
+    }
+#endif
+    return 1;
+}
+
+void reset_affinity() {
+#ifdef __linux__
+    cpu_set_t cpus;
+    if (get_process_cpus(cpus)) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+#endif
+}
+
+int current_numa_node() {
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+        return static_cast<int>(node);
+    }
+#endif
+    return 0;
+}
+
+} // namespace cpb
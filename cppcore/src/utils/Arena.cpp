@@ -0,0 +1,54 @@
+#include "utils/Arena.hpp"
+
+#ifdef __linux__
+# include <sys/mman.h>
+# include <unistd.h>
+# include <cstdint>
+#endif
+
+#include <vector>
+
+namespace cpb {
+namespace {
+    thread_local std::vector<std::function<void()>> arena_clears;
+}
+
+namespace detail {
+
+void advise_huge_pages(void* data, std::size_t bytes) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    // Transparent huge pages are 2 MiB: it's not worth it for anything smaller
+    constexpr auto huge_page = std::size_t{2} << 20;
+    if (bytes < huge_page) {
+        return;
+    }
+
+    // `madvise()` needs a page-aligned start, so only the interior pages are advised
+    auto const page = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+    auto const begin = reinterpret_cast<std::uintptr_t>(data);
+    auto const aligned_begin = (begin + page - 1) / page * page;
+    auto const aligned_end = (begin + bytes) / page * page;
+    if (aligned_end > aligned_begin) {
+        // Failure is fine, e.g. huge pages are disabled: it's just a hint
+        madvise(reinterpret_cast<void*>(aligned_begin), aligned_end - aligned_begin,
+                MADV_HUGEPAGE);
+    }
+#else
+    (void)data;
+    (void)bytes;
+#endif
+}
+
+void register_arena(std::function<void()> clear) {
+    arena_clears.push_back(std::move(clear));
+}
+
+} // namespace detail
+
+void release_arenas() {
+    for (auto const& clear : arena_clears) {
+        clear();
+    }
+}
+
+} // namespace cpb
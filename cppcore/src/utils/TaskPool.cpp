@@ -0,0 +1,130 @@
+#include "utils/TaskPool.hpp"
+#include "utils/Affinity.hpp"
+#include "utils/Arena.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+#ifndef _WIN32
+# include <pthread.h>
+#endif
+
+namespace cpb {
+namespace {
+
+std::atomic<TaskPool*> shared_pool{nullptr};
+
+#ifndef _WIN32
+/// The threads of the shared pool don't exist in a forked child and its mutex may have been
+/// locked by one of them: the old pool is abandoned (never destroyed) and a new one is made
+/// on demand
+void reset_shared_pool_in_child() {
+    shared_pool.store(nullptr);
+}
+#endif
+
+} // anonymous namespace
+
+TaskPool::TaskPool(int num_threads, int max_threads) : max_threads(std::max(max_threads, 0)) {
+    num_threads = std::max(num_threads, 1);
+    workers.reserve(num_threads);
+    for (auto i = 0; i < num_threads; ++i) {
+        workers.emplace_back(&TaskPool::work, this);
+    }
+}
+
+TaskPool::~TaskPool() {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        is_stopping = true;
+    }
+    cv.notify_all();
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void TaskPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        queue.push_back(std::move(task));
+    }
+    cv.notify_one();
+}
+
+void TaskPool::start(std::vector<std::function<void()>> tasks) {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        auto const num_idle = static_cast<int>(workers.size()) - num_busy
+                              - static_cast<int>(queue.size());
+        auto num_new = static_cast<int>(tasks.size()) - std::max(num_idle, 0);
+        if (max_threads > 0) {
+            num_new = std::min(num_new, max_threads - static_cast<int>(workers.size()));
+        }
+        for (auto i = 0; i < num_new; ++i) {
+            workers.emplace_back(&TaskPool::work, this);
+        }
+        for (auto& task : tasks) {
+            queue.push_back(std::move(task));
+        }
+    }
+    cv.notify_all();
+}
+
+int TaskPool::num_queued() const {
+    std::lock_guard<std::mutex> lk(mutex);
+    return static_cast<int>(queue.size());
+}
+
+void TaskPool::work() {
+    reset_affinity(); // not the single CPU of a pinned thread which may have created this one
+    while (true) {
+        std::unique_lock<std::mutex> lk(mutex);
+        cv.wait(lk, [&] { return !queue.empty() || is_stopping; });
+        if (queue.empty()) {
+            return; // stopping and nothing left to do
+        }
+        auto task = std::move(queue.front());
+        queue.pop_front();
+        ++num_busy;
+        lk.unlock();
+
+        task();
+
+        lk.lock();
+        --num_busy;
+        if (queue.empty()) {
+            // Going idle: the cached vectors of the last tasks may not be needed for a long time
+            lk.unlock();
+            release_arenas();
+        }
+    }
+}
+
+TaskPool& TaskPool::shared() {
+#ifndef _WIN32
+    static auto const is_registered = pthread_atfork(nullptr, nullptr,
+                                                     reset_shared_pool_in_child) == 0;
+    (void)is_registered;
+#endif
+
+    // Never destroyed: the threads may still be waiting for work when the process exits
+    auto pool = shared_pool.load();
+    if (!pool) {
+        auto const created = new TaskPool(1, max_shared_threads());
+        if (shared_pool.compare_exchange_strong(pool, created)) {
+            pool = created;
+        } else {
+            delete created; // another thread was first: `pool` is its pool
+        }
+    }
+    return *pool;
+}
+
+int TaskPool::max_shared_threads() {
+    auto const num_hardware = static_cast<int>(std::thread::hardware_concurrency());
+    return std::max(4 * num_hardware, 16);
+}
+
+} // namespace cpb
@@ -0,0 +1,128 @@
+#include "utils/ThreadPool.hpp"
+#include "utils/Affinity.hpp"
+#include "utils/TaskPool.hpp"
+#include "support/cppfuture.hpp"
+
+#include <algorithm>
+
+namespace cpb {
+
+constexpr int ThreadPool::min_chunk_size;
+
+ThreadPool::ThreadPool(int num_threads, bool pin_threads)
+    : num_threads(std::max(num_threads, 1)), state(std::make_shared<State>()) {
+    state->claimed.assign(static_cast<size_t>(this->num_threads), 0);
+    if (pin_threads) {
+        cpus = std14::make_unique<CpuReservation>(this->num_threads);
+    }
+
+    auto workers = std::vector<std::function<void()>>();
+    for (auto id = 1; id < this->num_threads; ++id) {
+        auto const shared_state = state;
+        auto const cpu = cpus ? (*cpus)[id] : -1;
+        workers.emplace_back([shared_state, id, cpu]() {
+            work(shared_state, id, cpu);
+        });
+    }
+    TaskPool::shared().start(std::move(workers));
+}
+
+ThreadPool::~ThreadPool() {
+    std::unique_lock<std::mutex> lk(state->mutex);
+    state->is_stopping = true;
+    state->start_cv.notify_all();
+
+    // The workers return to the shared pool. The ones which haven't started yet don't
+    // need to be waited for: they return as soon as they start.
+    state->done_cv.wait(lk, [&] { return state->num_running == 0; });
+}
+
+void ThreadPool::run(std::function<void(int)> const& fn) {
+    if (num_threads == 1) {
+        fn(0);
+        return;
+    }
+
+    auto& s = *state;
+    {
+        std::lock_guard<std::mutex> lk(s.mutex);
+        s.task = &fn;
+        s.num_pending = num_threads - 1;
+        ++s.generation;
+        s.claimed[0] = s.generation;
+    }
+    s.start_cv.notify_all();
+
+    // The calling thread does its share of the work. Even if it throws, the workers
+    // must be done with `fn` before it goes out of scope.
+    call(s, fn, 0);
+
+    // The shares of the workers which didn't pick up the task yet, e.g. still queued
+    std::unique_lock<std::mutex> lk(s.mutex);
+    for (auto id = 1; id < num_threads; ++id) {
+        if (s.claimed[id] == s.generation) {
+            continue;
+        }
+        s.claimed[id] = s.generation;
+        lk.unlock();
+        call(s, fn, id);
+        lk.lock();
+        --s.num_pending;
+    }
+
+    s.done_cv.wait(lk, [&] { return s.num_pending == 0; });
+    s.task = nullptr;
+    if (s.error) {
+        auto const first_error = s.error;
+        s.error = nullptr;
+        std::rethrow_exception(first_error);
+    }
+}
+
+void ThreadPool::call(State& s, std::function<void(int)> const& fn, int thread_id) {
+    try {
+        fn(thread_id);
+    } catch (...) {
+        std::lock_guard<std::mutex> lk(s.mutex);
+        if (!s.error) {
+            s.error = std::current_exception();
+        }
+    }
+}
+
+void ThreadPool::work(std::shared_ptr<State> const& state, int thread_id, int cpu) {
+    auto& s = *state;
+    {
+        std::lock_guard<std::mutex> lk(s.mutex);
+        if (s.is_stopping) {
+            return; // the pool was destroyed while this worker was queued
+        }
+        ++s.num_running;
+    }
+
+    ScopedAffinity const affinity(cpu);
+    std::unique_lock<std::mutex> lk(s.mutex);
+    while (true) {
+        s.start_cv.wait(lk, [&] {
+            return s.claimed[thread_id] != s.generation || s.is_stopping;
+        });
+        if (s.is_stopping) {
+            // Notify while holding the lock: the destructor may return as soon as it wakes
+            --s.num_running;
+            s.done_cv.notify_all();
+            return;
+        }
+        s.claimed[thread_id] = s.generation;
+        auto const& fn = *s.task;
+        lk.unlock();
+
+        call(s, fn, thread_id);
+
+        lk.lock();
+        if (--s.num_pending == 0) {
+            s.done_cv.notify_all();
+        }
+    }
+}
+
+} // namespace cpb
@@ -0,0 +1,111 @@
+#include "utils/Trace.hpp"
+#include "support/format.hpp"
+
+#include <chrono>
+#include <mutex>
+
+namespace cpb { namespace trace {
+
+namespace detail {
+    std::atomic<bool> is_enabled{false};
+}
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    struct Recorder {
+        std::mutex mutex;
+        std::vector<Event> events;
+        std::size_t capacity = std::size_t{1} << 20;
+        std::size_t dropped = 0;
+        std::atomic<Clock::rep> epoch{Clock::now().time_since_epoch().count()};
+        std::atomic<int> num_threads{0};
+    };
+
+    Recorder& recorder() {
+        static Recorder instance;
+        return instance;
+    }
+
+    std::int64_t now() {
+        auto const since_epoch = Clock::duration(Clock::now().time_since_epoch().count()
+                                                 - recorder().epoch.load());
+        return std::chrono::duration_cast<std::chrono::microseconds>(since_epoch).count();
+    }
+
+    int thread_id() {
+        thread_local auto const id = recorder().num_threads++;
+        return id;
+    }
+
+    thread_local int depth = 0;
+} // anonymous namespace
+
+void enable(bool on) {
+    if (on && !detail::is_enabled) {
+        clear();
+    }
+    detail::is_enabled = on;
+}
+
+void clear() {
+    auto& r = recorder();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.events.clear();
+    r.dropped = 0;
+    r.epoch = Clock::now().time_since_epoch().count();
+}
+
+void set_capacity(std::size_t max_events) {
+    auto& r = recorder();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.capacity = max_events;
+}
+
+std::size_t num_dropped() {
+    auto& r = recorder();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    return r.dropped;
+}
+
+std::vector<Event> events() {
+    auto& r = recorder();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    return r.events;
+}
+
+std::string to_chrome_json() {
+    // Complete events ("ph": "X"): the viewer nests them by their start and duration
+    auto json = fmt::MemoryWriter();
+    json << "{\"traceEvents\": [";
+    auto const all_events = events();
+    for (auto i = std::size_t{0}; i < all_events.size(); ++i) {
+        auto const& e = all_events[i];
+        json.write("{}\n{{\"name\": \"{}\", \"cat\": \"cpb\", \"ph\": \"X\", \"ts\": {}, "
+                   "\"dur\": {}, \"pid\": 0, \"tid\": {}, \"args\": {{\"depth\": {}}}}}",
+                   i == 0 ? "" : ",", e.name, e.start, e.duration, e.thread, e.depth);
+    }
+    json << "\n], \"displayTimeUnit\": \"ms\"}\n";
+    return json.str();
+}
+
+void Span::begin() {
+    ++depth;
+    start = now();
+}
+
+void Span::end() {
+    auto const finish = now();
+    --depth;
+    auto const event = Event{name, start, finish - start, thread_id(), depth};
+
+    auto& r = recorder();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    if (r.events.size() < r.capacity) {
+        r.events.push_back(event);
+    } else {
+        ++r.dropped;
+    }
+}
+
+}} // namespace cpb::trace
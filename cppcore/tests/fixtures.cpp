@@ -1,4 +1,17 @@
 #include "fixtures.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _WIN32
+# include <direct.h>
+# include <io.h>
+#else
+# include <dirent.h>
+# include <unistd.h>
+#endif
 using namespace cpb;
 
 namespace lattice {
@@ -160,3 +173,54 @@ cpb::HoppingModifier force_complex_numbers() {
 }
 
 } // namespace field
+
+namespace tmp {
+
+Directory::Directory() {
+#ifdef _WIN32
+    auto const name = _tempnam(nullptr, "pybinding-test-");
+    if (name) {
+        dir = name;
+        std::free(name);
+    }
+    if (dir.empty() || _mkdir(dir.c_str()) != 0) {
+        throw std::runtime_error("Could not create a temporary directory");
+    }
+#else
+    auto const base = std::getenv("TMPDIR");
+    auto const pattern = std::string(base && *base ? base : "/tmp") + "/pybinding-test-XXXXXX";
+    auto buffer = std::vector<char>(pattern.begin(), pattern.end());
+    buffer.push_back('\0');
+    if (!mkdtemp(buffer.data())) {
+        throw std::runtime_error("Could not create a temporary directory");
+    }
+    dir = buffer.data();
+#endif
+}
+
+Directory::~Directory() {
+#ifdef _WIN32
+    auto info = _finddata_t();
+    auto const handle = _findfirst(file("*").c_str(), &info);
+    if (handle != -1) {
+        do {
+            std::remove(file(info.name).c_str()); // fails for "." and ".."
+        } while (_findnext(handle, &info) == 0);
+        _findclose(handle);
+    }
+    _rmdir(dir.c_str());
+#else
+    if (auto const d = opendir(dir.c_str())) {
+        while (auto const entry = readdir(d)) {
+            auto const name = std::string(entry->d_name);
+            if (name != "." && name != "..") {
+                std::remove(file(name).c_str());
+            }
+        }
+        closedir(d);
+    }
+    rmdir(dir.c_str());
+#endif
+}
+
+} // namespace tmp
@@ -1,6 +1,8 @@
 #pragma once
 #include "Model.hpp"
 
+#include <string>
+
 namespace lattice {
 
 cpb::Lattice square(float a = 1.f, float t = 1.f);
@@ -36,3 +38,24 @@ cpb::HoppingModifier force_double_precision();
 cpb::HoppingModifier force_complex_numbers();
 
 } // namespace field
+
+namespace tmp {
+
+/// A new empty directory in the temporary directory of the system, removed with its files
+class Directory {
+public:
+    Directory();
+    ~Directory();
+
+    Directory(Directory const&) = delete;
+    Directory& operator=(Directory const&) = delete;
+
+    std::string const& path() const { return dir; }
+    /// Full path of a file in this directory
+    std::string file(std::string const& name) const { return dir + "/" + name; }
+
+private:
+    std::string dir;
+};
+
+} // namespace tmp
@@ -1,6 +1,13 @@
 #include <catch.hpp>
 
 #include "compute/lanczos.hpp"
+#include "solver/Bands.hpp"
+#include "solver/ChebFilter.hpp"
+#include "solver/Dense.hpp"
+#include "solver/DirectGreens.hpp"
+#include "solver/Lanczos.hpp"
+#include <Eigen/Eigenvalues>
+#include <Eigen/LU>
 #include "fixtures.hpp"
 using namespace cpb;
 
@@ -22,3 +29,344 @@ TEST_CASE("Lanczos", "[lanczos]") {
                                        [&](int c) { return c == loop_counters.front(); });
     REQUIRE(all_equal);
 }
+
+TEST_CASE("Batched band calculation", "[bands]") {
+    auto model = Model(graphene::monolayer(), Primitive(5, 5), TranslationalSymmetry(1, 1));
+    auto const kpoints = std::vector<Cartesian>{{0, 0, 0}, {0.5f, 0, 0}, {0.5f, 1.5f, 0}};
+    auto const bands = calc_bands(model, kpoints, /*num_threads*/2);
+    REQUIRE(bands.rows() == 3);
+    REQUIRE(bands.cols() == model.system()->num_sites());
+
+    for (auto n = 0; n < 3; ++n) {
+        model.set_wave_vector(kpoints[n]);
+        auto const& h = ham::get_reference<std::complex<float>>(model.hamiltonian());
+        auto const dense = MatrixX<std::complex<float>>(h);
+        auto const solver = Eigen::SelfAdjointEigenSolver<MatrixX<std::complex<float>>>(
+            dense, Eigen::EigenvaluesOnly
+        );
+        VectorX<double> const expected = solver.eigenvalues().cast<double>();
+        REQUIRE(bands.row(n).matrix().transpose().isApprox(expected, 1e-5));
+    }
+}
+
+TEST_CASE("Thick-restart Lanczos solver", "[lanczos]") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(1.4f, 1.2f),
+                             field::linear_onsite(0.5f));
+    auto const h = ham::get_shared_ptr<float>(model.hamiltonian());
+    auto const size = static_cast<int>(h->rows());
+
+    auto const dense = MatrixX<double>(h->cast<double>());
+    ArrayX<double> const all = Eigen::SelfAdjointEigenSolver<MatrixX<double>>(
+        dense, Eigen::EigenvaluesOnly
+    ).eigenvalues();
+
+    auto config = LanczosConfig();
+    config.num_eigenvalues = 4;
+    config.sigma = 0.3;
+    auto distance = std::vector<double>(all.data(), all.data() + size);
+    std::sort(distance.begin(), distance.end(), [&](double a, double b) {
+        return std::abs(a - config.sigma) < std::abs(b - config.sigma);
+    });
+    auto expected = ArrayX<double>(4);
+    std::copy(distance.begin(), distance.begin() + 4, expected.data());
+    std::sort(expected.data(), expected.data() + 4);
+
+    auto const check = [&](LanczosConfig const& c) {
+        Lanczos<float> solver(h, c);
+        solver.solve();
+        auto const ref = solver.eigenvalues();
+        REQUIRE(ref.rows * ref.cols == 4);
+        auto const values = Eigen::Map<ArrayX<float> const>(static_cast<float const*>(ref.data),
+                                                           4);
+        REQUIRE(values.cast<double>().isApprox(expected, 1e-4));
+        REQUIRE(solver.report(true).find("Lanczos") != std::string::npos);
+    };
+
+    SECTION("Shift-invert") {
+        check(config);
+    }
+
+    SECTION("Folded spectrum, multithreaded") {
+        config.mode = LanczosMode::Folded;
+        config.num_threads = 2;
+        check(config);
+    }
+
+    SECTION("Small subspace needs restarts") {
+        config.subspace_size = 6;
+        check(config);
+    }
+}
+
+TEST_CASE("Folded Lanczos at a zero mode", "[lanczos]") {
+    // An open chain with an odd number of sites has an exact zero mode at the default sigma
+    auto const size = 51;
+    auto chain = std::make_shared<SparseMatrixX<double>>(size, size);
+    for (auto i = 0; i + 1 < size; ++i) {
+        chain->insert(i, i + 1) = -1;
+        chain->insert(i + 1, i) = -1;
+    }
+    chain->makeCompressed();
+
+    ArrayX<double> all = Eigen::SelfAdjointEigenSolver<MatrixX<double>>(
+        MatrixX<double>(*chain), Eigen::EigenvaluesOnly
+    ).eigenvalues();
+    std::sort(all.data(), all.data() + size, [](double a, double b) {
+        return std::abs(a) < std::abs(b);
+    });
+    REQUIRE(std::abs(all[0]) < 1e-12);
+    ArrayX<double> expected = all.head(3);
+    std::sort(expected.data(), expected.data() + 3);
+
+    auto config = LanczosConfig();
+    config.num_eigenvalues = 3;
+    config.mode = LanczosMode::Folded;
+    Lanczos<double> solver(chain, config);
+    solver.solve();
+    auto const ref = solver.eigenvalues();
+    auto const values = Eigen::Map<ArrayX<double> const>(static_cast<double const*>(ref.data), 3);
+    REQUIRE((values - expected).abs().maxCoeff() < 1e-6);
+}
+
+TEST_CASE("Chebyshev-filtered subspace iteration", "[chebfilter]") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(1.4f, 1.2f),
+                             field::linear_onsite(0.5f));
+    auto const h = ham::get_shared_ptr<float>(model.hamiltonian());
+
+    auto const dense = MatrixX<double>(h->cast<double>());
+    ArrayX<double> const all = Eigen::SelfAdjointEigenSolver<MatrixX<double>>(
+        dense, Eigen::EigenvaluesOnly
+    ).eigenvalues();
+
+    auto config = ChebFilterConfig();
+    config.energy_min = -0.5;
+    config.energy_max = 1.0;
+    auto expected = std::vector<double>();
+    for (auto i = 0; i < all.size(); ++i) {
+        if (all[i] >= config.energy_min && all[i] <= config.energy_max) {
+            expected.push_back(all[i]);
+        }
+    }
+    auto const num_expected = static_cast<int>(expected.size());
+    REQUIRE(num_expected > 2);
+
+    auto const check = [&](ChebFilterConfig const& c) {
+        ChebFilter<float> solver(h, c);
+        solver.solve();
+        auto const ref = solver.eigenvalues();
+        REQUIRE(ref.rows * ref.cols == num_expected);
+        auto const values = Eigen::Map<ArrayX<float> const>(static_cast<float const*>(ref.data),
+                                                           num_expected);
+        REQUIRE(values.cast<double>().isApprox(eigen_cast<ArrayX>(expected), 1e-4));
+        return solver.report(false);
+    };
+
+    SECTION("Good size guess") {
+        config.initial_size_guess = 3 * num_expected / 2 + 1;
+        check(config);
+    }
+
+    SECTION("The subspace is enlarged if the guess is too small, multithreaded") {
+        config.initial_size_guess = 2;
+        config.num_threads = 2;
+        REQUIRE(check(config).find("Resized") != std::string::npos);
+    }
+
+    SECTION("The filter needs at least the first two coefficients") {
+        config.initial_size_guess = num_expected;
+        config.filter_degree = 1;
+        REQUIRE_THROWS_WITH(ChebFilter<float>(h, config).solve(),
+                            Catch::Contains("at least 2"));
+    }
+}
+
+TEST_CASE("Dense eigensolver", "[dense]") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(1.4f, 1.2f),
+                             field::linear_onsite(0.5f));
+    auto const h = ham::get_shared_ptr<float>(model.hamiltonian());
+    auto const size = static_cast<int>(h->rows());
+
+    auto const dense = MatrixX<double>(h->cast<double>());
+    auto const reference = Eigen::SelfAdjointEigenSolver<MatrixX<double>>(dense);
+    ArrayX<double> const all = reference.eigenvalues();
+
+    auto const values_of = [](Dense<float> const& solver) {
+        auto const ref = solver.eigenvalues();
+        return ArrayXd{Eigen::Map<ArrayX<float> const>(static_cast<float const*>(ref.data),
+                                                       ref.rows * ref.cols).cast<double>()};
+    };
+
+    SECTION("All eigenpairs") {
+        auto solver = Dense<float>(h);
+        solver.solve();
+        REQUIRE(values_of(solver).isApprox(all, 1e-4));
+
+        auto const ref = solver.eigenvectors();
+        REQUIRE(ref.rows == size);
+        REQUIRE(ref.cols == size);
+        MatrixX<double> const vectors = Eigen::Map<MatrixX<float> const>(
+            static_cast<float const*>(ref.data), size, size
+        ).cast<double>();
+        MatrixX<double> const residual = dense * vectors - vectors * all.matrix().asDiagonal();
+        REQUIRE(residual.norm() < 1e-3);
+    }
+
+    SECTION("Energy window") {
+        auto config = DenseConfig();
+        config.energy_min = -0.5;
+        config.energy_max = 1.0;
+        auto expected = std::vector<double>();
+        for (auto i = 0; i < all.size(); ++i) {
+            if (all[i] >= config.energy_min && all[i] <= config.energy_max) {
+                expected.push_back(all[i]);
+            }
+        }
+        REQUIRE(expected.size() > 2);
+
+        auto solver = Dense<float>(h, config);
+        solver.solve();
+        REQUIRE(values_of(solver).isApprox(eigen_cast<ArrayX>(expected), 1e-4));
+        REQUIRE(solver.eigenvectors().cols == static_cast<int>(expected.size()));
+    }
+
+    SECTION("Streamed spatial LDOS") {
+        auto regular = Solver<Dense>(model);
+        auto streamed = Solver<Dense>(model);
+        auto energies = ArrayXf(2);
+        energies << 0.1f, 0.6f;
+        streamed.stream_spatial_ldos(energies, 0.1f);
+        for (auto i = 0; i < energies.size(); ++i) {
+            auto const expected = regular.calc_spatial_ldos(energies[i], 0.1f);
+            REQUIRE(streamed.calc_spatial_ldos(energies[i], 0.1f).isApprox(expected, 1e-5));
+        }
+    }
+
+    auto config = DenseConfig();
+    config.energy_min = 1;
+    REQUIRE_THROWS_WITH(Dense<float>(h, config), Catch::Contains("Invalid energy window"));
+}
+
+TEST_CASE("Streamed spatial LDOS", "[chebfilter]") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(1.4f, 1.2f),
+                             field::linear_onsite(0.5f));
+    auto config = ChebFilterConfig();
+    config.energy_min = -0.5;
+    config.energy_max = 1.0;
+    config.initial_size_guess = 2;
+    auto const broadening = 0.1f;
+
+    auto regular = Solver<ChebFilter>(model, config);
+    auto streamed = Solver<ChebFilter>(model, config);
+    auto energies = ArrayXf(2);
+    energies << 0.1f, 0.6f;
+    streamed.stream_spatial_ldos(energies, broadening);
+
+    for (auto i = 0; i < energies.size(); ++i) {
+        auto const expected = regular.calc_spatial_ldos(energies[i], broadening);
+        REQUIRE(streamed.calc_spatial_ldos(energies[i], broadening).isApprox(expected, 1e-5));
+    }
+    REQUIRE(streamed.calc_dos(energies, broadening).isApprox(
+        regular.calc_dos(energies, broadening)));
+
+    REQUIRE_THROWS_WITH(streamed.eigenvectors(), Catch::Contains("not kept"));
+    REQUIRE_THROWS_WITH(streamed.calc_spatial_ldos(0.2f, broadening),
+                        Catch::Contains("streamed only"));
+
+    streamed.stream_spatial_ldos({}, broadening);
+    auto const vectors = streamed.eigenvectors();
+    REQUIRE(vectors.rows * vectors.cols != 0);
+}
+
+TEST_CASE("DOS and spatial LDOS", "[chebfilter]") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(1.4f, 1.2f),
+                             field::linear_onsite(0.5f));
+    auto config = ChebFilterConfig();
+    config.energy_min = -0.5;
+    config.energy_max = 1.0;
+    config.initial_size_guess = 2;
+    auto solver = Solver<ChebFilter>(model, config);
+
+    auto const broadening = 0.05f;
+    auto const scale = 1 / (broadening * std::sqrt(2 * constant::pi));
+    auto const values_ref = solver.eigenvalues();
+    auto const vectors_ref = solver.eigenvectors();
+    auto const num_values = values_ref.rows * values_ref.cols;
+    ArrayXd const values = Eigen::Map<ArrayX<float> const>(
+        static_cast<float const*>(values_ref.data), num_values
+    ).cast<double>();
+    ArrayXXd const psi2 = Eigen::Map<ArrayXX<float> const>(
+        static_cast<float const*>(vectors_ref.data), vectors_ref.rows, vectors_ref.cols
+    ).abs2().cast<double>();
+
+    auto energies = ArrayXf(3);
+    energies << -0.3f, 0.1f, 0.6f;
+    auto expected_dos = ArrayXd(energies.size());
+    for (auto i = 0; i < energies.size(); ++i) {
+        ArrayXd const gaussian = scale * exp(-0.5 * (values - energies[i]).square()
+                                             / (broadening * broadening));
+        expected_dos[i] = gaussian.sum();
+
+        ArrayXd const expected_ldos = psi2.matrix() * gaussian.matrix();
+        for (auto num_threads : {1, 2}) {
+            auto const ldos = solver.calc_spatial_ldos(energies[i], broadening, num_threads);
+            REQUIRE(ldos.isApprox(expected_ldos, 1e-4));
+        }
+    }
+    REQUIRE(solver.calc_dos(energies, broadening).isApprox(expected_dos, 1e-4));
+    REQUIRE(solver.calc_dos(energies, broadening, 2).isApprox(expected_dos, 1e-4));
+}
+
+TEST_CASE("Sparse direct Green's function", "[greens]") {
+    auto energy = ArrayXd(4);
+    energy << -0.5, -0.1, 0.2, 0.7;
+    auto const broadening = 1e-4;
+
+    // `G_{col,row}` of the dense inverse of `z - H` for each energy
+    auto const dense_greens = [&](Model const& model, int row, int col) {
+        auto const& h = ham::get_reference<float>(model.hamiltonian());
+        MatrixX<std::complex<double>> const h_dense = MatrixX<float>(h.toDense())
+            .cast<std::complex<double>>();
+        auto const n = h_dense.rows();
+        auto result = ArrayXcd(energy.size());
+        for (auto e = 0; e < energy.size(); ++e) {
+            auto const z = std::complex<double>{energy[e], broadening};
+            MatrixX<std::complex<double>> const g = (
+                z * MatrixX<std::complex<double>>::Identity(n, n) - h_dense
+            ).inverse();
+            result[e] = g(col, row);
+        }
+        return result;
+    };
+    auto const is_close = [](ArrayXcd const& a, ArrayXcd const& b) {
+        return ((a - b).abs() < 1e-6 * (1 + b.abs())).all();
+    };
+
+    auto const model = Model(graphene::monolayer(), Primitive(4, 4));
+    auto greens = DirectGreens(model, /*num_threads*/2);
+    auto const row = 0;
+    auto const cols = std::vector<int>{0, 3, 7};
+    auto const elements = greens.greens_vector(row, cols, energy, broadening);
+    REQUIRE(elements.size() == cols.size());
+    for (auto j = 0u; j < cols.size(); ++j) {
+        REQUIRE(is_close(elements[j], dense_greens(model, row, cols[j])));
+    }
+    // One symbolic analysis per thread, one numeric factorization per energy
+    REQUIRE(greens.num_analyses() == 2);
+    REQUIRE(greens.num_factorizations() == 4);
+
+    auto const block = greens.greens_block({0, 5}, {1, 2}, energy, broadening);
+    REQUIRE(block.size() == 4);
+    REQUIRE(is_close(block[3], dense_greens(model, 5, 2)));
+    REQUIRE(greens.num_analyses() == 2);
+
+    // An onsite potential keeps the pattern: every diagonal element is always stored
+    auto const shifted = Model(graphene::monolayer(), Primitive(4, 4), field::linear_onsite());
+    greens.set_model(shifted);
+    REQUIRE(is_close(greens.greens(4, 1, energy, broadening), dense_greens(shifted, 4, 1)));
+    REQUIRE(greens.num_analyses() == 2);
+    REQUIRE(greens.num_factorizations() == 12);
+
+    REQUIRE_THROWS_WITH(greens.greens(-1, 0, energy, broadening),
+                        Catch::Contains("invalid index"));
+    REQUIRE_THROWS_WITH(greens.greens(0, 0, energy, 0), Catch::Contains("must be positive"));
+}
@@ -1,7 +1,15 @@
 #include <catch.hpp>
 #include <complex>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
 
 #include "Model.hpp"
+#include "utils/ThreadPool.hpp"
+#include "utils/TaskPool.hpp"
+#include "utils/Arena.hpp"
+#include "utils/Trace.hpp"
 using namespace cpb;
 
 namespace static_test_typelist {
@@ -52,3 +60,228 @@ TEST_CASE("Symmetry masks") {
         REQUIRE(masks == expected);
     }
 }
+
+TEST_CASE("ThreadPool") {
+    ThreadPool pool(4);
+    REQUIRE(pool.size() == 4);
+
+    auto used_threads = std::vector<int>(pool.size(), 0);
+    pool.run([&](int id) { used_threads[id] += 1; });
+    REQUIRE(std::all_of(used_threads.begin(), used_threads.end(), [](int n) { return n == 1; }));
+
+    auto const size = 100000;
+    auto data = ArrayXi::Zero(size).eval();
+    for (auto repeat = 0; repeat < 10; ++repeat) {
+        pool.parallel_for(0, size, [&](int, int start, int end) {
+            data.segment(start, end - start) += 1;
+        });
+    }
+    REQUIRE((data == 10).all());
+
+    SECTION("Pinned threads") {
+        ThreadPool pinned(4, /*pin_threads*/true);
+        auto count = std::vector<int>(pinned.size(), 0);
+        pinned.run([&](int id) { count[id] += 1; });
+        REQUIRE(std::all_of(count.begin(), count.end(), [](int n) { return n == 1; }));
+    }
+
+    SECTION("CPU reservations") {
+        // Concurrent pools don't pin their threads to the same CPUs while there are enough
+        auto const num_cpus = num_process_cpus();
+        CpuReservation const first(num_cpus / 2), second(num_cpus / 2);
+        for (auto i = 0; i < num_cpus / 2; ++i) {
+            for (auto j = 0; j < num_cpus / 2; ++j) {
+                REQUIRE(first[i] % num_cpus != second[j] % num_cpus);
+            }
+        }
+    }
+
+    SECTION("Exceptions are rethrown after all threads are done") {
+        for (auto throwing_id : {0, 2}) {
+            std::atomic<int> num_done{0};
+            REQUIRE_THROWS_WITH(pool.run([&](int id) {
+                if (id == throwing_id) { throw std::runtime_error("thread failed"); }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                ++num_done;
+            }), Catch::Contains("thread failed"));
+            REQUIRE(num_done.load() == pool.size() - 1);
+        }
+
+        // The pool is still usable
+        auto count = std::vector<int>(pool.size(), 0);
+        pool.run([&](int id) { count[id] += 1; });
+        REQUIRE(std::all_of(count.begin(), count.end(), [](int n) { return n == 1; }));
+    }
+}
+
+TEST_CASE("TaskPool::shared") {
+    auto& shared = TaskPool::shared();
+    REQUIRE(&shared == &TaskPool::shared());
+
+    // The tasks wait on each other, so they must all be running at the same time
+    auto const num_tasks = 4;
+    std::mutex mutex;
+    std::condition_variable cv;
+    auto num_started = 0;
+    auto num_done = 0;
+
+    auto tasks = std::vector<std::function<void()>>();
+    for (auto i = 0; i < num_tasks; ++i) {
+        tasks.emplace_back([&]() {
+            std::unique_lock<std::mutex> lk(mutex);
+            ++num_started;
+            cv.notify_all();
+            cv.wait(lk, [&] { return num_started == num_tasks; });
+            ++num_done;
+            cv.notify_all();
+        });
+    }
+    shared.start(std::move(tasks));
+
+    std::unique_lock<std::mutex> lk(mutex);
+    cv.wait(lk, [&] { return num_done == num_tasks; });
+    REQUIRE(shared.size() >= num_tasks);
+    REQUIRE(shared.size() <= TaskPool::max_shared_threads());
+}
+
+TEST_CASE("TaskPool size limit") {
+    std::atomic<int> num_done{0};
+    {
+        TaskPool pool(1, /*max_threads*/2);
+        pool.start(std::vector<std::function<void()>>(5, [&]() { ++num_done; }));
+        REQUIRE(pool.size() == 2);
+    } // the queued tasks still run before the pool is destroyed
+    REQUIRE(num_done == 5);
+
+    // All the threads of the shared pool are busy: the workers of a new `ThreadPool` are
+    // queued and the calling thread does their share of the work
+    auto& shared = TaskPool::shared();
+    std::mutex mutex;
+    std::condition_variable cv;
+    auto is_released = false;
+    auto blockers = std::vector<std::function<void()>>(
+        static_cast<size_t>(TaskPool::max_shared_threads()), [&]() {
+            std::unique_lock<std::mutex> lk(mutex);
+            cv.wait(lk, [&] { return is_released; });
+        }
+    );
+    shared.start(std::move(blockers));
+    {
+        ThreadPool pool(4);
+        auto count = std::vector<int>(pool.size(), 0);
+        pool.run([&](int id) { count[id] += 1; });
+        REQUIRE(std::all_of(count.begin(), count.end(), [](int n) { return n == 1; }));
+    } // doesn't wait for the queued workers
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        is_released = true;
+    }
+    cv.notify_all();
+    REQUIRE(shared.size() == TaskPool::max_shared_threads());
+}
+
+TEST_CASE("Arena") {
+    auto& arena = Arena<VectorXd>::local();
+    arena.clear();
+
+    auto a = arena.take(100);
+    REQUIRE(a.size() == 100);
+    auto const data = a.data();
+    arena.give(std::move(a));
+    REQUIRE(arena.size() == 1);
+
+    SECTION("Reuse the same shape") {
+        auto b = arena.take(100);
+        REQUIRE(b.data() == data);
+        REQUIRE(arena.size() == 0);
+    }
+
+    SECTION("Different shapes are allocated separately") {
+        auto b = arena.take(50);
+        REQUIRE(b.size() == 50);
+        REQUIRE(arena.size() == 1);
+    }
+
+    SECTION("Limited cache size") {
+        for (auto i = 0u; i < 2 * Arena<VectorXd>::max_cached; ++i) {
+            arena.give(VectorXd::Zero(10));
+        }
+        REQUIRE(arena.size() == Arena<VectorXd>::max_cached);
+    }
+
+    SECTION("Reserve") {
+        auto num_touched = 0;
+        auto const touch = [&](VectorXd& v) { v.setZero(); ++num_touched; };
+        arena.reserve(100, 1, 2, touch);
+        REQUIRE(num_touched == 1); // one was already there
+        REQUIRE(arena.size() == 2);
+        arena.reserve(100, 1, 2, touch);
+        REQUIRE(num_touched == 1);
+        auto const b = arena.take(100); // the newest one
+        auto const c = arena.take(100);
+        REQUIRE(b.isZero());
+        REQUIRE(c.data() == data);
+    }
+
+    SECTION("Release all the arenas of the thread") {
+        auto& other = Arena<VectorXf>::local();
+        other.give(VectorXf::Zero(10));
+        release_arenas();
+        REQUIRE(arena.size() == 0);
+        REQUIRE(other.size() == 0);
+    }
+
+    SECTION("Each thread has its own arena") {
+        auto other = std::size_t{1};
+        std::thread([&] { other = Arena<VectorXd>::local().size(); }).join();
+        REQUIRE(other == 0);
+    }
+
+    SECTION("Two vectors return at the end of the scope") {
+        {
+            auto r0 = arena.take(100);
+            auto r1 = arena.take(100);
+            auto const recycle = return_to_arena(r0, r1);
+            r0.swap(r1);
+        }
+        REQUIRE(arena.size() == 2);
+    }
+    arena.clear();
+}
+
+TEST_CASE("Trace") {
+    trace::enable();
+    {
+        auto const outer = trace::Span("outer");
+        auto inner = trace::Span("inner");
+        inner.stop();
+    }
+    trace::enable(false);
+    {
+        auto const ignored = trace::Span("ignored");
+    }
+
+    auto const events = trace::events();
+    REQUIRE(events.size() == 2);
+    REQUIRE(std::string(events[0].name) == "inner");
+    REQUIRE(events[0].depth == 1);
+    REQUIRE(std::string(events[1].name) == "outer");
+    REQUIRE(events[1].depth == 0);
+    REQUIRE(events[1].start <= events[0].start);
+    REQUIRE(events[0].start + events[0].duration <= events[1].start + events[1].duration);
+    REQUIRE(trace::to_chrome_json().find("\"name\": \"outer\"") != std::string::npos);
+
+    SECTION("Limited capacity") {
+        trace::set_capacity(1);
+        trace::enable();
+        {
+            auto const a = trace::Span("a");
+            auto const b = trace::Span("b");
+        }
+        trace::enable(false);
+        REQUIRE(trace::events().size() == 1);
+        REQUIRE(trace::num_dropped() == 1);
+        trace::set_capacity(std::size_t{1} << 20);
+    }
+    trace::clear();
+}
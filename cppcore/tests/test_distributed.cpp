@@ -0,0 +1,214 @@
+#include <catch.hpp>
+
+#include "fixtures.hpp"
+#include "KPM.hpp"
+#include "kpm/calc_moments.hpp"
+#include "distributed/moments.hpp"
+
+#include <cassert>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+using namespace cpb;
+
+namespace {
+
+/// Shared state of a group of threads which stand in for the ranks of an MPI job
+class LocalGroup {
+public:
+    explicit LocalGroup(int size) : size(size), slots(size) {}
+
+    struct Slot {
+        int value;
+        double* data;
+        void const* send;
+        int const* send_bytes;
+        int const* send_displs;
+    };
+
+    void barrier() {
+        auto lock = std::unique_lock<std::mutex>(mutex);
+        auto const current = generation;
+        if (++arrived == size) {
+            arrived = 0;
+            ++generation;
+            cv.notify_all();
+        } else {
+            cv.wait(lock, [&] { return generation != current; });
+        }
+    }
+
+    int const size;
+    std::vector<Slot> slots;
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    int arrived = 0;
+    int generation = 0;
+};
+
+class LocalCommunicator : public dist::Communicator {
+public:
+    LocalCommunicator(LocalGroup& group, int rank) : group(group), this_rank(rank) {}
+
+    int rank() const override { return this_rank; }
+    int size() const override { return group.size; }
+
+    std::vector<int> allgather(int value) override {
+        group.slots[this_rank].value = value;
+        group.barrier();
+        auto result = std::vector<int>(group.size);
+        for (auto r = 0; r < group.size; ++r) {
+            result[r] = group.slots[r].value;
+        }
+        group.barrier();
+        return result;
+    }
+
+    void allreduce_sum(double* data, int size) override {
+        group.slots[this_rank].data = data;
+        group.barrier();
+        auto sum = std::vector<double>(size, 0.0);
+        for (auto r = 0; r < group.size; ++r) {
+            for (auto i = 0; i < size; ++i) {
+                sum[i] += group.slots[r].data[i];
+            }
+        }
+        group.barrier();
+        std::copy(sum.begin(), sum.end(), data);
+    }
+
+    void alltoallv(void const* send, int const* send_bytes, int const* send_displs,
+                   void* recv, int const* recv_bytes, int const* recv_displs) override {
+        auto& slot = group.slots[this_rank];
+        slot.send = send;
+        slot.send_bytes = send_bytes;
+        slot.send_displs = send_displs;
+        group.barrier();
+        for (auto r = 0; r < group.size; ++r) {
+            auto const& source = group.slots[r];
+            assert(source.send_bytes[this_rank] == recv_bytes[r]);
+            std::memcpy(static_cast<char*>(recv) + recv_displs[r],
+                        static_cast<char const*>(source.send) + source.send_displs[this_rank],
+                        static_cast<std::size_t>(recv_bytes[r]));
+        }
+        group.barrier();
+    }
+
+private:
+    LocalGroup& group;
+    int this_rank;
+};
+
+/// Call `fn(comm)` on `size` threads, each with its own rank
+template<class F>
+void run_ranks(int size, F fn) {
+    LocalGroup group(size);
+    auto threads = std::vector<std::thread>();
+    for (auto rank = 0; rank < size; ++rank) {
+        threads.emplace_back([&group, &fn, rank] {
+            LocalCommunicator comm(group, rank);
+            fn(comm);
+        });
+    }
+    for (auto& t : threads) { t.join(); }
+}
+
+} // anonymous namespace
+
+TEST_CASE("Partition", "[distributed]") {
+    auto covered = 0;
+    for (auto rank = 0; rank < 3; ++rank) {
+        auto const range = dist::partition(10, rank, 3);
+        REQUIRE(range.first == covered);
+        covered = range.second;
+    }
+    REQUIRE(covered == 10);
+}
+
+TEST_CASE("Hamiltonian row blocks", "[distributed]") {
+    auto model = Model(graphene::monolayer(), Primitive(5, 5), TranslationalSymmetry(1, 1),
+                       field::constant_potential(1));
+    model.set_wave_vector({0.5f, 1.5f, 0});
+    auto const& matrix = ham::get_reference<std::complex<float>>(model.hamiltonian());
+    auto const num_sites = static_cast<int>(matrix.rows());
+
+    for (auto rank = 0; rank < 3; ++rank) {
+        auto const range = dist::partition(num_sites, rank, 3);
+        auto const block = model.hamiltonian_rows(range.first, range.second);
+        auto const& rows = ham::get_reference<std::complex<float>>(block);
+        REQUIRE(rows.rows() == range.second - range.first);
+        REQUIRE(rows.cols() == num_sites);
+        REQUIRE(rows.isApprox(dist::slice_rows(matrix, range.first, range.second)));
+    }
+    REQUIRE(model.hamiltonian_rows(num_sites, num_sites).rows() == 0);
+    REQUIRE_THROWS_WITH(model.hamiltonian_rows(0, num_sites + 1),
+                        Catch::Contains("are not within"));
+}
+
+TEST_CASE("Distributed KPM moments", "[distributed]") {
+    using scalar_t = std::complex<float>;
+    auto model = Model(graphene::monolayer(), shape::rectangle(1.2f, 1.0f),
+                       field::constant_potential(1));
+    model.add(field::constant_magnetic_field(1e4));
+    auto const& matrix = ham::get_reference<scalar_t>(model.hamiltonian());
+    auto const num_sites = static_cast<int>(matrix.rows());
+    auto const scale = kpm::Scale<float>(-4.f, 5.f);
+    auto const num_moments = 30;
+
+    auto oh = kpm::OptimizedHamiltonian<scalar_t>(
+        &matrix, {kpm::MatrixConfig::Reorder::OFF, kpm::MatrixConfig::Format::CSR}
+    );
+    auto const indices = std::vector<int>{0, num_sites / 2, num_sites - 1};
+    oh.optimize_for({0, 0}, scale);
+
+    auto random = VectorX<scalar_t>(num_sites);
+    num::random_phase_fill(random, 42);
+
+    for (auto num_ranks : {1, 2, 3}) {
+        INFO("ranks: " << num_ranks);
+        // Catch assertions are not thread-safe: the ranks only store the results
+        auto results = std::vector<std::vector<ArrayX<scalar_t>>>(num_ranks);
+        run_ranks(num_ranks, [&](dist::Communicator& comm) {
+            // Each rank builds only its own rows of the Hamiltonian
+            auto const range = dist::partition(num_sites, comm.rank(), comm.size());
+            auto const block = model.hamiltonian_rows(range.first, range.second);
+            auto const h2 = dist::DistributedMatrix<scalar_t>(
+                ham::get_reference<scalar_t>(block), range.first, scale, comm
+            );
+            auto& r = results[comm.rank()];
+            for (auto i : indices) {
+                r.push_back(dist::exval_moments(h2, i, num_moments));
+            }
+            VectorX<scalar_t> local_random = random.segment(range.first, h2.rows());
+            r.push_back(dist::diagonal_moments<scalar_t>(h2, local_random, num_moments));
+            r.push_back(dist::trace_moments(h2, num_moments, 3, 42));
+        });
+
+        for (auto n = 0u; n < indices.size(); ++n) {
+            auto expected = kpm::ExvalDiagonalMoments<scalar_t>(num_moments, indices[n]);
+            kpm::calc_moments::diagonal::basic(expected, oh.csr());
+            for (auto rank = 0; rank < num_ranks; ++rank) {
+                REQUIRE(results[rank][n].isApprox(expected.get(), 1e-4f));
+            }
+        }
+
+        // Same random vector as the single-column block filled from the same seed
+        auto expected = kpm::StochasticTraceMoments<scalar_t>(num_moments, 1, 42);
+        kpm::calc_moments::diagonal::basic_block(expected, oh.csr());
+        for (auto rank = 0; rank < num_ranks; ++rank) {
+            auto const& r = results[rank];
+            REQUIRE(r[r.size() - 2].isApprox(expected.get().col(0), 1e-4f));
+        }
+
+        // The random vectors are generated by global index: the same for any number of ranks
+        auto trace = kpm::StochasticTraceMoments<scalar_t>(num_moments, 3, 42);
+        kpm::calc_moments::diagonal::basic_block(trace, oh.csr());
+        ArrayX<scalar_t> const expected_trace = trace.get().rowwise().mean();
+        for (auto rank = 0; rank < num_ranks; ++rank) {
+            REQUIRE(results[rank].back().isApprox(expected_trace, 1e-4f));
+        }
+    }
+}
@@ -1,7 +1,16 @@
 #include <catch.hpp>
 
 #include "fixtures.hpp"
+#include "AsyncKPM.hpp"
+#include "DisorderEnsemble.hpp"
 #include "KPM.hpp"
+#include "SelfConsistentLoop.hpp"
+#include "kpm/calc_moments.hpp"
+#include "compute/lanczos.hpp"
+#include "numeric/constant.hpp"
+
+#include <Eigen/Eigenvalues>
+#include <numeric>
 using namespace cpb;
 
 Model make_test_model(bool is_double = false, bool is_complex = false) {
@@ -73,6 +82,250 @@ TEST_CASE("OptimizedHamiltonian reordering", "[kpm]") {
         auto const expected12 = std::vector<int>{0, 1, 2, 3, 4, 5, 6, 6, 6, 5, 4, 3};
         REQUIRE(size_indices(oh, 12) == expected12);
     }
+
+    SECTION("Multi-source") {
+        auto oh = kpm::OptimizedHamiltonian<scalat_t>(&matrix, matrix_config);
+        auto const i = model.system()->find_nearest({0, 0.07f, 0}, "B");
+        auto const j1 = model.system()->find_nearest({0, 0.35f, 0}, "A");
+        auto const j2 = model.system()->find_nearest({0.12f, 0.14f, 0}, "A");
+        oh.optimize_for_block({i, std::vector<int>{i, j1, j2}}, bounds.scaling_factors());
+
+        REQUIRE(oh.idx().row == 0);
+        REQUIRE(oh.idx().cols[0] == 0);
+        REQUIRE(oh.idx().cols[1] == 1);
+        REQUIRE(oh.idx().cols[2] == 2);
+        REQUIRE(oh.sizes().get_data().front() == 3);
+        REQUIRE(oh.sizes().get_data().back() == num_sites);
+        REQUIRE(oh.sizes().get_offset() == 0);
+
+        // A multi-source reordering grows at least as fast as a single-source one
+        auto single = kpm::OptimizedHamiltonian<scalat_t>(&matrix, matrix_config);
+        single.optimize_for({i, i}, bounds.scaling_factors());
+        REQUIRE(oh.sizes().get_data().size() <= single.sizes().get_data().size());
+        REQUIRE(oh.sizes()[1] >= single.sizes()[1]);
+    }
+
+    SECTION("SELL-C-sigma") {
+        auto const i = model.system()->find_nearest({0, 0.35f, 0}, "A");
+        auto const j = model.system()->find_nearest({0, 0.07f, 0}, "B");
+        auto const scale = bounds.scaling_factors();
+
+        auto csr = kpm::OptimizedHamiltonian<scalat_t>(&matrix, matrix_config);
+        csr.optimize_for({i, j}, scale);
+        auto ell = kpm::OptimizedHamiltonian<scalat_t>(
+            &matrix, {kpm::MatrixConfig::Reorder::ON, kpm::MatrixConfig::Format::ELL}
+        );
+        ell.optimize_for({i, j}, scale);
+        auto sell = kpm::OptimizedHamiltonian<scalat_t>(
+            &matrix, {kpm::MatrixConfig::Reorder::ON, kpm::MatrixConfig::Format::SELL}
+        );
+        sell.optimize_for({i, j}, scale);
+
+        // Sorting the rows must not change the optimal sizes or the source index
+        REQUIRE(sell.idx().row == 0);
+        REQUIRE(sell.sizes().get_data() == csr.sizes().get_data());
+        REQUIRE(sell.sizes().get_offset() == csr.sizes().get_offset());
+        REQUIRE(sell.sell().nonZeros() >= csr.csr().nonZeros());
+        // The edge sites have fewer neighbors: less padding than ELLPACK (the last
+        // chunk may pad a few extra rows which don't exist in the matrix)
+        auto const last_chunk_padding = sell.sell().chunk_size * ell.ell().nnz_per_row;
+        REQUIRE(sell.sell().nonZeros() <= ell.ell().nonZeros() + last_chunk_padding);
+
+        // The same matrix-vector product, up to the permutation of the target index
+        auto const x = VectorX<scalat_t>{VectorX<scalat_t>::Ones(num_sites)};
+        auto y_csr = VectorX<scalat_t>{VectorX<scalat_t>::Zero(num_sites)};
+        auto y_sell = VectorX<scalat_t>{VectorX<scalat_t>::Zero(num_sites)};
+        compute::kpm_spmv(0, num_sites, csr.csr(), x, y_csr);
+        compute::kpm_spmv(0, num_sites, sell.sell(), x, y_sell);
+        REQUIRE(y_sell[sell.idx().cols[0]] == Approx(y_csr[csr.idx().cols[0]]));
+        REQUIRE(y_sell.sum() == Approx(y_csr.sum()));
+
+        // The reordered matrix is narrow: the 16-bit chunk-relative column offsets fit
+        REQUIRE_FALSE(sell.sell().is_compressed());
+        auto compressed = sell.sell();
+        REQUIRE(compressed.compress());
+        auto y_compressed = VectorX<scalat_t>{VectorX<scalat_t>::Zero(num_sites)};
+        compute::kpm_spmv(0, num_sites, compressed, x, y_compressed);
+        REQUIRE(y_compressed.isApprox(y_sell));
+        compressed.decompress();
+        REQUIRE((compressed.indices == sell.sell().indices).all());
+
+        // Same for ELLPACK, including partial blocks at the edges of the range
+        auto compressed_ell = kpm::OptimizedHamiltonian<scalat_t>(
+            &matrix, {kpm::MatrixConfig::Reorder::ON, kpm::MatrixConfig::Format::ELL,
+                      kpm::MatrixConfig::Indices::COMPRESSED}
+        );
+        compressed_ell.optimize_for({i, j}, scale);
+        REQUIRE(compressed_ell.ell().is_compressed());
+        REQUIRE(compressed_ell.memory_usage() < ell.memory_usage());
+        auto y_ell = VectorX<scalat_t>{VectorX<scalat_t>::Zero(num_sites)};
+        auto y_compressed_ell = VectorX<scalat_t>{VectorX<scalat_t>::Zero(num_sites)};
+        compute::kpm_spmv(1, num_sites - 1, ell.ell(), x, y_ell);
+        compute::kpm_spmv(1, num_sites - 1, compressed_ell.ell(), x, y_compressed_ell);
+        REQUIRE(y_compressed_ell.isApprox(y_ell));
+
+#ifndef CPB_USE_MKL // the MKL kernel only takes 32-bit indices
+        // Same kernel with 64-bit indices
+        auto const csr64 = SparseMatrixX<scalat_t, std::int64_t>(csr.csr());
+        auto y_csr64 = VectorX<scalat_t>{VectorX<scalat_t>::Zero(num_sites)};
+        compute::kpm_spmv(0, num_sites, csr64, x, y_csr64);
+        REQUIRE(y_csr64.isApprox(y_csr));
+#endif
+    }
+
+    SECTION("Cache") {
+        auto const i = model.system()->find_nearest({0, 0.07f, 0}, "B");
+        auto const j = model.system()->find_nearest({0, 0.35f, 0}, "A");
+        auto const scale = bounds.scaling_factors();
+
+        auto reference = kpm::OptimizedHamiltonian<scalat_t>(&matrix, matrix_config);
+        reference.optimize_for({i, i}, scale);
+
+        auto oh = kpm::OptimizedHamiltonian<scalat_t>(&matrix, matrix_config, 1024 * 1024);
+        oh.optimize_for({i, i}, scale);
+        auto const id_i = oh.id();
+        oh.optimize_for({j, j}, scale);
+        auto const id_j = oh.id();
+        REQUIRE(oh.cache_misses() == 2);
+        REQUIRE(oh.cache_hits() == 0);
+        REQUIRE(id_i != id_j);
+
+        oh.optimize_for({i, i}, scale);
+        REQUIRE(oh.id() == id_i);
+        oh.optimize_for({i, i}, scale);
+        oh.optimize_for({j, j}, scale);
+        REQUIRE(oh.id() == id_j);
+        REQUIRE(oh.cache_misses() == 2);
+        REQUIRE(oh.cache_hits() == 3);
+
+        oh.optimize_for({i, i}, scale);
+        REQUIRE(oh.sizes().get_data() == reference.sizes().get_data());
+        REQUIRE(oh.csr().isApprox(reference.csr()));
+
+        auto no_cache = kpm::OptimizedHamiltonian<scalat_t>(&matrix, matrix_config, 0);
+        no_cache.optimize_for({i, i}, scale);
+        no_cache.optimize_for({j, j}, scale);
+        no_cache.optimize_for({i, i}, scale);
+        REQUIRE(no_cache.cache_misses() == 3);
+        REQUIRE(no_cache.id() != id_i);
+
+        // Without reordering, the same matrix serves every target
+        auto const scaled_config = kpm::MatrixConfig{kpm::MatrixConfig::Reorder::OFF,
+                                                     kpm::MatrixConfig::Format::CSR};
+        auto scaled = kpm::OptimizedHamiltonian<scalat_t>(&matrix, scaled_config);
+        scaled.optimize_for({i, i}, scale);
+        auto const id_scaled = scaled.id();
+        scaled.optimize_for({j, j}, scale);
+        REQUIRE(scaled.id() == id_scaled);
+        REQUIRE(scaled.idx().row == j);
+        REQUIRE(scaled.cache_misses() == 1);
+    }
+
+    SECTION("Shared matrix") {
+        auto const i = model.system()->find_nearest({0, 0.07f, 0}, "B");
+        auto const j = model.system()->find_nearest({0, 0.35f, 0}, "A");
+        auto const scale = bounds.scaling_factors();
+        auto shared_config = kpm::MatrixConfig{kpm::MatrixConfig::Reorder::OFF,
+                                               kpm::MatrixConfig::Format::CSR};
+        shared_config.sharing = kpm::MatrixConfig::Sharing::SHARED;
+
+        auto a = kpm::OptimizedHamiltonian<scalat_t>(&matrix, shared_config);
+        a.optimize_for({i, i}, scale);
+        auto b = kpm::OptimizedHamiltonian<scalat_t>(&matrix, shared_config);
+        b.optimize_for({j, j}, scale);
+        REQUIRE(a.is_shared());
+        REQUIRE(b.is_shared());
+        REQUIRE(&a.csr() == &b.csr());
+        REQUIRE(a.id() == b.id());
+        REQUIRE(a.cache_misses() == 1);
+        REQUIRE(b.cache_hits() == 1);
+        REQUIRE(b.idx().row == j);
+
+        auto const private_config = kpm::MatrixConfig{kpm::MatrixConfig::Reorder::OFF,
+                                                      kpm::MatrixConfig::Format::CSR};
+        auto c = kpm::OptimizedHamiltonian<scalat_t>(&matrix, private_config);
+        c.optimize_for({j, j}, scale);
+        REQUIRE_FALSE(c.is_shared());
+        REQUIRE(c.id() != a.id());
+        REQUIRE(c.csr().isApprox(a.csr()));
+    }
+
+    SECTION("Thread pool") {
+        // Large enough to split the rows and the first level of the search between threads
+        auto const large_model = Model(graphene::monolayer(), shape::rectangle(12, 12),
+                                       field::constant_potential(1));
+        auto const large = ham::get_reference<scalat_t>(large_model.hamiltonian());
+        auto large_bounds = kpm::Bounds<scalat_t>(&large, kpm::Config{}.lanczos_precision);
+        auto const scale = large_bounds.scaling_factors();
+        auto sources = std::vector<int>(2500);
+        std::iota(sources.begin(), sources.end(), 0);
+        auto const i = large_model.system()->find_nearest({0, 0, 0}, "A");
+        auto const j = large_model.system()->find_nearest({2, 3, 0}, "B");
+
+        ThreadPool pool(2);
+        for (auto format : {kpm::MatrixConfig::Format::CSR, kpm::MatrixConfig::Format::ELL}) {
+            auto const config = kpm::MatrixConfig{kpm::MatrixConfig::Reorder::ON, format};
+            auto serial = kpm::OptimizedHamiltonian<scalat_t>(&large, config);
+            auto parallel = kpm::OptimizedHamiltonian<scalat_t>(&large, config, 0, &pool);
+
+            // The result must not depend on the number of threads
+            auto const require_identical = [&]() {
+                REQUIRE(parallel.idx() == serial.idx());
+                REQUIRE(parallel.sizes().get_data() == serial.sizes().get_data());
+                REQUIRE(parallel.sizes().get_offset() == serial.sizes().get_offset());
+                if (format == kpm::MatrixConfig::Format::CSR) {
+                    REQUIRE(parallel.csr().nonZeros() == serial.csr().nonZeros());
+                    REQUIRE(parallel.csr().isApprox(serial.csr()));
+                } else {
+                    auto const rows = serial.ell().rows();
+                    auto const& a = parallel.ell();
+                    auto const& b = serial.ell();
+                    REQUIRE((a.indices.topRows(rows) == b.indices.topRows(rows)).all());
+                    REQUIRE(a.data.topRows(rows).isApprox(b.data.topRows(rows)));
+                }
+            };
+
+            serial.optimize_for_block({0, sources}, scale);
+            parallel.optimize_for_block({0, sources}, scale);
+            require_identical();
+
+            serial.optimize_for({i, j}, scale);
+            parallel.optimize_for({i, j}, scale);
+            require_identical();
+        }
+    }
+
+    SECTION("Scaled in parallel") {
+        // A chain with only some of the diagonal elements: the offset needs the others
+        auto const size = 5000;
+        auto triplets = std::vector<Eigen::Triplet<scalat_t>>();
+        for (auto n = 0; n < size; ++n) {
+            if (n % 3 == 0) { triplets.emplace_back(n, n, 0.5f); }
+            if (n + 1 < size) {
+                triplets.emplace_back(n, n + 1, -1.0f);
+                triplets.emplace_back(n + 1, n, -1.0f);
+            }
+        }
+        auto chain = SparseMatrixX<scalat_t>(size, size);
+        chain.setFromTriplets(triplets.begin(), triplets.end());
+
+        auto identity = SparseMatrixX<scalat_t>(size, size);
+        identity.setIdentity();
+        for (auto const scale : {kpm::Scale<scalat_t>(-2.5f, 2.5f),
+                                 kpm::Scale<scalat_t>(-2.0f, 3.0f)}) {
+            auto expected = SparseMatrixX<scalat_t>((chain - identity * scale.b)
+                                                    * (2 / scale.a));
+            expected.makeCompressed();
+
+            ThreadPool pool(2);
+            auto const config = kpm::MatrixConfig{kpm::MatrixConfig::Reorder::OFF,
+                                                  kpm::MatrixConfig::Format::CSR};
+            auto oh = kpm::OptimizedHamiltonian<scalat_t>(&chain, config, 0, &pool);
+            oh.optimize_for({0, 0}, scale);
+            REQUIRE(oh.csr().nonZeros() == expected.nonZeros());
+            REQUIRE(oh.csr().isApprox(expected));
+        }
+    }
 }
 
 struct TestGreensResult {
@@ -124,6 +377,29 @@ std::vector<TestGreensResult> test_kpm_strategy() {
                 auto const ldos = strategy->ldos(i, energy_range, broadening);
                 REQUIRE(ldos.isApprox(-1/pi * g_ii.imag(), precision));
 
+                auto const ldos_block = strategy->ldos_vector({i, j, j+1}, energy_range,
+                                                              broadening);
+                REQUIRE(ldos_block.cols() == 3);
+                REQUIRE(ldos_block.col(0).isApprox(ldos, precision));
+                auto const ldos_j = strategy->ldos(j, energy_range, broadening);
+                REQUIRE(ldos_block.col(1).isApprox(ldos_j, precision));
+
+                config.num_threads = 3;
+                auto parallel = make_kpm_strategy<Strategy>(model.hamiltonian(), config);
+                auto const gs_parallel = parallel->greens_vector(i, cols, energy_range,
+                                                                 broadening);
+                REQUIRE(gs_parallel[0].isApprox(gs[0], precision));
+                REQUIRE(gs_parallel[1].isApprox(gs[1], precision));
+                REQUIRE(parallel->ldos(i, energy_range, broadening).isApprox(ldos, precision));
+
+                config.num_threads = 1;
+                config.mixed_precision = true;
+                auto mixed = make_kpm_strategy<Strategy>(model.hamiltonian(), config);
+                REQUIRE(mixed->ldos(i, energy_range, broadening).isApprox(ldos, precision));
+                auto const g_mixed = mixed->greens(i, i, energy_range, broadening);
+                REQUIRE(g_mixed.isApprox(g_ii, precision));
+                config.mixed_precision = false;
+
                 if (opt_level == 0) {
                     unoptimized_result = {g_ii, g_ij};
                 } else {
@@ -139,17 +415,1878 @@ std::vector<TestGreensResult> test_kpm_strategy() {
     return results;
 }
 
+TEST_CASE("OptimizedHamiltonian 64-bit indices", "[kpm]") {
+    using scalar_t = float;
+    auto const model = Model(graphene::monolayer(), shape::rectangle(0.6f, 0.8f));
+    auto const& matrix = ham::get_reference<scalar_t>(model.hamiltonian());
+    auto const wide = ham::make_csr<scalar_t, std::int64_t>(*model.system(),
+                                                            HamiltonianModifiers{}, {0, 0, 0});
+    REQUIRE(wide.rows() == matrix.rows());
+    REQUIRE(wide.nonZeros() == matrix.nonZeros());
+    REQUIRE(SparseMatrixX<scalar_t>(wide).isApprox(matrix));
+
+    auto const scale = kpm::Bounds<scalar_t>(&matrix, kpm::Config{}.lanczos_precision)
+        .scaling_factors();
+    auto const i = model.system()->num_sites() / 3;
+    using Format = kpm::MatrixConfig::Format;
+    for (auto format : {Format::CSR, Format::ELL, Format::SELL}) {
+        auto const config = kpm::MatrixConfig{kpm::MatrixConfig::Reorder::ON, format};
+        auto oh = kpm::OptimizedHamiltonian<scalar_t>(&matrix, config);
+        oh.optimize_for({i, i}, scale);
+        auto oh64 = kpm::OptimizedHamiltonian<scalar_t, std::int64_t>(&wide, config);
+        oh64.optimize_for({i, i}, scale);
+        REQUIRE(oh64.sizes().get_data() == oh.sizes().get_data());
+
+        auto moments = kpm::ExvalDiagonalMoments<scalar_t>(40, oh.idx().row);
+        auto moments64 = kpm::ExvalDiagonalMoments<scalar_t>(40, oh64.idx().row);
+        if (format == Format::CSR) {
+            kpm::calc_moments::diagonal::basic(moments, oh.csr());
+            kpm::calc_moments::diagonal::basic(moments64, oh64.csr());
+        } else if (format == Format::ELL) {
+            kpm::calc_moments::diagonal::basic(moments, oh.ell());
+            kpm::calc_moments::diagonal::basic(moments64, oh64.ell());
+        } else {
+            kpm::calc_moments::diagonal::basic(moments, oh.sell());
+            kpm::calc_moments::diagonal::basic(moments64, oh64.sell());
+        }
+        REQUIRE(moments64.get().isApprox(moments.get(), 1e-5f));
+    }
+
+    auto const bsr = kpm::MatrixConfig{kpm::MatrixConfig::Reorder::OFF, Format::BSR};
+    REQUIRE_THROWS_WITH((kpm::OptimizedHamiltonian<scalar_t, std::int64_t>(&wide, bsr)),
+                        Catch::Contains("32-bit indices"));
+}
+
+template<class scalar_t>
+void check_ell_dispatch(Model const& model) {
+    auto const& matrix = ham::get_reference<scalar_t>(model.hamiltonian());
+    auto const num_sites = static_cast<int>(matrix.rows());
+    auto const scale = kpm::Bounds<scalar_t>(&matrix, kpm::Config{}.lanczos_precision)
+        .scaling_factors();
+    auto oh = kpm::OptimizedHamiltonian<scalar_t>(
+        &matrix, {kpm::MatrixConfig::Reorder::OFF, kpm::MatrixConfig::Format::ELL}
+    );
+    oh.optimize_for({0, 0}, scale);
+
+    auto const x = VectorX<scalar_t>::Random(num_sites).eval();
+    auto const y0 = VectorX<scalar_t>::Random(num_sites).eval();
+    auto spmv = [&](std::string const& isa) {
+        compute::ell_dispatch::set_isa(isa);
+        auto y = VectorX<scalar_t>(y0);
+        compute::kpm_spmv(1, num_sites - 1, oh.ell(), x, y); // unaligned edges
+        return y;
+    };
+
+    auto const best = compute::ell_dispatch::active_isa();
+    auto const expected = spmv("generic");
+    for (auto const& isa : compute::ell_dispatch::available_isas()) {
+        INFO(isa);
+        REQUIRE(spmv(isa).isApprox(expected));
+    }
+    compute::ell_dispatch::set_isa(best);
+}
+
+TEST_CASE("ELL kernel dispatch", "[kpm]") {
+    auto const isas = compute::ell_dispatch::available_isas();
+    REQUIRE(isas.front() == "generic");
+    REQUIRE(compute::ell_dispatch::active_isa() == isas.back());
+    REQUIRE_THROWS(compute::ell_dispatch::set_isa("mmx"));
+
+    check_ell_dispatch<float>(make_test_model(false, false));
+    check_ell_dispatch<std::complex<float>>(make_test_model(false, true));
+    check_ell_dispatch<double>(make_test_model(true, false));
+    check_ell_dispatch<std::complex<double>>(make_test_model(true, true));
+}
+
+TEST_CASE("Upper triangle Hamiltonian storage", "[kpm]") {
+    using scalar_t = std::complex<float>;
+    auto model = Model(graphene::monolayer(), shape::rectangle(0.6f, 0.8f),
+                       field::constant_potential(0.5f));
+    model.add(field::constant_magnetic_field(1e4));
+    auto const& matrix = ham::get_reference<scalar_t>(model.hamiltonian());
+    auto const symmetric = model.make_symmetric<scalar_t>();
+    REQUIRE(symmetric.rows() == matrix.rows());
+    REQUIRE(symmetric.nonZeros() == (matrix.nonZeros() + matrix.rows()) / 2);
+
+    auto const from_full = num::SymmetricMatrix<scalar_t>::from_full(matrix);
+    REQUIRE(from_full.nonZeros() == symmetric.nonZeros());
+    REQUIRE(from_full.upper.isApprox(symmetric.upper));
+
+    auto const x = num::make_random<VectorX<scalar_t>>(symmetric.rows());
+    auto y_csr = VectorX<scalar_t>();
+    auto y_symmetric = VectorX<scalar_t>();
+    compute::matrix_vector_mul(matrix, x, y_csr);
+    compute::matrix_vector_mul(symmetric, x, y_symmetric);
+    REQUIRE(y_symmetric.isApprox(y_csr, 1e-4f));
+
+    auto const bounds = compute::minmax_eigenvalues(symmetric, 0.1);
+    auto const scale = kpm::Scale<float>(bounds.min, bounds.max);
+    auto const h2 = symmetric.scaled(2 / scale.a, scale.b);
+    auto oh = kpm::OptimizedHamiltonian<scalar_t>(
+        &matrix, {kpm::MatrixConfig::Reorder::OFF, kpm::MatrixConfig::Format::CSR}
+    );
+    auto const i = model.system()->num_sites() / 3;
+    oh.optimize_for({i, i}, scale);
+
+    auto csr_moments = kpm::ExvalDiagonalMoments<scalar_t>(40, i);
+    kpm::calc_moments::diagonal::basic(csr_moments, oh.csr());
+    auto symmetric_moments = kpm::ExvalDiagonalMoments<scalar_t>(40, i);
+    kpm::calc_moments::diagonal::basic(symmetric_moments, h2);
+    REQUIRE(symmetric_moments.get().isApprox(csr_moments.get(), 1e-4f));
+
+    auto csr_trace = kpm::StochasticTraceMoments<scalar_t>(40, 2, 42);
+    kpm::calc_moments::diagonal::basic_block(csr_trace, oh.csr());
+    auto symmetric_trace = kpm::StochasticTraceMoments<scalar_t>(40, 2, 42);
+    kpm::calc_moments::diagonal::basic_block(symmetric_trace, h2);
+    REQUIRE(symmetric_trace.get().isApprox(csr_trace.get(), 1e-4f));
+
+    // The same storage in the KPM strategy, see `Config::symmetric_storage`
+    auto symmetric_oh = kpm::OptimizedHamiltonian<scalar_t>(
+        &matrix, {kpm::MatrixConfig::Reorder::OFF, kpm::MatrixConfig::Format::SYMMETRIC}
+    );
+    symmetric_oh.optimize_for({i, i}, scale);
+    REQUIRE(symmetric_oh.is_symmetric());
+    REQUIRE(symmetric_oh.symmetric().upper.isApprox(h2.upper));
+    REQUIRE(symmetric_oh.memory_usage() < oh.memory_usage() * 3 / 4);
+
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const j = model.system()->num_sites() / 2;
+    for (auto opt_level = 0; opt_level <= 3; ++opt_level) {
+        auto config = kpm::Config{};
+        config.opt_level = opt_level;
+        auto const reference = make_kpm(model, config);
+        config.symmetric_storage = true;
+        auto const upper = make_kpm(model, config);
+
+        auto const expected = reference.calc_ldos_vector({i, j}, energy, 0.1);
+        REQUIRE(upper.calc_ldos_vector({i, j}, energy, 0.1).isApprox(expected, 1e-4));
+        auto const expected_g = reference.calc_greens(i, j, energy, 0.1);
+        REQUIRE(upper.calc_greens(i, j, energy, 0.1).isApprox(expected_g, 1e-4));
+    }
+
+    model.add(TranslationalSymmetry(1, 0));
+    REQUIRE_THROWS(model.make_symmetric<scalar_t>());
+}
+
+TEST_CASE("Real bulk with complex boundary Hamiltonian storage", "[kpm]") {
+    using scalar_t = std::complex<float>;
+    auto model = Model(graphene::monolayer(), Primitive(6, 5), TranslationalSymmetry(1, 1),
+                       field::constant_potential(0.5f));
+    model.set_wave_vector({0.4f, -0.3f, 0});
+    auto const& matrix = ham::get_reference<scalar_t>(model.hamiltonian());
+    auto const split = model.make_bulk_boundary<scalar_t>();
+    REQUIRE(split.rows() == matrix.rows());
+    REQUIRE(split.boundary_rows.size() > 0);
+    REQUIRE(split.boundary_rows.size() < split.rows());
+
+    auto const x = num::make_random<VectorX<scalar_t>>(split.rows());
+    auto y_csr = VectorX<scalar_t>();
+    auto y_split = VectorX<scalar_t>();
+    compute::matrix_vector_mul(matrix, x, y_csr);
+    compute::matrix_vector_mul(split, x, y_split);
+    REQUIRE(y_split.isApprox(y_csr, 1e-4f));
+
+    // Any row range, e.g. two halves
+    auto const half = split.rows() / 2;
+    y_csr = VectorX<scalar_t>::Ones(split.rows());
+    y_split = VectorX<scalar_t>::Ones(split.rows());
+    compute::kpm_spmv(0, split.rows(), matrix, x, y_csr);
+    compute::kpm_spmv(0, half, split, x, y_split);
+    compute::kpm_spmv(half, split.rows(), split, x, y_split);
+    REQUIRE(y_split.isApprox(y_csr, 1e-4f));
+
+    auto const bounds = compute::minmax_eigenvalues(split, 0.1);
+    auto const scale = kpm::Scale<float>(bounds.min, bounds.max);
+    auto const h2 = split.scaled(2 / scale.a, scale.b);
+    auto oh = kpm::OptimizedHamiltonian<scalar_t>(
+        &matrix, {kpm::MatrixConfig::Reorder::OFF, kpm::MatrixConfig::Format::CSR}
+    );
+    auto const i = model.system()->num_sites() / 3;
+    oh.optimize_for({i, i}, scale);
+
+    auto csr_moments = kpm::ExvalDiagonalMoments<scalar_t>(40, i);
+    kpm::calc_moments::diagonal::basic(csr_moments, oh.csr());
+    auto split_moments = kpm::ExvalDiagonalMoments<scalar_t>(40, i);
+    kpm::calc_moments::diagonal::basic(split_moments, h2);
+    REQUIRE(split_moments.get().isApprox(csr_moments.get(), 1e-4f));
+
+    auto csr_trace = kpm::StochasticTraceMoments<scalar_t>(40, 2, 42);
+    kpm::calc_moments::diagonal::basic_block(csr_trace, oh.csr());
+    auto split_trace = kpm::StochasticTraceMoments<scalar_t>(40, 2, 42);
+    kpm::calc_moments::diagonal::basic_block(split_trace, h2);
+    REQUIRE(split_trace.get().isApprox(csr_trace.get(), 1e-4f));
+
+    // The same split of the reordered matrix in the KPM strategy, see `Config::bulk_boundary`
+    auto const from_full = num::BulkBoundaryMatrix<scalar_t>::from_full(matrix);
+    REQUIRE(from_full.boundary_rows.size() > 0);
+    compute::matrix_vector_mul(from_full, x, y_split);
+    compute::matrix_vector_mul(matrix, x, y_csr);
+    REQUIRE(y_split.isApprox(y_csr, 1e-4f));
+
+    auto split_oh = kpm::OptimizedHamiltonian<scalar_t>(
+        &matrix, {kpm::MatrixConfig::Reorder::ON, kpm::MatrixConfig::Format::BULK_BOUNDARY}
+    );
+    split_oh.optimize_for({i, i}, scale);
+    REQUIRE(split_oh.is_bulk_boundary());
+    REQUIRE(split_oh.memory_usage() < oh.memory_usage());
+
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const j = model.system()->num_sites() / 2;
+    for (auto opt_level = 0; opt_level <= 4; ++opt_level) {
+        auto config = kpm::Config{};
+        config.opt_level = opt_level;
+        auto const reference = make_kpm(model, config);
+        config.bulk_boundary = true;
+        auto const bulk_boundary = make_kpm(model, config);
+
+        auto const expected = reference.calc_ldos_vector({i, j}, energy, 0.1);
+        REQUIRE(bulk_boundary.calc_ldos_vector({i, j}, energy, 0.1).isApprox(expected, 1e-4));
+        auto const expected_g = reference.calc_greens(i, j, energy, 0.1);
+        REQUIRE(bulk_boundary.calc_greens(i, j, energy, 0.1).isApprox(expected_g, 1e-4));
+    }
+
+    REQUIRE_THROWS(Model(graphene::monolayer(), Primitive(6, 5))
+                       .make_bulk_boundary<scalar_t>());
+}
+
+TEST_CASE("KPM stochastic DOS", "[kpm]") {
+    for (auto is_complex : {false, true}) {
+        INFO("complex: " << is_complex);
+        auto const model = make_test_model(false, is_complex);
+        auto const num_sites = model.system()->num_sites();
+        auto const energy_range = ArrayXd::LinSpaced(10, -0.3, 0.3);
+        auto const broadening = 0.8;
+
+        auto strategy = make_kpm_strategy<kpm::DefaultStrategy>(model.hamiltonian());
+        auto indices = std::vector<int>(num_sites);
+        std::iota(indices.begin(), indices.end(), 0);
+        ArrayXd const exact = strategy->ldos_vector(indices, energy_range, broadening)
+                                  .rowwise().sum();
+
+        auto const dos = strategy->dos(energy_range, broadening, 400);
+        REQUIRE(dos.isApprox(exact, 0.1));
+    }
+}
+
+TEST_CASE("KPM stats", "[kpm]") {
+    auto const model = make_test_model();
+    auto const energy_range = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto strategy = make_kpm_strategy<kpm::DefaultStrategy>(model.hamiltonian());
+
+    strategy->ldos(0, energy_range, 0.1);
+    auto const first = strategy->get_stats();
+    REQUIRE(first.num_bytes > 0);
+    REQUIRE(first.intensity() > 0);
+    REQUIRE(first.bytes_per_moment() == Approx(static_cast<double>(first.num_bytes)
+                                               / first.num_moments));
+    REQUIRE(first.bounds_timer.elapsed_seconds() > 0);
+    REQUIRE(first.reorder_timer.elapsed_seconds() > 0);
+
+    // The bounds and the optimized matrix are reused: only the moments need to be computed
+    strategy->ldos(0, energy_range, 0.1);
+    auto const& second = strategy->get_stats();
+    REQUIRE(second.num_bytes == first.num_bytes);
+    REQUIRE(second.bounds_timer.elapsed_seconds() < first.bounds_timer.elapsed_seconds());
+    REQUIRE(second.reorder_timer.elapsed_seconds() == 0);
+    REQUIRE(second.convert_timer.elapsed_seconds() == 0);
+}
+
+TEST_CASE("KPM autotuner", "[kpm]") {
+    auto const model = make_test_model();
+    auto const energy_range = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+    auto config = kpm::Config{};
+    config.opt_level = kpm::opt_level_auto;
+    auto strategy = make_kpm_strategy<kpm::DefaultStrategy>(model.hamiltonian(), config);
+
+    auto const ldos = strategy->ldos(0, energy_range, 0.1);
+    auto const first = strategy->get_stats();
+    REQUIRE(first.opt_level >= 0);
+    REQUIRE(first.opt_level <= 4);
+    REQUIRE(first.tune_timer.elapsed_seconds() > 0);
+
+    // The level is resolved once per strategy
+    strategy->ldos(0, energy_range, 0.1);
+    REQUIRE(strategy->get_stats().opt_level == first.opt_level);
+    REQUIRE(strategy->get_stats().tune_timer.elapsed_seconds() == 0);
+
+    // And once per structure: a new strategy finds it in the cache
+    auto other = make_kpm_strategy<kpm::DefaultStrategy>(model.hamiltonian(), config);
+    REQUIRE(other->ldos(0, energy_range, 0.1).isApprox(ldos, precision));
+    REQUIRE(other->get_stats().opt_level == first.opt_level);
+
+    config.opt_level = 0;
+    auto unoptimized = make_kpm_strategy<kpm::DefaultStrategy>(model.hamiltonian(), config);
+    REQUIRE(unoptimized->ldos(0, energy_range, 0.1).isApprox(ldos, precision));
+    REQUIRE(unoptimized->get_stats().opt_level == 0);
+}
+
+TEST_CASE("KPM interleave depth", "[kpm]") {
+    auto const model = make_test_model(false, true);
+    auto const i = model.system()->num_sites() / 2;
+    auto const energy_range = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+
+    auto config = kpm::Config{};
+    config.opt_level = 1;
+    auto const expected = make_kpm_strategy<kpm::DefaultStrategy>(model.hamiltonian(), config)
+        ->ldos(i, energy_range, 0.1);
+
+    for (auto opt_level : {2, 3, 4}) {
+        // Odd depths and a final pass with fewer iterations need the vectors to be swapped
+        for (auto depth : {1, 2, 3, 4, 7}) {
+            INFO("opt_level: " << opt_level << ", depth: " << depth);
+            config.opt_level = opt_level;
+            config.interleave_depth = depth;
+            auto strategy = make_kpm_strategy<kpm::DefaultStrategy>(model.hamiltonian(), config);
+            REQUIRE(strategy->ldos(i, energy_range, 0.1).isApprox(expected, precision));
+        }
+    }
+
+    config.interleave_depth = 0;
+    REQUIRE_THROWS_WITH(make_kpm_strategy<kpm::DefaultStrategy>(model.hamiltonian(), config),
+                        Catch::Contains("interleave depth"));
+}
+
+TEST_CASE("KPM split complex", "[kpm]") {
+    for (auto is_double : {false, true}) {
+        auto const model = make_test_model(is_double, true);
+        auto const i = model.system()->num_sites() / 2;
+        auto const energy_range = ArrayXd::LinSpaced(10, -0.3, 0.3);
+        auto const precision = Eigen::NumTraits<float>::dummy_precision();
+
+        auto config = kpm::Config{};
+        config.opt_level = 3;
+        for (auto mixed_precision : {false, true}) {
+            for (auto depth : {1, 2, 3}) {
+                INFO("double: " << is_double << ", mixed: " << mixed_precision
+                     << ", depth: " << depth);
+                config.mixed_precision = mixed_precision;
+                config.interleave_depth = depth;
+                config.split_complex = false;
+                auto const expected = make_kpm_strategy<kpm::DefaultStrategy>(
+                    model.hamiltonian(), config)->ldos(i, energy_range, 0.1);
+                config.split_complex = true;
+                auto const split = make_kpm_strategy<kpm::DefaultStrategy>(
+                    model.hamiltonian(), config)->ldos(i, energy_range, 0.1);
+                REQUIRE(split.isApprox(expected, precision));
+            }
+        }
+    }
+
+    // Both the compressed and full column indices, starting from unaligned rows
+    using scalar_t = std::complex<float>;
+    auto const model = make_test_model(false, true);
+    auto const& matrix = ham::get_reference<scalar_t>(model.hamiltonian());
+    auto const scale = kpm::Bounds<scalar_t>(&matrix, kpm::Config{}.lanczos_precision)
+        .scaling_factors();
+    auto const num_sites = static_cast<int>(matrix.rows());
+    for (auto indices : {kpm::MatrixConfig::Indices::FULL,
+                         kpm::MatrixConfig::Indices::COMPRESSED}) {
+        auto config = kpm::MatrixConfig{kpm::MatrixConfig::Reorder::ON,
+                                         kpm::MatrixConfig::Format::ELL, indices};
+        auto interleaved = kpm::OptimizedHamiltonian<scalar_t>(&matrix, config);
+        interleaved.optimize_for({0, 0}, scale);
+        config.layout = kpm::MatrixConfig::Layout::SPLIT;
+        auto split = kpm::OptimizedHamiltonian<scalar_t>(&matrix, config);
+        split.optimize_for({0, 0}, scale);
+        REQUIRE(split.ell().is_split());
+        REQUIRE(split.memory_usage() > interleaved.memory_usage());
+
+        auto const x = VectorX<scalar_t>::Random(num_sites).eval();
+        auto y = VectorX<scalar_t>::Random(num_sites).eval();
+        auto const split_x = num::SplitVector<float>(x);
+        auto split_y = num::SplitVector<float>(y);
+
+        auto m2 = scalar_t{0}, m3 = scalar_t{0};
+        auto split_m2 = scalar_t{0}, split_m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(1, num_sites, interleaved.ell(), x, y, m2, m3);
+        compute::kpm_spmv_diagonal(1, num_sites, split.ell(), split_x, split_y,
+                                   split_m2, split_m3);
+        REQUIRE(split_y.interleaved().isApprox(y));
+        REQUIRE(split_m2.real() == Approx(m2.real()));
+        REQUIRE(split_m3.real() == Approx(m3.real()));
+        REQUIRE(split_m3.imag() == Approx(m3.imag()));
+    }
+}
+
+TEST_CASE("KPM indexed values", "[kpm]") {
+    for (auto is_double : {false, true}) {
+        auto const model = make_test_model(is_double);
+        auto const i = model.system()->num_sites() / 2;
+        auto const energy_range = ArrayXd::LinSpaced(10, -0.3, 0.3);
+        auto const precision = Eigen::NumTraits<float>::dummy_precision();
+
+        auto config = kpm::Config{};
+        config.opt_level = 3;
+        for (auto depth : {1, 2, 3}) {
+            INFO("double: " << is_double << ", depth: " << depth);
+            config.interleave_depth = depth;
+            config.indexed_values = false;
+            auto const expected = make_kpm_strategy<kpm::DefaultStrategy>(
+                model.hamiltonian(), config)->ldos(i, energy_range, 0.1);
+            config.indexed_values = true;
+            auto const indexed = make_kpm_strategy<kpm::DefaultStrategy>(
+                model.hamiltonian(), config)->ldos(i, energy_range, 0.1);
+            REQUIRE(indexed.isApprox(expected, precision));
+        }
+    }
+
+    // Both the compressed and full column indices, starting from unaligned rows
+    using scalar_t = float;
+    auto const model = make_test_model();
+    auto const& matrix = ham::get_reference<scalar_t>(model.hamiltonian());
+    auto const scale = kpm::Bounds<scalar_t>(&matrix, kpm::Config{}.lanczos_precision)
+        .scaling_factors();
+    auto const num_sites = static_cast<int>(matrix.rows());
+    for (auto indices : {kpm::MatrixConfig::Indices::FULL,
+                         kpm::MatrixConfig::Indices::COMPRESSED}) {
+        auto config = kpm::MatrixConfig{kpm::MatrixConfig::Reorder::ON,
+                                         kpm::MatrixConfig::Format::ELL, indices};
+        auto direct = kpm::OptimizedHamiltonian<scalar_t>(&matrix, config);
+        direct.optimize_for({0, 0}, scale);
+        config.values = kpm::MatrixConfig::Values::INDEXED;
+        auto indexed = kpm::OptimizedHamiltonian<scalar_t>(&matrix, config);
+        indexed.optimize_for({0, 0}, scale);
+        REQUIRE(indexed.ell().is_indexed());
+        REQUIRE(indexed.ell().value_table.size() <= 4);
+        // The full values are freed: only the 8-bit ids and the table remain
+        REQUIRE_FALSE(indexed.ell().has_data());
+        REQUIRE(indexed.memory_usage() < direct.memory_usage());
+
+        auto const x = VectorX<scalar_t>::Random(num_sites).eval();
+        auto y = VectorX<scalar_t>::Random(num_sites).eval();
+        auto indexed_y = y;
+        auto off_diagonal_y = y;
+        auto indexed_off_diagonal_y = y;
+
+        auto m2 = scalar_t{0}, m3 = scalar_t{0};
+        auto indexed_m2 = scalar_t{0}, indexed_m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(1, num_sites, direct.ell(), x, y, m2, m3);
+        compute::kpm_spmv_diagonal(1, num_sites, num::IndexedEllRef<scalar_t>{indexed.ell()},
+                                   x, indexed_y, indexed_m2, indexed_m3);
+        REQUIRE(indexed_y.isApprox(y));
+        REQUIRE(indexed_m2 == Approx(m2));
+        REQUIRE(indexed_m3 == Approx(m3));
+
+        compute::kpm_spmv(1, num_sites, direct.ell(), x, off_diagonal_y);
+        compute::kpm_spmv(1, num_sites, indexed.ell(), x, indexed_off_diagonal_y);
+        REQUIRE(indexed_off_diagonal_y.isApprox(off_diagonal_y));
+
+        // The values are restored losslessly
+        auto restored = indexed.ell();
+        restored.restore_data();
+        REQUIRE(restored.has_data());
+        auto const rows = static_cast<int>(restored.rows());
+        REQUIRE((restored.data.topRows(rows) == direct.ell().data.topRows(rows)).all());
+    }
+
+    SECTION("Too many distinct values") {
+        // With `Config::reduced_precision` as well, values which can't be indexed are reduced
+        auto const large_model = Model(graphene::monolayer(), shape::rectangle(4, 4),
+                                       field::constant_potential(1));
+        auto distinct = ham::get_reference<scalar_t>(large_model.hamiltonian());
+        for (auto k = 0; k < distinct.nonZeros(); ++k) {
+            distinct.valuePtr()[k] *= 1 + 1e-3f * static_cast<float>(k);
+        }
+        REQUIRE(distinct.nonZeros() > 256);
+        auto const distinct_scale = kpm::Bounds<scalar_t>(&distinct,
+                                                          kpm::Config{}.lanczos_precision)
+            .scaling_factors();
+
+        auto config = kpm::MatrixConfig{kpm::MatrixConfig::Reorder::ON,
+                                        kpm::MatrixConfig::Format::ELL};
+        config.values = kpm::MatrixConfig::Values::INDEXED_OR_REDUCED;
+        auto reduced = kpm::OptimizedHamiltonian<scalar_t>(&distinct, config);
+        reduced.optimize_for({0, 0}, distinct_scale);
+        REQUIRE_FALSE(reduced.ell().is_indexed());
+        REQUIRE(reduced.ell().is_reduced());
+
+        // A few distinct values are still indexed and not reduced
+        auto indexed = kpm::OptimizedHamiltonian<scalar_t>(&matrix, config);
+        indexed.optimize_for({0, 0}, scale);
+        REQUIRE(indexed.ell().is_indexed());
+        REQUIRE_FALSE(indexed.ell().is_reduced());
+    }
+}
+
+TEST_CASE("KPM reduced precision", "[kpm]") {
+    // The LDOS with bfloat16 matrix values stays close to the full precision result
+    for (auto is_double : {false, true}) {
+        for (auto is_complex : {false, true}) {
+            auto const model = make_test_model(is_double, is_complex);
+            auto const i = model.system()->num_sites() / 2;
+            auto const energy_range = ArrayXd::LinSpaced(10, -0.3, 0.3);
+
+            auto config = kpm::Config{};
+            config.opt_level = 3;
+            for (auto depth : {1, 2}) {
+                INFO("double: " << is_double << ", complex: " << is_complex
+                     << ", depth: " << depth);
+                config.interleave_depth = depth;
+                config.reduced_precision = false;
+                auto const expected = make_kpm_strategy<kpm::DefaultStrategy>(
+                    model.hamiltonian(), config)->ldos(i, energy_range, 0.1);
+                config.reduced_precision = true;
+                auto const reduced = make_kpm_strategy<kpm::DefaultStrategy>(
+                    model.hamiltonian(), config)->ldos(i, energy_range, 0.1);
+                REQUIRE(reduced.isApprox(expected, 1e-2));
+            }
+        }
+    }
+
+    // The kernel is exact for the rounded values: compare with the regular ELLPACK kernel
+    // applied to the same values in full precision. Both the compressed and full column
+    // indices, starting from unaligned rows.
+    using scalar_t = std::complex<float>;
+    auto const model = make_test_model(false, true);
+    auto const& matrix = ham::get_reference<scalar_t>(model.hamiltonian());
+    auto const scale = kpm::Bounds<scalar_t>(&matrix, kpm::Config{}.lanczos_precision)
+        .scaling_factors();
+    auto const num_sites = static_cast<int>(matrix.rows());
+    for (auto indices : {kpm::MatrixConfig::Indices::FULL,
+                         kpm::MatrixConfig::Indices::COMPRESSED}) {
+        auto config = kpm::MatrixConfig{kpm::MatrixConfig::Reorder::ON,
+                                         kpm::MatrixConfig::Format::ELL, indices};
+        config.values = kpm::MatrixConfig::Values::REDUCED;
+        auto oh = kpm::OptimizedHamiltonian<scalar_t>(&matrix, config);
+        oh.optimize_for({0, 0}, scale);
+        auto const& ell = oh.ell();
+        REQUIRE(ell.is_reduced());
+
+        auto rounded = ell;
+        for (auto k = 0; k < rounded.data.size(); ++k) {
+            rounded.data.data()[k] = num::bfloat16_value<scalar_t>(ell.reduced.data() + 2 * k);
+        }
+
+        auto const x = VectorX<scalar_t>::Random(num_sites).eval();
+        auto y = VectorX<scalar_t>::Random(num_sites).eval();
+        auto reduced_y = y;
+
+        auto m2 = scalar_t{0}, m3 = scalar_t{0};
+        auto reduced_m2 = scalar_t{0}, reduced_m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(1, num_sites, rounded, x, y, m2, m3);
+        compute::kpm_spmv_diagonal(1, num_sites, num::ReducedEllRef<scalar_t>{ell},
+                                   x, reduced_y, reduced_m2, reduced_m3);
+        REQUIRE(reduced_y.isApprox(y));
+        REQUIRE(reduced_m2.real() == Approx(m2.real()));
+        REQUIRE(reduced_m3.real() == Approx(m3.real()));
+        REQUIRE(reduced_m3.imag() == Approx(m3.imag()));
+    }
+}
+
+TEST_CASE("KPM out-of-core matrix", "[kpm]") {
+    tmp::Directory const directory;
+    auto const filename = directory.file("matrix.bin");
+
+    SECTION("Stream") {
+        using scalar_t = float;
+        auto const model = make_test_model();
+        auto const& matrix = ham::get_reference<scalar_t>(model.hamiltonian());
+        auto const scale = kpm::Bounds<scalar_t>(&matrix, kpm::Config{}.lanczos_precision)
+            .scaling_factors();
+        auto const csr_config = kpm::MatrixConfig{kpm::MatrixConfig::Reorder::ON,
+                                                  kpm::MatrixConfig::Format::CSR};
+        auto oh = kpm::OptimizedHamiltonian<scalar_t>(&matrix, csr_config);
+        oh.optimize_for({0, 0}, scale);
+        // The reference blocks: the same reordering converted as a whole
+        auto const ell_config = kpm::MatrixConfig{kpm::MatrixConfig::Reorder::ON,
+                                                  kpm::MatrixConfig::Format::ELL};
+        auto ell_oh = kpm::OptimizedHamiltonian<scalar_t>(&matrix, ell_config);
+        ell_oh.optimize_for({0, 0}, scale);
+        auto const& ell = ell_oh.ell();
+
+        kpm::MatrixStream<scalar_t> stream(filename, oh.csr(), oh.sizes());
+        REQUIRE(stream.num_blocks() == oh.sizes().max_index() + 1);
+        REQUIRE(stream.num_blocks() > 3);
+        auto const file_size = static_cast<std::size_t>(
+            std::ifstream(filename, std::ios::binary | std::ios::ate).tellg()
+        );
+
+        // A sweep with a window of 2 blocks reads each block exactly once
+        for (auto k = 0; k < stream.num_blocks(); ++k) {
+            stream.window(std::max(k - 1, 0), k);
+            auto const& block = stream[k];
+            REQUIRE(block.first_row == (k > 0 ? oh.sizes()[k - 1] : 0));
+            REQUIRE(block.last_row == oh.sizes()[k]);
+            REQUIRE(block.nnz_per_row() == ell.nnz_per_row);
+            for (auto row = block.first_row; row < block.last_row; ++row) {
+                for (auto n = 0; n < ell.nnz_per_row; ++n) {
+                    REQUIRE(block.data(row - block.first_row, n) == ell.data(row, n));
+                    REQUIRE(block.indices(row - block.first_row, n) == ell.column(row, n));
+                }
+            }
+        }
+        REQUIRE(stream.bytes_read() == file_size);
+
+        // Starting a new sweep reads the first block again
+        stream.window(0, 0);
+        REQUIRE(stream.bytes_read() > file_size);
+    }
+
+    SECTION("LDOS") {
+        for (auto is_complex : {false, true}) {
+            auto const model = make_test_model(false, is_complex);
+            auto const i = model.system()->num_sites() / 2;
+            auto const energy_range = ArrayXd::LinSpaced(10, -0.3, 0.3);
+            auto const precision = Eigen::NumTraits<float>::dummy_precision();
+
+            auto config = kpm::Config{};
+            config.opt_level = 3;
+            auto bytes = std::vector<std::size_t>();
+            for (auto depth : {1, 2, 3}) {
+                INFO("complex: " << is_complex << ", depth: " << depth);
+                config.interleave_depth = depth;
+                config.matrix_file = "";
+                auto const expected = make_kpm_strategy<kpm::DefaultStrategy>(
+                    model.hamiltonian(), config)->ldos(i, energy_range, 0.1);
+                config.matrix_file = filename;
+                auto const strategy = make_kpm_strategy<kpm::DefaultStrategy>(
+                    model.hamiltonian(), config);
+                auto const streamed = strategy->ldos(i, energy_range, 0.1);
+                REQUIRE(streamed.isApprox(expected, precision));
+                bytes.push_back(strategy->get_stats().streamed_bytes);
+
+                // The next call for the same index reads the same file again
+                REQUIRE(std::ifstream(filename).good());
+                REQUIRE(strategy->ldos(i, energy_range, 0.1).isApprox(expected, precision));
+                REQUIRE(strategy->get_stats().streamed_bytes > 0);
+            }
+            // Deeper passes reuse each block for more iterations
+            REQUIRE(bytes[0] > bytes[1]);
+            REQUIRE(bytes[1] > bytes[2]);
+        }
+    }
+
+    // The file is removed together with the strategy
+    REQUIRE_FALSE(std::ifstream(filename).good());
+}
+
+TEST_CASE("KPM reconstruction", "[kpm]") {
+    auto const model = make_test_model(true, true);
+    auto const num_sites = model.system()->num_sites();
+    auto const i = num_sites / 2;
+    auto const j = num_sites / 4;
+    auto const energy_range = ArrayXd::LinSpaced(50, -0.9, 0.9);
+    auto const broadening = 0.1;
+
+    auto config = kpm::Config{};
+    auto direct = make_kpm_strategy<kpm::DefaultStrategy>(model.hamiltonian(), config);
+    auto const ldos = direct->ldos(i, energy_range, broadening);
+    auto const g_ij = direct->greens(i, j, energy_range, broadening);
+
+    config.reconstruction = kpm::Reconstruction::Clenshaw;
+    auto clenshaw = make_kpm_strategy<kpm::DefaultStrategy>(model.hamiltonian(), config);
+    REQUIRE(clenshaw->ldos(i, energy_range, broadening).isApprox(ldos, 1e-10));
+    REQUIRE(clenshaw->greens(i, j, energy_range, broadening).isApprox(g_ij, 1e-10));
+
+    config.reconstruction = kpm::Reconstruction::DCT;
+    auto dct = make_kpm_strategy<kpm::DefaultStrategy>(model.hamiltonian(), config);
+    REQUIRE(dct->ldos(i, energy_range, broadening).isApprox(ldos, 1e-4));
+    REQUIRE(dct->greens(i, j, energy_range, broadening).isApprox(g_ij, 1e-4));
+
+    // Several direct results are reconstructed together with the cached Chebyshev basis
+    auto const cols = std::vector<int>{j, j + 1, j + 2};
+    auto const g_vector = direct->greens_vector(i, cols, energy_range, broadening);
+    auto const g_clenshaw = clenshaw->greens_vector(i, cols, energy_range, broadening);
+    for (auto n = 0u; n < cols.size(); ++n) {
+        REQUIRE(g_vector[n].isApprox(g_clenshaw[n], 1e-8));
+    }
+    REQUIRE(g_vector[0].isApprox(g_ij, 1e-8));
+
+    auto const ldos_vector = direct->ldos_vector({i, j}, energy_range, broadening);
+    REQUIRE(ldos_vector.col(0).isApprox(ldos, 1e-8));
+    REQUIRE(ldos_vector.col(1).isApprox(clenshaw->ldos(j, energy_range, broadening), 1e-8));
+}
+
+TEST_CASE("KPM adaptive number of moments", "[kpm]") {
+    auto const model = make_test_model(true);
+    auto const i = model.system()->num_sites() / 2;
+    auto const energy_range = ArrayXd::LinSpaced(20, -0.5, 0.5);
+    auto const broadening = 0.02;
+
+    auto config = kpm::Config{};
+    auto full = make_kpm_strategy<kpm::DefaultStrategy>(model.hamiltonian(), config);
+    auto const expected = full->ldos(i, energy_range, broadening);
+    auto const num_moments = full->get_stats().num_moments;
+    REQUIRE(full->get_stats().used_moments == num_moments);
+
+    // A tolerance of 1 always stops after the second stage
+    config.convergence_tolerance = 1.0f;
+    auto adaptive = make_kpm_strategy<kpm::DefaultStrategy>(model.hamiltonian(), config);
+    auto const ldos = adaptive->ldos(i, energy_range, broadening);
+    auto const used = adaptive->get_stats().used_moments;
+    REQUIRE(adaptive->get_stats().num_moments == num_moments);
+    REQUIRE(used < num_moments);
+    REQUIRE_FALSE(ldos.isApprox(expected, 1e-6));
+
+    // Same as the full series with the kernel of all the moments, but the skipped ones zeroed
+    auto truncated = full->moments(i, {i}, num_moments).front();
+    truncated.data.tail(truncated.size() - used).setZero();
+    REQUIRE(ldos.isApprox(truncated.ldos(energy_range, broadening, config.kernel), 1e-8));
+
+    // A tight tolerance only stops if the moments really died out
+    config.convergence_tolerance = 1e-12f;
+    auto tight = make_kpm_strategy<kpm::DefaultStrategy>(model.hamiltonian(), config);
+    REQUIRE(tight->ldos(i, energy_range, broadening).isApprox(expected, 1e-6));
+
+    // Several indices stop one by one: the same as a single one, not the full block
+    auto const j = model.system()->num_sites() / 3;
+    auto const vector = adaptive->ldos_vector({i, j}, energy_range, broadening);
+    REQUIRE(vector.col(0).isApprox(ldos, 1e-8));
+    REQUIRE(vector.col(1).isApprox(adaptive->ldos(j, energy_range, broadening), 1e-8));
+    REQUIRE(adaptive->get_stats().used_moments < num_moments);
+
+    REQUIRE_THROWS_WITH(adaptive->greens_block({i}, {j}, energy_range, broadening),
+                        Catch::Contains("convergence tolerance"));
+}
+
+TEST_CASE("KPM raw moments", "[kpm]") {
+    auto const model = make_test_model(true, true);
+    auto const num_sites = model.system()->num_sites();
+    auto const i = num_sites / 2;
+    auto const j = num_sites / 4;
+    auto const energy_range = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const kernel = kpm::lorentz_kernel();
+
+    auto kpm = make_kpm(model);
+    auto const diagonal = kpm.calc_moments(i, {i}, 300);
+    auto const off_diagonal = kpm.calc_moments(i, {j, j + 1}, 300);
+    REQUIRE(diagonal.size() == 1);
+    REQUIRE(off_diagonal.size() == 2);
+    REQUIRE(diagonal[0].size() >= 300);
+
+    // The same moments can be reused for different broadenings
+    for (auto broadening : {0.4, 0.2}) {
+        auto const g_ii = kpm.calc_greens(i, i, energy_range, broadening);
+        REQUIRE(diagonal[0].greens(energy_range, broadening, kernel).isApprox(g_ii));
+        auto const g_ij = kpm.calc_greens(i, j, energy_range, broadening);
+        REQUIRE(off_diagonal[0].greens(energy_range, broadening, kernel).isApprox(g_ij));
+        auto const pi = double{constant::pi};
+        REQUIRE(diagonal[0].ldos(energy_range, broadening, kernel)
+                    .isApprox(-1/pi * g_ii.imag(), 1e-6));
+    }
+
+    // Not enough moments for a very fine broadening
+    REQUIRE_THROWS(diagonal[0].greens(energy_range, 0.001, kernel));
+}
+
+TEST_CASE("KPM resumable moments", "[kpm]") {
+    for (auto opt_level : {0, 1, 3, 4}) {
+        INFO("opt_level: " << opt_level);
+        auto const model = make_test_model(true, false);
+        auto const i = model.system()->num_sites() / 2;
+
+        auto config = kpm::Config{};
+        config.opt_level = opt_level;
+        auto kpm = make_kpm(model, config);
+        auto const reference = kpm.calc_moments(i, {i}, 302).front();
+
+        auto const first = kpm.calc_resumable_moments(i, 150);
+        REQUIRE(first.is_resumable());
+        REQUIRE(first.size() == 150);
+        REQUIRE(first.data.isApprox(reference.data.head(150)));
+
+        auto const extended = kpm.extend_moments(i, first, 302);
+        REQUIRE(extended.is_resumable());
+        REQUIRE(extended.size() == 302);
+        REQUIRE(extended.data.isApprox(reference.data));
+
+        // The checkpoint is only valid for the original index and Hamiltonian scaling
+        REQUIRE_THROWS(kpm.extend_moments(i + 1, first, 302));
+        auto mismatch = first;
+        mismatch.index = i + 1;
+        REQUIRE_THROWS(kpm.extend_moments(i, mismatch, 302));
+        mismatch = first;
+        mismatch.a *= 2;
+        REQUIRE_THROWS(kpm.extend_moments(i, mismatch, 302));
+    }
+}
+
+TEST_CASE("KPM conductivity", "[kpm]") {
+    using scalar_t = double;
+    auto const model = make_test_model(true, false);
+    auto const& system = *model.system();
+    auto const& h = ham::get_reference<scalar_t>(model.hamiltonian());
+
+    // v_ij = h_ij * (x_j - x_i): antisymmetric for a real Hamiltonian
+    auto const velocity_x = ham::velocity(model.hamiltonian(), system, {1, 0, 0});
+    auto const& vx = ham::get_reference<scalar_t>(velocity_x);
+    REQUIRE(vx.nonZeros() == h.nonZeros());
+    auto const& x = system.positions.x;
+    for (auto i = 0; i < h.outerSize(); ++i) {
+        for (auto it = SparseMatrixX<scalar_t>::InnerIterator(h, i); it; ++it) {
+            auto const j = it.col();
+            REQUIRE(vx.coeff(i, j) == Approx(it.value() * (x[j] - x[i])));
+            REQUIRE(vx.coeff(j, i) == Approx(-vx.coeff(i, j)));
+        }
+    }
+
+    // The blocking of the 2D moments doesn't change the result
+    auto const velocity_y = ham::velocity(model.hamiltonian(), system, {0, 1, 0});
+    auto const& vy = ham::get_reference<scalar_t>(velocity_y);
+    auto oh = kpm::OptimizedHamiltonian<scalar_t>(
+        &h, {kpm::MatrixConfig::Reorder::OFF, kpm::MatrixConfig::Format::CSR}
+    );
+    oh.optimize_for({0, 0}, kpm::Scale<scalar_t>(-10, 10));
+    auto const r = num::make_random<VectorX<scalar_t>>(h.rows());
+    auto full = kpm::DenseMatrixMoments<scalar_t>(20, vx, vy);
+    kpm::calc_moments::dense_matrix::basic(full, oh.csr(), r, 20);
+    auto blocked = kpm::DenseMatrixMoments<scalar_t>(20, vx, vy);
+    kpm::calc_moments::dense_matrix::basic(blocked, oh.csr(), r, 3);
+    REQUIRE(blocked.get().isApprox(full.get()));
+
+    // Direct evaluation of a few elements: mu_nm = <T_m(H) v_l r | v_r T_n(H) r>
+    auto const chebyshev = [&](VectorX<scalar_t> const& v, int n) {
+        VectorX<scalar_t> t0 = v;
+        VectorX<scalar_t> t1 = 0.5 * (oh.csr() * v);
+        for (auto k = 0; k < n; ++k) {
+            VectorX<scalar_t> t2 = oh.csr() * t1 - t0;
+            t0 = t1;
+            t1 = t2;
+        }
+        return t0;
+    };
+    for (auto n : {0, 1, 7}) {
+        for (auto m : {0, 2, 19}) {
+            VectorX<scalar_t> const left = chebyshev(vx * r, m);
+            VectorX<scalar_t> const right = vy * chebyshev(r, n);
+            REQUIRE(full.get()(n, m) == Approx(left.dot(right)));
+        }
+    }
+
+    // No states below the band: nothing to conduct
+    auto kpm = make_kpm(model);
+    auto const mu = ArrayXd::LinSpaced(5, -0.5, 0.5);
+    auto const sigma = kpm.calc_conductivity({1, 0, 0}, {1, 0, 0}, mu, 0.5, 0, 2, 200);
+    REQUIRE(sigma.size() == mu.size());
+    REQUIRE(sigma.allFinite());
+    auto const empty = kpm.calc_conductivity({1, 0, 0}, {1, 0, 0}, ArrayXd::Constant(1, -100),
+                                             0.5, 0, 1, 200);
+    REQUIRE(std::abs(empty[0]) == Approx(0));
+}
+
 TEST_CASE("KPM strategy", "[kpm]") {
 #ifndef CPB_USE_CUDA
-    test_kpm_strategy<kpm::DefaultStrategy, 3>();
+    test_kpm_strategy<kpm::DefaultStrategy, 4>();
 #else
-    auto const cpu_results = test_kpm_strategy<kpm::DefaultStrategy, 3>();
-    auto const cuda_results = test_kpm_strategy<kpm::CudaStrategy, 1>();
+    auto const cpu_results = test_kpm_strategy<kpm::DefaultStrategy, 4>();
+    auto const cuda_results = test_kpm_strategy<kpm::CudaStrategy, 2>();
+    auto const multi_gpu_results = test_kpm_strategy<kpm::MultiGpuStrategy, 2>();
     auto const precision = Eigen::NumTraits<float>::dummy_precision();
     for (auto i = 0u; i < cpu_results.size(); ++i) {
         REQUIRE(cpu_results[i].g_ii.isApprox(cuda_results[i].g_ii, precision));
         REQUIRE(cpu_results[i].g_ij.isApprox(cuda_results[i].g_ij, precision));
+        REQUIRE(cpu_results[i].g_ii.isApprox(multi_gpu_results[i].g_ii, precision));
+        REQUIRE(cpu_results[i].g_ij.isApprox(multi_gpu_results[i].g_ij, precision));
     }
 #endif // CPB_USE_CUDA
 }
 
+
+TEST_CASE("KPM onsite energy change", "[kpm]") {
+    auto model = make_test_model();
+    auto const& system = *model.system();
+    auto const i = system.num_sites() / 2;
+    auto kpm = make_kpm(model);
+    kpm.calc_ldos(ArrayXd::LinSpaced(10, -1, 1), 0.1, system.positions[i]);
+
+    model.clear_onsite_modifiers();
+    model.add(field::constant_potential(1.5f));
+    REQUIRE(ham::differs_only_in_onsite(kpm.get_model().hamiltonian(), model.hamiltonian()));
+
+    auto const energy = ArrayXd::LinSpaced(10, -1, 1);
+    kpm.set_model(model);
+    auto const ldos = kpm.calc_ldos(energy, 0.1, system.positions[i]);
+    REQUIRE(kpm.report(false).find("shifted") != std::string::npos);
+
+    auto const reference = make_kpm(model).calc_ldos(energy, 0.1, system.positions[i]);
+    REQUIRE(ldos.isApprox(reference, 1e-2));
+
+    SECTION("Bounds") {
+        using scalar_t = float;
+        auto const previous_model = make_test_model();
+        auto const& previous = ham::get_reference<scalar_t>(previous_model.hamiltonian());
+        auto const& matrix = ham::get_reference<scalar_t>(model.hamiltonian());
+        auto shifted = kpm::Bounds<scalar_t>(&previous, kpm::Config{}.lanczos_precision);
+        auto const previous_scale = shifted.scaling_factors();
+        REQUIRE(shifted.shift_diagonal(previous, &matrix));
+
+        auto lanczos = kpm::Bounds<scalar_t>(&matrix, kpm::Config{}.lanczos_precision);
+        REQUIRE(shifted.scaling_factors().a == Approx(lanczos.scaling_factors().a).epsilon(1e-2));
+        REQUIRE(shifted.scaling_factors().b == Approx(lanczos.scaling_factors().b).epsilon(1e-2));
+        REQUIRE(shifted.scaling_factors().a <= previous_scale.a);
+    }
+
+    SECTION("Replace the onsite energies repeatedly") {
+        // The first change copies the matrix and the following ones patch that copy
+        auto const base = make_test_model();
+        auto const h = ham::with_diagonal(base.hamiltonian());
+        auto const onsite = ham::real_diagonal(h);
+        auto config = kpm::Config{};
+        config.min_energy = -4.f; // the same bounds for the reference
+        config.max_energy = 4.f;
+        auto strategy = make_kpm_strategy<kpm::DefaultStrategy>(h, config);
+        strategy->ldos(i, energy, 0.1);
+        for (auto shift : {0.5f, -0.25f, 0.75f}) {
+            REQUIRE(strategy->change_onsite(onsite + shift));
+            auto shifted = make_test_model();
+            shifted.add(field::constant_potential(shift));
+            auto const expected = make_kpm_strategy<kpm::DefaultStrategy>(
+                ham::with_diagonal(shifted.hamiltonian()), config)->ldos(i, energy, 0.1);
+            REQUIRE(strategy->ldos(i, energy, 0.1).isApprox(expected, 1e-4));
+        }
+        REQUIRE(ham::real_diagonal(h).isApprox(onsite)); // the model's matrix is untouched
+    }
+}
+
+TEST_CASE("KPM builds the Hamiltonian on first use", "[kpm]") {
+    auto num_calls = 0;
+    auto model = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                       OnsiteModifier([&](ComplexArrayRef, CartesianArray const&, SubIdRef) {
+                           ++num_calls;
+                       }));
+
+    auto kpm = make_kpm(model);
+    REQUIRE(num_calls == 0);
+    kpm.set_model(model); // still nothing to reuse
+    REQUIRE(num_calls == 0);
+
+    kpm.calc_ldos(ArrayXd::LinSpaced(10, -1, 1), 0.1, {0, 0, 0});
+    REQUIRE(num_calls == 1);
+    REQUIRE(kpm.report(true).size() > 0);
+    REQUIRE(num_calls == 1);
+}
+
+TEST_CASE("KPM spatial LDOS", "[kpm]") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(3, 3),
+                             field::linear_onsite());
+    auto const kpm = make_kpm(model);
+    auto const energy = ArrayXd::LinSpaced(10, -0.5, 0.5);
+    auto const region = shape::rectangle(1.6f, 1.2f);
+
+    auto const indices = kpm.spatial_indices(region);
+    REQUIRE(indices.size() > 32); // more than a single block
+    REQUIRE(static_cast<int>(indices.size()) < model.system()->num_sites());
+
+    auto const ldos = kpm.calc_spatial_ldos(energy, 0.1, region);
+    REQUIRE(ldos.rows() == energy.size());
+    REQUIRE(ldos.cols() == static_cast<int>(indices.size()));
+    for (auto i : {0, 17, 33, static_cast<int>(indices.size()) - 1}) {
+        auto const position = model.system()->position(indices[i]);
+        auto const expected = kpm.calc_ldos(energy, 0.1, position);
+        REQUIRE(ldos.col(i).isApprox(expected, 1e-4));
+    }
+
+    REQUIRE_THROWS_WITH(kpm.calc_spatial_ldos(energy, 0.1, shape::rectangle(0.01f, 0.01f)),
+                        Catch::Contains("no sites"));
+}
+
+TEST_CASE("KPM point symmetry", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(10, -0.5, 0.5);
+
+    SECTION("Symmetric flake") {
+        auto const model = Model(graphene::monolayer(), shape::rectangle(2, 2));
+        auto const symmetry = ham::find_point_symmetry(*model.system(), model.hamiltonian());
+        REQUIRE(symmetry.group_order() > 1);
+        auto const representatives = symmetry.orbit_representatives();
+        REQUIRE(static_cast<int>(representatives.size()) < model.system()->num_sites());
+
+        auto kpm = make_kpm(model);
+        auto const region = shape::rectangle(1.2f, 1.2f);
+        auto const expected = kpm.calc_spatial_ldos(energy, 0.1, region);
+        kpm.set_symmetry(true);
+        REQUIRE(kpm.calc_spatial_ldos(energy, 0.1, region).isApprox(expected, 1e-4));
+    }
+
+    SECTION("Broken by the onsite energy") {
+        auto const model = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                 field::linear_onsite());
+        auto kpm = make_kpm(model);
+        auto indices = std::vector<int>();
+        for (auto i = 0; i < model.system()->num_sites(); i += 3) {
+            indices.push_back(i);
+        }
+        auto const expected = kpm.calc_ldos_vector(indices, energy, 0.1);
+        kpm.set_symmetry(true);
+        REQUIRE(kpm.calc_ldos_vector(indices, energy, 0.1).isApprox(expected, 1e-4));
+    }
+
+    SECTION("Periodic") {
+        auto const model = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                 TranslationalSymmetry(1, 0));
+        auto const symmetry = ham::find_point_symmetry(*model.system(), model.hamiltonian());
+        REQUIRE(symmetry.empty());
+    }
+}
+
+TEST_CASE("KPM streamed results", "[kpm]") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                             field::linear_onsite());
+    auto const kpm = make_kpm(model);
+    auto const energy = ArrayXd::LinSpaced(20, -0.5, 0.5);
+    tmp::Directory const directory;
+    auto const filename = directory.file("results.bin");
+
+    auto indices = std::vector<int>();
+    for (auto i = 0; i < model.system()->num_sites(); i += 2) {
+        indices.push_back(i);
+    }
+    REQUIRE(indices.size() > 32); // more than a single block
+
+    SECTION("LDOS") {
+        kpm::BinaryFileSink sink(filename, 5);
+        kpm.calc_ldos_stream(indices, energy, 0.1, sink);
+        auto const expected = kpm.calc_ldos_vector(indices, energy, 0.1);
+
+        auto const results = kpm::read_results(filename);
+        REQUIRE_FALSE(results.is_complex);
+        REQUIRE(results.energy.isApprox(energy));
+        REQUIRE(std::equal(indices.begin(), indices.end(), results.indices.data()));
+        REQUIRE(results.values.imag().isZero());
+        REQUIRE(results.values.real().isApprox(expected));
+    }
+
+    SECTION("Green's function") {
+        auto const cols = std::vector<int>(indices.begin(), indices.begin() + 7);
+        kpm::BinaryFileSink sink(filename, 3);
+        kpm.calc_greens_stream(indices[9], cols, energy, 0.1, sink);
+        auto const expected = kpm.calc_greens_vector(indices[9], cols, energy, 0.1);
+
+        auto const results = kpm::read_results(filename);
+        REQUIRE(results.is_complex);
+        REQUIRE(results.indices.size() == static_cast<int>(cols.size()));
+        for (auto i = 0; i < static_cast<int>(cols.size()); ++i) {
+            REQUIRE(results.indices[i] == cols[i]);
+            REQUIRE(results.values.col(i).isApprox(expected[i]));
+        }
+    }
+
+    REQUIRE_THROWS_WITH(kpm::read_results(directory.file("missing.bin")),
+                        Catch::Contains("Invalid"));
+}
+
+TEST_CASE("KPM Green's function block", "[kpm]") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                             field::linear_onsite());
+    auto const energy = ArrayXd::LinSpaced(10, -0.5, 0.5);
+    auto const precision = Eigen::NumTraits<float>::dummy_precision();
+    auto const num_sites = model.system()->num_sites();
+
+    // More rows than a single block and a col which is also a row
+    auto rows = std::vector<int>();
+    for (auto i = 0; i < 40; ++i) {
+        rows.push_back(i * num_sites / 40);
+    }
+    auto const cols = std::vector<int>{rows[3], num_sites / 3, num_sites - 1};
+
+    auto config = kpm::Config{};
+    for (auto opt_level : {0, 1, 3, 4}) {
+        INFO("opt_level: " << opt_level);
+        config.opt_level = opt_level;
+        auto strategy = make_kpm_strategy<kpm::DefaultStrategy>(model.hamiltonian(), config);
+        auto const block = strategy->greens_block(rows, cols, energy, 0.1);
+        REQUIRE(block.size() == rows.size() * cols.size());
+
+        for (auto i : {0, 3, 33, 39}) {
+            auto const expected = strategy->greens_vector(rows[i], cols, energy, 0.1);
+            for (auto j = 0; j < static_cast<int>(cols.size()); ++j) {
+                REQUIRE(block[i * cols.size() + j].isApprox(expected[j], precision));
+            }
+        }
+    }
+
+    auto const kpm = make_kpm(model);
+    REQUIRE_THROWS_WITH(kpm.calc_greens_block(rows, {num_sites}, energy, 0.1),
+                        Catch::Contains("invalid value"));
+}
+
+TEST_CASE("Async KPM", "[kpm]") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                             field::linear_onsite());
+    auto const energy = ArrayXd::LinSpaced(10, -0.5, 0.5);
+    auto const kpm = make_kpm(model);
+    auto const async_kpm = make_async_kpm(2);
+
+    auto ldos = std::vector<AsyncResult<ArrayXd>>();
+    for (auto i = 0; i < 4; ++i) {
+        ldos.push_back(async_kpm.calc_ldos(model, energy, 0.1, {0.1f * i, 0, 0}));
+    }
+    auto const greens = async_kpm.calc_greens(model, 0, 3, energy, 0.1);
+    for (auto i = 0; i < 4; ++i) {
+        REQUIRE(ldos[i].get().isApprox(kpm.calc_ldos(energy, 0.1, {0.1f * i, 0, 0})));
+    }
+    REQUIRE(greens.get().isApprox(kpm.calc_greens(0, 3, energy, 0.1)));
+
+    // An error is passed on to the caller
+    auto const invalid = async_kpm.calc_ldos_vector(model, {-1}, energy, 0.1);
+    REQUIRE_THROWS_WITH(invalid.get(), Catch::Contains("invalid index"));
+
+    // Block the only worker so that the next request stays queued
+    auto const pool = std::make_shared<TaskPool>(1);
+    auto const queued_kpm = AsyncKPM(pool, async_kpm.get_make_strategy());
+    auto release = std::promise<void>();
+    auto const blocker = release.get_future().share();
+    pool->submit([blocker]() { blocker.wait(); });
+
+    auto cancelled = queued_kpm.calc_dos(model, energy, 0.1, 1);
+    auto const kept = queued_kpm.calc_dos(model, energy, 0.1, 1);
+    REQUIRE_FALSE(cancelled.wait_for(0.01));
+    cancelled.cancel();
+    release.set_value();
+    REQUIRE_THROWS_AS(cancelled.get(), CancelledError);
+    REQUIRE(cancelled.is_cancelled());
+    REQUIRE(kept.get().size() == energy.size());
+}
+
+TEST_CASE("KPM shared matrix", "[kpm]") {
+    auto const model = make_test_model();
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const i = model.system()->find_nearest({0, 0.07f, 0}, "B");
+
+    auto config = kpm::Config{};
+    config.share_matrix = true;
+    auto const reference = make_kpm(model);
+    auto const first = make_kpm(model, config);
+    auto const second = make_kpm(model, config);
+
+    auto const expected = reference.calc_ldos_vector({i, i + 1}, energy, 0.1);
+    REQUIRE(first.calc_ldos_vector({i}, energy, 0.1).col(0).isApprox(expected.col(0), 1e-4));
+    REQUIRE(second.calc_ldos_vector({i + 1}, energy, 0.1).col(0).isApprox(expected.col(1),
+                                                                           1e-4));
+    REQUIRE(second.get_stats().cache_hits == 1); // the matrix of `first` was reused
+}
+
+TEST_CASE("KPM permuted matrix", "[kpm]") {
+    auto const model = make_test_model();
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const i = model.system()->find_nearest({0, 0.07f, 0}, "B");
+    auto const j = model.system()->find_nearest({0.1f, -0.05f, 0}, "A");
+
+    for (auto opt_level = 1; opt_level <= 3; ++opt_level) {
+        auto config = kpm::Config{};
+        config.opt_level = opt_level;
+        auto const reference = make_kpm(model, config);
+        config.permute_only = true;
+        auto const permuted = make_kpm(model, config);
+
+        auto const expected = reference.calc_ldos_vector({i, j}, energy, 0.1);
+        REQUIRE(permuted.calc_ldos_vector({i}, energy, 0.1).col(0).isApprox(expected.col(0),
+                                                                            1e-4));
+        REQUIRE(permuted.calc_ldos_vector({j}, energy, 0.1).col(0).isApprox(expected.col(1),
+                                                                            1e-4));
+
+        auto const expected_g = reference.calc_greens(i, j, energy, 0.1);
+        REQUIRE(permuted.calc_greens(i, j, energy, 0.1).isApprox(expected_g, 1e-4));
+    }
+}
+
+TEST_CASE("KPM block sparse matrix", "[kpm]") {
+    // Complete unit cells: each pair of consecutive sites is a block with `UnitCell` order
+    auto model = Model(graphene::monolayer(), Primitive(8, 8), field::constant_potential(1));
+    model.set_site_order(SiteOrder::UnitCell);
+    auto const energy = ArrayXd::LinSpaced(10, -0.3, 0.3);
+    auto const i = model.system()->find_nearest({0, 0.07f, 0}, "B");
+    auto const j = model.system()->find_nearest({0.2f, -0.1f, 0}, "A");
+
+    using scalar_t = float;
+    auto const matrix = ham::get_reference<scalar_t>(model.hamiltonian());
+    auto bounds = kpm::Bounds<scalar_t>(&matrix, kpm::Config{}.lanczos_precision);
+    auto matrix_config = kpm::MatrixConfig{kpm::MatrixConfig::Reorder::OFF,
+                                           kpm::MatrixConfig::Format::BSR};
+    matrix_config.block_size = 2;
+    auto oh = kpm::OptimizedHamiltonian<scalar_t>(&matrix, matrix_config);
+    oh.optimize_for({i, i}, bounds.scaling_factors());
+    REQUIRE(oh.is_bsr());
+    REQUIRE(oh.bsr().block_size == 2);
+
+    for (auto opt_level = 0; opt_level <= 3; ++opt_level) {
+        auto config = kpm::Config{};
+        config.opt_level = opt_level;
+        auto const reference = make_kpm(model, config);
+        config.block_size = 2;
+        auto const blocked = make_kpm(model, config);
+
+        auto const expected = reference.calc_ldos_vector({i, j}, energy, 0.1);
+        REQUIRE(blocked.calc_ldos_vector({i, j}, energy, 0.1).isApprox(expected, 1e-4));
+        auto const expected_g = reference.calc_greens(i, j, energy, 0.1);
+        REQUIRE(blocked.calc_greens(i, j, energy, 0.1).isApprox(expected_g, 1e-4));
+    }
+}
+
+namespace {
+    /// Onsite disorder of realization `n` which depends only on the site positions
+    struct WaveDisorder {
+        int n;
+        ArrayXf x, y;
+
+        ArrayXf values() const { return 0.2f * (static_cast<float>(n) + 7 * x + 3 * y).sin(); }
+
+        template<class Array>
+        void operator()(Array energy) const {
+            using scalar_t = typename Array::Scalar;
+            energy = values().template cast<scalar_t>();
+        }
+    };
+} // anonymous namespace
+
+TEST_CASE("Disorder ensemble", "[kpm]") {
+    auto const shape = shape::rectangle(1.2f, 1.2f);
+    auto const model = Model(graphene::monolayer(), shape);
+    auto buffer = CartesianArray();
+    auto const positions = CartesianArray(model.system()->expanded_positions(buffer));
+    auto const energy = ArrayXd::LinSpaced(10, -0.5, 0.5);
+    auto const indices = std::vector<int>{0, 3, 7, model.system()->num_sites() - 1};
+
+    auto const make_realization = [&](int n) {
+        return Model(graphene::monolayer(), shape, OnsiteModifier{
+            [n](ComplexArrayRef energy, CartesianArray const& pos, SubIdRef) {
+                num::match<ArrayX>(energy, WaveDisorder{n, pos.x, pos.y});
+            }
+        });
+    };
+    auto const ensemble = make_disorder_ensemble(model, [&](int n) {
+        return ArrayXd{WaveDisorder{n, positions.x, positions.y}.values().cast<double>()};
+    }, -0.2, 0.2, {}, 2);
+
+    // Reference: a separate KPM for each realization with the same energy range
+    auto config = kpm::Config{};
+    config.min_energy = static_cast<float>(ensemble.energy_range().first);
+    config.max_energy = static_cast<float>(ensemble.energy_range().second);
+
+    SECTION("LDOS") {
+        auto const num_realizations = 5;
+        auto expected = ArrayXXd{ArrayXXd::Zero(energy.size(), 4)};
+        for (auto n = 0; n < num_realizations; ++n) {
+            expected += make_kpm(make_realization(n), config).calc_ldos_vector(indices,
+                                                                              energy, 0.1);
+        }
+        expected /= num_realizations;
+
+        auto const ldos = ensemble.calc_ldos(indices, energy, 0.1, num_realizations);
+        REQUIRE(ldos.isApprox(expected, 1e-4));
+        auto const moments = ensemble.ldos_moments(indices, 100, num_realizations);
+        REQUIRE(moments.size() == indices.size());
+        REQUIRE(moments[0].size() >= 100);
+    }
+
+    SECTION("DOS") {
+        auto const expected = make_kpm(make_realization(0), config).calc_dos(energy, 0.1, 4);
+        REQUIRE(ensemble.calc_dos(energy, 0.1, 1, 4).isApprox(expected, 1e-4));
+
+        // The same realizations and random vectors regardless of the number of threads
+        auto const single_thread = make_disorder_ensemble(model, [&](int n) {
+            return ArrayXd{WaveDisorder{n, positions.x, positions.y}.values().cast<double>()};
+        }, -0.2, 0.2);
+        REQUIRE(ensemble.calc_dos(energy, 0.1, 6, 4).isApprox(
+            single_thread.calc_dos(energy, 0.1, 6, 4), 1e-4
+        ));
+    }
+
+    SECTION("Disorder out of range") {
+        auto const strong = make_disorder_ensemble(model, [&](int) {
+            return ArrayXd{ArrayXd::Constant(positions.size(), 0.5)};
+        }, -0.2, 0.2);
+        REQUIRE_THROWS_WITH(strong.calc_dos(energy, 0.1, 2), Catch::Contains("disorder range"));
+    }
+}
+
+TEST_CASE("KPM bounds methods", "[kpm]") {
+    using scalar_t = float;
+    auto const model = Model(graphene::monolayer(), shape::rectangle(3, 3),
+                             field::constant_potential(1));
+    auto const& matrix = ham::get_reference<scalar_t>(model.hamiltonian());
+    auto const precision = kpm::Config{}.lanczos_precision;
+
+    auto lanczos = kpm::Bounds<scalar_t>(&matrix, precision);
+    auto const scale = lanczos.scaling_factors();
+
+    SECTION("Gershgorin discs contain the spectrum") {
+        auto gershgorin = kpm::Bounds<scalar_t>(&matrix, precision, kpm::BoundsMethod::Gershgorin);
+        auto const cheap = gershgorin.scaling_factors();
+        REQUIRE(cheap.b - cheap.a <= scale.b - scale.a * 0.99f);
+        REQUIRE(cheap.b + cheap.a >= scale.b + scale.a * 0.99f);
+        REQUIRE(gershgorin.report().find("Gershgorin") != std::string::npos);
+    }
+
+    SECTION("Cache") {
+        auto first = kpm::Bounds<scalar_t>(&matrix, precision, kpm::BoundsMethod::Lanczos, true);
+        REQUIRE(first.scaling_factors() == scale);
+
+        auto const copy = SparseMatrixX<scalar_t>(matrix);
+        auto second = kpm::Bounds<scalar_t>(&copy, precision, kpm::BoundsMethod::Lanczos, true);
+        REQUIRE(second.scaling_factors() == scale);
+        REQUIRE(second.report().find("cached") != std::string::npos);
+
+        auto const different = SparseMatrixX<scalar_t>(matrix * 1.5f);
+        auto third = kpm::Bounds<scalar_t>(&different, precision, kpm::BoundsMethod::Lanczos, true);
+        REQUIRE(third.scaling_factors().a == Approx(1.5f * scale.a).epsilon(1e-2));
+        REQUIRE(third.report().find("cached") == std::string::npos);
+
+        // Only the same matrix at the same precision is a hit and only if requested
+        auto fourth = kpm::Bounds<scalar_t>(&copy, 2 * precision, kpm::BoundsMethod::Lanczos,
+                                            true);
+        fourth.scaling_factors();
+        REQUIRE(fourth.report().find("cached") == std::string::npos);
+        REQUIRE_FALSE(kpm::Config{}.cache_bounds);
+    }
+
+    SECTION("Warm start") {
+        auto perturbed = SparseMatrixX<scalar_t>(matrix * 1.02f);
+        for (auto k = 0; k < perturbed.rows(); ++k) {
+            perturbed.coeffRef(k, k) += 0.02f * static_cast<float>(k % 3);
+        }
+
+        auto previous = kpm::Bounds<scalar_t>(&matrix, precision, kpm::BoundsMethod::WarmLanczos);
+        REQUIRE(previous.scaling_factors() == scale); // same random start the first time
+
+        auto warm = kpm::Bounds<scalar_t>(&perturbed, precision, kpm::BoundsMethod::WarmLanczos);
+        warm.warm_start(std::move(previous));
+        auto cold = kpm::Bounds<scalar_t>(&perturbed, precision);
+        REQUIRE(warm.scaling_factors().a == Approx(cold.scaling_factors().a).epsilon(1e-2));
+        REQUIRE(warm.scaling_factors().b == Approx(cold.scaling_factors().b).epsilon(1e-2));
+
+        auto const loops = [](std::string const& report) {
+            return std::stoi(report.substr(report.find("with ") + 5));
+        };
+        REQUIRE(loops(warm.report()) < loops(cold.report()));
+    }
+}
+
+namespace {
+    /// Compare the Chebyshev propagator with the exact evolution from a dense eigensolver
+    template<class scalar_t>
+    void check_propagator(Model const& model, float tolerance) {
+        using real_t = num::get_real_t<scalar_t>;
+        using complex_t = num::get_complex_t<scalar_t>;
+        using complex_d = std::complex<double>;
+        auto const& h = ham::get_reference<scalar_t>(model.hamiltonian());
+        auto const size = static_cast<int>(h.rows());
+
+        MatrixX<complex_d> const dense = h.toDense().template cast<complex_d>();
+        Eigen::SelfAdjointEigenSolver<MatrixX<complex_d>> solver(dense);
+        auto const& energy = solver.eigenvalues();
+        auto const& vectors = solver.eigenvectors();
+
+        auto state = VectorX<complex_t>(size);
+        num::random_phase_fill(state);
+        state /= std::sqrt(static_cast<real_t>(size));
+
+        auto const time = 0.7; // fs
+        auto const x = time * 1e-15 / static_cast<double>(constant::hbar);
+        VectorX<complex_d> projected = vectors.adjoint() * state.template cast<complex_d>();
+        for (auto i = 0; i < size; ++i) {
+            projected[i] *= std::exp(complex_d{0, -energy[i] * x});
+        }
+        VectorX<complex_d> const expected = vectors * projected;
+
+        auto const scale = kpm::Scale<real_t>(static_cast<real_t>(energy.minCoeff()),
+                                              static_cast<real_t>(energy.maxCoeff()));
+        for (auto format : {kpm::MatrixConfig::Format::CSR, kpm::MatrixConfig::Format::ELL,
+                            kpm::MatrixConfig::Format::SELL}) {
+            auto const propagator = kpm::Propagator<scalar_t>(&h, scale, format);
+            REQUIRE(propagator.num_terms(time) > propagator.num_terms(time / 2));
+
+            VectorX<complex_d> const result = propagator.evolve(state, time)
+                                                        .template cast<complex_d>();
+            REQUIRE(result.norm() == Approx(1).epsilon(tolerance));
+            REQUIRE(result.isApprox(expected, tolerance));
+
+            auto const steps = propagator.evolve_steps(state, time / 2, 2);
+            REQUIRE(steps.cols() == 2);
+            REQUIRE(steps.col(1).template cast<complex_d>().isApprox(expected, tolerance));
+        }
+    }
+} // anonymous namespace
+
+TEST_CASE("Propagator", "[kpm]") {
+    SECTION("Bessel functions") {
+        auto const j = kpm::bessel_j(6, 10.0);
+        REQUIRE(j[0] == Approx(-0.2459357644513483));
+        REQUIRE(j[1] == Approx(0.0434727461688614));
+        REQUIRE(j[5] == Approx(-0.2340615281867936));
+        REQUIRE(kpm::bessel_j(2, -1.0)[1] == Approx(-0.4400505857449335));
+        REQUIRE(kpm::bessel_j(3, 0.0).isApprox(VectorX<double>::Unit(3, 0).array()));
+        REQUIRE(kpm::bessel_j(60, 1000.0)[50] == Approx(-0.0033360489606153).epsilon(1e-6));
+    }
+
+    SECTION("Real float") {
+        check_propagator<float>(make_test_model(), 1e-4f);
+    }
+
+    SECTION("Complex double") {
+        check_propagator<std::complex<double>>(make_test_model(true, true), 1e-8f);
+    }
+}
+
+namespace {
+    /// Compare the recursion method with the exact Green's functions of the eigenstates
+    template<class scalar_t>
+    void check_recursion(Model const& model) {
+        using real_t = num::get_real_t<scalar_t>;
+        using complex_d = std::complex<double>;
+        auto const& h = ham::get_reference<scalar_t>(model.hamiltonian());
+        auto const size = static_cast<int>(h.rows());
+
+        MatrixX<complex_d> const dense = h.toDense().template cast<complex_d>();
+        Eigen::SelfAdjointEigenSolver<MatrixX<complex_d>> solver(dense);
+        auto const& eigenvalues = solver.eigenvalues();
+        auto const& vectors = solver.eigenvectors();
+
+        auto const scale = kpm::Scale<real_t>(static_cast<real_t>(eigenvalues.minCoeff()),
+                                              static_cast<real_t>(eigenvalues.maxCoeff()));
+        auto const a = static_cast<double>(scale.a);
+        auto const energy = ArrayXd::LinSpaced(15, -1.0, 2.0).eval();
+        auto const broadening = 0.1;
+        auto const row = 0;
+        auto const col = size / 2;
+
+        // `a * G_{col,row}`: the results are in the scaled units of KPM
+        auto expected = ArrayXcd(energy.size());
+        for (auto k = 0; k < energy.size(); ++k) {
+            auto const z = complex_d{energy[k], broadening};
+            auto g = complex_d{0, 0};
+            for (auto n = 0; n < size; ++n) {
+                g += vectors(col, n) * std::conj(vectors(row, n)) / (z - eigenvalues[n]);
+            }
+            expected[k] = a * g;
+        }
+
+        // Enough levels to exhaust the Krylov space: exact with the truncated fraction
+        for (auto format : {kpm::MatrixConfig::Format::CSR, kpm::MatrixConfig::Format::ELL}) {
+            auto const recursion = kpm::Recursion<scalar_t>(&h, scale, kpm::Termination::Truncate,
+                                                            format);
+            REQUIRE(recursion.required_num_levels(broadening) == size);
+            auto const greens = recursion.greens(row, col, energy, broadening);
+            REQUIRE((greens - expected).abs().maxCoeff() < 1e-6);
+
+            auto const ldos = recursion.ldos(row, energy, broadening);
+            REQUIRE((ldos + recursion.greens(row, row, energy, broadening).imag()
+                            / static_cast<double>(constant::pi)).abs().maxCoeff() < 1e-12);
+            REQUIRE((ldos > 0).all());
+        }
+    }
+} // anonymous namespace
+
+TEST_CASE("KPM recursion method", "[kpm]") {
+    SECTION("Real double") {
+        check_recursion<double>(make_test_model(true));
+    }
+
+    SECTION("Complex double") {
+        check_recursion<std::complex<double>>(make_test_model(true, true));
+    }
+
+    SECTION("Continued fraction") {
+        // A constant chain is exactly its own square-root tail: the semicircle
+        auto t = kpm::Tridiagonal();
+        t.alpha = ArrayXd::Zero(8);
+        t.beta = ArrayXd::Constant(8, 0.5);
+        auto const energy = ArrayXd::LinSpaced(9, -0.9, 0.9).eval();
+        auto const g = kpm::continued_fraction(t, energy, 1e-9, kpm::Termination::SquareRoot);
+        ArrayXd const semicircle = 2 / static_cast<double>(constant::pi)
+                                   * (1 - energy.square()).sqrt();
+        REQUIRE((-g.imag() / static_cast<double>(constant::pi) - semicircle).abs().maxCoeff()
+                < 1e-6);
+    }
+
+    SECTION("Strategy") {
+        auto const model = make_test_model(true);
+        auto const energy = ArrayXd::LinSpaced(10, -1.0, 1.0).eval();
+        auto config = kpm::Config();
+        config.recursion = true;
+        auto const recursion = make_kpm(model, config);
+        auto const reference = make_kpm(model);
+
+        // The Lorentz kernel gives the same Lorentzian broadening, up to its truncation
+        auto const greens = recursion.calc_greens(0, 0, energy, 0.1);
+        auto const expected = reference.calc_greens(0, 0, energy, 0.1);
+        REQUIRE(greens.size() == energy.size());
+        REQUIRE((greens.imag() - expected.imag()).abs().maxCoeff()
+                < 0.05 * expected.imag().abs().maxCoeff());
+        REQUIRE(recursion.calc_greens_vector(0, {0, 3}, energy, 0.1).size() == 2);
+
+        // Both are the stochastic trace of the same random vectors, normalized to the states
+        auto const dos = recursion.calc_dos(energy, 0.1, 2);
+        auto const expected_dos = reference.calc_dos(energy, 0.1, 2);
+        REQUIRE(dos.size() == energy.size());
+        REQUIRE((dos - expected_dos).abs().maxCoeff() < 0.05 * expected_dos.abs().maxCoeff());
+    }
+}
+
+TEST_CASE("KPM fixed width ELLPACK kernel", "[kpm]") {
+    // The row-wise kernel for a compile-time width (the diagonal moments of narrow lattices)
+    // must agree with the column-wise `kpm_spmv()` followed by the separate dot products
+    using scalar_t = std::complex<float>;
+    auto const model = make_test_model(false, true);
+    auto const& matrix = ham::get_reference<scalar_t>(model.hamiltonian());
+    auto const scale = kpm::Bounds<scalar_t>(&matrix, kpm::Config{}.lanczos_precision)
+        .scaling_factors();
+    auto const num_sites = static_cast<int>(matrix.rows());
+
+    auto oh = kpm::OptimizedHamiltonian<scalar_t>(
+        &matrix, {kpm::MatrixConfig::Reorder::ON, kpm::MatrixConfig::Format::ELL}
+    );
+    oh.optimize_for({0, 0}, scale);
+    auto const& ell = oh.ell();
+    REQUIRE(ell.nnz_per_row >= 2);
+    REQUIRE(ell.nnz_per_row <= 12);
+
+    auto const x = VectorX<scalar_t>::Random(num_sites).eval();
+    auto const y0 = VectorX<scalar_t>::Random(num_sites).eval();
+
+    // The row-wise kernel is used with every instruction set, also the dispatched ones
+    auto const best = compute::ell_dispatch::active_isa();
+    for (auto const& isa : compute::ell_dispatch::available_isas()) {
+        INFO(isa);
+        compute::ell_dispatch::set_isa(isa);
+        auto y = VectorX<scalar_t>(y0);
+        auto expected_y = VectorX<scalar_t>(y0);
+
+        auto m2 = scalar_t{0}, m3 = scalar_t{0};
+        compute::kpm_spmv_diagonal(1, num_sites, ell, x, y, m2, m3); // unaligned start
+        compute::kpm_spmv(1, num_sites, ell, x, expected_y);
+        auto expected_m2 = scalar_t{0}, expected_m3 = scalar_t{0};
+        compute::detail::accumulate_diagonal(1, num_sites, x, expected_y,
+                                             expected_m2, expected_m3);
+
+        REQUIRE(y.isApprox(expected_y));
+        REQUIRE(m2.real() == Approx(expected_m2.real()));
+        REQUIRE(m3.real() == Approx(expected_m3.real()));
+    }
+    compute::ell_dispatch::set_isa(best);
+}
+
+namespace {
+    /// CSR matrix with a mix of empty, short uniform, irregular and long rows
+    template<class scalar_t>
+    SparseMatrixX<scalar_t> make_bucketed_csr(int size) {
+        auto triplets = std::vector<Eigen::Triplet<scalar_t>>();
+        for (auto row = 0; row < size; ++row) {
+            auto const length = (row % 37 == 5) ? 0                 // empty
+                              : (row % 23 == 7) ? 40 + row % 9      // long: hoppings generator
+                              : (row % 11 == 3) ? 1 + row % 5       // irregular
+                              : 3;                                   // lattice bulk
+            for (auto n = 0; n < length; ++n) {
+                auto const col = (row * 7 + n * 13) % size;
+                triplets.emplace_back(row, col, static_cast<scalar_t>(1 + n % 3));
+            }
+        }
+        auto matrix = SparseMatrixX<scalar_t>(size, size);
+        matrix.setFromTriplets(triplets.begin(), triplets.end()); // duplicates are summed
+        matrix.makeCompressed();
+        return matrix;
+    }
+
+    template<class scalar_t>
+    void check_csr_buckets() {
+        auto const size = 300;
+        auto const matrix = make_bucketed_csr<scalar_t>(size);
+        auto const x = VectorX<scalar_t>::Random(size).eval();
+        auto y = VectorX<scalar_t>::Random(size).eval();
+        VectorX<scalar_t> expected = matrix * x - y;
+        expected.head(3) = y.head(3);
+
+        compute::kpm_spmv(3, size, matrix, x, y); // unaligned start
+        REQUIRE(y.isApprox(expected));
+    }
+}
+
+TEST_CASE("CSR kernel row buckets", "[kpm]") {
+    check_csr_buckets<float>();
+    check_csr_buckets<std::complex<float>>();
+    check_csr_buckets<double>();
+    check_csr_buckets<std::complex<double>>();
+}
+
+TEST_CASE("KPM spectral function", "[kpm]") {
+    // E(k) = 4 - 2 cos(kx) - 2 cos(ky) in the bulk of the square lattice
+    auto const pi = 3.14159265358979;
+    auto const k_points = std::vector<Cartesian>{
+        {0, 0, 0}, {static_cast<float>(pi / 3), 0, 0},
+        {static_cast<float>(pi / 2), static_cast<float>(pi / 2), 0}
+    };
+    auto const expected_peaks = std::vector<double>{0, 1, 4};
+    auto const energy = ArrayXd::LinSpaced(161, -0.5, 8.5);
+    auto const step = energy[1] - energy[0];
+
+    auto reference = ArrayXXd();
+    for (auto is_complex : {false, true}) {
+        auto model = Model(lattice::square(), Primitive(40, 40));
+        if (is_complex) {
+            model.add(field::force_complex_numbers());
+        }
+
+        for (auto opt_level = 0; opt_level <= 3; ++opt_level) {
+            INFO("is_complex: " << is_complex << ", opt_level: " << opt_level);
+            auto config = kpm::Config{};
+            config.opt_level = opt_level;
+            auto const spectral = make_kpm(model, config).calc_spectral_function(
+                k_points, energy, 0.1
+            );
+            REQUIRE(spectral.rows() == energy.size());
+            REQUIRE(spectral.cols() == 3);
+
+            for (auto j = 0; j < spectral.cols(); ++j) {
+                auto peak = 0;
+                spectral.col(j).maxCoeff(&peak);
+                REQUIRE(std::abs(energy[peak] - expected_peaks[j]) < 0.2);
+                REQUIRE(spectral.col(j).sum() * step == Approx(1).epsilon(0.05));
+            }
+
+            if (reference.size() == 0) {
+                reference = spectral;
+            } else {
+                REQUIRE(spectral.isApprox(reference, 1e-3));
+            }
+        }
+    }
+
+    auto const model = Model(lattice::square(), Primitive(4, 4));
+    REQUIRE_THROWS(make_kpm(model).calc_spectral_function({}, energy, 0.1));
+    REQUIRE_THROWS(make_kpm(model).calc_spectral_function(k_points, energy, 0.1, "B"));
+}
+
+TEST_CASE("KPM projected DOS", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(30, -2, 2);
+    for (auto is_complex : {false, true}) {
+        auto const model = make_test_model(true, is_complex);
+        for (auto opt_level : {0, 1, 3, 4}) {
+            INFO("is_complex: " << is_complex << ", opt_level: " << opt_level);
+            auto config = kpm::Config{};
+            config.opt_level = opt_level;
+            auto kpm = make_kpm(model, config);
+            auto const dos = kpm.calc_dos(energy, 0.1, 4);
+
+            // The same random vectors: the sublattices add up to the total
+            auto const sublattice_dos = kpm.calc_sublattice_dos(energy, 0.1, 4);
+            REQUIRE(sublattice_dos.cols() == 2);
+            REQUIRE(sublattice_dos.rowwise().sum().matrix().isApprox(dos.matrix(), 1e-6));
+            REQUIRE(sublattice_dos.col(0).abs().sum() > 0);
+            REQUIRE(sublattice_dos.col(1).abs().sum() > 0);
+
+            // Overlapping regions: the sites belong to the first one
+            auto const whole = shape::rectangle(0.6f, 0.8f);
+            auto const region_dos = kpm.calc_region_dos(energy, 0.1, {whole, whole}, 4);
+            REQUIRE(region_dos.col(0).matrix().isApprox(dos.matrix(), 1e-6));
+            REQUIRE(region_dos.col(1).isZero());
+        }
+    }
+
+    auto const kpm = make_kpm(make_test_model());
+    REQUIRE_THROWS(kpm.calc_sublattice_dos(energy, 0.1, 0));
+    REQUIRE_THROWS(kpm.calc_region_dos(energy, 0.1, {}));
+}
+
+TEST_CASE("KPM absorbing boundary", "[kpm]") {
+    auto const model = make_test_model(true);
+    auto const num_sites = model.system()->num_sites();
+    auto const i = model.system()->find_nearest({0, 0, 0});
+    auto const energy = ArrayXd::LinSpaced(30, -2, 2);
+
+    auto kpm = make_kpm(model);
+    auto const ldos = kpm.calc_ldos(energy, 0.1, {0, 0, 0});
+
+    // No damping at all: the same result from the off-diagonal algorithm
+    kpm.set_damping(ArrayXf::Ones(num_sites));
+    REQUIRE(kpm.calc_ldos(energy, 0.1, {0, 0, 0}).isApprox(ldos, 1e-6));
+    REQUIRE(kpm.calc_greens(i, i, energy, 0.1).imag().isApprox(
+        make_kpm(model).calc_greens(i, i, energy, 0.1).imag(), 1e-6
+    ));
+
+    kpm.set_absorbing_boundary(shape::rectangle(0.3f, 0.4f), 3, 0.2f);
+    auto const& damping = kpm.get_damping();
+    REQUIRE(damping.size() == num_sites);
+    REQUIRE(damping[i] == 1);
+    REQUIRE(damping.minCoeff() < 1);
+    REQUIRE(damping.minCoeff() >= 0.8f - 1e-6f);
+
+    auto reference = ArrayXd();
+    for (auto opt_level : {0, 1, 3, 4}) {
+        INFO("opt_level: " << opt_level);
+        auto config = kpm::Config{};
+        config.opt_level = opt_level;
+        auto damped = make_kpm(model, config);
+        damped.set_damping(damping);
+        auto const result = damped.calc_ldos(energy, 0.1, {0, 0, 0});
+        REQUIRE_FALSE(result.isApprox(ldos, 1e-3));
+        if (reference.size() == 0) {
+            reference = result;
+        } else {
+            REQUIRE(result.isApprox(reference, 1e-6));
+        }
+    }
+
+    kpm.set_damping({});
+    REQUIRE(kpm.calc_ldos(energy, 0.1, {0, 0, 0}).isApprox(ldos, 1e-6));
+    REQUIRE_THROWS(kpm.set_damping(ArrayXf::Ones(num_sites + 1)));
+    REQUIRE_THROWS(kpm.set_damping(ArrayXf::Zero(num_sites)));
+    REQUIRE_THROWS(kpm.set_lead_absorbing_boundary(2));
+}
+
+TEST_CASE("KPM external CSR matrix", "[kpm]") {
+    auto const model = make_test_model(true);
+    auto const& h = ham::get_reference<double>(model.hamiltonian());
+    auto const i = model.system()->find_nearest({0, 0, 0});
+    auto const energy = ArrayXd::LinSpaced(30, -2, 2);
+
+    // Stand-in for the arrays of an external matrix
+    auto const rows = static_cast<int>(h.rows());
+    auto const nnz = static_cast<int>(h.nonZeros());
+    auto indptr = std::vector<int>(h.outerIndexPtr(), h.outerIndexPtr() + rows + 1);
+    auto indices = std::vector<int>(h.innerIndexPtr(), h.innerIndexPtr() + nnz);
+    auto const data = std::vector<double>(h.valuePtr(), h.valuePtr() + nnz);
+    auto const ref = [&] {
+        return num::CsrConstRef<double>(rows, rows, nnz, data.data(), indices.data(),
+                                        indptr.data());
+    };
+
+    auto const external = ham::from_csr(ref());
+    auto const& copy = ham::get_reference<double>(external);
+    REQUIRE(copy.isCompressed());
+    REQUIRE(copy.nonZeros() == nnz);
+    REQUIRE(SparseMatrixXd(copy - h).norm() == 0);
+
+    auto strategy = detail::MakeStrategy<kpm::Strategy, kpm::DefaultStrategy>({})(external);
+    REQUIRE(strategy->ldos(i, energy, 0.1).isApprox(
+        make_kpm(model).calc_ldos(energy, 0.1, {0, 0, 0}), 1e-6
+    ));
+
+    std::swap(indices[0], indices[1]);
+    REQUIRE_THROWS(ham::from_csr(ref()));
+    std::swap(indices[0], indices[1]);
+    indptr[rows] -= 1;
+    REQUIRE_THROWS(ham::from_csr(ref()));
+    indptr[rows] += 1;
+    // A row pointer beyond the non-zeros is caught before its indices are read
+    auto const second = indptr[1];
+    indptr[1] = 10 * nnz;
+    REQUIRE_THROWS(ham::from_csr(ref()));
+    indptr[1] = second;
+    REQUIRE_THROWS(ham::from_csr(num::CsrConstRef<double>(rows, rows + 1, nnz, data.data(),
+                                                          indices.data(), indptr.data())));
+}
+
+TEST_CASE("KPM bond currents", "[kpm]") {
+    auto const energy = ArrayXd::LinSpaced(10, -2, 2);
+    auto const region = shape::rectangle(0.3f, 0.3f);
+    for (auto is_complex : {false, true}) {
+        INFO("is_complex: " << is_complex);
+        auto const model = make_test_model(true, is_complex);
+        auto const kpm = make_kpm(model);
+        auto const& hoppings = model.system()->hoppings;
+        auto is_inside = ArrayX<bool>::Constant(model.system()->num_sites(), false).eval();
+        for (auto const i : kpm.spatial_indices(region)) {
+            is_inside[i] = true;
+        }
+
+        auto const exact = kpm.calc_bond_currents(energy, 0.1, region, 0);
+        auto const stochastic = kpm.calc_bond_currents(energy, 0.1, region, 4);
+        REQUIRE(exact.cols() == hoppings.nonZeros());
+        REQUIRE(stochastic.cols() == hoppings.nonZeros());
+
+        // Each bond within the region: `calc_greens(i, j)` starts from the vector of site `i`
+        // and reads element `j`, the same `G_ji`
+        auto num_bonds = 0;
+        for (auto i = 0; i < hoppings.outerSize(); ++i) {
+            for (auto n = hoppings.outerIndexPtr()[i]; n < hoppings.outerIndexPtr()[i + 1]; ++n) {
+                auto const j = hoppings.innerIndexPtr()[n];
+                if (!is_inside[i] || !is_inside[j]) {
+                    REQUIRE(exact.col(n).isZero());
+                    REQUIRE(stochastic.col(n).isZero());
+                    continue;
+                }
+
+                auto const hopping = is_complex
+                    ? ham::get_reference<std::complex<double>>(model.hamiltonian()).coeff(i, j)
+                    : ham::get_reference<double>(model.hamiltonian()).coeff(i, j);
+                ArrayXd const expected = (hopping * kpm.calc_greens(i, j, energy, 0.1)).imag();
+                REQUIRE(exact.col(n).matrix().isApprox(expected.matrix(), 1e-5));
+                ++num_bonds;
+            }
+        }
+        REQUIRE(num_bonds > 0);
+        REQUIRE(stochastic.abs().sum() > 0);
+    }
+
+    auto const kpm = make_kpm(make_test_model());
+    REQUIRE_THROWS(kpm.calc_bond_currents(energy, 0.1, shape::rectangle(0.3f, 0.3f), -1));
+}
+
+TEST_CASE("KPM electron density", "[kpm]") {
+    auto const model = make_test_model(true);
+    auto const num_sites = model.system()->num_sites();
+    auto const mu = 0.5;
+    auto const temperature = 2000.0;
+    auto const kt = constant::kb * temperature;
+
+    // Exact result: f(H)_ii from the eigenstates
+    MatrixX<double> const dense = ham::get_reference<double>(model.hamiltonian()).toDense();
+    Eigen::SelfAdjointEigenSolver<MatrixX<double>> solver(dense);
+    ArrayXd const f = 1 / (1 + ((solver.eigenvalues().array() - mu) / kt).exp());
+    ArrayXd const expected = (solver.eigenvectors().array().square().matrix()
+                              * f.matrix()).array();
+
+    auto const kpm = make_kpm(model);
+    // The probing vectors never combine any sites at this distance: exact up to the kernel
+    auto const probing = kpm.calc_density(mu, 0.02, temperature, 0, num_sites);
+    REQUIRE(probing.size() == num_sites);
+    REQUIRE((probing - expected).abs().maxCoeff() < 1e-2);
+
+    auto const stochastic = kpm.calc_density(mu, 0.02, temperature, 16);
+    REQUIRE(stochastic.size() == num_sites);
+    REQUIRE(std::abs(stochastic.sum() - expected.sum()) < 0.25 * expected.sum());
+
+    // Zero temperature: the closed form of the step function
+    auto const zero = kpm.calc_density(mu, 0.02, 0, 0, num_sites);
+    REQUIRE((zero > -0.1).all());
+    REQUIRE((zero < 1.1).all());
+
+    REQUIRE_THROWS(kpm.calc_density(mu, 0.02, temperature, 0));
+    REQUIRE_THROWS(kpm.calc_density(mu, 0.02, -1.0));
+}
+
+TEST_CASE("Self-consistent loop", "[kpm]") {
+    auto const model = make_test_model(true);
+    auto const num_sites = static_cast<int>(model.system()->num_sites());
+    auto const u = 1.0;
+
+    // Hubbard-like mean field: V_i = U * (n_i - 1/2)
+    auto coupling = SparseMatrixXd(num_sites, num_sites);
+    coupling.setIdentity();
+    coupling *= u;
+    auto const background = ArrayXd::Constant(num_sites, 0.5).eval();
+    auto const density = scf::fermi_density(0.5, 0.02, 2000.0, 0, num_sites);
+
+    auto potentials = std::vector<ArrayXd>();
+    for (auto mixing : {scf::Mixing::Linear, scf::Mixing::Anderson, scf::Mixing::Broyden}) {
+        auto config = scf::Config();
+        config.mixing = mixing;
+        config.max_iterations = 200;
+        auto loop = make_self_consistent_loop(model, density,
+                                              scf::linear_potential(coupling, background),
+                                              {}, config);
+        REQUIRE(loop.run());
+        REQUIRE(loop.converged());
+        REQUIRE(loop.num_iterations() > 1);
+        REQUIRE(loop.get_residuals().back() < config.tolerance);
+
+        auto const& v = loop.get_potential();
+        REQUIRE(v.size() == num_sites);
+        REQUIRE((v - u * (loop.get_density() - 0.5)).abs().maxCoeff() < 1e-4);
+        REQUIRE(loop.energy_range().first < loop.energy_range().second);
+        potentials.push_back(v);
+    }
+    REQUIRE((potentials[1] - potentials[0]).abs().maxCoeff() < 1e-3);
+    REQUIRE((potentials[2] - potentials[0]).abs().maxCoeff() < 1e-3);
+
+    // Starting from the converged potential, the first iteration is already converged
+    auto loop = make_self_consistent_loop(model, density,
+                                          scf::linear_potential(coupling, background));
+    REQUIRE(loop.run(potentials[0]));
+    REQUIRE(loop.num_iterations() == 1);
+
+    REQUIRE_THROWS(loop.run(ArrayXd::Zero(num_sites + 1)));
+    REQUIRE_THROWS(scf::fermi_density(0.5, 0.02, -1.0));
+    REQUIRE_THROWS(scf::linear_potential(SparseMatrixXd(2, 3), {}));
+}
@@ -1,6 +1,8 @@
 #include <catch.hpp>
 
 #include "fixtures.hpp"
+#include "leads/SelfEnergy.hpp"
+#include "solver/Transmission.hpp"
 using namespace cpb;
 
 /// Return the data array of a Hamiltonian CSR matrix
@@ -40,3 +42,95 @@ TEST_CASE("Attach leads") {
         REQUIRE(h.maxCoeff() < h0.maxCoeff());
     }
 }
+
+TEST_CASE("Multiple leads") {
+    auto const make_model = [](int num_threads) {
+        auto model = Model(lattice::square(), shape::rectangle(4, 3));
+        model.set_num_threads(num_threads);
+        model.attach_lead(-1, Line({0, -1.5f, 0}, {0, 1.5f, 0}));
+        model.attach_lead(+1, Line({0, -1.5f, 0}, {0, 1.5f, 0}));
+        model.attach_lead(-2, Line({-1, 0, 0}, {1, 0, 0}));
+        model.attach_lead(+2, Line({-2, 0, 0}, {2, 0, 0}));
+        return model;
+    };
+
+    auto serial = make_model(1);
+    auto parallel = make_model(3);
+    REQUIRE(parallel.leads().size() == 4);
+    for (auto i = size_t{0}; i < 4; ++i) {
+        INFO("lead: " << i);
+        REQUIRE(parallel.lead(i).indices() == serial.lead(i).indices());
+        REQUIRE(ham::get_reference<float>(parallel.lead(i).h0()).isApprox(
+            ham::get_reference<float>(serial.lead(i).h0())));
+        REQUIRE(ham::get_reference<float>(parallel.lead(i).h1()).isApprox(
+            ham::get_reference<float>(serial.lead(i).h1())));
+    }
+
+    // Without modifiers, identical leads on opposite sides share the Hamiltonian pair
+    auto const& h0_left = ham::get_reference<float>(serial.lead(0).h0());
+    REQUIRE(&h0_left == &ham::get_reference<float>(serial.lead(1).h0()));
+    REQUIRE(&h0_left != &ham::get_reference<float>(serial.lead(3).h0()));
+
+    // but not with position-dependent modifiers
+    serial.add(field::linear_onsite());
+    REQUIRE(&ham::get_reference<float>(serial.lead(0).h0())
+            != &ham::get_reference<float>(serial.lead(1).h0()));
+}
+
+TEST_CASE("Lead self-energy") {
+    // A single site cross-section: the lead is a semi-infinite chain with onsite energy 4
+    auto model = Model(lattice::square(), shape::rectangle(2, 1));
+    model.attach_lead(+1, Line({0, -0.5f, 0}, {0, 0.5f, 0}));
+    auto const lead = model.lead(0);
+    REQUIRE(lead.indices().size() == 1);
+
+    auto const energies = ArrayXd::LinSpaced(5, 1, 7).eval(); // across the band [2, 6]
+    auto const expected = [](double energy) {
+        auto const e = std::complex<double>(energy - 4, 0);
+        auto const root = std::sqrt(e * e - 4.0);
+        auto const sigma = (e - root) / 2.0;
+        auto const is_other_branch = sigma.imag() > 0 || (sigma.imag() == 0 && std::abs(sigma) > 1);
+        return is_other_branch ? e - sigma : sigma;
+    };
+
+    auto const self_energy = leads::SelfEnergy<double>(lead, 1e-10);
+    REQUIRE(self_energy.size() == 1);
+    auto const sigma = self_energy.calc(energies, 2);
+    for (auto i = 0; i < energies.size(); ++i) {
+        INFO("energy: " << energies[i]);
+        auto const s = sigma[i](0, 0);
+        REQUIRE(s.real() == Approx(expected(energies[i]).real()).epsilon(1e-6));
+        REQUIRE(s.imag() == Approx(expected(energies[i]).imag()).epsilon(1e-6));
+    }
+    REQUIRE(self_energy.calc(energies[2]).isApprox(sigma[2])); // from the cache
+
+    auto const single = leads::SelfEnergy<float>(lead, 1e-6);
+    auto const s = single.calc(energies[1])(0, 0);
+    REQUIRE(s.real() == Approx(expected(energies[1]).real()).epsilon(1e-3));
+    REQUIRE(s.imag() == Approx(expected(energies[1]).imag()).epsilon(1e-3));
+}
+
+TEST_CASE("RGF transmission") {
+    // A clean ribbon: the transmission counts the open transverse modes
+    auto const length = 6.0f;
+    auto const width = 3.0f;
+    auto model = Model(lattice::square(), shape::rectangle(length, width));
+    model.attach_lead(-1, Line({0, -width/2, 0}, {0, width/2, 0}));
+    model.attach_lead(+1, Line({0, -width/2, 0}, {0, width/2, 0}));
+
+    auto const slices = TransportSlices(*model.system(), model.lead(0).indices(),
+                                        model.lead(1).indices());
+    REQUIRE(slices.size() == 6);
+    REQUIRE(slices.max_width() == 3);
+
+    // Transverse mode energies are `4 - 2 cos(n pi / 4)`, each open within +/- 2
+    auto energies = ArrayXd(4);
+    energies << 1.0, 4.2, 5.8, 6.5;
+    auto expected = ArrayXd(4);
+    expected << 1, 3, 2, 1;
+
+    auto const transmission = calc_transmission(model, energies, 0, 1, 1e-8, 2);
+    REQUIRE(transmission.isApprox(expected, 1e-5));
+    auto const reverse = calc_transmission(model, energies, 1, 0, 1e-8);
+    REQUIRE(reverse.isApprox(expected, 1e-5));
+}
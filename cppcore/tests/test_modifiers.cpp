@@ -1,6 +1,11 @@
 #include <catch.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
 #include "fixtures.hpp"
+#include "hamiltonian/BuiltinModifiers.hpp"
 using namespace cpb;
 
 TEST_CASE("SiteStateModifier") {
@@ -129,4 +134,677 @@ TEST_CASE("HoppingGenerator") {
         REQUIRE(model.system()->hoppings.coeff(0, 1) == 1);
         REQUIRE(model.system()->hoppings.coeff(1, 0) == 0);
     }
+
+    SECTION("Later generators override earlier ones") {
+        auto const make = [](CartesianArray const&, SubIdRef) {
+            auto r = HoppingGenerator::Result{ArrayXi(1), ArrayXi(1)};
+            r.from << 1;
+            r.to   << 0;
+            return r;
+        };
+        model.add(HoppingGenerator("t2", 2.0, make, /*is_thread_safe*/true));
+        model.add(HoppingGenerator("t3", 3.0, make));
+
+        REQUIRE(model.system()->hoppings.isCompressed());
+        REQUIRE(model.system()->hoppings.nonZeros() == 1);
+        REQUIRE(model.system()->hoppings.coeff(0, 1) == 2);
+        REQUIRE_FALSE(model.system()->has_unbalanced_hoppings);
+    }
+}
+
+TEST_CASE("HoppingGenerator row balance") {
+    auto model = Model(lattice::square_2atom(), Primitive(6, 6));
+    REQUIRE(model.system()->num_sites() == 72);
+    REQUIRE_FALSE(model.system()->has_unbalanced_hoppings);
+
+    SECTION("A few extra hoppings keep the rows balanced") {
+        model.add(HoppingGenerator("tg", 2.0, [](CartesianArray const&, SubIdRef) {
+            auto r = HoppingGenerator::Result{ArrayXi(2), ArrayXi(2)};
+            r.from << 0, 60;
+            r.to   << 40, 7;
+            return r;
+        }, /*is_thread_safe*/true));
+        REQUIRE(model.system()->hoppings.coeff(0, 40) == 2);
+        REQUIRE(model.system()->hoppings.coeff(7, 60) == 2);
+        REQUIRE_FALSE(model.system()->has_unbalanced_hoppings);
+    }
+
+    SECTION("A hub connected to every site is unbalanced") {
+        model.add(HoppingGenerator("tg", 2.0, [](CartesianArray const& p, SubIdRef) {
+            auto const n = p.size() - 1;
+            return HoppingGenerator::Result{ArrayXi::Zero(n), ArrayXi::LinSpaced(n, 1, n)};
+        }));
+        REQUIRE(model.system()->hoppings.row(0).nonZeros() == 71);
+        REQUIRE(model.system()->has_unbalanced_hoppings);
+    }
+}
+
+TEST_CASE("Incremental onsite update") {
+    auto model = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                       field::constant_potential(1));
+    auto const initial = model.hamiltonian();
+
+    model.clear_onsite_modifiers();
+    model.add(field::linear_onsite(2));
+    auto const updated = model.hamiltonian();
+    REQUIRE(ham::differs_only_in_onsite(initial, updated));
+    REQUIRE_FALSE(ham::differs_only_in_onsite(initial, Hamiltonian{}));
+
+    auto const reference = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                 field::linear_onsite(2)).hamiltonian();
+    REQUIRE(ham::get_reference<float>(updated).isApprox(ham::get_reference<float>(reference)));
+    REQUIRE(ham::get_reference<float>(initial).diagonal().isOnes()); // not modified
+
+    SECTION("A different scalar type requires a full rebuild") {
+        auto const nop = [](ComplexArrayRef, CartesianArray const&, SubIdRef) {};
+        model.add(OnsiteModifier(nop, /*is_complex*/false, /*is_double*/true));
+        REQUIRE(ham::is<double>(model.hamiltonian()));
+        REQUIRE_FALSE(ham::differs_only_in_onsite(updated, model.hamiltonian()));
+    }
+
+    SECTION("Missing diagonal slots require a full rebuild") {
+        auto no_onsite = Model(graphene::monolayer(), shape::rectangle(2, 2));
+        auto const h = no_onsite.hamiltonian();
+        no_onsite.add(field::constant_potential(1));
+        REQUIRE(no_onsite.hamiltonian().non_zeros() == h.non_zeros() + h.rows());
+    }
+}
+
+TEST_CASE("Derived models share the system") {
+    auto const base = Model(graphene::monolayer(), shape::rectangle(2, 2));
+    auto variant = base.derive();
+    variant.add(field::constant_potential(1));
+    REQUIRE(variant.system() == base.system());
+    REQUIRE(ham::get_reference<float>(variant.hamiltonian()).diagonal().isOnes());
+    REQUIRE(base.hamiltonian().non_zeros() < variant.hamiltonian().non_zeros());
+
+    auto resized = base.derive();
+    resized.add(shape::rectangle(3, 3));
+    REQUIRE(resized.system() != base.system());
+    REQUIRE(resized.system()->num_sites() > base.system()->num_sites());
+}
+
+TEST_CASE("Concurrent access to a shared model") {
+    auto num_calls = std::atomic<int>{0};
+    auto const counter = [&](ComplexArrayRef, CartesianArray const&, SubIdRef) { ++num_calls; };
+    auto const model = Model(graphene::monolayer(), shape::rectangle(3, 3),
+                             OnsiteModifier(counter));
+    auto const num_calls_per_build = [&]{
+        auto const reference = Model(graphene::monolayer(), shape::rectangle(3, 3),
+                                     OnsiteModifier(counter));
+        reference.hamiltonian();
+        auto const n = num_calls.load();
+        num_calls = 0;
+        return n;
+    }();
+
+    auto systems = std::vector<System const*>(4);
+    auto hamiltonians = std::vector<Hamiltonian>(4);
+    auto threads = std::vector<std::thread>();
+    for (auto i = 0; i < 4; ++i) {
+        threads.emplace_back([&, i]{
+            hamiltonians[i] = model.hamiltonian();
+            systems[i] = model.system().get();
+        });
+    }
+    for (auto& t : threads) { t.join(); }
+
+    REQUIRE(num_calls.load() == num_calls_per_build); // built only once
+    for (auto i = 1; i < 4; ++i) {
+        REQUIRE(systems[i] == systems[0]);
+        REQUIRE(ham::get_shared_ptr<float>(hamiltonians[i])
+                == ham::get_shared_ptr<float>(hamiltonians[0]));
+    }
+}
+
+TEST_CASE("Periodic boundaries") {
+    auto const same_boundaries = [](System const& a, System const& b) {
+        if (a.boundaries.size() != b.boundaries.size()) { return false; }
+        for (auto i = 0u; i < a.boundaries.size(); ++i) {
+            auto const& x = a.boundaries[i];
+            auto const& y = b.boundaries[i];
+            auto const nnz = x.hoppings.nonZeros();
+            auto const rows = x.hoppings.rows();
+            if (x.shift != y.shift || nnz != y.hoppings.nonZeros() || rows != y.hoppings.rows()
+                || !std::equal(x.hoppings.outerIndexPtr(), x.hoppings.outerIndexPtr() + rows + 1,
+                               y.hoppings.outerIndexPtr())
+                || !std::equal(x.hoppings.innerIndexPtr(), x.hoppings.innerIndexPtr() + nnz,
+                               y.hoppings.innerIndexPtr())
+                || !std::equal(x.hoppings.valuePtr(), x.hoppings.valuePtr() + nnz,
+                               y.hoppings.valuePtr())) {
+                return false;
+            }
+        }
+        return true;
+    };
+    // A long strip: the boundary rows must be more than `ThreadPool::min_chunk_size` (1024)
+    // for each of the 3 threads, otherwise `parallel_for()` runs them all on a single one
+    auto const make_model = [](int num_threads) {
+        auto model = Model(graphene::monolayer(), Primitive(4000, 4),
+                           TranslationalSymmetry(1, 1));
+        model.set_num_threads(num_threads);
+        return model;
+    };
+
+    auto model = make_model(1);
+    REQUIRE_FALSE(model.system()->boundaries.empty());
+    auto num_boundary_rows = 0;
+    for (auto const& boundary : model.system()->boundaries) {
+        auto const outer = boundary.hoppings.outerIndexPtr();
+        for (auto row = 0; row < boundary.hoppings.rows(); ++row) {
+            if (outer[row + 1] > outer[row]) { ++num_boundary_rows; }
+        }
+    }
+    REQUIRE(num_boundary_rows > 3 * 1024);
+    REQUIRE(same_boundaries(*model.system(), *make_model(3).system()));
+
+    SECTION("Only the positions change: the boundaries are reused") {
+        auto const stretch = PositionModifier([](CartesianArray& p, SubIdRef) { p.x *= 1.1f; });
+        auto const original = model.system();
+        model.add(stretch);
+        REQUIRE(model.system() != original);
+        REQUIRE(same_boundaries(*model.system(), *original));
+
+        auto reference = make_model(1);
+        reference.add(stretch);
+        REQUIRE(same_boundaries(*model.system(), *reference.system()));
+    }
+}
+
+TEST_CASE("Position updates with a fixed topology") {
+    auto num_builds = 0;
+    auto const count_builds = SiteStateModifier([&](ArrayX<bool>&, CartesianArray const&,
+                                                    SubIdRef) { ++num_builds; });
+    auto const stretch = [](float s) {
+        return PositionModifier([s](CartesianArray& p, SubIdRef) { p.x *= s; });
+    };
+    auto const make_model = [&](float s) {
+        return Model(graphene::monolayer(), shape::rectangle(3, 3), count_builds,
+                     field::linear_hopping(), stretch(s));
+    };
+
+    auto model = make_model(1.1f);
+    model.set_keep_topology(true);
+    model.hamiltonian();
+    auto const builds = num_builds;
+
+    for (auto const s : {1.2f, 0.9f}) {
+        model.clear_position_modifiers();
+        model.add(stretch(s));
+        auto const& system = *model.system();
+        auto const& h = ham::get_reference<float>(model.hamiltonian());
+        REQUIRE(num_builds == builds); // the sites and hoppings are kept
+
+        auto const reference = make_model(s);
+        auto const& expected_system = *reference.system();
+        auto const& expected = ham::get_reference<float>(reference.hamiltonian());
+        REQUIRE(system.num_sites() == expected_system.num_sites());
+        REQUIRE(system.positions.x.isApprox(expected_system.positions.x));
+        REQUIRE(system.positions.y.isApprox(expected_system.positions.y));
+        REQUIRE(h.nonZeros() == expected.nonZeros());
+        REQUIRE(h.isApprox(expected));
+    }
+
+    SECTION("The Morton order depends on the positions") {
+        model.set_site_order(SiteOrder::Morton);
+        model.system();
+        auto const morton_builds = num_builds;
+        model.add(stretch(1.5f));
+        model.system();
+        REQUIRE(num_builds == morton_builds + 1);
+    }
+}
+
+TEST_CASE("Incremental site removal") {
+    auto const lattice = graphene::monolayer().with_min_neighbors(2);
+    auto const base = Model(lattice, shape::rectangle(3, 3), field::linear_onsite(1));
+    auto const& system = *base.system();
+    base.hamiltonian();
+
+    // An edge site with 2 neighbors next to a bulk site with 3 of them
+    auto const nnz = nonzeros_per_row(system.hoppings);
+    auto edge = -1, bulk = -1;
+    sparse::make_loop(system.hoppings).for_each([&](int i, int j, hop_id) {
+        if (nnz[i] == 2 && nnz[j] == 3) { edge = i; bulk = j; }
+        if (nnz[j] == 2 && nnz[i] == 3) { edge = j; bulk = i; }
+    });
+    REQUIRE(bulk >= 0);
+
+    // The same removal as a site state modifier in a full rebuild
+    auto const make_reference = [&](int min_neighbors) {
+        auto const target = system.positions[bulk];
+        auto const remove = [target](ArrayX<bool>& state, CartesianArray const& positions,
+                                     SubIdRef) {
+            for (auto n = 0; n < state.size(); ++n) {
+                if ((positions[n] - target).norm() < 1e-3f) { state[n] = false; }
+            }
+        };
+        return Model(lattice, shape::rectangle(3, 3), field::linear_onsite(1),
+                     SiteStateModifier(remove, min_neighbors));
+    };
+    auto const require_same = [](Model const& a, Model const& b) {
+        auto const& sa = *a.system();
+        auto const& sb = *b.system();
+        REQUIRE(sa.num_sites() == sb.num_sites());
+        REQUIRE(sa.positions.x.isApprox(sb.positions.x));
+        REQUIRE(sa.positions.y.isApprox(sb.positions.y));
+        REQUIRE((sa.sublattices == sb.sublattices).all());
+        REQUIRE(sa.hoppings.nonZeros() == sb.hoppings.nonZeros());
+        auto const& ha = ham::get_reference<float>(a.hamiltonian());
+        auto const& hb = ham::get_reference<float>(b.hamiltonian());
+        REQUIRE(ha.nonZeros() == hb.nonZeros());
+        REQUIRE(ha.isApprox(hb));
+    };
+
+    SECTION("Single site") {
+        auto model = base.derive();
+        auto const new_index = model.remove_sites({bulk});
+        REQUIRE(new_index[bulk] == -1);
+        REQUIRE(new_index[edge] >= 0);
+        require_same(model, make_reference(0));
+        REQUIRE(base.system()->num_sites() == model.system()->num_sites() + 1);
+        REQUIRE(model.system()->original_indices[new_index[edge]] == edge);
+    }
+
+    SECTION("Dangling neighbors") {
+        auto model = base.derive();
+        auto const new_index = model.remove_sites({bulk}, 2);
+        REQUIRE(new_index[edge] == -1);
+        require_same(model, make_reference(2));
+    }
+
+    SECTION("The removal is not a model parameter") {
+        tmp::Directory const directory;
+        auto model = base.derive();
+        model.set_cache(directory.path(), "removal");
+        REQUIRE_FALSE(model.cache_filename().empty());
+        model.remove_sites({bulk});
+        REQUIRE(model.cache_filename().empty());
+        REQUIRE_THROWS(model.remove_sites({system.num_sites()}));
+
+        model.add(field::constant_potential(1)); // onsite update on the reduced system
+        REQUIRE(model.hamiltonian().rows() == system.num_sites() - 1);
+        model.set_site_order(SiteOrder::Foundation); // structural: rebuilt without removal
+        REQUIRE(model.system()->num_sites() == system.num_sites());
+    }
+}
+
+TEST_CASE("Wave vector sweep") {
+    auto num_calls = 0;
+    auto const count_calls = HoppingModifier([&](ComplexArrayRef, CartesianArray const&,
+                                                 CartesianArray const&, HopIdRef) {
+        ++num_calls;
+    });
+
+    auto model = Model(graphene::monolayer(), Primitive(5, 5), TranslationalSymmetry(1, 1),
+                       count_calls);
+    auto const initial = model.hamiltonian();
+    auto const calls_per_build = num_calls;
+    REQUIRE(calls_per_build > 0);
+
+    auto const kpoints = std::vector<Cartesian>{{0.5f, 0, 0}, {0.5f, 1.5f, 0}, {0, 0, 0}};
+    for (auto const& k : kpoints) {
+        model.set_wave_vector(k);
+        auto const& h = ham::get_reference<std::complex<float>>(model.hamiltonian());
+
+        auto reference_model = Model(graphene::monolayer(), Primitive(5, 5),
+                                     TranslationalSymmetry(1, 1));
+        reference_model.set_wave_vector(k);
+        auto const& reference = ham::get_reference<std::complex<float>>(
+            reference_model.hamiltonian()
+        );
+        REQUIRE(h.nonZeros() == reference.nonZeros());
+        REQUIRE(h.isApprox(reference));
+    }
+
+    // Only the first point of the sweep needs to evaluate the modifiers again
+    REQUIRE(num_calls == 2 * calls_per_build);
+    REQUIRE(ham::get_reference<std::complex<float>>(initial).isApprox(
+        ham::get_reference<std::complex<float>>(model.hamiltonian())
+    ));
+}
+
+TEST_CASE("System and Hamiltonian cache") {
+    tmp::Directory const directory;
+    auto num_calls = 0;
+    auto const count_calls = HoppingModifier([&](ComplexArrayRef, CartesianArray const&,
+                                                 CartesianArray const&, HopIdRef) {
+        ++num_calls;
+    });
+    auto const make_model = [&](std::string const& tag) {
+        auto model = Model(graphene::monolayer(), Primitive(5, 5), TranslationalSymmetry(1, 1),
+                           count_calls);
+        model.set_cache(directory.path(), tag);
+        return model;
+    };
+
+    auto model = make_model("test");
+    auto const filename = model.cache_filename();
+    auto const& built = ham::get_reference<std::complex<float>>(model.hamiltonian());
+    auto const calls_per_build = num_calls;
+    REQUIRE(calls_per_build > 0);
+
+    // A new model with the same parameters reads the file instead of building anything
+    auto cached_model = make_model("test");
+    REQUIRE(cached_model.cache_filename() == filename);
+    auto const& cached = ham::get_reference<std::complex<float>>(cached_model.hamiltonian());
+    REQUIRE(num_calls == calls_per_build);
+    REQUIRE(cached.nonZeros() == built.nonZeros());
+    REQUIRE(cached.isApprox(built));
+
+    auto const& system = *model.system();
+    auto const& cached_system = *cached_model.system();
+    REQUIRE(cached_system.num_sites() == system.num_sites());
+    REQUIRE(cached_system.positions.x.isApprox(system.positions.x));
+    REQUIRE((cached_system.sublattices == system.sublattices).all());
+    REQUIRE(cached_system.hoppings.nonZeros() == system.hoppings.nonZeros());
+    REQUIRE(cached_system.boundaries.size() == system.boundaries.size());
+
+    // Different parameters or tags get different files
+    REQUIRE(make_model("other").cache_filename() != filename);
+    auto shifted_model = make_model("test");
+    shifted_model.set_wave_vector({0.5f, 0, 0});
+    REQUIRE(shifted_model.cache_filename() != filename);
+
+    // The modifier function can't be identified without a tag, but a model without any
+    // functions is fully described by its parameters
+    REQUIRE(make_model("").cache_filename().empty());
+    auto plain_model = Model(graphene::monolayer(), Primitive(5, 5), TranslationalSymmetry(1, 1));
+    plain_model.set_cache(directory.path());
+    REQUIRE_FALSE(plain_model.cache_filename().empty());
+
+    // A tag function is called when the model is built, not when it's set
+    auto num_tags = 0;
+    auto tagged_model = make_model("");
+    tagged_model.set_cache(directory.path(), [&] { ++num_tags; return std::string("test"); });
+    REQUIRE(num_tags == 0);
+    REQUIRE(tagged_model.cache_filename() == filename);
+    REQUIRE(num_tags == 1);
+
+    // Builtin modifiers are identified by their arguments
+    auto const make_disordered = [&](std::uint32_t seed) {
+        auto model = Model(graphene::monolayer(), Primitive(5, 5),
+                           builtin::onsite_disorder(0.1f, seed));
+        model.set_cache(directory.path());
+        return model;
+    };
+    REQUIRE_FALSE(make_disordered(1).cache_filename().empty());
+    REQUIRE(make_disordered(1).cache_filename() == make_disordered(1).cache_filename());
+    REQUIRE(make_disordered(1).cache_filename() != make_disordered(2).cache_filename());
+
+    // The memory cache has its own tag
+    model.set_memory_cache(false);
+    REQUIRE(model.cache_filename() == filename);
+
+    // The results are kept even if the cache file can't be written
+    auto unsaved_model = make_model("test");
+    unsaved_model.set_cache(directory.file("missing"), "test");
+    REQUIRE(unsaved_model.hamiltonian().rows() == model.hamiltonian().rows());
+    REQUIRE_FALSE(unsaved_model.get_cache_error().empty());
+    REQUIRE(model.get_cache_error().empty());
+}
+
+TEST_CASE("Memory cache") {
+    auto& memory = cache::MemoryCache::instance();
+    memory.clear();
+
+    auto num_calls = 0;
+    auto const count_calls = HoppingModifier([&](ComplexArrayRef, CartesianArray const&,
+                                                 CartesianArray const&, HopIdRef) {
+        ++num_calls;
+    });
+    auto const make_model = [&](std::string const& tag) {
+        auto model = Model(graphene::monolayer(), Primitive(5, 5), TranslationalSymmetry(1, 1),
+                           count_calls);
+        model.set_memory_cache(true, tag);
+        return model;
+    };
+
+    auto model = make_model("test");
+    auto const built = model.hamiltonian();
+    auto const calls_per_build = num_calls;
+    REQUIRE(memory.stats().num_entries == 1);
+
+    // The same parameters share the system and Hamiltonian without building anything
+    auto shared_model = make_model("test");
+    auto const shared = shared_model.hamiltonian();
+    REQUIRE(num_calls == calls_per_build);
+    REQUIRE(shared_model.system() == model.system());
+    REQUIRE(ham::get_shared_ptr<std::complex<float>>(shared)
+            == ham::get_shared_ptr<std::complex<float>>(built));
+
+    make_model("other").hamiltonian();
+    REQUIRE(num_calls == 2 * calls_per_build);
+    auto const stats = memory.stats();
+    REQUIRE(stats.hits == 1);
+    REQUIRE(stats.num_entries == 2);
+    REQUIRE(stats.memory > 0);
+
+    // The least recently used entry is dropped first
+    make_model("test").hamiltonian(); // now used after "other"
+    memory.set_capacity(stats.memory - 1);
+    REQUIRE(memory.stats().evictions == 1);
+    make_model("test").hamiltonian();
+    REQUIRE(num_calls == 2 * calls_per_build);
+    make_model("other").hamiltonian();
+    REQUIRE(num_calls == 3 * calls_per_build);
+
+    // A hit compares the full key, i.e. everything which was hashed
+    auto const key = cache::Hasher().add(1).add(std::string("a"));
+    REQUIRE(key.key().size() == sizeof(int) + sizeof(std::size_t) + 1);
+
+    // Native functions may be freed and their address reused: each modifier has its own id
+    auto const field = +[](double* energy, float const* x, float const*, float const*,
+                           std::int8_t const*, std::int64_t n) {
+        for (auto i = std::int64_t{0}; i < n; ++i) { energy[i] += x[i]; }
+    };
+    auto const native = builtin::native_onsite(field);
+    REQUIRE(native.fingerprint != builtin::native_onsite(field).fingerprint);
+    REQUIRE(OnsiteModifier(native).fingerprint == native.fingerprint);
+
+    memory.set_capacity(std::size_t{1} << 30);
+    memory.clear();
+}
+
+TEST_CASE("Parallel hopping modifiers") {
+    std::atomic<bool> ids_match{true}; // the modifier may run on any thread: no REQUIRE there
+    auto const position_dependent = [&](ComplexArrayRef energy, CartesianArray const& p1,
+                                        CartesianArray const& p2, HopIdRef hopping) {
+        auto const size = energy.rows * energy.cols;
+        if (hopping.ids.size() != size || (hopping.ids != 0).any()) {
+            ids_match = false;
+        }
+        auto e = Eigen::Map<ArrayXf>(static_cast<float*>(energy.data), size);
+        e *= 1 + 0.01f * (p1.x + p2.y);
+    };
+
+    auto serial = Model(graphene::monolayer(), shape::rectangle(40, 40),
+                        HoppingModifier(position_dependent));
+    auto parallel = Model(graphene::monolayer(), shape::rectangle(40, 40),
+                          HoppingModifier(position_dependent, false, false, true));
+    parallel.set_num_threads(3);
+    REQUIRE(parallel.system()->hoppings.nonZeros() > 4 * 4096); // more than one round of chunks
+
+    auto const& expected = ham::get_reference<float>(serial.hamiltonian());
+    auto const& result = ham::get_reference<float>(parallel.hamiltonian());
+    REQUIRE(result.nonZeros() == expected.nonZeros());
+    REQUIRE(result.isApprox(expected, 0)); // the same values in the same order
+    REQUIRE(ids_match);
+}
+
+TEST_CASE("Chunked onsite modifiers") {
+    auto const make_model = [](OnsiteModifier const& modifier) {
+        return Model(graphene::monolayer(), shape::rectangle(10, 10), modifier);
+    };
+    auto const reference = make_model(field::linear_onsite());
+    auto const& expected = ham::get_reference<float>(reference.hamiltonian());
+
+    auto chunk_sizes = std::vector<int>();
+    auto chunked = make_model(OnsiteModifier([&](ComplexArrayRef energy, CartesianArray const& p,
+                                                 SubIdRef s) {
+        chunk_sizes.push_back(p.size());
+        REQUIRE(s.ids.size() == p.size());
+        field::linear_onsite().apply(energy, p, s);
+    }));
+    chunked.set_onsite_chunk_size(100);
+    auto const num_sites = chunked.system()->num_sites();
+    auto const& result = ham::get_reference<float>(chunked.hamiltonian());
+    REQUIRE(result.isApprox(expected, 0));
+    REQUIRE(chunk_sizes.size() == static_cast<size_t>((num_sites + 99) / 100));
+    REQUIRE(chunk_sizes.front() == 100);
+
+    // A new chunk size rebuilds the Hamiltonian
+    chunk_sizes.clear();
+    chunked.set_onsite_chunk_size(50);
+    REQUIRE(ham::get_reference<float>(chunked.hamiltonian()).isApprox(expected, 0));
+    REQUIRE(chunk_sizes.size() == static_cast<size_t>((num_sites + 49) / 50));
+
+    auto parallel = make_model(builtin::linear_electric_field({1, 0, 0}));
+    auto serial = make_model(builtin::linear_electric_field({1, 0, 0}));
+    parallel.set_onsite_chunk_size(64);
+    parallel.set_num_threads(3);
+    REQUIRE(ham::get_reference<float>(parallel.hamiltonian())
+                .isApprox(ham::get_reference<float>(serial.hamiltonian()), 0));
+
+    // The disorder is keyed by position: it doesn't depend on the chunks or threads
+    auto disordered = make_model(builtin::onsite_disorder(0.2f, 1));
+    auto disordered_chunks = make_model(builtin::onsite_disorder(0.2f, 1));
+    disordered_chunks.set_onsite_chunk_size(64);
+    disordered_chunks.set_num_threads(3);
+    REQUIRE(ham::get_reference<float>(disordered_chunks.hamiltonian())
+                .isApprox(ham::get_reference<float>(disordered.hamiltonian()), 0));
+}
+
+TEST_CASE("Direct CSR assembly") {
+    SECTION("Duplicates are summed and unused slots are removed") {
+        auto const num_rows = 50;
+        auto triplets = std::vector<Eigen::Triplet<double>>();
+        for (auto n = 0; n < 400; ++n) { // plenty of duplicates in 50 x 50
+            triplets.emplace_back(n * 7 % num_rows, n * 13 % 29, 0.5 + n);
+        }
+
+        auto capacity = ArrayXi(ArrayXi::Constant(num_rows, 2));
+        for (auto const& t : triplets) { ++capacity[t.row()]; }
+
+        auto result = SparseMatrixX<double>();
+        auto builder = detail::CsrBuilder<double>(result, capacity);
+        for (auto const& t : triplets) { builder.insert(t.row(), t.col(), t.value()); }
+        builder.finish(3);
+
+        auto expected = SparseMatrixX<double>(num_rows, num_rows);
+        expected.setFromTriplets(triplets.begin(), triplets.end());
+        REQUIRE(result.isCompressed());
+        REQUIRE(result.nonZeros() == expected.nonZeros());
+        REQUIRE(result.isApprox(expected, 0));
+    }
+
+    SECTION("Periodic Hamiltonian") {
+        auto model = Model(graphene::monolayer(), Primitive(5, 5), TranslationalSymmetry(1, 1),
+                           field::constant_potential(1));
+        model.set_wave_vector({0.5f, 0.2f, 0});
+        auto const& h = ham::get_reference<std::complex<float>>(model.hamiltonian());
+        REQUIRE(h.isCompressed());
+        auto const dense = MatrixX<std::complex<float>>(h);
+        REQUIRE(dense.isApprox(dense.adjoint()));
+        REQUIRE(dense.diagonal().real().isApproxToConstant(1));
+    }
+}
+
+TEST_CASE("Built-in modifiers") {
+    auto const num_sites = [](Model const& m) { return m.system()->num_sites(); };
+
+    SECTION("Magnetic field") {
+        auto const expected = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                    field::constant_magnetic_field(1e3f)).hamiltonian();
+        auto const result = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                  builtin::constant_magnetic_field(1e3f)).hamiltonian();
+        auto const& e = ham::get_reference<std::complex<float>>(expected);
+        auto const& r = ham::get_reference<std::complex<float>>(result);
+        REQUIRE(r.isApprox(e));
+        REQUIRE_FALSE(r.isApprox(ham::get_reference<std::complex<float>>(
+            Model(graphene::monolayer(), shape::rectangle(2, 2), field::force_complex_numbers())
+                .hamiltonian()
+        )));
+    }
+
+    SECTION("Electric field") {
+        auto const model = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                 builtin::linear_electric_field({0.5f, 0, 0}));
+        auto const& h = ham::get_reference<float>(model.hamiltonian());
+        auto const& x = model.system()->positions.x;
+        for (auto i = 0; i < num_sites(model); ++i) {
+            REQUIRE(h.coeff(i, i) == Approx(0.5f * x[i]));
+        }
+    }
+
+    SECTION("Strained hopping") {
+        auto const unstrained = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                      builtin::strained_hopping(3.37f, graphene::a_cc));
+        auto const& h = ham::get_reference<float>(unstrained.hamiltonian());
+        auto const plain = Model(graphene::monolayer(), shape::rectangle(2, 2));
+        auto const& h0 = ham::get_reference<float>(plain.hamiltonian());
+        REQUIRE(h.isApprox(h0, 1e-4f)); // every bond has the equilibrium length
+
+        auto const stretched = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                     builtin::strained_hopping(3.37f, 0.9f * graphene::a_cc));
+        auto const& hs = ham::get_reference<float>(stretched.hamiltonian());
+        REQUIRE(hs.cwiseAbs().sum() < h0.cwiseAbs().sum());
+    }
+
+    SECTION("Onsite disorder") {
+        auto const a = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                             builtin::onsite_disorder(0.2f, 1));
+        auto const b = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                             builtin::onsite_disorder(0.2f, 1));
+        auto const c = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                             builtin::onsite_disorder(0.2f, 2));
+        auto const& ha = ham::get_reference<float>(a.hamiltonian());
+        auto const& hb = ham::get_reference<float>(b.hamiltonian());
+        auto const& hc = ham::get_reference<float>(c.hamiltonian());
+        REQUIRE(ha.isApprox(hb, 0));
+        REQUIRE_FALSE(ha.isApprox(hc));
+        REQUIRE(ha.diagonal().cwiseAbs().maxCoeff() <= 0.1f);
+        REQUIRE(ha.diagonal().size() == num_sites(a));
+    }
+
+    SECTION("Native functions") {
+        auto const field = +[](double* energy, float const* x, float const*, float const*,
+                               std::int8_t const*, std::int64_t n) {
+            for (auto i = std::int64_t{0}; i < n; ++i) { energy[i] += 0.5 * x[i]; }
+        };
+        auto const expected = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                    builtin::linear_electric_field({0.5f, 0, 0}));
+        auto model = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                           builtin::native_onsite(field));
+        model.set_onsite_chunk_size(16);
+        model.set_num_threads(3);
+        REQUIRE(ham::get_reference<float>(model.hamiltonian()).isApprox(
+            ham::get_reference<float>(expected.hamiltonian())
+        ));
+
+        // A complex function sees the (real, imag) pairs: multiply by `i`
+        auto const rotate = +[](double* energy, float const*, float const*, float const*,
+                                float const*, float const*, float const*,
+                                std::int8_t const*, std::int64_t n) {
+            for (auto i = std::int64_t{0}; i < n; ++i) {
+                auto const re = energy[2 * i];
+                energy[2 * i] = -energy[2 * i + 1];
+                energy[2 * i + 1] = re;
+            }
+        };
+        auto const plain = Model(graphene::monolayer(), shape::rectangle(2, 2));
+        auto const rotated = Model(graphene::monolayer(), shape::rectangle(2, 2),
+                                   builtin::native_hopping(rotate, /*is_complex*/true));
+        auto const& h0 = ham::get_reference<float>(plain.hamiltonian());
+        auto const& h = ham::get_reference<std::complex<float>>(rotated.hamiltonian());
+        REQUIRE(h.nonZeros() == h0.nonZeros());
+        REQUIRE(h.cwiseAbs().isApprox(h0.cwiseAbs()));
+        REQUIRE(h.real().norm() < 1e-6f);
+        REQUIRE(MatrixX<std::complex<float>>(h).isApprox(
+            MatrixX<std::complex<float>>(h).adjoint()
+        ));
+
+        REQUIRE_THROWS_AS(builtin::native_onsite(nullptr), std::invalid_argument);
+        REQUIRE_THROWS_AS(builtin::native_hopping(nullptr), std::invalid_argument);
+    }
 }
@@ -1,6 +1,9 @@
 #include <catch.hpp>
 
+#include "numeric/bfloat16.hpp"
+#include "numeric/bsrmatrix.hpp"
 #include "numeric/dense.hpp"
+#include "numeric/random.hpp"
 using namespace cpb;
 
 struct ArrayRefTestOp {
@@ -49,3 +52,104 @@ TEST_CASE("Aligned size") {
     REQUIRE((num::aligned_size<std::complex<double>, 16>(2) == 2));
     REQUIRE((num::aligned_size<std::complex<float>, 32>(9) == 12));
 }
+
+TEST_CASE("Counter-based random numbers") {
+    SECTION("Philox4x32-10 known answers") {
+        using Block = num::Philox::Block;
+        REQUIRE((num::Philox(0).generate({{0, 0, 0, 0}})
+                 == Block{{0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}}));
+        auto const ones = num::Philox(0xffffffffffffffffull);
+        REQUIRE((ones.generate({{0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff}})
+                 == Block{{0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd}}));
+    }
+
+    SECTION("Any part of a vector can be generated on its own") {
+        auto full = VectorXcf(1000);
+        num::random_phase_fill(full, 7, 3);
+        auto part = VectorXcf(300);
+        num::random_phase_fill(part, 7, 3, 500);
+        REQUIRE(part == full.segment(500, 300));
+        REQUIRE(std::abs(full[123]) == Approx(1));
+
+        auto other_stream = VectorXcf(1000);
+        num::random_phase_fill(other_stream, 7, 4);
+        REQUIRE(other_stream != full);
+    }
+
+    SECTION("Uniform values") {
+        auto const x = num::make_random<ArrayXd>(1000);
+        REQUIRE(x.minCoeff() >= 0);
+        REQUIRE(x.maxCoeff() < 1);
+        REQUIRE(x.mean() == Approx(0.5).epsilon(0.05));
+        REQUIRE((x == num::make_random<ArrayXd>(1000)).all());
+    }
+}
+
+TEST_CASE("bfloat16 conversion") {
+    REQUIRE(num::to_bfloat16(1.0f) == 0x3f80);
+    REQUIRE(num::to_bfloat16(-2.0f) == 0xc000);
+    REQUIRE(num::from_bfloat16(0x3f80) == 1.0f);
+    REQUIRE(num::from_bfloat16(num::to_bfloat16(0.0f)) == 0.0f);
+
+    // Round to nearest, ties to even: 1 + 2^-8 is halfway between 1 and 1 + 2^-7
+    REQUIRE(num::to_bfloat16(1.0f + 1.0f / 256) == 0x3f80);
+    REQUIRE(num::to_bfloat16(1.0f + 3.0f / 256) == 0x3f82);
+    REQUIRE(num::to_bfloat16(1.0f + 1.0f / 256 + 1.0f / 4096) == 0x3f81);
+
+    auto const nan = std::numeric_limits<float>::quiet_NaN();
+    REQUIRE(std::isnan(num::from_bfloat16(num::to_bfloat16(nan))));
+    auto const inf = std::numeric_limits<float>::infinity();
+    REQUIRE(num::from_bfloat16(num::to_bfloat16(inf)) == inf);
+
+    auto const x = num::make_random<ArrayXf>(1000);
+    for (auto i = 0; i < x.size(); ++i) {
+        auto const value = 4 * x[i] - 2;
+        auto const rounded = num::from_bfloat16(num::to_bfloat16(value));
+        REQUIRE(std::abs(rounded - value) <= std::abs(value) / 256);
+    }
+
+    auto const parts = std::vector<num::bfloat16_t>{0x3f80, 0xc000};
+    REQUIRE(num::bfloat16_value<double>(parts.data()) == 1.0);
+    REQUIRE(num::bfloat16_value<std::complex<float>>(parts.data())
+            == std::complex<float>(1, -2));
+}
+
+TEST_CASE("BSR matrix") {
+    // Dense 3x3 blocks on the block diagonal and above it
+    auto triplets = std::vector<Eigen::Triplet<float>>();
+    auto const add_block = [&](int i, int j) {
+        for (auto r = 0; r < 3; ++r) {
+            for (auto c = 0; c < 3; ++c) {
+                triplets.emplace_back(3 * i + r, 3 * j + c, static_cast<float>(1 + r + 3 * c));
+            }
+        }
+    };
+    add_block(0, 0);
+    add_block(0, 1);
+    add_block(1, 1);
+    auto csr = SparseMatrixX<float>(6, 6);
+    csr.setFromTriplets(triplets.begin(), triplets.end());
+    csr.makeCompressed();
+
+    // Blocks of 2 or 6 rows would contain zeros
+    REQUIRE(num::find_block_size(csr) == 3);
+
+    auto const bsr = num::BsrMatrix<float>(csr, 3);
+    REQUIRE(bsr.num_blocks() == 3);
+    REQUIRE(bsr.nonZeros() == csr.nonZeros());
+
+    Eigen::MatrixXf const dense = csr;
+    auto count = 0;
+    for (auto row = 0; row < bsr.rows(); ++row) {
+        bsr.for_each_in_row(row, [&](int col, float value) {
+            REQUIRE(value == dense(row, col));
+            ++count;
+        });
+    }
+    REQUIRE(count == csr.nonZeros());
+
+    // A sparse pattern doesn't benefit from blocks
+    auto identity = SparseMatrixX<float>(6, 6);
+    identity.setIdentity();
+    REQUIRE(num::find_block_size(identity) == 0);
+}
@@ -1,6 +1,10 @@
 #include <catch.hpp>
 
+#include <limits>
+
 #include "fixtures.hpp"
+#include "system/Foundation.hpp"
+#include "numeric/random.hpp"
 using namespace cpb;
 
 TEST_CASE("FreeformShape", "[shape]") {
@@ -31,6 +35,44 @@ TEST_CASE("FreeformShape", "[shape]") {
     }
 }
 
+TEST_CASE("Polygon", "[shape]") {
+    // Star-shaped (concave) polygon with many vertices
+    auto const num_vertices = 2000;
+    auto vertices = Shape::Vertices();
+    for (auto i = 0; i < num_vertices; ++i) {
+        auto const angle = 2 * 3.14159265f * static_cast<float>(i) / num_vertices;
+        auto const radius = (i % 2 == 0) ? 10.f : 6.f + static_cast<float>(i % 7);
+        vertices.push_back({radius * std::cos(angle), radius * std::sin(angle), 0});
+    }
+    auto const polygon = Polygon(vertices);
+    REQUIRE(polygon.is_thread_safe);
+
+    auto const num_points = 5000;
+    auto x = ArrayXf(num_points);
+    auto y = ArrayXf(num_points);
+    num::random_fill(x, 1);
+    num::random_fill(y, 2);
+    auto const p = CartesianArray(x * 24 - 12, y * 24 - 12, ArrayXf::Zero(num_points));
+
+    // Reference: the ray is tested against every side of the polygon
+    auto expected = ArrayX<bool>::Constant(num_points, false).eval();
+    for (auto n = 0; n < num_points; ++n) {
+        for (auto i = 0, j = num_vertices - 1; i < num_vertices; j = i++) {
+            auto const& v1 = vertices[i];
+            auto const& v2 = vertices[j];
+            if (num::approx_equal(v1.y(), v2.y())) { continue; }
+            auto const k = (v2.x() - v1.x()) / (v2.y() - v1.y());
+            auto const intersects_y = (v1.y() > p.y[n]) != (v2.y() > p.y[n]);
+            if (intersects_y && p.x[n] > k * (p.y[n] - v1.y()) + v1.x()) {
+                expected[n] = !expected[n];
+            }
+        }
+    }
+    REQUIRE(any_of(expected));
+    REQUIRE(all_of(polygon.contains(p) == expected));
+    REQUIRE(all_of(detail::contains(polygon, p, 3) == expected));
+}
+
 TEST_CASE("Shape-imposed lattice offset") {
     auto shape = shape::rectangle(2.4f, 2.4f);
     
@@ -46,3 +88,300 @@ TEST_CASE("Shape-imposed lattice offset") {
     REQUIRE(system.positions.x.minCoeff() > offset_system.positions.x.minCoeff());
     REQUIRE(system.num_sites() > offset_system.num_sites());
 }
+
+TEST_CASE("Parallel system build") {
+    auto model = Model(graphene::monolayer(), shape::rectangle(20, 14));
+    auto const& system = *model.system();
+    // The rows are written straight into an exactly sized matrix
+    REQUIRE(system.hoppings.isCompressed());
+    REQUIRE(system.hoppings.data().allocatedSize() == system.hoppings.nonZeros());
+
+    for (auto num_threads : {2, 3, 4}) {
+        auto parallel_model = Model(graphene::monolayer(), shape::rectangle(20, 14));
+        parallel_model.set_num_threads(num_threads);
+        auto const& parallel_system = *parallel_model.system();
+
+        REQUIRE(parallel_system.num_sites() == system.num_sites());
+        REQUIRE(all_of(parallel_system.positions.x == system.positions.x));
+        REQUIRE(all_of(parallel_system.positions.y == system.positions.y));
+        REQUIRE(all_of(parallel_system.sublattices == system.sublattices));
+
+        auto const& expected = system.hoppings;
+        auto const& actual = parallel_system.hoppings;
+        REQUIRE(actual.nonZeros() == expected.nonZeros());
+        REQUIRE(std::equal(expected.outerIndexPtr(), expected.outerIndexPtr() + expected.rows() + 1,
+                           actual.outerIndexPtr()));
+        REQUIRE(std::equal(expected.innerIndexPtr(), expected.innerIndexPtr() + expected.nonZeros(),
+                           actual.innerIndexPtr()));
+        REQUIRE(std::equal(expected.valuePtr(), expected.valuePtr() + expected.nonZeros(),
+                           actual.valuePtr()));
+    }
+}
+
+TEST_CASE("Tiled foundation") {
+    auto const ring = FreeformShape([](CartesianArray const& p) -> ArrayX<bool> {
+        auto const r = (p.x.square() + p.y.square()).sqrt().eval();
+        return r > 8.f && r < 9.f;
+    }, {20, 20, 0});
+
+    auto const lattice = graphene::monolayer();
+    auto const box = Foundation(lattice, ring);
+    auto const tiled = Foundation(lattice, ring, 1, 8);
+    REQUIRE(tiled.get_tiles().size() > 1);
+    REQUIRE(tiled.get_num_sites() < box.get_num_sites() / 2);
+    REQUIRE(tiled.get_states().count() == box.get_states().count());
+
+    auto model = Model(lattice, ring);
+    auto const& system = *model.system();
+
+    for (auto tile_size : {1, 8, 100}) {
+        auto tiled_model = Model(lattice, ring);
+        tiled_model.set_tile_size(tile_size);
+        tiled_model.set_num_threads(2);
+        auto const& tiled_system = *tiled_model.system();
+
+        // The sites are ordered by tile, so only compare order-independent properties
+        REQUIRE(tiled_system.num_sites() == system.num_sites());
+        REQUIRE(tiled_system.hoppings.nonZeros() == system.hoppings.nonZeros());
+        auto const& p = system.positions;
+        auto const& tiled_p = tiled_system.positions;
+        REQUIRE(tiled_p.x.square().sum() == Approx(p.x.square().sum()));
+        REQUIRE(tiled_p.y.square().sum() == Approx(p.y.square().sum()));
+    }
+}
+
+TEST_CASE("Interior neighbours") {
+    auto const lattice = graphene::monolayer();
+    auto const shape = shape::rectangle(3.f, 2.f);
+
+    for (auto tile_size : {0, 4}) {
+        INFO("tile_size: " << tile_size);
+        auto foundation = Foundation(lattice, shape, 1, tile_size);
+
+        // The fast path for interior sites must give the same neighbours as a full lookup
+        auto num_neighbors = 0;
+        for (auto const& site : foundation) {
+            site.for_each_neighbour([&](Site neighbor, Hopping hopping) {
+                auto const expected = Site(&foundation, site.get_index() + hopping.relative_index,
+                                           hopping.to_sublattice);
+                REQUIRE(neighbor.get_idx() == expected.get_idx());
+                REQUIRE(neighbor.get_index() == expected.get_index());
+                ++num_neighbors;
+            });
+        }
+        REQUIRE(num_neighbors > 0);
+    }
+}
+
+TEST_CASE("Site order") {
+    auto const bandwidth = [](SparseMatrixX<float> const& h) {
+        auto result = 0;
+        for (auto row = 0; row < h.outerSize(); ++row) {
+            for (auto it = SparseMatrixX<float>::InnerIterator(h, row); it; ++it) {
+                result = std::max(result, static_cast<int>(std::abs(it.col() - row)));
+            }
+        }
+        return result;
+    };
+
+    auto model = Model(graphene::monolayer(), shape::rectangle(4, 3));
+    auto const& system = *model.system();
+    MatrixX<float> const h = ham::get_reference<float>(model.hamiltonian());
+    REQUIRE(system.original_indices.size() == 0);
+
+    for (auto order : {SiteOrder::UnitCell, SiteOrder::RCM, SiteOrder::Morton}) {
+        INFO("order: " << static_cast<int>(order));
+        auto reordered = Model(graphene::monolayer(), shape::rectangle(4, 3));
+        reordered.set_site_order(order);
+        auto const& s = *reordered.system();
+        auto const& original = s.original_indices;
+        REQUIRE(s.num_sites() == system.num_sites());
+        REQUIRE(original.size() == s.num_sites());
+
+        auto sorted = ArrayXi(original);
+        std::sort(sorted.data(), sorted.data() + sorted.size());
+        REQUIRE((sorted == ArrayXi::LinSpaced(s.num_sites(), 0, s.num_sites() - 1)).all());
+
+        auto const& h2 = ham::get_reference<float>(reordered.hamiltonian());
+        for (auto i = 0; i < s.num_sites(); ++i) {
+            REQUIRE(s.positions[i] == system.positions[original[i]]);
+            REQUIRE(s.sublattices[i] == system.sublattices[original[i]]);
+            for (auto j = 0; j < s.num_sites(); ++j) {
+                REQUIRE(h2.coeff(i, j) == h(original[i], original[j]));
+            }
+        }
+
+        if (order == SiteOrder::RCM) {
+            REQUIRE(bandwidth(h2) < bandwidth(ham::get_reference<float>(model.hamiltonian())));
+        }
+    }
+}
+
+TEST_CASE("Compact positions") {
+    auto make_model = [](int tile_size, SiteOrder order, bool compact) {
+        auto model = Model(graphene::monolayer(), shape::rectangle(4, 3),
+                           field::linear_onsite(), field::constant_magnetic_field(1e4));
+        model.set_tile_size(tile_size);
+        model.set_site_order(order);
+        model.set_compact_positions(compact);
+        return model;
+    };
+
+    for (auto tile_size : {0, 3}) {
+        for (auto order : {SiteOrder::Foundation, SiteOrder::Morton}) {
+            INFO("tile_size: " << tile_size << ", order: " << static_cast<int>(order));
+            auto model = make_model(tile_size, order, false);
+            auto compact_model = make_model(tile_size, order, true);
+            auto const& system = *model.system();
+            auto const& compact = *compact_model.system();
+            REQUIRE(compact.positions.size() == 0);
+            REQUIRE(compact.compact.cells.size() == system.num_sites());
+            REQUIRE((compact.sublattices == system.sublattices).all());
+
+            auto buffer = CartesianArray();
+            auto const& p = compact.expanded_positions(buffer);
+            REQUIRE(p.x.isApprox(system.positions.x));
+            REQUIRE(p.y.isApprox(system.positions.y));
+            for (auto i = 0; i < system.num_sites(); ++i) {
+                REQUIRE((compact.position(i) - system.positions[i]).norm() < 1e-5f);
+            }
+            REQUIRE(compact.find_nearest({0, 0, 0}) == system.find_nearest({0, 0, 0}));
+
+            using scalar_t = std::complex<float>;
+            auto const& h = ham::get_reference<scalar_t>(model.hamiltonian());
+            auto const& compact_h = ham::get_reference<scalar_t>(compact_model.hamiltonian());
+            REQUIRE(compact_h.isApprox(h));
+        }
+    }
+
+    // Modified positions don't follow the lattice anymore
+    auto model = make_model(0, SiteOrder::Foundation, true);
+    model.add(PositionModifier([](CartesianArray& position, SubIdRef) { position.y *= 2; }));
+    REQUIRE(model.system()->compact.empty());
+    REQUIRE(model.system()->positions.size() == model.system()->num_sites());
+}
+
+TEST_CASE("Memory estimate") {
+    auto const ring = FreeformShape([](CartesianArray const& p) -> ArrayX<bool> {
+        auto const r = (p.x.square() + p.y.square()).sqrt().eval();
+        return r > 8.f && r < 9.f;
+    }, {20, 20, 0});
+    auto const lattice = graphene::monolayer();
+
+    auto model = Model(lattice, ring);
+    auto const estimate = model.estimate_memory();
+    auto const& system = *model.system();
+    auto const num_sites = static_cast<std::size_t>(system.num_sites());
+    auto const box = Foundation(lattice, ring);
+    REQUIRE(estimate.box_sites == static_cast<std::size_t>(box.get_num_sites()));
+    REQUIRE(estimate.foundation_sites == estimate.box_sites);
+    // Few enough unit cells to sample all of them: only the dangling sites are not removed
+    REQUIRE(estimate.num_sites >= num_sites);
+    REQUIRE(estimate.num_sites < num_sites * 11 / 10);
+    REQUIRE(estimate.hamiltonian_nnz >= static_cast<std::size_t>(model.hamiltonian().non_zeros()));
+    REQUIRE(estimate.peak_bytes() > estimate.system_bytes);
+
+    auto const tiled = estimate_memory(model, 8, true);
+    REQUIRE(tiled.foundation_sites < estimate.foundation_sites / 2);
+    REQUIRE(tiled.system_bytes < estimate.system_bytes);
+
+    SECTION("The budget switches on the lower memory modes") {
+        auto budgeted = Model(lattice, ring);
+        budgeted.set_memory_budget(estimate.peak_bytes() - 1);
+        REQUIRE(budgeted.system()->num_sites() == system.num_sites());
+    }
+
+    SECTION("Fail before building if the budget is too small") {
+        auto budgeted = Model(lattice, ring);
+        budgeted.set_memory_budget(1024);
+        REQUIRE_THROWS_WITH(budgeted.system(), Catch::Contains("memory budget"));
+    }
+}
+
+TEST_CASE("Spatial index") {
+    auto const model = Model(graphene::monolayer(), shape::rectangle(5, 4));
+    auto const& system = *model.system();
+    auto const id_b = system.lattice.get_sites().id_lookup("B");
+
+    auto brute_nearest = [&](Cartesian target, sub_id sublattice) {
+        auto best = -1;
+        auto best_distance = std::numeric_limits<float>::max();
+        for (auto i = 0; i < system.num_sites(); ++i) {
+            if (sublattice >= 0 && system.sublattices[i] != sublattice) { continue; }
+            auto const distance = (system.positions[i] - target).norm();
+            if (distance < best_distance) {
+                best_distance = distance;
+                best = i;
+            }
+        }
+        return best;
+    };
+
+    // Inside the system, far outside of it and exactly on the sites
+    auto targets = CartesianArray(40);
+    for (auto n = 0; n < 30; ++n) {
+        targets[n] = Cartesian{-3.f + 0.21f * n, 2.7f - 0.17f * n, 0};
+    }
+    for (auto n = 30; n < 40; ++n) {
+        targets[n] = system.positions[(n * 37) % system.num_sites()];
+    }
+    targets[0] = {50, -20, 3};
+
+    for (auto n = 0; n < targets.size(); ++n) {
+        INFO("target: " << n);
+        REQUIRE(system.find_nearest(targets[n]) == brute_nearest(targets[n], -1));
+        REQUIRE(system.find_nearest(targets[n], "B") == brute_nearest(targets[n], id_b));
+    }
+
+    auto const batch = system.find_nearest(targets, "B", 3);
+    for (auto n = 0; n < targets.size(); ++n) {
+        REQUIRE(batch[n] == brute_nearest(targets[n], id_b));
+    }
+
+    auto const center = Cartesian{0.3f, -0.2f, 0};
+    auto const radius = 0.9f;
+    auto const within = system.find_within(center, radius);
+    auto expected = std::vector<int>();
+    for (auto i = 0; i < system.num_sites(); ++i) {
+        if ((system.positions[i] - center).norm() <= radius) { expected.push_back(i); }
+    }
+    REQUIRE(within.size() == static_cast<int>(expected.size()));
+    REQUIRE(std::equal(expected.begin(), expected.end(), within.data()));
+    REQUIRE(system.find_within({50, 50, 0}, radius).size() == 0);
+}
+
+TEST_CASE("Remove dangling sites") {
+    auto foundation = Foundation(graphene::monolayer(), shape::rectangle(20, 20));
+    auto& states = foundation.get_states();
+    auto random = ArrayXf(states.size());
+    num::random_fill(random, 3);
+    states = states && (random > 0.3f); // vacancy disorder
+    auto const min_neighbors = 2;
+
+    // Reference: the same fixed point found by repeatedly scanning all of the sites
+    auto expected = ArrayX<bool>(states);
+    auto is_changed = true;
+    while (is_changed) {
+        is_changed = false;
+        for (auto const& site : foundation) {
+            if (!expected[site.get_idx()]) { continue; }
+            auto num_neighbors = 0;
+            auto num_invalid = 0;
+            site.for_each_neighbour([&](Site neighbor, Hopping) {
+                ++num_neighbors;
+                if (!expected[neighbor.get_idx()]) { ++num_invalid; }
+            });
+            if (num_invalid > 0 && num_neighbors - num_invalid < min_neighbors) {
+                expected[site.get_idx()] = false;
+                is_changed = true;
+            }
+        }
+    }
+    REQUIRE(expected.count() < states.count());
+
+    for (auto num_threads : {1, 3}) {
+        auto pruned = foundation;
+        remove_dangling(pruned, min_neighbors, num_threads);
+        REQUIRE(all_of(pruned.get_states() == expected));
+    }
+}
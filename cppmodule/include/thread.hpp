@@ -1,8 +1,15 @@
 #pragma once
 #include <pybind11/pybind11.h>
 
+#include "numeric/dense.hpp"
+#include "utils/Affinity.hpp"
+#include "utils/TaskPool.hpp"
+
 #include <thread>
 #include <queue>
+#include <deque>
+#include <memory>
+#include <algorithm>
 #include <condition_variable>
 
 namespace py = pybind11;
@@ -60,6 +67,22 @@ public:
         return std::move(val);
     }
 
+    /// Wait for at least one item and take all of them: empty result if there are no more
+    std::vector<T> pop_all() {
+        std::unique_lock<std::mutex> lk(m);
+        consumption_cv.wait(lk, [&] { return !q.empty() || is_closed; });
+
+        auto items = std::vector<T>();
+        items.reserve(q.size());
+        while (!q.empty()) {
+            items.push_back(std::move(q.front()));
+            q.pop();
+        }
+        lk.unlock();
+        production_cv.notify_all();
+        return items;
+    }
+
     void push(const T& item) {
         std::unique_lock<std::mutex> lk(m);
         production_cv.wait(lk, [&] { return q.size() < max_size; });
@@ -89,38 +112,194 @@ private:
     std::size_t max_size = std::numeric_limits<std::size_t>::max();
 };
 
+/**
+ Work-stealing queue: each worker thread has its own deque
+
+ A worker takes jobs from the front of its own deque and, once it's empty, steals from the
+ front of another worker's deque. The total number of queued jobs is limited to `max_size`.
+ */
 template<class T>
+class StealingQueue {
+    struct Local {
+        std::mutex m;
+        std::deque<T> q;
+    };
+
+public:
+    using Maybe = typename Queue<T>::Maybe;
+
+    StealingQueue(std::size_t num_workers, std::size_t max_size) : max_size(max_size) {
+        for (auto i = std::size_t{0}; i < std::max(num_workers, std::size_t{1}); ++i) {
+            locals.emplace_back(new Local());
+        }
+    }
+    StealingQueue(const StealingQueue&) = delete;
+    StealingQueue& operator=(const StealingQueue&) = delete;
+
+    void add_producer() {
+        std::unique_lock<std::mutex> lk(m);
+        num_producers++;
+        if (num_producers > 0)
+            is_closed = false;
+    }
+
+    void remove_producer() {
+        std::unique_lock<std::mutex> lk(m);
+        num_producers--;
+        if (num_producers <= 0)
+            is_closed = true;
+        lk.unlock();
+        consumption_cv.notify_all();
+    }
+
+    /// Add a job to the deque of the given `worker`
+    void push(T&& item, std::size_t worker) {
+        {
+            std::unique_lock<std::mutex> lk(m);
+            production_cv.wait(lk, [&] { return count < static_cast<std::ptrdiff_t>(max_size); });
+        }
+        {
+            auto& local = *locals[worker % locals.size()];
+            std::lock_guard<std::mutex> lk(local.m);
+            local.q.push_back(std::move(item));
+        }
+        {
+            std::lock_guard<std::mutex> lk(m);
+            ++count;
+        }
+        consumption_cv.notify_all();
+    }
+
+    /// Get a job for the given `worker`: empty result if there are no more jobs
+    Maybe pop(std::size_t worker) {
+        while (true) {
+            for (auto n = std::size_t{0}; n < locals.size(); ++n) {
+                auto& local = *locals[(worker + n) % locals.size()];
+                std::unique_lock<std::mutex> local_lk(local.m);
+                if (local.q.empty()) {
+                    continue;
+                }
+
+                auto item = std::move(local.q.front());
+                local.q.pop_front();
+                local_lk.unlock();
+                {
+                    std::lock_guard<std::mutex> lk(m);
+                    --count; // may briefly go negative if `push` hasn't counted it yet
+                }
+                production_cv.notify_one();
+                return std::move(item);
+            }
+
+            std::unique_lock<std::mutex> lk(m);
+            consumption_cv.wait(lk, [&] { return count > 0 || is_closed; });
+            if (count <= 0 && is_closed) {
+                return {};
+            }
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<Local>> locals;
+    std::mutex m;
+    std::condition_variable production_cv;
+    std::condition_variable consumption_cv;
+
+    std::ptrdiff_t count = 0;
+    bool is_closed = false;
+    int num_producers = 0;
+    std::size_t max_size;
+};
+
+template<class Q>
 class QueueGuard {
-    Queue<T>& wq;
+    Q& wq;
 public:
-    QueueGuard(Queue<T>& q) : wq(q) { wq.add_producer(); }
+    QueueGuard(Q& q) : wq(q) { wq.add_producer(); }
     ~QueueGuard() { wq.remove_producer(); }
 };
 
+/// A `parallel_for` job: `id` is the index of the `value` in the original sequence
+template<class Value>
+struct Job {
+    size_t id;
+    Value value;
+};
+
+/// Job indices sorted by decreasing cost, the original order is kept for equal costs
+inline std::vector<std::size_t> longest_first(std::size_t size, std::vector<double> const& costs) {
+    auto order = std::vector<std::size_t>(size);
+    for (auto i = std::size_t{0}; i < size; ++i) {
+        order[i] = i;
+    }
+    if (costs.size() == size) {
+        std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+            return costs[a] > costs[b];
+        });
+    }
+    return order;
+}
+
+/// Counts down the tasks of one `parallel_for` call which run on the shared pool
+class Latch {
+public:
+    explicit Latch(int count) : count(count) {}
+
+    void count_down() {
+        // Notify while holding the lock: `wait()` may return and destroy the latch as soon
+        // as the count reaches zero
+        std::lock_guard<std::mutex> lk(m);
+        if (--count == 0)
+            cv.notify_all();
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait(lk, [&] { return count == 0; });
+    }
+
+private:
+    std::mutex m;
+    std::condition_variable cv;
+    int count;
+};
+
 #ifdef CPB_USE_MKL
 # include <mkl.h>
 
+/// Single-threaded MKL on the calling thread only: the setting is thread-local, so it
+/// doesn't affect MKL calls on other threads, e.g. a concurrent `parallel_for`
 class MKLDisableThreading {
 public:
-    MKLDisableThreading(bool condition) : num_threads{mkl_get_max_threads()} {
-        if (condition)
-            mkl_set_num_threads(1);
+    MKLDisableThreading(bool condition)
+        : previous{condition ? mkl_set_num_threads_local(1) : -1} {}
+    ~MKLDisableThreading() {
+        if (previous >= 0)
+            mkl_set_num_threads_local(previous);
     }
-    ~MKLDisableThreading() { mkl_set_num_threads(num_threads); }
 
 private:
-    int num_threads;
+    int previous; ///< previous thread-local setting (0 means the global one), -1 if unchanged
 };
 
 #endif
 
 } // namespace detail
 
+namespace detail {
+    /// The result as a plain array, if it is one: see `DeferredBase::result_array()`
+    inline Eigen::ArrayXd const* as_array(Eigen::ArrayXd const& result) { return &result; }
+    template<class Result>
+    Eigen::ArrayXd const* as_array(Result const&) { return nullptr; }
+} // namespace detail
+
 class DeferredBase {
 public:
     virtual py::object solver() const = 0;
     virtual void compute() = 0;
     virtual py::object result() = 0;
+    /// Direct access to a computed `ArrayXd` result without going through Python (no GIL)
+    virtual Eigen::ArrayXd const* result_array() const = 0;
 };
 
 template<class Result>
@@ -140,6 +319,10 @@ public:
 
     py::object result() final { compute(); return py::cast(_result); }
 
+    Eigen::ArrayXd const* result_array() const final {
+        return is_computed ? detail::as_array(_result) : nullptr;
+    }
+
 private:
     py::object _solver;
     std::function<Result()> _compute;
@@ -149,37 +332,57 @@ private:
 };
 
 
-template<class Produce, class Compute, class Retire>
-void parallel_for(size_t size, size_t num_threads, size_t queue_size,
-                  Produce produce, Compute compute, Retire retire) {
-#ifdef CPB_USE_MKL
-    detail::MKLDisableThreading disable_mkl_internal_threading_if{num_threads > 1};
-#endif
+/**
+ Produce jobs on one thread, compute them on `num_threads` and retire them on another
 
-    using Value = decltype(produce(size_t{}));
-    struct Job {
-        size_t id;
-        Value value;
-    };
+ The finished jobs are retired in batches: `retire(jobs)` gets all the `detail::Job`s which
+ were completed since its previous call, so a callback which needs a lock (e.g. the GIL)
+ can take it once per batch instead of once per job. A batch is never empty.
 
-    detail::Queue<Job> work_queue{queue_size > 0 ? queue_size : num_threads};
-    detail::Queue<Job> retirement_queue{};
+ If `costs` are given (one estimate per job, any unit), the jobs are produced and computed
+ longest-first so that the expensive ones don't end up at the tail where they would leave
+ most threads idle. Retirement is always done on a single thread with the original job index.
 
-    // This thread produces new jobs and adds them to the work queue
-    std::thread production_thread([&] {
-        detail::QueueGuard<Job> guard{work_queue};
-        for (auto id = size_t{0}; id < size; ++id) {
-            work_queue.push({id, produce(id)});
+ All the threads are borrowed from `TaskPool::shared()`, so repeated calls don't spawn and
+ join any threads. With `pin_threads`, compute thread `i` is pinned to a CPU while it runs
+ this loop, see `ScopedAffinity`. The CPUs are reserved for the loop, see `CpuReservation`.
+ */
+template<class Produce, class Compute, class Retire>
+void parallel_for(size_t size, size_t num_threads, size_t queue_size,
+                  Produce produce, Compute compute, Retire retire,
+                  std::vector<double> const& costs = {}, bool pin_threads = false) {
+    using Value = decltype(produce(size_t{}));
+    using Job = detail::Job<Value>;
+
+    using WorkQueue = detail::StealingQueue<Job>;
+    using RetirementQueue = detail::Queue<Job>;
+    WorkQueue work_queue{num_threads, queue_size > 0 ? queue_size : num_threads};
+    RetirementQueue retirement_queue{};
+
+    // The producer, the compute threads and the reporter all start at once
+    auto tasks = std::vector<std::function<void()>>();
+    tasks.reserve(num_threads + 2);
+
+    // This thread produces new jobs and deals them out to the workers' queues
+    tasks.emplace_back([&] {
+        detail::QueueGuard<WorkQueue> guard{work_queue};
+        auto const order = detail::longest_first(size, costs);
+        for (auto n = size_t{0}; n < size; ++n) {
+            work_queue.push({order[n], produce(order[n])}, n);
         }
     });
 
-    // Multiple compute threads consume the work queue
+    // Multiple compute threads consume the work queue (stealing from each other when idle)
     // and send the completed jobs to the retirement queue
-    auto work_threads = std::vector<std::thread>{num_threads};
-    for (auto& thread : work_threads) {
-        thread = std::thread([&] {
-            detail::QueueGuard<Job> guard{retirement_queue};
-            while (auto maybe_job = work_queue.pop()) {
+    CpuReservation const cpus(pin_threads ? static_cast<int>(num_threads) : 0);
+    for (auto i = size_t{0}; i < num_threads; ++i) {
+        tasks.emplace_back([&, i] {
+            ScopedAffinity const affinity(pin_threads ? cpus[static_cast<int>(i)] : -1);
+#ifdef CPB_USE_MKL
+            detail::MKLDisableThreading disable_mkl_internal_threading_if{num_threads > 1};
+#endif
+            detail::QueueGuard<RetirementQueue> guard{retirement_queue};
+            while (auto maybe_job = work_queue.pop(i)) {
                 auto job = maybe_job.get();
                 compute(job.value);
                 retirement_queue.push(std::move(job));
@@ -187,19 +390,26 @@ void parallel_for(size_t size, size_t num_threads, size_t queue_size,
         });
     }
 
-    // This thread consumes the retirement queue
-    std::thread report_thread([&] {
-        while (auto maybe_job = retirement_queue.pop()) {
-            auto job = maybe_job.get();
-            retire(std::move(job.value), job.id);
+    // This thread drains the retirement queue
+    tasks.emplace_back([&] {
+        while (true) {
+            auto jobs = retirement_queue.pop_all();
+            if (jobs.empty()) {
+                break;
+            }
+            retire(jobs);
         }
     });
 
-    production_thread.join();
-    for (auto& thread : work_threads) {
-        thread.join();
+    detail::Latch latch{static_cast<int>(tasks.size())};
+    for (auto& task : tasks) {
+        task = [&latch, task]() {
+            task();
+            latch.count_down();
+        };
     }
-    report_thread.join();
+    TaskPool::shared().start(std::move(tasks));
+    latch.wait();
 }
 
 } // namespace cpb
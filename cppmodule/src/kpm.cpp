@@ -1,4 +1,6 @@
 #include "KPM.hpp"
+#include "DisorderEnsemble.hpp"
+#include "SelfConsistentLoop.hpp"
 #include "wrappers.hpp"
 #include "thread.hpp"
 using namespace cpb;
@@ -6,29 +8,90 @@ using namespace cpb;
 namespace {
 
 template<template<class> class Strategy>
-void wrap_kpm_strategy(py::module& m, char const* name) {
+KPM make_from(Model const& model, kpm::Config const& config) {
+    return make_kpm<Strategy>(model, config);
+}
+
+/// The strategy on its own for an external Hamiltonian matrix which has no `Model`
+template<template<class> class Strategy>
+std::unique_ptr<kpm::Strategy> make_from(Hamiltonian const& h, kpm::Config const& config) {
+    return detail::MakeStrategy<kpm::Strategy, Strategy>(config)(h);
+}
+
+/// Define the factory function `name` which takes the `Source` (model or Hamiltonian)
+/// followed by all the `kpm::Config` parameters
+template<template<class> class Strategy, class Source>
+void def_kpm_factory(py::module& m, char const* name, char const* source_name) {
     auto const kpm_defaults = kpm::Config();
     m.def(
         name,
-        [](Model const& model, std::pair<float, float> energy,
-           kpm::Kernel const& kernel, int opt, float lanczos) {
+        [](Source const& source, std::pair<float, float> energy,
+           kpm::Kernel const& kernel, int opt, float lanczos, int num_threads,
+           bool mixed_precision, kpm::BoundsMethod bounds_method, bool cache_bounds,
+           int interleave_depth, bool split_complex, bool share_matrix, bool permute_only,
+           int block_size, bool symmetric_storage, bool bulk_boundary,
+           float convergence_tolerance, bool indexed_values, bool reduced_precision,
+           std::string const& matrix_file, bool pin_threads, bool recursion,
+           kpm::Termination termination) {
             kpm::Config config;
             config.min_energy = energy.first;
             config.max_energy = energy.second;
             config.kernel = kernel;
             config.opt_level = opt;
             config.lanczos_precision = lanczos;
+            config.num_threads = num_threads;
+            config.mixed_precision = mixed_precision;
+            config.bounds_method = bounds_method;
+            config.cache_bounds = cache_bounds;
+            config.interleave_depth = interleave_depth;
+            config.split_complex = split_complex;
+            config.share_matrix = share_matrix;
+            config.permute_only = permute_only;
+            config.block_size = block_size;
+            config.symmetric_storage = symmetric_storage;
+            config.bulk_boundary = bulk_boundary;
+            config.convergence_tolerance = convergence_tolerance;
+            config.indexed_values = indexed_values;
+            config.reduced_precision = reduced_precision;
+            config.matrix_file = matrix_file;
+            config.pin_threads = pin_threads;
+            config.recursion = recursion;
+            config.termination = termination;
 
-            return make_kpm<Strategy>(model, config);
+            return make_from<Strategy>(source, config);
         },
-        "model"_a,
+        py::arg(source_name),
         "energy_range"_a=py::make_tuple(kpm_defaults.min_energy, kpm_defaults.max_energy),
         "kernel"_a=kpm_defaults.kernel,
         "optimization_level"_a=kpm_defaults.opt_level,
-        "lanczos_precision"_a=kpm_defaults.lanczos_precision
+        "lanczos_precision"_a=kpm_defaults.lanczos_precision,
+        "num_threads"_a=kpm_defaults.num_threads,
+        "mixed_precision"_a=kpm_defaults.mixed_precision,
+        "bounds_method"_a=kpm_defaults.bounds_method,
+        "cache_bounds"_a=kpm_defaults.cache_bounds,
+        "interleave_depth"_a=kpm_defaults.interleave_depth,
+        "split_complex"_a=kpm_defaults.split_complex,
+        "share_matrix"_a=kpm_defaults.share_matrix,
+        "permute_only"_a=kpm_defaults.permute_only,
+        "block_size"_a=kpm_defaults.block_size,
+        "symmetric_storage"_a=kpm_defaults.symmetric_storage,
+        "bulk_boundary"_a=kpm_defaults.bulk_boundary,
+        "convergence_tolerance"_a=kpm_defaults.convergence_tolerance,
+        "indexed_values"_a=kpm_defaults.indexed_values,
+        "reduced_precision"_a=kpm_defaults.reduced_precision,
+        "matrix_file"_a=kpm_defaults.matrix_file,
+        "pin_threads"_a=kpm_defaults.pin_threads,
+        "recursion"_a=kpm_defaults.recursion,
+        "termination"_a=kpm_defaults.termination
     );
 }
 
+template<template<class> class Strategy>
+void wrap_kpm_strategy(py::module& m, char const* name, char const* strategy_name) {
+    def_kpm_factory<Strategy, Model>(m, name, "model");
+    def_kpm_factory<Strategy, Hamiltonian>(m, strategy_name, "hamiltonian");
+}
+
 // This will be a lot simpler with C++14 generic lambdas
 struct PyOptHam {
     using OptHamVariant = var::variant<kpm::OptimizedHamiltonian<float>,
@@ -81,22 +144,133 @@ struct PyOptHam {
 void wrap_greens(py::module& m) {
     py::class_<kpm::Stats>(m, "KPMStats")
         .def_readonly("num_moments", &kpm::Stats::num_moments)
+        .def_readonly("used_moments", &kpm::Stats::used_moments)
+        .def_readonly("streamed_bytes", &kpm::Stats::streamed_bytes)
+        .def_readonly("opt_level", &kpm::Stats::opt_level)
         .def_readonly("num_operations", &kpm::Stats::num_operations)
+        .def_readonly("num_bytes", &kpm::Stats::num_bytes)
         .def_readonly("matrix_memory", &kpm::Stats::matrix_memory)
         .def_readonly("vector_memory", &kpm::Stats::vector_memory)
+        .def_readonly("cache_hits", &kpm::Stats::cache_hits)
+        .def_readonly("cache_misses", &kpm::Stats::cache_misses)
         .def_property_readonly("ops", &kpm::Stats::ops)
+        .def_property_readonly("bandwidth", &kpm::Stats::bandwidth)
+        .def_property_readonly("intensity", &kpm::Stats::intensity)
+        .def_property_readonly("bytes_per_moment", &kpm::Stats::bytes_per_moment)
         .def_property_readonly("elapsed_seconds", [](kpm::Stats const& s) {
             return s.moments_timer.elapsed_seconds();
+        })
+        .def_property_readonly("timings", [](kpm::Stats const& s) {
+            return std::map<std::string, double>{
+                {"bounds", s.bounds_timer.elapsed_seconds()},
+                {"tune", s.tune_timer.elapsed_seconds()},
+                {"reorder", s.reorder_timer.elapsed_seconds()},
+                {"convert", s.convert_timer.elapsed_seconds()},
+                {"moments", s.moments_timer.elapsed_seconds()},
+                {"reconstruction", s.reconstruction_timer.elapsed_seconds()}
+            };
         });
 
     py::class_<kpm::Kernel>(m, "KPMKernel");
+
+    py::enum_<kpm::BoundsMethod>(m, "KPMBoundsMethod")
+        .value("lanczos", kpm::BoundsMethod::Lanczos)
+        .value("warm_lanczos", kpm::BoundsMethod::WarmLanczos)
+        .value("gershgorin", kpm::BoundsMethod::Gershgorin);
+
+    py::enum_<kpm::Termination>(m, "KPMTermination")
+        .value("truncate", kpm::Termination::Truncate)
+        .value("square_root", kpm::Termination::SquareRoot);
+
+    py::class_<kpm::RawMoments>(m, "KPMRawMoments")
+        .def_readonly("data", &kpm::RawMoments::data)
+        .def_readonly("a", &kpm::RawMoments::a)
+        .def_readonly("b", &kpm::RawMoments::b)
+        .def_property_readonly("is_resumable", &kpm::RawMoments::is_resumable)
+        .def("greens", [](kpm::RawMoments const& r, ArrayXd energy, double broadening,
+                          kpm::Kernel const& kernel) {
+            return r.greens(energy, broadening, kernel);
+        }, "energy"_a, "broadening"_a, "kernel"_a)
+        .def("ldos", [](kpm::RawMoments const& r, ArrayXd energy, double broadening,
+                        kpm::Kernel const& kernel) {
+            return r.ldos(energy, broadening, kernel);
+        }, "energy"_a, "broadening"_a, "kernel"_a)
+        .def("__getstate__", [](kpm::RawMoments const& r) {
+            return py::make_tuple(r.data, r.a, r.b, r.index, r.r0, r.r1);
+        })
+        .def("__setstate__", [](kpm::RawMoments& r, py::tuple t) {
+            new (&r) kpm::RawMoments(t[0].cast<ArrayXcd>(), t[1].cast<double>(),
+                                     t[2].cast<double>());
+            r.index = t[3].cast<int>();
+            r.r0 = t[4].cast<VectorXcd>();
+            r.r1 = t[5].cast<VectorXcd>();
+        });
+    m.def("kpm_read_results", [](std::string const& filename) {
+        auto const r = kpm::read_results(filename);
+        auto values = r.is_complex ? py::cast(r.values) : py::cast(ArrayXXd(r.values.real()));
+        return py::make_tuple(r.energy, r.indices, values);
+    });
+    auto const kpm_defaults = kpm::Config();
+    m.def("kpm_estimate_memory", [](MemoryEstimate const& model, int optimization_level,
+                                    bool split_complex, bool indexed_values,
+                                    bool reduced_precision) {
+        auto config = kpm::Config();
+        config.opt_level = optimization_level;
+        config.split_complex = split_complex;
+        config.indexed_values = indexed_values;
+        config.reduced_precision = reduced_precision;
+        auto const result = kpm::estimate_memory(model, config);
+        return py::make_tuple(result.matrix_bytes, result.vector_bytes);
+    }, "model"_a, "optimization_level"_a=kpm_defaults.opt_level,
+       "split_complex"_a=kpm_defaults.split_complex,
+       "indexed_values"_a=kpm_defaults.indexed_values,
+       "reduced_precision"_a=kpm_defaults.reduced_precision);
     m.def("lorentz_kernel", &kpm::lorentz_kernel);
     m.def("jackson_kernel", &kpm::jackson_kernel);
 
     py::class_<KPM>(m, "Greens")
         .def("calc_greens", &KPM::calc_greens)
         .def("calc_greens", &KPM::calc_greens_vector)
+        .def("calc_greens_block", &KPM::calc_greens_block, "rows"_a, "cols"_a, "energy"_a,
+             "broadening"_a)
         .def("calc_ldos", &KPM::calc_ldos)
+        .def("calc_ldos_vector", &KPM::calc_ldos_vector)
+        .def("stream_greens", [](KPM const& kpm, int row, std::vector<int> const& cols,
+                                 ArrayXd const& energy, double broadening,
+                                 std::string const& filename, int chunk_size) {
+            kpm::BinaryFileSink sink(filename, chunk_size);
+            kpm.calc_greens_stream(row, cols, energy, broadening, sink);
+        }, "row"_a, "cols"_a, "energy"_a, "broadening"_a, "filename"_a, "chunk_size"_a=64)
+        .def("stream_ldos", [](KPM const& kpm, std::vector<int> const& indices,
+                               ArrayXd const& energy, double broadening,
+                               std::string const& filename, int chunk_size) {
+            kpm::BinaryFileSink sink(filename, chunk_size);
+            kpm.calc_ldos_stream(indices, energy, broadening, sink);
+        }, "indices"_a, "energy"_a, "broadening"_a, "filename"_a, "chunk_size"_a=64)
+        .def("calc_spatial_ldos", &KPM::calc_spatial_ldos, "energy"_a, "broadening"_a,
+             "shape"_a)
+        .def("spatial_indices", &KPM::spatial_indices, "shape"_a)
+        .def("calc_dos", &KPM::calc_dos, "energy"_a, "broadening"_a, "num_random"_a=16)
+        .def("calc_sublattice_dos", &KPM::calc_sublattice_dos, "energy"_a, "broadening"_a,
+             "num_random"_a=16)
+        .def("calc_region_dos", &KPM::calc_region_dos, "energy"_a, "broadening"_a,
+             "regions"_a, "num_random"_a=16)
+        .def("calc_bond_currents", &KPM::calc_bond_currents, "energy"_a, "broadening"_a,
+             "shape"_a, "num_random"_a=16)
+        .def("calc_density", &KPM::calc_density, "chemical_potential"_a, "broadening"_a,
+             "temperature"_a=0, "num_random"_a=16, "probing_distance"_a=0)
+        .def("calc_spectral_function", &KPM::calc_spectral_function, "k_points"_a,
+             "energy"_a, "broadening"_a, "sublattice"_a="")
+        .def("calc_moments", &KPM::calc_moments, "row"_a, "cols"_a, "num_moments"_a)
+        .def("calc_resumable_moments", &KPM::calc_resumable_moments,
+             "index"_a, "num_moments"_a)
+        .def("extend_moments", &KPM::extend_moments, "index"_a, "previous"_a,
+             "num_moments"_a)
+        .def("calc_conductivity", &KPM::calc_conductivity, "direction_l"_a, "direction_r"_a,
+             "chemical_potential"_a, "broadening"_a, "temperature"_a=0, "num_random"_a=1,
+             "num_points"_a=1000)
+        .def("calc_time_evolution", &KPM::calc_time_evolution, "state"_a, "time_step"_a,
+             "num_steps"_a=1)
         .def("deferred_ldos", [](py::object self, ArrayXd energy, double broadening,
                                  Cartesian position, std::string sublattice) {
             auto& kpm = self.cast<KPM&>();
@@ -104,15 +278,172 @@ void wrap_greens(py::module& m) {
                 self, [=, &kpm] { return kpm.calc_ldos(energy, broadening, position, sublattice); }
             };
         })
+        .def("deferred_ldos_vector", [](py::object self, std::vector<int> indices,
+                                        ArrayXd energy, double broadening) {
+            auto& kpm = self.cast<KPM&>();
+            return Deferred<ArrayXXd>{
+                self, [=, &kpm] { return kpm.calc_ldos_vector(indices, energy, broadening); }
+            };
+        })
+        .def("deferred_greens", [](py::object self, int row, int col, ArrayXd energy,
+                                   double broadening) {
+            auto& kpm = self.cast<KPM&>();
+            return Deferred<ArrayXcd>{
+                self, [=, &kpm] { return kpm.calc_greens(row, col, energy, broadening); }
+            };
+        })
+        .def("deferred_greens", [](py::object self, int row, std::vector<int> cols,
+                                   ArrayXd energy, double broadening) {
+            auto& kpm = self.cast<KPM&>();
+            return Deferred<std::vector<ArrayXcd>>{
+                self, [=, &kpm] { return kpm.calc_greens_vector(row, cols, energy, broadening); }
+            };
+        })
+        .def("deferred_dos", [](py::object self, ArrayXd energy, double broadening,
+                                int num_random) {
+            auto& kpm = self.cast<KPM&>();
+            return Deferred<ArrayXd>{
+                self, [=, &kpm] { return kpm.calc_dos(energy, broadening, num_random); }
+            };
+        }, "energy"_a, "broadening"_a, "num_random"_a=16)
         .def("report", &KPM::report, "shortform"_a=false)
         .def_property("model", &KPM::get_model, &KPM::set_model)
         .def_property_readonly("system", &KPM::system)
+        .def_property("use_symmetry", &KPM::get_symmetry, &KPM::set_symmetry)
+        .def_property("damping", &KPM::get_damping, &KPM::set_damping)
+        .def("set_absorbing_boundary", &KPM::set_absorbing_boundary, "interior"_a, "width"_a,
+             "strength"_a=0.1f)
+        .def("set_lead_absorbing_boundary", &KPM::set_lead_absorbing_boundary, "width"_a,
+             "strength"_a=0.1f)
+        .def_property_readonly("symmetry_order", [](KPM const& kpm) {
+            return kpm.point_symmetry().group_order();
+        })
         .def_property_readonly("stats", &KPM::get_stats);
 
-    wrap_kpm_strategy<kpm::DefaultStrategy>(m, "KPM");
+    py::class_<kpm::Strategy>(m, "GreensStrategy")
+        .def("change_hamiltonian", &kpm::Strategy::change_hamiltonian, "hamiltonian"_a,
+             "diagonal_only"_a=false)
+        .def("ldos", &kpm::Strategy::ldos, "index"_a, "energy"_a, "broadening"_a)
+        .def("ldos_vector", &kpm::Strategy::ldos_vector, "indices"_a, "energy"_a,
+             "broadening"_a)
+        .def("dos", &kpm::Strategy::dos, "energy"_a, "broadening"_a, "num_random"_a=16)
+        .def("greens", &kpm::Strategy::greens, "row"_a, "col"_a, "energy"_a, "broadening"_a)
+        .def("greens_vector", &kpm::Strategy::greens_vector, "row"_a, "cols"_a, "energy"_a,
+             "broadening"_a)
+        .def("report", &kpm::Strategy::report, "shortform"_a=false)
+        .def_property_readonly("stats", &kpm::Strategy::get_stats);
+
+    wrap_kpm_strategy<kpm::DefaultStrategy>(m, "KPM", "KPMStrategy");
+
+    // The realizations run on worker threads without the GIL: the Python function which
+    // generates the disorder acquires it only for its own call
+    py::class_<DisorderEnsemble>(m, "DisorderEnsemble")
+        .def("ldos_moments", [](DisorderEnsemble const& self, std::vector<int> const& indices,
+                                int num_moments, int num_realizations) {
+            py::gil_scoped_release gil_release;
+            return self.ldos_moments(indices, num_moments, num_realizations);
+        }, "indices"_a, "num_moments"_a, "num_realizations"_a)
+        .def("dos_moments", [](DisorderEnsemble const& self, int num_moments,
+                               int num_realizations, int num_random) {
+            py::gil_scoped_release gil_release;
+            return self.dos_moments(num_moments, num_realizations, num_random);
+        }, "num_moments"_a, "num_realizations"_a, "num_random"_a=1)
+        .def("calc_ldos", [](DisorderEnsemble const& self, std::vector<int> const& indices,
+                             ArrayXd const& energy, double broadening, int num_realizations) {
+            py::gil_scoped_release gil_release;
+            return self.calc_ldos(indices, energy, broadening, num_realizations);
+        }, "indices"_a, "energy"_a, "broadening"_a, "num_realizations"_a)
+        .def("calc_dos", [](DisorderEnsemble const& self, ArrayXd const& energy,
+                            double broadening, int num_realizations, int num_random) {
+            py::gil_scoped_release gil_release;
+            return self.calc_dos(energy, broadening, num_realizations, num_random);
+        }, "energy"_a, "broadening"_a, "num_realizations"_a, "num_random"_a=1)
+        .def_property_readonly("energy_range", &DisorderEnsemble::energy_range);
+
+    m.def("disorder_ensemble", [](Model const& model, py::object realization,
+                                  std::pair<double, double> disorder_range,
+                                  kpm::Kernel const& kernel, int opt, float lanczos,
+                                  kpm::BoundsMethod bounds_method, int num_threads) {
+        kpm::Config config;
+        config.kernel = kernel;
+        config.opt_level = opt;
+        config.lanczos_precision = lanczos;
+        config.bounds_method = bounds_method;
+
+        auto const generate = [realization](int n) {
+            py::gil_scoped_acquire guard;
+            return realization(n).cast<ArrayXd>();
+        };
+        return make_disorder_ensemble(model, generate, disorder_range.first,
+                                      disorder_range.second, config, num_threads);
+    }, "model"_a, "realization"_a, "disorder_range"_a, "kernel"_a, "optimization_level"_a,
+       "lanczos_precision"_a, "bounds_method"_a, "num_threads"_a);
+
+    py::enum_<scf::Mixing>(m, "SCFMixing")
+        .value("linear", scf::Mixing::Linear)
+        .value("anderson", scf::Mixing::Anderson)
+        .value("broyden", scf::Mixing::Broyden);
+
+    // All the iterations of `run` are done without the GIL
+    py::class_<SelfConsistentLoop>(m, "SelfConsistentLoop")
+        .def("run", [](SelfConsistentLoop& self, ArrayXd const& initial) {
+            py::gil_scoped_release gil_release;
+            return self.run(initial);
+        }, "initial"_a)
+        .def_property_readonly("potential", &SelfConsistentLoop::get_potential)
+        .def_property_readonly("density", &SelfConsistentLoop::get_density)
+        .def_property_readonly("residuals", &SelfConsistentLoop::get_residuals)
+        .def_property_readonly("num_iterations", &SelfConsistentLoop::num_iterations)
+        .def_property_readonly("converged", &SelfConsistentLoop::converged)
+        .def_property_readonly("energy_range", &SelfConsistentLoop::energy_range);
+
+    m.def("self_consistent_loop", [](Model const& model, double chemical_potential,
+                                     double broadening, double temperature, int num_random,
+                                     int probing_distance, py::object indptr,
+                                     py::object indices, py::object data, ArrayXd background,
+                                     scf::Mixing mixing, double mixing_parameter, int history,
+                                     double tolerance, int max_iterations,
+                                     kpm::Kernel const& kernel, int opt, float lanczos,
+                                     kpm::BoundsMethod bounds_method) {
+        // The coupling is a square CSR matrix with one row per Hamiltonian row
+        auto const p = py::array_t<int>(indptr);
+        auto const i = py::array_t<int>(indices);
+        auto const d = py::array_t<double>(data);
+        auto const size = static_cast<int>(p.size()) - 1;
+        if (size < 0 || i.size() != d.size()) {
+            throw std::runtime_error("self_consistent_loop(): inconsistent CSR array sizes");
+        }
+        auto coupling = sparse::from_csr(num::CsrConstRef<double>(
+            size, size, static_cast<int>(d.size()), d.data(), i.data(), p.data()
+        ));
+
+        kpm::Config kpm_config;
+        kpm_config.kernel = kernel;
+        kpm_config.opt_level = opt;
+        kpm_config.lanczos_precision = lanczos;
+        kpm_config.bounds_method = bounds_method;
+
+        scf::Config config;
+        config.mixing = mixing;
+        config.mixing_parameter = mixing_parameter;
+        config.history = history;
+        config.tolerance = tolerance;
+        config.max_iterations = max_iterations;
+
+        return make_self_consistent_loop(
+            model, scf::fermi_density(chemical_potential, broadening, temperature, num_random,
+                                      probing_distance),
+            scf::linear_potential(std::move(coupling), std::move(background)),
+            kpm_config, config
+        );
+    }, "model"_a, "chemical_potential"_a, "broadening"_a, "temperature"_a, "num_random"_a,
+       "probing_distance"_a, "indptr"_a, "indices"_a, "data"_a, "background"_a, "mixing"_a,
+       "mixing_parameter"_a, "history"_a, "tolerance"_a, "max_iterations"_a, "kernel"_a,
+       "optimization_level"_a, "lanczos_precision"_a, "bounds_method"_a);
 
 #ifdef CPB_USE_CUDA
-    wrap_kpm_strategy<kpm::CudaStrategy>(m, "KPMcuda");
+    wrap_kpm_strategy<kpm::CudaStrategy>(m, "KPMcuda", "KPMcudaStrategy");
+    wrap_kpm_strategy<kpm::MultiGpuStrategy>(m, "KPMmultigpu", "KPMmultigpuStrategy");
 #endif
 
     py::class_<PyOptHam>(m, "OptimizedHamiltonian")
@@ -1,4 +1,5 @@
 #include "leads/Leads.hpp"
+#include "leads/SelfEnergy.hpp"
 #include "wrappers.hpp"
 using namespace cpb;
 
@@ -17,6 +18,18 @@ void wrap_leads(py::module& m) {
         .def_property_readonly("h1", [](Lead const& l) { return l.h1().csrref(); })
     ;
 
+    using SelfEnergy = leads::SelfEnergy<double>;
+    py::class_<SelfEnergy>(m, "LeadSelfEnergy")
+        .def(py::init<Lead const&, double, double, int>(), "lead"_a, "broadening"_a=1e-6,
+             "tolerance"_a=0, "max_iterations"_a=100)
+        .def_property_readonly("size", &SelfEnergy::size)
+        .def("calc", [](SelfEnergy const& s, ArrayXd const& energies, int num_threads) {
+            return s.calc(energies, num_threads);
+        }, "energies"_a, "num_threads"_a=1)
+        .def("surface_greens", &SelfEnergy::surface_greens, "energy"_a)
+        .def("clear_cache", &SelfEnergy::clear_cache)
+    ;
+
     py::class_<Leads>(m, "Leads")
         .def("__len__", &Leads::size)
         .def("__getitem__", &Leads::operator[])
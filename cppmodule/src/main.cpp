@@ -1,5 +1,6 @@
 #include "wrappers.hpp"
 #include "support/simd.hpp"
+#include "utils/Trace.hpp"
 #ifdef CPB_USE_MKL
 # include <mkl.h>
 #endif
@@ -34,6 +35,18 @@ PYBIND11_PLUGIN(_pybinding) {
 #endif
     });
 
+    m.def("trace_enable", &trace::enable, "on"_a=true,
+          "Start or stop recording the build and calculation stages");
+    m.def("trace_clear", &trace::clear);
+    m.def("trace_events", []() {
+        auto result = std::vector<std::tuple<std::string, std::int64_t, std::int64_t, int, int>>();
+        for (auto const& e : trace::events()) {
+            result.emplace_back(e.name, e.start, e.duration, e.thread, e.depth);
+        }
+        return result;
+    });
+    m.def("trace_chrome_json", &trace::to_chrome_json);
+
 #ifdef CPB_USE_MKL
     m.def("get_max_threads", MKL_Get_Max_Threads,
           "Get the maximum number of MKL threads. (<= logical theads)");
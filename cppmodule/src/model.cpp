@@ -2,9 +2,39 @@
 #include "wrappers.hpp"
 using namespace cpb;
 
+namespace {
+
+/// The arrays are expected to be contiguous with 32-bit indices: see `Hamiltonian.from_csr`
+template<class scalar_t>
+Hamiltonian csr_hamiltonian(py::object indptr, py::object indices, py::object data,
+                            int rows, int cols) {
+    auto const p = py::array_t<int>(indptr);
+    auto const i = py::array_t<int>(indices);
+    auto const d = py::array_t<scalar_t>(data);
+    if (p.size() != static_cast<std::size_t>(rows) + 1 || i.size() != d.size()) {
+        throw std::runtime_error("Hamiltonian.from_csr(): inconsistent CSR array sizes");
+    }
+    auto const nnz = static_cast<int>(d.size());
+    return ham::from_csr(num::CsrConstRef<scalar_t>(rows, cols, nnz, d.data(), i.data(),
+                                                    p.data()));
+}
+
+/// Calls the Python `tag` function each time the model is built, see `Model::set_cache()`.
+/// The model may be built on a thread which doesn't hold the GIL.
+Model::CacheTag make_cache_tag(py::object tag) {
+    return [tag]() {
+        py::gil_scoped_acquire guard;
+        return tag().cast<std::string>();
+    };
+}
+
+} // anonymous namespace
+
 void wrap_model(py::module& m) {
     py::class_<Model>(m, "Model")
         .def(py::init<Lattice const&>())
+        .def(py::init<Model const&>(), "other"_a, "Copy which shares the built system")
+        .def("derive", &Model::derive)
         .def("add", &Model::add | resolve<Primitive>())
         .def("add", &Model::add | resolve<Shape const&>())
         .def("add", &Model::add | resolve<TranslationalSymmetry const&>())
@@ -22,16 +52,235 @@ void wrap_model(py::module& m) {
             k : array_like
                 Wave vector in reciprocal space.
         )")
+        .def("set_num_threads", &Model::set_num_threads, "n"_a, R"(
+            Set the number of threads used to build the system
+
+            The sites of the lattice foundation are split into contiguous blocks which
+            are processed in parallel. The result does not depend on the number of threads.
+
+            Parameters
+            ----------
+            n : int
+                Number of threads.
+        )")
+        .def("set_onsite_chunk_size", &Model::set_onsite_chunk_size, "n"_a, R"(
+            Apply the onsite modifiers to chunks of `n` sites at a time
+
+            By default, each onsite modifier is called once with the arrays of all the
+            sites. For very large systems, chunks limit the memory of the temporary arrays
+            created by (Python) modifier functions. Modifiers which depend on the whole
+            system, e.g. random disorder with a fixed seed, see each chunk separately.
+
+            Parameters
+            ----------
+            n : int
+                Number of sites per call, 0 means all of them.
+        )")
+        .def("set_tile_size", &Model::set_tile_size, "n"_a, R"(
+            Build the foundation in tiles and only keep the ones which intersect the shape
+
+            This reduces the memory required to build sparse shapes (e.g. a thin ring)
+            which only fill a small part of their bounding box. The order of the sites
+            follows the tiles. Tiling is not used for models with leads.
+
+            Parameters
+            ----------
+            n : int
+                Number of unit cells along each lattice vector in a tile, 0 disables tiling.
+        )")
+        .def("set_site_order", &Model::set_site_order, "order"_a, R"(
+            Renumber the sites of the system for better memory locality
+
+            Parameters
+            ----------
+            order : SiteOrder
+                The default `foundation` order is sublattice-major. `unit_cell` keeps
+                the sites of each unit cell together, `rcm` minimizes the bandwidth of
+                the Hamiltonian and `morton` follows a space-filling curve.
+        )")
+        .def("set_compact_positions", &Model::set_compact_positions, "enabled"_a, R"(
+            Store the site positions as unit cell and sublattice indices
+
+            The positions of a perfect crystal follow from the lattice, so a single 32-bit
+            index per site replaces the three coordinates. They are recomputed whenever
+            they are needed, e.g. for the modifiers. Ignored for models with position
+            modifiers.
+
+            Parameters
+            ----------
+            enabled : bool
+        )")
+        .def("set_keep_topology", &Model::set_keep_topology, "enabled"_a, R"(
+            Keep the sites and hoppings when the position modifiers change
+
+            Position modifiers (e.g. strain) move the sites without changing which of them
+            are connected. With this enabled, changing them only recomputes the positions
+            and the Hamiltonian values, without building the system again. This is intended
+            for strain sweeps: see :meth:`clear_position_modifiers`. A copy of the unmodified
+            positions is kept for this. The position modifiers see the sites of the system
+            (in its order) instead of the foundation. Ignored for models with hopping
+            generators, leads or the `morton` site order since they depend on the positions.
+
+            Parameters
+            ----------
+            enabled : bool
+        )")
+        .def("set_cache", [](Model& self, std::string const& directory, std::string const& tag) {
+            self.set_cache(directory, tag);
+        }, "directory"_a, "tag"_a="", R"(
+            Keep the built system and Hamiltonian in a binary file in `directory`
+
+            The file is named after a hash of the lattice, shape, symmetry and modifier
+            parameters. A model with the same parameters reads the file instead of
+            building anything. Modifier and shape functions are not visible here:
+            `tag` must identify them, otherwise a model with such functions is not
+            cached. An empty `directory` disables the cache.
+
+            Parameters
+            ----------
+            directory : str
+                Existing directory where the cache files are kept.
+            tag : str or callable
+                Identifies the modifier and shape functions. A function is called each
+                time the model is built and it returns the tag.
+        )")
+        .def("set_cache", [](Model& self, std::string const& directory, py::object tag) {
+            self.set_cache(directory, make_cache_tag(tag));
+        }, "directory"_a, "tag"_a)
+        .def_property_readonly("cache_filename", &Model::cache_filename)
+        .def_property_readonly("cache_error", &Model::get_cache_error,
+                               "Why the last cache file could not be saved, empty if it was")
+        .def("set_memory_cache", [](Model& self, bool enabled, std::string const& tag) {
+            self.set_memory_cache(enabled, tag);
+        }, "enabled"_a=true, "tag"_a="", R"(
+            Share the built system and Hamiltonian with the other models of the process
+
+            Models with the same parameters hash and `tag` (see :meth:`set_cache`) build
+            them only once and share them, e.g. the jobs of a parallel sweep which repeat
+            the same parameters. The least recently used entries are dropped once they take
+            more memory than the capacity, see :meth:`set_memory_cache_capacity`.
+
+            Parameters
+            ----------
+            enabled : bool
+            tag : str or callable
+                Identifies the modifier and shape functions.
+        )")
+        .def("set_memory_cache", [](Model& self, bool enabled, py::object tag) {
+            self.set_memory_cache(enabled, make_cache_tag(tag));
+        }, "enabled"_a, "tag"_a)
+        .def_property_readonly("memory_cache", &Model::get_memory_cache)
+        .def_static("memory_cache_stats", []() {
+            auto const s = cache::MemoryCache::instance().stats();
+            return std::map<std::string, std::size_t>{
+                {"hits", s.hits}, {"misses", s.misses}, {"evictions", s.evictions},
+                {"num_entries", s.num_entries}, {"memory", s.memory}, {"capacity", s.capacity}
+            };
+        }, "Hits, misses, evictions, entries and memory (bytes) of the memory cache")
+        .def_static("set_memory_cache_capacity", [](std::size_t bytes) {
+            cache::MemoryCache::instance().set_capacity(bytes);
+        }, "bytes"_a, "Maximum memory of the memory cache entries, 0 disables it")
+        .def_static("clear_memory_cache", []() { cache::MemoryCache::instance().clear(); },
+                    "Remove all the memory cache entries and reset the stats")
+        .def("set_memory_budget", &Model::set_memory_budget, "bytes"_a, R"(
+            Check the estimated memory against a budget before building the system
+
+            See :meth:`estimate_memory`. If the estimate exceeds the budget, foundation
+            tiling and compact positions are switched on, as far as the model allows.
+            If it still doesn't fit, building the system fails right away instead of
+            running out of memory halfway through.
+
+            Parameters
+            ----------
+            bytes : int
+                Memory budget in bytes, 0 disables the check.
+        )")
+        .def("estimate_memory", &Model::estimate_memory, R"(
+            Estimate the memory needed to build the system and Hamiltonian
+
+            Nothing is built: the size of the foundation follows from the bounding box
+            of the shape and the number of sites from a coarse sample of the shape.
+            Hopping generators, leads and the removal of dangling sites are ignored.
+
+            Returns
+            -------
+            MemoryEstimate
+        )")
+        .def("clear_onsite_modifiers", &Model::clear_onsite_modifiers, R"(
+            Remove all onsite modifiers
+
+            An already built Hamiltonian is not rebuilt from scratch after the onsite
+            modifiers change: only the diagonal is updated. This makes sweeps over the
+            onsite energy (e.g. gate voltage) cheaper.
+        )")
+        .def("clear_position_modifiers", &Model::clear_position_modifiers, R"(
+            Remove all position modifiers
+
+            With :meth:`set_keep_topology`, an already built system keeps its sites and
+            hoppings: only the positions are updated when new position modifiers are added.
+        )")
+        .def("remove_sites", &Model::remove_sites, "indices"_a, "min_neighbors"_a=0, R"(
+            Remove sites from the built system and Hamiltonian without building them again
+
+            The rows and columns of the removed sites are cut out of the existing sparse
+            matrices and the remaining sites are renumbered. Nothing else is rebuilt and
+            the modifiers are not applied again, so this is much cheaper than adding a
+            site state modifier when defects are added one at a time to a large system.
+
+            This is not a model parameter: a structural change (shape, modifiers, ...)
+            builds the system again without the removal. The cache is disabled afterwards.
+            Not available for models with leads.
+
+            Parameters
+            ----------
+            indices : array_like
+                Indices of the sites to remove.
+            min_neighbors : int
+                Also remove the neighbors which are left with fewer than this many
+                hoppings, repeatedly, as the `min_neighbors` of a site state modifier.
+
+            Returns
+            -------
+            np.ndarray
+                The new index of each previous site, -1 for the removed ones.
+        )")
         .def_property_readonly("system", &Model::system)
         .def_property_readonly("raw_hamiltonian", &Model::hamiltonian)
         .def_property_readonly("hamiltonian", [](Model const& self) {
             return self.hamiltonian().csrref();
         })
+        .def("hamiltonian_rows", &Model::hamiltonian_rows, "start"_a, "end"_a)
         .def_property_readonly("leads", &Model::leads)
         .def("report", &Model::report, "Return a string with information about the last build")
         .def_property_readonly("system_build_seconds", &Model::system_build_seconds)
         .def_property_readonly("hamiltonian_build_seconds", &Model::hamiltonian_build_seconds);
 
+    py::class_<MemoryEstimate>(m, "MemoryEstimate")
+        .def_readonly("box_sites", &MemoryEstimate::box_sites)
+        .def_readonly("foundation_sites", &MemoryEstimate::foundation_sites)
+        .def_readonly("num_sites", &MemoryEstimate::num_sites)
+        .def_readonly("hamiltonian_nnz", &MemoryEstimate::hamiltonian_nnz)
+        .def_readonly("max_nnz_per_row", &MemoryEstimate::max_nnz_per_row)
+        .def_readonly("scalar_bytes", &MemoryEstimate::scalar_bytes)
+        .def_readonly("foundation_bytes", &MemoryEstimate::foundation_bytes)
+        .def_readonly("system_bytes", &MemoryEstimate::system_bytes)
+        .def_readonly("hamiltonian_bytes", &MemoryEstimate::hamiltonian_bytes)
+        .def_property_readonly("peak_bytes", &MemoryEstimate::peak_bytes)
+        .def("report", &MemoryEstimate::report)
+        .def("__repr__", &MemoryEstimate::report);
+
     py::class_<Hamiltonian>(m, "Hamiltonian")
-        .def_property_readonly("csrref", &Hamiltonian::csrref);
+        .def_property_readonly("csrref", &Hamiltonian::csrref)
+        .def_static("from_csr", [](py::object indptr, py::object indices, py::object data,
+                                   int rows, int cols, char dtype) {
+            switch (dtype) {
+                case 'f': return csr_hamiltonian<float>(indptr, indices, data, rows, cols);
+                case 'd': return csr_hamiltonian<double>(indptr, indices, data, rows, cols);
+                case 'F': return csr_hamiltonian<std::complex<float>>(indptr, indices, data,
+                                                                      rows, cols);
+                case 'D': return csr_hamiltonian<std::complex<double>>(indptr, indices, data,
+                                                                       rows, cols);
+                default: throw std::runtime_error("Hamiltonian.from_csr(): unknown dtype");
+            }
+        }, "indptr"_a, "indices"_a, "data"_a, "rows"_a, "cols"_a, "dtype"_a);
 }
@@ -1,6 +1,7 @@
 #include "system/SystemModifiers.hpp"
 #include "system/Generators.hpp"
 #include "hamiltonian/HamiltonianModifiers.hpp"
+#include "hamiltonian/BuiltinModifiers.hpp"
 #include "wrappers.hpp"
 using namespace cpb;
 
@@ -33,6 +34,31 @@ inline void extract_array(EigenType& v, py::object const& o) {
     ExtractArray{o}(Eigen::Map<EigenType>(v.data(), v.size()));
 }
 
+/// Calls `apply` and holds a reference to the Python object which owns the native function,
+/// e.g. a numba `cfunc`, so the function can't be freed while the modifier is in use. The
+/// modifiers are copied and destroyed without the GIL: only the last reference takes it.
+template<class Function>
+struct KeepAlive {
+    Function apply;
+    std::shared_ptr<py::object> owner;
+
+    template<class... Args>
+    void operator()(Args&&... args) const { apply(std::forward<Args>(args)...); }
+};
+
+template<class Modifier>
+Modifier keep_alive(Modifier modifier, py::object owner) {
+    auto const shared_owner = std::shared_ptr<py::object>(
+        new py::object(std::move(owner)), [](py::object* p) {
+            py::gil_scoped_acquire guard;
+            delete p;
+        }
+    );
+    using Function = typename Modifier::Function;
+    modifier.apply = KeepAlive<Function>{modifier.apply, shared_owner};
+    return modifier;
+}
+
 } // anonymous namespace
 
 void wrap_modifiers(py::module& m) {
@@ -44,10 +70,13 @@ void wrap_modifiers(py::module& m) {
         .def_property_readonly("ids", [](HopIdRef const& s) { return arrayref(s.ids); })
         .def_property_readonly("name_map", [](HopIdRef const& s) { return s.name_map; });
 
+    // The functions below may be called from threads which don't hold the GIL, e.g. when
+    // a Deferred job builds its model on one of the `parallel_for` worker threads
     py::class_<SiteStateModifier>(m, "SiteStateModifier")
         .def("__init__", [](SiteStateModifier& self, py::object apply, int min_neighbors) {
             new (&self) SiteStateModifier(
                 [apply](ArrayX<bool>& state, CartesianArray const& p, SubIdRef sub) {
+                    py::gil_scoped_acquire guard;
                     auto result = apply(arrayref(state), arrayref(p.x),
                                         arrayref(p.y), arrayref(p.z), sub);
                     extract_array(state, result);
@@ -59,6 +88,7 @@ void wrap_modifiers(py::module& m) {
     py::class_<PositionModifier>(m, "PositionModifier")
         .def("__init__", [](PositionModifier& self, py::object apply) {
             new (&self) PositionModifier([apply](CartesianArray& p, SubIdRef sub) {
+                py::gil_scoped_acquire guard;
                 auto t = py::tuple(apply(arrayref(p.x), arrayref(p.y), arrayref(p.z), sub));
                 extract_array(p.x, t[0]);
                 extract_array(p.y, t[1]);
@@ -72,6 +102,7 @@ void wrap_modifiers(py::module& m) {
             new (&self) HoppingGenerator(
                 name, energy,
                 [make](CartesianArray const& p, SubIdRef sub) {
+                    py::gil_scoped_acquire guard;
                     auto t = py::tuple(make(arrayref(p.x), arrayref(p.y), arrayref(p.z), sub));
                     return HoppingGenerator::Result{t[0].cast<ArrayXi>(), t[1].cast<ArrayXi>()};
                 }
@@ -83,6 +114,7 @@ void wrap_modifiers(py::module& m) {
                             bool is_complex, bool is_double) {
             new (&self) OnsiteModifier(
                 [apply](ComplexArrayRef energy, CartesianArray const& p, SubIdRef sub) {
+                    py::gil_scoped_acquire guard;
                     auto result = apply(energy, arrayref(p.x), arrayref(p.y), arrayref(p.z), sub);
                     num::match<ArrayX>(energy, ExtractArray{result});
                 },
@@ -90,7 +122,9 @@ void wrap_modifiers(py::module& m) {
             );
         }, "apply"_a, "is_complex"_a=false, "is_double"_a=false)
         .def_readwrite("is_complex", &OnsiteModifier::is_complex)
-        .def_readwrite("is_double", &OnsiteModifier::is_double);
+        .def_readwrite("is_double", &OnsiteModifier::is_double)
+        .def_readonly("is_thread_safe", &OnsiteModifier::is_thread_safe)
+        .def_readonly("fingerprint", &OnsiteModifier::fingerprint);
 
     py::class_<HoppingModifier>(m, "HoppingModifier")
         .def("__init__", [](HoppingModifier& self, py::object apply,
@@ -98,6 +132,7 @@ void wrap_modifiers(py::module& m) {
             new (&self) HoppingModifier(
                 [apply](ComplexArrayRef energy, CartesianArray const& p1,
                         CartesianArray const& p2, HopIdRef hopping) {
+                    py::gil_scoped_acquire guard;
                     auto result = apply(energy, arrayref(p1.x), arrayref(p1.y), arrayref(p1.z),
                                         arrayref(p2.x), arrayref(p2.y), arrayref(p2.z), hopping);
                     num::match<ArrayX>(energy, ExtractArray{result});
@@ -106,5 +141,31 @@ void wrap_modifiers(py::module& m) {
             );
         }, "apply"_a, "is_complex"_a=false, "is_double"_a=false)
         .def_readwrite("is_complex", &HoppingModifier::is_complex)
-        .def_readwrite("is_double", &HoppingModifier::is_double);
+        .def_readwrite("is_double", &HoppingModifier::is_double)
+        .def_readonly("is_thread_safe", &HoppingModifier::is_thread_safe)
+        .def_readonly("fingerprint", &HoppingModifier::fingerprint);
+
+    auto sub = m.def_submodule("builtin", "Compiled modifiers: no Python callbacks");
+    sub.def("constant_magnetic_field", &builtin::constant_magnetic_field, "magnitude"_a,
+            "Constant magnetic field in the z-direction [T], applied as a Peierls phase");
+    sub.def("linear_electric_field", &builtin::linear_electric_field, "field"_a,
+            "Uniform electric field [V/nm] which shifts the onsite energy by `field.dot(r)`");
+    sub.def("strained_hopping", &builtin::strained_hopping, "beta"_a, "bond_length"_a,
+            "Bond length dependent hopping: t = t0 * exp(-beta * (l / bond_length - 1))");
+    sub.def("onsite_disorder", &builtin::onsite_disorder, "width"_a, "seed"_a=0,
+            "Random onsite energy, uniformly distributed in [-width/2, width/2]");
+    sub.def("native_onsite", [](std::uintptr_t address, bool is_complex, bool is_double,
+                                py::object owner) {
+        auto const function = reinterpret_cast<builtin::NativeOnsiteFunction>(address);
+        return keep_alive(builtin::native_onsite(function, is_complex, is_double), owner);
+    }, "address"_a, "is_complex"_a=false, "is_double"_a=false, "owner"_a=py::none(),
+       "Onsite modifier which calls the C function at `address` without the GIL. "
+       "The `owner` of the function is kept alive as long as the modifier.");
+    sub.def("native_hopping", [](std::uintptr_t address, bool is_complex, bool is_double,
+                                 py::object owner) {
+        auto const function = reinterpret_cast<builtin::NativeHoppingFunction>(address);
+        return keep_alive(builtin::native_hopping(function, is_complex, is_double), owner);
+    }, "address"_a, "is_complex"_a=false, "is_double"_a=false, "owner"_a=py::none(),
+       "Hopping modifier which calls the C function at `address` without the GIL. "
+       "The `owner` of the function is kept alive as long as the modifier.");
 }
@@ -1,7 +1,72 @@
 #include "wrappers.hpp"
 #include "thread.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
 using namespace cpb;
 
+namespace {
+
+/**
+ Append-only file of retired results which allows an interrupted sweep to be resumed
+
+ The header is an 8-byte magic string followed by the int64 version, the int64 size of
+ the sequence and an int64 `key` which identifies the loop (a hash of the sequence and
+ the call which made it, see `parallel.py`). The reader refuses to resume a different loop.
+ Each record is the int64 job index, the int64 number of values and the float64 values.
+ A record which was cut short by the interruption is truncated away by the reader before
+ the file is reopened.
+ */
+class CheckpointFile {
+public:
+    CheckpointFile(std::string const& filename, std::size_t size, std::int64_t key) {
+        if (filename.empty()) {
+            return;
+        }
+
+        file.open(filename, std::ios::binary | std::ios::app);
+        if (file && file.tellp() == 0) {
+            constexpr char magic[8] = {'P', 'B', 'C', 'H', 'K', 'P', 'N', 'T'};
+            auto const header = std::array<std::int64_t, 3>{{
+                std::int64_t{2}, static_cast<std::int64_t>(size), key
+            }};
+            file.write(magic, sizeof(magic));
+            write(header.data(), header.size());
+        }
+        if (!file) {
+            throw std::runtime_error("Could not write the checkpoint file: " + filename);
+        }
+    }
+
+    bool is_open() const { return file.is_open(); }
+
+    void write(std::size_t index, Eigen::ArrayXd const& result) {
+        auto const header = std::array<std::int64_t, 2>{{static_cast<std::int64_t>(index),
+                                                        result.size()}};
+        write(header.data(), header.size());
+        write(result.data(), static_cast<std::size_t>(result.size()));
+    }
+
+    /// The records are complete once this returns, should the process be killed later
+    void flush() { file.flush(); }
+
+    bool is_good() const { return static_cast<bool>(file); }
+
+private:
+    template<class T>
+    void write(T const* data, std::size_t count) {
+        file.write(reinterpret_cast<char const*>(data),
+                   static_cast<std::streamsize>(count * sizeof(T)));
+    }
+
+private:
+    std::ofstream file;
+};
+
+} // anonymous namespace
+
 void wrap_parallel(py::module& m) {
     py::class_<DeferredBase, std::shared_ptr<DeferredBase>>(m, "DeferredBase", py::dynamic_attr())
         .def("compute", &DeferredBase::compute)
@@ -10,35 +75,144 @@ void wrap_parallel(py::module& m) {
 
     using DeferredXd = Deferred<Eigen::ArrayXd>;
     py::class_<DeferredXd, std::shared_ptr<DeferredXd>, DeferredBase>(m, "DeferredXd");
+    using DeferredXcd = Deferred<Eigen::ArrayXcd>;
+    py::class_<DeferredXcd, std::shared_ptr<DeferredXcd>, DeferredBase>(m, "DeferredXcd");
+    using DeferredXXd = Deferred<Eigen::ArrayXXd>;
+    py::class_<DeferredXXd, std::shared_ptr<DeferredXXd>, DeferredBase>(m, "DeferredXXd");
+    using DeferredVectorXcd = Deferred<std::vector<Eigen::ArrayXcd>>;
+    py::class_<DeferredVectorXcd, std::shared_ptr<DeferredVectorXcd>, DeferredBase>(
+        m, "DeferredVectorXcd");
 
     m.def("parallel_for", [](py::object sequence, py::object produce, py::object retire,
-                             std::size_t num_threads, std::size_t queue_size) {
+                             std::size_t num_threads, std::size_t queue_size,
+                             std::vector<double> const& costs, bool pin_threads,
+                             std::string const& checkpoint_file, std::int64_t checkpoint_key,
+                             std::vector<std::size_t> const& skip) -> py::object {
         auto const size = py::len(sequence);
-        py::gil_scoped_release gil_release;
+        auto const store = retire.is_none();
+        auto results = RowMajorArrayXX<double>();
+        auto error = std::string();
+        auto is_invalid_result = false; ///< the `error` is about a result which can't be stored
+        std::atomic<bool> failed{false}; ///< no new jobs are produced after the first `error`
+
+        // Only the jobs which weren't completed by a previous (interrupted) run
+        auto is_skipped = std::vector<bool>(size, false);
+        for (auto const id : skip) {
+            if (id < size) { is_skipped[id] = true; }
+        }
+        auto ids = std::vector<std::size_t>();
+        auto job_costs = std::vector<double>();
+        for (auto id = std::size_t{0}; id < size; ++id) {
+            if (is_skipped[id]) { continue; }
+            ids.push_back(id);
+            if (costs.size() == size) { job_costs.push_back(costs[id]); }
+        }
+        CheckpointFile checkpoint(checkpoint_file, size, checkpoint_key);
 
         struct Job {
             py::object py;
             std::shared_ptr<DeferredBase> cpp;
         };
 
-        parallel_for(
-            size, num_threads, queue_size,
-            [&produce, &sequence](size_t id) {
-                py::gil_scoped_acquire gil_acquire;
-                py::object var = sequence[py::cast(id)];
-                py::object obj = produce(var);
-                return Job{obj, obj.cast<std::shared_ptr<DeferredBase>>()};
-            },
-            [](Job& job) {
-                // no GIL lock -> computations run in parallel
-                // but no Python code may be called here
-                job.cpp->compute();
-            },
-            [&retire](Job job, size_t id) {
-                py::gil_scoped_acquire gil_acquire;
-                retire(job.py, id);
-                job.py.release();
-            }
-        );
-    }, "sequence"_a, "produce"_a, "retire"_a, "num_threads"_a, "queue_size"_a);
+        {
+            py::gil_scoped_release gil_release;
+            parallel_for(
+                ids.size(), num_threads, queue_size,
+                [&produce, &sequence, &ids, &failed](size_t n) {
+                    if (failed) {
+                        return Job{}; // the loop is failing: skip the remaining jobs
+                    }
+                    py::gil_scoped_acquire gil_acquire;
+                    py::object var = sequence[py::cast(ids[n])];
+                    py::object obj = produce(var);
+                    return Job{obj, obj.cast<std::shared_ptr<DeferredBase>>()};
+                },
+                [&](Job& job) {
+                    // no GIL lock -> computations run in parallel
+                    // This includes building the system and Hamiltonian which is deferred
+                    // until the first calculation. Python modifiers acquire the GIL only
+                    // for their call.
+                    if (job.cpp) {
+                        job.cpp->compute();
+                        if ((store || checkpoint.is_open()) && !job.cpp->result_array()) {
+                            failed = true; // the retirement reports it, but stop producing now
+                        }
+                    }
+                },
+                [&](std::vector<detail::Job<Job>>& jobs) {
+                    // no GIL lock -> the plain results are copied and saved directly
+                    auto num_saved = error.empty() ? jobs.size() : 0; // may be retired
+                    for (auto const& job : jobs) {
+                        if ((!store && !checkpoint.is_open()) || !error.empty()) {
+                            break;
+                        }
+                        if (!job.value.cpp) {
+                            continue; // skipped
+                        }
+
+                        auto const id = ids[job.id];
+                        auto const array = job.value.cpp->result_array();
+                        if (!array) {
+                            error = "Only real 1D array results can be stored or checkpointed: "
+                                    "use `retire` for the others.";
+                            is_invalid_result = true;
+                            num_saved = static_cast<size_t>(&job - jobs.data());
+                            break;
+                        }
+                        if (checkpoint.is_open()) {
+                            checkpoint.write(id, *array);
+                            if (!checkpoint.is_good()) {
+                                error = "Could not write the checkpoint file.";
+                                num_saved = static_cast<size_t>(&job - jobs.data());
+                                break;
+                            }
+                        }
+                        if (!store) {
+                            continue;
+                        }
+                        if (results.rows() == 0) {
+                            results.setZero(size, array->size());
+                        }
+                        if (array->size() != results.cols()) {
+                            error = "All the results must have the same size.";
+                            is_invalid_result = true;
+                            break;
+                        }
+                        results.row(id) = array->transpose();
+                    }
+                    if (checkpoint.is_open()) {
+                        checkpoint.flush();
+                        if (!checkpoint.is_good() && error.empty()) {
+                            error = "Could not write the checkpoint file.";
+                        }
+                    }
+                    if (!error.empty()) {
+                        failed = true;
+                    }
+
+                    // A single GIL lock for the whole batch. After an error, only the results
+                    // which were checkpointed are retired: the others are redone on resume.
+                    py::gil_scoped_acquire gil_acquire;
+                    for (auto& job : jobs) {
+                        auto const is_saved = static_cast<size_t>(&job - jobs.data()) < num_saved;
+                        if (!store && job.value.cpp && is_saved) {
+                            retire(job.value.py, ids[job.id]);
+                        }
+                        job.value.cpp.reset();
+                        job.value.py = py::object();
+                    }
+                },
+                job_costs, pin_threads
+            );
+        }
+
+        if (is_invalid_result) {
+            throw std::invalid_argument(error); // `ValueError`: Python may retire them instead
+        } else if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+        return store ? py::cast(results) : py::none();
+    }, "sequence"_a, "produce"_a, "retire"_a, "num_threads"_a, "queue_size"_a,
+       "costs"_a=std::vector<double>{}, "pin_threads"_a=false, "checkpoint"_a="",
+       "checkpoint_key"_a=0, "skip"_a=std::vector<std::size_t>{});
 }
@@ -1,39 +1,222 @@
 #include "solver/Solver.hpp"
+#include "solver/Bands.hpp"
+#include "solver/ChebFilter.hpp"
+#include "solver/Dense.hpp"
+#include "solver/DirectGreens.hpp"
 #include "solver/FEAST.hpp"
+#include "solver/Lanczos.hpp"
+#include "solver/Transmission.hpp"
 #include "wrappers.hpp"
+#include "thread.hpp"
 using namespace cpb;
 
+namespace {
+
+/// The eigenvalues of either precision as a plain `ArrayXd`, see `deferred_eigenvalues`
+struct EigenvaluesXd {
+    template<class Array>
+    ArrayXd operator()(Array const& eigenvalues) const {
+        return eigenvalues.template cast<double>();
+    }
+};
+
+} // anonymous namespace
+
 void wrap_solver(py::module& m) {
     py::class_<BaseSolver>(m, "Solver")
         .def("solve", &BaseSolver::solve)
         .def("clear", &BaseSolver::clear)
         .def("report", &BaseSolver::report, "shortform"_a=false)
-        .def("calc_dos", &BaseSolver::calc_dos, "energies"_a, "broadening"_a)
-        .def("calc_spatial_ldos", &BaseSolver::calc_spatial_ldos, "energy"_a, "broadening"_a)
+        .def("calc_dos", &BaseSolver::calc_dos, "energies"_a, "broadening"_a,
+             "num_threads"_a=1)
+        .def("calc_spatial_ldos", &BaseSolver::calc_spatial_ldos, "energy"_a, "broadening"_a,
+             "num_threads"_a=1)
+        .def("stream_spatial_ldos", &BaseSolver::stream_spatial_ldos,
+             "energies"_a, "broadening"_a)
+        .def("deferred_dos", [](py::object self, ArrayXf energies, float broadening) {
+            auto& solver = self.cast<BaseSolver&>();
+            return Deferred<ArrayXd>{
+                self, [=, &solver] { return solver.calc_dos(energies, broadening); }
+            };
+        })
+        .def("deferred_spatial_ldos", [](py::object self, float energy, float broadening) {
+            auto& solver = self.cast<BaseSolver&>();
+            return Deferred<ArrayXd>{
+                self, [=, &solver] { return solver.calc_spatial_ldos(energy, broadening); }
+            };
+        })
+        .def("deferred_eigenvalues", [](py::object self) {
+            auto& solver = self.cast<BaseSolver&>();
+            return Deferred<ArrayXd>{
+                self, [&solver] {
+                    return num::match<ArrayX>(solver.eigenvalues(), EigenvaluesXd{});
+                }
+            };
+        })
         .def_property("model", &BaseSolver::get_model, &BaseSolver::set_model)
         .def_property_readonly("system", &BaseSolver::system)
         .def_property_readonly("eigenvalues", &BaseSolver::eigenvalues)
         .def_property_readonly("eigenvectors", &BaseSolver::eigenvectors);
 
+    m.def("calc_bands", &calc_bands, "model"_a, "kpoints"_a, "num_threads"_a=1, R"(
+        Compute the eigenvalues of a periodic model at many k-points in a single call
+
+        The Hamiltonian is diagonalized as a dense matrix for each k-point. The modifiers
+        are not evaluated again and the k-points are distributed over `num_threads`.
+
+        Parameters
+        ----------
+        model : Model
+        kpoints : List[array_like]
+            Wave vectors in reciprocal space.
+        num_threads : int
+
+        Returns
+        -------
+        array_like
+            Shape (len(kpoints), num_sites): row `n` has the sorted eigenvalues at `kpoints[n]`.
+    )");
+
+    m.def("calc_transmission", &calc_transmission, "model"_a, "energies"_a, "lead_from"_a=0,
+          "lead_to"_a=1, "broadening"_a=1e-6, "num_threads"_a=1, R"(
+        Two-terminal transmission using the recursive Green's function method
+
+        The system is sliced into layers between the two leads and only the dense slice
+        blocks are formed. The cost scales with the number of slices times the cube of
+        the slice width. The energies are distributed over `num_threads`.
+
+        Parameters
+        ----------
+        model : Model
+            Must have at least two leads.
+        energies : array_like
+            Energy values (eV).
+        lead_from, lead_to : int
+            Indices of the two leads in `model.leads`.
+        broadening : float
+            Imaginary part of the energy (eV).
+        num_threads : int
+
+        Returns
+        -------
+        array_like
+            The transmission at each energy.
+    )");
+
+    py::class_<DirectGreens>(m, "DirectGreens", R"(
+        Green's functions from sparse LU factorizations of `E + i*broadening - H`
+
+        The symbolic analysis is done once per sparsity pattern and each energy only needs
+        a numeric factorization, so this works well for a very small broadening where KPM
+        needs too many moments. The energies are distributed over `num_threads`. Unlike
+        the KPM results, the Green's functions are not scaled: they are in units of 1/eV.
+    )")
+        .def(py::init<Model const&, int>(), "model"_a, "num_threads"_a=1)
+        .def("calc_greens", &DirectGreens::greens, "row"_a, "col"_a, "energy"_a,
+             "broadening"_a)
+        .def("calc_greens", &DirectGreens::greens_vector, "row"_a, "cols"_a, "energy"_a,
+             "broadening"_a)
+        .def("calc_greens_block", &DirectGreens::greens_block, "rows"_a, "cols"_a,
+             "energy"_a, "broadening"_a)
+        .def("report", &DirectGreens::report, "shortform"_a=false)
+        .def_property("model", &DirectGreens::get_model, &DirectGreens::set_model)
+        .def_property_readonly("num_analyses", &DirectGreens::num_analyses)
+        .def_property_readonly("num_factorizations", &DirectGreens::num_factorizations);
+
+    py::enum_<LanczosMode>(m, "LanczosMode")
+        .value("shift_invert", LanczosMode::ShiftInvert)
+        .value("folded", LanczosMode::Folded);
+
+    auto const lanczos_defaults = LanczosConfig();
+    py::class_<Solver<Lanczos>, BaseSolver>(m, "Lanczos")
+        .def("__init__", [](Solver<Lanczos>& self, Model const& model, int k, double sigma,
+                            LanczosMode mode, int subspace_size, double tolerance,
+                            int num_threads) {
+                 LanczosConfig config;
+                 config.num_eigenvalues = k;
+                 config.sigma = sigma;
+                 config.mode = mode;
+                 config.subspace_size = subspace_size;
+                 config.tolerance = tolerance;
+                 config.num_threads = num_threads;
+
+                 new (&self) Solver<Lanczos>(model, config);
+             },
+             "model"_a, "k"_a, "sigma"_a=lanczos_defaults.sigma,
+             "mode"_a=lanczos_defaults.mode,
+             "subspace_size"_a=lanczos_defaults.subspace_size,
+             "tolerance"_a=lanczos_defaults.tolerance,
+             "num_threads"_a=lanczos_defaults.num_threads
+        );
+
+    auto const chebfilter_defaults = ChebFilterConfig();
+    py::class_<Solver<ChebFilter>, BaseSolver>(m, "ChebFilter")
+        .def("__init__", [](Solver<ChebFilter>& self, Model const& model,
+                            std::pair<double, double> energy, int size_guess, int degree,
+                            double tolerance, int num_threads) {
+                 ChebFilterConfig config;
+                 config.energy_min = energy.first;
+                 config.energy_max = energy.second;
+                 config.initial_size_guess = size_guess;
+                 config.filter_degree = degree;
+                 config.tolerance = tolerance;
+                 config.num_threads = num_threads;
+
+                 new (&self) Solver<ChebFilter>(model, config);
+             },
+             "model"_a, "energy_range"_a, "initial_size_guess"_a,
+             "filter_degree"_a=chebfilter_defaults.filter_degree,
+             "tolerance"_a=chebfilter_defaults.tolerance,
+             "num_threads"_a=chebfilter_defaults.num_threads
+        );
+
+    auto const dense_defaults = DenseConfig();
+    py::class_<Solver<Dense>, BaseSolver>(m, "Dense")
+        .def("__init__", [](Solver<Dense>& self, Model const& model,
+                            std::pair<double, double> energy, int num_threads) {
+                 DenseConfig config;
+                 config.energy_min = energy.first;
+                 config.energy_max = energy.second;
+                 config.num_threads = num_threads;
+
+                 new (&self) Solver<Dense>(model, config);
+             },
+             "model"_a, "energy_range"_a=std::make_pair(dense_defaults.energy_min,
+                                                       dense_defaults.energy_max),
+             "num_threads"_a=dense_defaults.num_threads
+        );
+
 #ifdef CPB_USE_FEAST
+    py::class_<FEASTSweep, std::shared_ptr<FEASTSweep>>(m, "FEASTSweep")
+        .def(py::init<int>(), "capacity"_a=8)
+        .def_property_readonly("size", &FEASTSweep::size);
+
     auto const feast_defaults = FEASTConfig();
     py::class_<Solver<FEAST>, BaseSolver>(m, "FEAST")
         .def("__init__", [](Solver<FEAST>& self, Model const& model,
                             std::pair<float, float> energy, int size_guess,
-                            bool recycle, bool verbose) {
+                            bool recycle, bool verbose, int num_threads,
+                            py::object sweep, int sweep_index) {
                  FEASTConfig config;
                  config.energy_min = energy.first;
                  config.energy_max = energy.second;
                  config.initial_size_guess = size_guess;
                  config.recycle_subspace = recycle;
                  config.is_verbose = verbose;
+                 config.num_threads = num_threads;
+                 if (!sweep.is_none()) {
+                     config.sweep = sweep.cast<std::shared_ptr<FEASTSweep>>();
+                 }
+                 config.sweep_index = sweep_index;
 
                  new (&self) Solver<FEAST>(model, config);
 
              },
              "model"_a, "energy_range"_a, "initial_size_guess"_a,
              "recycle_subspace"_a=feast_defaults.recycle_subspace,
-             "is_verbose"_a=feast_defaults.is_verbose
+             "is_verbose"_a=feast_defaults.is_verbose,
+             "num_threads"_a=feast_defaults.num_threads, "sweep"_a=py::none(),
+             "sweep_index"_a=feast_defaults.sweep_index
         );
 #endif // CPB_USE_FEAST
 }
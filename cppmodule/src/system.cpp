@@ -24,18 +24,40 @@ void wrap_system(py::module& m) {
             new (&b) Boundary{t[0].cast<decltype(b.hoppings)>(), t[1].cast<decltype(b.shift)>()};
         });
 
+    py::enum_<SiteOrder>(m, "SiteOrder")
+        .value("foundation", SiteOrder::Foundation)
+        .value("unit_cell", SiteOrder::UnitCell)
+        .value("rcm", SiteOrder::RCM)
+        .value("morton", SiteOrder::Morton);
+
     py::class_<System, std::shared_ptr<System>>(m, "System")
         .def(py::init<Lattice const&>())
-        .def("find_nearest", &System::find_nearest, "position"_a, "sublattice"_a="")
+        .def("find_nearest",
+             static_cast<int (System::*)(Cartesian, std::string const&) const>(
+                 &System::find_nearest
+             ), "position"_a, "sublattice"_a="")
+        .def("find_nearest_many", [](System const& s, ArrayXf x, ArrayXf y, ArrayXf z,
+                                     std::string const& sublattice, int num_threads) {
+            return s.find_nearest(CartesianArray(x, y, z), sublattice, num_threads);
+        }, "x"_a, "y"_a, "z"_a, "sublattice"_a="", "num_threads"_a=1)
+        .def("find_within", &System::find_within, "position"_a, "radius"_a, "sublattice"_a="")
         .def_readonly("lattice", &System::lattice)
-        .def_readonly("positions", &System::positions)
+        .def_property_readonly("positions", [](System const& s) {
+            auto buffer = CartesianArray();
+            return CartesianArray(s.expanded_positions(buffer));
+        })
         .def_property_readonly("sublattices", [](System const& s) { return arrayref(s.sublattices); })
         .def_property_readonly("hoppings", [](System const& s) { return csrref(s.hoppings); })
         .def_readonly("boundaries", &System::boundaries)
         .def_readonly("has_unbalanced_hoppings", &System::has_unbalanced_hoppings)
+        .def_property_readonly("original_indices", [](System const& s) {
+            return arrayref(s.original_indices);
+        })
         .def("__getstate__", [](System const& s) {
-            return py::make_tuple(s.lattice, s.positions, s.sublattices, s.hoppings,
-                                  s.boundaries, s.has_unbalanced_hoppings);
+            auto buffer = CartesianArray();
+            return py::make_tuple(s.lattice, s.expanded_positions(buffer), s.sublattices,
+                                  s.hoppings, s.boundaries, s.has_unbalanced_hoppings,
+                                  s.original_indices);
         })
         .def("__setstate__", [](System& s, py::tuple t) {
             new (&s) System(t[0].cast<decltype(s.lattice)>());
@@ -44,5 +66,8 @@ void wrap_system(py::module& m) {
             s.hoppings = t[3].cast<decltype(s.hoppings)>();
             s.boundaries = t[4].cast<decltype(s.boundaries)>();
             s.has_unbalanced_hoppings = t[5].cast<decltype(s.has_unbalanced_hoppings)>();
+            if (t.size() > 6) { // older pickles don't have it
+                s.original_indices = t[6].cast<decltype(s.original_indices)>();
+            }
         });
 }
@@ -0,0 +1,41 @@
+#! /usr/bin/env python3
+"""Benchmark of the removal of dangling sites in a system with vacancy disorder
+
+Usage: run this script using python3 with pybinding installed. To compare two versions
+of pybinding, run it with each of them: the results are printed as a table.
+
+A fraction of the sites of a graphene flake is removed at random. With `min_neighbors=2`,
+the removal of dangling sites cascades through the remaining sites, which is the worst
+case for the pruning pass. The system build time is measured for each number of threads.
+"""
+
+import numpy as np
+import pybinding as pb
+from pybinding.repository import graphene
+
+
+def vacancies(fraction, seed=42):
+    @pb.site_state_modifier(min_neighbors=2)
+    def modifier(state):
+        rng = np.random.RandomState(seed)
+        state[rng.rand(state.size) < fraction] = False
+        return state
+    return modifier
+
+
+def measure(width, fraction, num_threads):
+    model = pb.Model(graphene.monolayer(), pb.rectangle(width), vacancies(fraction))
+    model.set_num_threads(num_threads)
+    with pb.utils.timed() as time:
+        num_sites = model.system.num_sites
+    return time.elapsed, num_sites
+
+
+if __name__ == '__main__':
+    fraction = 0.2
+    measure(10, fraction, 1)  # warmup
+    print("{:>8} {:>10} {:>8} {:>10}".format("width", "sites", "threads", "time [s]"))
+    for width in [100, 200, 400]:
+        for num_threads in [1, 2, 4]:
+            elapsed, num_sites = measure(width, fraction, num_threads)
+            print("{:>8} {:>10} {:>8} {:>10.3f}".format(width, num_sites, num_threads, elapsed))
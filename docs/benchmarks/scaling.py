@@ -0,0 +1,201 @@
+#! /usr/bin/env python3
+"""Strong and weak scaling benchmarks of the system build, KPM, parallel sweeps and FEAST
+
+Usage: run this script using python3 with pybinding installed. The results are printed as
+they come in and saved to a JSON file (see `--output`) along with the pybinding version and
+the machine information, so that the files of different releases or machines can be compared.
+
+    python3 scaling.py                              # 10^4 to 10^6 sites, all stages
+    python3 scaling.py --max-sites 1e8 --stages build,kpm
+    python3 scaling.py --lattices monolayer,bilayer --output scaling-0.9.json
+
+The stages are:
+  - build    : system and Hamiltonian build time for each system size and number of threads
+  - kpm      : KPM moments per second for each system size and `optimization_level`,
+               and for `kpm_cuda` if the module was compiled with CUDA
+  - parallel : throughput of a `pb.parallel_for` sweep of KPM jobs for each number of threads
+               (strong scaling: the sweep and the system size are fixed)
+  - feast    : FEAST solve time for each system size, if the module was compiled with FEAST
+
+Each measurement runs in a new process, so the peak resident memory (RSS) is that of the
+measurement alone. 10^8 sites need several tens of GiB of RAM for the build stage.
+"""
+
+import argparse
+import datetime
+import json
+import math
+import multiprocessing
+import os
+import platform
+import resource
+import sys
+
+import numpy as np
+import pybinding as pb
+from pybinding import _cpp
+from pybinding.repository import graphene
+
+
+def make_model(lattice_name, num_sites, num_threads=1):
+    """A square flake of the named `graphene` lattice with about `num_sites` sites"""
+    lattice = getattr(graphene, lattice_name)()
+    unit_area = np.linalg.norm(np.cross(*lattice.vectors)) / len(lattice.sublattices)
+    model = pb.Model(lattice, pb.rectangle(math.sqrt(num_sites * unit_area)))
+    model.set_num_threads(num_threads)
+    return model
+
+
+def peak_rss_mib():
+    """Peak resident memory of this process: `ru_maxrss` is in KiB on Linux, bytes on macOS"""
+    rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    return rss / 2**20 if sys.platform == "darwin" else rss / 2**10
+
+
+def measure_build(lattice, num_sites, num_threads):
+    model = make_model(lattice, num_sites, num_threads)
+    with pb.utils.timed() as time:
+        h = model.hamiltonian
+    return dict(num_sites=h.shape[0], non_zeros=h.nnz, seconds=time.elapsed,
+                system_seconds=model.system_build_seconds,
+                hamiltonian_seconds=model.hamiltonian_build_seconds)
+
+
+def measure_kpm(lattice, num_sites, opt_level, broadening=0.03):
+    model = make_model(lattice, num_sites)
+    if opt_level == "cuda":
+        kpm = pb.kpm_cuda(model)
+    else:
+        kpm = pb.kpm(model, optimization_level=opt_level)
+
+    # A single vector: about 1000 moments for the bandwidth of graphene
+    kpm.calc_ldos(np.linspace(-1, 1, 100), broadening, position=[0, 0])
+    stats = kpm.stats
+    seconds = stats.timings["moments"]
+    return dict(num_sites=model.system.num_sites, num_moments=stats.num_moments,
+                seconds=seconds, moments_per_second=stats.num_moments / seconds,
+                bandwidth=stats.bandwidth)
+
+
+def measure_parallel(lattice, num_sites, num_threads, num_jobs=32, broadening=0.06):
+    model = make_model(lattice, num_sites)
+    energy = np.linspace(-1, 1, 100)
+
+    @pb.parallelize(num_threads=num_threads, shift=np.linspace(-0.1, 0.1, num_jobs))
+    def factory(shift):
+        kpm = pb.kpm(model, energy_range=(-10, 10))
+        return kpm.deferred_ldos(energy + shift, broadening, [0, 0])
+
+    factory.config.filename = ""
+    factory.config.pbar_fd = None
+    with pb.utils.timed() as time:
+        pb.parallel_for(factory)
+    return dict(num_sites=model.system.num_sites, num_jobs=num_jobs, seconds=time.elapsed,
+                jobs_per_second=num_jobs / time.elapsed)
+
+
+def measure_feast(lattice, num_sites, num_threads):
+    model = make_model(lattice, num_sites)
+    model.hamiltonian  # not part of the solve time
+    solver = pb.solver.feast(model, energy_range=(-0.1, 0.1), initial_size_guess=100,
+                             num_threads=num_threads)
+    with pb.utils.timed() as time:
+        solver.solve()
+    return dict(num_sites=model.system.num_sites, num_eigenvalues=len(solver.eigenvalues),
+                seconds=time.elapsed)
+
+
+def _run(args):
+    measure, kwargs = args
+    result = measure(**kwargs)
+    result["peak_rss_mib"] = peak_rss_mib()
+    return result
+
+
+def run_isolated(measure, **kwargs):
+    """Run a measurement in a new process, returns `None` if the process fails"""
+    with multiprocessing.get_context("spawn").Pool(1, maxtasksperchild=1) as pool:
+        try:
+            return pool.apply(_run, ((measure, kwargs),))
+        except Exception as err:
+            print("  {}({}) failed: {}".format(measure.__name__, kwargs, err))
+            return None
+
+
+def thread_counts(max_threads):
+    """Powers of 2 up to the number of cores, and the number of cores itself"""
+    counts = [2**i for i in range(int(math.log2(max_threads)) + 1)]
+    return counts if counts[-1] == max_threads else counts + [max_threads]
+
+
+def stage(results, name, measure, header, cases, row):
+    print("\n{}\n{}".format(name, header))
+    for kwargs in cases:
+        result = run_isolated(measure, **kwargs)
+        if result is not None:
+            result = dict(kwargs, **result)  # the actual `num_sites` replaces the requested one
+            results[name].append(result)
+            print(row.format(**result))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--min-sites", type=float, default=1e4)
+    parser.add_argument("--max-sites", type=float, default=1e6)
+    parser.add_argument("--lattices", default="monolayer",
+                        help="comma separated names of `pb.repository.graphene` lattices")
+    parser.add_argument("--stages", default="build,kpm,parallel,feast")
+    parser.add_argument("--max-threads", type=int, default=os.cpu_count())
+    parser.add_argument("--output", default="scaling.json")
+    args = parser.parse_args()
+
+    sizes = [int(10**e) for e in range(int(math.log10(args.min_sites)),
+                                       int(math.log10(args.max_sites)) + 1)]
+    threads = thread_counts(args.max_threads)
+    stages = args.stages.split(",")
+    opt_levels = [0, 1, 2, 3] + (["cuda"] if hasattr(_cpp, "KPMcuda") else [])
+
+    results = dict(
+        info=dict(pybinding=pb.__version__, numpy=np.__version__, python=platform.python_version(),
+                  machine=platform.machine(), processor=platform.processor(),
+                  system=platform.platform(), num_cores=os.cpu_count(),
+                  date=datetime.datetime.now().isoformat(timespec="seconds")),
+        build=[], kpm=[], parallel=[], feast=[]
+    )
+
+    for lattice in args.lattices.split(","):
+        print("\n=== graphene.{} ===".format(lattice))
+        if "build" in stages:
+            stage(results, "build", measure_build,
+                  "{:>11} {:>8} {:>10} {:>10}".format("sites", "threads", "time [s]", "RSS [MiB]"),
+                  [dict(lattice=lattice, num_sites=n, num_threads=t)
+                   for n in sizes for t in threads],
+                  "{num_sites:>11} {num_threads:>8} {seconds:>10.3f} {peak_rss_mib:>10.0f}")
+        if "kpm" in stages:
+            stage(results, "kpm", measure_kpm,
+                  "{:>11} {:>6} {:>12} {:>10}".format("sites", "opt", "moments/s", "RSS [MiB]"),
+                  [dict(lattice=lattice, num_sites=n, opt_level=o)
+                   for n in sizes for o in opt_levels],
+                  "{num_sites:>11} {opt_level!s:>6} {moments_per_second:>12.1f} "
+                  "{peak_rss_mib:>10.0f}")
+        if "parallel" in stages:
+            stage(results, "parallel", measure_parallel,
+                  "{:>11} {:>8} {:>10} {:>10}".format("sites", "threads", "jobs/s", "RSS [MiB]"),
+                  [dict(lattice=lattice, num_sites=sizes[0], num_threads=t) for t in threads],
+                  "{num_sites:>11} {num_threads:>8} {jobs_per_second:>10.2f} "
+                  "{peak_rss_mib:>10.0f}")
+        if "feast" in stages and hasattr(_cpp, "FEAST"):
+            # The sparse direct solver of each contour point limits the feasible sizes
+            stage(results, "feast", measure_feast,
+                  "{:>11} {:>8} {:>10} {:>10}".format("sites", "threads", "time [s]", "RSS [MiB]"),
+                  [dict(lattice=lattice, num_sites=n, num_threads=t)
+                   for n in sizes if n <= 10**6 for t in [1, threads[-1]]],
+                  "{num_sites:>11} {num_threads:>8} {seconds:>10.3f} {peak_rss_mib:>10.0f}")
+
+    with open(args.output, "w") as file:
+        json.dump(results, file, indent=2)
+    print("\nSaved to {}".format(args.output))
+
+
+if __name__ == '__main__':
+    main()
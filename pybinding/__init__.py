@@ -25,6 +25,7 @@ from .modifier import *
 from .results import *
 
 from .support.pickle import save, load
+from .support.shared import share, SharedCSR
 from .parallel import parallel_for, parallelize
 
 from . import (chebyshev, constants, greens, parallel, pltutils, results, solver, system, utils)
@@ -3,12 +3,17 @@
 The kernel polynomial method (KPM) can be used to approximate various functions by expanding them
 in a series of Chebyshev polynomials.
 """
+import numpy as np
+
 from . import _cpp
 from . import results
 from .model import Model
 from .system import System
 
-__all__ = ['KernelPolynomialMethod', 'kpm', 'kpm_cuda', 'jackson_kernel', 'lorentz_kernel']
+__all__ = ['KernelPolynomialMethod', 'kpm', 'kpm_cuda', 'MatrixKPM', 'kpm_matrix',
+           'DisorderEnsemble', 'disorder_ensemble', 'SelfConsistentLoop',
+           'self_consistent_loop', 'jackson_kernel', 'lorentz_kernel', 'load_results',
+           'kpm_memory']
 
 
 class KernelPolynomialMethod:
@@ -35,6 +40,80 @@ class KernelPolynomialMethod:
         """The tight-binding system (shortcut for `KernelPolynomialMethod.model.system`)"""
         return System(self.impl.system)
 
+    @property
+    def use_symmetry(self) -> bool:
+        """Use the rotation and mirror symmetries of a finite system in LDOS calculations
+
+        Only one site of each symmetry orbit is computed by :meth:`calc_ldos_vector` and
+        :meth:`calc_spatial_ldos` and the result is copied to the equivalent sites. The
+        symmetries of the system and Hamiltonian are found automatically. Periodic systems
+        and multi-orbital models are computed in full.
+        """
+        return self.impl.use_symmetry
+
+    @use_symmetry.setter
+    def use_symmetry(self, enabled):
+        self.impl.use_symmetry = enabled
+
+    @property
+    def damping(self) -> np.ndarray:
+        """Damping factor `0 < d <= 1` of each site, applied to the KPM vectors in every iteration
+
+        The vectors decay as they reach the damped sites: an absorbing boundary makes a small
+        finite sample look like an open system, without computing any lead self-energies.
+        Used by :meth:`calc_ldos`, :meth:`calc_greens` and the moments of a single row, the
+        other calculations ignore it. An empty array disables it. See also
+        :meth:`set_absorbing_boundary` and :meth:`set_lead_absorbing_boundary`.
+        """
+        return self.impl.damping
+
+    @damping.setter
+    def damping(self, damping):
+        self.impl.damping = np.asarray(damping, dtype=np.float32)
+
+    def set_absorbing_boundary(self, interior, width, strength=0.1):
+        """Damp the sites outside of the `interior` shape
+
+        The damping factor drops smoothly from 1 to `1 - strength` over the first `width`
+        layers of neighbors away from the interior, which limits the reflections from the
+        edge of the damped region.
+
+        Parameters
+        ----------
+        interior : :class:`~pybinding.Shape`
+            Sites within this shape are not damped.
+        width : int
+            Number of neighbor layers over which the damping increases.
+        strength : float
+            Maximum damping per iteration, between 0 and 1.
+        """
+        self.impl.set_absorbing_boundary(interior, width, strength)
+
+    def set_lead_absorbing_boundary(self, width, strength=0.1):
+        """Damp the sites near the leads of the model
+
+        The same as :meth:`set_absorbing_boundary`, but the damping is strongest at the
+        interface of each lead and fades out over `width` layers of neighbors into the system.
+
+        Parameters
+        ----------
+        width : int
+            Number of neighbor layers over which the damping fades out.
+        strength : float
+            Maximum damping per iteration, between 0 and 1.
+        """
+        self.impl.set_lead_absorbing_boundary(width, strength)
+
+    @property
+    def symmetry_order(self) -> int:
+        """Number of point symmetry operations of the model, 1 if there are none"""
+        return self.impl.symmetry_order
+
+    @property
+    def stats(self):
+        """Stats of the last computation: time breakdown, memory traffic, optimization level"""
+        return self.impl.stats
+
     def report(self, shortform=False):
         """Return a report of the last computation
 
@@ -69,6 +148,32 @@ class KernelPolynomialMethod:
         """
         return self.impl.calc_greens(i, j, energy, broadening)
 
+    def calc_greens_block(self, rows, cols, energy, broadening):
+        """Calculate the block of Green's functions between all the `rows` and `cols`
+
+        The KPM vectors of all the rows are computed together with a single reordering of
+        the Hamiltonian matrix, which is much faster than calling :meth:`calc_greens` for
+        each row, e.g. for the Green's function between two contact regions.
+
+        Parameters
+        ----------
+        rows, cols : List[int]
+            Hamiltonian indices.
+        energy : ndarray
+            Energy value array.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+            Lower values result in longer calculation time.
+
+        Returns
+        -------
+        ndarray
+            Array of shape `(len(rows), len(cols), len(energy))`.
+        """
+        rows, cols = np.atleast_1d(rows).tolist(), np.atleast_1d(cols).tolist()
+        greens = self.impl.calc_greens_block(rows, cols, energy, broadening)
+        return np.array(greens).reshape(len(rows), len(cols), -1)
+
     def calc_ldos(self, energy, broadening, position, sublattice=""):
         """Calculate the local density of states as a function of energy
 
@@ -94,6 +199,409 @@ class KernelPolynomialMethod:
         ldos = self.impl.calc_ldos(energy, broadening, position, sublattice)
         return results.LDOS(energy, ldos)
 
+    def calc_dos(self, energy, broadening, num_random=16):
+        """Calculate the density of states as a function of energy
+
+        The DOS is computed using stochastic trace evaluation: the KPM moments are averaged
+        over a number of random-phase vectors instead of summing the LDOS of every site.
+        The random vectors are processed in blocks which share each pass over the matrix.
+
+        Parameters
+        ----------
+        energy : ndarray
+            Values for which the DOS is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+            Lower values result in longer calculation time.
+        num_random : int
+            The number of random vectors. The statistical error decreases as
+            `1 / sqrt(num_random * num_sites)`, so large systems need only a few.
+
+        Returns
+        -------
+        :class:`~pybinding.DOS`
+        """
+        dos = self.impl.calc_dos(energy, broadening, num_random)
+        return results.DOS(energy, dos)
+
+    def calc_sublattice_dos(self, energy, broadening, num_random=16):
+        """Calculate the DOS projected on each sublattice
+
+        All the projections come from a single stochastic trace: the random vectors are the
+        same as in :meth:`calc_dos` and the projections add up to its result. This costs
+        about as much as two DOS calculations, regardless of the number of sublattices,
+        instead of an LDOS calculation for every site.
+
+        Parameters
+        ----------
+        energy : ndarray
+            Values for which the DOS is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+            Lower values result in longer calculation time.
+        num_random : int
+            The number of random vectors.
+
+        Returns
+        -------
+        Dict[str, :class:`~pybinding.DOS`]
+            The projected DOS of each sublattice name.
+        """
+        dos = self.impl.calc_sublattice_dos(energy, broadening, num_random)
+        sub_name_map = self.impl.system.lattice.sub_name_map
+        return {name: results.DOS(energy, dos[:, sub_id]) for name, sub_id in sub_name_map.items()}
+
+    def calc_region_dos(self, energy, broadening, regions, num_random=16):
+        """Calculate the DOS projected on each of the given regions
+
+        The same as :meth:`calc_sublattice_dos`, but the parts of the system are the sites
+        located within each of the `regions`. A site which is located within several of them
+        only counts for the first one and sites outside of all of them are not included.
+
+        Parameters
+        ----------
+        energy : ndarray
+            Values for which the DOS is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+            Lower values result in longer calculation time.
+        regions : List[:class:`~pybinding.Shape`]
+            Parts of the system.
+        num_random : int
+            The number of random vectors.
+
+        Returns
+        -------
+        List[:class:`~pybinding.DOS`]
+            The projected DOS of each region.
+        """
+        dos = self.impl.calc_region_dos(energy, broadening, regions, num_random)
+        return [results.DOS(energy, dos[:, i]) for i in range(dos.shape[1])]
+
+    def calc_bond_currents(self, energy, broadening, shape, num_random=16):
+        """Calculate the local current `Im(H_ij * G_ji(E))` of every bond within `shape`
+
+        The Green's functions of all the bonds come from a single KPM run instead of one
+        :meth:`calc_greens` call per site. By default, they are estimated stochastically from
+        the same random vectors as :meth:`calc_dos`: the error of each bond only decreases as
+        `1 / sqrt(num_random)`. With `num_random=0`, the result is exact but the cost grows
+        with the number of sites within `shape`, like :meth:`calc_ldos_vector`. Only for
+        models with a single orbital per site.
+
+        Parameters
+        ----------
+        energy : ndarray
+            Values for which the currents are calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+            Lower values result in longer calculation time.
+        shape : :class:`~pybinding.Shape`
+            Only the bonds with both sites within the shape are computed.
+        num_random : int
+            The number of random vectors, 0 for the exact result.
+
+        Returns
+        -------
+        ndarray
+            2D array of shape `(energy.size, system.hoppings.nnz)`: one column for each
+            non-zero of the :attr:`.System.hoppings` CSR matrix, zero outside of `shape`.
+        """
+        return self.impl.calc_bond_currents(energy, broadening, shape, num_random)
+
+    def calc_density(self, chemical_potential, broadening, temperature=0, num_random=16,
+                     probing_distance=0):
+        """Calculate the electron density of every site at the given chemical potential
+
+        The Fermi-Dirac distribution is expanded in Chebyshev polynomials and the diagonal of
+        the resulting Fermi operator is estimated for all the sites at once. This scales
+        linearly with the system size instead of one :meth:`calc_ldos` run per site, e.g. for
+        self-consistent electrostatics. The estimate uses either random vectors or probing
+        vectors: each of those combines sites which are more than `probing_distance`
+        hoppings apart. The error of probing decays quickly with the distance, faster at
+        higher temperatures, and it doesn't have any statistical noise.
+
+        Parameters
+        ----------
+        chemical_potential : float
+            Energy of the Fermi level.
+        broadening : float
+            Resolution of the expansion: the Fermi function is smoothed over this width.
+        temperature : float
+            Value in Kelvin.
+        num_random : int
+            The number of random vectors, not used with probing.
+        probing_distance : int
+            Use probing vectors instead of random ones if larger than 0.
+
+        Returns
+        -------
+        ndarray
+            The occupation of each Hamiltonian index, between 0 and 1 (without spin).
+        """
+        return self.impl.calc_density(chemical_potential, broadening, temperature, num_random,
+                                      probing_distance)
+
+    def calc_spectral_function(self, k_points, energy, broadening, sublattice=""):
+        """Calculate the spectral function `A(k, E)` of a finite system
+
+        The spectral function is the LDOS of a plane wave: `<k|delta(E - H)|k>`. The plane
+        waves are built from the site positions and their KPM moments are computed together
+        in blocks, in the same way as the random vectors of :meth:`calc_dos`. The result is
+        the band structure of the system broadened by its finite size and any disorder, e.g.
+        to compare with ARPES measurements.
+
+        Parameters
+        ----------
+        k_points : array_like
+            Wave vectors, one per row: 2D vectors are padded with `kz = 0`.
+        energy : ndarray
+            Values for which the spectral function is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+            Lower values result in longer calculation time.
+        sublattice : str
+            Only include the sites of this sublattice in the plane waves.
+
+        Returns
+        -------
+        ndarray
+            2D array of shape `(energy.size, len(k_points))`: one column for each k-point.
+            Each column integrates to 1 over all energies.
+        """
+        k_points = np.atleast_2d(np.asarray(k_points, dtype=np.float32))
+        k_points = np.pad(k_points, ((0, 0), (0, 3 - k_points.shape[1])), 'constant')
+        return self.impl.calc_spectral_function(list(k_points), energy, broadening, sublattice)
+
+    def calc_ldos_vector(self, indices, energy, broadening):
+        """Calculate the LDOS for many Hamiltonian indices at once
+
+        All the indices are computed together in a single pass over the Hamiltonian matrix
+        for each KPM iteration. This is much faster than calling :meth:`calc_ldos` repeatedly.
+
+        Parameters
+        ----------
+        indices : array_like
+            Hamiltonian indices of the sites for which the LDOS is calculated.
+        energy : ndarray
+            Values for which the LDOS is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+            Lower values result in longer calculation time.
+
+        Returns
+        -------
+        ndarray
+            2D array of shape `(energy.size, len(indices))`: one column for each index.
+        """
+        return self.impl.calc_ldos_vector(indices, energy, broadening)
+
+    def stream_ldos(self, indices, energy, broadening, filename, chunk_size=64):
+        """Same as :meth:`calc_ldos_vector` but the results are written to a file
+
+        The results are saved in chunks as soon as they are computed, so the memory usage
+        doesn't grow with the number of indices. Use :func:`load_results` to read them.
+
+        Parameters
+        ----------
+        indices : array_like
+            Hamiltonian indices of the sites for which the LDOS is calculated.
+        energy : ndarray
+            Values for which the LDOS is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+        filename : str
+            Destination file, overwritten if it exists.
+        chunk_size : int
+            Number of results which are written together.
+        """
+        self.impl.stream_ldos(indices, energy, broadening, filename, chunk_size)
+
+    def stream_greens(self, i, j, energy, broadening, filename, chunk_size=64):
+        """Same as :meth:`calc_greens` but the results are written to a file
+
+        Each matrix element is saved as soon as it's reconstructed: only the KPM moments
+        are kept in memory, not the full energy-resolved results. Use :func:`load_results`
+        to read them.
+
+        Parameters
+        ----------
+        i : int
+            Row index of the Green's matrix.
+        j : int or List[int]
+            Column index (or indices) of the Green's matrix.
+        energy : ndarray
+            Values for which the Green's function is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+        filename : str
+            Destination file, overwritten if it exists.
+        chunk_size : int
+            Number of results which are written together.
+        """
+        self.impl.stream_greens(i, np.atleast_1d(j).tolist(), energy, broadening, filename,
+                                chunk_size)
+
+    def calc_spatial_ldos(self, energy, broadening, shape):
+        """Calculate the LDOS of every site located within the given shape
+
+        All the sites are computed together using a single reordering of the Hamiltonian
+        matrix, which is much faster than calling :meth:`calc_ldos` for each position.
+
+        Parameters
+        ----------
+        energy : float or array_like
+            Values for which the LDOS is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+            Lower values result in longer calculation time.
+        shape : :class:`~pybinding.Polygon` or :class:`~pybinding.FreeformShape`
+            Only the sites within this shape are included in the map.
+
+        Returns
+        -------
+        :class:`~pybinding.StructureMap` or List[:class:`~pybinding.StructureMap`]
+            A map of the LDOS at the sites within `shape`, one for each value of `energy`.
+        """
+        energies = np.atleast_1d(energy)
+        ldos = self.impl.calc_spatial_ldos(energies, broadening, shape)
+        indices = self.impl.spatial_indices(shape)
+        smap = results.StructureMap.from_system(np.zeros(self.system.num_sites), self.system)
+        smap = smap[indices]
+        maps = [results.StructureMap(row, smap.positions, smap.sublattices, smap.hoppings,
+                                     smap.boundaries) for row in ldos]
+        return maps if np.ndim(energy) else maps[0]
+
+    def calc_moments(self, i, j, num_moments):
+        """Calculate the raw KPM moments of the Green's function element(s) `G_ij`
+
+        This is the expensive part of a KPM calculation. The returned objects can be
+        pickled and then reconstructed at any time, for any kernel, broadening and energy
+        range using their `greens(energy, broadening, kernel)` and `ldos(...)` methods.
+
+        Parameters
+        ----------
+        i : int
+            Hamiltonian index of the row.
+        j : int or List[int]
+            Hamiltonian index of the column(s).
+        num_moments : int
+            The number of moments to compute (may be rounded up). This limits the smallest
+            broadening which can be reconstructed later.
+
+        Returns
+        -------
+        KPMRawMoments or List[KPMRawMoments]
+        """
+        if isinstance(j, int):
+            return self.impl.calc_moments(i, [j], num_moments)[0]
+        else:
+            return self.impl.calc_moments(i, j, num_moments)
+
+    def calc_resumable_moments(self, i, num_moments):
+        """Same as :meth:`calc_moments` for a diagonal element `G_ii`, but resumable
+
+        The result also saves the state of the KPM recurrence so that the calculation can
+        be continued later using :meth:`extend_moments`, e.g. when a finer broadening is
+        needed. The saved state has the size of the system.
+
+        Parameters
+        ----------
+        i : int
+            Hamiltonian index.
+        num_moments : int
+            The number of moments to compute (may be rounded up).
+
+        Returns
+        -------
+        KPMRawMoments
+        """
+        return self.impl.calc_resumable_moments(i, num_moments)
+
+    def extend_moments(self, i, moments, num_moments):
+        """Continue the calculation of resumable moments up to `num_moments`
+
+        Only the new moments are computed: extending from `N` to `2N` moments costs
+        about the same as the initial calculation of `N` moments.
+
+        Parameters
+        ----------
+        i : int
+            Hamiltonian index, must be the same as for the `moments`.
+        moments : KPMRawMoments
+            The result of :meth:`calc_resumable_moments` or a previous :meth:`extend_moments`.
+        num_moments : int
+            The new total number of moments.
+
+        Returns
+        -------
+        KPMRawMoments
+        """
+        return self.impl.extend_moments(i, moments, num_moments)
+
+    def calc_conductivity(self, chemical_potential, broadening, direction="xx", temperature=0,
+                          volume=1.0, num_random=1, num_points=1000):
+        """Calculate the Kubo-Bastin conductivity as a function of the chemical potential
+
+        The 2D KPM moments of the velocity operators are computed with stochastic trace
+        evaluation. The cost grows with the square of the number of moments, so this is
+        much more expensive than the DOS for the same `broadening`.
+
+        Parameters
+        ----------
+        chemical_potential : ndarray
+            Values (in eV) for which the conductivity is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+            Lower values result in longer calculation time.
+        direction : str
+            Element of the conductivity tensor: "xx", "xy", "zz", etc.
+        temperature : float
+            Temperature (in Kelvin) of the Fermi-Dirac distribution.
+        volume : float
+            Volume of the system (area in 2D) in nm^3 (nm^2) which normalizes the result.
+        num_random : int
+            The number of random vectors for the stochastic trace evaluation.
+        num_points : int
+            The number of energy points of the integral over the Fermi sea.
+
+        Returns
+        -------
+        ndarray
+            The conductivity in units of e^2/h (2D systems, `volume` in nm^2).
+        """
+        axes = {"x": [1, 0, 0], "y": [0, 1, 0], "z": [0, 0, 1]}
+        if len(direction) != 2 or any(d not in axes for d in direction):
+            raise ValueError("Invalid direction {!r}, expected e.g. 'xx'".format(direction))
+
+        sigma = self.impl.calc_conductivity(axes[direction[0]], axes[direction[1]],
+                                            chemical_potential, broadening, temperature,
+                                            num_random, num_points)
+        return sigma.real / volume
+
+    def calc_time_evolution(self, state, time_step, num_steps=1):
+        """Evolve a state in time using the Chebyshev expansion of `exp(-iHt)`
+
+        The Bessel function coefficients are computed once for the `time_step` and each
+        step requires a number of matrix-vector multiplications proportional to the step
+        size times the spectral width of the Hamiltonian. The norm of the state is conserved
+        up to the numerical precision.
+
+        Parameters
+        ----------
+        state : array_like
+            Initial state: a complex vector with one element per Hamiltonian row.
+        time_step : float
+            Length (in femtoseconds) of each time step.
+        num_steps : int
+            Number of steps.
+
+        Returns
+        -------
+        ndarray
+            The state after each step as the rows of a `(num_steps, size)` array.
+        """
+        return self.impl.calc_time_evolution(state, time_step, num_steps).T
+
     def deferred_ldos(self, energy, broadening, position, sublattice=""):
         """Same as :meth:`calc_ldos` but for parallel computation: see the :mod:`.parallel` module
 
@@ -118,8 +626,83 @@ class KernelPolynomialMethod:
         """
         return self.impl.deferred_ldos(energy, broadening, position, sublattice)
 
+    def deferred_ldos_vector(self, indices, energy, broadening):
+        """Same as :meth:`calc_ldos_vector` but for parallel computation: see the :mod:`.parallel` module
+
+        The result is a 2D array, so it must be handled by a `retire` function: only 1D
+        results can be stored or checkpointed by :func:`~.parallel.parallel_for`.
+
+        Parameters
+        ----------
+        indices : array_like
+            Hamiltonian indices of the sites for which the LDOS is calculated.
+        energy : ndarray
+            Values for which the LDOS is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+
+        Returns
+        -------
+        Deferred
+        """
+        return self.impl.deferred_ldos_vector(indices, energy, broadening)
+
+    def deferred_greens(self, i, j, energy, broadening):
+        """Same as :meth:`calc_greens` but for parallel computation: see the :mod:`.parallel` module
+
+        The result is complex (a list of arrays if `j` is a list), so it must be handled
+        by a `retire` function: only real results can be stored or checkpointed.
+
+        Parameters
+        ----------
+        i, j : int or list of int
+            Hamiltonian indices. `j` may be a list of column indices for the same row `i`.
+        energy : ndarray
+            Energy value array.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+
+        Returns
+        -------
+        Deferred
+        """
+        return self.impl.deferred_greens(i, j, energy, broadening)
+
+    def deferred_dos(self, energy, broadening, num_random=16):
+        """Same as :meth:`calc_dos` but for parallel computation: see the :mod:`.parallel` module
 
-def kpm(model, energy_range=None, kernel="default", optimization_level=3, lanczos_precision=0.002):
+        Parameters
+        ----------
+        energy : ndarray
+            Values for which the DOS is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+        num_random : int
+            The number of random vectors.
+
+        Returns
+        -------
+        Deferred
+        """
+        return self.impl.deferred_dos(energy, broadening, num_random)
+
+
+def _opt_level(optimization_level):
+    """Convert 'auto' to the value expected by the C++ `kpm::Config::opt_level`"""
+    return -1 if optimization_level == "auto" else optimization_level
+
+
+def _block_size(block_size):
+    """Convert 'auto' to the value expected by the C++ `kpm::Config::block_size`"""
+    return -1 if block_size == "auto" else block_size
+
+
+def kpm(model, energy_range=None, kernel="default", optimization_level=3, lanczos_precision=0.002,
+        num_threads=1, mixed_precision=False, bounds_method="lanczos", cache_bounds=False,
+        interleave_depth=2, split_complex=False, share_matrix=False, permute_only=False,
+        block_size=0, symmetric_storage=False, bulk_boundary=False, convergence_tolerance=0,
+        indexed_values=False, reduced_precision=False, matrix_file="", pin_threads=False,
+        recursion=False, termination="square_root"):
     """The default CPU implementation of the Kernel Polynomial Method
 
     This implementation works on any system and is well optimized.
@@ -140,16 +723,146 @@ def kpm(model, energy_range=None, kernel="default", optimization_level=3, lanczo
         the function reconstructed from the Chebyshev series. Possible values are
         :func:`jackson_kernel` or :func:`lorentz_kernel`. The Lorentz kernel is used
         by default with `lambda = 4`.
-    optimization_level : int
+    optimization_level : Union[int, str]
         Level 0 disables all optimizations. Level 1 turns on matrix reordering which
         allows some parts of the sparse matrix-vector multiplication to be discarded.
         Level 2 enables moment interleaving: two KPM moments will be calculated per
         iteration which significantly lowers the required memory bandwidth. Level 3
         converts the Hamiltonian matrix format from CSR to ELLPACK format which
         allows for better vectorization of sparse matrix-vector multiplication.
+        Level 4 uses the sliced ELLPACK format (SELL-C-sigma) instead, which pads
+        the rows much less than ELLPACK when the number of hoppings per site varies a
+        lot, e.g. in systems with defects or with hopping generators. With 'auto',
+        a short calculation is timed with each level on the actual Hamiltonian and the
+        fastest one is used. The choice is remembered for Hamiltonians of the same
+        structure, so only the first calculation pays for the trials. The chosen level
+        is reported in :attr:`KernelPolynomialMethod.stats`.
     lanczos_precision : float
         How precise should the automatic Hamiltonian bounds determination be.
         TODO: implementation detail. Remove from public interface.
+    num_threads : int
+        The number of threads which share the work of a single KPM calculation. This is
+        useful for very large systems. For many independent calculations, it's usually
+        better to keep this at 1 and use the :mod:`.parallel` module instead. Multiple
+        threads can't use moment interleaving, so level 2 behaves the same as level 1.
+    mixed_precision : bool
+        Accumulate the LDOS and diagonal Green's function moments in double precision
+        while keeping the Hamiltonian and vectors in single precision. This retains
+        most of the speed of single precision models with fewer rounding errors for
+        a large number of moments.
+    bounds_method : {'lanczos', 'warm_lanczos', 'gershgorin'}
+        How to determine the energy bounds when `energy_range` is not given. With
+        'warm_lanczos', the Lanczos procedure for a new model (see
+        :attr:`KernelPolynomialMethod.model`) starts from the result of the previous
+        one, which converges much faster if the Hamiltonian changed only a little.
+        'gershgorin' skips the Lanczos procedure entirely. It's instant, but the bounds
+        are wider, so more moments are needed for the same broadening.
+    cache_bounds : bool
+        Reuse the Lanczos result of an identical Hamiltonian (also from another KPM
+        object, e.g. a previous job of a parallel sweep). Off by default: every
+        calculation then hashes the whole matrix and a copy of each matrix is kept
+        to verify the hits. It pays off when many jobs share the same Hamiltonian.
+    interleave_depth : int
+        The number of KPM iterations computed in a single pass over the Hamiltonian
+        matrix at levels 2 to 4 (LDOS and diagonal Green's function elements). The
+        default is the moment interleaving described above. For large systems, where the
+        KPM vectors don't fit into the CPU cache, deeper passes (e.g. 4 to 8) further
+        reduce the memory traffic.
+    split_complex : bool
+        For complex Hamiltonians (e.g. with a magnetic field or translational symmetry)
+        at level 3: also store the matrix values as separate real and imaginary arrays
+        and compute the LDOS and diagonal Green's function moments on split vectors.
+        The complex arithmetic then vectorizes as well as the real one, at the cost of
+        a second copy of the matrix values.
+    share_matrix : bool
+        Skip the matrix reordering for the target indices and share a single read-only
+        copy of the optimized matrix with all the other KPM objects of the same
+        Hamiltonian, e.g. the jobs of a parallel sweep over many sites. Each job then
+        needs only the memory for its KPM vectors. The work per moment is a bit higher
+        without the reordering. On a multi-socket machine, each socket (NUMA node) gets
+        its own copy which is used by the jobs running on that socket.
+    permute_only : bool
+        Keep a single scaled copy of the Hamiltonian and, for each new target index,
+        only compute the permutation which the optimization levels 1 to 4 reorder it
+        by instead of building a reordered copy. All these levels then use the CSR
+        format. Each multiplication goes through the permutation, which costs a bit
+        more per moment, but switching between targets is much cheaper. Suits many
+        target indices with few moments each, e.g. the LDOS at many positions.
+    block_size : int or 'auto'
+        Store the Hamiltonian in dense blocks of this many consecutive sites (block sparse
+        row format) at every optimization level, without reordering. This suits models
+        made of dense blocks, e.g. several orbitals per site with all-to-all hoppings or
+        whole unit cells with the "unit_cell" :meth:`.Model.set_site_order`: an index is read
+        once per block instead of once per element. With 'auto', the block size (up to 8)
+        which needs the least memory is used, if any of them needs less than the regular
+        format. Disabled by default (0).
+    symmetric_storage : bool
+        Store only the upper triangle of the Hermitian Hamiltonian at every optimization
+        level, without reordering. The optimized matrix then needs about half the memory,
+        but each multiplication covers the whole matrix on a single thread, so this is
+        slower. It's meant for Hamiltonians which wouldn't fit into memory otherwise.
+        Takes priority over `block_size`.
+    bulk_boundary : bool
+        For complex Hamiltonians, e.g. with translational symmetry: keep the real matrix
+        elements as real values and only the ones with an imaginary part (the Bloch phases
+        of the periodic boundary hoppings) as complex values, at every optimization level.
+        This replaces the ELLPACK formats of levels 3 and 4. Large periodic systems have
+        few boundary hoppings, so the matrix takes about half (double precision) or two
+        thirds (single precision) of the memory traffic. Ignored for real Hamiltonians.
+    convergence_tolerance : float
+        Opt-in early termination of the LDOS and diagonal Green's function moments.
+        They are computed in stages which double in size, and the calculation stops
+        once the kernel-damped magnitude of the latest stage is below this fraction of
+        all the moments so far, e.g. for sites in bulk-like regions where the moments
+        decay quickly. The skipped moments are taken as zero. The number of moments
+        which were actually computed is reported as `used_moments` in
+        :attr:`KernelPolynomialMethod.stats`. Several LDOS sites (`calc_ldos_vector`,
+        `calc_spatial_ldos`) are computed one by one, each with its own stop.
+        :meth:`~KernelPolynomialMethod.calc_greens_block` and absorbing boundaries
+        don't support it. Disabled by default (0).
+    indexed_values : bool
+        At level 3: also store the Hamiltonian values as 8-bit indices into a table of
+        the distinct values, as long as there are no more than 256 of them. This is
+        usually the case for models without modifiers, where the values are just the
+        few hopping and onsite energies. The LDOS and diagonal Green's function moments
+        then read a single byte per matrix element instead of a full value, which lowers
+        the memory traffic. Otherwise, the regular values are used, or the reduced ones
+        with `reduced_precision`.
+    reduced_precision : bool
+        At level 3: also store the Hamiltonian values in the 16-bit bfloat16 format for
+        the LDOS and diagonal Green's function moments. This halves the memory traffic
+        for the matrix values (relative to single precision) while the KPM vectors and
+        sums keep the full precision. The values are rounded to about 3 significant
+        digits, which is usually fine for the LDOS at a moderate broadening, but check
+        the accuracy against a regular calculation first. If `indexed_values` applies,
+        it takes priority since it's exact.
+    matrix_file : str
+        Out-of-core LDOS and diagonal Green's function moments at level 3 (single thread).
+        The optimized Hamiltonian matrix is written to this file and read back in blocks
+        of rows during the calculation, so only `interleave_depth + 1` blocks need to be
+        in memory at a time while the next one is read in the background. Each block
+        which is read is reused for `interleave_depth` iterations, so deeper passes need
+        less I/O. Put the file on fast local storage. The file is reused by the following
+        calculations for the same site and it's removed together with the KPM object.
+        The number of bytes which were read is reported as `streamed_bytes` in
+        :attr:`KernelPolynomialMethod.stats`. Empty by default: the matrix stays in memory.
+    pin_threads : bool
+        Pin each of the `num_threads` to a CPU for the duration of the calculation, so
+        every thread keeps working on the same part of the matrix in its own cache.
+        The optimized matrix and the KPM vectors are initialized by the same threads in
+        parallel, so on a multi-socket machine each thread's part is in local memory.
+    recursion : bool
+        Compute the LDOS, DOS and Green's functions with the recursion (Haydock) method
+        instead of the Chebyshev expansion: a Lanczos tridiagonalization from each target
+        index (or random vector) gives a continued fraction. For smooth spectra, it
+        usually needs fewer matrix-vector multiplications for the same broadening, which
+        is always Lorentzian here regardless of the `kernel`. The other results (e.g. the
+        raw moments, conductivity or density) still use the Chebyshev expansion.
+    termination : {'square_root', 'truncate'}
+        How the continued fraction of the `recursion` method is closed after the last level.
+        'square_root' continues it with the average coefficients of the last levels, which
+        suits bulk-like continuous spectra. 'truncate' stops it, which suits small systems
+        with discrete levels.
 
     Returns
     -------
@@ -158,10 +871,134 @@ def kpm(model, energy_range=None, kernel="default", optimization_level=3, lanczo
     if kernel == "default":
         kernel = lorentz_kernel()
     return KernelPolynomialMethod(_cpp.KPM(model, energy_range or (0, 0), kernel,
-                                           optimization_level, lanczos_precision))
+                                           _opt_level(optimization_level), lanczos_precision,
+                                           num_threads,
+                                           mixed_precision,
+                                           getattr(_cpp.KPMBoundsMethod, bounds_method),
+                                           cache_bounds, interleave_depth, split_complex,
+                                           share_matrix, permute_only, _block_size(block_size),
+                                           symmetric_storage, bulk_boundary,
+                                           convergence_tolerance,
+                                           indexed_values, reduced_precision, str(matrix_file),
+                                           pin_threads, recursion,
+                                           getattr(_cpp.KPMTermination, termination)))
+
+
+def _csr_hamiltonian(matrix):
+    """Convert a sparse matrix into a Hamiltonian for :func:`kpm_matrix`"""
+    from scipy.sparse import csr_matrix
+    matrix = csr_matrix(matrix)
+    if not matrix.has_canonical_format:
+        matrix = matrix.copy()
+        matrix.sum_duplicates()
+    if matrix.dtype.char not in "fdFD":
+        matrix = matrix.astype(np.float64)
+    return _cpp.Hamiltonian.from_csr(np.ascontiguousarray(matrix.indptr, dtype=np.int32),
+                                     np.ascontiguousarray(matrix.indices, dtype=np.int32),
+                                     np.ascontiguousarray(matrix.data), *matrix.shape,
+                                     matrix.dtype.char)
+
+
+class MatrixKPM:
+    """KPM for a Hamiltonian matrix which doesn't come from a :class:`.Model`
+
+    It should not be created directly but via :func:`kpm_matrix`. The results are in
+    terms of the matrix indices since there is no system with site positions.
+    """
 
+    def __init__(self, make_impl, matrix):
+        self._make_impl = make_impl
+        self.impl = make_impl(_csr_hamiltonian(matrix))
 
-def kpm_cuda(model, energy_range=None, kernel="default", optimization_level=1):
+    def set_matrix(self, matrix):
+        """Replace the Hamiltonian matrix, e.g. for the next step of a sweep
+
+        The optimized matrix and the energy bounds are recomputed, but the strategy is
+        reused if the scalar type is the same.
+        """
+        hamiltonian = _csr_hamiltonian(matrix)
+        if not self.impl.change_hamiltonian(hamiltonian):
+            self.impl = self._make_impl(hamiltonian)
+
+    @property
+    def stats(self):
+        """Information about the last calculation, see :attr:`KernelPolynomialMethod.stats`"""
+        return self.impl.stats
+
+    def report(self, shortform=False):
+        """Return a report of the last calculation"""
+        return self.impl.report(shortform) + "\n"
+
+    def calc_greens(self, i, j, energy, broadening):
+        """Green's function matrix element(s) at the matrix indices `i` and `j`
+
+        Parameters are the same as :meth:`KernelPolynomialMethod.calc_greens`.
+        """
+        if isinstance(j, int):
+            return self.impl.greens(i, j, energy, broadening)
+        else:
+            return self.impl.greens_vector(i, j, energy, broadening)
+
+    def calc_ldos(self, energy, broadening, index):
+        """Local density of states at the matrix `index` (a single int or an array of them)
+
+        Returns
+        -------
+        np.ndarray
+            One column for each index if `index` is an array.
+        """
+        if isinstance(index, int):
+            return self.impl.ldos(index, energy, broadening)
+        else:
+            return self.impl.ldos_vector(index, energy, broadening)
+
+    def calc_dos(self, energy, broadening, num_random=16):
+        """Density of states computed with a stochastic trace, see
+        :meth:`KernelPolynomialMethod.calc_dos`"""
+        return self.impl.dos(energy, broadening, num_random)
+
+
+def kpm_matrix(matrix, energy_range=None, kernel="default", optimization_level=3,
+               lanczos_precision=0.002, num_threads=1, **kwargs):
+    """KPM for an external Hamiltonian matrix, e.g. from another code
+
+    The matrix is converted to CSR format (if needed) and its arrays are copied once
+    into the C++ Hamiltonian, which is then reordered and rescaled for KPM as usual.
+    There is no model, so the results which need site positions or sublattices
+    are not available. A Hermitian matrix is assumed.
+
+    Parameters
+    ----------
+    matrix : scipy.sparse.spmatrix
+        Square Hamiltonian matrix with `float32`, `float64`, `complex64` or `complex128`
+        values. Other types are converted to `float64`.
+    energy_range, kernel, optimization_level, lanczos_precision, num_threads, **kwargs
+        See :func:`kpm`.
+
+    Returns
+    -------
+    :class:`~pybinding.chebyshev.MatrixKPM`
+    """
+    if kernel == "default":
+        kernel = lorentz_kernel()
+    kwargs = dict(kwargs, energy_range=energy_range or (0, 0), kernel=kernel,
+                  optimization_level=_opt_level(optimization_level),
+                  lanczos_precision=lanczos_precision, num_threads=num_threads)
+    if "bounds_method" in kwargs:
+        kwargs["bounds_method"] = getattr(_cpp.KPMBoundsMethod, kwargs["bounds_method"])
+    if "block_size" in kwargs:
+        kwargs["block_size"] = _block_size(kwargs["block_size"])
+    if "matrix_file" in kwargs:
+        kwargs["matrix_file"] = str(kwargs["matrix_file"])
+
+    def make_impl(hamiltonian):
+        return _cpp.KPMStrategy(hamiltonian, **kwargs)
+
+    return MatrixKPM(make_impl, matrix)
+
+
+def kpm_cuda(model, energy_range=None, kernel="default", optimization_level=2,
+             multi_gpu=False):
     """Same as :func:`kpm` except that it's executed on the GPU using CUDA (if supported)
 
     See :func:`kpm` for detailed parameter documentation.
@@ -172,7 +1009,17 @@ def kpm_cuda(model, energy_range=None, kernel="default", optimization_level=1):
     model : Model
     energy_range : Optional[Tuple[float, float]]
     kernel : Kernel
-    optimization_level : int
+    optimization_level : Union[int, str]
+        Level 0 disables all optimizations. Level 1 turns on matrix reordering. Level 2
+        also computes the dot products of the KPM moments within the matrix-vector
+        multiplication kernel and keeps all the intermediate results on the GPU.
+        See :func:`kpm` for 'auto'.
+    multi_gpu : bool
+        Split the random vectors of :meth:`~KernelPolynomialMethod.calc_dos` and the
+        target indices of :meth:`~KernelPolynomialMethod.calc_ldos_vector` across all visible
+        GPUs (see the `CUDA_VISIBLE_DEVICES` environment variable). Each GPU holds a copy
+        of the Hamiltonian matrix. Calculations with a single vector, e.g. Green's function
+        elements, run on the first GPU.
 
     Returns
     -------
@@ -182,13 +1029,236 @@ def kpm_cuda(model, energy_range=None, kernel="default", optimization_level=1):
         if kernel == "default":
             kernel = lorentz_kernel()
         # noinspection PyUnresolvedReferences
-        return KernelPolynomialMethod(_cpp.KPMcuda(model, energy_range or (0, 0), kernel,
-                                                   optimization_level))
+        impl = _cpp.KPMmultigpu if multi_gpu else _cpp.KPMcuda
+        return KernelPolynomialMethod(impl(model, energy_range or (0, 0), kernel,
+                                           _opt_level(optimization_level)))
     except AttributeError:
         raise Exception("The module was compiled without CUDA support.\n"
                         "Use a different KPM implementation or recompile the module with CUDA.")
 
 
+class DisorderEnsemble:
+    """KPM averages over many realizations of onsite disorder of the same model
+
+    It should not be created directly but via :func:`disorder_ensemble`.
+    """
+
+    def __init__(self, impl):
+        self.impl = impl
+
+    @property
+    def energy_range(self):
+        """The energy bounds of the clean model widened by the disorder range"""
+        return self.impl.energy_range
+
+    def calc_dos(self, energy, broadening, num_realizations, num_random=1):
+        """Calculate the DOS averaged over the first `num_realizations`
+
+        Each realization uses stochastic trace evaluation with its own `num_random`
+        random vectors, see :meth:`KernelPolynomialMethod.calc_dos`.
+
+        Parameters
+        ----------
+        energy : ndarray
+            Values for which the DOS is calculated.
+        broadening : float
+            Width, in energy, of the smallest detail which can be resolved.
+        num_realizations : int
+            Number of disorder realizations, starting from 0.
+        num_random : int
+            The number of random vectors per realization.
+
+        Returns
+        -------
+        :class:`~pybinding.DOS`
+        """
+        dos = self.impl.calc_dos(energy, broadening, num_realizations, num_random)
+        return results.DOS(energy, dos)
+
+    def calc_ldos(self, indices, energy, broadening, num_realizations):
+        """Calculate the LDOS at Hamiltonian `indices` averaged over `num_realizations`
+
+        Returns
+        -------
+        ndarray
+            2D array of shape `(energy.size, len(indices))`: one column for each index.
+        """
+        return self.impl.calc_ldos(indices, energy, broadening, num_realizations)
+
+    def dos_moments(self, num_moments, num_realizations, num_random=1):
+        """Raw KPM moments of the DOS averaged over `num_realizations`
+
+        The `data`, `a` and `b` attributes of the result are the moments and the scaling
+        factors of the Hamiltonian which are needed for the reconstruction.
+        """
+        return self.impl.dos_moments(num_moments, num_realizations, num_random)
+
+    def ldos_moments(self, indices, num_moments, num_realizations):
+        """Raw KPM moments of the LDOS averaged over `num_realizations`: one for each index"""
+        return self.impl.ldos_moments(indices, num_moments, num_realizations)
+
+
+def disorder_ensemble(model, realization, disorder_range, kernel="default",
+                      optimization_level=3, lanczos_precision=0.002, bounds_method="lanczos",
+                      num_threads=1):
+    """Create a KPM engine for averages over many realizations of onsite disorder
+
+    The system, the hoppings and the clean Hamiltonian are shared by all the realizations.
+    Only the onsite energies are rewritten for each one: the Hamiltonian isn't rebuilt,
+    the energy bounds are computed once and the matrix reordering for the target indices
+    is reused. The realizations are split between `num_threads` worker threads.
+
+    Parameters
+    ----------
+    model : Model
+        The clean model. The disorder is added to its onsite energies.
+    realization : Callable[[int], ndarray]
+        Return the onsite disorder of realization `n`: one value per Hamiltonian index.
+        It should be deterministic in `n` (e.g. use `n` as the random seed).
+    disorder_range : Tuple[float, float]
+        The lowest and highest value of the disorder in any realization. The KPM energy
+        bounds are widened by this range, so it should be as tight as possible.
+    kernel : Kernel
+    optimization_level : Union[int, str]
+    lanczos_precision : float
+    bounds_method : {'lanczos', 'warm_lanczos', 'gershgorin'}
+        See :func:`kpm` for these parameters.
+    num_threads : int
+        Number of threads which compute different realizations in parallel.
+
+    Returns
+    -------
+    :class:`~pybinding.chebyshev.DisorderEnsemble`
+    """
+    if kernel == "default":
+        kernel = lorentz_kernel()
+    return DisorderEnsemble(_cpp.disorder_ensemble(
+        model, realization, disorder_range, kernel, _opt_level(optimization_level),
+        lanczos_precision, getattr(_cpp.KPMBoundsMethod, bounds_method), num_threads
+    ))
+
+
+class SelfConsistentLoop:
+    """Self-consistent onsite potential computed entirely in C++
+
+    It should not be created directly but via :func:`self_consistent_loop`.
+    """
+
+    def __init__(self, impl):
+        self.impl = impl
+
+    def run(self, initial=None):
+        """Iterate until the potential is self-consistent or `max_iterations` is reached
+
+        Parameters
+        ----------
+        initial : Optional[ndarray]
+            Initial onsite potential: one value per Hamiltonian index, zero by default.
+
+        Returns
+        -------
+        bool
+            True if the loop converged.
+        """
+        initial = np.zeros(0) if initial is None else np.asarray(initial, dtype=np.float64)
+        return self.impl.run(initial)
+
+    @property
+    def potential(self):
+        """The onsite potential of the last iteration"""
+        return self.impl.potential
+
+    @property
+    def density(self):
+        """The electron density of the last `potential`"""
+        return self.impl.density
+
+    @property
+    def residuals(self):
+        """The residual `max|V_out - V_in|` of each iteration of the last run"""
+        return np.array(self.impl.residuals)
+
+    @property
+    def num_iterations(self):
+        return self.impl.num_iterations
+
+    @property
+    def converged(self):
+        return self.impl.converged
+
+    @property
+    def energy_range(self):
+        """The energy bounds of the current KPM scaling, which covers the potential"""
+        return self.impl.energy_range
+
+
+def self_consistent_loop(model, coupling, chemical_potential, broadening, temperature=0,
+                         background=None, num_random=16, probing_distance=0,
+                         mixing="anderson", mixing_parameter=0.3, history=5, tolerance=1e-5,
+                         max_iterations=100, kernel="default", optimization_level=3,
+                         lanczos_precision=0.002, bounds_method="lanczos"):
+    """Create a self-consistent loop of the electron density and a linear onsite potential
+
+    Each iteration computes the KPM electron density `n` (see
+    :meth:`KernelPolynomialMethod.calc_density`) of the model plus the current potential
+    and the new potential `V = coupling @ (n - background)`, e.g. a Hubbard-like diagonal
+    coupling or a discretized Coulomb interaction. The Hamiltonian is built once and only
+    its diagonal is rewritten after that. The model and its modifiers aren't called again,
+    nor is any Python code, until the loop is done.
+
+    Parameters
+    ----------
+    model : Model
+        The model without the self-consistent potential.
+    coupling : scipy.sparse matrix
+        Square real matrix with one row per Hamiltonian index.
+    chemical_potential : float
+    broadening : float
+    temperature : float
+        Fermi-Dirac distribution of the density, see
+        :meth:`KernelPolynomialMethod.calc_density` for these and the next two parameters.
+    background : Optional[ndarray]
+        Density of the neutral system, zero by default.
+    num_random : int
+    probing_distance : int
+    mixing : {'linear', 'anderson', 'broyden'}
+        How the next input potential is found from the previous iterations.
+    mixing_parameter : float
+        Fraction of the residual `V_out - V_in` which is mixed into the next input.
+    history : int
+        Number of previous iterations used by the Anderson and Broyden mixing.
+    tolerance : float
+        Converged when `max|V_out - V_in|` drops below this.
+    max_iterations : int
+    kernel : Kernel
+    optimization_level : Union[int, str]
+    lanczos_precision : float
+    bounds_method : {'lanczos', 'warm_lanczos', 'gershgorin'}
+        See :func:`kpm` for these parameters.
+
+    Returns
+    -------
+    :class:`~pybinding.chebyshev.SelfConsistentLoop`
+    """
+    from scipy.sparse import csr_matrix
+    coupling = csr_matrix(coupling, dtype=np.float64)
+    if not coupling.has_canonical_format:
+        coupling = coupling.copy()
+        coupling.sum_duplicates()
+    if kernel == "default":
+        kernel = lorentz_kernel()
+    background = np.zeros(0) if background is None else np.asarray(background, dtype=np.float64)
+    return SelfConsistentLoop(_cpp.self_consistent_loop(
+        model, chemical_potential, broadening, temperature, num_random, probing_distance,
+        np.ascontiguousarray(coupling.indptr, dtype=np.int32),
+        np.ascontiguousarray(coupling.indices, dtype=np.int32),
+        np.ascontiguousarray(coupling.data), background, getattr(_cpp.SCFMixing, mixing),
+        mixing_parameter, history, tolerance, max_iterations, kernel,
+        _opt_level(optimization_level), lanczos_precision,
+        getattr(_cpp.KPMBoundsMethod, bounds_method)
+    ))
+
+
 def jackson_kernel():
     """The Jackson kernel -- a good general-purpose kernel, appropriate for most applications
 
@@ -215,3 +1285,49 @@ def lorentz_kernel(lambda_value=4.0):
         accuracy. If in doubt, leave it at the default value of 4.
     """
     return _cpp.lorentz_kernel(lambda_value)
+
+
+def load_results(filename):
+    """Load the results written by :meth:`KernelPolynomialMethod.stream_ldos` or
+    :meth:`KernelPolynomialMethod.stream_greens`
+
+    Parameters
+    ----------
+    filename : str
+
+    Returns
+    -------
+    energy : ndarray
+        The energy points shared by all the results.
+    indices : ndarray
+        Hamiltonian index of each result: the LDOS site or the Green's function column.
+    data : ndarray
+        2D array of shape `(energy.size, indices.size)`: one column for each index.
+        Real for the LDOS and complex for the Green's function.
+    """
+    return _cpp.kpm_read_results(filename)
+
+
+def kpm_memory(model, optimization_level=3, split_complex=False, indexed_values=False,
+               reduced_precision=False):
+    """Estimate the memory of a KPM calculation before the model is built
+
+    The estimate is based on :meth:`Model.estimate_memory` and it's in addition to the
+    memory of the Hamiltonian itself. The arguments are the same as for :func:`kpm`.
+
+    Parameters
+    ----------
+    model : Model
+    optimization_level : int or 'auto'
+        The automatic level counts as the level which needs the most memory.
+    split_complex, indexed_values, reduced_precision : bool
+
+    Returns
+    -------
+    matrix_bytes : int
+        The scaled Hamiltonian and its optimized format.
+    vector_bytes : int
+        The vectors of the KPM recurrence.
+    """
+    return _cpp.kpm_estimate_memory(model.estimate_memory(), _opt_level(optimization_level),
+                                    split_complex, indexed_values, reduced_precision)
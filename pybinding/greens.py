@@ -1,9 +1,148 @@
 """Green's function computation and related methods
 
-Deprecated: use the chebyshev module instead
+The recursive Green's function method computes the transmission between the leads of a model
+and sparse LU factorizations give the Green's function at a very small broadening.
+The `Greens` alias is deprecated: use the chebyshev module for the kernel polynomial method.
 """
+import numpy as np
+
+from . import _cpp
 from .chebyshev import KernelPolynomialMethod, kpm, kpm_cuda
 
-__all__ = ['Greens', 'kpm', 'kpm_cuda']
+__all__ = ['Greens', 'kpm', 'kpm_cuda', 'transmission', 'DirectGreens', 'direct']
 
 Greens = KernelPolynomialMethod
+
+
+def transmission(model, energies, lead_from=0, lead_to=1, broadening=1e-6, num_threads=1):
+    """Two-terminal transmission using the recursive Green's function method
+
+    The system is sliced into layers between the two leads and only the dense slice blocks
+    are formed. The cost scales with the number of slices times the cube of the slice width,
+    so long devices are cheap compared to a solve of the full Hamiltonian.
+
+    Parameters
+    ----------
+    model : Model
+        Must have at least two leads, see :meth:`.Model.attach_lead`.
+    energies : array_like
+        Energy values (eV).
+    lead_from, lead_to : int
+        Indices of the two leads in :attr:`.Model.leads`.
+    broadening : float
+        Imaginary part of the energy (eV).
+    num_threads : int
+        The energies are distributed over this many threads.
+
+    Returns
+    -------
+    np.ndarray
+        The transmission at each energy.
+    """
+    energies = np.atleast_1d(energies).astype(np.float64)
+    return np.asarray(_cpp.calc_transmission(model, energies, lead_from, lead_to, broadening,
+                                             num_threads))
+
+
+class DirectGreens:
+    """Green's functions from sparse LU factorizations of `E + i*broadening - H`
+
+    It should not be created directly but via :func:`direct`.
+    """
+
+    def __init__(self, impl):
+        self.impl = impl
+
+    @property
+    def model(self):
+        """The tight-binding model holding the Hamiltonian"""
+        return self.impl.model
+
+    @model.setter
+    def model(self, model):
+        self.impl.model = model
+
+    @property
+    def num_analyses(self) -> int:
+        """Number of symbolic analyses so far: one per sparsity pattern and thread"""
+        return self.impl.num_analyses
+
+    @property
+    def num_factorizations(self) -> int:
+        """Number of numeric factorizations so far: one per energy"""
+        return self.impl.num_factorizations
+
+    def report(self, shortform=False):
+        """Return a report of the last calculation
+
+        Parameters
+        ----------
+        shortform : bool, optional
+            Return a short one line version of the report
+        """
+        return self.impl.report(shortform)
+
+    def calc_greens(self, i, j, energy, broadening):
+        """Calculate Green's function of a single Hamiltonian element (or a list of `j`)
+
+        Parameters
+        ----------
+        i : int
+            Hamiltonian index.
+        j : int or List[int]
+            Hamiltonian index or a list of them which share the same factorizations.
+        energy : ndarray
+            Energy value array (eV).
+        broadening : float
+            Imaginary part of the energy (eV). Unlike KPM, the cost doesn't depend on it.
+
+        Returns
+        -------
+        ndarray or List[ndarray]
+            Array of the same size as the input `energy` (1/eV), or one for each `j`.
+        """
+        return self.impl.calc_greens(i, j, np.atleast_1d(energy).astype(np.float64), broadening)
+
+    def calc_greens_block(self, rows, cols, energy, broadening):
+        """Calculate the block of Green's functions between all the `rows` and `cols`
+
+        Parameters
+        ----------
+        rows, cols : List[int]
+            Hamiltonian indices.
+        energy : ndarray
+            Energy value array (eV).
+        broadening : float
+            Imaginary part of the energy (eV).
+
+        Returns
+        -------
+        ndarray
+            Array of shape `(len(rows), len(cols), len(energy))`.
+        """
+        rows, cols = np.atleast_1d(rows).tolist(), np.atleast_1d(cols).tolist()
+        energy = np.atleast_1d(energy).astype(np.float64)
+        greens = self.impl.calc_greens_block(rows, cols, energy, broadening)
+        return np.array(greens).reshape(len(rows), len(cols), -1)
+
+
+def direct(model, num_threads=1):
+    """Green's functions from sparse direct solves of `E + i*broadening - H`
+
+    The symbolic analysis is done once per sparsity pattern and each energy only needs a
+    numeric factorization, so this works well for a very small broadening where KPM needs
+    too many moments. The memory grows with the fill-in of the LU factors, so it's meant for
+    moderate system sizes.
+
+    Parameters
+    ----------
+    model : Model
+        Model which will provide the Hamiltonian matrix.
+    num_threads : int
+        The energies are distributed over this many threads.
+
+    Returns
+    -------
+    :class:`~pybinding.greens.DirectGreens`
+    """
+    return DirectGreens(_cpp.DirectGreens(model, num_threads))
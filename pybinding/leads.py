@@ -33,6 +33,7 @@ class Lead:
     def __init__(self, impl: _cpp.Lead, index):
         self.impl = impl
         self.index = index
+        self._self_energy = {}
 
     @property
     def indices(self) -> np.ndarray:
@@ -83,6 +84,34 @@ class Lead:
         bands = [eigenvalues(k) for k in k_path]
         return results.Bands(k_path, np.vstack(bands))
 
+    def calc_self_energy(self, energies, broadening=1e-6, num_threads=1):
+        """Calculate the retarded self-energy of the semi-infinite lead
+
+        The surface Green's function of the lead is computed using the Sancho-Rubio
+        decimation and the results are cached per energy for the given `broadening`.
+
+        Parameters
+        ----------
+        energies : array_like
+            Energy values (eV).
+        broadening : float
+            Imaginary part of the energy (eV).
+        num_threads : int
+            The energies are distributed over this many threads.
+
+        Returns
+        -------
+        np.ndarray
+            Complex array of shape `(len(energies), n, n)` where `n = len(self.indices)`:
+            the self-energy matrix at each energy in the order of :attr:`indices`.
+        """
+        if broadening not in self._self_energy:
+            self._self_energy[broadening] = _cpp.LeadSelfEnergy(self.impl, broadening)
+        solver = self._self_energy[broadening]
+        energies = np.atleast_1d(energies).astype(np.float64)
+        result = solver.calc(energies, num_threads)
+        return np.array(result).reshape(len(energies), solver.size, solver.size)
+
     def plot(self, lead_length=6, **kwargs):
         """Plot the sites, hoppings and periodic boundaries of the lead
 
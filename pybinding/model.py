@@ -1,4 +1,8 @@
 """Main model definition interface"""
+import hashlib
+import inspect
+import warnings
+
 import numpy as np
 from scipy.sparse import csr_matrix
 
@@ -12,6 +16,163 @@ from .results import StructureMap
 __all__ = ['Model']
 
 
+def _code_fingerprint(code):
+    """Bytecode and constants, nested functions included, without memory addresses"""
+    consts = [_code_fingerprint(c) if hasattr(c, 'co_code') else repr(c)
+              for c in code.co_consts]
+    return code.co_code.hex() + repr(consts)
+
+
+def _code_names(code):
+    """Global (and attribute) names read by `code` and its nested functions"""
+    names = set(code.co_names)
+    for c in code.co_consts:
+        if hasattr(c, 'co_code'):
+            names |= _code_names(c)
+    return names
+
+
+# Values which are fully identified by their `repr`
+_primitive_types = (type(None), bool, int, float, complex, str, bytes, np.generic)
+# Libraries whose functions and classes are identified by their name
+_library_modules = ('builtins', 'math', 'cmath', 'numpy', 'scipy', 'pybinding')
+
+
+def _library_name(value):
+    """`module.name` of a function or class of the `_library_modules`, `None` otherwise"""
+    if isinstance(value, np.ufunc):
+        return "numpy." + value.__name__
+    owner = getattr(value, '__self__', None)
+    if not callable(value) or (owner is not None and not inspect.ismodule(owner)):
+        return None  # e.g. a method bound to an object with its own state
+    module = getattr(value, '__module__', None) or ""
+    name = getattr(value, '__qualname__', None) or getattr(value, '__name__', None)
+    if not name or module.split(".")[0] not in _library_modules:
+        return None
+    return module + "." + name
+
+
+def _value_fingerprint(value, seen, names=()):
+    """Identify an argument or a variable read by a function, including array contents
+
+    Only primitives, arrays, tuples and lists of those, functions, library functions and
+    classes (by name) and the attributes `names` of modules are identified. Anything else
+    may hide its state from `repr` (e.g. the default `<object at 0x...>`, whose address
+    can be reused, or sparse matrices) and it's opaque: the result is `None`. `repr`
+    abbreviates large arrays, so they are identified by a hash of their data.
+    """
+    if isinstance(value, _primitive_types):
+        return repr(value)
+    if isinstance(value, np.ndarray):
+        if value.dtype.hasobject:
+            return None
+        data = hashlib.sha1(np.ascontiguousarray(value).tobytes()).hexdigest()
+        return "ndarray({}, {}, {})".format(value.dtype, value.shape, data)
+    if isinstance(value, (tuple, list)):
+        items = [_value_fingerprint(v, seen, names) for v in value]
+        if None in items:
+            return None
+        return "{}({})".format(type(value).__name__, ", ".join(items))
+    library_name = _library_name(value)
+    if library_name:
+        return library_name
+    if inspect.isfunction(value):
+        return _function_fingerprint(value, seen)
+    if inspect.ismodule(value):
+        return _module_fingerprint(value, seen, names)
+    return None
+
+
+def _module_fingerprint(module, seen, names):
+    """The attributes of `module` which may be read by a function with the given `names`"""
+    if id(module) in seen:
+        return module.__name__
+    seen.add(id(module))
+
+    parts = [module.__name__]
+    for name in sorted(names):
+        if not hasattr(module, name):
+            continue
+        fingerprint = _value_fingerprint(getattr(module, name), seen, names)
+        if fingerprint is None:
+            return None
+        parts.append(name + "=" + fingerprint)
+    return "module(" + ", ".join(parts) + ")"
+
+
+def _function_fingerprint(func, seen):
+    """Code, default arguments, closure variables and globals which `func` reads
+
+    Returns `None` if any of them is opaque, see `_value_fingerprint`.
+    """
+    if id(func) in seen:  # e.g. recursive
+        return func.__qualname__
+    seen.add(id(func))
+
+    code = func.__code__
+    names = _code_names(code)
+    parts = [_code_fingerprint(code)]
+    parts += [_value_fingerprint(v, seen, names) for v in func.__defaults__ or ()]
+    for cell in func.__closure__ or ():
+        try:
+            parts.append(_value_fingerprint(cell.cell_contents, seen, names))
+        except ValueError:  # the variable is not assigned yet
+            parts.append("<empty>")
+    for name in sorted(names):
+        if name in func.__globals__:
+            value = _value_fingerprint(func.__globals__[name], seen, names)
+            parts.append(None if value is None else name + "=" + value)
+    return None if None in parts else "|".join(parts)
+
+
+# Parameters which are defined by functions: compiled ones can't be identified
+_opaque_kinds = (_cpp.SiteStateModifier, _cpp.PositionModifier, _cpp.OnsiteModifier,
+                 _cpp.HoppingModifier, _cpp.HoppingGenerator, _cpp.FreeformShape)
+
+
+def _fingerprint(obj):
+    """Identify a modifier or shape by its name, arguments and function
+
+    Returns `None` if the function or any of its arguments is opaque, e.g. compiled code
+    or an object which isn't identified by `_value_fingerprint`.
+    """
+    seen = set()
+    callsig = getattr(obj, 'callsig', None)
+    parts = [type(obj).__name__]
+    fingerprint = getattr(obj, 'fingerprint', "")  # compiled `_cpp.builtin` modifiers
+    if fingerprint:
+        return "|".join(parts + [fingerprint])
+    if callsig:
+        opaque = []
+
+        def fingerprint(value):
+            result = _value_fingerprint(value, seen)
+            if result is None:
+                opaque.append(value)
+            return result
+
+        parts.append(callsig._format_args(fingerprint))
+        if opaque:
+            return None
+    func = getattr(callsig, 'function', None) or getattr(obj, 'contains', None)
+    if inspect.isfunction(func):
+        parts.append(_function_fingerprint(func, seen))
+    elif isinstance(obj, _opaque_kinds):
+        return None
+    return None if None in parts else "|".join(parts)
+
+
+def _model_tag(parameters):
+    """Function which identifies the `parameters` when it's called, i.e. at build time
+
+    The tag is empty if any of them can't be identified: such models are not cached.
+    """
+    def tag():
+        parts = [_fingerprint(p) for p in parameters]
+        return "" if None in parts else ";".join(parts)
+    return tag
+
+
 class Model(_cpp.Model):
     """Builds a Hamiltonian from lattice, shape, symmetry and modifier parameters
 
@@ -38,6 +199,9 @@ class Model(_cpp.Model):
 
         self._lattice = lattice
         self._shape = None
+        self._parameters = []
+        self._cache_args = None
+        self._memory_cache_args = None
         self.add(*args)
 
     def add(self, *args):
@@ -57,9 +221,124 @@ class Model(_cpp.Model):
                 self.add(*arg)
             except TypeError:
                 super().add(arg)
+                self._parameters.append(arg)
                 if isinstance(arg, _cpp.Shape):
                     self._shape = arg
 
+    def derive(self, *args):
+        """Return a variant of this model with additional parameters
+
+        The variant shares the already built system (and leads) with this model. If
+        `args` only contain Hamiltonian parameters, i.e. onsite and hopping modifiers,
+        this model's system is built first, so that any number of variants only build
+        it once. A structural parameter (shape, symmetry, site state or position modifier,
+        hopping generator) makes the variant build a new system of its own. This model
+        is never modified.
+
+        Parameters
+        ----------
+        *args
+            Same as :meth:`add`.
+
+        Examples
+        --------
+        ::
+
+            base = pb.Model(graphene.monolayer(), pb.circle(50))
+
+            @pb.parallelize(v=np.linspace(0, 0.5, 100))
+            def factory(v, energy=np.linspace(0, 1, 200)):
+                model = base.derive(pb.constant_potential(v))  # no system build
+                kpm = pb.kpm(model)
+                return kpm.deferred_ldos(energy, broadening=0.05, position=[0, 0])
+        """
+        structural = (_cpp.Primitive, _cpp.Shape, _cpp.TranslationalSymmetry,
+                      _cpp.SiteStateModifier, _cpp.PositionModifier, _cpp.HoppingGenerator)
+        args = list(_flatten(args))
+        if not any(isinstance(arg, structural) for arg in args):
+            super().system  # build it once for all the variants
+
+        variant = type(self).__new__(type(self))
+        _cpp.Model.__init__(variant, self)
+        variant._lattice = self._lattice
+        variant._shape = self._shape
+        variant._parameters = list(self._parameters)
+        variant._cache_args = variant._memory_cache_args = None
+        # The default tags are made from the parameter list: the variant has its own
+        for set_cache, cache_args in ((variant.set_cache, self._cache_args),
+                                      (variant.set_memory_cache, self._memory_cache_args)):
+            if cache_args:
+                set_cache(*cache_args)
+        variant.add(*args)
+        return variant
+
+    def __copy__(self):
+        return self.derive()
+
+    def set_cache(self, directory, tag=None):
+        """Keep the built system and Hamiltonian in a binary file in `directory`
+
+        The filename is a hash of all the model parameters. Another model with the
+        same parameters, e.g. in a different process of a batch job, loads the file
+        instead of building the system and Hamiltonian again.
+
+        Parameters
+        ----------
+        directory : str
+            Existing directory where the cache files are kept. Empty to disable the cache.
+        tag : Optional[str]
+            Identifies the modifier and shape functions since they can't be hashed directly.
+            By default, it's made from the names, arguments and code of the Python functions,
+            along with the closure variables and globals they read, when the model is built.
+            Only numbers, strings, arrays, tuples and lists of those, functions and modules
+            are identified: any other object (e.g. a sparse matrix or an instance of a class)
+            is opaque. Compiled modifiers from `_cpp.builtin` are identified by their
+            arguments. Each native modifier gets its own id: only the models which share it
+            share a cache entry, since a freed function's address can be reused. Other
+            compiled functions are opaque. A model with anything opaque is not cached unless a `tag` describes
+            it explicitly.
+        """
+        self._cache_args = directory, tag
+        super().set_cache(directory, _model_tag(self._parameters) if tag is None else tag)
+
+    def set_memory_cache(self, enabled=True, tag=None):
+        """Share the built system and Hamiltonian with the other models of the process
+
+        Models with the same parameters, e.g. the jobs of a parallel sweep whose variable
+        only changes the post-processing or which repeat a disorder seed, build them only
+        once. The entries are shared, not copied, so the KPM bounds cache also recognizes
+        them. See :meth:`memory_cache_stats` for the hit rate.
+
+        Parameters
+        ----------
+        enabled : bool
+        tag : Optional[str]
+            Same as :meth:`set_cache`: made from the Python functions by default. It's
+            kept separately from the tag of the cache file.
+        """
+        self._memory_cache_args = enabled, tag
+        super().set_memory_cache(enabled, _model_tag(self._parameters) if tag is None else tag)
+
+    def set_site_order(self, order):
+        """Renumber the sites of the system for better memory locality
+
+        By default, the sites are numbered sublattice by sublattice, so the neighbors of
+        a site may be far apart in the Hamiltonian matrix. A different order keeps them
+        closer together, which speeds up any calculation based on sparse matrix-vector
+        multiplication (KPM, Lanczos, the `scipy` eigensolvers, etc.) for large systems.
+        The site positions and sublattices always follow the new order, and
+        :attr:`.System.original_indices` records the permutation.
+
+        Parameters
+        ----------
+        order : {'foundation', 'unit_cell', 'rcm', 'morton'}
+            'foundation' is the default. 'unit_cell' keeps the sites of each unit cell
+            together. 'rcm' is the reverse Cuthill-McKee ordering which minimizes the
+            bandwidth of the Hamiltonian matrix. 'morton' follows a space-filling curve
+            of the site positions.
+        """
+        super().set_site_order(getattr(_cpp.SiteOrder, order))
+
     def attach_lead(self, direction, contact):
         """Attach a lead to the main system
 
@@ -115,7 +394,29 @@ class Model(_cpp.Model):
     @property
     def hamiltonian(self) -> csr_matrix:
         """Hamiltonian sparse matrix in the :class:`.scipy.sparse.csr_matrix` format"""
-        return super().hamiltonian
+        hamiltonian = super().hamiltonian
+        if self.cache_error:  # the results are still fine: it's only a warning
+            warnings.warn("The cache file was not saved: " + self.cache_error, RuntimeWarning)
+        return hamiltonian
+
+    def hamiltonian_rows(self, start: int, end: int) -> csr_matrix:
+        """Rows `[start, end)` of the Hamiltonian, built without the full matrix
+
+        Each process of a distributed (e.g. `mpi4py`) calculation can build only its own
+        block of rows. The column indices are global, so the shape is `(end - start, num_sites)`.
+        The structure, i.e. :attr:`system`, is still built in full, and the block is not kept
+        by the model.
+
+        Parameters
+        ----------
+        start, end : int
+            Range of the rows (sites), `0 <= start <= end <= num_sites`.
+
+        Returns
+        -------
+        :class:`~scipy.sparse.csr_matrix`
+        """
+        return super().hamiltonian_rows(start, end).csrref
 
     @property
     def lattice(self) -> Lattice:
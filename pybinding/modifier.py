@@ -3,6 +3,7 @@
 Used to create functions which express some feature of a tight-binding model,
 such as various fields, defects or geometric deformations.
 """
+import ctypes
 import inspect
 import functools
 from collections import defaultdict
@@ -17,7 +18,7 @@ from .utils.misc import decorator_decorator
 
 __all__ = ['constant_potential', 'force_double_precision', 'hopping_energy_modifier',
            'hopping_generator', 'onsite_energy_modifier', 'site_position_modifier',
-           'site_state_modifier']
+           'site_state_modifier', 'native_onsite_modifier', 'native_hopping_modifier']
 
 
 def _make_alias_array(obj):
@@ -395,6 +396,80 @@ def force_double_precision():
     return f
 
 
+def _native_address(function):
+    """The address of a numba `cfunc`, a ctypes function pointer or a plain int
+
+    A null pointer gives 0, which the modifier rejects.
+    """
+    if hasattr(function, "address"):
+        return function.address
+    if isinstance(function, int):
+        return function
+    return ctypes.cast(function, ctypes.c_void_p).value or 0
+
+
+def native_onsite_modifier(function, complex=False, double=False):
+    """Onsite energy modifier from a compiled function, e.g. a numba `cfunc`
+
+    Unlike :func:`onsite_energy_modifier`, the function is called without the GIL and
+    without creating any numpy arrays. The model may apply it to several chunks of sites
+    in parallel (see :meth:`.Model.set_num_threads`), so it must be thread-safe.
+
+    Parameters
+    ----------
+    function : numba cfunc or ctypes function pointer or int
+        A C function with the signature `void (double* energy, float const* x,
+        float const* y, float const* z, int8_t const* sub_id, int64_t n)`. It modifies the
+        `n` values of `energy` in place: interleaved (real, imag) pairs if `complex`.
+        A real function only sees the real part of a complex Hamiltonian. The modifier
+        keeps a reference to it, so it isn't freed while it's in use. A plain int address
+        must be kept valid by the caller.
+    complex : bool
+        The function produces complex energies.
+    double : bool
+        Requires the model to use double precision floating point values. The function
+        always sees double precision values.
+
+    Examples
+    --------
+    ::
+
+        import math
+        from numba import cfunc, types, carray
+
+        sig = types.void(types.CPointer(types.float64), types.CPointer(types.float32),
+                         types.CPointer(types.float32), types.CPointer(types.float32),
+                         types.CPointer(types.int8), types.int64)
+
+        @cfunc(sig, nopython=True)
+        def wavy(energy_ptr, x_ptr, y_ptr, z_ptr, sub_ptr, n):
+            energy, x = carray(energy_ptr, n), carray(x_ptr, n)
+            for i in range(n):
+                energy[i] += math.sin(0.6 * x[i])**2
+
+        model = pb.Model(..., pb.native_onsite_modifier(wavy))
+    """
+    return _cpp.builtin.native_onsite(_native_address(function), complex, double, owner=function)
+
+
+def native_hopping_modifier(function, complex=False, double=False):
+    """Hopping energy modifier from a compiled function, e.g. a numba `cfunc`
+
+    See :func:`native_onsite_modifier`. The function signature is `void (double* energy,
+    float const* x1, float const* y1, float const* z1, float const* x2, float const* y2,
+    float const* z2, int8_t const* hop_id, int64_t n)`.
+
+    Parameters
+    ----------
+    function : numba cfunc or ctypes function pointer or int
+    complex : bool
+        The function produces complex energies, e.g. a Peierls phase.
+    double : bool
+        Requires the model to use double precision floating point values.
+    """
+    return _cpp.builtin.native_hopping(_native_address(function), complex, double, owner=function)
+
+
 def _make_generator(func, kind, name, energy, keywords):
     """Turn a regular function into a generator of the desired kind
 
@@ -1,5 +1,7 @@
 """Multi-threaded functions for parameter sweeps"""
+import os
 import sys
+import hashlib
 import inspect
 import itertools
 from copy import copy
@@ -26,7 +28,86 @@ def _sequential_for(sequence, produce, retire):
         retire(deferred, idx)
 
 
-def _parallel_for(sequence, produce, retire, num_threads=num_cores, queue_size=num_cores):
+def _checkpoint_key(sequence, callsig=None):
+    """Identify a loop by a hash of its `sequence` and the call which made it, if any
+
+    It's stored in the header of the checkpoint file, so a different loop doesn't resume
+    from it. Arrays are hashed by their contents since `repr` abbreviates them.
+
+    Returns
+    -------
+    int
+        A signed 64-bit value, as stored in the file.
+    """
+    def fingerprint(value):
+        if isinstance(value, np.ndarray):
+            data = hashlib.sha1(np.ascontiguousarray(value).tobytes()).hexdigest()
+            return "ndarray({}, {}, {})".format(value.dtype, value.shape, data)
+        return repr(value)
+
+    h = hashlib.sha1()
+    for value in sequence:
+        h.update(fingerprint(value).encode())
+    if callsig:
+        h.update(callsig.function.__qualname__.encode())
+        h.update(callsig._format_args(fingerprint).encode())
+    return int.from_bytes(h.digest()[:8], 'little', signed=True)
+
+
+def _read_checkpoint(filename, size=None, key=None):
+    """Read the results of a previous (interrupted) `_parallel_for` with the same `checkpoint`
+
+    An incomplete record at the end of the file is truncated away, so the file can be
+    appended to again. See `CheckpointFile` in the C++ module for the format.
+
+    Parameters
+    ----------
+    filename : str
+    size, key : int, optional
+        Length of the sequence and `_checkpoint_key` of the loop which is about to resume.
+        If the file was written by a different loop, it raises instead of mixing results.
+
+    Returns
+    -------
+    dict
+        A result array for each completed index. Empty if the file doesn't exist yet.
+    """
+    try:
+        with open(filename, 'rb') as file:
+            raw = file.read()
+    except FileNotFoundError:
+        return {}
+
+    header_size, record_header_size = 32, 16
+    if len(raw) < header_size:
+        os.remove(filename)  # the header itself was cut short
+        return {}
+    version, file_size, file_key = np.frombuffer(raw, np.int64, 3, 8)
+    if raw[:8] != b"PBCHKPNT" or version != 2:
+        raise RuntimeError("Invalid checkpoint file: {}".format(filename))
+    if (size is not None and file_size != size) or (key is not None and file_key != key):
+        raise RuntimeError("The checkpoint file {} was written by a different loop (sequence "
+                           "or parameters): delete it to start over".format(filename))
+
+    results = {}
+    position = header_size
+    while position + record_header_size <= len(raw):
+        idx, num_values = np.frombuffer(raw, np.int64, 2, position)
+        end = position + record_header_size + 8 * num_values
+        if end > len(raw):
+            break
+        results[int(idx)] = np.frombuffer(raw, np.float64, num_values,
+                                          position + record_header_size).copy()
+        position = end
+
+    if position < len(raw):
+        os.truncate(filename, position)
+    return results
+
+
+def _parallel_for(sequence, produce, retire, num_threads=num_cores, queue_size=num_cores,
+                  costs=None, pin_threads=False, checkpoint=None, checkpoint_key=None,
+                  skip=None):
     """Multi-threaded for loop
 
     See the implementation of `_sequential_for` to get the basic idea. This parallel
@@ -43,15 +124,37 @@ def _parallel_for(sequence, produce, retire, num_threads=num_cores, queue_size=n
         The for loop will iterate over this.
     produce : callable
         Takes a value from `sequence` and returns a `Deferred` compute object.
-    retire : callable
+    retire : callable or None
         Takes the computed `Deferred` object and 'idx' which indicates the index
-        of the value in `sequence` which was just computed.
+        of the value in `sequence` which was just computed. The finished jobs are
+        retired in batches with a single GIL lock per batch. If `None`, the results
+        (which must be arrays of the same size) are copied into a single array in C++
+        without calling back into Python. That array is returned with a row for each
+        value in `sequence`.
     num_threads : int
         Number of thread that will run in parallel.
     queue_size : int
         Number of `Deferred` jobs to be queued up for consumption by the worker
         threads. The maximum number of jobs that will be kept in memory at any
         one time will be `queue_size` + `num_threads`.
+    costs : array_like, optional
+        Estimated relative cost of each value in `sequence`. If given, the most
+        expensive jobs are started first and idle threads steal work from busy ones,
+        so a long job doesn't end up running alone at the end of the loop. `retire`
+        is still called with the original `idx`.
+    pin_threads : bool
+        Pin each compute thread to a CPU while the loop runs. The threads are taken
+        from a process-wide pool and reused by later calls either way.
+    checkpoint : str, optional
+        Append each retired result (which must be an array) to this binary file as soon
+        as it's computed. It's written by the retirement thread in C++ and can be read
+        back with `_read_checkpoint` to resume an interrupted loop.
+    checkpoint_key : int, optional
+        Identifies the loop in the header of the checkpoint file, see `_checkpoint_key`.
+        By default, it's made from the `sequence`.
+    skip : list of int, optional
+        Indices of `sequence` which are not produced or computed, e.g. the ones which
+        were completed before a checkpoint.
 
     Examples
     --------
@@ -66,8 +169,18 @@ def _parallel_for(sequence, produce, retire, num_threads=num_cores, queue_size=n
             print(deferred.result)
 
         _parallel_for(np.linspace(0, 1, 50), produce, retire)
+
+    Returns
+    -------
+    np.ndarray or None
+        The results if `retire` is `None`.
     """
-    _cpp.parallel_for(sequence, produce, retire, num_threads, queue_size)
+    costs = [] if costs is None else [float(c) for c in costs]
+    if checkpoint and checkpoint_key is None:
+        checkpoint_key = _checkpoint_key(sequence)
+    return _cpp.parallel_for(sequence, produce, retire, num_threads, queue_size, costs,
+                             pin_threads, str(checkpoint or ""), checkpoint_key or 0,
+                             list(skip or []))
 
 
 class Hooks:
@@ -108,6 +221,18 @@ class Config:
         A 0 to 100 percentage points interval to save and plot the data.
     pbar_fd : {sys.stdout, sys.stderr, None}
         Output stream. The progress bar is always the last line of output.
+    cost : callable or None
+        Takes the same arguments as the `produce` function and returns an estimate of
+        the relative cost of that job, e.g. the system size or the number of KPM moments.
+        Forwarded to `_parallel_for` as `costs`.
+    pin_threads : bool
+        Forwarded to `_parallel_for`.
+    checkpoint : str or None
+        Name of a file which receives every result as soon as it's computed. If the file
+        already exists, the sweep resumes: the values of the sequence which are already in
+        the file are not computed again. Useful on preemptible machines. Delete the file
+        to start over. A file which was written by a sweep with a different sequence or
+        different arguments is refused with an error.
     """
     def __init__(self, callsig, num_threads, queue_size):
         self.callsig = callsig
@@ -117,6 +242,9 @@ class Config:
         self.filename = self.make_filename(callsig)
         self.save_every = 10.0
         self.pbar_fd = sys.stdout
+        self.cost = None
+        self.pin_threads = False
+        self.checkpoint = None
 
     def make_save_set(self, total):
         save_at = {int(total * p) for p in np.arange(0, 1, self.save_every / 100)}
@@ -207,11 +335,19 @@ class ParallelFor:
         logname = self.config.filename + ".log" if self.config.filename else ""
         self.pbar = progressbar.ProgressBar(size, stream=self.config.pbar_fd, filename=logname)
 
-        if self.config.num_threads == 1:
+        if self.config.num_threads == 1 and not self.config.checkpoint:
             self.loop = _sequential_for
         else:
+            costs = None
+            if self.config.cost:
+                costs = [self.config.cost(*var, **factory.fixtures) for var in factory.sequence]
+            key = None
+            if self.config.checkpoint:
+                key = _checkpoint_key(factory.sequence, self.config.callsig)
             self.loop = partial(_parallel_for, num_threads=self.config.num_threads,
-                                queue_size=self.config.queue_size)
+                                queue_size=self.config.queue_size, costs=costs,
+                                pin_threads=self.config.pin_threads,
+                                checkpoint=self.config.checkpoint, checkpoint_key=key)
 
         self.called_first = False
         self.result = None
@@ -272,10 +408,44 @@ class ParallelFor:
         except Exception as err:
             print(err)
 
+    def _is_silent(self):
+        """Nothing needs to be done in Python for each job: no status, saving or plotting"""
+        return (not self.hooks.status and not self.config.filename
+                and self.config.pbar_fd is None)
+
+    def _resume(self):
+        """Restore the results of an interrupted run from the checkpoint file, if any"""
+        if not self.config.checkpoint:
+            return self.loop
+
+        done = _read_checkpoint(self.config.checkpoint, len(self.factory.sequence),
+                                self.loop.keywords['checkpoint_key'])
+        for idx, result in done.items():
+            self.data[idx] = result
+        return partial(self.loop, skip=sorted(done))
+
     def __call__(self):
         self.called_first = False
+        loop = self._resume()
+        num_done = sum(d is not None for d in self.data)
+
+        if self.loop is not _sequential_for and self._is_silent():
+            # The results are stored in C++ and all of them are retired at the end
+            try:
+                results = loop(self.factory.sequence, self._produce, None)
+            except ValueError:
+                pass  # not real arrays of the same size: the loop stops and they're retired below
+            else:
+                if len(results):
+                    self.data = [d if d is not None else r for d, r in zip(self.data, results)]
+                self.result = self._make_result(self.data)
+                return self.result
+
         with self.pbar:
-            self.loop(self.factory.sequence, self._produce, self._retire)
+            self.pbar += num_done
+            loop(self.factory.sequence, self._produce, self._retire)
+        if num_done == len(self.data):
+            self.result = self._make_result(self.data)
         return self.result
 
 
@@ -4,9 +4,10 @@ The :class:`.Solver` class is the main interface for dealing with eigenvalue pro
 is made to work specifically with pybinding's :class:`.Model` objects, but it may use any
 eigensolver algorithm under the hood.
 
-A few different algorithms are provided out of the box: the :func:`.lapack`, :func:`.arpack`
-and :func:`.feast` functions return concrete :class:`.Solver` implementation using the LAPACK,
-ARPACK and FEAST algorithms, respectively.
+A few different algorithms are provided out of the box: the :func:`.lapack`, :func:`.arpack`,
+:func:`.lanczos`, :func:`.chebfilter` and :func:`.feast` functions return concrete
+:class:`.Solver` implementation using the LAPACK, ARPACK, native thick-restart Lanczos,
+Chebyshev-filtered subspace iteration and FEAST algorithms, respectively.
 
 The :class:`.Solver` may easily be extended with new eigensolver algorithms. All that is
 required is a function which takes a Hamiltonian matrix and returns the computed
@@ -23,7 +24,7 @@ from .model import Model
 from .system import System
 from .support.pickle import pickleable
 
-__all__ = ['Solver', 'arpack', 'feast', 'lapack']
+__all__ = ['Solver', 'arpack', 'chebfilter', 'dense', 'feast', 'feast_sweep', 'lanczos', 'lapack']
 
 
 @pickleable(impl='system. eigenvalues eigenvectors')
@@ -162,7 +163,7 @@ class Solver:
             probability = np.sum(probability, axis=1)
         return results.StructureMap.from_system(probability, self.system)
 
-    def calc_dos(self, energies, broadening):
+    def calc_dos(self, energies, broadening, num_threads=1):
         r"""Calculate the density of states as a function of energy
 
         .. math::
@@ -178,19 +179,73 @@ class Solver:
             Values for which the DOS is calculated.
         broadening : float
             Controls the width of the Gaussian broadening applied to the DOS.
+        num_threads : int
+            The energies are split between this many threads. Only used by the
+            solvers implemented in C++.
 
         Returns
         -------
         :class:`~pybinding.DOS`
         """
         if hasattr(self.impl, 'calc_dos'):
-            return results.DOS(energies, self.impl.calc_dos(energies, broadening))
+            return results.DOS(energies, self.impl.calc_dos(energies, broadening, num_threads))
         else:
             scale = 1 / (broadening * math.sqrt(2 * math.pi))
             delta = self.eigenvalues[:, np.newaxis] - energies
             dos = scale * np.sum(np.exp(-0.5 * delta**2 / broadening**2), axis=0)
             return results.DOS(energies, dos)
 
+    def deferred_dos(self, energies, broadening):
+        """Same as :meth:`calc_dos` but for parallel computation: see the :mod:`.parallel` module
+
+        Only available for the solvers implemented in C++. Combined with a shared
+        :class:`FEASTSweep`, the jobs of a parallel sweep reuse each other's subspaces.
+
+        Parameters
+        ----------
+        energies : array_like
+            Values for which the DOS is calculated.
+        broadening : float
+            Controls the width of the Gaussian broadening applied to the DOS.
+
+        Returns
+        -------
+        Deferred
+        """
+        return self.impl.deferred_dos(energies, broadening)
+
+    def deferred_spatial_ldos(self, energy, broadening):
+        """Same as :meth:`calc_spatial_ldos` but for parallel computation: see the :mod:`.parallel` module
+
+        Only available for the solvers implemented in C++. The result is the plain array
+        of LDOS values, one for each site, instead of a :class:`~pybinding.StructureMap`.
+
+        Parameters
+        ----------
+        energy : float
+            The energy value for which the spatial LDOS is calculated.
+        broadening : float
+            Controls the width of the Gaussian broadening applied to the DOS.
+
+        Returns
+        -------
+        Deferred
+        """
+        return self.impl.deferred_spatial_ldos(energy, broadening)
+
+    def deferred_eigenvalues(self):
+        """Solve the eigenvalue problem for parallel computation: see the :mod:`.parallel` module
+
+        Only available for the solvers implemented in C++. The result is the array of
+        :attr:`eigenvalues` (in double precision). The eigenvectors stay with the solver
+        and can be read in the `retire` function, e.g. for FEAST sweeps.
+
+        Returns
+        -------
+        Deferred
+        """
+        return self.impl.deferred_eigenvalues()
+
     def calc_ldos(self, energies, broadening, position, sublattice=""):
         r"""Calculate the local density of states as a function of energy at the given position
 
@@ -234,7 +289,7 @@ class Solver:
             ldos = scale * np.sum(psi2[:, np.newaxis] * gaussian, axis=0)
             return results.LDOS(energies, ldos)
 
-    def calc_spatial_ldos(self, energy, broadening):
+    def calc_spatial_ldos(self, energy, broadening, num_threads=1):
         r"""Calculate the spatial local density of states at the given energy
 
         .. math::
@@ -251,13 +306,16 @@ class Solver:
             The energy value for which the spatial LDOS is calculated.
         broadening : float
             Controls the width of the Gaussian broadening applied to the DOS.
+        num_threads : int
+            The sites are split between this many threads. Only used by the
+            solvers implemented in C++.
 
         Returns
         -------
         :class:`~pybinding.StructureMap`
         """
         if hasattr(self.impl, 'calc_spatial_ldos'):
-            ldos = self.impl.calc_spatial_ldos(energy, broadening)
+            ldos = self.impl.calc_spatial_ldos(energy, broadening, num_threads)
         else:
             scale = 1 / (broadening * math.sqrt(2 * math.pi))
             gaussian = np.exp(-0.5 * (self.eigenvalues - energy)**2 / broadening**2)
@@ -266,6 +324,35 @@ class Solver:
 
         return results.StructureMap.from_system(ldos, self.system)
 
+    def stream_spatial_ldos(self, energies, broadening):
+        """Compute the spatial LDOS at the given energies while solving
+
+        The eigenvectors are passed on as soon as they are computed and they are not kept
+        afterwards, so the memory held between calculations is just `num_sites *
+        len(energies)` instead of `num_sites * num_eigenvalues`. This doesn't lower the peak
+        memory of the solve itself: each solver still needs its working subspace (FEAST's
+        subspace, the Lanczos basis or the filtered block of :func:`chebfilter`), which is
+        about the size of the eigenvectors. When even that is too large, the LDOS can come
+        from the kernel polynomial method instead, which only keeps a few vectors and can
+        also stream the Hamiltonian from a file (the `matrix_file` of :func:`.kpm`).
+
+        After this, :meth:`calc_spatial_ldos` can only be used with one of these `energies`
+        and the same `broadening`, and :attr:`eigenvectors` is not available.
+        :meth:`calc_dos` works as usual since it only needs the eigenvalues.
+
+        Call with an empty `energies` list to go back to keeping the eigenvectors. Solvers
+        implemented in Python always keep the eigenvectors, so this is a no-op for them.
+
+        Parameters
+        ----------
+        energies : array_like
+            Target energies for :meth:`calc_spatial_ldos`.
+        broadening : float
+            Controls the width of the Gaussian broadening applied to the LDOS.
+        """
+        if hasattr(self.impl, 'stream_spatial_ldos'):
+            self.impl.stream_spatial_ldos(np.atleast_1d(energies), broadening)
+
     def calc_bands(self, k0, k1, *ks, step=0.1):
         """Calculate the band structure on a path in reciprocal space
 
@@ -408,6 +495,32 @@ def lapack(model, **kwargs):
     return Solver(_SolverPythonImpl(solver_func, model, **kwargs))
 
 
+def dense(model, energy_range=None, num_threads=0):
+    """Native dense :class:`.Solver` for small and medium models
+
+    Like :func:`lapack`, this diagonalizes the full Hamiltonian as a dense matrix, but the
+    calculation stays in C++: the dense matrix is filled directly from the sparse one and
+    :meth:`~.Solver.calc_dos` and :meth:`~.Solver.calc_spatial_ldos` don't copy the results
+    through Python. The LAPACK `heevr` driver is used if the extension module was compiled
+    with MKL, otherwise Eigen's dense solver.
+
+    Parameters
+    ----------
+    model : Model
+        Model which will provide the Hamiltonian matrix.
+    energy_range : Optional[tuple of float]
+        Only keep the eigenvalues (and eigenvectors) between these two energies.
+        With MKL, the others are not computed at all. The default is all of them.
+    num_threads : int
+        The number of LAPACK threads (MKL only). The default is the library's setting.
+
+    Returns
+    -------
+    :class:`~pybinding.solver.Solver`
+    """
+    return Solver(_cpp.Dense(model, energy_range or (0, 0), num_threads))
+
+
 def arpack(model, k, sigma=0, **kwargs):
     """ARPACK :class:`.Solver` implementation for sparse matrices
 
@@ -440,7 +553,83 @@ def arpack(model, k, sigma=0, **kwargs):
     return Solver(_SolverPythonImpl(eigsh, model, k=k, sigma=sigma, **kwargs))
 
 
-def feast(model, energy_range, initial_size_guess, recycle_subspace=False, is_verbose=False):
+def lanczos(model, k, sigma=0, mode="shift_invert", num_threads=1, subspace_size=0,
+            tolerance=0):
+    """Native thick-restart Lanczos :class:`.Solver` for sparse matrices
+
+    Like :func:`arpack`, this computes a small number of eigenvalues and eigenvectors
+    closest to `sigma`, but the calculation stays in C++: the Hamiltonian doesn't need
+    to be copied and the matrix-vector multiplications may use several threads.
+
+    Parameters
+    ----------
+    model : Model
+        Model which will provide the Hamiltonian matrix.
+    k : int
+        The desired number of eigenvalues and eigenvectors.
+    sigma : float, optional
+        Look for eigenvalues near `sigma`.
+    mode : {'shift_invert', 'folded'}
+        'shift_invert' factorizes `H - sigma` which converges quickly but needs extra
+        memory for the factorization. 'folded' works with `(H - sigma)^2` using only
+        matrix-vector multiplication: it needs no extra memory but converges slowly.
+    num_threads : int
+        The number of threads which share the matrix-vector multiplications.
+    subspace_size : int
+        The number of Lanczos vectors. The default is `max(2*k + 1, 20)`.
+    tolerance : float
+        Accuracy of the eigenvalues relative to the norm of the Lanczos operator. The default
+        depends on the precision of the Hamiltonian: the square root of the machine epsilon.
+
+    Returns
+    -------
+    :class:`~pybinding.solver.Solver`
+    """
+    if sigma == 0 and mode == "shift_invert":
+        # same as `arpack`: `H - sigma` is often singular when sigma is exactly zero
+        sigma = np.finfo(model.hamiltonian.dtype).eps
+    return Solver(_cpp.Lanczos(model, k, sigma, getattr(_cpp.LanczosMode, mode),
+                               subspace_size, tolerance, num_threads))
+
+
+def chebfilter(model, energy_range, initial_size_guess, filter_degree=0, tolerance=0,
+               num_threads=1):
+    """Chebyshev-filtered subspace iteration :class:`.Solver` for sparse matrices
+
+    Computes all the eigenvalues and eigenvectors within `energy_range`, like :func:`feast`,
+    but without any matrix factorization. The only large operations are multiplications of
+    the sparse Hamiltonian with a block of vectors, so the memory usage stays low and the
+    work is easily split among threads. This makes it suitable for very large systems.
+
+    Parameters
+    ----------
+    model : Model
+        Model which will provide the Hamiltonian matrix.
+    energy_range : tuple of float
+        The lowest and highest eigenvalue between which to compute the solutions.
+    initial_size_guess : int
+        Initial guess for the number of eigenvalues in `energy_range`. The subspace is
+        enlarged automatically if it's too small, but for optimal performance this should
+        be around 1.5 * actual_size.
+    filter_degree : int
+        Degree of the Chebyshev polynomial filter, at least 2. The default is chosen
+        automatically based on the width of `energy_range` relative to the full spectrum.
+    tolerance : float
+        Relative accuracy of the eigenpairs. The default depends on the precision of
+        the Hamiltonian: the square root of the machine epsilon.
+    num_threads : int
+        The number of threads which share the matrix multiplications.
+
+    Returns
+    -------
+    :class:`~pybinding.solver.Solver`
+    """
+    return Solver(_cpp.ChebFilter(model, energy_range, initial_size_guess, filter_degree,
+                                  tolerance, num_threads))
+
+
+def feast(model, energy_range, initial_size_guess, recycle_subspace=False, is_verbose=False,
+          num_threads=1, sweep=None, sweep_index=0):
     """FEAST :class:`.Solver` implementation for sparse matrices
 
     This solver is only available if the C++ extension module was compiled with FEAST.
@@ -463,6 +652,14 @@ def feast(model, energy_range, initial_size_guess, recycle_subspace=False, is_ve
         gradually as a function of the wave vector. It may hurt performance otherwise.
     is_verbose : bool, optional
         Show the raw output from the FEAST routine.
+    num_threads : int, optional
+        The contour points are factorized and solved concurrently on this many threads.
+        The default of 1 calls MKL's FEAST routine which handles the points one at a time.
+    sweep : FEASTSweep, optional
+        Shared by the solvers of a parameter sweep: a solver which has no previous data
+        starts from the subspace of the nearest sweep point which was already computed.
+    sweep_index : int, optional
+        Position of this solver's point in the `sweep`.
 
     Returns
     -------
@@ -471,7 +668,28 @@ def feast(model, energy_range, initial_size_guess, recycle_subspace=False, is_ve
     try:
         # noinspection PyUnresolvedReferences
         return Solver(_cpp.FEAST(model, energy_range, initial_size_guess,
-                                 recycle_subspace, is_verbose))
+                                 recycle_subspace, is_verbose, num_threads, sweep, sweep_index))
+    except AttributeError:
+        raise Exception("The module was compiled without the FEAST solver.\n"
+                        "Use a different solver or recompile the module with FEAST.")
+
+
+def feast_sweep(capacity=8):
+    """Subspaces shared between the :func:`feast` solvers of a parameter sweep
+
+    Parameters
+    ----------
+    capacity : int
+        At most this many subspaces are kept. The ones farthest from the newest
+        sweep point are dropped first.
+
+    Returns
+    -------
+    FEASTSweep
+    """
+    try:
+        # noinspection PyUnresolvedReferences
+        return _cpp.FEASTSweep(capacity)
     except AttributeError:
         raise Exception("The module was compiled without the FEAST solver.\n"
                         "Use a different solver or recompile the module with FEAST.")
@@ -0,0 +1,84 @@
+"""Share sparse matrices between processes through memory-mapped files"""
+import os
+import shutil
+import tempfile
+import weakref
+
+import numpy as np
+from scipy.sparse import csr_matrix
+
+__all__ = ['SharedCSR', 'share']
+
+_array_names = ('data', 'indices', 'indptr')
+
+
+def _default_directory():
+    """Prefer a RAM-backed filesystem: the mapped pages are then plain shared memory"""
+    shm = '/dev/shm'
+    if os.path.isdir(shm) and os.access(shm, os.W_OK):
+        return shm
+    else:
+        return tempfile.gettempdir()
+
+
+class SharedCSR:
+    """A CSR matrix stored in memory-mapped files which is pickled by reference
+
+    Pickling only transfers the path of the files, e.g. when the object is sent to a
+    :mod:`multiprocessing` worker or saved with :func:`pybinding.save`. The receiving process
+    maps the same files so all the processes on a machine share the same physical pages and
+    the matrix data is never serialized or copied.
+
+    Use :func:`share` to create one. The files are removed once the original object created
+    by :func:`share` is garbage collected. Processes which already mapped the matrix keep
+    their view, but objects unpickled after that point will fail to load.
+
+    Attributes
+    ----------
+    matrix : :class:`~scipy.sparse.csr_matrix`
+        Read-only matrix with the data, indices and indptr arrays mapped from the files.
+    path : str
+        Directory which holds the files.
+    """
+    def __init__(self, path, shape):
+        self.path = path
+        self.shape = tuple(shape)
+        arrays = (np.load(os.path.join(path, name + '.npy'), mmap_mode='r')
+                  for name in _array_names)
+        self.matrix = csr_matrix(tuple(arrays), shape=self.shape, copy=False)
+
+    def __reduce__(self):
+        return SharedCSR, (self.path, self.shape)
+
+    def __repr__(self):
+        return "SharedCSR(path={!r}, shape={})".format(self.path, self.shape)
+
+
+def share(matrix, directory=None):
+    """Write a sparse matrix to memory-mapped files which other processes can map directly
+
+    The C++ Hamiltonian is already exposed to Python without a copy, e.g. as
+    :attr:`.Model.hamiltonian`, so its arrays are written to the files exactly once. After
+    that, the :class:`SharedCSR` result can be sent to any number of processes for free.
+
+    Parameters
+    ----------
+    matrix : scipy.sparse matrix
+        Converted to CSR if needed.
+    directory : Optional[str]
+        Where to keep the files. The default is `/dev/shm` when it's available, otherwise
+        the system's temporary directory. A directory on a shared filesystem may be used
+        to share the matrix between cluster nodes.
+
+    Returns
+    -------
+    :class:`SharedCSR`
+    """
+    matrix = matrix.tocsr()
+    path = tempfile.mkdtemp(prefix='pybinding-csr-', dir=directory or _default_directory())
+    for name in _array_names:
+        np.save(os.path.join(path, name + '.npy'), getattr(matrix, name))
+
+    shared = SharedCSR(path, matrix.shape)
+    weakref.finalize(shared, shutil.rmtree, path, ignore_errors=True)
+    return shared
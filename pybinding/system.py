@@ -186,20 +186,36 @@ class System:
         """List of :class:`.Boundary`"""
         return self.impl.boundaries
 
-    def find_nearest(self, position, at_sublattice=""):
+    @property
+    def original_indices(self) -> np.ndarray:
+        """Index of each site in the default order, empty if the sites were not reordered
+
+        See :meth:`.Model.set_site_order`.
+        """
+        return self.impl.original_indices
+
+    def find_nearest(self, position, at_sublattice="", num_threads=1):
         """Find the index of the atom closest to the given position
 
+        The search uses a grid of the site positions which is built on the first call.
+
         Parameters
         ----------
         position : array_like
-            Where to look.
+            Where to look. A 2D array with one position per row finds the nearest
+            site for each of them at once.
         at_sublattice : Optional[int]
             Look for a specific sublattice site. By default any will do.
+        num_threads : int
+            Split a batch of positions between this many threads.
 
         Returns
         -------
-        int
+        int or np.ndarray
         """
+        if np.ndim(position) == 2:
+            x, y, z = _split_xyz(position)
+            return self.impl.find_nearest_many(x, y, z, at_sublattice, num_threads)
         if hasattr(self.impl, 'find_nearest'):
             # use cpp implementation
             return self.impl.find_nearest(position, at_sublattice)
@@ -209,6 +225,25 @@ class System:
             sites = Sites(self.positions, self.sublattices)
             return sites.find_nearest(position, at_sublattice)
 
+    def find_within(self, position, radius, at_sublattice=""):
+        """Find the indices of all the atoms within `radius` of the given position
+
+        Parameters
+        ----------
+        position : array_like
+            Center of the search.
+        radius : float
+            Include the sites at this distance or closer.
+        at_sublattice : Optional[int]
+            Look for a specific sublattice site. By default any will do.
+
+        Returns
+        -------
+        np.ndarray
+            Site indices in ascending order.
+        """
+        return self.impl.find_within(position, radius, at_sublattice)
+
     def plot(self, num_periods=1, **kwargs):
         """Plot the structure: sites, hoppings and periodic boundaries (if any)
 
@@ -275,6 +310,14 @@ def decorate_structure_plot(axes='xy', add_margin=True, **_):
         pltutils.despine()
 
 
+def _split_xyz(positions):
+    """Split an array of positions (one per row) into contiguous float32 x, y, z columns"""
+    positions = np.asarray(positions, dtype=np.float32)
+    columns = [np.ascontiguousarray(positions[:, i]) for i in range(positions.shape[1])]
+    columns += [np.zeros(len(positions), np.float32)] * (3 - len(columns))
+    return columns[:3]
+
+
 def _rotate(position, axes):
     """Rotate axes in position"""
     missing_axes = set('xyz') - set(axes)
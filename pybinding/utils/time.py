@@ -1,6 +1,6 @@
 import time
 
-__all__ = ['tic', 'toc', 'timed', 'pretty_duration']
+__all__ = ['tic', 'toc', 'timed', 'traced', 'pretty_duration']
 
 _tic_times = []
 
@@ -55,6 +55,50 @@ def timed(message=""):
     return _Timed(message)
 
 
+class _Traced:
+    def __init__(self, filename=None):
+        self.filename = filename
+        self.events = []
+
+    def __enter__(self):
+        from .. import _cpp
+        _cpp.trace_enable(True)
+        return self
+
+    def __exit__(self, *_):
+        from .. import _cpp
+        _cpp.trace_enable(False)
+        self.events = [dict(name=name, start=start * 1e-6, duration=duration * 1e-6,
+                            thread=thread, depth=depth)
+                       for name, start, duration, thread, depth in _cpp.trace_events()]
+        if self.filename:
+            with open(self.filename, 'w') as file:
+                file.write(_cpp.trace_chrome_json())
+
+
+def traced(filename=None):
+    """Context manager which records the stages of the model build and calculations
+
+    The recorded spans include the system and Hamiltonian builds and their parts
+    (foundation, modifiers, leads) as well as the KPM stages (bounds, optimization,
+    moments) and solver calls. The overhead is small enough to leave it on in long runs.
+
+    Parameters
+    ----------
+    filename : Optional[str]
+        Save the spans in the Chrome trace event format (JSON) on block exit. It can be
+        viewed with chrome://tracing or https://ui.perfetto.dev.
+
+    Examples
+    --------
+    >>> with traced("trace.json") as t:  # doctest: +SKIP
+    ...     model.hamiltonian
+    >>> [(e['name'], e['duration']) for e in t.events]  # doctest: +SKIP
+    [('Foundation', 0.012), ('System', 0.034), ('Model::system', 0.047), ...]
+    """
+    return _Traced(filename)
+
+
 def pretty_duration(seconds):
     """Return a pretty duration string
 
@@ -39,8 +39,10 @@ class CMakeBuild(build_ext):
                           '-DPB_WERROR=' + os.environ.get("PB_WERROR", "OFF"),
                           '-DPB_TESTS=' + os.environ.get("PB_TESTS", "OFF"),
                           '-DPB_NATIVE_SIMD=' + os.environ.get("PB_NATIVE_SIMD", "ON"),
+                          '-DPB_SIMD_DISPATCH=' + os.environ.get("PB_SIMD_DISPATCH", "ON"),
                           '-DPB_MKL=' + os.environ.get("PB_MKL", "OFF"),
-                          '-DPB_CUDA=' + os.environ.get("PB_CUDA", "OFF")]
+                          '-DPB_CUDA=' + os.environ.get("PB_CUDA", "OFF"),
+                          '-DPB_MPI=' + os.environ.get("PB_MPI", "OFF")]
             build_args = ['--config', 'Release']
 
             if platform.system() == "Windows":
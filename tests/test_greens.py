@@ -0,0 +1,45 @@
+import pytest
+
+import numpy as np
+import pybinding as pb
+from pybinding.repository import graphene
+
+
+@pytest.fixture
+def model():
+    return pb.Model(graphene.monolayer(), pb.rectangle(1.2), pb.force_double_precision())
+
+
+def dense_greens(model, energy, broadening):
+    """`G[e, i, j]` of the dense inverse of `z - H` at each energy"""
+    h = model.hamiltonian.todense()
+    identity = np.eye(h.shape[0])
+    return np.array([np.linalg.inv((e + 1j * broadening) * identity - h) for e in energy])
+
+
+def test_direct(model):
+    energy = np.array([-0.5, -0.1, 0.2, 0.7])
+    broadening = 1e-4
+    expected = dense_greens(model, energy, broadening)
+
+    greens = pb.greens.direct(model, num_threads=2)
+    g = greens.calc_greens(0, 3, energy, broadening)
+    assert pytest.fuzzy_equal(g, expected[:, 3, 0], rtol=1e-6, atol=1e-6)
+
+    gs = greens.calc_greens(0, [0, 3, 7], energy, broadening)
+    assert len(gs) == 3
+    for g, j in zip(gs, [0, 3, 7]):
+        assert pytest.fuzzy_equal(g, expected[:, j, 0], rtol=1e-6, atol=1e-6)
+
+    rows, cols = [1, 4], [0, 5, 9]
+    block = greens.calc_greens_block(rows, cols, energy, broadening)
+    assert block.shape == (len(rows), len(cols), len(energy))
+    for i, row in enumerate(rows):
+        for j, col in enumerate(cols):
+            assert pytest.fuzzy_equal(block[i, j], expected[:, col, row],
+                                      rtol=1e-6, atol=1e-6)
+
+    # The symbolic analysis is reused: only the numeric factorizations add up
+    assert greens.num_analyses <= 2
+    assert greens.num_factorizations == 3 * len(energy)
+    assert greens.report()
@@ -22,8 +22,13 @@ def model(request):
 @pytest.fixture(scope='module')
 def kpm(model):
     strategies = [pb.chebyshev.kpm(model, optimization_level=i) for i in range(4)]
+    strategies += [pb.chebyshev.kpm(model, optimization_level="auto")]
+    strategies += [pb.chebyshev.kpm(model, split_complex=True)]
+    strategies += [pb.chebyshev.kpm(model, indexed_values=True)]
+    strategies += [pb.chebyshev.kpm(model, symmetric_storage=True)]
+    strategies += [pb.chebyshev.kpm(model, bulk_boundary=True)]
     if hasattr(pb._cpp, 'KPMcuda'):
-        strategies += [pb.chebyshev.kpm_cuda(model, optimization_level=i) for i in range(2)]
+        strategies += [pb.chebyshev.kpm_cuda(model, optimization_level=i) for i in range(3)]
     return strategies
 
 
@@ -56,6 +61,162 @@ def test_kpm_multiple_indices(model):
     assert pytest.fuzzy_equal(gs[0], g)
 
 
+def test_deferred():
+    """The deferred jobs give the same results as the direct calls"""
+    model = pb.Model(graphene.monolayer(), pb.rectangle(6), pb.constant_potential(0.2))
+    kpm = pb.chebyshev.kpm(model)
+    energy = np.linspace(-0.5, 0.5, 20)
+    broadening = 0.1
+    i, j = 0, model.system.num_sites // 2
+
+    def computed(deferred):
+        deferred.compute()
+        return deferred.result
+
+    expected = kpm.calc_ldos(energy, broadening, [0, 0]).ldos
+    assert pytest.fuzzy_equal(computed(kpm.deferred_ldos(energy, broadening, [0, 0])), expected)
+
+    expected = kpm.calc_ldos_vector([i, j], energy, broadening)
+    result = computed(kpm.deferred_ldos_vector([i, j], energy, broadening))
+    assert result.shape == expected.shape
+    assert pytest.fuzzy_equal(result, expected)
+
+    expected = kpm.calc_greens(i, j, energy, broadening)
+    result = computed(kpm.deferred_greens(i, j, energy, broadening))
+    assert np.iscomplexobj(result)
+    assert pytest.fuzzy_equal(result, expected)
+
+    expected = kpm.calc_greens(i, [j, j + 1], energy, broadening)
+    result = computed(kpm.deferred_greens(i, [j, j + 1], energy, broadening))
+    assert len(result) == len(expected)
+    for r, e in zip(result, expected):
+        assert pytest.fuzzy_equal(r, e)
+
+    # The random vectors have a fixed seed
+    expected = kpm.calc_dos(energy, broadening, num_random=4).dos
+    result = computed(kpm.deferred_dos(energy, broadening, num_random=4))
+    assert pytest.fuzzy_equal(result, expected)
+
+
+def test_spatial_ldos():
+    model = pb.Model(graphene.monolayer(), pb.rectangle(2, 2))
+    kpm = pb.kpm(model)
+    energy = np.linspace(-0.5, 0.5, 5)
+    region = pb.rectangle(1, 1)
+
+    smaps = kpm.calc_spatial_ldos(energy, 0.1, region)
+    assert len(smaps) == energy.size
+    assert all(0 < smap.num_sites < model.system.num_sites for smap in smaps)
+
+    smap = smaps[2]
+    position = [smap.x[3], smap.y[3]]
+    ldos = kpm.calc_ldos([energy[2]], 0.1, position)
+    assert pytest.fuzzy_equal(smap.data[3], ldos.ldos[0], rtol=1e-3)
+    assert kpm.calc_spatial_ldos(energy[2], 0.1, region).num_sites == smap.num_sites
+
+
+def test_symmetry():
+    model = pb.Model(graphene.monolayer(), pb.rectangle(2, 2))
+    kpm = pb.kpm(model)
+    energy = np.linspace(-0.5, 0.5, 5)
+    indices = list(range(0, model.system.num_sites, 2))
+
+    assert kpm.symmetry_order > 1
+    expected = kpm.calc_ldos_vector(indices, energy, 0.1)
+    kpm.use_symmetry = True
+    assert pytest.fuzzy_equal(kpm.calc_ldos_vector(indices, energy, 0.1), expected, rtol=1e-3)
+
+
+def test_disorder_ensemble():
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1, 1))
+    num_sites = model.system.num_sites
+
+    def realization(n):
+        return np.random.RandomState(n).uniform(-0.1, 0.1, num_sites)
+
+    ensemble = pb.chebyshev.disorder_ensemble(model, realization, (-0.1, 0.1), num_threads=2)
+    energy = np.linspace(-0.5, 0.5, 10)
+    ldos = ensemble.calc_ldos([0, 5], energy, 0.1, num_realizations=4)
+    assert ldos.shape == (energy.size, 2)
+
+    expected = np.zeros(energy.size)
+    for n in range(4):
+        @pb.onsite_energy_modifier
+        def disorder(energy):
+            return energy + realization(n)
+
+        disordered = pb.Model(graphene.monolayer(), pb.rectangle(1, 1), disorder)
+        kpm = pb.kpm(disordered, energy_range=ensemble.energy_range)
+        expected += kpm.calc_ldos_vector([0], energy, 0.1)[:, 0] / 4
+    assert pytest.fuzzy_equal(ldos[:, 0], expected, rtol=1e-3, atol=1e-6)
+
+
+def test_self_consistent_loop():
+    from scipy.sparse import identity
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1, 1))
+    num_sites = model.system.num_sites
+
+    loop = pb.chebyshev.self_consistent_loop(model, 0.5 * identity(num_sites), 0.1, 0.05,
+                                             temperature=1000, background=np.full(num_sites, 0.5),
+                                             probing_distance=num_sites)
+    assert loop.run()
+    assert loop.converged
+    assert loop.residuals[-1] < 1e-5
+    assert pytest.fuzzy_equal(loop.potential, 0.5 * (loop.density - 0.5), atol=1e-4)
+
+
+def test_recursion_method(model):
+    energy = np.linspace(0, 2, 25)
+    kpm = pb.kpm(model)
+    recursion = pb.kpm(model, recursion=True)
+    expected = kpm.calc_ldos(energy, broadening=0.15, position=(0, 0), sublattice='B')
+    ldos = recursion.calc_ldos(energy, broadening=0.15, position=(0, 0), sublattice='B')
+    assert pytest.fuzzy_equal(ldos, expected, rtol=0.1, atol=0.05 * expected.ldos.max())
+
+    # The same random vectors, normalized to the number of states like the KPM trace
+    expected = kpm.calc_dos(energy, broadening=0.15, num_random=2)
+    dos = recursion.calc_dos(energy, broadening=0.15, num_random=2)
+    assert pytest.fuzzy_equal(dos, expected, rtol=0.1, atol=0.05 * expected.dos.max())
+
+    # The discrete poles of the truncated fraction are only smoothed out by the broadening
+    truncated = pb.kpm(model, recursion=True, termination="truncate")
+    dos = truncated.calc_dos(energy, broadening=0.15, num_random=2)
+    assert pytest.fuzzy_equal(dos, expected, rtol=0.2, atol=0.1 * expected.dos.max())
+
+
+def test_stream_results(tmpdir):
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1, 1))
+    kpm = pb.kpm(model)
+    energy = np.linspace(-0.5, 0.5, 10)
+    indices = list(range(0, model.system.num_sites, 3))
+    filename = str(tmpdir.join('ldos.bin'))
+
+    kpm.stream_ldos(indices, energy, 0.1, filename, chunk_size=4)
+    e, idx, ldos = pb.chebyshev.load_results(filename)
+    assert pytest.fuzzy_equal(e, energy)
+    assert np.all(idx == indices)
+    assert pytest.fuzzy_equal(ldos, kpm.calc_ldos_vector(indices, energy, 0.1))
+
+    kpm.stream_greens(indices[0], indices[1:4], energy, 0.1, filename)
+    _, idx, greens = pb.chebyshev.load_results(filename)
+    assert np.all(idx == indices[1:4])
+    expected = kpm.calc_greens(indices[0], indices[1:4], energy, 0.1)
+    assert pytest.fuzzy_equal(greens, np.column_stack(expected))
+
+
+def test_greens_block():
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1, 1))
+    kpm = pb.kpm(model)
+    energy = np.linspace(-0.5, 0.5, 10)
+    rows, cols = [0, 3, 7], [3, 5]
+
+    block = kpm.calc_greens_block(rows, cols, energy, 0.1)
+    assert block.shape == (len(rows), len(cols), len(energy))
+    for i, row in enumerate(rows):
+        expected = kpm.calc_greens(row, cols, energy, 0.1)
+        assert pytest.fuzzy_equal(block[i], np.array(expected))
+
+
 def test_kpm_reuse():
     """KPM should return the same result when a single object is used for multiple calculations"""
     model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(10))
@@ -69,6 +230,113 @@ def test_kpm_reuse():
         assert pytest.fuzzy_equal(actual, expected, rtol=1e-3, atol=1e-6)
 
 
+def test_kpm_autotune():
+    """The automatic optimization level is chosen once and reused for the same structure"""
+    model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(10))
+    kpm = pb.chebyshev.kpm(model, optimization_level="auto")
+    energy = np.linspace(-5, 5, 50)
+
+    ldos = kpm.calc_ldos(energy, 0.1, [0, 0])
+    assert 0 <= kpm.stats.opt_level <= 4
+    assert kpm.stats.timings["tune"] > 0
+
+    expected = pb.chebyshev.kpm(model, optimization_level=0).calc_ldos(energy, 0.1, [0, 0])
+    assert pytest.fuzzy_equal(ldos, expected, rtol=1e-3, atol=1e-6)
+
+    other = pb.chebyshev.kpm(model, optimization_level="auto")
+    other.calc_ldos(energy, 0.1, [0, 0])
+    assert other.stats.opt_level == kpm.stats.opt_level
+
+
+def test_convergence_tolerance():
+    """The adaptive mode reports the number of moments it actually used"""
+    model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(10))
+    energy = np.linspace(-2, 2, 30)
+
+    kpm = pb.chebyshev.kpm(model)
+    expected = kpm.calc_ldos(energy, 0.05, [0, 0])
+    assert kpm.stats.used_moments == kpm.stats.num_moments
+
+    adaptive = pb.chebyshev.kpm(model, convergence_tolerance=1)
+    ldos = adaptive.calc_ldos(energy, 0.05, [0, 0])
+    assert adaptive.stats.used_moments < adaptive.stats.num_moments
+    assert not pytest.fuzzy_equal(ldos, expected, rtol=1e-3, atol=1e-6)
+
+    # Each site of a vector stops on its own, same as a single one
+    i = model.system.find_nearest([0, 0])
+    ldos_vector = adaptive.calc_ldos_vector([i, i + 1], energy, 0.05)
+    assert pytest.fuzzy_equal(ldos_vector[:, 0], adaptive.calc_ldos(energy, 0.05, [0, 0]).ldos)
+    with pytest.raises(ValueError):
+        adaptive.calc_greens_block([i], [i + 1], energy, 0.05)
+
+
+def test_reduced_precision():
+    """The bfloat16 matrix values change the LDOS only a little"""
+    model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(10), graphene.mass_term(1))
+    energy = np.linspace(-2, 2, 30)
+
+    expected = pb.chebyshev.kpm(model).calc_ldos(energy, 0.1, [0, 0])
+    reduced = pb.chebyshev.kpm(model, reduced_precision=True).calc_ldos(energy, 0.1, [0, 0])
+    assert pytest.fuzzy_equal(reduced, expected, rtol=2e-2, atol=1e-3)
+
+
+def test_symmetric_storage():
+    """The upper triangle gives the same results with less matrix memory"""
+    model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(10), graphene.mass_term(1))
+    energy = np.linspace(-2, 2, 30)
+
+    full = pb.chebyshev.kpm(model, optimization_level=0)
+    symmetric = pb.chebyshev.kpm(model, symmetric_storage=True)
+    expected = full.calc_ldos(energy, 0.1, [0, 0])
+    assert pytest.fuzzy_equal(symmetric.calc_ldos(energy, 0.1, [0, 0]), expected,
+                              rtol=1e-3, atol=1e-6)
+    assert symmetric.stats.matrix_memory < 0.75 * full.stats.matrix_memory
+
+    expected = full.calc_greens(0, [3, 7], energy, 0.1)
+    result = symmetric.calc_greens(0, [3, 7], energy, 0.1)
+    assert pytest.fuzzy_equal(np.array(result), np.array(expected), rtol=1e-3, atol=1e-6)
+
+
+def test_bulk_boundary():
+    """The real bulk and complex boundary parts give the same results with less memory"""
+    model = pb.Model(graphene.monolayer(), pb.primitive(20, 20),
+                     pb.translational_symmetry(a1=True, a2=True))
+    model.set_wave_vector([0.4, -0.3])
+    energy = np.linspace(-2, 2, 30)
+
+    for level in range(5):
+        regular = pb.chebyshev.kpm(model, optimization_level=level)
+        split = pb.chebyshev.kpm(model, optimization_level=level, bulk_boundary=True)
+        expected = regular.calc_ldos(energy, 0.1, [0, 0])
+        assert pytest.fuzzy_equal(split.calc_ldos(energy, 0.1, [0, 0]), expected,
+                                  rtol=1e-3, atol=1e-6)
+        assert split.stats.matrix_memory < regular.stats.matrix_memory
+
+        expected = regular.calc_greens(0, [3, 7], energy, 0.1)
+        result = split.calc_greens(0, [3, 7], energy, 0.1)
+        assert pytest.fuzzy_equal(np.array(result), np.array(expected), rtol=1e-3, atol=1e-6)
+
+
+def test_matrix_file(tmpdir):
+    """The out-of-core matrix gives the same result as the in-memory one"""
+    model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(10), graphene.mass_term(1))
+    energy = np.linspace(-2, 2, 30)
+    filename = str(tmpdir.join('matrix.bin'))
+
+    expected = pb.chebyshev.kpm(model).calc_ldos(energy, 0.1, [0, 0])
+    kpm = pb.chebyshev.kpm(model, matrix_file=filename)
+    ldos = kpm.calc_ldos(energy, 0.1, [0, 0])
+    assert pytest.fuzzy_equal(ldos, expected, rtol=1e-4, atol=1e-6)
+    assert kpm.stats.streamed_bytes > 0
+
+    # The file is kept for the next calculation at the same site
+    assert tmpdir.join('matrix.bin').check()
+    ldos = kpm.calc_ldos(energy, 0.1, [0, 0])
+    assert pytest.fuzzy_equal(ldos, expected, rtol=1e-4, atol=1e-6)
+    del kpm
+    assert not tmpdir.join('matrix.bin').check()
+
+
 def test_ldos_sublattice():
     """LDOS for A and B sublattices should be antisymmetric for graphene with a mass term"""
     model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(10), graphene.mass_term(1))
@@ -88,3 +356,38 @@ def test_optimized_hamiltonian():
     assert oh.matrix.shape == h.shape
     assert oh.sizes[-1] == h.shape[0]
     assert len(oh.indices) == h.shape[0]
+
+
+def test_conductivity():
+    model = pb.Model(graphene.monolayer(), pb.rectangle(4))
+    kpm = pb.chebyshev.kpm(model)
+    mu = np.linspace(-1, 1, 5)
+
+    sigma = kpm.calc_conductivity(mu, broadening=0.5, direction="xx", num_points=200)
+    assert sigma.shape == mu.shape
+    assert np.all(np.isfinite(sigma))
+
+    halved = kpm.calc_conductivity(mu, broadening=0.5, direction="xx", volume=2, num_points=200)
+    assert pytest.fuzzy_equal(halved, sigma / 2)
+
+    with pytest.raises(ValueError):
+        kpm.calc_conductivity(mu, broadening=0.5, direction="xw")
+
+
+def test_time_evolution():
+    from scipy.linalg import expm
+
+    model = pb.Model(graphene.monolayer(), pb.rectangle(2), pb.constant_potential(0.2))
+    kpm = pb.chebyshev.kpm(model)
+    state = np.zeros(model.hamiltonian.shape[0], dtype=np.complex128)
+    state[0] = 1
+
+    time_step = 0.5  # fs
+    states = kpm.calc_time_evolution(state, time_step, num_steps=3)
+    assert states.shape == (3, state.size)
+    assert pytest.fuzzy_equal(np.linalg.norm(states, axis=1), [1, 1, 1], 1e-5, 1e-5)
+
+    hbar = 6.58211899e-16  # eV*s
+    h = model.hamiltonian.toarray()
+    expected = expm(-1j * h * 3 * time_step * 1e-15 / hbar).dot(state)
+    assert pytest.fuzzy_equal(states[-1], expected, 1e-4, 1e-4)
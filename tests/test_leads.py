@@ -105,3 +105,46 @@ def test_attach():
     model.add(linear_onsite())
     assert model.leads[0].h0.diagonal().max() < model.hamiltonian.diagonal().min()
     assert model.hamiltonian.diagonal().max() < model.leads[1].h0.diagonal().min()
+
+
+def test_self_energy(square_model):
+    """A lead with a single site cross-section is a semi-infinite chain"""
+    model = pb.Model(square_model.lattice, pb.rectangle(2, 1))
+    model.attach_lead(+1, pb.line([0, -0.5], [0, 0.5]))
+    lead = model.leads[0]
+    assert len(lead.indices) == 1
+
+    energies = np.array([-3, -1, 0.5, 1.5, 3])
+    sigma = lead.calc_self_energy(energies, broadening=1e-9)
+    assert sigma.shape == (5, 1, 1)
+    # Analytic: sigma = (E - sqrt(E^2 - 4t^2)) / 2 on the branch with Im(sigma) <= 0
+    expected = (energies - np.sqrt((energies + 1e-9j)**2 - 4 + 0j)) / 2
+    expected = np.where(expected.imag > 0, energies - expected, expected)
+    assert pytest.fuzzy_equal(sigma[:, 0, 0], expected, rtol=1e-6, atol=1e-6)
+
+    # Wider lead: the self-energy satisfies its own Dyson equation
+    model = square_model
+    model.attach_lead(-1, pb.line([0, -1.5], [0, 1.5]))
+    lead = model.leads[0]
+    h0, h1 = lead.h0.todense(), lead.h1.todense()
+    z = 0.3 + 1e-9j
+    sigma = lead.calc_self_energy([0.3], broadening=1e-9, num_threads=2)[0]
+    g = np.linalg.inv(z * np.eye(h0.shape[0]) - h0 - sigma)
+    assert pytest.fuzzy_equal(sigma, h1.H @ g @ h1, rtol=1e-6, atol=1e-6)
+
+
+def test_transmission(square_model):
+    """A clean ribbon: the transmission counts the open transverse modes"""
+    model = pb.Model(square_model.lattice, pb.rectangle(6, 3))
+    model.attach_lead(-1, pb.line([0, -1.5], [0, 1.5]))
+    model.attach_lead(+1, pb.line([0, -1.5], [0, 1.5]))
+
+    # Transverse mode energies are `-2 cos(n pi / 4)`, each open within +/- 2
+    energies = np.array([-3, 0.2, 1.8, 2.5])
+    transmission = pb.greens.transmission(model, energies, broadening=1e-8, num_threads=2)
+    assert pytest.fuzzy_equal(transmission, [1, 3, 2, 1], rtol=1e-5, atol=1e-5)
+
+    # The reverse direction is the same for a time-reversal symmetric model
+    reverse = pb.greens.transmission(model, energies.tolist(), lead_from=1, lead_to=0,
+                                     broadening=1e-8)
+    assert pytest.fuzzy_equal(reverse, transmission, rtol=1e-5, atol=1e-5)
@@ -1,3 +1,5 @@
+import types
+
 import pytest
 
 import numpy as np
@@ -39,6 +41,160 @@ def test_report(model):
     assert "2 non-zero values" in report
 
 
+def test_trace(tmpdir):
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1))
+    filename = str(tmpdir.join("trace.json"))
+    with pb.utils.traced(filename) as t:
+        assert model.hamiltonian.shape[0] > 0
+
+    names = [e['name'] for e in t.events]
+    assert names.index("Foundation") < names.index("Model::system")
+    assert "Hamiltonian build" in names
+    assert all(e['duration'] >= 0 for e in t.events)
+
+    import json
+    with open(filename) as file:
+        trace = json.load(file)
+    assert len(trace['traceEvents']) == len(t.events)
+
+
+def test_derive():
+    base = pb.Model(graphene.monolayer(), pb.rectangle(1))
+    variant = base.derive(pb.constant_potential(1))
+    with pb.utils.traced() as t:
+        h = variant.hamiltonian
+    assert "Model::system" not in [e['name'] for e in t.events]
+    assert pytest.fuzzy_equal(h.diagonal(), 1)
+    assert pytest.fuzzy_equal(base.hamiltonian.diagonal(), 0)
+    assert len(variant._parameters) == len(base._parameters) + 1
+
+    bigger = base.derive(pb.rectangle(2))
+    assert bigger.system.num_sites > base.system.num_sites
+
+
+def test_memory_cache():
+    pb.Model.clear_memory_cache()
+
+    def make_model(v):
+        model = pb.Model(graphene.monolayer(), pb.rectangle(2), pb.constant_potential(v))
+        model.set_memory_cache()
+        return model
+
+    first = make_model(1).hamiltonian
+    second = make_model(1)
+    with pb.utils.traced() as t:
+        assert point_to_same_memory(second.hamiltonian.data, first.data)
+    names = [e['name'] for e in t.events]
+    assert "Model::hamiltonian" in names
+    assert "Model::system" not in names and "Hamiltonian build" not in names
+    assert "Memory cache: 1 hits" in second.report()
+
+    assert pytest.fuzzy_equal(make_model(2).hamiltonian.diagonal(), 2)
+    stats = pb.Model.memory_cache_stats()
+    assert stats['hits'] == 1 and stats['misses'] == 2 and stats['num_entries'] == 2
+
+    pb.Model.set_memory_cache_capacity(0)
+    assert pb.Model.memory_cache_stats()['num_entries'] == 0
+    pb.Model.set_memory_cache_capacity(2**30)
+    pb.Model.clear_memory_cache()
+
+
+_scale = 1
+
+
+def test_cache_tag(tmpdir):
+    directory = str(tmpdir)
+
+    def make_model(*args):
+        model = pb.Model(graphene.monolayer(), pb.rectangle(2))
+        model.set_cache(directory)
+        model.add(*args)  # the default tag is made at build time: it sees these too
+        return model
+
+    def scaled(values):
+        @pb.onsite_energy_modifier
+        def modifier(energy):
+            return energy + _scale * values[0]
+        return modifier
+
+    plain = make_model().cache_filename
+    assert plain
+    assert make_model(pb.constant_potential(1)).cache_filename not in ("", plain)
+    assert (make_model(pb.constant_potential(1)).cache_filename ==
+            make_model().derive(pb.constant_potential(1)).cache_filename)
+
+    # Large arrays are identified by their contents, not their abbreviated `repr`
+    a = np.zeros(5000)
+    b = a.copy()
+    b[2500] = 1
+    model = make_model(scaled(a))
+    assert model.cache_filename == make_model(scaled(a.copy())).cache_filename
+    assert model.cache_filename != make_model(scaled(b)).cache_filename
+
+    # The globals which the function reads are part of the tag
+    global _scale
+    first = model.cache_filename
+    _scale = 2
+    assert model.cache_filename != first
+    _scale = 1
+
+    # Modules are identified by the attributes which the function reads
+    def reads(params):
+        @pb.onsite_energy_modifier
+        def modifier(energy):
+            return energy + params.V0
+        return modifier
+
+    params = types.ModuleType("params")
+    params.V0 = 1
+    model = make_model(reads(params))
+    first = model.cache_filename
+    assert first
+    params.V0 = 2
+    assert model.cache_filename != first
+
+    # Other objects may hide their state from `repr`: they are opaque
+    assert make_model(reads(types.SimpleNamespace(V0=1))).cache_filename == ""
+
+    # Builtin modifiers are identified by their arguments
+    def disorder(seed):
+        return pb._cpp.builtin.onsite_disorder(0.1, seed)
+    assert make_model(disorder(1)).cache_filename not in ("", plain)
+    assert make_model(disorder(1)).cache_filename != make_model(disorder(2)).cache_filename
+
+    # Other functions without a Python signature are opaque: they need an explicit tag
+    opaque = pb._cpp.OnsiteModifier(lambda energy, *_: energy)
+    assert make_model(opaque).cache_filename == ""
+    model = make_model(opaque)
+    model.set_cache(directory, tag="no-op")
+    assert model.cache_filename
+
+    # The memory cache has its own tag
+    model.set_memory_cache(False)
+    assert model.cache_filename
+
+    # A file which can't be saved is only a warning: the model keeps the results
+    model = make_model()
+    model.set_cache(str(tmpdir.join("missing")))
+    with pytest.warns(RuntimeWarning, match="not saved"):
+        assert model.hamiltonian.shape[0] > 0
+
+
+def test_memory_estimate():
+    model = pb.Model(graphene.monolayer(), pb.rectangle(2))
+    estimate = model.estimate_memory()
+    assert estimate.num_sites >= model.system.num_sites
+    assert estimate.peak_bytes > estimate.hamiltonian_bytes > 0
+    matrix_bytes, vector_bytes = pb.chebyshev.kpm_memory(model)
+    assert matrix_bytes > estimate.hamiltonian_bytes and vector_bytes > 0
+
+    model = pb.Model(graphene.monolayer(), pb.rectangle(2))
+    model.set_memory_budget(1)
+    with pytest.raises(RuntimeError) as excinfo:
+        assert model.system
+    assert "memory budget" in str(excinfo.value)
+
+
 def test_hamiltonian(model):
     """Must be in the correct format and point to memory allocated in C++ (no copies)"""
     h = model.hamiltonian
@@ -59,3 +215,22 @@ def test_hamiltonian(model):
     h2 = model.hamiltonian
     assert h2.data is not h.data
     assert point_to_same_memory(h2.data, h.data)
+
+
+def test_hamiltonian_rows():
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1.2), pb.translational_symmetry(a1=1.2),
+                     pb.constant_potential(1))
+    model.set_wave_vector([0.5, 0])
+    h = model.hamiltonian.toarray()
+    num_sites = h.shape[0]
+
+    bounds = [0, num_sites // 3, num_sites // 2, num_sites]
+    blocks = [model.hamiltonian_rows(start, end) for start, end in zip(bounds, bounds[1:])]
+    assert all(isinstance(block, csr_matrix) for block in blocks)
+    assert [block.shape for block in blocks] == [(end - start, num_sites)
+                                                 for start, end in zip(bounds, bounds[1:])]
+    assert pytest.fuzzy_equal(np.vstack([block.toarray() for block in blocks]), h)
+
+    with pytest.raises(ValueError) as excinfo:
+        model.hamiltonian_rows(0, num_sites + 1)
+    assert "are not within" in str(excinfo.value)
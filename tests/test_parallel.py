@@ -50,3 +50,131 @@ def test_ndsweep(baseline):
 
     expected = baseline(result)
     assert pytest.fuzzy_equal(result, expected, rtol=1e-3, atol=1e-6)
+
+
+def test_stored_results():
+    """Without `retire`, the results are stored directly in C++"""
+    energy = np.linspace(0, 0.1, 10)
+
+    def produce(v):
+        model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(side_width=10),
+                         pb.constant_potential(v))
+        kpm = pb.greens.kpm(model)
+        return kpm.deferred_ldos(energy, broadening=0.15, position=[0, 0])
+
+    sequence = np.linspace(0, 0.1, 6)
+    retired = [None] * len(sequence)
+
+    def retire(deferred, idx):
+        retired[idx] = deferred.result.copy()
+
+    pb.parallel._parallel_for(sequence, produce, retire, num_threads=2, queue_size=2)
+    stored = pb.parallel._parallel_for(sequence, produce, None, num_threads=2, queue_size=2)
+    assert stored.shape == (len(sequence), len(energy))
+    assert pytest.fuzzy_equal(stored, np.vstack(retired), rtol=1e-3, atol=1e-6)
+
+
+def test_stored_results_fail_fast():
+    """A result which can't be stored stops the loop after the first jobs"""
+    energy = np.linspace(0, 0.1, 10)
+    produced = []
+
+    def produce(v):
+        produced.append(v)
+        model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(side_width=6),
+                         pb.constant_potential(v))
+        kpm = pb.greens.kpm(model)
+        return kpm.deferred_greens(0, 0, energy, broadening=0.15)  # complex
+
+    sequence = np.linspace(0, 0.1, 40)
+    with pytest.raises(ValueError) as excinfo:
+        pb.parallel._parallel_for(sequence, produce, None, num_threads=2, queue_size=2)
+    assert "Only real 1D array results" in str(excinfo.value)
+    assert len(produced) < len(sequence)
+
+
+def test_silent_complex_results():
+    """Results which can't be stored in C++ are retired in Python instead"""
+    energy = np.linspace(0, 0.1, 10)
+
+    @pb.parallelize(v=np.linspace(0, 0.1, 4))
+    def factory(v):
+        model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(side_width=6),
+                         pb.constant_potential(v))
+        return pb.greens.kpm(model).deferred_greens(0, 0, energy, broadening=0.15)
+
+    silence_parallel_output(factory)
+    results = pb.parallel.parallel_for(factory)
+    assert len(results) == 4
+    assert all(np.iscomplexobj(r) and r.shape == energy.shape for r in results)
+
+
+def test_checkpoint(tmpdir):
+    """An interrupted loop resumes from the checkpoint file"""
+    energy = np.linspace(0, 0.1, 10)
+    produced = []
+
+    def produce(v):
+        produced.append(v)
+        model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(side_width=10),
+                         pb.constant_potential(v))
+        kpm = pb.greens.kpm(model)
+        return kpm.deferred_ldos(energy, broadening=0.15, position=[0, 0])
+
+    sequence = np.linspace(0, 0.1, 6)
+    filename = str(tmpdir.join("sweep.checkpoint"))
+    expected = pb.parallel._parallel_for(sequence, produce, None, num_threads=2,
+                                         checkpoint=filename)
+    done = pb.parallel._read_checkpoint(filename)
+    assert sorted(done) == list(range(len(sequence)))
+    assert all(np.array_equal(done[i], expected[i]) for i in done)
+
+    # Simulate an interruption in the middle of writing the 4th record
+    record_size = 16 + 8 * len(energy)
+    with open(filename, 'rb+') as file:
+        file.truncate(32 + 3 * record_size + record_size // 2)
+    done = pb.parallel._read_checkpoint(filename)
+    assert len(done) == 3
+
+    produced.clear()
+    resumed = pb.parallel._parallel_for(sequence, produce, None, num_threads=2,
+                                        checkpoint=filename, skip=sorted(done))
+    assert len(produced) == len(sequence) - 3
+    assert sorted(pb.parallel._read_checkpoint(filename)) == list(range(len(sequence)))
+    for i in range(len(sequence)):
+        if i not in done:
+            assert pytest.fuzzy_equal(resumed[i], expected[i], rtol=1e-3, atol=1e-6)
+
+    # The file identifies the loop: a different sequence doesn't resume from it
+    key = pb.parallel._checkpoint_key(sequence)
+    assert len(pb.parallel._read_checkpoint(filename, len(sequence), key)) == len(sequence)
+    with pytest.raises(RuntimeError) as excinfo:
+        pb.parallel._read_checkpoint(filename, len(sequence), key=key + 1)
+    assert "different loop" in str(excinfo.value)
+    with pytest.raises(RuntimeError):
+        pb.parallel._read_checkpoint(filename, size=len(sequence) + 1)
+    other = sequence.copy()
+    other[-1] += 1
+    assert pb.parallel._checkpoint_key(other) != key
+
+
+def test_checkpoint_fail_fast(tmpdir):
+    """A result which can't be checkpointed stops the loop and isn't retired"""
+    energy = np.linspace(0, 0.1, 10)
+    produced = []
+    retired = []
+
+    def produce(v):
+        produced.append(v)
+        model = pb.Model(graphene.monolayer(), graphene.hexagon_ac(side_width=6),
+                         pb.constant_potential(v))
+        return pb.greens.kpm(model).deferred_greens(0, 0, energy, broadening=0.15)
+
+    sequence = np.linspace(0, 0.1, 40)
+    filename = str(tmpdir.join("complex.checkpoint"))
+    with pytest.raises(ValueError):
+        pb.parallel._parallel_for(sequence, produce, lambda d, idx: retired.append(idx),
+                                  num_threads=2, queue_size=2, checkpoint=filename)
+    assert len(produced) < len(sequence)
+    assert not retired
+    assert not pb.parallel._read_checkpoint(filename)
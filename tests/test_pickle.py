@@ -1,7 +1,10 @@
 import pytest
 
 import pathlib
+import pickle
+import numpy as np
 import pybinding as pb
+from pybinding.repository import graphene
 
 mock_data = list(range(10))
 
@@ -40,3 +43,21 @@ def test_extension(tmpdir):
     file = tmpdir / 'file.ext'
     pb.save(mock_data, file)
     assert mock_data == pb.load(tmpdir / 'file.ext')
+
+
+def test_shared_csr(tmpdir):
+    model = pb.Model(graphene.monolayer(), pb.rectangle(4))
+    shared = pb.share(model.hamiltonian, directory=str(tmpdir))
+    assert isinstance(shared.matrix.data, np.memmap)
+    assert (shared.matrix != model.hamiltonian).nnz == 0
+
+    # Only the path is pickled: the copy maps the same files
+    assert len(pickle.dumps(shared)) < shared.matrix.data.nbytes
+    copy = pickle.loads(pickle.dumps(shared))
+    assert copy.path == shared.path
+    assert isinstance(copy.matrix.indices, np.memmap)
+    assert (copy.matrix != model.hamiltonian).nnz == 0
+
+    file = tmpdir / 'shared'
+    pb.save(shared, file)
+    assert pb.load(file).path == shared.path
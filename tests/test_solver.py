@@ -1,3 +1,5 @@
+import re
+
 import pytest
 
 import numpy as np
@@ -99,3 +101,54 @@ def test_lapack(baseline, plot_if_fails):
     expected = baseline(bands)
     plot_if_fails(bands, expected, 'plot')
     assert pytest.fuzzy_equal(bands, expected, 2.e-2, 1.e-6)
+
+
+def test_dense():
+    model = pb.Model(graphene.monolayer(), pb.rectangle(1.2))
+    expected = pb.solver.lapack(model)
+
+    solver = pb.solver.dense(model)
+    assert pytest.fuzzy_equal(solver.eigenvalues, expected.eigenvalues)
+    assert pytest.fuzzy_equal(solver.calc_dos([-1, 0.5], 0.1).dos,
+                              expected.calc_dos([-1, 0.5], 0.1).dos)
+
+    window = pb.solver.dense(model, energy_range=(-1, 1))
+    inside = expected.eigenvalues[abs(expected.eigenvalues) <= 1]
+    assert pytest.fuzzy_equal(window.eigenvalues, inside)
+
+    deferred = solver.deferred_dos([-1, 0.5], 0.1)
+    deferred.compute()
+    assert pytest.fuzzy_equal(deferred.result, solver.calc_dos([-1, 0.5], 0.1).dos)
+
+    deferred = solver.deferred_spatial_ldos(0.5, 0.1)
+    deferred.compute()
+    assert pytest.fuzzy_equal(deferred.result, solver.calc_spatial_ldos(0.5, 0.1).data)
+
+    deferred = pb.solver.dense(model).deferred_eigenvalues()
+    deferred.compute()
+    assert deferred.result.dtype == np.float64
+    assert pytest.fuzzy_equal(deferred.result, solver.eigenvalues)
+
+
+@pytest.mark.skipif(not hasattr(pb._cpp, 'FEAST'), reason="compiled without FEAST")
+def test_feast_parallel_sweep():
+    def refinement_loops(solver):
+        return int(re.search(r"Refinement\((\d+)\|", solver.report(shortform=True)).group(1))
+
+    def make_model(field):
+        return pb.Model(graphene.monolayer(), pb.rectangle(6),
+                        graphene.constant_magnetic_field(field))
+
+    fields = [10, 10.5]
+    sweep = pb.solver.feast_sweep()
+    loops = []
+    for index, field in enumerate(fields):
+        expected = pb.solver.feast(make_model(field), (-0.1, 0.1), 18)
+        solver = pb.solver.feast(make_model(field), (-0.1, 0.1), 18, num_threads=4,
+                                 sweep=sweep, sweep_index=index)
+        assert pytest.fuzzy_equal(np.sort(solver.eigenvalues), np.sort(expected.eigenvalues))
+        loops.append(refinement_loops(solver))
+        assert loops[-1] >= 1
+    assert sweep.size == 2
+    # the second point starts from the subspace of the first one
+    assert loops[1] <= loops[0]
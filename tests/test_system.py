@@ -1,5 +1,7 @@
 import pytest
 
+import numpy as np
+
 import pybinding as pb
 from pybinding.repository import graphene
 
@@ -43,6 +45,19 @@ def test_api():
     assert "read-only" in str(excinfo.value)
 
 
+def test_find_nearest_batch():
+    model = pb.Model(graphene.monolayer(), pb.circle(1.2))
+    system = model.system
+
+    targets = np.column_stack([np.linspace(-1.5, 1.5, 20), np.linspace(1, -1, 20)])
+    expected = [system.find_nearest(t, 'A') for t in targets]
+    assert np.all(system.find_nearest(targets, 'A', num_threads=2) == expected)
+
+    within = system.find_within([0, 0], 0.3)
+    distance = np.linalg.norm(system.xyz, axis=1)
+    assert np.all(within == np.flatnonzero(distance <= 0.3))
+
+
 def test_sites():
     model = pb.Model(graphene.monolayer(), pb.primitive(2, 2))
     system = model.system
@@ -54,6 +69,32 @@ def test_sites():
     assert sites.find_nearest([0, 0], 'A') != sites.find_nearest([0, 0], 'B')
 
 
+@pytest.mark.parametrize("order", ["unit_cell", "rcm", "morton"])
+def test_site_order(order):
+    model = pb.Model(graphene.monolayer(), pb.rectangle(2))
+    reordered = pb.Model(graphene.monolayer(), pb.rectangle(2))
+    reordered.set_site_order(order)
+
+    assert len(model.system.original_indices) == 0
+    idx = reordered.system.original_indices
+    assert sorted(idx) == list(range(model.system.num_sites))
+    assert pytest.fuzzy_equal(reordered.system.xyz, model.system.xyz[idx])
+
+    h = model.hamiltonian.toarray()
+    assert pytest.fuzzy_equal(reordered.hamiltonian.toarray(), h[np.ix_(idx, idx)])
+
+
+def test_compact_positions():
+    model = pb.Model(graphene.monolayer(), pb.rectangle(2),
+                     pb.translational_symmetry(a1=True, a2=False))
+    compact = pb.Model(graphene.monolayer(), pb.rectangle(2),
+                       pb.translational_symmetry(a1=True, a2=False))
+    compact.set_compact_positions(True)
+
+    assert pytest.fuzzy_equal(compact.system.xyz, model.system.xyz)
+    assert pytest.fuzzy_equal(compact.hamiltonian.toarray(), model.hamiltonian.toarray())
+
+
 def test_pickle_round_trip(model, tmpdir):
     file_name = str(tmpdir.join('file.npz'))
     pb.save(model.system, file_name)